@@ -13,26 +13,76 @@ SET CC_OBJS=^
 REM .obj files to be compiled from .cpp source files
 SET CPP_OBJS=^
  hookdll/hookdll.obj^
+ relay/dplite-relay.obj^
+ relay/RelayPacket.obj^
+ relay/RelayServer.obj^
+ relay/RelaySocket.obj^
  src/AsyncHandleAllocator.obj^
+ src/BufferPool.obj^
+ src/CaptureTransport.obj^
+ src/Clock.obj^
  src/COMAPIException.obj^
+ src/CongestionController.obj^
+ src/ConnectionStats.obj^
  src/DirectPlay8Address.obj^
+ src/DirectPlay8Client.obj^
  src/DirectPlay8Peer.obj^
+ src/DirectPlay8Server.obj^
+ src/DirectPlay8ThreadPool.obj^
  src/dpnet.obj^
  src/EventObject.obj^
  src/HandleHandlingPool.obj^
+ src/HandlerProfiler.obj^
  src/HostEnumerator.obj^
+ src/HostEnumScheduler.obj^
+ src/ImpairedTransport.obj^
  src/Log.obj^
+ src/LogFormat.obj^
+ src/LoopbackTransport.obj^
  src/network.obj^
  src/packet.obj^
+ src/ProfiledMutex.obj^
+ src/RelayTransport.obj^
+ src/ReplayTransport.obj^
  src/SendQueue.obj^
+ src/SharedListener.obj^
+ src/TokenBucket.obj^
+ src/Trace.obj^
+ src/Transport.obj^
+ src/WorkQueue.obj^
+ tests/BufferPool.obj^
+ tests/CaptureTransport.obj^
+ tests/Clock.obj^
+ tests/CongestionController.obj^
+ tests/ConnectionStats.obj^
  tests/DirectPlay8Address.obj^
+ tests/DirectPlay8ClientServer.obj^
  tests/DirectPlay8Peer.obj^
+ tests/DirectPlay8ThreadPool.obj^
  tests/HandleHandlingPool.obj^
+ tests/HandlerProfiler.obj^
+ tests/ImpairedTransport.obj^
+ tests/LogFormat.obj^
+ tests/LoopbackTransport.obj^
  tests/PacketDeserialiser.obj^
  tests/PacketSerialiser.obj^
+ tests/ProfiledMutex.obj^
+ tests/RelayTransport.obj^
  tests/SendQueue.obj^
+ tests/TestHelpers.obj^
+ tests/TokenBucket.obj^
+ tests/Trace.obj^
+ tests/WorkQueue.obj^
+ tests/bench-impairment.obj^
+ tests/bench-mesh-join.obj^
+ tests/bench-relay.obj^
+ tests/bench-session-start.obj^
+ tests/bench-socket-profile.obj^
+ tests/bench-work-queue.obj^
+ tests/replay-capture.obj^
  tests/soak-peer-client.obj^
- tests/soak-peer-server.obj
+ tests/soak-peer-server.obj^
+ tools/dplite-logdecode.obj
 
 REM .obj files to be compiled from .c source files
 SET C_OBJS=^
@@ -46,23 +96,64 @@ REM .obj files which will be linked into all-tests.exe
 SET TEST_OBJS=^
  googletest/src/gtest-all.obj^
  googletest/src/gtest_main.obj^
+ relay/RelayPacket.obj^
+ relay/RelayServer.obj^
+ relay/RelaySocket.obj^
  src/AsyncHandleAllocator.obj^
+ src/BufferPool.obj^
+ src/CaptureTransport.obj^
+ src/Clock.obj^
  src/COMAPIException.obj^
+ src/CongestionController.obj^
+ src/ConnectionStats.obj^
  src/DirectPlay8Address.obj^
+ src/DirectPlay8Client.obj^
  src/DirectPlay8Peer.obj^
+ src/DirectPlay8Server.obj^
+ src/DirectPlay8ThreadPool.obj^
  src/EventObject.obj^
  src/HandleHandlingPool.obj^
+ src/HandlerProfiler.obj^
  src/HostEnumerator.obj^
+ src/HostEnumScheduler.obj^
+ src/ImpairedTransport.obj^
  src/Log.obj^
+ src/LogFormat.obj^
+ src/LoopbackTransport.obj^
  src/network.obj^
  src/packet.obj^
+ src/ProfiledMutex.obj^
+ src/RelayTransport.obj^
+ src/ReplayTransport.obj^
  src/SendQueue.obj^
+ src/SharedListener.obj^
+ src/TokenBucket.obj^
+ src/Trace.obj^
+ src/Transport.obj^
+ src/WorkQueue.obj^
+ tests/BufferPool.obj^
+ tests/CaptureTransport.obj^
+ tests/Clock.obj^
+ tests/CongestionController.obj^
+ tests/ConnectionStats.obj^
  tests/DirectPlay8Address.obj^
+ tests/DirectPlay8ClientServer.obj^
  tests/DirectPlay8Peer.obj^
+ tests/DirectPlay8ThreadPool.obj^
  tests/HandleHandlingPool.obj^
+ tests/HandlerProfiler.obj^
+ tests/ImpairedTransport.obj^
+ tests/LogFormat.obj^
+ tests/LoopbackTransport.obj^
  tests/PacketDeserialiser.obj^
  tests/PacketSerialiser.obj^
- tests/SendQueue.obj
+ tests/ProfiledMutex.obj^
+ tests/RelayTransport.obj^
+ tests/SendQueue.obj^
+ tests/TestHelpers.obj^
+ tests/TokenBucket.obj^
+ tests/Trace.obj^
+ tests/WorkQueue.obj
 
 SET TEST_LIBS=ws2_32.lib dxguid.lib ole32.lib iphlpapi.lib
 
@@ -76,35 +167,114 @@ SET HOOK_OBJS=^
  minhook/src/hook.obj^
  minhook/src/trampoline.obj^
  src/AsyncHandleAllocator.obj^
+ src/BufferPool.obj^
+ src/CaptureTransport.obj^
+ src/Clock.obj^
  src/COMAPIException.obj^
+ src/CongestionController.obj^
+ src/ConnectionStats.obj^
  src/DirectPlay8Address.obj^
+ src/DirectPlay8Client.obj^
  src/DirectPlay8Peer.obj^
+ src/DirectPlay8Server.obj^
+ src/DirectPlay8ThreadPool.obj^
  src/EventObject.obj^
  src/HandleHandlingPool.obj^
+ src/HandlerProfiler.obj^
  src/HostEnumerator.obj^
+ src/HostEnumScheduler.obj^
  src/Log.obj^
+ src/LogFormat.obj^
  src/network.obj^
  src/packet.obj^
- src/SendQueue.obj
+ src/ProfiledMutex.obj^
+ src/RelayTransport.obj^
+ src/ReplayTransport.obj^
+ src/SendQueue.obj^
+ src/SharedListener.obj^
+ src/TokenBucket.obj^
+ src/Trace.obj^
+ src/Transport.obj^
+ src/WorkQueue.obj
 
 SET HOOK_LIBS=ws2_32.lib dxguid.lib ole32.lib iphlpapi.lib
 
 SET DPNET_OBJS=^
  src/AsyncHandleAllocator.obj^
+ src/BufferPool.obj^
+ src/CaptureTransport.obj^
+ src/Clock.obj^
  src/COMAPIException.obj^
+ src/CongestionController.obj^
+ src/ConnectionStats.obj^
  src/DirectPlay8Address.obj^
+ src/DirectPlay8Client.obj^
  src/DirectPlay8Peer.obj^
+ src/DirectPlay8Server.obj^
+ src/DirectPlay8ThreadPool.obj^
  src/dpnet.obj^
  src/EventObject.obj^
  src/HandleHandlingPool.obj^
+ src/HandlerProfiler.obj^
  src/HostEnumerator.obj^
+ src/HostEnumScheduler.obj^
  src/Log.obj^
+ src/LogFormat.obj^
  src/network.obj^
  src/packet.obj^
- src/SendQueue.obj
+ src/ProfiledMutex.obj^
+ src/RelayTransport.obj^
+ src/ReplayTransport.obj^
+ src/SendQueue.obj^
+ src/SharedListener.obj^
+ src/TokenBucket.obj^
+ src/Trace.obj^
+ src/Transport.obj^
+ src/WorkQueue.obj
 
 SET DPNET_LIBS=ws2_32.lib dxguid.lib ole32.lib iphlpapi.lib
 
+REM .obj files linked into benchmarks which create DirectPlay8Peer instances directly
+SET PEER_OBJS=^
+ src/AsyncHandleAllocator.obj^
+ src/BufferPool.obj^
+ src/CaptureTransport.obj^
+ src/Clock.obj^
+ src/COMAPIException.obj^
+ src/CongestionController.obj^
+ src/ConnectionStats.obj^
+ src/DirectPlay8Address.obj^
+ src/DirectPlay8Client.obj^
+ src/DirectPlay8Peer.obj^
+ src/DirectPlay8Server.obj^
+ src/DirectPlay8ThreadPool.obj^
+ src/EventObject.obj^
+ src/HandleHandlingPool.obj^
+ src/HandlerProfiler.obj^
+ src/HostEnumerator.obj^
+ src/HostEnumScheduler.obj^
+ src/ImpairedTransport.obj^
+ src/Log.obj^
+ src/LogFormat.obj^
+ src/LoopbackTransport.obj^
+ src/network.obj^
+ src/packet.obj^
+ src/ProfiledMutex.obj^
+ src/RelayTransport.obj^
+ src/ReplayTransport.obj^
+ src/SendQueue.obj^
+ src/SharedListener.obj^
+ src/TokenBucket.obj^
+ src/Trace.obj^
+ src/Transport.obj^
+ src/WorkQueue.obj
+
+REM .obj files shared by the relay server and its benchmark
+SET RELAY_OBJS=^
+ relay/RelayPacket.obj^
+ relay/RelayServer.obj^
+ relay/RelaySocket.obj
+
 SET CFLAGS=^
  /Zi^
  /EHsc^
@@ -159,6 +329,60 @@ echo ==
         link %DEBUG% /out:tests/soak-peer-server.exe tests/soak-peer-server.obj dxguid.lib ole32.lib || exit /b
 echo:
 
+echo ==
+echo == link %DEBUG% /out:tests/bench-work-queue.exe tests/bench-work-queue.obj src/EventObject.obj src/HandleHandlingPool.obj src/Log.obj src/LogFormat.obj src/ProfiledMutex.obj src/WorkQueue.obj
+echo ==
+        link %DEBUG% /out:tests/bench-work-queue.exe tests/bench-work-queue.obj src/EventObject.obj src/HandleHandlingPool.obj src/Log.obj src/LogFormat.obj src/ProfiledMutex.obj src/WorkQueue.obj || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/bench-impairment.exe tests/bench-impairment.obj %PEER_OBJS% %DPNET_LIBS% winmm.lib
+echo ==
+        link %DEBUG% /out:tests/bench-impairment.exe tests/bench-impairment.obj %PEER_OBJS% %DPNET_LIBS% winmm.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/bench-mesh-join.exe tests/bench-mesh-join.obj dxguid.lib ole32.lib
+echo ==
+        link %DEBUG% /out:tests/bench-mesh-join.exe tests/bench-mesh-join.obj dxguid.lib ole32.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/bench-relay.exe tests/bench-relay.obj %PEER_OBJS% %RELAY_OBJS% %DPNET_LIBS% winmm.lib
+echo ==
+        link %DEBUG% /out:tests/bench-relay.exe tests/bench-relay.obj %PEER_OBJS% %RELAY_OBJS% %DPNET_LIBS% winmm.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/bench-session-start.exe tests/bench-session-start.obj dxguid.lib ole32.lib
+echo ==
+        link %DEBUG% /out:tests/bench-session-start.exe tests/bench-session-start.obj dxguid.lib ole32.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/bench-socket-profile.exe tests/bench-socket-profile.obj dxguid.lib ole32.lib
+echo ==
+        link %DEBUG% /out:tests/bench-socket-profile.exe tests/bench-socket-profile.obj dxguid.lib ole32.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tests/replay-capture.exe tests/replay-capture.obj %PEER_OBJS% %DPNET_LIBS% winmm.lib
+echo ==
+        link %DEBUG% /out:tests/replay-capture.exe tests/replay-capture.obj %PEER_OBJS% %DPNET_LIBS% winmm.lib || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:tools/dplite-logdecode.exe tools/dplite-logdecode.obj src/LogFormat.obj
+echo ==
+        link %DEBUG% /out:tools/dplite-logdecode.exe tools/dplite-logdecode.obj src/LogFormat.obj || exit /b
+echo:
+
+echo ==
+echo == link %DEBUG% /out:relay/dplite-relay.exe relay/dplite-relay.obj %RELAY_OBJS% ws2_32.lib
+echo ==
+        link %DEBUG% /out:relay/dplite-relay.exe relay/dplite-relay.obj %RELAY_OBJS% ws2_32.lib || exit /b
+echo:
+
 FOR %%o IN (%HOOK_DLLS%) DO (
 	echo ==
 	echo == ml /c /Cx /coff /Fo hookdll/%%o.obj hookdll/%%o.asm
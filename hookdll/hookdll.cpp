@@ -77,6 +77,11 @@ extern "C" BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvRe
 		
 		log_fini();
 	}
+	else if(fdwReason == DLL_PROCESS_DETACH)
+	{
+		/* The process is exiting, write out anything still sitting in the log buffers. */
+		log_fini();
+	}
 	
 	return TRUE;
 }
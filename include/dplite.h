@@ -0,0 +1,163 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_DPLITE_H
+#define DPLITE_DPLITE_H
+
+/* DirectPlay Lite specific extensions to the DirectPlay 8 API.
+ *
+ * Applications written against the official DirectPlay never see any of this and
+ * get the normal behaviour, these are only for applications (and tests) which know
+ * they are running on DirectPlay Lite.
+*/
+
+#include <dplay8.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/* Extended version of DPN_CAPS_EX, accepted by GetCaps() and SetCaps() when dwSize is
+ * sizeof(DPLITE_CAPS).
+ *
+ * The send rate limits are applied by pacing messages out of the send queue. While a
+ * player's queue is backed up, new non-guaranteed messages are dropped rather than
+ * queued once the backlog exceeds dwDropThresholdRate percent (low priority) or
+ * dwThrottleRate percent (normal priority) of what may be sent in one second. High
+ * priority and guaranteed messages are never dropped.
+ *
+ * dwSocketProfile selects one of the DPLITE_SOCKET_PROFILE_* option sets below for the
+ * sockets used by the session. The socket buffer sizes can be overridden by setting
+ * dwSystemBufferSize using SetSPCaps(). GetSPCaps() reports the send buffer size in use, or
+ * 8192 if neither the profile nor SetSPCaps() has set one.
+ *
+ * Host enumerations are answered from a cached copy of the session description, and at most
+ * dwMaxEnumResponseRate of them (50 by default) are answered per second for any one source
+ * address, so a host being hammered by server browsers doesn't spend all its time on them.
+ *
+ * Setting dwCongestionControl to a non-zero value paces sends to each player at a rate found
+ * by a delay-based congestion controller (and no faster than dwMaxPlayerSendRate). It backs
+ * off as soon as the round trip time to a player starts rising, so bulk transfers don't fill
+ * the buffers of a slow link, at the cost of pinging players we are sending to ten times a
+ * second. It is disabled by default.
+*/
+typedef struct _DPLITE_CAPS {
+  DWORD   dwSize;
+  DWORD   dwFlags;
+  DWORD   dwConnectTimeout;
+  DWORD   dwConnectRetries;
+  DWORD   dwTimeoutUntilKeepAlive;
+  DWORD   dwMaxRecvMsgSize;
+  DWORD   dwNumSendRetries;
+  DWORD   dwMaxSendRetryInterval;
+  DWORD   dwDropThresholdRate;
+  DWORD   dwThrottleRate;
+  DWORD   dwNumHardDisconnectSends;
+  DWORD   dwMaxHardDisconnectPeriod;
+  DWORD   dwMaxSendRate;          /* Bytes per second to all players combined, 0 for no limit. */
+  DWORD   dwMaxPlayerSendRate;    /* Bytes per second to any one player, 0 for no limit. */
+  DWORD   dwSocketProfile;        /* One of DPLITE_SOCKET_PROFILE_*. */
+  DWORD   dwEnumFlags;            /* DPLITE_ENUM_* flags. */
+  DWORD   dwMaxEnumResponseRate;  /* Enumeration responses per second to any one address, 0 for no limit. */
+  DWORD   dwHandlerWarnTime;      /* Milliseconds, see DPLITE_HANDLER_STATS. 0 to disable. */
+  DWORD   dwCongestionControl;    /* Non-zero to enable congestion control. */
+} DPLITE_CAPS, *PDPLITE_CAPS;
+
+/* Answer host enumerations from the session description alone, without raising
+ * DPN_MSGID_ENUM_HOSTS_QUERY. Saves a round trip through the application for every probe
+ * on busy hosts which don't use enumeration data.
+*/
+#define DPLITE_ENUM_NOQUERY 0x00000001
+
+/* Host() flag: share the listener and UDP socket with any other sessions hosted on the same
+ * address and port with this flag in the same process. Connections are passed to the session
+ * named by the instance GUID in the client's connect request (or the first session of the
+ * requested application, if the client doesn't name an instance) and every session answers
+ * enumerations for its own application. A port must be specified.
+*/
+#define DPLITE_HOST_SHAREDPORT 0x00010000
+
+/* Leave everything at the system defaults. */
+#define DPLITE_SOCKET_PROFILE_DEFAULT         0
+
+/* Disable Nagle's algorithm, mark packets for expedited forwarding (IP_TOS 0xB8) and keep
+ * the send buffer small so messages don't sit queued in the kernel.
+*/
+#define DPLITE_SOCKET_PROFILE_LOW_LATENCY     1
+
+/* Large socket buffers for bulk transfers, Nagle's algorithm left enabled. Packets are
+ * marked with IP_TOS 0x08 (IPTOS_THROUGHPUT).
+*/
+#define DPLITE_SOCKET_PROFILE_HIGH_THROUGHPUT 2
+
+/* Disable Nagle's algorithm with moderately large buffers, for fast local networks. */
+#define DPLITE_SOCKET_PROFILE_LAN             3
+
+/* Time spent in the application's message handler, returned by GetCaps() when dwSize is
+ * sizeof(DPLITE_HANDLER_STATS).
+ *
+ * Every call to the message handler is timed, since a handler which takes too long holds up
+ * the worker thread it was called from and, for DPN_MSGID_RECEIVE, everything else coming
+ * from the same player. Set dwMessageType to the DPN_MSGID_* value to get the statistics
+ * for, or to 0 for the totals of all message types, in which case it is set to the type of
+ * the slowest call on return. Passing DPLITE_HANDLER_STATS_RESET to GetCaps() clears the
+ * statistics once they have been read.
+ *
+ * Calls which take longer than DPLITE_CAPS.dwHandlerWarnTime are counted in dwSlowCount and
+ * logged. The statistics are also written to the log by Close().
+ *
+ * Times are in microseconds. dwHistogram[0] counts calls under 1us, dwHistogram[N] counts
+ * calls of [2^(N-1), 2^N) us and the last bucket counts anything longer.
+*/
+#define DPLITE_HANDLER_HISTOGRAM_BUCKETS 24
+
+typedef struct _DPLITE_HANDLER_STATS {
+  DWORD     dwSize;
+  DWORD     dwMessageType;
+  DWORD     dwCount;          /* Calls to the handler. */
+  DWORD     dwSlowCount;      /* Calls which took longer than dwHandlerWarnTime. */
+  ULONGLONG qwTotalTime;      /* Time spent in all calls. */
+  DWORD     dwMaxTime;        /* Longest single call. */
+  DPNID     dpnidMaxPlayer;   /* Player the longest call was for, 0 if none. */
+  DWORD     dwHistogram[DPLITE_HANDLER_HISTOGRAM_BUCKETS];
+} DPLITE_HANDLER_STATS, *PDPLITE_HANDLER_STATS;
+
+#define DPLITE_HANDLER_STATS_RESET 0x00000001
+
+/* Send latency for a single player, returned by GetConnectionInfo() when dwSize is
+ * sizeof(DPLITE_CONNECTION_LATENCY).
+ *
+ * dwQueueHistogram counts how long messages to the player waited in our send queue before
+ * the first byte was written, and dwWireHistogram how long it then took to get the rest of
+ * each message into the socket. Only messages which were sent successfully are counted.
+ *
+ * Buckets are the same as DPLITE_HANDLER_STATS.dwHistogram.
+*/
+#define DPLITE_LATENCY_HISTOGRAM_BUCKETS 24
+
+typedef struct _DPLITE_CONNECTION_LATENCY {
+  DWORD     dwSize;
+  DWORD     dwQueueHistogram[DPLITE_LATENCY_HISTOGRAM_BUCKETS];
+  DWORD     dwWireHistogram[DPLITE_LATENCY_HISTOGRAM_BUCKETS];
+} DPLITE_CONNECTION_LATENCY, *PDPLITE_CONNECTION_LATENCY;
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif /* !DPLITE_DPLITE_H */
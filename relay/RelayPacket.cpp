@@ -0,0 +1,223 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#include "RelayPacket.hpp"
+
+/* Fields are read and written with memcpy() rather than by casting to a header struct since
+ * nothing in a relay packet is guaranteed to be aligned once it has been copied about.
+*/
+
+static uint32_t read_u32(const unsigned char *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	
+	return value;
+}
+
+static void write_u32(unsigned char *p, uint32_t value)
+{
+	memcpy(p, &value, sizeof(value));
+}
+
+bool RelayGUID::operator<(const RelayGUID &rhs) const
+{
+	return memcmp(bytes, rhs.bytes, sizeof(bytes)) < 0;
+}
+
+bool RelayGUID::operator==(const RelayGUID &rhs) const
+{
+	return memcmp(bytes, rhs.bytes, sizeof(bytes)) == 0;
+}
+
+RelayPacketWriter::RelayPacketWriter(uint32_t type)
+{
+	sbuf.reserve(256);
+	sbuf.resize(RELAY_TLV_HEADER_SIZE);
+	
+	write_u32(sbuf.data(), type);
+	write_u32(sbuf.data() + 4, 0);
+}
+
+std::pair<const void*, size_t> RelayPacketWriter::raw_packet() const
+{
+	return std::make_pair((const void*)(sbuf.data()), sbuf.size());
+}
+
+std::shared_ptr< std::vector<unsigned char> > RelayPacketWriter::release()
+{
+	std::shared_ptr< std::vector<unsigned char> > packet(new std::vector<unsigned char>());
+	packet->swap(sbuf);
+	
+	return packet;
+}
+
+void RelayPacketWriter::append_field(uint32_t type, const void *value, size_t value_length)
+{
+	size_t at = sbuf.size();
+	sbuf.resize(at + RELAY_TLV_HEADER_SIZE + value_length);
+	
+	write_u32(sbuf.data() + at,     type);
+	write_u32(sbuf.data() + at + 4, value_length);
+	
+	if(value_length > 0)
+	{
+		memcpy(sbuf.data() + at + RELAY_TLV_HEADER_SIZE, value, value_length);
+	}
+	
+	write_u32(sbuf.data() + 4, (sbuf.size() - RELAY_TLV_HEADER_SIZE));
+}
+
+void RelayPacketWriter::append_null()
+{
+	append_field(RELAY_FIELD_TYPE_NULL, NULL, 0);
+}
+
+void RelayPacketWriter::append_dword(uint32_t value)
+{
+	append_field(RELAY_FIELD_TYPE_DWORD, &value, sizeof(value));
+}
+
+void RelayPacketWriter::append_data(const void *data, size_t size)
+{
+	append_field(RELAY_FIELD_TYPE_DATA, data, size);
+}
+
+void RelayPacketWriter::append_guid(const RelayGUID &guid)
+{
+	append_field(RELAY_FIELD_TYPE_GUID, guid.bytes, sizeof(guid.bytes));
+}
+
+RelayPacketReader::RelayPacketReader(const void *serialised_packet, size_t packet_size)
+{
+	const unsigned char *packet = (const unsigned char*)(serialised_packet);
+	
+	if(RelayPacketReader::packet_size(packet, packet_size) == 0
+		|| packet_size < RelayPacketReader::packet_size(packet, packet_size))
+	{
+		throw Error("Incomplete packet");
+	}
+	
+	type = read_u32(packet);
+	
+	const unsigned char *at = packet + RELAY_TLV_HEADER_SIZE;
+	size_t value_remain = read_u32(packet + 4);
+	
+	while(value_remain > 0)
+	{
+		if(value_remain < RELAY_TLV_HEADER_SIZE || value_remain < RELAY_TLV_HEADER_SIZE + read_u32(at + 4))
+		{
+			throw Error("Malformed packet");
+		}
+		
+		Field field;
+		field.type         = read_u32(at);
+		field.value        = at + RELAY_TLV_HEADER_SIZE;
+		field.value_length = read_u32(at + 4);
+		
+		fields.push_back(field);
+		
+		at           += RELAY_TLV_HEADER_SIZE + field.value_length;
+		value_remain -= RELAY_TLV_HEADER_SIZE + field.value_length;
+	}
+}
+
+size_t RelayPacketReader::packet_size(const void *data, size_t size)
+{
+	if(size < RELAY_TLV_HEADER_SIZE)
+	{
+		return 0;
+	}
+	
+	return RELAY_TLV_HEADER_SIZE + (size_t)(read_u32((const unsigned char*)(data) + 4));
+}
+
+uint32_t RelayPacketReader::packet_type() const
+{
+	return type;
+}
+
+size_t RelayPacketReader::num_fields() const
+{
+	return fields.size();
+}
+
+const RelayPacketReader::Field &RelayPacketReader::get_field(size_t index, uint32_t type) const
+{
+	if(fields.size() <= index)
+	{
+		throw Error("Missing field in packet");
+	}
+	
+	if(fields[index].type != type)
+	{
+		throw Error("Incorrect field type in packet");
+	}
+	
+	return fields[index];
+}
+
+bool RelayPacketReader::is_null(size_t index) const
+{
+	if(fields.size() <= index)
+	{
+		throw Error("Missing field in packet");
+	}
+	
+	return fields[index].type == RELAY_FIELD_TYPE_NULL;
+}
+
+uint32_t RelayPacketReader::get_dword(size_t index) const
+{
+	const Field &field = get_field(index, RELAY_FIELD_TYPE_DWORD);
+	
+	if(field.value_length != sizeof(uint32_t))
+	{
+		throw Error("Malformed packet");
+	}
+	
+	return read_u32(field.value);
+}
+
+std::pair<const void*, size_t> RelayPacketReader::get_data(size_t index) const
+{
+	const Field &field = get_field(index, RELAY_FIELD_TYPE_DATA);
+	return std::make_pair((const void*)(field.value), field.value_length);
+}
+
+RelayGUID RelayPacketReader::get_guid(size_t index) const
+{
+	const Field &field = get_field(index, RELAY_FIELD_TYPE_GUID);
+	
+	RelayGUID guid;
+	
+	if(field.value_length != sizeof(guid.bytes))
+	{
+		throw Error("Malformed packet");
+	}
+	
+	memcpy(guid.bytes, field.value, sizeof(guid.bytes));
+	
+	return guid;
+}
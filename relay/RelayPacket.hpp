@@ -0,0 +1,113 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_RELAYPACKET_HPP
+#define DPLITE_RELAYPACKET_HPP
+
+#include <memory>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdlib.h>
+#include <utility>
+#include <vector>
+
+/* Cut-down PacketSerialiser and PacketDeserialiser for the relay, which doesn't have
+ * windows.h to lean on when built elsewhere. The wire format is identical, so relay messages
+ * can be built and read by the peer using the real thing.
+ *
+ * Only the field types used by the relay messages are supported.
+*/
+
+#define RELAY_FIELD_TYPE_NULL  0
+#define RELAY_FIELD_TYPE_DWORD 1
+#define RELAY_FIELD_TYPE_DATA  2
+#define RELAY_FIELD_TYPE_GUID  4
+
+/* Size of the type and length header which starts every packet and field. */
+#define RELAY_TLV_HEADER_SIZE 8
+
+/* Instance GUIDs are only ever compared, so they are kept as raw bytes. */
+struct RelayGUID
+{
+	unsigned char bytes[16];
+	
+	bool operator<(const RelayGUID &rhs) const;
+	bool operator==(const RelayGUID &rhs) const;
+};
+
+class RelayPacketWriter
+{
+	private:
+		std::vector<unsigned char> sbuf;
+		
+		void append_field(uint32_t type, const void *value, size_t value_length);
+		
+	public:
+		RelayPacketWriter(uint32_t type);
+		
+		std::pair<const void*, size_t> raw_packet() const;
+		
+		/* Moves the serialised packet out, leaving the writer empty. */
+		std::shared_ptr< std::vector<unsigned char> > release();
+		
+		void append_null();
+		void append_dword(uint32_t value);
+		void append_data(const void *data, size_t size);
+		void append_guid(const RelayGUID &guid);
+};
+
+class RelayPacketReader
+{
+	private:
+		struct Field
+		{
+			uint32_t type;
+			const unsigned char *value;
+			size_t value_length;
+		};
+		
+		uint32_t type;
+		std::vector<Field> fields;
+		
+		const Field &get_field(size_t index, uint32_t type) const;
+		
+	public:
+		class Error: public std::runtime_error
+		{
+			public:
+				Error(const char *what): runtime_error(what) {}
+		};
+		
+		/* The packet must be complete, use packet_size() to find out when it is. */
+		RelayPacketReader(const void *serialised_packet, size_t packet_size);
+		
+		/* Returns the total size of the packet starting at data, or zero if fewer than
+		 * RELAY_TLV_HEADER_SIZE bytes are available.
+		*/
+		static size_t packet_size(const void *data, size_t size);
+		
+		uint32_t packet_type() const;
+		size_t num_fields() const;
+		
+		bool is_null(size_t index) const;
+		uint32_t get_dword(size_t index) const;
+		std::pair<const void*, size_t> get_data(size_t index) const;
+		RelayGUID get_guid(size_t index) const;
+};
+
+#endif /* !DPLITE_RELAYPACKET_HPP */
@@ -0,0 +1,732 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "RelaySocket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdarg.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/Messages.hpp"
+#include "RelayPacket.hpp"
+#include "RelayServer.hpp"
+
+/* dplay8.h isn't available everywhere the relay is built. */
+#define RELAY_DPNERR_ALREADYCONNECTED ((uint32_t)(0x80158060))
+#define RELAY_DPNERR_INVALIDPASSWORD   ((uint32_t)(0x80158410))
+#define RELAY_DPNERR_INVALIDPLAYER     ((uint32_t)(0x80158420))
+#define RELAY_DPNERR_NOTALLOWED        ((uint32_t)(0x80158520))
+
+/* How long poll() may block before checking whether stop() has been called. */
+#define POLL_TIMEOUT_MS 100
+
+/* Initial size of each client's receive buffer, grown as needed to fit larger packets. */
+#define RECV_BUF_SIZE (64 * 1024)
+
+static uint64_t now_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RelayServer::RelayServer(uint32_t ipaddr, uint16_t port, bool verbose):
+	verbose(verbose),
+	stopping(false),
+	n_clients(0),
+	n_sessions(0),
+	packets_in(0),
+	packets_out(0),
+	bytes_in(0),
+	bytes_out(0)
+{
+	listener = relay_listen(ipaddr, port);
+	if(listener == RELAY_INVALID_SOCKET)
+	{
+		throw std::runtime_error("Cannot create listener socket");
+	}
+	
+	struct sockaddr_in addr;
+	relay_socklen_t addrlen = sizeof(addr);
+	
+	if(getsockname(listener, (struct sockaddr*)(&addr), &addrlen) != 0)
+	{
+		relay_close(listener);
+		throw std::runtime_error("Cannot get listener address");
+	}
+	
+	this->port = ntohs(addr.sin_port);
+}
+
+RelayServer::~RelayServer()
+{
+	for(auto c = clients.begin(); c != clients.end(); ++c)
+	{
+		relay_close((*c)->sock);
+		delete *c;
+	}
+	
+	for(auto s = sessions.begin(); s != sessions.end(); ++s)
+	{
+		delete s->second;
+	}
+	
+	relay_close(listener);
+}
+
+uint16_t RelayServer::get_port() const
+{
+	return port;
+}
+
+void RelayServer::stop()
+{
+	stopping = true;
+}
+
+RelayServer::Stats RelayServer::get_stats() const
+{
+	Stats stats;
+	
+	stats.clients     = n_clients;
+	stats.sessions    = n_sessions;
+	stats.packets_in  = packets_in;
+	stats.packets_out = packets_out;
+	stats.bytes_in    = bytes_in;
+	stats.bytes_out   = bytes_out;
+	
+	return stats;
+}
+
+void RelayServer::run()
+{
+	std::vector<struct pollfd> pfds;
+	
+	while(!stopping)
+	{
+		pfds.resize(clients.size() + 1);
+		
+		pfds[0].fd      = listener;
+		pfds[0].events  = POLLIN;
+		pfds[0].revents = 0;
+		
+		for(size_t i = 0; i < clients.size(); ++i)
+		{
+			Client *c = clients[i];
+			
+			pfds[i + 1].fd      = c->sock;
+			pfds[i + 1].events  = 0;
+			pfds[i + 1].revents = 0;
+			
+			/* Stop reading while anybody in the session is backed up, see above. */
+			if(!c->closing && (c->session == NULL || c->session->backlogged == 0))
+			{
+				pfds[i + 1].events |= POLLIN;
+			}
+			
+			if(!c->send_queue.empty())
+			{
+				pfds[i + 1].events |= POLLOUT;
+			}
+		}
+		
+		int r = relay_poll(pfds.data(), pfds.size(), POLL_TIMEOUT_MS);
+		if(r < 0)
+		{
+			int err = relay_last_error();
+			
+			#ifndef _WIN32
+			if(err == EINTR)
+			{
+				continue;
+			}
+			#endif
+			
+			log("poll() failed (error %d)", err);
+			break;
+		}
+		
+		/* Only the clients which were polled, any accepted below go around next time. */
+		size_t n_polled = clients.size();
+		
+		for(size_t i = 0; i < n_polled; ++i)
+		{
+			Client *c = clients[i];
+			
+			if(!c->dead && (pfds[i + 1].revents & (POLLIN | POLLERR | POLLHUP)))
+			{
+				client_recv(c);
+			}
+		}
+		
+		/* Try to send everything queued by the reads above straight away rather than
+		 * waiting to go around the loop again, most of it will fit in the socket buffer.
+		*/
+		
+		uint64_t now = now_ms();
+		
+		for(size_t i = 0; i < n_polled; ++i)
+		{
+			Client *c = clients[i];
+			
+			if(!c->dead && !c->send_queue.empty())
+			{
+				client_flush(c);
+			}
+			
+			if(!c->dead && c->backlogged && (now - c->backlogged_since) >= STALL_TIMEOUT_MS)
+			{
+				log("Player %u isn't reading fast enough, disconnecting", (unsigned)(c->player_id));
+				client_drop(c);
+			}
+			
+			if(!c->dead && c->join_pending && (now - c->join_since) >= JOIN_TIMEOUT_MS)
+			{
+				log("Player %u wasn't admitted to session, refusing join", (unsigned)(c->join_player_id));
+				join_fail(c, RELAY_DPNERR_INVALIDPASSWORD);
+			}
+		}
+		
+		if(pfds[0].revents & POLLIN)
+		{
+			accept_clients();
+		}
+		
+		/* Reap anything which died during this pass. */
+		
+		for(auto c = clients.begin(); c != clients.end();)
+		{
+			if((*c)->dead)
+			{
+				relay_close((*c)->sock);
+				delete *c;
+				
+				c = clients.erase(c);
+				--n_clients;
+			}
+			else{
+				++c;
+			}
+		}
+	}
+}
+
+void RelayServer::accept_clients()
+{
+	while(true)
+	{
+		struct sockaddr_in addr;
+		relay_socklen_t addrlen = sizeof(addr);
+		
+		relay_socket_t newfd = accept(listener, (struct sockaddr*)(&addr), &addrlen);
+		if(newfd == RELAY_INVALID_SOCKET)
+		{
+			return;
+		}
+		
+		if(!relay_set_nonblocking(newfd))
+		{
+			relay_close(newfd);
+			continue;
+		}
+		
+		/* Everything we forward is latency sensitive and already a whole message. */
+		relay_set_nodelay(newfd);
+		
+		Client *c = new Client;
+		
+		c->sock = newfd;
+		c->recv_buf.resize(RECV_BUF_SIZE);
+		c->recv_buf_cur     = 0;
+		c->send_queue_bytes = 0;
+		c->send_offset      = 0;
+		c->session          = NULL;
+		c->player_id        = 0;
+		c->join_pending     = false;
+		c->join_player_id   = 0;
+		c->join_since       = 0;
+		c->backlogged       = false;
+		c->backlogged_since = 0;
+		c->closing          = false;
+		c->dead             = false;
+		
+		clients.push_back(c);
+		++n_clients;
+		
+		char s_ip[16];
+		inet_ntop(AF_INET, &(addr.sin_addr), s_ip, sizeof(s_ip));
+		
+		log("Connection from %s:%u", s_ip, (unsigned)(ntohs(addr.sin_port)));
+	}
+}
+
+void RelayServer::client_recv(Client *client)
+{
+	/* Read a bounded amount each time so one busy client can't starve the others. */
+	for(int reads = 0; reads < 16 && !client->dead && !client->closing; ++reads)
+	{
+		if(client->recv_buf_cur == client->recv_buf.size())
+		{
+			client->recv_buf.resize(client->recv_buf.size() * 2);
+		}
+		
+		int r = recv(client->sock, (char*)(client->recv_buf.data() + client->recv_buf_cur), (client->recv_buf.size() - client->recv_buf_cur), 0);
+		if(r == 0)
+		{
+			client_drop(client);
+			return;
+		}
+		else if(r < 0)
+		{
+			if(relay_last_error() != RELAY_EWOULDBLOCK)
+			{
+				client_drop(client);
+			}
+			
+			return;
+		}
+		
+		client->recv_buf_cur += r;
+		
+		size_t at = 0;
+		
+		while(!client->dead)
+		{
+			size_t packet_size = RelayPacketReader::packet_size(client->recv_buf.data() + at, client->recv_buf_cur - at);
+			
+			if(packet_size > RELAY_MAX_PACKET_SIZE)
+			{
+				log("Received over-size packet from player %u, disconnecting", (unsigned)(client->player_id));
+				client_drop(client);
+				return;
+			}
+			
+			if(packet_size == 0 || packet_size > (client->recv_buf_cur - at))
+			{
+				if(packet_size > client->recv_buf.size())
+				{
+					client->recv_buf.resize(packet_size);
+				}
+				
+				break;
+			}
+			
+			handle_packet(client, client->recv_buf.data() + at, packet_size);
+			at += packet_size;
+		}
+		
+		if(at > 0 && !client->dead)
+		{
+			memmove(client->recv_buf.data(), client->recv_buf.data() + at, client->recv_buf_cur - at);
+			client->recv_buf_cur -= at;
+		}
+	}
+}
+
+void RelayServer::client_flush(Client *client)
+{
+	while(!client->send_queue.empty())
+	{
+		const std::vector<unsigned char> &packet = *(client->send_queue.front());
+		
+		int s = send(client->sock, (const char*)(packet.data() + client->send_offset), (packet.size() - client->send_offset), 0);
+		if(s < 0)
+		{
+			if(relay_last_error() != RELAY_EWOULDBLOCK)
+			{
+				client_drop(client);
+			}
+			
+			break;
+		}
+		
+		client->send_offset += s;
+		
+		if(client->send_offset == packet.size())
+		{
+			client->send_queue_bytes -= packet.size();
+			client->send_offset = 0;
+			client->send_queue.pop_front();
+		}
+	}
+	
+	if(client->backlogged && client->send_queue_bytes <= SOFT_QUEUE_LIMIT)
+	{
+		client->backlogged = false;
+		
+		if(client->session != NULL)
+		{
+			--(client->session->backlogged);
+		}
+	}
+	
+	if(client->closing && client->send_queue.empty())
+	{
+		client_drop(client);
+	}
+}
+
+void RelayServer::client_queue(Client *client, const std::shared_ptr< std::vector<unsigned char> > &packet)
+{
+	if(client->dead)
+	{
+		return;
+	}
+	
+	client->send_queue.push_back(packet);
+	client->send_queue_bytes += packet->size();
+	
+	if(!client->backlogged && client->send_queue_bytes > SOFT_QUEUE_LIMIT)
+	{
+		client->backlogged       = true;
+		client->backlogged_since = now_ms();
+		
+		if(client->session != NULL)
+		{
+			++(client->session->backlogged);
+		}
+	}
+}
+
+/* Detaches a client from its session and marks it to be closed at the end of this pass
+ * of the event loop.
+*/
+void RelayServer::client_drop(Client *client)
+{
+	if(client->dead)
+	{
+		return;
+	}
+	
+	client->dead = true;
+	
+	Session *session = client->session;
+	if(session == NULL)
+	{
+		return;
+	}
+	
+	if(client->backlogged)
+	{
+		--(session->backlogged);
+	}
+	
+	client->session = NULL;
+	session->players.erase(client->player_id);
+	
+	log("Player %u left session", (unsigned)(client->player_id));
+	
+	if(session->players.empty())
+	{
+		sessions.erase(session->instance_guid);
+		delete session;
+		
+		--n_sessions;
+		
+		return;
+	}
+	
+	RelayPacketWriter peer_left(DPLITE_MSGID_RELAY_PEER_LEFT);
+	peer_left.append_dword(client->player_id);
+	
+	std::shared_ptr< std::vector<unsigned char> > packet = peer_left.release();
+	
+	for(auto p = session->players.begin(); p != session->players.end(); ++p)
+	{
+		client_queue(p->second, packet);
+	}
+}
+
+void RelayServer::handle_packet(Client *client, const unsigned char *data, size_t size)
+{
+	try {
+		RelayPacketReader rp(data, size);
+		
+		if(client->session == NULL)
+		{
+			if(rp.packet_type() != DPLITE_MSGID_RELAY_JOIN || client->join_pending)
+			{
+				log("Received message type %u before DPLITE_MSGID_RELAY_JOIN_OK, disconnecting",
+					(unsigned)(rp.packet_type()));
+				
+				client_drop(client);
+				return;
+			}
+			
+			handle_join(client, rp);
+			return;
+		}
+		
+		switch(rp.packet_type())
+		{
+			case DPLITE_MSGID_RELAY_SEND:
+				handle_send(client, rp);
+				break;
+				
+			case DPLITE_MSGID_RELAY_ADMIT:
+				handle_admit(client, rp);
+				break;
+				
+			default:
+				log("Unexpected message type %u received from player %u",
+					(unsigned)(rp.packet_type()), (unsigned)(client->player_id));
+				break;
+		}
+	}
+	catch(const RelayPacketReader::Error &e)
+	{
+		log("Malformed packet received from player %u: %s, disconnecting",
+			(unsigned)(client->player_id), e.what());
+		
+		client_drop(client);
+	}
+}
+
+void RelayServer::handle_join(Client *client, const RelayPacketReader &rp)
+{
+	RelayGUID instance_guid = rp.get_guid(0);
+	uint32_t  player_id     = rp.get_dword(1);
+	RelayGUID token         = rp.get_guid(2);
+	
+	if(player_id == 0)
+	{
+		join_fail(client, RELAY_DPNERR_INVALIDPLAYER);
+		return;
+	}
+	
+	auto si = sessions.find(instance_guid);
+	
+	if(token == RelayGUID())
+	{
+		/* Hosting, which creates the session. */
+		
+		if(si != sessions.end())
+		{
+			log("Player %u tried to host a session which already exists, refusing join",
+				(unsigned)(player_id));
+			
+			join_fail(client, RELAY_DPNERR_NOTALLOWED);
+			return;
+		}
+		
+		Session *session = new Session;
+		session->instance_guid = instance_guid;
+		session->backlogged    = 0;
+		
+		sessions.insert(std::make_pair(instance_guid, session));
+		++n_sessions;
+		
+		join_session(client, session, player_id);
+		return;
+	}
+	
+	/* Held until a peer in the session admits the player with the same token, which the
+	 * host may not have got around to uploading yet.
+	*/
+	
+	client->join_pending   = true;
+	client->join_instance  = instance_guid;
+	client->join_player_id = player_id;
+	client->join_token     = token;
+	client->join_since     = now_ms();
+	
+	join_admitted(client);
+}
+
+void RelayServer::handle_admit(Client *client, const RelayPacketReader &rp)
+{
+	uint32_t  player_id = rp.get_dword(0);
+	RelayGUID token     = rp.get_guid(1);
+	
+	Session *session = client->session;
+	session->admitted[player_id] = token;
+	
+	for(auto c = clients.begin(); c != clients.end(); ++c)
+	{
+		if(!(*c)->dead
+			&& (*c)->join_pending
+			&& (*c)->join_player_id == player_id
+			&& (*c)->join_instance == session->instance_guid)
+		{
+			join_admitted(*c);
+		}
+	}
+}
+
+/* Completes a pending DPLITE_MSGID_RELAY_JOIN if its player has been admitted to the
+ * session with its token, otherwise leaves it waiting.
+*/
+void RelayServer::join_admitted(Client *client)
+{
+	auto si = sessions.find(client->join_instance);
+	if(si == sessions.end())
+	{
+		return;
+	}
+	
+	Session *session = si->second;
+	
+	auto ai = session->admitted.find(client->join_player_id);
+	if(ai == session->admitted.end() || !(ai->second == client->join_token))
+	{
+		return;
+	}
+	
+	session->admitted.erase(ai);
+	
+	client->join_pending = false;
+	
+	if(session->players.find(client->join_player_id) != session->players.end())
+	{
+		log("Player %u is already joined to session, refusing join",
+			(unsigned)(client->join_player_id));
+		
+		join_fail(client, RELAY_DPNERR_ALREADYCONNECTED);
+		return;
+	}
+	
+	join_session(client, session, client->join_player_id);
+}
+
+void RelayServer::join_session(Client *client, Session *session, uint32_t player_id)
+{
+	RelayPacketWriter join_ok(DPLITE_MSGID_RELAY_JOIN_OK);
+	join_ok.append_dword(session->players.size());
+	
+	RelayPacketWriter peer_joined(DPLITE_MSGID_RELAY_PEER_JOINED);
+	peer_joined.append_dword(player_id);
+	
+	std::shared_ptr< std::vector<unsigned char> > peer_joined_packet = peer_joined.release();
+	
+	for(auto p = session->players.begin(); p != session->players.end(); ++p)
+	{
+		join_ok.append_dword(p->first);
+		client_queue(p->second, peer_joined_packet);
+	}
+	
+	client->session   = session;
+	client->player_id = player_id;
+	
+	session->players.insert(std::make_pair(player_id, client));
+	
+	if(client->backlogged)
+	{
+		++(session->backlogged);
+	}
+	
+	client_queue(client, join_ok.release());
+	
+	log("Player %u joined session (%u players)",
+		(unsigned)(player_id), (unsigned)(session->players.size()));
+}
+
+/* Refuses a DPLITE_MSGID_RELAY_JOIN, the connection is closed once the
+ * DPLITE_MSGID_RELAY_JOIN_FAIL has been sent.
+*/
+void RelayServer::join_fail(Client *client, uint32_t error)
+{
+	RelayPacketWriter join_fail(DPLITE_MSGID_RELAY_JOIN_FAIL);
+	join_fail.append_dword(error);
+	
+	client_queue(client, join_fail.release());
+	
+	client->join_pending = false;
+	client->closing      = true;
+}
+
+void RelayServer::handle_send(Client *client, const RelayPacketReader &rp)
+{
+	uint32_t dest_id = rp.get_dword(0);
+	std::pair<const void*, size_t> data = rp.get_data(1);
+	
+	++packets_in;
+	bytes_in += data.second;
+	
+	/* Serialised once, however many players it goes to. */
+	
+	RelayPacketWriter relay_recv(DPLITE_MSGID_RELAY_RECV);
+	relay_recv.append_dword(client->player_id);
+	relay_recv.append_data(data.first, data.second);
+	
+	std::shared_ptr< std::vector<unsigned char> > packet = relay_recv.release();
+	
+	Session *session = client->session;
+	
+	if(dest_id == 0 && rp.num_fields() == 2)
+	{
+		for(auto p = session->players.begin(); p != session->players.end(); ++p)
+		{
+			if(p->second != client)
+			{
+				client_queue(p->second, packet);
+				
+				++packets_out;
+				bytes_out += data.second;
+			}
+		}
+	}
+	else if(dest_id == 0)
+	{
+		for(size_t i = 2; i < rp.num_fields(); ++i)
+		{
+			send_to_player(client, rp.get_dword(i), packet, data.second);
+		}
+	}
+	else{
+		send_to_player(client, dest_id, packet, data.second);
+	}
+}
+
+void RelayServer::send_to_player(Client *client, uint32_t dest_id, const std::shared_ptr< std::vector<unsigned char> > &packet, size_t data_size)
+{
+	Session *session = client->session;
+	
+	auto p = session->players.find(dest_id);
+	if(p != session->players.end() && p->second != client)
+	{
+		client_queue(p->second, packet);
+		
+		++packets_out;
+		bytes_out += data_size;
+	}
+	
+	/* Otherwise the destination has probably just left, and its
+	 * DPLITE_MSGID_RELAY_PEER_LEFT is on its way to the sender.
+	*/
+}
+
+void RelayServer::log(const char *fmt, ...)
+{
+	if(!verbose)
+	{
+		return;
+	}
+	
+	va_list argv;
+	va_start(argv, fmt);
+	
+	vfprintf(stderr, fmt, argv);
+	fputc('\n', stderr);
+	
+	va_end(argv);
+}
@@ -0,0 +1,182 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_RELAYSERVER_HPP
+#define DPLITE_RELAYSERVER_HPP
+
+#include "RelaySocket.hpp"
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "RelayPacket.hpp"
+
+/* Largest DPLITE_MSGID_RELAY_SEND accepted, enough for a MAX_PACKET_SIZE packet plus the
+ * fields wrapped around it.
+*/
+#define RELAY_MAX_PACKET_SIZE (256 * 1024 + 64)
+
+/* Forwards DPLITE_* packets between the peers in each session, for peers which can't (or
+ * would rather not) connect to each other directly. See DPLITE_MSGID_RELAY_JOIN.
+ *
+ * A session is created by its host joining it. Anyone else may only join as a player which
+ * somebody already in the session has admitted with DPLITE_MSGID_RELAY_ADMIT, using the
+ * token they were given, so nobody can claim another player's ID.
+ *
+ * Runs everything from a single thread polling every socket, which is plenty for a few
+ * hundred peers since the relay never looks inside the packets it is forwarding. A packet
+ * sent to more than one peer is serialised once and the same buffer queued to every
+ * recipient.
+ *
+ * When any peer in a session has more than SOFT_QUEUE_LIMIT bytes waiting to be sent to it,
+ * the relay stops reading from the rest of the session so TCP flow control pushes back on
+ * the senders rather than the relay buffering without limit. A peer which stays over the
+ * limit for STALL_TIMEOUT_MS is disconnected so it can't hold up everyone else forever.
+*/
+
+class RelayServer
+{
+	public:
+		static const size_t SOFT_QUEUE_LIMIT = 1024 * 1024;
+		static const unsigned int STALL_TIMEOUT_MS = 5000;
+		
+		/* How long a DPLITE_MSGID_RELAY_JOIN waits for the matching
+		 * DPLITE_MSGID_RELAY_ADMIT before it is refused.
+		*/
+		static const unsigned int JOIN_TIMEOUT_MS = 5000;
+		
+		struct Stats
+		{
+			uint64_t clients;
+			uint64_t sessions;
+			
+			uint64_t packets_in;   /* DPLITE_MSGID_RELAY_SEND messages received. */
+			uint64_t packets_out;  /* DPLITE_MSGID_RELAY_RECV messages queued. */
+			uint64_t bytes_in;
+			uint64_t bytes_out;
+		};
+		
+	private:
+		struct Session;
+		
+		struct Client
+		{
+			relay_socket_t sock;
+			
+			std::vector<unsigned char> recv_buf;
+			size_t recv_buf_cur;
+			
+			std::deque< std::shared_ptr< std::vector<unsigned char> > > send_queue;
+			size_t send_queue_bytes;
+			size_t send_offset;  /* Bytes of send_queue.front() already sent. */
+			
+			Session *session;  /* NULL until DPLITE_MSGID_RELAY_JOIN. */
+			uint32_t player_id;
+			
+			/* Set from a DPLITE_MSGID_RELAY_JOIN waiting to be admitted to its session
+			 * until it is accepted or refused.
+			*/
+			bool join_pending;
+			RelayGUID join_instance;
+			uint32_t join_player_id;
+			RelayGUID join_token;
+			uint64_t join_since;
+			
+			/* Set once the client is over SOFT_QUEUE_LIMIT, to when it went over. */
+			bool backlogged;
+			uint64_t backlogged_since;
+			
+			/* Close once send_queue has been flushed. */
+			bool closing;
+			
+			/* Close at the end of this pass of the event loop. */
+			bool dead;
+		};
+		
+		struct Session
+		{
+			RelayGUID instance_guid;
+			std::map<uint32_t, Client*> players;
+			
+			/* Tokens from DPLITE_MSGID_RELAY_ADMIT not yet used to join, by player ID. */
+			std::map<uint32_t, RelayGUID> admitted;
+			
+			/* Number of players which are backlogged. */
+			unsigned int backlogged;
+		};
+		
+		relay_socket_t listener;
+		uint16_t port;
+		bool verbose;
+		
+		std::vector<Client*> clients;
+		std::map<RelayGUID, Session*> sessions;
+		
+		std::atomic<bool> stopping;
+		
+		std::atomic<uint64_t> n_clients;
+		std::atomic<uint64_t> n_sessions;
+		std::atomic<uint64_t> packets_in;
+		std::atomic<uint64_t> packets_out;
+		std::atomic<uint64_t> bytes_in;
+		std::atomic<uint64_t> bytes_out;
+		
+		/* No copy c'tor. */
+		RelayServer(const RelayServer&) = delete;
+		
+		void accept_clients();
+		void client_recv(Client *client);
+		void client_flush(Client *client);
+		void client_queue(Client *client, const std::shared_ptr< std::vector<unsigned char> > &packet);
+		void client_drop(Client *client);
+		
+		void handle_packet(Client *client, const unsigned char *data, size_t size);
+		void handle_join(Client *client, const RelayPacketReader &rp);
+		void handle_admit(Client *client, const RelayPacketReader &rp);
+		void join_admitted(Client *client);
+		void join_session(Client *client, Session *session, uint32_t player_id);
+		void join_fail(Client *client, uint32_t error);
+		void handle_send(Client *client, const RelayPacketReader &rp);
+		void send_to_player(Client *client, uint32_t dest_id, const std::shared_ptr< std::vector<unsigned char> > &packet, size_t data_size);
+		
+		void log(const char *fmt, ...);
+		
+	public:
+		/* Binds the listener, throws std::runtime_error on failure. ipaddr is in network
+		 * byte order, a port of zero picks any free port.
+		*/
+		RelayServer(uint32_t ipaddr, uint16_t port, bool verbose = false);
+		~RelayServer();
+		
+		uint16_t get_port() const;
+		
+		/* Forwards packets until stop() is called. */
+		void run();
+		
+		/* May be called from any thread, run() returns shortly afterwards. */
+		void stop();
+		
+		/* May be called from any thread. */
+		Stats get_stats() const;
+};
+
+#endif /* !DPLITE_RELAYSERVER_HPP */
@@ -0,0 +1,114 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "RelaySocket.hpp"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+bool relay_sockets_init()
+{
+	#ifdef _WIN32
+	WSADATA wd;
+	return WSAStartup(MAKEWORD(2,2), &wd) == 0;
+	#else
+	/* Writing to a connection the other end has closed should fail, not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+	#endif
+}
+
+bool relay_set_nonblocking(relay_socket_t sock)
+{
+	#ifdef _WIN32
+	u_long non_blocking = 1;
+	return ioctlsocket(sock, FIONBIO, &non_blocking) == 0;
+	#else
+	int flags = fcntl(sock, F_GETFL);
+	return flags != -1 && fcntl(sock, F_SETFL, (flags | O_NONBLOCK)) != -1;
+	#endif
+}
+
+bool relay_set_nodelay(relay_socket_t sock)
+{
+	int nodelay = 1;
+	return setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)(&nodelay), sizeof(nodelay)) == 0;
+}
+
+relay_socket_t relay_listen(uint32_t ipaddr, uint16_t port)
+{
+	relay_socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == RELAY_INVALID_SOCKET)
+	{
+		return RELAY_INVALID_SOCKET;
+	}
+	
+	#ifndef _WIN32
+	/* Let the relay be restarted without waiting for old connections to time out. Windows
+	 * lets anybody steal the port with SO_REUSEADDR, so we don't set it there.
+	*/
+	int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)(&reuse), sizeof(reuse));
+	#endif
+	
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = ipaddr;
+	addr.sin_port        = htons(port);
+	
+	if(bind(sock, (struct sockaddr*)(&addr), sizeof(addr)) != 0
+		|| listen(sock, SOMAXCONN) != 0
+		|| !relay_set_nonblocking(sock))
+	{
+		relay_close(sock);
+		return RELAY_INVALID_SOCKET;
+	}
+	
+	return sock;
+}
+
+relay_socket_t relay_connect(uint32_t ipaddr, uint16_t port)
+{
+	relay_socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock == RELAY_INVALID_SOCKET)
+	{
+		return RELAY_INVALID_SOCKET;
+	}
+	
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = ipaddr;
+	addr.sin_port        = htons(port);
+	
+	if(connect(sock, (struct sockaddr*)(&addr), sizeof(addr)) != 0)
+	{
+		relay_close(sock);
+		return RELAY_INVALID_SOCKET;
+	}
+	
+	relay_set_nodelay(sock);
+	
+	return sock;
+}
@@ -0,0 +1,88 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_RELAYSOCKET_HPP
+#define DPLITE_RELAYSOCKET_HPP
+
+/* The relay server and its benchmark are built on Windows by build.bat like everything
+ * else, but are also meant to run on Linux boxes in the middle of the internet, so they
+ * only use the subset of the sockets API common to both.
+*/
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  /* For WSAPoll() */
+#endif
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+typedef SOCKET relay_socket_t;
+typedef int relay_socklen_t;
+
+#define RELAY_INVALID_SOCKET INVALID_SOCKET
+#define RELAY_EWOULDBLOCK    WSAEWOULDBLOCK
+
+#define relay_poll WSAPoll
+
+static inline int relay_last_error() { return WSAGetLastError(); }
+static inline void relay_close(relay_socket_t sock) { closesocket(sock); }
+
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef int relay_socket_t;
+typedef socklen_t relay_socklen_t;
+
+#define RELAY_INVALID_SOCKET -1
+#define RELAY_EWOULDBLOCK    EWOULDBLOCK
+
+#define relay_poll poll
+
+static inline int relay_last_error() { return errno; }
+static inline void relay_close(relay_socket_t sock) { close(sock); }
+
+#endif
+
+#include <stdint.h>
+
+/* Initialises the sockets API, if the platform needs it. Returns false on failure. */
+bool relay_sockets_init();
+
+bool relay_set_nonblocking(relay_socket_t sock);
+bool relay_set_nodelay(relay_socket_t sock);
+
+/* Creates a listening TCP socket. ipaddr is in network byte order, port in host byte order.
+ * Returns RELAY_INVALID_SOCKET on failure.
+*/
+relay_socket_t relay_listen(uint32_t ipaddr, uint16_t port);
+
+/* Makes a blocking TCP connection, with Nagle's algorithm disabled. Returns
+ * RELAY_INVALID_SOCKET on failure.
+*/
+relay_socket_t relay_connect(uint32_t ipaddr, uint16_t port);
+
+#endif /* !DPLITE_RELAYSOCKET_HPP */
@@ -0,0 +1,111 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Standalone relay server, see RelayServer.hpp.
+ *
+ * Usage: dplite-relay [-a <address>] [-p <port>] [-v]
+*/
+
+#include "RelaySocket.hpp"
+
+#include <chrono>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#include "RelayServer.hpp"
+
+#define DEFAULT_RELAY_PORT 6074
+
+/* Seconds between statistics lines. */
+#define STATS_INTERVAL 60
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-a <address>] [-p <port>] [-v]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t ipaddr  = htonl(INADDR_ANY);
+	uint16_t port    = DEFAULT_RELAY_PORT;
+	bool     verbose = false;
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-a") == 0 && (i + 1) < argc)
+		{
+			if(inet_pton(AF_INET, argv[++i], &ipaddr) != 1)
+			{
+				fprintf(stderr, "Invalid address: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if(strcmp(argv[i], "-p") == 0 && (i + 1) < argc)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "-v") == 0)
+		{
+			verbose = true;
+		}
+		else{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	
+	if(!relay_sockets_init())
+	{
+		fprintf(stderr, "Cannot initialise sockets\n");
+		return 1;
+	}
+	
+	try {
+		RelayServer server(ipaddr, port, verbose);
+		
+		fprintf(stderr, "Relaying on port %u\n", (unsigned)(server.get_port()));
+		
+		std::thread run_thread([&server]() { server.run(); });
+		
+		while(true)
+		{
+			std::this_thread::sleep_for(std::chrono::seconds(STATS_INTERVAL));
+			
+			RelayServer::Stats stats = server.get_stats();
+			
+			fprintf(stderr, "%llu clients, %llu sessions, %llu packets (%llu bytes) in, %llu packets (%llu bytes) out\n",
+				(unsigned long long)(stats.clients),
+				(unsigned long long)(stats.sessions),
+				(unsigned long long)(stats.packets_in),
+				(unsigned long long)(stats.bytes_in),
+				(unsigned long long)(stats.packets_out),
+				(unsigned long long)(stats.bytes_out));
+		}
+	}
+	catch(const std::runtime_error &e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <new>
+#include <windows.h>
+
+#include "BufferPool.hpp"
+
+static_assert(sizeof(size_t) <= 16, "size_t must fit in the buffer header");
+
+BufferPool::BufferPool(size_t min_pooled, size_t max_retained):
+	min_pooled(min_pooled), max_retained(max_retained), retained(0) {}
+
+BufferPool::~BufferPool()
+{
+	for(auto fb = free_buffers.begin(); fb != free_buffers.end(); ++fb)
+	{
+		delete[] (fb->second - HEADER_SIZE);
+	}
+}
+
+unsigned char *BufferPool::get(size_t size)
+{
+	size_t capacity = size;
+	
+	if(size >= min_pooled)
+	{
+		/* Round up to a power of two so returned buffers are likely to fit the next
+		 * request of a similar size.
+		*/
+		capacity = min_pooled;
+		while(capacity < size && capacity <= ((size_t)(-1) / 2))
+		{
+			capacity *= 2;
+		}
+		
+		if(capacity < size)
+		{
+			capacity = size;
+		}
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		auto fb = free_buffers.find(capacity);
+		if(fb != free_buffers.end())
+		{
+			unsigned char *buffer = fb->second;
+			
+			free_buffers.erase(fb);
+			retained -= capacity;
+			
+			return buffer;
+		}
+	}
+	
+	if(capacity > ((size_t)(-1) - HEADER_SIZE))
+	{
+		return NULL;
+	}
+	
+	unsigned char *raw = new(std::nothrow) unsigned char[HEADER_SIZE + capacity];
+	if(raw == NULL)
+	{
+		return NULL;
+	}
+	
+	*(size_t*)(raw) = capacity;
+	
+	return raw + HEADER_SIZE;
+}
+
+void BufferPool::put(unsigned char *buffer)
+{
+	if(buffer == NULL)
+	{
+		return;
+	}
+	
+	size_t capacity = *(size_t*)(buffer - HEADER_SIZE);
+	
+	if(capacity >= min_pooled)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if((retained + capacity) <= max_retained)
+		{
+			free_buffers.insert(std::make_pair(capacity, buffer));
+			retained += capacity;
+			
+			return;
+		}
+	}
+	
+	delete[] (buffer - HEADER_SIZE);
+}
+
+size_t BufferPool::get_retained()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return retained;
+}
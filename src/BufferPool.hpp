@@ -0,0 +1,67 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_BUFFERPOOL_HPP
+#define DPLITE_BUFFERPOOL_HPP
+
+#include <winsock2.h>
+#include <map>
+#include <mutex>
+#include <stddef.h>
+#include <windows.h>
+
+/* Pool of receive buffers handed to the application in DPNMSG_RECEIVE.
+ *
+ * Buffers of at least min_pooled bytes are rounded up to a power of two and kept for reuse
+ * when returned, up to max_retained bytes in total, so repeatedly receiving large messages
+ * doesn't keep going back to the heap. Smaller buffers are simply freed.
+ *
+ * Every buffer remembers its own size, so put() can be given any buffer returned by get()
+ * without the caller keeping track of it. Thread safe.
+*/
+
+class BufferPool
+{
+	private:
+		/* Buffer size is stored in front of the buffer, padded to keep the buffer aligned. */
+		static const size_t HEADER_SIZE = 16;
+		
+		const size_t min_pooled;
+		const size_t max_retained;
+		
+		std::mutex lock;
+		
+		std::multimap<size_t, unsigned char*> free_buffers;
+		size_t retained;
+		
+	public:
+		BufferPool(size_t min_pooled, size_t max_retained);
+		~BufferPool();
+		
+		/* No copy c'tor. */
+		BufferPool(const BufferPool &src) = delete;
+		
+		/* Returns a buffer of at least size bytes, NULL if allocation failed. */
+		unsigned char *get(size_t size);
+		
+		void put(unsigned char *buffer);
+		
+		size_t get_retained();
+};
+
+#endif /* !DPLITE_BUFFERPOOL_HPP */
@@ -0,0 +1,377 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "CaptureTransport.hpp"
+#include "Log.hpp"
+
+/* Size of the stdio buffer in front of the capture file. */
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+CaptureTransport::CaptureTransport(Transport *inner, const std::string &path, Clock *clock):
+	inner(inner),
+	clock(clock)
+{
+	fh = fopen(path.c_str(), "wb");
+	if(fh == NULL)
+	{
+		throw std::runtime_error("Unable to create capture file");
+	}
+	
+	setvbuf(fh, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+	
+	CaptureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = CAPTURE_VERSION;
+	
+	fwrite(&header, sizeof(header), 1, fh);
+	
+	start = clock->now();
+}
+
+CaptureTransport::~CaptureTransport()
+{
+	fclose(fh);
+}
+
+CaptureTransport *CaptureTransport::from_env(Transport *inner, Clock *clock)
+{
+	static std::atomic<unsigned int> instances(0);
+	
+	const char *path = getenv("DPLITE_CAPTURE");
+	if(path == NULL || *path == '\0')
+	{
+		return NULL;
+	}
+	
+	unsigned int instance = ++instances;
+	
+	std::string instance_path = path;
+	if(instance > 1)
+	{
+		instance_path += "." + std::to_string(instance);
+	}
+	
+	try {
+		CaptureTransport *capture = new CaptureTransport(inner, instance_path, clock);
+		log_printf("Capturing to %s", instance_path.c_str());
+		
+		return capture;
+	}
+	catch(const std::runtime_error &e)
+	{
+		log_printf("Unable to create capture file %s", instance_path.c_str());
+		return NULL;
+	}
+}
+
+void CaptureTransport::write_record(CaptureRecordType type, int sock, uint32_t ip, uint16_t port, const void *data, size_t length)
+{
+	CaptureRecord record;
+	memset(&record, 0, sizeof(record));
+	
+	record.time   = clock->now() - start;
+	record.sock   = sock;
+	record.ip     = ip;
+	record.length = length;
+	record.port   = port;
+	record.type   = type;
+	
+	/* Writing the file mustn't disturb the error the caller is about to look at. */
+	int err = WSAGetLastError();
+	
+	std::unique_lock<std::mutex> l(lock);
+	
+	fwrite(&record, sizeof(record), 1, fh);
+	
+	if(length > 0)
+	{
+		fwrite(data, length, 1, fh);
+	}
+	
+	l.unlock();
+	
+	WSASetLastError(err);
+}
+
+void CaptureTransport::write_record(CaptureRecordType type, int sock, const struct sockaddr_in &addr, const void *data, size_t length)
+{
+	write_record(type, sock, addr.sin_addr.s_addr, ntohs(addr.sin_port), data, length);
+}
+
+/* Labels the record with the remote address of a stream socket. */
+void CaptureTransport::write_record(CaptureRecordType type, int sock, const void *data, size_t length)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	auto r = remotes.find(sock);
+	struct sockaddr_in addr;
+	
+	if(r != remotes.end())
+	{
+		addr = r->second;
+	}
+	else{
+		memset(&addr, 0, sizeof(addr));
+	}
+	
+	l.unlock();
+	
+	write_record(type, sock, addr, data, length);
+}
+
+void CaptureTransport::record_session(const PacketSerialiser &session)
+{
+	std::pair<const void*, size_t> raw = session.raw_packet();
+	write_record(CR_SESSION, -1, 0, 0, raw.first, raw.second);
+	
+	std::unique_lock<std::mutex> l(lock);
+	fflush(fh);
+}
+
+int CaptureTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	int sock = inner->create_udp_socket(ipaddr, port, options);
+	if(sock != -1)
+	{
+		write_record(CR_UDP_SOCKET, sock, ipaddr, port);
+	}
+	
+	return sock;
+}
+
+int CaptureTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	int sock = inner->create_listener_socket(ipaddr, port, options);
+	if(sock != -1)
+	{
+		write_record(CR_LISTENER_SOCKET, sock, ipaddr, port);
+	}
+	
+	return sock;
+}
+
+bool CaptureTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	if(!inner->create_auto_port_sockets(ipaddr, udp_sock, listener_sock, port, options))
+	{
+		return false;
+	}
+	
+	write_record(CR_UDP_SOCKET,      *udp_sock,      ipaddr, *port);
+	write_record(CR_LISTENER_SOCKET, *listener_sock, ipaddr, *port);
+	
+	return true;
+}
+
+int CaptureTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	int sock = inner->create_client_socket(local_ipaddr, local_port, options);
+	if(sock != -1)
+	{
+		write_record(CR_CLIENT_SOCKET, sock, local_ipaddr, local_port);
+	}
+	
+	return sock;
+}
+
+int CaptureTransport::create_discovery_socket()
+{
+	int sock = inner->create_discovery_socket();
+	if(sock != -1)
+	{
+		write_record(CR_DISCOVERY_SOCKET, sock, htonl(INADDR_ANY), DISCOVERY_PORT);
+	}
+	
+	return sock;
+}
+
+void CaptureTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	inner->apply_socket_options(sock, stream, options);
+}
+
+bool CaptureTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	return inner->setup_accepted_socket(sock, options);
+}
+
+int CaptureTransport::event_select(int sock, HANDLE event, long events)
+{
+	return inner->event_select(sock, event, events);
+}
+
+int CaptureTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	int newfd = inner->accept(sock, addr);
+	if(newfd != -1)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		remotes[newfd] = *addr;
+		l.unlock();
+		
+		uint32_t listener = sock;
+		write_record(CR_ACCEPT, newfd, *addr, &listener, sizeof(listener));
+	}
+	
+	return newfd;
+}
+
+int CaptureTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	remotes[sock] = *addr;
+	l.unlock();
+	
+	write_record(CR_CONNECT, sock, *addr);
+	
+	return inner->connect(sock, addr);
+}
+
+int CaptureTransport::get_socket_error(int sock, int *error)
+{
+	int r = inner->get_socket_error(sock, error);
+	if(r == 0)
+	{
+		uint32_t e = *error;
+		write_record(CR_CONNECT_RESULT, sock, &e, sizeof(e));
+	}
+	
+	return r;
+}
+
+int CaptureTransport::send(int sock, const void *data, size_t size)
+{
+	int s = inner->send(sock, data, size);
+	if(s > 0)
+	{
+		write_record(CR_SEND, sock, data, s);
+	}
+	
+	return s;
+}
+
+int CaptureTransport::recv(int sock, void *buf, size_t size)
+{
+	int r = inner->recv(sock, buf, size);
+	
+	if(r > 0)
+	{
+		write_record(CR_RECV, sock, buf, r);
+	}
+	else if(r == 0)
+	{
+		write_record(CR_RECV_EOF, sock);
+	}
+	else if(WSAGetLastError() != WSAEWOULDBLOCK)
+	{
+		uint32_t err = WSAGetLastError();
+		write_record(CR_RECV_ERROR, sock, &err, sizeof(err));
+	}
+	
+	return r;
+}
+
+int CaptureTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	int s = inner->sendto(sock, data, size, addr, addrlen);
+	if(s > 0)
+	{
+		write_record(CR_SENDTO, sock, *(const struct sockaddr_in*)(addr), data, s);
+	}
+	
+	return s;
+}
+
+int CaptureTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	int r = inner->recvfrom(sock, buf, size, from_addr);
+	if(r >= 0)
+	{
+		write_record(CR_RECVFROM, sock, *from_addr, buf, r);
+	}
+	
+	return r;
+}
+
+int CaptureTransport::shutdown_send(int sock)
+{
+	return inner->shutdown_send(sock);
+}
+
+void CaptureTransport::close(int sock)
+{
+	write_record(CR_CLOSE, sock);
+	
+	std::unique_lock<std::mutex> l(lock);
+	remotes.erase(sock);
+	l.unlock();
+	
+	inner->close(sock);
+}
+
+bool CaptureTransport::get_host_instance(GUID *instance)
+{
+	return inner->get_host_instance(instance);
+}
+
+void CaptureTransport::session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token)
+{
+	inner->session_joined(instance, player_id, relay_token);
+}
+
+void CaptureTransport::admit_player(DWORD player_id, GUID *relay_token)
+{
+	inner->admit_player(player_id, relay_token);
+}
+
+void CaptureTransport::session_left()
+{
+	inner->session_left();
+}
+
+int CaptureTransport::connect_player(DWORD player_id, const SocketOptions &options)
+{
+	int sock = inner->connect_player(player_id, options);
+	if(sock != -1)
+	{
+		/* Recorded as a connection to nowhere, since it has no address of its own. */
+		
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		
+		std::unique_lock<std::mutex> l(lock);
+		remotes[sock] = addr;
+		l.unlock();
+		
+		write_record(CR_CLIENT_SOCKET, sock, htonl(INADDR_ANY), 0);
+		write_record(CR_CONNECT, sock, addr);
+	}
+	
+	return sock;
+}
@@ -0,0 +1,188 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_CAPTURETRANSPORT_HPP
+#define DPLITE_CAPTURETRANSPORT_HPP
+
+#include <winsock2.h>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <windows.h>
+
+#include "Clock.hpp"
+#include "packet.hpp"
+#include "Transport.hpp"
+
+/* Capture file format.
+ *
+ * A CaptureFileHeader, followed by CaptureRecords, each followed by length bytes of data.
+ * All fields are little endian except ip, which is in network byte order like a sockaddr.
+ *
+ * Sockets are identified by the numbers the transport gave DirectPlay8Peer, which are only
+ * unique while the socket is open.
+*/
+
+#define CAPTURE_MAGIC   "DPLCAP\r\n"
+#define CAPTURE_VERSION 1
+
+struct CaptureFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+enum CaptureRecordType {
+	/* Host() or Connect() was called, data is a PacketSerialiser of type
+	 * CAPTURE_SESSION_HOST or CAPTURE_SESSION_CONNECT. Socket is unused.
+	*/
+	CR_SESSION = 1,
+	
+	/* A socket was created, the address is the local one it was bound to. */
+	CR_UDP_SOCKET,
+	CR_LISTENER_SOCKET,
+	CR_CLIENT_SOCKET,
+	CR_DISCOVERY_SOCKET,
+	
+	/* A connection was accepted, sock is the new socket, the address is the remote one and
+	 * data is the uint32_t listener socket.
+	*/
+	CR_ACCEPT,
+	
+	/* An outgoing connection was started to the address. */
+	CR_CONNECT,
+	
+	/* The result of an outgoing connection was read, data is the uint32_t SO_ERROR value. */
+	CR_CONNECT_RESULT,
+	
+	/* Stream data sent to or received from the remote address of the socket. */
+	CR_SEND,
+	CR_RECV,
+	
+	/* The remote end shut down the connection. */
+	CR_RECV_EOF,
+	
+	/* Reading from the socket failed, data is the uint32_t error code. */
+	CR_RECV_ERROR,
+	
+	/* Datagram sent to or received from the address. */
+	CR_SENDTO,
+	CR_RECVFROM,
+	
+	CR_CLOSE,
+};
+
+struct CaptureRecord
+{
+	uint64_t time;     /* Microseconds since the capture was started. */
+	uint32_t sock;
+	uint32_t ip;       /* Network byte order. */
+	uint32_t length;   /* Bytes of data following the record. */
+	uint16_t port;     /* Host byte order. */
+	uint8_t type;      /* CaptureRecordType */
+	uint8_t reserved;
+};
+
+/* CR_SESSION packet types. Fields:
+ *
+ * 0  DWORD    Role (DirectPlay8Peer::Role)
+ * 1  GUID     Application
+ * 2  GUID     Instance
+ * 3  DWORD    DPN_APPLICATION_DESC dwFlags
+ * 4  DWORD    Maximum players
+ * 5  WSTRING  Session name
+ * 6  WSTRING  Password
+ * 7  DWORD    Port hosted on, or connected to
+ * 8  DATA     Connect() user data
+*/
+#define CAPTURE_SESSION_HOST    1
+#define CAPTURE_SESSION_CONNECT 2
+
+/* A Transport which passes everything through to another one and records what goes over
+ * the wire to a capture file, for replaying with ReplayTransport.
+ *
+ * Each DirectPlay8Peer using the default transport records its sessions when the
+ * DPLITE_CAPTURE environment variable names a file. Any further instances in the same
+ * process write to the same name with ".2", ".3", etc appended.
+ *
+ * Thread safe.
+*/
+
+class CaptureTransport: public Transport
+{
+	private:
+		Transport * const inner;
+		Clock * const clock;
+		
+		std::mutex lock;
+		
+		FILE *fh;
+		unsigned long long start;
+		
+		/* Remote address of each stream socket, for labelling its data. */
+		std::map<int, struct sockaddr_in> remotes;
+		
+		void write_record(CaptureRecordType type, int sock, uint32_t ip, uint16_t port, const void *data = NULL, size_t length = 0);
+		void write_record(CaptureRecordType type, int sock, const struct sockaddr_in &addr, const void *data = NULL, size_t length = 0);
+		void write_record(CaptureRecordType type, int sock, const void *data = NULL, size_t length = 0);
+		
+	public:
+		/* Throws std::runtime_error if the file can't be created. */
+		CaptureTransport(Transport *inner, const std::string &path, Clock *clock = SystemClock::get());
+		virtual ~CaptureTransport();
+		
+		/* No copy c'tor. */
+		CaptureTransport(const CaptureTransport &src) = delete;
+		
+		/* Returns a new CaptureTransport wrapping inner if the DPLITE_CAPTURE environment
+		 * variable is set, NULL otherwise.
+		*/
+		static CaptureTransport *from_env(Transport *inner, Clock *clock);
+		
+		void record_session(const PacketSerialiser &session);
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+		virtual bool get_host_instance(GUID *instance) override;
+		virtual void session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token) override;
+		virtual void admit_player(DWORD player_id, GUID *relay_token) override;
+		virtual void session_left() override;
+		virtual int connect_player(DWORD player_id, const SocketOptions &options) override;
+};
+
+#endif /* !DPLITE_CAPTURETRANSPORT_HPP */
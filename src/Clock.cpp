@@ -0,0 +1,170 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "Clock.hpp"
+#include "SendQueue.hpp"
+
+SystemClock *SystemClock::get()
+{
+	static SystemClock clock;
+	return &clock;
+}
+
+unsigned long long SystemClock::now()
+{
+	return SendQueue::now();
+}
+
+DWORD SystemClock::ticks()
+{
+	return GetTickCount();
+}
+
+HANDLE SystemClock::create_timer()
+{
+	return CreateWaitableTimer(NULL, FALSE, NULL);
+}
+
+void SystemClock::set_timer(HANDLE timer, unsigned long long due, DWORD period)
+{
+	unsigned long long now = this->now();
+	
+	/* Negative due time is relative, in 100ns units. */
+	LARGE_INTEGER rel_due;
+	rel_due.QuadPart = -((LONGLONG)(due > now ? due - now : 1) * 10);
+	
+	SetWaitableTimer(timer, &rel_due, period, NULL, NULL, FALSE);
+}
+
+void SystemClock::cancel_timer(HANDLE timer)
+{
+	CancelWaitableTimer(timer);
+}
+
+VirtualClock::VirtualClock(unsigned long long start):
+	current(start) {}
+
+unsigned long long VirtualClock::now()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return current;
+}
+
+DWORD VirtualClock::ticks()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return (DWORD)(current / 1000);
+}
+
+HANDLE VirtualClock::create_timer()
+{
+	return CreateEvent(NULL, FALSE, FALSE, NULL);
+}
+
+void VirtualClock::set_timer(HANDLE timer, unsigned long long due, DWORD period)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(due <= current)
+	{
+		SetEvent(timer);
+		
+		if(period == 0)
+		{
+			timers.erase(timer);
+			return;
+		}
+		
+		due = current + ((unsigned long long)(period) * 1000);
+	}
+	
+	Timer &t = timers[timer];
+	t.due    = due;
+	t.period = period;
+}
+
+void VirtualClock::cancel_timer(HANDLE timer)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	timers.erase(timer);
+}
+
+void VirtualClock::advance(unsigned long long us)
+{
+	std::unique_lock<std::mutex> l(lock);
+	advance_locked(us);
+}
+
+void VirtualClock::advance_locked(unsigned long long us)
+{
+	current += us;
+	
+	for(auto t = timers.begin(); t != timers.end();)
+	{
+		if(t->second.due > current)
+		{
+			++t;
+			continue;
+		}
+		
+		SetEvent(t->first);
+		
+		if(t->second.period == 0)
+		{
+			t = timers.erase(t);
+		}
+		else{
+			unsigned long long period = (unsigned long long)(t->second.period) * 1000;
+			
+			while(t->second.due <= current)
+			{
+				t->second.due += period;
+			}
+			
+			++t;
+		}
+	}
+}
+
+bool VirtualClock::advance_to_next_timer()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(timers.empty())
+	{
+		return false;
+	}
+	
+	unsigned long long next_due = timers.begin()->second.due;
+	
+	for(auto t = timers.begin(); t != timers.end(); ++t)
+	{
+		if(t->second.due < next_due)
+		{
+			next_due = t->second.due;
+		}
+	}
+	
+	advance_locked(next_due > current ? next_due - current : 0);
+	
+	return true;
+}
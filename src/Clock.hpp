@@ -0,0 +1,116 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_CLOCK_HPP
+#define DPLITE_CLOCK_HPP
+
+#include <winsock2.h>
+#include <map>
+#include <mutex>
+#include <windows.h>
+
+/* Source of time for a DirectPlay8Peer and the things it owns.
+ *
+ * Times from now() are in microseconds since an arbitrary point, like SendQueue::now(),
+ * ticks() is in milliseconds and wraps like GetTickCount().
+ *
+ * Timers are auto-reset waitable handles from create_timer(), which the clock signals when
+ * they come due so that a VirtualClock can drive them without any real time passing.
+*/
+
+class Clock
+{
+	public:
+		virtual ~Clock() {}
+		
+		virtual unsigned long long now() = 0;
+		virtual DWORD ticks() = 0;
+		
+		/* Returns a new timer handle, NULL on failure. Close it with CloseHandle() after
+		 * calling cancel_timer().
+		*/
+		virtual HANDLE create_timer() = 0;
+		
+		/* Arms timer to be signalled at the given now() time, then every period
+		 * milliseconds if period is non-zero. Replaces any existing schedule.
+		*/
+		virtual void set_timer(HANDLE timer, unsigned long long due, DWORD period = 0) = 0;
+		
+		/* Disarms timer. Must be called before the handle is closed. */
+		virtual void cancel_timer(HANDLE timer) = 0;
+};
+
+/* The real clock, backed by the performance counter and GetTickCount(). */
+class SystemClock: public Clock
+{
+	public:
+		/* Process-wide instance, used when no other clock is given. */
+		static SystemClock *get();
+		
+		virtual unsigned long long now() override;
+		virtual DWORD ticks() override;
+		virtual HANDLE create_timer() override;
+		virtual void set_timer(HANDLE timer, unsigned long long due, DWORD period = 0) override;
+		virtual void cancel_timer(HANDLE timer) override;
+};
+
+/* A clock which only moves when advance() is called, for tests.
+ *
+ * Timers are plain auto-reset events, signalled from advance() as they come due so they are
+ * already set by the time it returns. A periodic timer which is passed several times by one
+ * call is only signalled once, the same as a real timer that nobody waited on in time.
+ *
+ * Thread safe.
+*/
+class VirtualClock: public Clock
+{
+	private:
+		struct Timer
+		{
+			unsigned long long due;
+			DWORD period;
+		};
+		
+		std::mutex lock;
+		unsigned long long current;
+		std::map<HANDLE, Timer> timers;
+		
+		void advance_locked(unsigned long long us);
+		
+	public:
+		VirtualClock(unsigned long long start = 1000000);
+		
+		/* No copy c'tor. */
+		VirtualClock(const VirtualClock &src) = delete;
+		
+		virtual unsigned long long now() override;
+		virtual DWORD ticks() override;
+		virtual HANDLE create_timer() override;
+		virtual void set_timer(HANDLE timer, unsigned long long due, DWORD period = 0) override;
+		virtual void cancel_timer(HANDLE timer) override;
+		
+		/* Moves time forward by the given number of microseconds. */
+		void advance(unsigned long long us);
+		
+		/* Moves time forward to when the next timer is due and signals it. Returns false
+		 * if no timers are armed.
+		*/
+		bool advance_to_next_timer();
+};
+
+#endif /* !DPLITE_CLOCK_HPP */
@@ -0,0 +1,145 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "CongestionController.hpp"
+
+/* Largest proportion by which the rate moves on a single sample. */
+#define GAIN_PERCENT 10
+
+static const unsigned long long NO_SAMPLE = (unsigned long long)(-1);
+
+CongestionController::CongestionController():
+	rate(INITIAL_RATE), base_idx(0), base_bucket_start(0), current_idx(0)
+{
+	for(int i = 0; i < BASE_HISTORY; ++i)
+	{
+		base_history[i] = NO_SAMPLE;
+	}
+	
+	for(int i = 0; i < CURRENT_FILTER; ++i)
+	{
+		current_history[i] = NO_SAMPLE;
+	}
+}
+
+unsigned long long CongestionController::base_delay() const
+{
+	unsigned long long min = NO_SAMPLE;
+	
+	for(int i = 0; i < BASE_HISTORY; ++i)
+	{
+		if(base_history[i] < min)
+		{
+			min = base_history[i];
+		}
+	}
+	
+	return min;
+}
+
+unsigned long long CongestionController::current_delay() const
+{
+	unsigned long long min = NO_SAMPLE;
+	
+	for(int i = 0; i < CURRENT_FILTER; ++i)
+	{
+		if(current_history[i] < min)
+		{
+			min = current_history[i];
+		}
+	}
+	
+	return min;
+}
+
+void CongestionController::rtt_sample(unsigned long long rtt, bool app_limited, unsigned long long now)
+{
+	if(base_bucket_start == 0)
+	{
+		base_bucket_start = now;
+	}
+	else if((now - base_bucket_start) >= BASE_BUCKET_LENGTH)
+	{
+		base_idx = (base_idx + 1) % BASE_HISTORY;
+		base_history[base_idx] = NO_SAMPLE;
+		
+		base_bucket_start = now;
+	}
+	
+	if(rtt < base_history[base_idx])
+	{
+		base_history[base_idx] = rtt;
+	}
+	
+	current_history[current_idx] = rtt;
+	current_idx = (current_idx + 1) % CURRENT_FILTER;
+	
+	unsigned long long queueing_delay = get_queueing_delay();
+	
+	/* off_target ranges from +100% (no queueing) down to -100% (queueing at least twice
+	 * the target), and scales the adjustment made to the rate.
+	*/
+	long long off_target;
+	if(queueing_delay >= (TARGET_DELAY * 2))
+	{
+		off_target = -100;
+	}
+	else{
+		off_target = (((long long)(TARGET_DELAY) - (long long)(queueing_delay)) * 100) / (long long)(TARGET_DELAY);
+	}
+	
+	if(off_target > 0 && app_limited)
+	{
+		return;
+	}
+	
+	long long delta = ((long long)(rate) * off_target * GAIN_PERCENT) / (100 * 100);
+	long long new_rate = (long long)(rate) + delta;
+	
+	if(new_rate < (long long)(MIN_RATE))
+	{
+		new_rate = MIN_RATE;
+	}
+	else if(new_rate > (long long)(MAX_RATE))
+	{
+		new_rate = MAX_RATE;
+	}
+	
+	rate = (DWORD)(new_rate);
+}
+
+DWORD CongestionController::get_rate() const
+{
+	return rate;
+}
+
+unsigned long long CongestionController::get_queueing_delay() const
+{
+	unsigned long long base    = base_delay();
+	unsigned long long current = current_delay();
+	
+	if(base == NO_SAMPLE || current == NO_SAMPLE || current < base)
+	{
+		return 0;
+	}
+	
+	return current - base;
+}
@@ -0,0 +1,87 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_CONGESTIONCONTROLLER_HPP
+#define DPLITE_CONGESTIONCONTROLLER_HPP
+
+#include <winsock2.h>
+#include <windows.h>
+
+/* Delay-based congestion controller, loosely following LEDBAT (RFC 6817).
+ *
+ * The lowest RTT seen recently is taken as the path's base delay, anything above that is
+ * assumed to be queueing in a buffer somewhere (usually a home router). The send rate is
+ * nudged up while the queueing delay is below TARGET_DELAY and down while it is above,
+ * so we back off well before buffers fill and latency-sensitive traffic suffers.
+ *
+ * There is no separate loss signal. Peers talk over TCP, so a lost segment shows up as a
+ * retransmission delaying everything behind it, and is handled like any other queueing.
+ *
+ * The rate only grows while the sender is actually limited by it, so an idle connection
+ * doesn't build up an allowance it has never tested.
+ *
+ * Times are in microseconds (as returned by SendQueue::now()). Not thread safe, the owner
+ * must serialise access.
+*/
+
+class CongestionController
+{
+	public:
+		static const DWORD MIN_RATE     = 4096;       /* Bytes per second */
+		static const DWORD MAX_RATE     = 104857600;  /* Bytes per second */
+		static const DWORD INITIAL_RATE = 10485760;   /* Bytes per second */
+		
+		static const unsigned long long TARGET_DELAY = 25000;
+		
+	private:
+		/* Base delay is the minimum of one-minute buckets over this many minutes, so it can
+		 * follow a route change without being fooled by a single lucky sample.
+		*/
+		static const int BASE_HISTORY = 10;
+		static const unsigned long long BASE_BUCKET_LENGTH = 60000000;
+		
+		/* The current delay is the minimum of this many recent samples, to filter out noise. */
+		static const int CURRENT_FILTER = 4;
+		
+		DWORD rate;
+		
+		unsigned long long base_history[BASE_HISTORY];
+		int base_idx;
+		unsigned long long base_bucket_start;
+		
+		unsigned long long current_history[CURRENT_FILTER];
+		int current_idx;
+		
+		unsigned long long base_delay() const;
+		unsigned long long current_delay() const;
+		
+	public:
+		CongestionController();
+		
+		/* Feed in a round trip time. app_limited should be true if the sender has had nothing
+		 * more to send than the current rate allows since the last sample.
+		*/
+		void rtt_sample(unsigned long long rtt, bool app_limited, unsigned long long now);
+		
+		DWORD get_rate() const;
+		
+		/* Most recent estimate of queueing delay along the path. */
+		unsigned long long get_queueing_delay() const;
+};
+
+#endif /* !DPLITE_CONGESTIONCONTROLLER_HPP */
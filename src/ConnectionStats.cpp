@@ -0,0 +1,235 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <windows.h>
+
+#include "ConnectionStats.hpp"
+
+ConnectionStats::ConnectionStats():
+	srtt(0),
+	window_start(GetTickCount()),
+	window_bytes(0),
+	throughput(0),
+	peak_throughput(0),
+	bytes_sent_guaranteed(0),
+	packets_sent_guaranteed(0),
+	bytes_sent_non_guaranteed(0),
+	packets_sent_non_guaranteed(0),
+	bytes_dropped(0),
+	packets_dropped(0),
+	bytes_received_guaranteed(0),
+	packets_received_guaranteed(0),
+	bytes_received_non_guaranteed(0),
+	packets_received_non_guaranteed(0)
+{
+	for(int i = 0; i < 3; ++i)
+	{
+		messages_transmitted[i] = 0;
+		messages_timed_out[i]   = 0;
+	}
+	
+	for(int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		queue_latency[i] = 0;
+		wire_latency[i]  = 0;
+	}
+}
+
+int ConnectionStats::priority_index(DWORD send_flags)
+{
+	if(send_flags & DPNSEND_PRIORITY_HIGH)
+	{
+		return 0;
+	}
+	else if(send_flags & DPNSEND_PRIORITY_LOW)
+	{
+		return 2;
+	}
+	else{
+		return 1;
+	}
+}
+
+int ConnectionStats::latency_bucket(unsigned long long us)
+{
+	int bucket = 0;
+	
+	while(us > 0 && bucket < (LATENCY_BUCKETS - 1))
+	{
+		us >>= 1;
+		++bucket;
+	}
+	
+	return bucket;
+}
+
+void ConnectionStats::message_sent(DWORD send_flags, size_t bytes, HRESULT result)
+{
+	if(result == DPNERR_TIMEDOUT)
+	{
+		++(messages_timed_out[priority_index(send_flags)]);
+		return;
+	}
+	else if(result != S_OK)
+	{
+		/* Cancelled, or the connection went away before it was sent. */
+		bytes_dropped += bytes;
+		++packets_dropped;
+		
+		return;
+	}
+	
+	if(send_flags & DPNSEND_GUARANTEED)
+	{
+		bytes_sent_guaranteed += bytes;
+		++packets_sent_guaranteed;
+	}
+	else{
+		bytes_sent_non_guaranteed += bytes;
+		++packets_sent_non_guaranteed;
+	}
+	
+	++(messages_transmitted[priority_index(send_flags)]);
+	
+	/* Whichever thread sees the current window has expired gets to close it and calculate
+	 * the throughput for it. Any bytes added by other threads in the meantime may be counted
+	 * in either window, which is close enough.
+	*/
+	
+	window_bytes += bytes;
+	
+	DWORD now   = GetTickCount();
+	DWORD start = window_start;
+	
+	if((now - start) >= THROUGHPUT_WINDOW && window_start.compare_exchange_strong(start, now))
+	{
+		DWORD rate = (DWORD)(((unsigned long long)(window_bytes.exchange(0)) * 1000) / (now - start));
+		
+		throughput = rate;
+		
+		if(rate > peak_throughput)
+		{
+			peak_throughput = rate;
+		}
+	}
+}
+
+void ConnectionStats::send_latency(unsigned long long queue_us, unsigned long long wire_us)
+{
+	++(queue_latency[latency_bucket(queue_us)]);
+	++(wire_latency[latency_bucket(wire_us)]);
+}
+
+void ConnectionStats::get_queue_latency(DWORD (&buckets)[LATENCY_BUCKETS]) const
+{
+	for(int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		buckets[i] = queue_latency[i];
+	}
+}
+
+void ConnectionStats::get_wire_latency(DWORD (&buckets)[LATENCY_BUCKETS]) const
+{
+	for(int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		buckets[i] = wire_latency[i];
+	}
+}
+
+void ConnectionStats::message_received(DWORD send_flags, size_t bytes)
+{
+	if(send_flags & DPNSEND_GUARANTEED)
+	{
+		bytes_received_guaranteed += bytes;
+		++packets_received_guaranteed;
+	}
+	else{
+		bytes_received_non_guaranteed += bytes;
+		++packets_received_non_guaranteed;
+	}
+}
+
+void ConnectionStats::rtt_sample(DWORD rtt_ms)
+{
+	/* Exponentially weighted moving average as used for TCP's SRTT (RFC 6298), with
+	 * alpha = 1/8. srtt is kept scaled up by 8 to avoid losing precision.
+	*/
+	
+	DWORD old_srtt = srtt;
+	DWORD new_srtt;
+	
+	do {
+		if(old_srtt == 0)
+		{
+			new_srtt = (rtt_ms * 8) + 1; /* Never 0 once we have a sample. */
+		}
+		else{
+			new_srtt = old_srtt - (old_srtt / 8) + rtt_ms;
+		}
+	} while(!srtt.compare_exchange_weak(old_srtt, new_srtt));
+}
+
+DWORD ConnectionStats::get_rtt() const
+{
+	return srtt / 8;
+}
+
+void ConnectionStats::fill_connection_info(DPN_CONNECTION_INFO *info) const
+{
+	info->dwRoundTripLatencyMS = get_rtt();
+	
+	/* Nothing has been sent for a whole window, so the last rate calculated is stale. */
+	if((GetTickCount() - window_start) >= (THROUGHPUT_WINDOW * 2))
+	{
+		info->dwThroughputBPS = 0;
+	}
+	else{
+		info->dwThroughputBPS = throughput;
+	}
+	
+	info->dwPeakThroughputBPS = peak_throughput;
+	
+	info->dwBytesSentGuaranteed      = bytes_sent_guaranteed;
+	info->dwPacketsSentGuaranteed    = packets_sent_guaranteed;
+	info->dwBytesSentNonGuaranteed   = bytes_sent_non_guaranteed;
+	info->dwPacketsSentNonGuaranteed = packets_sent_non_guaranteed;
+	
+	/* Everything goes over TCP, so we never retry anything ourselves. */
+	info->dwBytesRetried   = 0;
+	info->dwPacketsRetried = 0;
+	
+	info->dwBytesDropped   = bytes_dropped;
+	info->dwPacketsDropped = packets_dropped;
+	
+	info->dwMessagesTransmittedHighPriority   = messages_transmitted[0];
+	info->dwMessagesTimedOutHighPriority      = messages_timed_out[0];
+	info->dwMessagesTransmittedNormalPriority = messages_transmitted[1];
+	info->dwMessagesTimedOutNormalPriority    = messages_timed_out[1];
+	info->dwMessagesTransmittedLowPriority    = messages_transmitted[2];
+	info->dwMessagesTimedOutLowPriority       = messages_timed_out[2];
+	
+	info->dwBytesReceivedGuaranteed      = bytes_received_guaranteed;
+	info->dwPacketsReceivedGuaranteed    = packets_received_guaranteed;
+	info->dwBytesReceivedNonGuaranteed   = bytes_received_non_guaranteed;
+	info->dwPacketsReceivedNonGuaranteed = packets_received_non_guaranteed;
+	
+	info->dwMessagesReceived = packets_received_guaranteed + packets_received_non_guaranteed;
+}
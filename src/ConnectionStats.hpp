@@ -0,0 +1,111 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_CONNECTIONSTATS_HPP
+#define DPLITE_CONNECTIONSTATS_HPP
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <windows.h>
+
+/* Transport statistics for a single connection, used to fill in DPN_CONNECTION_INFO.
+ *
+ * All counters are atomics so they may be read by GetConnectionInfo() without taking the
+ * session-wide lock while the worker threads are updating them. Byte counts are of application
+ * payload only, internal control messages aren't counted.
+*/
+
+class ConnectionStats
+{
+	public:
+		/* Latency histograms are bucketed by powers of two. Bucket 0 counts samples under
+		 * 1us, bucket N counts samples of [2^(N-1), 2^N) us and the last bucket counts
+		 * anything longer.
+		*/
+		static const int LATENCY_BUCKETS = 24;
+		
+	private:
+		/* Throughput is averaged over windows of at least this many milliseconds. */
+		static const DWORD THROUGHPUT_WINDOW = 1000;
+		
+		std::atomic<DWORD> srtt;           /* Smoothed RTT, in 1/8ths of a millisecond. 0 if no samples yet. */
+		
+		std::atomic<DWORD> window_start;   /* GetTickCount() at the start of the current window. */
+		std::atomic<DWORD> window_bytes;   /* Bytes sent so far in the current window. */
+		std::atomic<DWORD> throughput;     /* Bytes per second over the last complete window. */
+		std::atomic<DWORD> peak_throughput;
+		
+		std::atomic<DWORD> bytes_sent_guaranteed;
+		std::atomic<DWORD> packets_sent_guaranteed;
+		std::atomic<DWORD> bytes_sent_non_guaranteed;
+		std::atomic<DWORD> packets_sent_non_guaranteed;
+		
+		std::atomic<DWORD> bytes_dropped;
+		std::atomic<DWORD> packets_dropped;
+		
+		/* Indexed by priority_index() */
+		std::atomic<DWORD> messages_transmitted[3];
+		std::atomic<DWORD> messages_timed_out[3];
+		
+		std::atomic<DWORD> bytes_received_guaranteed;
+		std::atomic<DWORD> packets_received_guaranteed;
+		std::atomic<DWORD> bytes_received_non_guaranteed;
+		std::atomic<DWORD> packets_received_non_guaranteed;
+		
+		/* Time messages spent waiting in our send queue before the first byte was sent,
+		 * and then the time taken to get the rest of it into the socket.
+		*/
+		std::atomic<DWORD> queue_latency[LATENCY_BUCKETS];
+		std::atomic<DWORD> wire_latency[LATENCY_BUCKETS];
+		
+		static int priority_index(DWORD send_flags);
+		
+	public:
+		/* Returns the histogram bucket for a sample of us microseconds. Also used by
+		 * HandlerProfiler, which buckets handler times the same way.
+		*/
+		static int latency_bucket(unsigned long long us);
+		
+		ConnectionStats();
+		
+		/* No copy c'tor. */
+		ConnectionStats(const ConnectionStats&) = delete;
+		
+		/* Record the outcome of sending a message with the given DPNSEND_XXX flags. */
+		void message_sent(DWORD send_flags, size_t bytes, HRESULT result);
+		
+		/* Record how long a successfully sent message spent queued and on the wire, in
+		 * microseconds.
+		*/
+		void send_latency(unsigned long long queue_us, unsigned long long wire_us);
+		
+		void get_queue_latency(DWORD (&buckets)[LATENCY_BUCKETS]) const;
+		void get_wire_latency(DWORD (&buckets)[LATENCY_BUCKETS]) const;
+		
+		/* Record receipt of a message with the given DPNSEND_XXX flags. */
+		void message_received(DWORD send_flags, size_t bytes);
+		
+		/* Feed a round trip time measurement into the smoothed RTT estimate. */
+		void rtt_sample(DWORD rtt_ms);
+		DWORD get_rtt() const;
+		
+		void fill_connection_info(DPN_CONNECTION_INFO *info) const;
+};
+
+#endif /* !DPLITE_CONNECTIONSTATS_HPP */
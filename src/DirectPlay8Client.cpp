@@ -0,0 +1,261 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <mutex>
+#include <objbase.h>
+#include <string.h>
+#include <windows.h>
+
+#include "DirectPlay8Client.hpp"
+#include "DirectPlay8Peer.hpp"
+
+DirectPlay8Client::DirectPlay8Client(std::atomic<unsigned int> *global_refcount):
+	global_refcount(global_refcount),
+	local_refcount(0),
+	message_handler(NULL),
+	message_handler_ctx(NULL)
+{
+	peer = new DirectPlay8Peer(global_refcount, DirectPlay8Peer::ROLE_CLIENT);
+	AddRef();
+}
+
+DirectPlay8Client::~DirectPlay8Client()
+{
+	peer->Release();
+}
+
+HRESULT DirectPlay8Client::QueryInterface(REFIID riid, void **ppvObject)
+{
+	if(riid == IID_IDirectPlay8Client || riid == IID_IUnknown)
+	{
+		*((IUnknown**)(ppvObject)) = this;
+		AddRef();
+		
+		return S_OK;
+	}
+	else{
+		return E_NOINTERFACE;
+	}
+}
+
+ULONG DirectPlay8Client::AddRef(void)
+{
+	if(global_refcount != NULL)
+	{
+		++(*global_refcount);
+	}
+	
+	return ++local_refcount;
+}
+
+ULONG DirectPlay8Client::Release(void)
+{
+	std::atomic<unsigned int> *global_refcount = this->global_refcount;
+	
+	ULONG rc = --local_refcount;
+	if(rc == 0)
+	{
+		delete this;
+	}
+	
+	if(global_refcount != NULL)
+	{
+		--(*global_refcount);
+	}
+	
+	return rc;
+}
+
+HRESULT DirectPlay8Client::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags)
+{
+	HRESULT result = peer->Initialize(this, &peer_message_handler, dwFlags);
+	
+	if(result == S_OK)
+	{
+		message_handler     = pfn;
+		message_handler_ctx = pvUserContext;
+	}
+	
+	return result;
+}
+
+HRESULT DirectPlay8Client::EnumServiceProviders(CONST GUID* CONST pguidServiceProvider, CONST GUID* CONST pguidApplication, DPN_SERVICE_PROVIDER_INFO* CONST pSPInfoBuffer, PDWORD CONST pcbEnumData, PDWORD CONST pcReturned, CONST DWORD dwFlags)
+{
+	return peer->EnumServiceProviders(pguidServiceProvider, pguidApplication, pSPInfoBuffer, pcbEnumData, pcReturned, dwFlags);
+}
+
+HRESULT DirectPlay8Client::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc, IDirectPlay8Address* CONST pAddrHost, IDirectPlay8Address* CONST pDeviceInfo, PVOID CONST pUserEnumData, CONST DWORD dwUserEnumDataSize, CONST DWORD dwEnumCount, CONST DWORD dwRetryInterval, CONST DWORD dwTimeOut, PVOID CONST pvUserContext, DPNHANDLE* CONST pAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->EnumHosts(pApplicationDesc, pAddrHost, pDeviceInfo, pUserEnumData, dwUserEnumDataSize, dwEnumCount, dwRetryInterval, dwTimeOut, pvUserContext, pAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->CancelAsyncOperation(hAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDirectPlay8Address* CONST pHostAddr, IDirectPlay8Address* CONST pDeviceInfo, CONST DPN_SECURITY_DESC* CONST pdnSecurity, CONST DPN_SECURITY_CREDENTIALS* CONST pdnCredentials, CONST void* CONST pvUserConnectData, CONST DWORD dwUserConnectDataSize, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->Connect(pdnAppDesc, pHostAddr, pDeviceInfo, pdnSecurity, pdnCredentials, pvUserConnectData, dwUserConnectDataSize, NULL, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::Send(CONST DPN_BUFFER_DESC* CONST prgBufferDesc, CONST DWORD cBufferDesc, CONST DWORD dwTimeOut, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->SendTo(get_server_player_id(), prgBufferDesc, cBufferDesc, dwTimeOut, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetSendQueueInfo(DWORD* CONST pdwNumMsgs, DWORD* CONST pdwNumBytes, CONST DWORD dwFlags)
+{
+	return peer->GetSendQueueInfo(get_server_player_id(), pdwNumMsgs, pdwNumBytes, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetApplicationDesc(DPN_APPLICATION_DESC* CONST pAppDescBuffer, DWORD* CONST pcbDataSize, CONST DWORD dwFlags)
+{
+	return peer->GetApplicationDesc(pAppDescBuffer, pcbDataSize, dwFlags);
+}
+
+HRESULT DirectPlay8Client::SetClientInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->SetPeerInfo(pdpnPlayerInfo, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetServerInfo(DPN_PLAYER_INFO* CONST pdpnPlayerInfo, DWORD* CONST pdwSize, CONST DWORD dwFlags)
+{
+	return peer->GetPeerInfo(get_server_player_id(), pdpnPlayerInfo, pdwSize, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetServerAddress(IDirectPlay8Address** CONST pAddress, CONST DWORD dwFlags)
+{
+	return peer->GetPeerAddress(get_server_player_id(), pAddress, dwFlags);
+}
+
+HRESULT DirectPlay8Client::Close(CONST DWORD dwFlags)
+{
+	return peer->Close(dwFlags);
+}
+
+HRESULT DirectPlay8Client::ReturnBuffer(CONST DPNHANDLE hBufferHandle, CONST DWORD dwFlags)
+{
+	return peer->ReturnBuffer(hBufferHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetCaps(DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
+{
+	return peer->GetCaps(pdpCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Client::SetCaps(CONST DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
+{
+	return peer->SetCaps(pdpCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Client::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags)
+{
+	return peer->SetSPCaps(pguidSP, pdpspCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags)
+{
+	return peer->GetSPCaps(pguidSP, pdpspCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Client::GetConnectionInfo(DPN_CONNECTION_INFO* CONST pdpConnectionInfo, CONST DWORD dwFlags)
+{
+	return peer->GetConnectionInfo(get_server_player_id(), pdpConnectionInfo, dwFlags);
+}
+
+HRESULT DirectPlay8Client::RegisterLobby(CONST DPNHANDLE dpnHandle, struct IDirectPlay8LobbiedApplication* CONST pIDP8LobbiedApplication, CONST DWORD dwFlags)
+{
+	return peer->RegisterLobby(dpnHandle, pIDP8LobbiedApplication, dwFlags);
+}
+
+/* Returns the player ID of the server, or zero if we aren't connected to one, in
+ * which case the peer method we pass it to will fail with the appropriate error.
+*/
+DPNID DirectPlay8Client::get_server_player_id()
+{
+	std::unique_lock<ProfiledMutex> l(peer->lock.at("DirectPlay8Client::get_server_player_id"));
+	
+	if(peer->state == DirectPlay8Peer::STATE_CONNECTED)
+	{
+		return peer->host_player_id;
+	}
+	else{
+		return 0;
+	}
+}
+
+HRESULT CALLBACK DirectPlay8Client::peer_message_handler(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	DirectPlay8Client *self = (DirectPlay8Client*)(pvUserContext);
+	
+	switch(dwMessageType)
+	{
+		/* Clients don't get told about players or groups. The server is the only
+		 * other player we know about and groups only exist on the server.
+		*/
+		
+		case DPN_MSGID_CREATE_PLAYER:
+		case DPN_MSGID_DESTROY_PLAYER:
+		case DPN_MSGID_CREATE_GROUP:
+		case DPN_MSGID_DESTROY_GROUP:
+		case DPN_MSGID_ADD_PLAYER_TO_GROUP:
+		case DPN_MSGID_REMOVE_PLAYER_FROM_GROUP:
+		case DPN_MSGID_GROUP_INFO:
+		case DPN_MSGID_HOST_MIGRATE:
+			return DPN_OK;
+		
+		case DPN_MSGID_PEER_INFO:
+		{
+			/* The player info of the server or the local client has changed. The
+			 * local player ID doesn't change while the session is running, so we
+			 * can safely read it here without holding the peer's lock.
+			*/
+			
+			DPNMSG_PEER_INFO *pi = (DPNMSG_PEER_INFO*)(pMessage);
+			
+			if(pi->dpnidPeer == self->peer->local_player_id)
+			{
+				DPNMSG_CLIENT_INFO ci;
+				memset(&ci, 0, sizeof(ci));
+				
+				ci.dwSize          = sizeof(ci);
+				ci.dpnidClient     = pi->dpnidPeer;
+				ci.pvPlayerContext = pi->pvPlayerContext;
+				
+				return self->message_handler(self->message_handler_ctx, DPN_MSGID_CLIENT_INFO, &ci);
+			}
+			else{
+				DPNMSG_SERVER_INFO si;
+				memset(&si, 0, sizeof(si));
+				
+				si.dwSize          = sizeof(si);
+				si.dpnidServer     = pi->dpnidPeer;
+				si.pvPlayerContext = pi->pvPlayerContext;
+				
+				return self->message_handler(self->message_handler_ctx, DPN_MSGID_SERVER_INFO, &si);
+			}
+		}
+		
+		default:
+			return self->message_handler(self->message_handler_ctx, dwMessageType, pMessage);
+	}
+}
@@ -20,10 +20,12 @@
 #include <assert.h>
 #include <atomic>
 #include <dplay8.h>
+#include <dplite.h>
 #include <iterator>
 #include <memory>
 #include <mutex>
 #include <objbase.h>
+#include <set>
 #include <stdexcept>
 #include <stdint.h>
 #include <stdio.h>
@@ -37,6 +39,7 @@
 #include "Log.hpp"
 #include "Messages.hpp"
 #include "network.hpp"
+#include "Trace.hpp"
 
 #define UNIMPLEMENTED(fmt, ...) \
 	log_printf("Unimplemented: " fmt, ## __VA_ARGS__); \
@@ -49,22 +52,92 @@
 		return; \
 	}
 
-#define THREADS_PER_POOL     4
-#define MAX_HANDLES_PER_POOL 16
+/* Capacity of the lock-free part of work_queue, and the maximum number of items handle_work()
+ * will run before passing the rest on to another thread.
+*/
+#define WORK_QUEUE_SIZE 1024
+#define WORK_BATCH_SIZE 32
+
+/* Period of keepalive_timer, in milliseconds. */
+#define KEEPALIVE_TICK 500
+
+/* Peers are pinged at least this often (in milliseconds) so we always have a reasonably fresh
+ * RTT estimate, even if the application has set a long dwTimeoutUntilKeepAlive.
+*/
+#define RTT_PROBE_INTERVAL 5000
+
+/* With congestion control enabled, peers we are sending data to are pinged this often (in
+ * milliseconds) instead, to give the congestion controller enough RTT samples to work with.
+ * keepalive_timer runs at this period too.
+*/
+#define CC_PROBE_INTERVAL 100
+
+/* A connection to another peer which hasn't completed after this long (in milliseconds) is
+ * retried through the relay, if there is one, rather than waiting for the TCP connect to
+ * time out.
+*/
+#define DIRECT_CONNECT_TIMEOUT 3000
 
-/* Ephemeral port range as defined by IANA. */
-static const int AUTO_PORT_MIN = 49152;
-static const int AUTO_PORT_MAX = 65535;
+#define DEFAULT_KEEPALIVE_TIMEOUT         25000
+#define DEFAULT_NUM_SEND_RETRIES          10
+#define DEFAULT_MAX_SEND_RETRY_INTERVAL   5000
+#define DEFAULT_DROP_THRESHOLD_RATE       7
+#define DEFAULT_THROTTLE_RATE             25
+#define DEFAULT_MAX_ENUM_RESPONSE_RATE    50
 
-DirectPlay8Peer::DirectPlay8Peer(std::atomic<unsigned int> *global_refcount):
+/* dwSystemBufferSize reported by GetSPCaps() when neither SetSPCaps() nor the socket profile
+ * has picked a buffer size. This is what we always reported before they could be changed.
+*/
+#define DEFAULT_SYSTEM_BUFFER_SIZE 8192
+
+/* Receive buffers of at least MAX_FRAGMENT_SIZE are kept for reuse, up to this many bytes. */
+#define RECV_POOL_RETAIN (16 * 1024 * 1024)
+
+/* Maximum number of source addresses tracked for enumeration rate limiting. Once full, the
+ * address whose window started longest ago is forgotten to make room for a new one, or the
+ * new one is ignored if every window is still open.
+*/
+#define MAX_ENUM_SOURCES 4096
+
+DirectPlay8Peer::DirectPlay8Peer(std::atomic<unsigned int> *global_refcount, Role role, Transport *transport, Clock *clock):
 	global_refcount(global_refcount),
 	local_refcount(0),
+	role(role),
+	env_relay(transport == NULL ? RelayTransport::from_env(SocketTransport::get()) : NULL),
+	env_capture(transport == NULL ? CaptureTransport::from_env((env_relay != NULL ? (Transport*)(env_relay) : SocketTransport::get()), (clock != NULL ? clock : SystemClock::get())) : NULL),
+	transport(env_capture != NULL ? env_capture : (env_relay != NULL ? env_relay : (transport != NULL ? transport : SocketTransport::get()))),
+	clock(clock != NULL ? clock : SystemClock::get()),
 	state(STATE_NEW),
+	session_flags(0),
 	udp_socket(-1),
 	listener_socket(-1),
 	discovery_socket(-1),
+	shared_listener(NULL),
+	shared_listener_id(0),
 	worker_pool(NULL),
-	udp_sq(udp_socket_event)
+	work_queue(WORK_QUEUE_SIZE),
+	work_signalled(false),
+	udp_sq(udp_socket_event, this->clock),
+	keepalive_timer(NULL),
+	keepalive_timeout(DEFAULT_KEEPALIVE_TIMEOUT),
+	num_send_retries(DEFAULT_NUM_SEND_RETRIES),
+	max_send_retry_interval(DEFAULT_MAX_SEND_RETRY_INTERVAL),
+	drop_threshold_rate(DEFAULT_DROP_THRESHOLD_RATE),
+	throttle_rate(DEFAULT_THROTTLE_RATE),
+	max_send_rate(0),
+	max_player_send_rate(0),
+	congestion_control(false),
+	socket_profile(DPLITE_SOCKET_PROFILE_DEFAULT),
+	system_buffer_size(0),
+	enum_flags(0),
+	max_enum_response_rate(DEFAULT_MAX_ENUM_RESPONSE_RATE),
+	host_enum_response_players(0),
+	pace_timer(NULL),
+	pace_timer_due(0),
+	recv_pool(MAX_FRAGMENT_SIZE, RECV_POOL_RETAIN),
+	next_fragmented_msg_id(1),
+	lock("DirectPlay8Peer::lock"),
+	join_dispatching(false)
 {
 	AddRef();
 }
@@ -75,6 +148,9 @@ DirectPlay8Peer::~DirectPlay8Peer()
 	{
 		Close(DPNCLOSE_IMMEDIATE);
 	}
+	
+	delete env_capture;
+	delete env_relay;
 }
 
 HRESULT DirectPlay8Peer::QueryInterface(REFIID riid, void **ppvObject)
@@ -121,7 +197,7 @@ ULONG DirectPlay8Peer::Release(void)
 
 HRESULT DirectPlay8Peer::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("Initialize"));
 	
 	if(state != STATE_NEW)
 	{
@@ -135,14 +211,42 @@ HRESULT DirectPlay8Peer::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSA
 		return DPNERR_GENERIC;
 	}
 	
+	keepalive_timer = clock->create_timer();
+	if(keepalive_timer == NULL)
+	{
+		DWORD err = GetLastError();
+		log_printf("CreateWaitableTimer() failed: %s", win_strerror(err).c_str());
+		
+		WSACleanup();
+		return DPNERR_OUTOFMEMORY;
+	}
+	
+	pace_timer = clock->create_timer();
+	if(pace_timer == NULL)
+	{
+		DWORD err = GetLastError();
+		log_printf("CreateWaitableTimer() failed: %s", win_strerror(err).c_str());
+		
+		CloseHandle(keepalive_timer);
+		keepalive_timer = NULL;
+		
+		WSACleanup();
+		return DPNERR_OUTOFMEMORY;
+	}
+	
 	message_handler     = pfn;
 	message_handler_ctx = pvUserContext;
 	
-	worker_pool = new HandleHandlingPool(THREADS_PER_POOL, MAX_HANDLES_PER_POOL);
+	worker_pool = HandleHandlingPool::acquire_shared();
+	pool_ref    = std::shared_ptr<void>(nullptr, [this](void*) { SetEvent(pool_idle); });
+	
+	add_pool_handle(udp_socket_event,   [this]() { handle_udp_socket_event();   });
+	add_pool_handle(other_socket_event, [this]() { handle_other_socket_event(); });
+	add_pool_handle(work_ready,         [this]() { handle_work(); });
+	add_pool_handle(keepalive_timer,    [this]() { keepalive_tick(); });
+	add_pool_handle(pace_timer,         [this]() { handle_pace_timer(); });
 	
-	worker_pool->add_handle(udp_socket_event,   [this]() { handle_udp_socket_event();   });
-	worker_pool->add_handle(other_socket_event, [this]() { handle_other_socket_event(); });
-	worker_pool->add_handle(work_ready,         [this]() { handle_work(); });
+	clock->set_timer(keepalive_timer, clock->now() + ((unsigned long long)(keepalive_period()) * 1000), keepalive_period());
 	
 	state = STATE_INITIALISED;
 	
@@ -154,7 +258,7 @@ HRESULT DirectPlay8Peer::EnumServiceProviders(CONST GUID* CONST pguidServiceProv
 	static const DPN_SERVICE_PROVIDER_INFO IP_INFO  = { 0, CLSID_DP8SP_TCPIP, L"DirectPlay8 TCP/IP Service Provider", 0, 0 };
 	static const DPN_SERVICE_PROVIDER_INFO IPX_INFO = { 0, CLSID_DP8SP_IPX,   L"DirectPlay8 IPX Service Provider",    0, 0 };
 	
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("EnumServiceProviders"));
 	
 	if(state == STATE_NEW)
 	{
@@ -206,7 +310,7 @@ HRESULT DirectPlay8Peer::EnumServiceProviders(CONST GUID* CONST pguidServiceProv
 
 HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("CancelAsyncOperation"));
 	
 	if(dwFlags & DPNCANCEL_PLAYER_SENDS)
 	{
@@ -366,23 +470,39 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 			return DPNERR_CANNOTCANCEL;
 		}
 		
-		for(auto p = peers.begin(); p != peers.end() && sqop == NULL; ++p)
+		std::list<SendQueue::SendOp*> sqops;
+		if(sqop != NULL)
+		{
+			sqops.push_back(sqop);
+		}
+		
+		for(auto p = peers.begin(); p != peers.end() && sqops.empty(); ++p)
 		{
 			Peer *peer = p->second;
 			
-			sqop = peer->sq.remove_queued_by_handle(hAsyncHandle);
 			if(peer->sq.handle_is_pending(hAsyncHandle))
 			{
 				/* Cannot cancel once message has started sending. */
 				return DPNERR_CANNOTCANCEL;
 			}
+			
+			/* Messages too big for a single DPLITE_MSGID_MESSAGE are queued as one
+			 * SendOp per fragment, all with the same handle.
+			*/
+			while((sqop = peer->sq.remove_queued_by_handle(hAsyncHandle)) != NULL)
+			{
+				sqops.push_back(sqop);
+			}
 		}
 		
-		if(sqop != NULL)
+		if(!sqops.empty())
 		{
 			/* Queued send was found, make it go away. */
-			sqop->invoke_callback(l, DPNERR_USERCANCEL);
-			delete sqop;
+			for(auto si = sqops.begin(); si != sqops.end(); ++si)
+			{
+				(*si)->invoke_callback(l, DPNERR_USERCANCEL);
+				delete *si;
+			}
 			
 			return S_OK;
 		}
@@ -399,7 +519,7 @@ HRESULT DirectPlay8Peer::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONS
 
 HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDirectPlay8Address* CONST pHostAddr, IDirectPlay8Address* CONST pDeviceInfo, CONST DPN_SECURITY_DESC* CONST pdnSecurity, CONST DPN_SECURITY_CREDENTIALS* CONST pdnCredentials, CONST void* CONST pvUserConnectData, CONST DWORD dwUserConnectDataSize, void* CONST pvPlayerContext, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("Connect"));
 	
 	switch(state)
 	{
@@ -522,64 +642,30 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 		}
 	}
 	
+	capture_session(CAPTURE_SESSION_CONNECT, pdnAppDesc, r_port);
+	
 	if(l_port == 0)
 	{
-		/* Start at a random point in the ephemeral port range and try each one, wrapping
-		 * around when we reach the end.
-		 *
-		 * Gets the "random" point by querying the performance counter rather than calling
-		 * rand() just in case the application relies on the RNG state.
-		*/
-		
-		LARGE_INTEGER p_counter;
-		QueryPerformanceCounter(&p_counter);
-		
-		int port_range = AUTO_PORT_MAX - AUTO_PORT_MIN;
-		int base_port  = p_counter.QuadPart % port_range;
-		
-		for(int p = AUTO_PORT_MIN; p <= AUTO_PORT_MAX; ++p)
-		{
-			/* TODO: Only continue if creation failed due to address conflict. */
-			
-			int port = AUTO_PORT_MIN + ((base_port + p) % (port_range + 1));
-			
-			udp_socket = create_udp_socket(l_ipaddr, port);
-			if(udp_socket == -1)
-			{
-				continue;
-			}
-			
-			listener_socket = create_listener_socket(l_ipaddr, port);
-			if(listener_socket == -1)
-			{
-				closesocket(udp_socket);
-				udp_socket = -1;
-				
-				continue;
-			}
-			
-			local_ip   = l_ipaddr;
-			local_port = port;
-			
-			break;
-		}
-		
-		if(udp_socket == -1)
+		uint16_t port;
+		if(!transport->create_auto_port_sockets(l_ipaddr, &udp_socket, &listener_socket, &port, get_socket_options()))
 		{
 			return DPNERR_GENERIC;
 		}
+		
+		local_ip   = l_ipaddr;
+		local_port = port;
 	}
 	else{
-		udp_socket = create_udp_socket(l_ipaddr, l_port);
+		udp_socket = transport->create_udp_socket(l_ipaddr, l_port, get_socket_options());
 		if(udp_socket == -1)
 		{
 			return DPNERR_GENERIC;
 		}
 		
-		listener_socket = create_listener_socket(l_ipaddr, l_port);
+		listener_socket = transport->create_listener_socket(l_ipaddr, l_port, get_socket_options());
 		if(listener_socket == -1)
 		{
-			closesocket(udp_socket);
+			transport->close(udp_socket);
 			udp_socket = -1;
 			
 			return DPNERR_GENERIC;
@@ -592,21 +678,27 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 	connect_ctx    = pvAsyncContext;
 	connect_handle = (dwFlags & DPNCONNECT_SYNC) ? 0 : handle_alloc.new_connect();
 	
+	join_dispatching = false;
+	deferred_joins.clear();
+	
+	memset(&join_timing, 0, sizeof(join_timing));
+	join_timing.started = clock->now();
+	
 	state = STATE_CONNECTING_TO_HOST;
 	
 	if(!peer_connect(Peer::PS_CONNECTING_HOST, r_ipaddr, r_port))
 	{
-		closesocket(listener_socket);
+		transport->close(listener_socket);
 		listener_socket = -1;
 		
-		closesocket(udp_socket);
+		transport->close(udp_socket);
 		udp_socket = -1;
 		
 		return DPNERR_GENERIC;
 	}
 	
-	if(WSAEventSelect(udp_socket, udp_socket_event, FD_READ | FD_WRITE) != 0
-		|| WSAEventSelect(listener_socket, other_socket_event, FD_ACCEPT) != 0)
+	if(transport->event_select(udp_socket, udp_socket_event, FD_READ | FD_WRITE) != 0
+		|| transport->event_select(listener_socket, other_socket_event, FD_ACCEPT) != 0)
 	{
 		return DPNERR_GENERIC;
 	}
@@ -624,7 +716,7 @@ HRESULT DirectPlay8Peer::Connect(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, I
 
 HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST prgBufferDesc, CONST DWORD cBufferDesc, CONST DWORD dwTimeOut, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
 	
 	switch(state)
 	{
@@ -645,21 +737,48 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		return DPNERR_GENERIC;
 	}
 	
-	std::vector<unsigned char> payload;
+	size_t payload_size = 0;
+	
+	for(DWORD i = 0; i < cBufferDesc; ++i)
+	{
+		payload_size += prgBufferDesc[i].dwBufferSize;
+	}
+	
+	if(payload_size > MAX_MESSAGE_SIZE)
+	{
+		return DPNERR_SENDTOOLARGE;
+	}
+	
+	/* Shared with the send queue of every peer a fragmented message is going to. */
+	std::shared_ptr<std::vector<unsigned char>> payload(new std::vector<unsigned char>());
+	payload->reserve(payload_size);
 	
 	for(DWORD i = 0; i < cBufferDesc; ++i)
 	{
-		payload.reserve(payload.size() + prgBufferDesc[i].dwBufferSize);
-		payload.insert(payload.end(),
+		payload->insert(payload->end(),
 			(const unsigned char*)(prgBufferDesc[i].pBufferData),
 			(const unsigned char*)(prgBufferDesc[i].pBufferData) + prgBufferDesc[i].dwBufferSize);
 	}
 	
-	PacketSerialiser message(DPLITE_MSGID_MESSAGE);
+	DWORD message_flags = dwFlags & (DPNSEND_GUARANTEED | DPNSEND_COALESCE | DPNSEND_COMPLETEONPROCESS);
+	
+	/* Messages which are too big to go in one DPLITE_MSGID_MESSAGE are split up as they are
+	 * queued to each peer by send_fragmented().
+	*/
+	std::unique_ptr<PacketSerialiser> message;
+	DWORD fragmented_msg_id = 0;
 	
-	message.append_dword(local_player_id);
-	message.append_data(payload.data(), payload.size());
-	message.append_dword(dwFlags & (DPNSEND_GUARANTEED | DPNSEND_COALESCE | DPNSEND_COMPLETEONPROCESS));
+	if(payload_size <= MAX_FRAGMENT_SIZE)
+	{
+		message.reset(new PacketSerialiser(DPLITE_MSGID_MESSAGE));
+		
+		message->append_dword(local_player_id);
+		message->append_data(payload->data(), payload->size());
+		message->append_dword(message_flags);
+	}
+	else{
+		fragmented_msg_id = next_fragmented_msg_id++;
+	}
 	
 	SendQueue::SendPriority priority = SendQueue::SEND_PRI_MEDIUM;
 	if(dwFlags & DPNSEND_PRIORITY_HIGH)
@@ -725,19 +844,83 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		}
 	}
 	
+	/* Drop the message rather than queueing it for any peers whose send queue is already
+	 * backed up past the threshold for its priority.
+	*/
+	unsigned int dropped = 0;
+	
+	for(auto pi = send_to_peers.begin(); pi != send_to_peers.end();)
+	{
+		if(send_backlogged(*pi, dwFlags))
+		{
+			(*pi)->stats->message_sent(dwFlags, payload_size, DPNERR_TIMEDOUT);
+			
+			pi = send_to_peers.erase(pi);
+			++dropped;
+		}
+		else{
+			++pi;
+		}
+	}
+	
+	/* Peers which send_multi() has already sent the message to. */
+	std::set<Peer*> multi_sent;
+	
+	auto queue_message = [this, &message, &multi_sent, priority, fragmented_msg_id, payload, message_flags, dwFlags]
+		(Peer *peer, DPNHANDLE async_handle, const SendQueue::TimedCallback &callback)
+	{
+		if(multi_sent.find(peer) != multi_sent.end())
+		{
+			/* Complete it from the work queue as if it had gone through the send queue. */
+			
+			std::pair<const void*, size_t> raw = message->raw_packet();
+			
+			std::shared_ptr<SendQueue::SendOp> op(new SendQueue::SendOp(raw.first, raw.second, NULL, 0, async_handle, callback, clock));
+			op->inc_sent_data(raw.second);
+			
+			queue_work([this, op]()
+			{
+				std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
+				op->invoke_callback(l, S_OK);
+			});
+		}
+		else if(message)
+		{
+			peer->sq.send_timed(priority, *message, NULL, async_handle, callback);
+		}
+		else{
+			send_fragmented(peer, priority, fragmented_msg_id, payload,
+				(message_flags | (dwFlags & (DPNSEND_PRIORITY_HIGH | DPNSEND_PRIORITY_LOW))),
+				async_handle, callback);
+		}
+	};
+	
 	if(dwFlags & DPNSEND_SYNC)
 	{
 		unsigned int pending = send_to_peers.size();
 		std::mutex d_mutex;
 		std::condition_variable d_cv;
-		HRESULT result = S_OK;
+		HRESULT result = (dropped > 0 ? DPNERR_TIMEDOUT : S_OK);
+		
+		multi_sent = send_multi(send_to_peers, message.get(), 0);
 		
 		for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
 		{
-			(*pi)->sq.send(priority, message, NULL,
-				[&pending, &d_mutex, &d_cv, &result]
-				(std::unique_lock<std::mutex> &l, HRESULT s_result)
+			std::shared_ptr<ConnectionStats> stats = (*pi)->stats;
+			
+			queue_message(*pi, 0,
+				[&pending, &d_mutex, &d_cv, &result, stats, payload_size, dwFlags]
+				(std::unique_lock<ProfiledMutex> &l, HRESULT s_result, const SendQueue::SendOp &op)
 				{
+					stats->message_sent(dwFlags, payload_size, s_result);
+					
+					if(s_result == S_OK)
+					{
+						stats->send_latency(
+							(op.get_first_sent_at() - op.get_queued_at()),
+							(op.get_completed_at() - op.get_first_sent_at()));
+					}
+					
 					if(s_result != S_OK && result == S_OK)
 					{
 						/* Error code from the first failure wins. */
@@ -758,8 +941,11 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		{
 			/* TODO: Should the processing of this block a DPNSEND_SYNC send? */
 			
-			unsigned char *payload_copy = new unsigned char[payload.size()];
-			memcpy(payload_copy, payload.data(), payload.size());
+			unsigned char *payload_copy = recv_pool.get(payload_size);
+			if(payload_size > 0)
+			{
+				memcpy(payload_copy, payload->data(), payload_size);
+			}
 			
 			DPNMSG_RECEIVE r;
 			memset(&r, 0, sizeof(r));
@@ -768,17 +954,17 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			r.dpnidSender       = local_player_id;
 			r.pvPlayerContext   = local_player_ctx;
 			r.pReceiveData      = payload_copy;
-			r.dwReceiveDataSize = payload.size();
+			r.dwReceiveDataSize = payload_size;
 			r.hBufferHandle     = (DPNHANDLE)(payload_copy);
 			r.dwReceiveFlags    = (dwFlags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0)
 			                    | (dwFlags & DPNSEND_COALESCE   ? DPNRECEIVE_COALESCED  : 0);
 			
 			l.unlock();
 			
-			HRESULT r_result = message_handler(message_handler_ctx, DPN_MSGID_RECEIVE, &r);
+			HRESULT r_result = call_message_handler(DPN_MSGID_RECEIVE, &r);
 			if(r_result != DPNSUCCESS_PENDING)
 			{
-				delete[] payload_copy;
+				recv_pool.put(payload_copy);
 			}
 		}
 		else{
@@ -791,15 +977,20 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 		return result;
 	}
 	else{
-		unsigned int *pending = new unsigned int(send_to_peers.size() + send_to_self);
-		HRESULT      *result  = new HRESULT(S_OK);
+		unsigned int *pending         = new unsigned int(send_to_peers.size() + dropped + send_to_self);
+		HRESULT      *result          = new HRESULT(S_OK);
+		DWORD        *send_time       = new DWORD(0);
+		DWORD        *first_frame_rtt = new DWORD(0);
 		
 		DPNHANDLE handle = handle_alloc.new_send();
 		*phAsyncHandle   = handle;
 		
+		/* s_send_time and s_rtt are the time taken to send to one target and the current RTT
+		 * to it, the DPNMSG_SEND_COMPLETE reports the slowest of all the targets.
+		*/
 		auto handle_send_complete =
-			[this, pending, result, pvAsyncContext, dwFlags, prgBufferDesc, cBufferDesc, handle]
-			(std::unique_lock<std::mutex> &l, HRESULT s_result)
+			[this, pending, result, send_time, first_frame_rtt, pvAsyncContext, dwFlags, prgBufferDesc, cBufferDesc, handle]
+			(std::unique_lock<ProfiledMutex> &l, HRESULT s_result, DWORD s_send_time, DWORD s_rtt)
 		{
 			if(s_result != S_OK && *result == S_OK)
 			{
@@ -807,6 +998,16 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				*result = s_result;
 			}
 			
+			if(s_send_time > *send_time)
+			{
+				*send_time = s_send_time;
+			}
+			
+			if(s_rtt > *first_frame_rtt)
+			{
+				*first_frame_rtt = s_rtt;
+			}
+			
 			if(--(*pending) == 0)
 			{
 				DPNMSG_SEND_COMPLETE sc;
@@ -816,9 +1017,12 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				sc.hAsyncOp = handle;
 				sc.pvUserContext = pvAsyncContext;
 				sc.hResultCode   = *result;
-				// sc.dwSendTime
-				// sc.dwFirstFrameRTT
-				// sc.dwFirstRetryCount
+				sc.dwSendTime      = *send_time;
+				sc.dwFirstFrameRTT = *first_frame_rtt;
+				
+				/* Everything goes over TCP, which does any retrying for us. */
+				sc.dwFirstFrameRetryCount = 0;
+				
 				sc.dwSendCompleteFlags = (dwFlags & DPNSEND_GUARANTEED ? DPNRECEIVE_GUARANTEED : 0)
 				                       | (dwFlags & DPNSEND_COALESCE   ? DPNRECEIVE_COALESCED  : 0);
 				
@@ -828,18 +1032,29 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 					sc.dwNumBuffers = cBufferDesc;
 				}
 				
+				delete first_frame_rtt;
+				delete send_time;
 				delete result;
 				delete pending;
 				
 				if(!(dwFlags & DPNSEND_NOCOMPLETE))
 				{
 					l.unlock();
-					message_handler(message_handler_ctx, DPN_MSGID_SEND_COMPLETE, &sc);
+					call_message_handler(DPN_MSGID_SEND_COMPLETE, &sc);
 					l.lock();
 				}
 			}
 		};
 		
+		for(unsigned int i = 0; i < dropped; ++i)
+		{
+			queue_work([this, handle_send_complete]()
+			{
+				std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
+				handle_send_complete(l, DPNERR_TIMEDOUT, 0, 0);
+			});
+		}
+		
 		if(*pending == 0)
 		{
 			/* Horrible horrible hack to raise a DPNMSG_SEND_COMPLETE if there are no
@@ -850,33 +1065,49 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 			
 			std::thread t([this, handle_send_complete]()
 			{
-				std::unique_lock<std::mutex> l(lock);
-				handle_send_complete(l, S_OK);
+				std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
+				handle_send_complete(l, S_OK, 0, 0);
 			});
 			
 			t.detach();
 		}
 		
+		multi_sent = send_multi(send_to_peers, message.get(), handle);
+		
 		for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
 		{
-			(*pi)->sq.send(priority, message, NULL, handle,
-				[handle_send_complete]
-				(std::unique_lock<std::mutex> &l, HRESULT s_result)
+			std::shared_ptr<ConnectionStats> stats = (*pi)->stats;
+			
+			queue_message(*pi, handle,
+				[handle_send_complete, stats, payload_size, dwFlags]
+				(std::unique_lock<ProfiledMutex> &l, HRESULT s_result, const SendQueue::SendOp &op)
 				{
-					handle_send_complete(l, s_result);
+					stats->message_sent(dwFlags, payload_size, s_result);
+					
+					if(s_result == S_OK)
+					{
+						stats->send_latency(
+							(op.get_first_sent_at() - op.get_queued_at()),
+							(op.get_completed_at() - op.get_first_sent_at()));
+					}
+					
+					handle_send_complete(l, s_result,
+						(DWORD)((op.get_completed_at() - op.get_queued_at()) / 1000),
+						stats->get_rtt());
 				});
 		}
 		
 		if(send_to_self)
 		{
-			size_t payload_size = payload.size();
-			
-			unsigned char *payload_copy = new unsigned char[payload_size];
-			memcpy(payload_copy, payload.data(), payload_size);
+			unsigned char *payload_copy = recv_pool.get(payload_size);
+			if(payload_size > 0)
+			{
+				memcpy(payload_copy, payload->data(), payload_size);
+			}
 			
 			queue_work([this, payload_size, payload_copy, handle_send_complete, dwFlags]()
 			{
-				std::unique_lock<std::mutex> l(lock);
+				std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
 				
 				DPNMSG_RECEIVE r;
 				memset(&r, 0, sizeof(r));
@@ -891,15 +1122,15 @@ HRESULT DirectPlay8Peer::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST
 				                    | (dwFlags & DPNSEND_COALESCE   ? DPNRECEIVE_COALESCED  : 0);
 				
 				l.unlock();
-				HRESULT r_result = message_handler(message_handler_ctx, DPN_MSGID_RECEIVE, &r);
+				HRESULT r_result = call_message_handler(DPN_MSGID_RECEIVE, &r);
 				l.lock();
 				
 				if(r_result != DPNSUCCESS_PENDING)
 				{
-					delete[] payload_copy;
+					recv_pool.put(payload_copy);
 				}
 				
-				handle_send_complete(l, S_OK);
+				handle_send_complete(l, S_OK, 0, 0);
 			});
 		}
 		
@@ -914,7 +1145,7 @@ HRESULT DirectPlay8Peer::GetSendQueueInfo(CONST DPNID dpnid, DWORD* CONST pdwNum
 
 HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDirectPlay8Address **CONST prgpDeviceInfo, CONST DWORD cDeviceInfo, CONST DPN_SECURITY_DESC* CONST pdnSecurity, CONST DPN_SECURITY_CREDENTIALS* CONST pdnCredentials, void* CONST pvPlayerContext, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("Host"));
 	
 	switch(state)
 	{
@@ -931,14 +1162,13 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 		return DPNERR_INVALIDPARAM;
 	}
 	
-	if(pdnAppDesc->dwFlags & DPNSESSION_CLIENT_SERVER)
-	{
-		return DPNERR_INVALIDPARAM;
-	}
+	/* Client/server sessions can only be hosted through IDirectPlay8Server, and
+	 * IDirectPlay8Server can only host client/server sessions.
+	*/
 	
-	if(pdnAppDesc->dwFlags & DPNSESSION_MIGRATE_HOST)
+	if(!!(pdnAppDesc->dwFlags & DPNSESSION_CLIENT_SERVER) != (role == ROLE_SERVER))
 	{
-		/* Not supported yet. */
+		return DPNERR_INVALIDPARAM;
 	}
 	
 	if(cDeviceInfo == 0)
@@ -946,16 +1176,28 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 		return DPNERR_INVALIDPARAM;
 	}
 	
-	/* Generate a random GUID for this session. */
-	HRESULT guid_err = CoCreateGuid(&instance_guid);
-	if(guid_err != S_OK)
+	/* Generate a random GUID for this session, unless the transport is replaying one
+	 * whose connection requests name the instance which was captured.
+	*/
+	if(!transport->get_host_instance(&instance_guid))
 	{
-		return guid_err;
+		HRESULT guid_err = CoCreateGuid(&instance_guid);
+		if(guid_err != S_OK)
+		{
+			return guid_err;
+		}
 	}
 	
 	application_guid = pdnAppDesc->guidApplication;
 	max_players      = pdnAppDesc->dwMaxPlayers;
 	session_name     = (pdnAppDesc->pwszSessionName != NULL ? pdnAppDesc->pwszSessionName : L"(null)");
+	session_flags    = pdnAppDesc->dwFlags & (DPNSESSION_MIGRATE_HOST | DPNSESSION_NODPNSVR | DPNSESSION_CLIENT_SERVER);
+	
+	if(role == ROLE_SERVER)
+	{
+		/* The clients never see each other, so there is nobody to migrate to. */
+		session_flags &= ~DPNSESSION_MIGRATE_HOST;
+	}
 	
 	if(pdnAppDesc->dwFlags & DPNSESSION_REQUIREPASSWORD)
 	{
@@ -974,6 +1216,8 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 			(unsigned char*)(pdnAppDesc->pvApplicationReservedData) + pdnAppDesc->dwApplicationReservedDataSize);
 	}
 	
+	host_enum_response.reset();
+	
 	GUID     sp     = GUID_NULL;
 	uint32_t ipaddr = htonl(INADDR_ANY);
 	uint16_t port   = 0;
@@ -1022,49 +1266,54 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 	
 	service_provider = sp;
 	
-	if(port == 0)
+	capture_session(CAPTURE_SESSION_HOST, pdnAppDesc, port);
+	
+	if(dwFlags & DPLITE_HOST_SHAREDPORT)
 	{
-		for(int p = AUTO_PORT_MIN; p <= AUTO_PORT_MAX; ++p)
+		if(port == 0)
 		{
-			/* TODO: Only continue if creation failed due to address conflict. */
-			
-			udp_socket = create_udp_socket(ipaddr, p);
-			if(udp_socket == -1)
-			{
-				continue;
-			}
-			
-			listener_socket = create_listener_socket(ipaddr, p);
-			if(listener_socket == -1)
-			{
-				closesocket(udp_socket);
-				udp_socket = -1;
-				
-				continue;
-			}
-			
-			local_ip   = ipaddr;
-			local_port = p;
-			
-			break;
+			/* Nobody else could find the port to share it. */
+			return DPNERR_INVALIDPARAM;
 		}
 		
-		if(udp_socket == -1)
+		if(transport != SocketTransport::get())
+		{
+			/* The SharedListener always uses real sockets. */
+			return DPNERR_UNSUPPORTED;
+		}
+		
+		shared_listener = SharedListener::acquire(ipaddr, port, get_socket_options());
+		if(shared_listener == NULL)
+		{
+			return DPNERR_GENERIC;
+		}
+		
+		udp_socket = shared_listener->get_udp_socket();
+		
+		local_ip   = ipaddr;
+		local_port = port;
+	}
+	else if(port == 0)
+	{
+		if(!transport->create_auto_port_sockets(ipaddr, &udp_socket, &listener_socket, &port, get_socket_options()))
 		{
 			return DPNERR_GENERIC;
 		}
+		
+		local_ip   = ipaddr;
+		local_port = port;
 	}
 	else{
-		udp_socket = create_udp_socket(ipaddr, port);
+		udp_socket = transport->create_udp_socket(ipaddr, port, get_socket_options());
 		if(udp_socket == -1)
 		{
 			return DPNERR_GENERIC;
 		}
 		
-		listener_socket = create_listener_socket(ipaddr, port);
+		listener_socket = transport->create_listener_socket(ipaddr, port, get_socket_options());
 		if(listener_socket == -1)
 		{
-			closesocket(udp_socket);
+			transport->close(udp_socket);
 			udp_socket = -1;
 			
 			return DPNERR_GENERIC;
@@ -1074,18 +1323,19 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 		local_port = port;
 	}
 	
-	if(WSAEventSelect(udp_socket, udp_socket_event, FD_READ | FD_WRITE) != 0
-		|| WSAEventSelect(listener_socket, other_socket_event, FD_ACCEPT) != 0)
+	if(shared_listener == NULL
+		&& (transport->event_select(udp_socket, udp_socket_event, FD_READ | FD_WRITE) != 0
+			|| transport->event_select(listener_socket, other_socket_event, FD_ACCEPT) != 0))
 	{
 		return DPNERR_GENERIC;
 	}
 	
 	if(!(pdnAppDesc->dwFlags & DPNSESSION_NODPNSVR))
 	{
-		discovery_socket = create_discovery_socket();
+		discovery_socket = transport->create_discovery_socket();
 		
 		if(discovery_socket == -1
-			|| WSAEventSelect(discovery_socket, other_socket_event, FD_READ) != 0)
+			|| transport->event_select(discovery_socket, other_socket_event, FD_READ) != 0)
 		{
 			return DPNERR_GENERIC;
 		}
@@ -1097,6 +1347,16 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 	local_player_id  = host_player_id;
 	local_player_ctx = pvPlayerContext;
 	
+	if(role == ROLE_PEER)
+	{
+		transport->session_joined(instance_guid, local_player_id, GUID_NULL);
+	}
+	
+	if(shared_listener != NULL)
+	{
+		shared_listener_id = shared_listener->add(this, pool_ref, instance_guid, application_guid);
+	}
+	
 	state = STATE_HOSTING;
 	
 	/* Send DPNMSG_CREATE_PLAYER for local player. */
@@ -1107,7 +1367,7 @@ HRESULT DirectPlay8Peer::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDir
 
 HRESULT DirectPlay8Peer::GetApplicationDesc(DPN_APPLICATION_DESC* CONST pAppDescBuffer, DWORD* CONST pcbDataSize, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetApplicationDesc"));
 	
 	switch(state)
 	{
@@ -1133,7 +1393,7 @@ HRESULT DirectPlay8Peer::GetApplicationDesc(DPN_APPLICATION_DESC* CONST pAppDesc
 	{
 		unsigned char *extra_at = (unsigned char*)(pAppDescBuffer + 1);
 		
-		pAppDescBuffer->dwFlags          = 0;
+		pAppDescBuffer->dwFlags          = session_flags;
 		pAppDescBuffer->guidInstance     = instance_guid;
 		pAppDescBuffer->guidApplication  = application_guid;
 		pAppDescBuffer->dwMaxPlayers     = max_players;
@@ -1183,7 +1443,7 @@ HRESULT DirectPlay8Peer::GetApplicationDesc(DPN_APPLICATION_DESC* CONST pAppDesc
 
 HRESULT DirectPlay8Peer::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pad, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("SetApplicationDesc"));
 	
 	switch(state)
 	{
@@ -1218,6 +1478,8 @@ HRESULT DirectPlay8Peer::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pa
 			(unsigned char*)(pad->pvApplicationReservedData) + pad->dwApplicationReservedDataSize);
 	}
 	
+	host_enum_response.reset();
+	
 	/* Notify all peers of the new application description. We don't wait for confirmation
 	 * from the other peers, they'll get it when they get it.
 	*/
@@ -1237,7 +1499,7 @@ HRESULT DirectPlay8Peer::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pa
 		}
 		
 		pi->second->sq.send(SendQueue::SEND_PRI_MEDIUM, appdesc, NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 	}
 	
 	/* And finally, notify ourself about it.
@@ -1245,14 +1507,14 @@ HRESULT DirectPlay8Peer::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pa
 	*/
 	
 	l.unlock();
-	message_handler(message_handler_ctx, DPN_MSGID_APPLICATION_DESC, NULL);
+	call_message_handler(DPN_MSGID_APPLICATION_DESC, NULL);
 	
 	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo, void* CONST pvGroupContext, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("CreateGroup"));
 	
 	switch(state)
 	{
@@ -1312,7 +1574,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 	
 	auto complete =
 		[cg_lock, pending, dwFlags, &sync_cv, &sync_result, async_handle, pvAsyncContext, this]
-		(std::unique_lock<std::mutex> &l, HRESULT result)
+		(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 	{
 		std::unique_lock<std::mutex> cgl(*cg_lock);
 		
@@ -1334,7 +1596,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 				oc.hResultCode   = result;
 				
 				l.unlock();
-				message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+				call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
 				l.lock();
 				
 				cgl.unlock();
@@ -1347,7 +1609,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 	
 	auto create_the_group =
 		[this, group_name, group_data, pvGroupContext, cg_lock, pending, complete]
-		(std::unique_lock<std::mutex> &l, DPNID group_id)
+		(std::unique_lock<ProfiledMutex> &l, DPNID group_id)
 	{
 		groups.emplace(
 			std::piecewise_construct,
@@ -1365,13 +1627,15 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 		{
 			Peer *peer = p->second;
 			
-			if(peer->state == Peer::PS_CONNECTED)
+			/* Groups only exist on the server in a client/server session. */
+			
+			if(peer->state == Peer::PS_CONNECTED && role != ROLE_SERVER)
 			{
 				++(*pending);
 				
 				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_create, NULL,
 					[complete]
-					(std::unique_lock<std::mutex> &l, HRESULT result)
+					(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						if(result != S_OK)
 						{
@@ -1391,7 +1655,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 		
 		std::thread t([this, group_id, pvGroupContext, complete]()
 		{
-			std::unique_lock<std::mutex> l(lock);
+			std::unique_lock<ProfiledMutex> l(lock.at("CreateGroup"));
 			
 			DPNMSG_CREATE_GROUP cg;
 			memset(&cg, 0, sizeof(cg));
@@ -1403,7 +1667,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 			cg.pvOwnerContext = local_player_ctx;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_CREATE_GROUP, &cg);
+			call_message_handler(DPN_MSGID_CREATE_GROUP, &cg);
 			l.lock();
 			
 			Group *group = get_group_by_id(group_id);
@@ -1436,7 +1700,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 		
 		host->sq.send(SendQueue::SEND_PRI_HIGH, group_allocate, NULL,
 			[this, ack_id, host_id, create_the_group, complete]
-			(std::unique_lock<std::mutex> &l, HRESULT result)
+			(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 			{
 				if(result == S_OK)
 				{
@@ -1445,7 +1709,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 					
 					host->register_ack(ack_id,
 						[create_the_group, complete]
-						(std::unique_lock<std::mutex> &l, DWORD result, const void *data, size_t data_size)
+						(std::unique_lock<ProfiledMutex> &l, DWORD result, const void *data, size_t data_size)
 						{
 							if(result == S_OK && data_size == sizeof(DPNID))
 							{
@@ -1483,7 +1747,7 @@ HRESULT DirectPlay8Peer::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo,
 
 HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("DestroyGroup"));
 	
 	switch(state)
 	{
@@ -1529,11 +1793,11 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 	group_destroy.append_dword(idGroup);
 	
 	int *pending = new int(1);
-	std::condition_variable cv;
+	std::condition_variable_any cv;
 	
 	auto complete =
 		[this, pending, dwFlags, &cv, async_handle, pvAsyncContext]
-		(std::unique_lock<std::mutex> &l)
+		(std::unique_lock<ProfiledMutex> &l)
 	{
 		if(--(*pending) == 0)
 		{
@@ -1551,7 +1815,7 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 				oc.hResultCode   = S_OK;
 				
 				l.unlock();
-				message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+				call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
 				l.lock();
 				
 				delete pending;
@@ -1563,13 +1827,15 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 	{
 		Peer *peer = p->second;
 		
-		if(peer->state == Peer::PS_CONNECTED)
+		/* Groups only exist on the server in a client/server session. */
+		
+		if(peer->state == Peer::PS_CONNECTED && role != ROLE_SERVER)
 		{
 			++(*pending);
 			
 			peer->sq.send(SendQueue::SEND_PRI_HIGH, group_destroy, NULL,
 				[complete]
-				(std::unique_lock<std::mutex> &l, HRESULT result)
+				(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 				{
 					if(result != S_OK)
 					{
@@ -1587,7 +1853,7 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 	
 	std::thread t([this, idGroup, complete]()
 	{
-		std::unique_lock<std::mutex> l(lock);
+		std::unique_lock<ProfiledMutex> l(lock.at("DestroyGroup"));
 		
 		Group *group = get_group_by_id(idGroup);
 		if(group != NULL)
@@ -1601,7 +1867,7 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 			dg.dwReason       = DPNDESTROYGROUPREASON_NORMAL;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_DESTROY_GROUP, &dg);
+			call_message_handler(DPN_MSGID_DESTROY_GROUP, &dg);
 			l.lock();
 			
 			groups.erase(idGroup);
@@ -1626,7 +1892,7 @@ HRESULT DirectPlay8Peer::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncCo
 
 HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idClient, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("AddPlayerToGroup"));
 	
 	switch(state)
 	{
@@ -1671,12 +1937,12 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 	}
 	
 	int *pending = new int(1);
-	std::condition_variable cv;
+	std::condition_variable_any cv;
 	HRESULT s_result = S_OK;
 	
 	auto complete =
 		[this, pending, dwFlags, &cv, &s_result, async_handle, pvAsyncContext]
-		(std::unique_lock<std::mutex> &l, HRESULT result)
+		(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 	{
 		if(--(*pending) == 0)
 		{
@@ -1695,7 +1961,7 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 				oc.hResultCode   = result;
 				
 				l.unlock();
-				message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+				call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
 				l.lock();
 				
 				delete pending;
@@ -1703,9 +1969,25 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 		}
 	};
 	
-	if(idClient == local_player_id)
+	if(idClient == local_player_id || role == ROLE_SERVER)
 	{
-		/* Adding ourself to the group. Notify everyone else in the session. */
+		/* Adding ourself to the group, or a client to a group on the server. Notify
+		 * everyone else in the session (unless this is a client/server session, in
+		 * which case the group only exists here).
+		*/
+		
+		void *player_ctx = local_player_ctx;
+		
+		if(idClient != local_player_id)
+		{
+			Peer *peer = get_peer_by_player_id(idClient);
+			if(peer == NULL)
+			{
+				return DPNERR_INVALIDPLAYER;
+			}
+			
+			player_ctx = peer->player_ctx;
+		}
 		
 		PacketSerialiser group_joined(DPLITE_MSGID_GROUP_JOINED);
 		group_joined.append_dword(idGroup);
@@ -1716,12 +1998,12 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 		{
 			Peer *peer = p->second;
 			
-			if(peer->state == Peer::PS_CONNECTED)
+			if(peer->state == Peer::PS_CONNECTED && role != ROLE_SERVER)
 			{
 				++(*pending);
 				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_joined, NULL,
 					[complete]
-					(std::unique_lock<std::mutex> &l, HRESULT result)
+					(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						if(result != S_OK)
 						{
@@ -1735,10 +2017,10 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 		
 		/* And actually update the group and tell the application. */
 		
-		group->player_ids.insert(local_player_id);
+		group->player_ids.insert(idClient);
 		
 		void *group_ctx = group->ctx;
-		std::thread t([this, idGroup, group_ctx, complete]()
+		std::thread t([this, idGroup, group_ctx, idClient, player_ctx, complete]()
 		{
 			DPNMSG_ADD_PLAYER_TO_GROUP ap;
 			memset(&ap, 0, sizeof(ap));
@@ -1746,12 +2028,12 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 			ap.dwSize          = sizeof(ap);
 			ap.dpnidGroup      = idGroup;
 			ap.pvGroupContext  = group_ctx;
-			ap.dpnidPlayer     = local_player_id;
-			ap.pvPlayerContext = local_player_ctx;
+			ap.dpnidPlayer     = idClient;
+			ap.pvPlayerContext = player_ctx;
 			
-			message_handler(message_handler_ctx, DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
+			call_message_handler(DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
 			
-			std::unique_lock<std::mutex> l(lock);
+			std::unique_lock<ProfiledMutex> l(lock.at("AddPlayerToGroup"));
 			complete(l, S_OK);
 		});
 		
@@ -1781,7 +2063,7 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 		
 		peer->sq.send(SendQueue::SEND_PRI_HIGH, group_join, NULL,
 			[this, peer_id, ack_id, complete]
-			(std::unique_lock<std::mutex> &l, HRESULT result)
+			(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 			{
 				if(result == S_OK)
 				{
@@ -1791,7 +2073,7 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 					Peer *peer = get_peer_by_peer_id(peer_id);
 					assert(peer != NULL);
 					
-					peer->register_ack(ack_id, [complete](std::unique_lock<std::mutex> &l, HRESULT result)
+					peer->register_ack(ack_id, [complete](std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						complete(l, result);
 					});
@@ -1816,7 +2098,7 @@ HRESULT DirectPlay8Peer::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idCli
 
 HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID idClient, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("RemovePlayerFromGroup"));
 	
 	switch(state)
 	{
@@ -1855,12 +2137,12 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 	}
 	
 	int *pending = new int(1);
-	std::condition_variable cv;
+	std::condition_variable_any cv;
 	HRESULT s_result = S_OK;
 	
 	auto complete =
 		[this, pending, dwFlags, &cv, &s_result, async_handle, pvAsyncContext]
-		(std::unique_lock<std::mutex> &l, HRESULT result)
+		(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 	{
 		if(--(*pending) == 0)
 		{
@@ -1879,7 +2161,7 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 				oc.hResultCode   = result;
 				
 				l.unlock();
-				message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+				call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
 				l.lock();
 				
 				delete pending;
@@ -1887,9 +2169,25 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 		}
 	};
 	
-	if(idClient == local_player_id)
+	if(idClient == local_player_id || role == ROLE_SERVER)
 	{
-		/* Removing ourself from the group. Notify everyone else in the session. */
+		/* Removing ourself from the group, or a client from a group on the server.
+		 * Notify everyone else in the session (unless this is a client/server session,
+		 * in which case the group only exists here).
+		*/
+		
+		void *player_ctx = local_player_ctx;
+		
+		if(idClient != local_player_id)
+		{
+			Peer *peer = get_peer_by_player_id(idClient);
+			if(peer == NULL)
+			{
+				return DPNERR_INVALIDPLAYER;
+			}
+			
+			player_ctx = peer->player_ctx;
+		}
 		
 		PacketSerialiser group_left(DPLITE_MSGID_GROUP_LEFT);
 		group_left.append_dword(idGroup);
@@ -1898,12 +2196,12 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 		{
 			Peer *peer = p->second;
 			
-			if(peer->state == Peer::PS_CONNECTED)
+			if(peer->state == Peer::PS_CONNECTED && role != ROLE_SERVER)
 			{
 				++(*pending);
 				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_left, NULL,
 					[complete]
-					(std::unique_lock<std::mutex> &l, HRESULT result)
+					(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						if(result != S_OK)
 						{
@@ -1917,10 +2215,10 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 		
 		/* And actually update the group and tell the application. */
 		
-		group->player_ids.erase(local_player_id);
+		group->player_ids.erase(idClient);
 		
 		void *group_ctx = group->ctx;
-		std::thread t([this, idGroup, group_ctx, complete]()
+		std::thread t([this, idGroup, group_ctx, idClient, player_ctx, complete]()
 		{
 			DPNMSG_REMOVE_PLAYER_FROM_GROUP rp;
 			memset(&rp, 0, sizeof(rp));
@@ -1928,12 +2226,12 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 			rp.dwSize          = sizeof(rp);
 			rp.dpnidGroup      = idGroup;
 			rp.pvGroupContext  = group_ctx;
-			rp.dpnidPlayer     = local_player_id;
-			rp.pvPlayerContext = local_player_ctx;
+			rp.dpnidPlayer     = idClient;
+			rp.pvPlayerContext = player_ctx;
 			
-			message_handler(message_handler_ctx, DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
+			call_message_handler(DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
 			
-			std::unique_lock<std::mutex> l(lock);
+			std::unique_lock<ProfiledMutex> l(lock.at("RemovePlayerFromGroup"));
 			complete(l, S_OK);
 		});
 		
@@ -1961,7 +2259,7 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 		
 		peer->sq.send(SendQueue::SEND_PRI_HIGH, group_leave, NULL,
 			[this, peer_id, ack_id, complete]
-			(std::unique_lock<std::mutex> &l, HRESULT result)
+			(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 			{
 				if(result == S_OK)
 				{
@@ -1971,7 +2269,7 @@ HRESULT DirectPlay8Peer::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID
 					Peer *peer = get_peer_by_peer_id(peer_id);
 					assert(peer != NULL);
 					
-					peer->register_ack(ack_id, [complete](std::unique_lock<std::mutex> &l, HRESULT result)
+					peer->register_ack(ack_id, [complete](std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						complete(l, result);
 					});
@@ -2001,7 +2299,7 @@ HRESULT DirectPlay8Peer::SetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST p
 
 HRESULT DirectPlay8Peer::GetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST pdpnGroupInfo, DWORD* CONST pdwSize, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetGroupInfo"));
 	
 	switch(state)
 	{
@@ -2076,7 +2374,7 @@ HRESULT DirectPlay8Peer::GetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST p
 
 HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("EnumPlayersAndGroups"));
 	
 	switch(state)
 	{
@@ -2153,7 +2451,7 @@ HRESULT DirectPlay8Peer::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONS
 
 HRESULT DirectPlay8Peer::EnumGroupMembers(CONST DPNID dpnid, DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("EnumGroupMembers"));
 	
 	switch(state)
 	{
@@ -2196,7 +2494,7 @@ HRESULT DirectPlay8Peer::EnumGroupMembers(CONST DPNID dpnid, DPNID* CONST prgdpn
 
 HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("SetPeerInfo"));
 	
 	if(pdpnPlayerInfo->dwSize != sizeof(DPN_PLAYER_INFO))
 	{
@@ -2236,12 +2534,12 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 		return S_OK;
 	}
 	
-	std::function<void(std::unique_lock<std::mutex>&, HRESULT)> op_finished_cb;
+	std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT)> op_finished_cb;
 	
 	unsigned int sync_pending = 1;
 	unsigned int *pending = &sync_pending;
 	
-	std::condition_variable sync_cv;
+	std::condition_variable_any sync_cv;
 	HRESULT sync_result = S_OK;
 	
 	DPNHANDLE async_handle = handle_alloc.new_pinfo();
@@ -2249,7 +2547,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 	
 	if(dwFlags & DPNSETPEERINFO_SYNC)
 	{
-		op_finished_cb = [this, pending, &sync_result, &sync_cv](std::unique_lock<std::mutex> &l, HRESULT result)
+		op_finished_cb = [this, pending, &sync_result, &sync_cv](std::unique_lock<ProfiledMutex> &l, HRESULT result)
 		{
 			if(result != S_OK && sync_result == S_OK)
 			{
@@ -2272,7 +2570,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 		pending = new unsigned int(1);
 		async_result = new HRESULT(S_OK);
 		
-		op_finished_cb = [this, pending, async_result, async_handle, pvAsyncContext](std::unique_lock<std::mutex> &l, HRESULT result)
+		op_finished_cb = [this, pending, async_result, async_handle, pvAsyncContext](std::unique_lock<ProfiledMutex> &l, HRESULT result)
 		{
 			if(result != S_OK && *async_result == S_OK)
 			{
@@ -2294,7 +2592,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 				delete pending;
 				
 				l.unlock();
-				message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+				call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
 				l.lock();
 			}
 		};
@@ -2321,7 +2619,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 		
 		pi->second->sq.send(SendQueue::SEND_PRI_MEDIUM, playerinfo, NULL,
 			[this, op_finished_cb, peer_id, ack_id]
-			(std::unique_lock<std::mutex> &l, HRESULT result)
+			(std::unique_lock<ProfiledMutex> &l, HRESULT result)
 			{
 				if(result == S_OK)
 				{
@@ -2331,7 +2629,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 					Peer *peer = get_peer_by_peer_id(peer_id);
 					assert(peer != NULL);
 					
-					peer->register_ack(ack_id, [op_finished_cb](std::unique_lock<std::mutex> &l, HRESULT result)
+					peer->register_ack(ack_id, [op_finished_cb](std::unique_lock<ProfiledMutex> &l, HRESULT result)
 					{
 						op_finished_cb(l, result);
 					});
@@ -2357,7 +2655,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 		pi.pvPlayerContext = local_player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_PEER_INFO, &pi);
+		call_message_handler(DPN_MSGID_PEER_INFO, &pi);
 		l.lock();
 		
 		op_finished_cb(l, S_OK);
@@ -2375,7 +2673,7 @@ HRESULT DirectPlay8Peer::SetPeerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo
 
 HRESULT DirectPlay8Peer::GetPeerInfo(CONST DPNID dpnid, DPN_PLAYER_INFO* CONST pdpnPlayerInfo, DWORD* CONST pdwSize, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetPeerInfo"));
 	
 	std::wstring *name;
 	std::vector<unsigned char> *data;
@@ -2456,7 +2754,7 @@ HRESULT DirectPlay8Peer::GetPeerInfo(CONST DPNID dpnid, DPN_PLAYER_INFO* CONST p
 
 HRESULT DirectPlay8Peer::GetPeerAddress(CONST DPNID dpnid, IDirectPlay8Address** CONST pAddress, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetPeerAddress"));
 	
 	Peer *peer = get_peer_by_player_id(dpnid);
 	if(peer == NULL)
@@ -2476,7 +2774,7 @@ HRESULT DirectPlay8Peer::GetPeerAddress(CONST DPNID dpnid, IDirectPlay8Address**
 
 HRESULT DirectPlay8Peer::GetLocalHostAddresses(IDirectPlay8Address** CONST prgpAddress, DWORD* CONST pcAddress, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetLocalHostAddresses"));
 	
 	switch(state)
 	{
@@ -2538,7 +2836,7 @@ HRESULT DirectPlay8Peer::GetLocalHostAddresses(IDirectPlay8Address** CONST prgpA
 
 HRESULT DirectPlay8Peer::Close(CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("Close"));
 	
 	bool was_connected = false;
 	bool was_hosting   = false;
@@ -2610,17 +2908,62 @@ HRESULT DirectPlay8Peer::Close(CONST DWORD dwFlags)
 	/* Wait for outstanding EnumHosts() calls. */
 	host_enum_completed.wait(l, [this]() { return async_host_enums.empty() && sync_host_enums.empty(); });
 	
-	/* We need to release the lock while the worker_pool destructor runs so that any worker
-	 * threads waiting for it can finish. No other thread should mess with it while we are in
-	 * STATE_CLOSING and we have no open sockets.
+	worker_pool->remove_handle(udp_socket_event);
+	worker_pool->remove_handle(other_socket_event);
+	worker_pool->remove_handle(work_ready);
+	worker_pool->remove_handle(keepalive_timer);
+	worker_pool->remove_handle(pace_timer);
+	
+	/* We need to release the lock while waiting for our callbacks to drain out of the shared
+	 * worker_pool so that any worker threads waiting for it can finish. No other thread should
+	 * mess with it while we are in STATE_CLOSING and we have no open sockets.
 	*/
+	pool_ref.reset();
+	
 	l.unlock();
-	delete worker_pool;
+	WaitForSingleObject(pool_idle, INFINITE);
+	HandleHandlingPool::release_shared();
+	
+	if(shared_listener != NULL)
+	{
+		SharedListener::release(shared_listener);
+	}
+	
+	trace_save();
+	
 	l.lock();
 	worker_pool = NULL;
 	
+	shared_listener    = NULL;
+	shared_listener_id = 0;
+	
+	clock->cancel_timer(keepalive_timer);
+	CloseHandle(keepalive_timer);
+	keepalive_timer = NULL;
+	
+	clock->cancel_timer(pace_timer);
+	CloseHandle(pace_timer);
+	pace_timer = NULL;
+	
+	pace_timer_due = 0;
+	paced_peers.clear();
+	
 	destroyed_groups.clear();
 	
+	{
+		std::unique_lock<std::mutex> sl(stats_lock);
+		player_stats.clear();
+	}
+	
+	handler_profiler.log_summary();
+	handler_profiler.reset();
+	
+	/* Only populated while lock profiling is enabled, see ProfiledMutex.hpp. The shared
+	 * worker pool and logger locks are reported when the last user releases the pool.
+	*/
+	lock.get_profile().log_summary();
+	lock.get_profile().reset();
+	
 	WSACleanup();
 	
 	state = STATE_NEW;
@@ -2630,7 +2973,7 @@ HRESULT DirectPlay8Peer::Close(CONST DWORD dwFlags)
 
 HRESULT DirectPlay8Peer::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc, IDirectPlay8Address* CONST pAddrHost, IDirectPlay8Address* CONST pDeviceInfo,PVOID CONST pUserEnumData, CONST DWORD dwUserEnumDataSize, CONST DWORD dwEnumCount, CONST DWORD dwRetryInterval, CONST DWORD dwTimeOut,PVOID CONST pvUserContext, DPNHANDLE* CONST pAsyncHandle, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("EnumHosts"));
 	
 	if(state == STATE_NEW)
 	{
@@ -2644,7 +2987,7 @@ HRESULT DirectPlay8Peer::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc,
 			
 			sync_host_enums.emplace_front(
 				global_refcount,
-				message_handler, message_handler_ctx,
+				&host_enum_message_handler, this,
 				pApplicationDesc, pAddrHost, pDeviceInfo, pUserEnumData, dwUserEnumDataSize,
 				dwEnumCount, dwRetryInterval, dwTimeOut, pvUserContext,
 				
@@ -2674,7 +3017,7 @@ HRESULT DirectPlay8Peer::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc,
 				std::forward_as_tuple(handle),
 				std::forward_as_tuple(
 					global_refcount,
-					message_handler, message_handler_ctx,
+					&host_enum_message_handler, this,
 					pApplicationDesc, pAddrHost, pDeviceInfo, pUserEnumData, dwUserEnumDataSize,
 					dwEnumCount, dwRetryInterval, dwTimeOut, pvUserContext,
 					
@@ -2688,12 +3031,21 @@ HRESULT DirectPlay8Peer::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc,
 						oc.pvUserContext = pvUserContext;
 						oc.hResultCode   = r;
 						
-						message_handler(message_handler_ctx, DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+						call_message_handler(DPN_MSGID_ASYNC_OP_COMPLETE, &oc);
+						
+						/* We are running in a callback belonging to the HostEnumerator,
+						 * which can't be destroyed until it returns.
+						*/
 						
-						std::unique_lock<std::mutex> l(lock);
-						async_host_enums.erase(handle);
+						std::unique_lock<ProfiledMutex> l(lock.at("EnumHosts"));
 						
-						host_enum_completed.notify_all();
+						queue_work([this, handle]()
+						{
+							std::unique_lock<ProfiledMutex> l(lock.at("EnumHosts"));
+							async_host_enums.erase(handle);
+							
+							host_enum_completed.notify_all();
+						});
 					}));
 			
 			return DPNSUCCESS_PENDING;
@@ -2711,7 +3063,7 @@ HRESULT DirectPlay8Peer::EnumHosts(PDPN_APPLICATION_DESC CONST pApplicationDesc,
 
 HRESULT DirectPlay8Peer::DestroyPeer(CONST DPNID dpnidClient, CONST void* CONST pvDestroyData, CONST DWORD dwDestroyDataSize, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("DestroyPeer"));
 	
 	switch(state)
 	{
@@ -2750,23 +3102,24 @@ HRESULT DirectPlay8Peer::DestroyPeer(CONST DPNID dpnidClient, CONST void* CONST
 	
 	/* Notify the peer we are destroying it and initiate the connection shutdown. */
 	
-	peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer_full, NULL, [](std::unique_lock<std::mutex> &l, HRESULT result) {});
+	peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer_full, NULL, [](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 	peer_shutdown(l, peer_id, DPNERR_HOSTTERMINATEDSESSION, DPNDESTROYPLAYERREASON_HOSTDESTROYEDPLAYER);
 	
 	/* Notify the other peers, in case the other peer is malfunctioning and doesn't remove
-	 * itself from the session gracefully.
+	 * itself from the session gracefully. Clients in a client/server session don't know
+	 * about each other, so there is nobody else to tell.
 	*/
 	
 	for(auto p = peers.begin(); p != peers.end(); ++p)
 	{
 		Peer *o_peer = p->second;
 		
-		if(o_peer->state != Peer::PS_CONNECTED)
+		if(o_peer->state != Peer::PS_CONNECTED || role == ROLE_SERVER)
 		{
 			continue;
 		}
 		
-		o_peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer_base, NULL, [](std::unique_lock<std::mutex> &l, HRESULT result) {});
+		o_peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer_base, NULL, [](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 	}
 	
 	return S_OK;
@@ -2775,14 +3128,14 @@ HRESULT DirectPlay8Peer::DestroyPeer(CONST DPNID dpnidClient, CONST void* CONST
 HRESULT DirectPlay8Peer::ReturnBuffer(CONST DPNHANDLE hBufferHandle, CONST DWORD dwFlags)
 {
 	unsigned char *buffer = (unsigned char*)(hBufferHandle);
-	delete[] buffer;
+	recv_pool.put(buffer);
 	
 	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::GetPlayerContext(CONST DPNID dpnid,PVOID* CONST ppvPlayerContext, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetPlayerContext"));
 	
 	switch(state)
 	{
@@ -2813,7 +3166,7 @@ HRESULT DirectPlay8Peer::GetPlayerContext(CONST DPNID dpnid,PVOID* CONST ppvPlay
 
 HRESULT DirectPlay8Peer::GetGroupContext(CONST DPNID dpnid,PVOID* CONST ppvGroupContext, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetGroupContext"));
 	
 	switch(state)
 	{
@@ -2841,40 +3194,67 @@ HRESULT DirectPlay8Peer::GetGroupContext(CONST DPNID dpnid,PVOID* CONST ppvGroup
 
 HRESULT DirectPlay8Peer::GetCaps(DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetCaps"));
 	
 	if(state == STATE_NEW)
 	{
 		return DPNERR_UNINITIALIZED;
 	}
 	
-	l.unlock();
-	
 	if(pdpCaps->dwSize == sizeof(DPN_CAPS))
 	{
 		pdpCaps->dwFlags                   = 0;
 		pdpCaps->dwConnectTimeout          = 200;
 		pdpCaps->dwConnectRetries          = 14;
-		pdpCaps->dwTimeoutUntilKeepAlive   = 25000;
+		pdpCaps->dwTimeoutUntilKeepAlive   = keepalive_timeout;
 		
 		return S_OK;
 	}
-	else if(pdpCaps->dwSize == sizeof(DPN_CAPS_EX))
+	else if(pdpCaps->dwSize == sizeof(DPN_CAPS_EX) || pdpCaps->dwSize == sizeof(DPLITE_CAPS))
 	{
 		DPN_CAPS_EX *pdpCapsEx = (DPN_CAPS_EX*)(pdpCaps);
 		
 		pdpCapsEx->dwFlags                   = 0;
 		pdpCapsEx->dwConnectTimeout          = 200;
 		pdpCapsEx->dwConnectRetries          = 14;
-		pdpCapsEx->dwTimeoutUntilKeepAlive   = 25000;
+		pdpCapsEx->dwTimeoutUntilKeepAlive   = keepalive_timeout;
 		pdpCapsEx->dwMaxRecvMsgSize          = 0xFFFFFFFF;
-		pdpCapsEx->dwNumSendRetries          = 10;
-		pdpCapsEx->dwMaxSendRetryInterval    = 5000;
-		pdpCapsEx->dwDropThresholdRate       = 7;
-		pdpCapsEx->dwThrottleRate            = 25;
+		pdpCapsEx->dwNumSendRetries          = num_send_retries;
+		pdpCapsEx->dwMaxSendRetryInterval    = max_send_retry_interval;
+		pdpCapsEx->dwDropThresholdRate       = drop_threshold_rate;
+		pdpCapsEx->dwThrottleRate            = throttle_rate;
 		pdpCapsEx->dwNumHardDisconnectSends  = 3;
 		pdpCapsEx->dwMaxHardDisconnectPeriod = 500;
 		
+		if(pdpCaps->dwSize == sizeof(DPLITE_CAPS))
+		{
+			DPLITE_CAPS *pdpCapsLite = (DPLITE_CAPS*)(pdpCaps);
+			
+			pdpCapsLite->dwMaxSendRate         = max_send_rate;
+			pdpCapsLite->dwMaxPlayerSendRate   = max_player_send_rate;
+			pdpCapsLite->dwSocketProfile       = socket_profile;
+			pdpCapsLite->dwEnumFlags           = enum_flags;
+			pdpCapsLite->dwMaxEnumResponseRate = max_enum_response_rate;
+			pdpCapsLite->dwHandlerWarnTime     = handler_profiler.get_warn_time();
+			pdpCapsLite->dwCongestionControl   = congestion_control;
+		}
+		
+		return S_OK;
+	}
+	else if(pdpCaps->dwSize == sizeof(DPLITE_HANDLER_STATS))
+	{
+		DPLITE_HANDLER_STATS *stats = (DPLITE_HANDLER_STATS*)(pdpCaps);
+		
+		if(!handler_profiler.get_stats(stats))
+		{
+			return DPNERR_INVALIDPARAM;
+		}
+		
+		if(dwFlags & DPLITE_HANDLER_STATS_RESET)
+		{
+			handler_profiler.reset();
+		}
+		
 		return S_OK;
 	}
 	else{
@@ -2884,40 +3264,106 @@ HRESULT DirectPlay8Peer::GetCaps(DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
 
 HRESULT DirectPlay8Peer::SetCaps(CONST DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("SetCaps"));
 	
 	if(state == STATE_NEW)
 	{
 		return DPNERR_UNINITIALIZED;
 	}
 	
-	l.unlock();
-	
-	if(pdpCaps->dwSize == sizeof(DPN_CAPS) || pdpCaps->dwSize == sizeof(DPN_CAPS_EX))
+	if(pdpCaps->dwSize == sizeof(DPN_CAPS) || pdpCaps->dwSize == sizeof(DPN_CAPS_EX) || pdpCaps->dwSize == sizeof(DPLITE_CAPS))
 	{
-		/* Our protocol doesn't have all the tunables the official DirectPlay does... so
-		 * just say everything was accepted.
-		 *
-		 * TODO: Store new values for future GetSPCaps() calls?
-		*/
-		return S_OK;
-	}
-	else{
-		return DPNERR_INVALIDPARAM;
-	}
-}
-
-HRESULT DirectPlay8Peer::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags )
-{
-	std::unique_lock<std::mutex> l(lock);
-	
-	if(state == STATE_NEW)
+		if(pdpCaps->dwTimeoutUntilKeepAlive == 0)
+		{
+			return DPNERR_INVALIDPARAM;
+		}
+		
+		if(pdpCaps->dwSize != sizeof(DPN_CAPS))
+		{
+			const DPN_CAPS_EX *pdpCapsEx = (const DPN_CAPS_EX*)(pdpCaps);
+			
+			if(pdpCapsEx->dwDropThresholdRate > 100 || pdpCapsEx->dwThrottleRate > 100)
+			{
+				return DPNERR_INVALIDPARAM;
+			}
+		}
+		
+		if(pdpCaps->dwSize == sizeof(DPLITE_CAPS)
+			&& ((const DPLITE_CAPS*)(pdpCaps))->dwSocketProfile > DPLITE_SOCKET_PROFILE_LAN)
+		{
+			return DPNERR_INVALIDPARAM;
+		}
+		
+		keepalive_timeout = pdpCaps->dwTimeoutUntilKeepAlive;
+		
+		if(pdpCaps->dwSize != sizeof(DPN_CAPS))
+		{
+			const DPN_CAPS_EX *pdpCapsEx = (const DPN_CAPS_EX*)(pdpCaps);
+			
+			num_send_retries        = pdpCapsEx->dwNumSendRetries;
+			max_send_retry_interval = pdpCapsEx->dwMaxSendRetryInterval;
+			drop_threshold_rate     = pdpCapsEx->dwDropThresholdRate;
+			throttle_rate           = pdpCapsEx->dwThrottleRate;
+		}
+		
+		if(pdpCaps->dwSize == sizeof(DPLITE_CAPS))
+		{
+			const DPLITE_CAPS *pdpCapsLite = (const DPLITE_CAPS*)(pdpCaps);
+			
+			max_send_rate        = pdpCapsLite->dwMaxSendRate;
+			max_player_send_rate = pdpCapsLite->dwMaxPlayerSendRate;
+			
+			send_pacer.set_rate(max_send_rate);
+			
+			/* Per-peer buckets pick up the new rate the next time they send. Kick any
+			 * peers waiting on the old rates so they re-evaluate.
+			*/
+			for(auto pi = peers.begin(); pi != peers.end(); ++pi)
+			{
+				SetEvent(pi->second->event);
+			}
+			
+			if(pdpCapsLite->dwSocketProfile != socket_profile)
+			{
+				socket_profile = pdpCapsLite->dwSocketProfile;
+				apply_session_socket_options();
+			}
+			
+			enum_flags             = pdpCapsLite->dwEnumFlags;
+			max_enum_response_rate = pdpCapsLite->dwMaxEnumResponseRate;
+			
+			handler_profiler.set_warn_time(pdpCapsLite->dwHandlerWarnTime);
+			
+			if((pdpCapsLite->dwCongestionControl != 0) != congestion_control)
+			{
+				congestion_control = (pdpCapsLite->dwCongestionControl != 0);
+				
+				if(keepalive_timer != NULL)
+				{
+					clock->set_timer(keepalive_timer, clock->now() + ((unsigned long long)(keepalive_period()) * 1000), keepalive_period());
+				}
+			}
+		}
+		
+		/* Our protocol doesn't have all the other tunables the official DirectPlay does...
+		 * so just say everything else was accepted.
+		*/
+		return S_OK;
+	}
+	else{
+		return DPNERR_INVALIDPARAM;
+	}
+}
+
+HRESULT DirectPlay8Peer::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags )
+{
+	std::unique_lock<ProfiledMutex> l(lock.at("SetSPCaps"));
+	
+	if(state == STATE_NEW)
 	{
 		return DPNERR_UNINITIALIZED;
 	}
 	
-	l.unlock();
-	
 	if(pdpspCaps->dwSize != sizeof(DPN_SP_CAPS))
 	{
 		return DPNERR_INVALIDPARAM;
@@ -2934,20 +3380,33 @@ HRESULT DirectPlay8Peer::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS*
 	 * member is for legacy support. Microsoft DirectX 9.0 applications should use the
 	 * IDirectPlay8ThreadPool::SetThreadCount method to set the number of threads. The other
 	 * members of the DPN_SP_CAPS structure are get-only or ignored.
+	 *
+	 * We use dwSystemBufferSize for SO_SNDBUF and SO_RCVBUF in place of the sizes from the
+	 * socket profile. Zero leaves them to the profile, as does passing back the size returned
+	 * by GetSPCaps() so that updating some other member doesn't pin the buffer size.
 	*/
 	
+	if(pdpspCaps->dwSystemBufferSize != system_buffer_size
+		&& pdpspCaps->dwSystemBufferSize != reported_buffer_size())
+	{
+		system_buffer_size = pdpspCaps->dwSystemBufferSize;
+		apply_session_socket_options();
+	}
+	
 	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("GetSPCaps"));
 	
 	if(state == STATE_NEW)
 	{
 		return DPNERR_UNINITIALIZED;
 	}
 	
+	DWORD buffer_size = reported_buffer_size();
+	
 	l.unlock();
 	
 	if(pdpspCaps->dwSize != sizeof(DPN_SP_CAPS))
@@ -2973,14 +3432,53 @@ HRESULT DirectPlay8Peer::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST
 	pdpspCaps->dwDefaultEnumTimeout       = DEFAULT_ENUM_TIMEOUT;
 	pdpspCaps->dwMaxEnumPayloadSize       = 983;
 	pdpspCaps->dwBuffersPerThread         = 1;
-	pdpspCaps->dwSystemBufferSize         = 8192;
+	pdpspCaps->dwSystemBufferSize         = buffer_size;
 	
 	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::GetConnectionInfo(CONST DPNID dpnid, DPN_CONNECTION_INFO* CONST pdpConnectionInfo, CONST DWORD dwFlags)
 {
-	UNIMPLEMENTED("DirectPlay8Peer::GetConnectionInfo");
+	if(pdpConnectionInfo == NULL
+		|| (pdpConnectionInfo->dwSize != sizeof(DPN_CONNECTION_INFO)
+			&& pdpConnectionInfo->dwSize != sizeof(DPLITE_CONNECTION_LATENCY)))
+	{
+		return DPNERR_INVALIDPARAM;
+	}
+	
+	/* We deliberately don't take the session lock here, applications tend to poll this from
+	 * their main loop and it shouldn't stall behind message handlers or the worker threads.
+	*/
+	
+	std::shared_ptr<ConnectionStats> stats;
+	
+	{
+		std::unique_lock<std::mutex> sl(stats_lock);
+		
+		auto s = player_stats.find(dpnid);
+		if(s == player_stats.end())
+		{
+			return DPNERR_INVALIDPLAYER;
+		}
+		
+		stats = s->second;
+	}
+	
+	if(pdpConnectionInfo->dwSize == sizeof(DPLITE_CONNECTION_LATENCY))
+	{
+		static_assert(DPLITE_LATENCY_HISTOGRAM_BUCKETS == ConnectionStats::LATENCY_BUCKETS,
+			"DPLITE_CONNECTION_LATENCY histograms are copied straight from ConnectionStats");
+		
+		DPLITE_CONNECTION_LATENCY *latency = (DPLITE_CONNECTION_LATENCY*)(pdpConnectionInfo);
+		
+		stats->get_queue_latency(latency->dwQueueHistogram);
+		stats->get_wire_latency(latency->dwWireHistogram);
+	}
+	else{
+		stats->fill_connection_info(pdpConnectionInfo);
+	}
+	
+	return S_OK;
 }
 
 HRESULT DirectPlay8Peer::RegisterLobby(CONST DPNHANDLE dpnHandle, struct IDirectPlay8LobbiedApplication* CONST pIDP8LobbiedApplication, CONST DWORD dwFlags)
@@ -2990,7 +3488,7 @@ HRESULT DirectPlay8Peer::RegisterLobby(CONST DPNHANDLE dpnHandle, struct IDirect
 
 HRESULT DirectPlay8Peer::TerminateSession(void* CONST pvTerminateData, CONST DWORD dwTerminateDataSize, CONST DWORD dwFlags)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("TerminateSession"));
 	
 	switch(state)
 	{
@@ -3032,7 +3530,7 @@ HRESULT DirectPlay8Peer::TerminateSession(void* CONST pvTerminateData, CONST DWO
 		
 		if(peer->state == Peer::PS_CONNECTED)
 		{
-			peer->sq.send(SendQueue::SEND_PRI_HIGH, terminate_session, NULL, [](std::unique_lock<std::mutex> &l, HRESULT result){});
+			peer->sq.send(SendQueue::SEND_PRI_HIGH, terminate_session, NULL, [](std::unique_lock<ProfiledMutex> &l, HRESULT result){});
 			peer->state = Peer::PS_CLOSING;
 			
 			closing_peers.push_back(std::make_pair(peer->player_id, peer->player_ctx));
@@ -3060,7 +3558,7 @@ HRESULT DirectPlay8Peer::TerminateSession(void* CONST pvTerminateData, CONST DWO
 		ts.dwTerminateDataSize = dwTerminateDataSize;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_TERMINATE_SESSION, &ts);
+		call_message_handler(DPN_MSGID_TERMINATE_SESSION, &ts);
 		l.lock();
 	}
 	
@@ -3111,6 +3609,18 @@ DirectPlay8Peer::Peer *DirectPlay8Peer::get_peer_by_player_id(DPNID player_id)
 	}
 }
 
+void DirectPlay8Peer::player_stats_add(Peer *peer)
+{
+	std::unique_lock<std::mutex> sl(stats_lock);
+	player_stats[peer->player_id] = peer->stats;
+}
+
+void DirectPlay8Peer::player_stats_remove(DPNID player_id)
+{
+	std::unique_lock<std::mutex> sl(stats_lock);
+	player_stats.erase(player_id);
+}
+
 DirectPlay8Peer::Group *DirectPlay8Peer::get_group_by_id(DPNID group_id)
 {
 	auto gi = groups.find(group_id);
@@ -3125,70 +3635,77 @@ DirectPlay8Peer::Group *DirectPlay8Peer::get_group_by_id(DPNID group_id)
 
 void DirectPlay8Peer::handle_udp_socket_event()
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("handle_udp_socket_event"));
 	
 	if(udp_socket == -1)
 	{
 		return;
 	}
 	
-	struct sockaddr_in from_addr;
-	int fa_len = sizeof(from_addr);
-	
-	unsigned char recv_buf[MAX_PACKET_SIZE];
-	
-	int r = recvfrom(udp_socket, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &fa_len);
-	if(r > 0)
+	/* A shared udp_socket is read by the SharedListener, we only get woken up here to
+	 * send.
+	*/
+	if(shared_listener == NULL)
 	{
-		/* Process message */
-		std::unique_ptr<PacketDeserialiser> pd;
+		struct sockaddr_in from_addr;
+		unsigned char recv_buf[MAX_PACKET_SIZE];
 		
-		try {
-			pd.reset(new PacketDeserialiser(recv_buf, r));
+		int r = transport->recvfrom(udp_socket, recv_buf, sizeof(recv_buf), &from_addr);
+		if(r > 0)
+		{
+			handle_udp_packet(l, recv_buf, r, &from_addr);
 		}
-		catch(const PacketDeserialiser::Error &e)
+	}
+	
+	io_udp_send(l);
+}
+
+void DirectPlay8Peer::handle_udp_packet(std::unique_lock<ProfiledMutex> &l, const void *data, size_t size, const struct sockaddr_in *from_addr)
+{
+	/* Process message */
+	std::unique_ptr<PacketDeserialiser> pd;
+	
+	try {
+		pd.reset(new PacketDeserialiser(data, size));
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		/* Malformed packet received */
+		return;
+	}
+	
+	switch(pd->packet_type())
+	{
+		case DPLITE_MSGID_HOST_ENUM_REQUEST:
 		{
-			/* Malformed packet received */
-			return;
+			handle_host_enum_request(l, *pd, from_addr);
+			break;
 		}
 		
-		switch(pd->packet_type())
+		default:
 		{
-			case DPLITE_MSGID_HOST_ENUM_REQUEST:
-			{
-				handle_host_enum_request(l, *pd, &from_addr);
-				break;
-			}
+			char s_ip[16];
+			inet_ntop(AF_INET, &(from_addr->sin_addr), s_ip, sizeof(s_ip));
 			
-			default:
-			{
-				char s_ip[16];
-				inet_ntop(AF_INET, &(from_addr.sin_addr), s_ip, sizeof(s_ip));
-				
-				log_printf(
-					"Unexpected message type %u received on udp_socket from %s",
-					(unsigned)(pd->packet_type()), s_ip);
-				
-				break;
-			}
+			log_printf(
+				"Unexpected message type %u received on udp_socket from %s",
+				(unsigned)(pd->packet_type()), s_ip);
+			
+			break;
 		}
 	}
-	
-	io_udp_send(l);
 }
 
 void DirectPlay8Peer::handle_other_socket_event()
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("handle_other_socket_event"));
 	
 	if(discovery_socket != -1)
 	{
 		struct sockaddr_in from_addr;
-		int fa_len = sizeof(from_addr);
-		
 		unsigned char recv_buf[MAX_PACKET_SIZE];
 		
-		int r = recvfrom(discovery_socket, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &fa_len);
+		int r = transport->recvfrom(discovery_socket, recv_buf, sizeof(recv_buf), &from_addr);
 		if(r > 0)
 		{
 			/* Process message */
@@ -3227,38 +3744,331 @@ void DirectPlay8Peer::handle_other_socket_event()
 	peer_accept(l);
 }
 
+/* Register a handle with the shared worker_pool. The callback holds a reference to pool_ref so
+ * that Close() can tell when it is no longer running.
+*/
+void DirectPlay8Peer::add_pool_handle(HANDLE handle, const std::function<void()> &callback)
+{
+	std::shared_ptr<void> ref = pool_ref;
+	worker_pool->add_handle(handle, [ref, callback]() { callback(); });
+}
+
 void DirectPlay8Peer::queue_work(const std::function<void()> &work)
 {
 	work_queue.push(work);
-	SetEvent(work_ready);
+	
+	/* Only signal work_ready if nobody else has since the last time a worker started
+	 * draining the queue.
+	*/
+	if(!work_signalled.exchange(true))
+	{
+		SetEvent(work_ready);
+	}
 }
 
 void DirectPlay8Peer::handle_work()
 {
-	std::unique_lock<std::mutex> l(lock);
+	/* Clear work_signalled before we start popping, so any work queued after we find the
+	 * queue empty will signal work_ready again.
+	*/
+	work_signalled = false;
+	
+	std::function<void()> work;
+	
+	for(int i = 0; i < WORK_BATCH_SIZE; ++i)
+	{
+		if(!work_queue.pop(work))
+		{
+			return;
+		}
+		
+		work();
+	}
+	
+	/* We've done a full batch and there may be more. Give another thread the rest so other
+	 * handles in the pool get a look in.
+	*/
+	if(!work_signalled.exchange(true))
+	{
+		SetEvent(work_ready);
+	}
+}
+
+void DirectPlay8Peer::keepalive_tick()
+{
+	std::unique_lock<ProfiledMutex> l(lock.at("keepalive_tick"));
+	
+	DWORD now = clock->ticks();
 	
-	if(!work_queue.empty())
+	DWORD ping_interval = keepalive_timeout < RTT_PROBE_INTERVAL ? keepalive_timeout : RTT_PROBE_INTERVAL;
+	DWORD dead_timeout  = keepalive_timeout + (num_send_retries * max_send_retry_interval);
+	
+	/* Always give a peer a couple of chances to answer a ping. */
+	if(dead_timeout < ((ping_interval + KEEPALIVE_TICK) * 2))
+	{
+		dead_timeout = (ping_interval + KEEPALIVE_TICK) * 2;
+	}
+	
+	std::list<unsigned int> dead_peers;
+	
+	for(auto pi = peers.begin(); pi != peers.end(); ++pi)
 	{
-		std::function<void()> work = work_queue.front();
-		work_queue.pop();
+		unsigned int peer_id = pi->first;
+		Peer *peer = pi->second;
 		
-		if(!work_queue.empty())
+		/* Nothing has been received from a peer we are still connecting to, so last_recv
+		 * is when the connection was started.
+		*/
+		if(peer->state == Peer::PS_CONNECTING_PEER && !peer->relay_tried
+			&& (now - peer->last_recv) >= DIRECT_CONNECT_TIMEOUT)
 		{
-			/* Wake up another thread, in case we are heavily loaded and the pool isn't
-			 * keeping up with the events from queue_work()
-			*/
-			SetEvent(work_ready);
+			peer_relay(peer_id);
 		}
 		
-		l.unlock();
+		if(peer->state != Peer::PS_CONNECTED)
+		{
+			continue;
+		}
 		
-		work();
+		if((now - peer->last_recv) >= dead_timeout)
+		{
+			dead_peers.push_back(peer_id);
+			continue;
+		}
+		
+		/* The connection is a stream, so a slow pong has been delayed rather than lost and
+		 * will still give us an RTT sample. Wait for it rather than sending another ping
+		 * which it would be mistaken for the answer to.
+		*/
+		if(peer->ping_outstanding)
+		{
+			continue;
+		}
+		
+		if((now - peer->last_ping) >= ping_interval
+			|| (congestion_control && peer->sent_since_ping && (now - peer->last_ping) >= CC_PROBE_INTERVAL))
+		{
+			PacketSerialiser ping(DPLITE_MSGID_PING);
+			ping.append_dword(now);
+			
+			peer->sq.send_timed(SendQueue::SEND_PRI_HIGH, ping, NULL, 0,
+				[this, peer_id](std::unique_lock<ProfiledMutex> &l, HRESULT result, const SendQueue::SendOp &op)
+				{
+					Peer *peer = get_peer_by_peer_id(peer_id);
+					if(peer != NULL && result == S_OK)
+					{
+						peer->ping_sent_at = op.get_completed_at();
+					}
+				});
+			
+			peer->last_ping        = now;
+			peer->ping_outstanding = true;
+			peer->ping_sent_at     = 0;
+			peer->sent_since_ping  = false;
+		}
+	}
+	
+	/* peer_destroy() releases the lock to raise DPN_MSGID_DESTROY_PLAYER, so any of the
+	 * peers may have gone away by the time we get to them.
+	*/
+	for(auto di = dead_peers.begin(); di != dead_peers.end(); ++di)
+	{
+		Peer *peer = get_peer_by_peer_id(*di);
+		if(peer == NULL || peer->state != Peer::PS_CONNECTED)
+		{
+			continue;
+		}
+		
+		log_printf("Nothing received from peer %u for %u ms, dropping connection",
+			*di, (unsigned)(now - peer->last_recv));
+		
+		peer_destroy(l, *di, DPNERR_CONNECTIONLOST, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+	}
+}
+
+void DirectPlay8Peer::pace_wait(unsigned int peer_id, SendQueue::Timestamp ready_at)
+{
+	paced_peers.insert(peer_id);
+	
+	if(pace_timer_due == 0 || ready_at < pace_timer_due)
+	{
+		clock->set_timer(pace_timer, ready_at);
+		pace_timer_due = ready_at;
+	}
+}
+
+void DirectPlay8Peer::handle_pace_timer()
+{
+	std::unique_lock<ProfiledMutex> l(lock.at("handle_pace_timer"));
+	
+	pace_timer_due = 0;
+	
+	/* Just wake up every waiting peer, any which still can't send will go back on the
+	 * list and re-arm the timer.
+	*/
+	for(auto pi = paced_peers.begin(); pi != paced_peers.end(); ++pi)
+	{
+		Peer *peer = get_peer_by_peer_id(*pi);
+		if(peer != NULL)
+		{
+			SetEvent(peer->event);
+		}
+	}
+	
+	paced_peers.clear();
+}
+
+/* Returns the rate sends to the given peer should be paced at, the lower of any limit set
+ * using SetCaps() and the rate picked by the congestion controller (if enabled). Zero means
+ * no limit.
+*/
+DWORD DirectPlay8Peer::peer_send_rate(Peer *peer)
+{
+	DWORD rate = max_player_send_rate;
+	
+	if(congestion_control)
+	{
+		DWORD cc_rate = peer->cc.get_rate();
+		
+		if(rate == 0 || cc_rate < rate)
+		{
+			rate = cc_rate;
+		}
+	}
+	
+	return rate;
+}
+
+/* Returns the period keepalive_timer should run at, in milliseconds. */
+DWORD DirectPlay8Peer::keepalive_period() const
+{
+	return congestion_control ? CC_PROBE_INTERVAL : KEEPALIVE_TICK;
+}
+
+/* Returns the dwSystemBufferSize to report from GetSPCaps(), the SO_SNDBUF size of our
+ * sockets, or DEFAULT_SYSTEM_BUFFER_SIZE when left to the system.
+*/
+DWORD DirectPlay8Peer::reported_buffer_size() const
+{
+	SocketOptions options = get_socket_options();
+	
+	return options.send_buffer != 0 ? options.send_buffer : DEFAULT_SYSTEM_BUFFER_SIZE;
+}
+
+SocketOptions DirectPlay8Peer::get_socket_options() const
+{
+	return SocketOptions::from_profile(socket_profile, system_buffer_size);
+}
+
+/* Applies the current socket options to any sockets which already exist. Buffer sizes and
+ * IP_TOS which the new profile leaves at the system default aren't reset on them.
+*/
+void DirectPlay8Peer::apply_session_socket_options()
+{
+	SocketOptions options = get_socket_options();
+	
+	/* A shared udp_socket keeps the options of the session which created it. */
+	if(udp_socket != -1 && shared_listener == NULL)
+	{
+		transport->apply_socket_options(udp_socket, false, options);
+	}
+	
+	if(listener_socket != -1)
+	{
+		transport->apply_socket_options(listener_socket, true, options);
+	}
+	
+	for(auto pi = peers.begin(); pi != peers.end(); ++pi)
+	{
+		transport->apply_socket_options(pi->second->sock, true, options);
 	}
 }
 
+/* Returns true if a non-guaranteed message to the given peer should be dropped rather than
+ * added to its send queue because the queue is already backed up.
+*/
+bool DirectPlay8Peer::send_backlogged(Peer *peer, DWORD send_flags)
+{
+	if(send_flags & (DPNSEND_GUARANTEED | DPNSEND_PRIORITY_HIGH))
+	{
+		return false;
+	}
+	
+	DWORD rate = max_player_send_rate;
+	if(rate == 0 || (max_send_rate != 0 && max_send_rate < rate))
+	{
+		rate = max_send_rate;
+	}
+	
+	if(rate == 0)
+	{
+		/* No rate limits, so the queue only backs up as far as the socket does. */
+		return false;
+	}
+	
+	DWORD percent = (send_flags & DPNSEND_PRIORITY_LOW)
+		? drop_threshold_rate
+		: throttle_rate;
+	
+	return peer->sq.get_queued_bytes() > (((unsigned long long)(rate) * percent) / 100);
+}
+
+/* Queues a message which is too big for a single DPLITE_MSGID_MESSAGE to a peer as a series
+ * of DPLITE_MSGID_MESSAGE_FRAGMENT messages. Only the first fragment is queued up front, each
+ * following one is serialised from the shared payload once the previous one has been written
+ * to the socket, so neither the whole message nor all of its fragments are ever held in the
+ * send queue at once.
+ *
+ * The callback is invoked once, after the final fragment has been sent. If the send is
+ * cancelled or the peer goes away, the remaining fragments are never produced.
+*/
+void DirectPlay8Peer::send_fragmented(Peer *peer, SendQueue::SendPriority priority, DWORD msg_id, const std::shared_ptr<const std::vector<unsigned char>> &payload, DWORD flags, DPNHANDLE async_handle, const SendQueue::TimedCallback &callback)
+{
+	DWORD from_player_id = local_player_id;
+	
+	auto serialise_fragment = [from_player_id, msg_id, payload, flags](size_t offset)
+	{
+		size_t fragment_size = payload->size() - offset;
+		if(fragment_size > MAX_FRAGMENT_SIZE)
+		{
+			fragment_size = MAX_FRAGMENT_SIZE;
+		}
+		
+		PacketSerialiser fragment(DPLITE_MSGID_MESSAGE_FRAGMENT);
+		
+		fragment.append_dword(from_player_id);
+		fragment.append_dword(msg_id);
+		fragment.append_dword(payload->size());
+		fragment.append_dword(offset);
+		fragment.append_data(payload->data() + offset, fragment_size);
+		fragment.append_dword(flags);
+		
+		return fragment;
+	};
+	
+	size_t next_offset = MAX_FRAGMENT_SIZE;
+	
+	peer->sq.send_streamed(priority, serialise_fragment(0), async_handle,
+		[serialise_fragment, payload, next_offset](std::vector<unsigned char> &data) mutable
+		{
+			if(next_offset >= payload->size())
+			{
+				return false;
+			}
+			
+			PacketSerialiser fragment = serialise_fragment(next_offset);
+			
+			std::pair<const void*, size_t> raw = fragment.raw_packet();
+			data.assign((const unsigned char*)(raw.first), (const unsigned char*)(raw.first) + raw.second);
+			
+			next_offset += MAX_FRAGMENT_SIZE;
+			return true;
+		}, callback);
+}
+
 void DirectPlay8Peer::io_peer_triggered(unsigned int peer_id)
 {
-	std::unique_lock<std::mutex> l(lock);
+	std::unique_lock<ProfiledMutex> l(lock.at("io_peer_triggered"));
 	
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	if(peer == NULL)
@@ -3277,13 +4087,94 @@ void DirectPlay8Peer::io_peer_triggered(unsigned int peer_id)
 		assert(state == STATE_CONNECTING_TO_PEERS);
 		io_peer_connected(l, peer_id);
 	}
-	else{
-		io_peer_send(l, peer_id);
-		io_peer_recv(l, peer_id);
+	else{
+		io_peer_send(l, peer_id);
+		io_peer_recv(l, peer_id);
+	}
+}
+
+/* Sends message to as many of send_to_peers as the transport can reach with a single
+ * send_multi(), such as those only reachable through the relay, and returns them.
+ *
+ * A peer is only included if its send queue is empty and its pacer would let the message go
+ * now, so the message goes out between any others in its stream, exactly when it would have
+ * done through the send queue.
+*/
+std::set<DirectPlay8Peer::Peer*> DirectPlay8Peer::send_multi(const std::list<Peer*> &send_to_peers, const PacketSerialiser *message, DPNHANDLE async_handle)
+{
+	std::set<Peer*> sent;
+	
+	if(message == NULL)
+	{
+		/* Fragmented, each fragment has to be queued. */
+		return sent;
+	}
+	
+	std::pair<const void*, size_t> raw = message->raw_packet();
+	
+	SendQueue::Timestamp now = clock->now();
+	
+	if(send_pacer.ready_at(raw.second, now) > now)
+	{
+		return sent;
+	}
+	
+	std::vector<Peer*> multi_peers;
+	std::vector<int> multi_socks;
+	
+	for(auto pi = send_to_peers.begin(); pi != send_to_peers.end(); ++pi)
+	{
+		Peer *peer = *pi;
+		
+		if(peer->state != Peer::PS_CONNECTED
+			|| peer->sq.get_pending() != NULL
+			|| !transport->can_send_multi(peer->sock))
+		{
+			continue;
+		}
+		
+		DWORD rate = peer_send_rate(peer);
+		if(peer->pacer.get_rate() != rate)
+		{
+			peer->pacer.set_rate(rate);
+		}
+		
+		if(peer->pacer.ready_at(raw.second, now) > now)
+		{
+			continue;
+		}
+		
+		multi_peers.push_back(peer);
+		multi_socks.push_back(peer->sock);
+	}
+	
+	/* Nothing is saved by sending to just one. */
+	
+	if(multi_peers.size() < 2
+		|| !transport->send_multi(multi_socks.data(), multi_socks.size(), raw.first, raw.second))
+	{
+		return sent;
+	}
+	
+	send_pacer.consume(raw.second, now);
+	
+	for(auto pi = multi_peers.begin(); pi != multi_peers.end(); ++pi)
+	{
+		Peer *peer = *pi;
+		
+		peer->pacer.consume(raw.second, now);
+		peer->sent_since_ping = true;
+		
+		auto p2p = player_to_peer_id.find(peer->player_id);
+		TRACE_POINT(TE_WIRE_WRITE, (p2p != player_to_peer_id.end() ? p2p->second : 0), DPLITE_MSGID_MESSAGE, raw.second, async_handle);
+		
+		sent.insert(peer);
 	}
+	
+	return sent;
 }
 
-void DirectPlay8Peer::io_udp_send(std::unique_lock<std::mutex> &l)
+void DirectPlay8Peer::io_udp_send(std::unique_lock<ProfiledMutex> &l)
 {
 	SendQueue::SendOp *sqop;
 	
@@ -3292,7 +4183,7 @@ void DirectPlay8Peer::io_udp_send(std::unique_lock<std::mutex> &l)
 		std::pair<const void*, size_t>            data = sqop->get_data();
 		std::pair<const struct sockaddr*, size_t> addr = sqop->get_dest_addr();
 		
-		int s = sendto(udp_socket, (const char*)(data.first), data.second, 0, addr.first, addr.second);
+		int s = transport->sendto(udp_socket, data.first, data.second, addr.first, addr.second);
 		if(s == -1)
 		{
 			DWORD err = WSAGetLastError();
@@ -3321,15 +4212,14 @@ void DirectPlay8Peer::io_udp_send(std::unique_lock<std::mutex> &l)
 	}
 }
 
-void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigned int peer_id)
+void DirectPlay8Peer::io_peer_connected(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
 	
 	int error;
-	int esize = sizeof(error);
 	
-	if(getsockopt(peer->sock, SOL_SOCKET, SO_ERROR, (char*)(&error), &esize) != 0)
+	if(transport->get_socket_error(peer->sock, &error) != 0)
 	{
 		log_printf("getsockopt(level = SOL_SOCKET, optname = SO_ERROR) failed");
 		connect_fail(l, DPNERR_GENERIC, NULL, 0);
@@ -3343,6 +4233,8 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 		
 		if(peer->state == Peer::PS_CONNECTING_HOST)
 		{
+			join_timing.host_connected = clock->now();
+			
 			PacketSerialiser connect_host(DPLITE_MSGID_CONNECT_HOST);
 			
 			if(instance_guid != GUID_NULL)
@@ -3373,16 +4265,19 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 			
 			connect_host.append_wstring(local_player_name);
 			connect_host.append_data(local_player_data.data(), local_player_data.size());
+			connect_host.append_dword(role == ROLE_CLIENT ? DPLITE_CONNECT_AS_CLIENT : DPLITE_CONNECT_AS_PEER);
 			
 			peer->sq.send(SendQueue::SEND_PRI_MEDIUM,
 				connect_host,
 				NULL,
-				[](std::unique_lock<std::mutex> &l, HRESULT result){});
+				[](std::unique_lock<ProfiledMutex> &l, HRESULT result){});
 			
 			peer->state = Peer::PS_REQUESTING_HOST;
 		}
 		else if(peer->state == Peer::PS_CONNECTING_PEER)
 		{
+			join_timing.peers_connected = clock->now();
+			
 			PacketSerialiser connect_peer(DPLITE_MSGID_CONNECT_PEER);
 			
 			connect_peer.append_guid(instance_guid);
@@ -3396,7 +4291,7 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 			peer->sq.send(SendQueue::SEND_PRI_HIGH,
 				connect_peer,
 				NULL,
-				[](std::unique_lock<std::mutex> &l, HRESULT result){});
+				[](std::unique_lock<ProfiledMutex> &l, HRESULT result){});
 			
 			peer->state = Peer::PS_REQUESTING_PEER;
 		}
@@ -3412,12 +4307,15 @@ void DirectPlay8Peer::io_peer_connected(std::unique_lock<std::mutex> &l, unsigne
 		}
 		else if(peer->state == Peer::PS_CONNECTING_PEER)
 		{
-			connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
+			if(!peer_relay(peer_id))
+			{
+				connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
+			}
 		}
 	}
 }
 
-void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int peer_id)
+void DirectPlay8Peer::io_peer_send(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id)
 {
 	Peer *peer;
 	SendQueue::SendOp *sqop;
@@ -3428,7 +4326,34 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 		{
 			std::pair<const void*, size_t> d = sqop->get_pending_data();
 			
-			int s = send(peer->sock, (const char*)(d.first), d.second, 0);
+			DWORD rate = peer_send_rate(peer);
+			if(peer->pacer.get_rate() != rate)
+			{
+				peer->pacer.set_rate(rate);
+			}
+			
+			SendQueue::Timestamp now      = clock->now();
+			SendQueue::Timestamp ready_at = peer->pacer.ready_at(d.second, now);
+			SendQueue::Timestamp i_ready  = send_pacer.ready_at(d.second, now);
+			
+			if(ready_at > now)
+			{
+				peer->rate_limited = true;
+			}
+			
+			if(i_ready > ready_at)
+			{
+				ready_at = i_ready;
+			}
+			
+			if(ready_at > now)
+			{
+				/* Rate limited. pace_timer will wake us up. */
+				pace_wait(peer_id, ready_at);
+				break;
+			}
+			
+			int s = transport->send(peer->sock, d.first, d.second);
 			
 			if(s < 0)
 			{
@@ -3452,8 +4377,21 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 			
 			sqop->inc_sent_data(s);
 			
+			TRACE_POINT(TE_WIRE_WRITE, peer_id, ((const TLVChunk*)(sqop->get_data().first))->type, s, sqop->async_handle);
+			
+			peer->pacer.consume(s, now);
+			send_pacer.consume(s, now);
+			
+			peer->sent_since_ping = true;
+			
 			if(s == d.second)
 			{
+				if(peer->sq.continue_pending(sqop))
+				{
+					/* Streamed message has another packet to go out. */
+					continue;
+				}
+				
 				peer->sq.pop_pending(sqop);
 				
 				if(peer->sq.get_pending() != NULL)
@@ -3480,7 +4418,7 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 				 * a hard close once it receives our EOF.
 				*/
 				
-				if(shutdown(peer->sock, SD_SEND) != 0)
+				if(transport->shutdown_send(peer->sock) != 0)
 				{
 					DWORD err = WSAGetLastError();
 					log_printf(
@@ -3499,7 +4437,7 @@ void DirectPlay8Peer::io_peer_send(std::unique_lock<std::mutex> &l, unsigned int
 	}
 }
 
-void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int peer_id)
+void DirectPlay8Peer::io_peer_recv(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id)
 {
 	Peer *peer;
 	
@@ -3507,6 +4445,26 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 	
 	while((peer = get_peer_by_peer_id(peer_id)) != NULL)
 	{
+		if(peer->join_pending)
+		{
+			/* Not announced to the application yet, leave anything we have already
+			 * read for join_dispatch_deferred() to hand back to us.
+			*/
+			
+			if(rb_claimed)
+			{
+				/* recv_busy stays set (and FD_READ disabled) so no other thread
+				 * reads from the peer either, until peer_recv_resume().
+				*/
+				peer->recv_buf_preload = peer->recv_buf_cur;
+				peer->recv_buf_cur     = 0;
+				
+				peer->recv_parked = true;
+			}
+			
+			return;
+		}
+		
 		if(!rb_claimed && peer->recv_busy)
 		{
 			/* Another thread is already processing data from this socket.
@@ -3518,8 +4476,23 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 			return;
 		}
 		
-		int r = recv(peer->sock, (char*)(peer->recv_buf) + peer->recv_buf_cur, sizeof(peer->recv_buf) - peer->recv_buf_cur, 0);
-		DWORD err = WSAGetLastError();
+		int r;
+		DWORD err;
+		
+		if(peer->recv_buf_preload > 0)
+		{
+			/* Data read by the SharedListener before handing the connection to us, it
+			 * is already sitting at the start of recv_buf.
+			*/
+			r   = peer->recv_buf_preload;
+			err = 0;
+			
+			peer->recv_buf_preload = 0;
+		}
+		else{
+			r   = transport->recv(peer->sock, peer->recv_buf + peer->recv_buf_cur, sizeof(peer->recv_buf) - peer->recv_buf_cur);
+			err = WSAGetLastError();
+		}
 		
 		if(r < 0 && err == WSAEWOULDBLOCK)
 		{
@@ -3570,6 +4543,7 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 		}
 		
 		peer->recv_buf_cur += r;
+		peer->last_recv     = clock->ticks();
 		
 		while(peer->recv_buf_cur >= sizeof(TLVChunk))
 		{
@@ -3608,6 +4582,8 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 					return;
 				}
 				
+				TRACE_POINT(TE_RECV_DECODE, peer_id, pd->packet_type(), full_packet_size, 0);
+				
 				switch(pd->packet_type())
 				{
 					case DPLITE_MSGID_CONNECT_HOST:
@@ -3634,6 +4610,12 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 						break;
 					}
 					
+					case DPLITE_MSGID_MESSAGE_FRAGMENT:
+					{
+						handle_message_fragment(l, peer_id, *pd);
+						break;
+					}
+					
 					case DPLITE_MSGID_PLAYERINFO:
 					{
 						handle_playerinfo(l, peer_id, *pd);
@@ -3724,6 +4706,24 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 						break;
 					}
 					
+					case DPLITE_MSGID_HOST_MIGRATE:
+					{
+						handle_host_migrate(l, peer_id, *pd);
+						break;
+					}
+					
+					case DPLITE_MSGID_PING:
+					{
+						handle_ping(l, peer_id, *pd);
+						break;
+					}
+					
+					case DPLITE_MSGID_PONG:
+					{
+						handle_pong(l, peer_id, *pd);
+						break;
+					}
+					
 					default:
 						log_printf(
 							"Unexpected message type %u received from peer %u",
@@ -3740,6 +4740,12 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 				memmove(peer->recv_buf, peer->recv_buf + full_packet_size,
 					peer->recv_buf_cur - full_packet_size);
 				peer->recv_buf_cur -= full_packet_size;
+				
+				if(peer->join_pending)
+				{
+					/* Picked up by the check at the top of the outer loop. */
+					break;
+				}
 			}
 			else{
 				/* Haven't read the full message yet. */
@@ -3755,7 +4761,7 @@ void DirectPlay8Peer::io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int
 	}
 }
 
-void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
+void DirectPlay8Peer::peer_accept(std::unique_lock<ProfiledMutex> &l)
 {
 	if(listener_socket == -1)
 	{
@@ -3763,9 +4769,8 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 	}
 	
 	struct sockaddr_in addr;
-	int addrlen = sizeof(addr);
 	
-	int newfd = accept(listener_socket, (struct sockaddr*)(&addr), &addrlen);
+	int newfd = transport->accept(listener_socket, &addr);
 	if(newfd == -1)
 	{
 		DWORD err = WSAGetLastError();
@@ -3781,55 +4786,37 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 		}
 	}
 	
-	struct linger li;
-	li.l_onoff = 0;
-	li.l_linger = 0;
-	
-	if(setsockopt(newfd, SOL_SOCKET, SO_LINGER, (char*)(&li), sizeof(li)) != 0)
-	{
-		DWORD err = WSAGetLastError();
-		log_printf("Failed to set SO_LINGER parameters on accepted connection: %s", win_strerror(err).c_str());
-		
-		/* Not fatal, since this probably won't matter in production. */
-	}
-	
-	u_long non_blocking = 1;
-	if(ioctlsocket(newfd, FIONBIO, &non_blocking) != 0)
+	peer_accept_socket(newfd, &addr);
+}
+
+/* Sets up a Peer for a newly accepted connection. Any data which has already been read from
+ * the socket is copied into the start of its receive buffer and processed as if it had just
+ * been received.
+*/
+void DirectPlay8Peer::peer_accept_socket(int newfd, const struct sockaddr_in *addr, const void *data, size_t data_size)
+{
+	if(!transport->setup_accepted_socket(newfd, get_socket_options()))
 	{
-		DWORD err = WSAGetLastError();
-		log_printf("Failed to set accepted connection to non-blocking mode: %s", win_strerror(err).c_str());
-		log_printf("Closing connection");
-		
-		closesocket(newfd);
 		return;
 	}
 	
-	/* Set SO_LINGER so that closesocket() does a hard close, immediately removing the socket
-	 * address from the connection table.
-	 *
-	 * If this isn't done, then we are able to immediately bind() new sockets to the same
-	 * local address (as we may when the port isn't specified), but then outgoing connections
-	 * made from it will fail with WSAEADDRINUSE until the background close completes.
-	*/
-	
-	struct linger no_linger;
-	no_linger.l_onoff  = 1;
-	no_linger.l_linger = 0;
+	unsigned int peer_id = next_peer_id++;
+	Peer *peer = new Peer(transport, clock, Peer::PS_ACCEPTED, newfd, addr->sin_addr.s_addr, ntohs(addr->sin_port));
+	peer->sq.set_trace_peer(peer_id);
 	
-	if(setsockopt(newfd, SOL_SOCKET, SO_LINGER, (char*)(&no_linger), sizeof(no_linger)) != 0)
+	if(data_size > 0)
 	{
-		DWORD err = WSAGetLastError();
-		log_printf("Failed to set SO_LINGER on accepted connection: %s", win_strerror(err).c_str());
+		assert(data_size <= sizeof(peer->recv_buf));
+		
+		memcpy(peer->recv_buf, data, data_size);
+		peer->recv_buf_preload = data_size;
 	}
 	
-	unsigned int peer_id = next_peer_id++;
-	Peer *peer = new Peer(Peer::PS_ACCEPTED, newfd, addr.sin_addr.s_addr, ntohs(addr.sin_port));
-	
 	if(!peer->enable_events(FD_READ | FD_WRITE | FD_CLOSE))
 	{
 		log_printf("WSAEventSelect() failed, dropping peer");
 		
-		closesocket(peer->sock);
+		transport->close(peer->sock);
 		delete peer;
 		
 		return;
@@ -3837,25 +4824,53 @@ void DirectPlay8Peer::peer_accept(std::unique_lock<std::mutex> &l)
 	
 	peers.insert(std::make_pair(peer_id, peer));
 	
-	worker_pool->add_handle(peer->event, [this, peer_id]() { io_peer_triggered(peer_id); });
+	add_pool_handle(peer->event, [this, peer_id]() { io_peer_triggered(peer_id); });
+	
+	if(data_size > 0)
+	{
+		/* Nothing else will wake us up if there is no more data coming. */
+		SetEvent(peer->event);
+	}
+}
+
+/* Hand the receive side of a peer parked by io_peer_recv() while it was waiting to be
+ * announced back to the worker threads.
+*/
+void DirectPlay8Peer::peer_recv_resume(Peer *peer)
+{
+	if(!peer->recv_parked)
+	{
+		return;
+	}
+	
+	peer->recv_parked = false;
+	peer->recv_busy   = false;
+	
+	peer->enable_events(FD_READ | FD_CLOSE);
+	
+	/* Anything io_peer_recv() had already read is waiting in the preload, nothing else
+	 * will wake us up for it.
+	*/
+	SetEvent(peer->event);
 }
 
 bool DirectPlay8Peer::peer_connect(Peer::PeerState initial_state, uint32_t remote_ip, uint16_t remote_port, DPNID player_id)
 {
-	int p_sock = create_client_socket(local_ip, local_port);
+	int p_sock = transport->create_client_socket(local_ip, local_port, get_socket_options());
 	if(p_sock == -1)
 	{
 		return false;
 	}
 	
 	unsigned int peer_id = next_peer_id++;
-	Peer *peer = new Peer(initial_state, p_sock, remote_ip, remote_port);
+	Peer *peer = new Peer(transport, clock, initial_state, p_sock, remote_ip, remote_port);
+	peer->sq.set_trace_peer(peer_id);
 	
 	peer->player_id = player_id;
 	
 	if(!peer->enable_events(FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE))
 	{
-		closesocket(peer->sock);
+		transport->close(peer->sock);
 		delete peer;
 		
 		return false;
@@ -3871,9 +4886,9 @@ bool DirectPlay8Peer::peer_connect(Peer::PeerState initial_state, uint32_t remot
 	
 	log_printf("Initiating connection to %s:%d as peer_id %u", s_ip, (int)(remote_port), peer_id);
 	
-	if(connect(peer->sock, (struct sockaddr*)(&r_addr), sizeof(r_addr)) != -1 || WSAGetLastError() != WSAEWOULDBLOCK)
+	if(transport->connect(peer->sock, &r_addr) != -1 || WSAGetLastError() != WSAEWOULDBLOCK)
 	{
-		closesocket(peer->sock);
+		transport->close(peer->sock);
 		delete peer;
 		
 		return false;
@@ -3881,12 +4896,58 @@ bool DirectPlay8Peer::peer_connect(Peer::PeerState initial_state, uint32_t remot
 	
 	peers.insert(std::make_pair(peer_id, peer));
 	
-	worker_pool->add_handle(peer->event, [this, peer_id]() { io_peer_triggered(peer_id); });
+	add_pool_handle(peer->event, [this, peer_id]() { io_peer_triggered(peer_id); });
+	
+	return true;
+}
+
+/* Replaces the socket of a peer in PS_CONNECTING_PEER with a connection to the same player
+ * through the transport's relay. Returns false if the transport has no relay, or it has
+ * already been tried.
+*/
+bool DirectPlay8Peer::peer_relay(unsigned int peer_id)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	assert(peer->state == Peer::PS_CONNECTING_PEER);
+	
+	if(peer->relay_tried)
+	{
+		return false;
+	}
+	
+	peer->relay_tried = true;
+	
+	int r_sock = transport->connect_player(peer->player_id, get_socket_options());
+	if(r_sock == -1)
+	{
+		DWORD err = WSAGetLastError();
+		
+		if(err != WSAEOPNOTSUPP)
+		{
+			log_printf("Unable to relay connection to player %u: %s",
+				(unsigned)(peer->player_id), win_strerror(err).c_str());
+		}
+		
+		return false;
+	}
+	
+	log_printf("Connecting to player %u through the relay as peer_id %u",
+		(unsigned)(peer->player_id), peer_id);
+	
+	/* The direct attempt mustn't wake us up with its result after this. */
+	peer->disable_events(peer->events);
+	transport->close(peer->sock);
+	ResetEvent(peer->event);
+	
+	peer->sock = r_sock;
+	
+	peer->enable_events(FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE);
 	
 	return true;
 }
 
-void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason)
+void DirectPlay8Peer::peer_destroy(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -3909,7 +4970,7 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 	{
 		auto ai = peer->pending_acks.begin();
 		
-		std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> callback = ai->second;
+		std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const void*, size_t)> callback = ai->second;
 		peer->pending_acks.erase(ai);
 		
 		callback(l, outstanding_op_result, NULL, 0);
@@ -3917,7 +4978,18 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 		RENEW_PEER_OR_RETURN();
 	}
 	
-	if(peer->state == Peer::PS_CONNECTED)
+	if(peer->state == Peer::PS_CONNECTED && peer->join_pending)
+	{
+		/* The application was never told about this player, so don't tell it that the
+		 * player has gone either. join_dispatch_deferred() skips the peer once it is gone.
+		*/
+		
+		peer->state = Peer::PS_CLOSING;
+		
+		player_to_peer_id.erase(peer->player_id);
+		player_stats_remove(peer->player_id);
+	}
+	else if(peer->state == Peer::PS_CONNECTED)
 	{
 		DPNID killed_player_id = peer->player_id;
 		
@@ -3931,15 +5003,23 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 		dispatch_destroy_player(l, peer->player_id, peer->player_ctx, destroy_player_reason);
 		
 		player_to_peer_id.erase(killed_player_id);
+		player_stats_remove(killed_player_id);
 		
-		if(state == STATE_CONNECTED && killed_player_id == host_player_id)
+		if(state == STATE_CONNECTED && killed_player_id == host_player_id && (session_flags & DPNSESSION_MIGRATE_HOST))
+		{
+			/* The connection to the host has been lost, but the session permits the
+			 * host to migrate. Every remaining peer elects the same new host from the
+			 * players it knows about, so no negotiation is required.
+			*/
+			
+			host_migrated(l, elect_new_host());
+		}
+		else if(state == STATE_CONNECTED && killed_player_id == host_player_id)
 		{
 			/* The connection to the host has been lost. We need to raise a
 			 * DPNMSG_TERMINATE_SESSION and dump all the other peers. We don't return
 			 * to STATE_INITIALISED because the application is still expected to call
 			 * IDirectPlay8Peer::Close() after receiving DPNMSG_TERMINATE_SESSION.
-			 *
-			 * TODO: Implement host migration here.
 			*/
 			
 			DPNMSG_TERMINATE_SESSION ts;
@@ -3953,7 +5033,7 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 			state = STATE_TERMINATED;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_TERMINATE_SESSION, &ts);
+			call_message_handler(DPN_MSGID_TERMINATE_SESSION, &ts);
 			l.lock();
 			
 			dispatch_destroy_player(l, local_player_id, local_player_ctx, DPNDESTROYPLAYERREASON_NORMAL);
@@ -3982,7 +5062,7 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 	
 	worker_pool->remove_handle(peer->event);
 	
-	closesocket(peer->sock);
+	transport->close(peer->sock);
 	
 	peers.erase(peer_id);
 	delete peer;
@@ -3990,7 +5070,7 @@ void DirectPlay8Peer::peer_destroy(std::unique_lock<std::mutex> &l, unsigned int
 	peer_destroyed.notify_all();
 }
 
-void DirectPlay8Peer::peer_destroy_all(std::unique_lock<std::mutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason)
+void DirectPlay8Peer::peer_destroy_all(std::unique_lock<ProfiledMutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason)
 {
 	while(!peers.empty())
 	{
@@ -3999,7 +5079,7 @@ void DirectPlay8Peer::peer_destroy_all(std::unique_lock<std::mutex> &l, HRESULT
 	}
 }
 
-void DirectPlay8Peer::peer_shutdown(std::unique_lock<std::mutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason)
+void DirectPlay8Peer::peer_shutdown(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4013,9 +5093,17 @@ void DirectPlay8Peer::peer_shutdown(std::unique_lock<std::mutex> &l, unsigned in
 		peer->state = Peer::PS_CLOSING;
 		SetEvent(peer->event);
 		
-		dispatch_destroy_player(l, peer->player_id, peer->player_ctx, destroy_player_reason);
+		if(peer->join_pending)
+		{
+			/* Never announced, just let it drain. */
+			peer_recv_resume(peer);
+		}
+		else{
+			dispatch_destroy_player(l, peer->player_id, peer->player_ctx, destroy_player_reason);
+		}
 		
-		player_to_peer_id.erase(peer_id);
+		player_to_peer_id.erase(peer->player_id);
+		player_stats_remove(peer->player_id);
 	}
 	else if(peer->state == Peer::PS_CLOSING)
 	{
@@ -4027,7 +5115,7 @@ void DirectPlay8Peer::peer_shutdown(std::unique_lock<std::mutex> &l, unsigned in
 	}
 }
 
-void DirectPlay8Peer::peer_shutdown_all(std::unique_lock<std::mutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason)
+void DirectPlay8Peer::peer_shutdown_all(std::unique_lock<ProfiledMutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason)
 {
 	for(auto p = peers.begin(); p != peers.end();)
 	{
@@ -4059,7 +5147,7 @@ void DirectPlay8Peer::peer_shutdown_all(std::unique_lock<std::mutex> &l, HRESULT
 	}
 }
 
-void DirectPlay8Peer::group_destroy_all(std::unique_lock<std::mutex> &l, DWORD dwReason)
+void DirectPlay8Peer::group_destroy_all(std::unique_lock<ProfiledMutex> &l, DWORD dwReason)
 {
 	for(std::map<DPNID, Group>::iterator g; (g = groups.begin()) != groups.end();)
 	{
@@ -4080,24 +5168,197 @@ void DirectPlay8Peer::close_main_sockets()
 {
 	if(discovery_socket != -1)
 	{
-		closesocket(discovery_socket);
+		transport->close(discovery_socket);
 		discovery_socket = -1;
 	}
 	
-	if(listener_socket != -1)
-	{
-		closesocket(listener_socket);
-		listener_socket = -1;
-	}
+	if(listener_socket != -1)
+	{
+		transport->close(listener_socket);
+		listener_socket = -1;
+	}
+	
+	if(shared_listener != NULL)
+	{
+		/* The sockets belong to the SharedListener, which we can't release until Close()
+		 * has dropped the lock. Just stop it passing us anything else.
+		*/
+		shared_listener->remove(shared_listener_id);
+		udp_socket = -1;
+	}
+	else if(udp_socket != -1)
+	{
+		transport->close(udp_socket);
+		udp_socket = -1;
+	}
+	
+	/* Relayed connections to peers are left to close down like any others. */
+	transport->session_left();
+}
+
+void DirectPlay8Peer::adopt_connection(int sock, const struct sockaddr_in *addr, const void *data, size_t data_size)
+{
+	std::unique_lock<ProfiledMutex> l(lock.at("adopt_connection"));
+	
+	if(state != STATE_HOSTING || shared_listener == NULL)
+	{
+		/* Closed since the SharedListener picked us. */
+		transport->close(sock);
+		return;
+	}
+	
+	peer_accept_socket(sock, addr, data, data_size);
+}
+
+void DirectPlay8Peer::shared_udp_recv(const void *data, size_t size, const struct sockaddr_in *from_addr)
+{
+	std::unique_lock<ProfiledMutex> l(lock.at("shared_udp_recv"));
+	
+	if(state != STATE_HOSTING || udp_socket == -1)
+	{
+		return;
+	}
+	
+	handle_udp_packet(l, data, size, from_addr);
+	io_udp_send(l);
+}
+
+void DirectPlay8Peer::shared_udp_writable()
+{
+	SetEvent(udp_socket_event);
+}
+
+/* Choose the player which should take over as host of the session.
+ *
+ * The lowest player ID of the remaining fully connected players (including
+ * ourself) wins. Player IDs are allocated in ascending order, so this is the
+ * longest-serving player and every peer in the mesh will pick the same one.
+*/
+DPNID DirectPlay8Peer::elect_new_host()
+{
+	DPNID new_host_id = local_player_id;
+	
+	for(auto pi = peers.begin(); pi != peers.end(); ++pi)
+	{
+		Peer *peer = pi->second;
+		
+		if(peer->state == Peer::PS_CONNECTED
+			&& peer->player_id != host_player_id
+			&& peer->player_id < new_host_id)
+		{
+			new_host_id = peer->player_id;
+		}
+	}
+	
+	return new_host_id;
+}
+
+/* Take over as the host of the session after the previous one went away. */
+void DirectPlay8Peer::become_host(std::unique_lock<ProfiledMutex> &l)
+{
+	assert(state == STATE_CONNECTED);
+	
+	state = STATE_HOSTING;
+	
+	/* The old host will have told us what its next_player_id was when we joined,
+	 * but IDs it allocated since then are only known to us through the players and
+	 * groups they were assigned to, so carry on from the highest of them.
+	*/
+	
+	if(next_player_id <= local_player_id)
+	{
+		next_player_id = local_player_id + 1;
+	}
+	
+	for(auto pi = player_to_peer_id.begin(); pi != player_to_peer_id.end(); ++pi)
+	{
+		if(next_player_id <= pi->first)
+		{
+			next_player_id = pi->first + 1;
+		}
+	}
+	
+	for(auto gi = groups.begin(); gi != groups.end(); ++gi)
+	{
+		if(next_player_id <= gi->first)
+		{
+			next_player_id = gi->first + 1;
+		}
+	}
+	
+	for(auto di = destroyed_groups.begin(); di != destroyed_groups.end(); ++di)
+	{
+		if(next_player_id <= *di)
+		{
+			next_player_id = *di + 1;
+		}
+	}
+	
+	if(!(session_flags & DPNSESSION_NODPNSVR) && discovery_socket == -1)
+	{
+		discovery_socket = transport->create_discovery_socket();
+		
+		if(discovery_socket == -1
+			|| transport->event_select(discovery_socket, other_socket_event, FD_READ) != 0)
+		{
+			/* Not fatal, the session just won't show up in EnumHosts() on the
+			 * default port any more.
+			*/
+			
+			log_printf("Unable to open discovery socket after becoming host");
+			
+			if(discovery_socket != -1)
+			{
+				transport->close(discovery_socket);
+				discovery_socket = -1;
+			}
+		}
+	}
+	
+	PacketSerialiser host_migrate(DPLITE_MSGID_HOST_MIGRATE);
+	host_migrate.append_dword(local_player_id);
+	host_migrate.append_dword(next_player_id);
+	
+	for(auto pi = peers.begin(); pi != peers.end(); ++pi)
+	{
+		Peer *peer = pi->second;
+		
+		if(peer->state == Peer::PS_CONNECTED)
+		{
+			peer->sq.send(SendQueue::SEND_PRI_HIGH, host_migrate, NULL,
+				[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
+		}
+	}
+}
+
+/* Switch the session over to a new host and raise DPNMSG_HOST_MIGRATE. */
+void DirectPlay8Peer::host_migrated(std::unique_lock<ProfiledMutex> &l, DPNID new_host_id)
+{
+	log_printf("Host migrating from player %u to player %u",
+		(unsigned)(host_player_id), (unsigned)(new_host_id));
+	
+	host_player_id = new_host_id;
+	
+	DPNMSG_HOST_MIGRATE hm;
+	memset(&hm, 0, sizeof(hm));
 	
-	if(udp_socket != -1)
+	hm.dwSize       = sizeof(hm);
+	hm.dpnidNewHost = new_host_id;
+	
+	if(new_host_id == local_player_id)
 	{
-		closesocket(udp_socket);
-		udp_socket = -1;
+		become_host(l);
+		hm.pvPlayerContext = local_player_ctx;
+	}
+	else{
+		Peer *new_host = get_peer_by_player_id(new_host_id);
+		hm.pvPlayerContext = (new_host != NULL ? new_host->player_ctx : NULL);
 	}
+	
+	dispatch_message(l, DPN_MSGID_HOST_MIGRATE, &hm);
 }
 
-void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, const struct sockaddr_in *from_addr)
+void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<ProfiledMutex> &l, const PacketDeserialiser &pd, const struct sockaddr_in *from_addr)
 {
 	if(state != STATE_HOSTING)
 	{
@@ -4117,6 +5378,32 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 		}
 	}
 	
+	if(!host_enum_allowed(from_addr->sin_addr.s_addr))
+	{
+		return;
+	}
+	
+	DWORD req_tick = pd.get_dword(2);
+	
+	if(enum_flags & DPLITE_ENUM_NOQUERY)
+	{
+		/* The application doesn't want to see the queries, so there's nothing to wait on
+		 * and we can answer straight from the cached response.
+		*/
+		
+		PacketSerialiser host_enum_response(get_host_enum_response());
+		
+		host_enum_response.append_null();
+		host_enum_response.append_dword(req_tick);
+		
+		udp_sq.send(SendQueue::SEND_PRI_MEDIUM,
+			host_enum_response,
+			from_addr,
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result){});
+		
+		return;
+	}
+	
 	DPNMSG_ENUM_HOSTS_QUERY ehq;
 	memset(&ehq, 0, sizeof(ehq));
 	
@@ -4137,10 +5424,8 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 	
 	ehq.dwMaxResponseDataSize = 9999; // TODO
 	
-	DWORD req_tick = pd.get_dword(2);
-	
 	l.unlock();
-	HRESULT ehq_result = message_handler(message_handler_ctx, DPN_MSGID_ENUM_HOSTS_QUERY, &ehq);
+	HRESULT ehq_result = call_message_handler(DPN_MSGID_ENUM_HOSTS_QUERY, &ehq);
 	l.lock();
 	
 	sender_address->Release();
@@ -4162,7 +5447,7 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 		rb.pvUserContext = ehq.pvResponseContext;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_RETURN_BUFFER, &rb);
+		call_message_handler(DPN_MSGID_RETURN_BUFFER, &rb);
 		l.lock();
 		
 		ehq.pvResponseData = response_data_buffer.data();
@@ -4175,22 +5460,7 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 	
 	if(ehq_result == DPN_OK)
 	{
-		PacketSerialiser host_enum_response(DPLITE_MSGID_HOST_ENUM_RESPONSE);
-		
-		host_enum_response.append_dword(password.empty() ? 0 : DPNSESSION_REQUIREPASSWORD);
-		host_enum_response.append_guid(instance_guid);
-		host_enum_response.append_guid(application_guid);
-		host_enum_response.append_dword(max_players);
-		host_enum_response.append_dword(player_to_peer_id.size() + 1);
-		host_enum_response.append_wstring(session_name);
-		
-		if(!application_data.empty())
-		{
-			host_enum_response.append_data(application_data.data(), application_data.size());
-		}
-		else{
-			host_enum_response.append_null();
-		}
+		PacketSerialiser host_enum_response(get_host_enum_response());
 		
 		if(ehq.dwResponseDataSize > 0)
 		{
@@ -4205,14 +5475,97 @@ void DirectPlay8Peer::handle_host_enum_request(std::unique_lock<std::mutex> &l,
 		udp_sq.send(SendQueue::SEND_PRI_MEDIUM,
 			host_enum_response,
 			from_addr,
-			[](std::unique_lock<std::mutex> &l, HRESULT result){});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result){});
 	}
 	else{
 		/* Application rejected the DPNMSG_ENUM_HOSTS_QUERY message. */
 	}
 }
 
-void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+/* Returns true if we may respond to a DPLITE_MSGID_HOST_ENUM_REQUEST from the given address
+ * without exceeding max_enum_response_rate, and counts the response against it.
+*/
+bool DirectPlay8Peer::host_enum_allowed(uint32_t ipaddr)
+{
+	if(max_enum_response_rate == 0)
+	{
+		return true;
+	}
+	
+	DWORD now = clock->ticks();
+	
+	auto si = enum_sources.find(ipaddr);
+	if(si == enum_sources.end())
+	{
+		if(enum_sources.size() >= MAX_ENUM_SOURCES)
+		{
+			auto oldest = enum_sources.find(enum_source_lru.front());
+			
+			if((now - oldest->second.window_start) < 1000)
+			{
+				return false;
+			}
+			
+			enum_source_lru.erase(oldest->second.lru);
+			enum_sources.erase(oldest);
+		}
+		
+		EnumSource source;
+		source.window_start = now;
+		source.responses    = 0;
+		source.lru          = enum_source_lru.insert(enum_source_lru.end(), ipaddr);
+		
+		si = enum_sources.insert(std::make_pair(ipaddr, source)).first;
+	}
+	else if((now - si->second.window_start) >= 1000)
+	{
+		si->second.window_start = now;
+		si->second.responses    = 0;
+		
+		enum_source_lru.splice(enum_source_lru.end(), enum_source_lru, si->second.lru);
+	}
+	
+	if(si->second.responses >= max_enum_response_rate)
+	{
+		return false;
+	}
+	
+	++(si->second.responses);
+	
+	return true;
+}
+
+const PacketSerialiser &DirectPlay8Peer::get_host_enum_response()
+{
+	DWORD players = player_to_peer_id.size() + 1;
+	
+	if(host_enum_response && host_enum_response_players == players)
+	{
+		return *host_enum_response;
+	}
+	
+	host_enum_response.reset(new PacketSerialiser(DPLITE_MSGID_HOST_ENUM_RESPONSE));
+	host_enum_response_players = players;
+	
+	host_enum_response->append_dword((password.empty() ? 0 : DPNSESSION_REQUIREPASSWORD) | (session_flags & (DPNSESSION_MIGRATE_HOST | DPNSESSION_CLIENT_SERVER)));
+	host_enum_response->append_guid(instance_guid);
+	host_enum_response->append_guid(application_guid);
+	host_enum_response->append_dword(max_players);
+	host_enum_response->append_dword(players);
+	host_enum_response->append_wstring(session_name);
+	
+	if(!application_data.empty())
+	{
+		host_enum_response->append_data(application_data.data(), application_data.size());
+	}
+	else{
+		host_enum_response->append_null();
+	}
+	
+	return *host_enum_response;
+}
+
+void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4240,7 +5593,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		peer->sq.send(SendQueue::SEND_PRI_MEDIUM,
 			connect_host_fail,
 			NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 		
 		peer->state = Peer::PS_CLOSING;
 	};
@@ -4271,6 +5624,18 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		return;
 	}
 	
+	/* A client can only join a client/server session and a peer can only join a
+	 * peer-to-peer session.
+	*/
+	
+	DWORD req_interface = pd.get_dword(6);
+	
+	if((req_interface == DPLITE_CONNECT_AS_CLIENT) != (role == ROLE_SERVER))
+	{
+		send_fail(DPNERR_INVALIDINTERFACE, NULL, 0);
+		return;
+	}
+	
 	peer->player_name = pd.get_wstring(4);
 	
 	peer->player_data.clear();
@@ -4309,7 +5674,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 	peer->state = Peer::PS_INDICATING;
 	
 	l.unlock();
-	HRESULT ic_result = message_handler(message_handler_ctx, DPN_MSGID_INDICATE_CONNECT, &ic);
+	HRESULT ic_result = call_message_handler(DPN_MSGID_INDICATE_CONNECT, &ic);
 	l.lock();
 	
 	peer_address->Release();
@@ -4331,7 +5696,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		rb.pvUserContext = ic.pvReplyContext;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_RETURN_BUFFER, &rb);
+		call_message_handler(DPN_MSGID_RETURN_BUFFER, &rb);
 		l.lock();
 		
 		ic.pvReplyData = reply_data_buffer.data();
@@ -4347,46 +5712,54 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		peer->player_ctx = ic.pvPlayerContext;
 		
 		player_to_peer_id[peer->player_id] = peer_id;
+		player_stats_add(peer);
 		
 		peer->state = Peer::PS_CONNECTED;
 		
-		/* Send DPLITE_MSGID_GROUP_DESTROY for each destroyed group. */
-		
-		for(auto di = destroyed_groups.begin(); di != destroyed_groups.end(); ++di)
-		{
-			PacketSerialiser group_destroy(DPLITE_MSGID_GROUP_DESTROY);
-			group_destroy.append_dword(*di);
-			
-			peer->sq.send(SendQueue::SEND_PRI_HIGH, group_destroy, NULL,
-				[](std::unique_lock<std::mutex> &l, HRESULT result) {});
-		}
-		
-		/* Send DPLITE_MSGID_GROUP_CREATE for each group. */
-		
 		std::set<DPNID> member_group_ids;
 		
-		for(auto gi = groups.begin(); gi != groups.end(); ++gi)
+		if(role != ROLE_SERVER)
 		{
-			DPNID group_id = gi->first;
-			Group *group   = &(gi->second);
+			/* Clients in a client/server session only ever talk to the server, so
+			 * they don't need to know about any groups.
+			*/
 			
-			if(destroyed_groups.find(group_id) != destroyed_groups.end())
+			/* Send DPLITE_MSGID_GROUP_DESTROY for each destroyed group. */
+			
+			for(auto di = destroyed_groups.begin(); di != destroyed_groups.end(); ++di)
 			{
-				/* Group is being destroyed. */
-				continue;
+				PacketSerialiser group_destroy(DPLITE_MSGID_GROUP_DESTROY);
+				group_destroy.append_dword(*di);
+				
+				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_destroy, NULL,
+					[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 			}
 			
-			PacketSerialiser group_create(DPLITE_MSGID_GROUP_CREATE);
-			group_create.append_dword(group_id);
-			group_create.append_wstring(group->name);
-			group_create.append_data(group->data.data(), group->data.size());
-			
-			peer->sq.send(SendQueue::SEND_PRI_HIGH, group_create, NULL,
-				[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			/* Send DPLITE_MSGID_GROUP_CREATE for each group. */
 			
-			if(group->player_ids.find(local_player_id) != group->player_ids.end())
+			for(auto gi = groups.begin(); gi != groups.end(); ++gi)
 			{
-				member_group_ids.insert(group_id);
+				DPNID group_id = gi->first;
+				Group *group   = &(gi->second);
+				
+				if(destroyed_groups.find(group_id) != destroyed_groups.end())
+				{
+					/* Group is being destroyed. */
+					continue;
+				}
+				
+				PacketSerialiser group_create(DPLITE_MSGID_GROUP_CREATE);
+				group_create.append_dword(group_id);
+				group_create.append_wstring(group->name);
+				group_create.append_data(group->data.data(), group->data.size());
+				
+				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_create, NULL,
+					[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
+				
+				if(group->player_ids.find(local_player_id) != group->player_ids.end())
+				{
+					member_group_ids.insert(group_id);
+				}
 			}
 		}
 		
@@ -4397,17 +5770,24 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		connect_host_ok.append_dword(host_player_id);
 		connect_host_ok.append_dword(peer->player_id);
 		
-		connect_host_ok.append_dword(player_to_peer_id.size() - 1);
-		
-		for(auto pi = peers.begin(); pi != peers.end(); ++pi)
+		if(role == ROLE_SERVER)
 		{
-			Peer *pip = pi->second;
+			/* Clients never connect to each other. */
+			connect_host_ok.append_dword(0);
+		}
+		else{
+			connect_host_ok.append_dword(player_to_peer_id.size() - 1);
 			
-			if(pip != peer && pip->state == Peer::PS_CONNECTED)
+			for(auto pi = peers.begin(); pi != peers.end(); ++pi)
 			{
-				connect_host_ok.append_dword(pip->player_id);
-				connect_host_ok.append_dword(pip->ip);
-				connect_host_ok.append_dword(pip->port);
+				Peer *pip = pi->second;
+				
+				if(pip != peer && pip->state == Peer::PS_CONNECTED)
+				{
+					connect_host_ok.append_dword(pip->player_id);
+					connect_host_ok.append_dword(pip->ip);
+					connect_host_ok.append_dword(pip->port);
+				}
 			}
 		}
 		
@@ -4434,10 +5814,23 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 			connect_host_ok.append_dword(*i);
 		}
 		
+		connect_host_ok.append_dword(session_flags);
+		connect_host_ok.append_dword(next_player_id);
+		
+		/* Lets the new player onto our relay (if any) as themselves, and nobody else. */
+		GUID relay_token = GUID_NULL;
+		
+		if(role == ROLE_PEER)
+		{
+			transport->admit_player(peer->player_id, &relay_token);
+		}
+		
+		connect_host_ok.append_guid(relay_token);
+		
 		peer->sq.send(SendQueue::SEND_PRI_MEDIUM,
 			connect_host_ok,
 			NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 		
 		DPNMSG_CREATE_PLAYER cp;
 		memset(&cp, 0, sizeof(cp));
@@ -4447,7 +5840,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
 		cp.pvPlayerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_CREATE_PLAYER, &cp);
+		call_message_handler(DPN_MSGID_CREATE_PLAYER, &cp);
 		l.lock();
 		
 		RENEW_PEER_OR_RETURN();
@@ -4475,7 +5868,7 @@ void DirectPlay8Peer::handle_host_connect_request(std::unique_lock<std::mutex> &
  * DATA | NULL - Response data
 */
 
-void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4495,6 +5888,7 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 	
 	peer->player_id = host_player_id;
 	player_to_peer_id[peer->player_id] = peer_id;
+	player_stats_add(peer);
 	
 	local_player_id = pd.get_dword(2);
 	
@@ -4550,15 +5944,35 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		peer_groups.insert(pd.get_dword(after_peers_base + 8 + i));
 	}
 	
+	session_flags  = pd.get_dword(after_peers_base + 8 + peer_group_count);
+	next_player_id = pd.get_dword(after_peers_base + 9 + peer_group_count);
+	
+	GUID relay_token = pd.get_guid(after_peers_base + 10 + peer_group_count);
+	
+	/* Registered with the relay (if any) before connecting to the other peers, so it is
+	 * ready to fall back on by the time one of them turns out to be unreachable.
+	*/
+	if(role == ROLE_PEER)
+	{
+		transport->session_joined(instance_guid, local_player_id, relay_token);
+	}
+	
 	this->application_data.clear();
 	this->application_data.insert(this->application_data.end(),
 		(const unsigned char*)(application_data.first),
 		(const unsigned char*)(application_data.first) + application_data.second);
 	
+	host_enum_response.reset();
+	
 	peer->state = Peer::PS_CONNECTED;
 	
 	state = STATE_CONNECTING_TO_PEERS;
 	
+	join_timing.host_accepted = clock->now();
+	
+	join_dispatching = true;
+	SendQueue::Timestamp callbacks_start = clock->now();
+	
 	{
 		DPNMSG_CREATE_PLAYER cp;
 		memset(&cp, 0, sizeof(cp));
@@ -4568,12 +5982,31 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		cp.pvPlayerContext = local_player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_CREATE_PLAYER, &cp);
+		call_message_handler(DPN_MSGID_CREATE_PLAYER, &cp);
 		l.lock();
 		
 		local_player_ctx = cp.pvPlayerContext;
 	}
 	
+	RENEW_PEER_OR_RETURN();
+	
+	/* Start connecting to the other peers before raising any more messages, so the TCP
+	 * connects and handshakes go on while the application is busy handling them. Any
+	 * peers which finish before we do are announced by join_dispatch_deferred().
+	*/
+	for(DWORD n = 0; n < n_other_peers; ++n)
+	{
+		DPNID    player_id     = pd.get_dword(4 + (n * 3));
+		uint32_t player_ipaddr = pd.get_dword(5 + (n * 3));
+		uint16_t player_port   = pd.get_dword(6 + (n * 3));
+		
+		if(!peer_connect(Peer::PS_CONNECTING_PEER, player_ipaddr, player_port, player_id))
+		{
+			connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
+			return;
+		}
+	}
+	
 	{
 		DPNMSG_CREATE_PLAYER cp;
 		memset(&cp, 0, sizeof(cp));
@@ -4583,7 +6016,7 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		cp.pvPlayerContext = NULL;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_CREATE_PLAYER, &cp);
+		call_message_handler(DPN_MSGID_CREATE_PLAYER, &cp);
 		l.lock();
 		
 		RENEW_PEER_OR_RETURN();
@@ -4626,29 +6059,18 @@ void DirectPlay8Peer::handle_host_connect_ok(std::unique_lock<std::mutex> &l, un
 		ap.pvPlayerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
+		call_message_handler(DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
 		l.lock();
 		
 		RENEW_PEER_OR_RETURN();
 	}
 	
-	for(DWORD n = 0; n < n_other_peers; ++n)
-	{
-		DPNID    player_id     = pd.get_dword(4 + (n * 3));
-		uint32_t player_ipaddr = pd.get_dword(5 + (n * 3));
-		uint16_t player_port   = pd.get_dword(6 + (n * 3));
-		
-		if(!peer_connect(Peer::PS_CONNECTING_PEER, player_ipaddr, player_port, player_id))
-		{
-			connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
-			return;
-		}
-	}
+	join_timing.callbacks += clock->now() - callbacks_start;
 	
-	connect_check(l);
+	join_dispatch_deferred(l);
 }
 
-void DirectPlay8Peer::handle_host_connect_fail(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_host_connect_fail(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4689,7 +6111,7 @@ void DirectPlay8Peer::handle_host_connect_fail(std::unique_lock<std::mutex> &l,
 	connect_fail(l, hResultCode, pvApplicationReplyData, dwApplicationReplyDataSize);
 }
 
-void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_connect_peer(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4709,17 +6131,28 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 		peer->sq.send(SendQueue::SEND_PRI_HIGH,
 			connect_peer_fail,
 			NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 		
 		peer->state = Peer::PS_CLOSING;
 	};
 	
-	if(state != STATE_CONNECTED)
+	/* We may have become the host through migration after the connecting peer got
+	 * the list of players to connect to from the old host.
+	*/
+	
+	if(state != STATE_CONNECTED && state != STATE_HOSTING)
 	{
 		send_fail(DPNERR_GENERIC);
 		return;
 	}
 	
+	if(role != ROLE_PEER)
+	{
+		/* Nobody should be connecting directly to us in a client/server session. */
+		send_fail(DPNERR_INVALIDINTERFACE);
+		return;
+	}
+	
 	if(pd.get_guid(0) != instance_guid)
 	{
 		send_fail(DPNERR_INVALIDINSTANCE);
@@ -4759,6 +6192,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	}
 	
 	player_to_peer_id[peer->player_id] = peer_id;
+	player_stats_add(peer);
 	
 	peer->state = Peer::PS_CONNECTED;
 	
@@ -4770,7 +6204,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 		group_destroy.append_dword(*di);
 		
 		peer->sq.send(SendQueue::SEND_PRI_HIGH, group_destroy, NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 	}
 	
 	/* Send DPLITE_MSGID_GROUP_CREATE for each group. */
@@ -4794,7 +6228,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 		group_create.append_data(group->data.data(), group->data.size());
 		
 		peer->sq.send(SendQueue::SEND_PRI_HIGH, group_create, NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 		
 		if(group->player_ids.find(local_player_id) != group->player_ids.end())
 		{
@@ -4818,7 +6252,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	peer->sq.send(SendQueue::SEND_PRI_HIGH,
 		connect_peer_ok,
 		NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 	
 	DPNMSG_CREATE_PLAYER cp;
 	memset(&cp, 0, sizeof(cp));
@@ -4828,7 +6262,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	cp.pvPlayerContext = NULL;
 	
 	l.unlock();
-	message_handler(message_handler_ctx, DPN_MSGID_CREATE_PLAYER, &cp);
+	call_message_handler(DPN_MSGID_CREATE_PLAYER, &cp);
 	l.lock();
 	
 	RENEW_PEER_OR_RETURN();
@@ -4836,7 +6270,7 @@ void DirectPlay8Peer::handle_connect_peer(std::unique_lock<std::mutex> &l, unsig
 	peer->player_ctx = cp.pvPlayerContext;
 }
 
-void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4873,69 +6307,23 @@ void DirectPlay8Peer::handle_connect_peer_ok(std::unique_lock<std::mutex> &l, un
 	
 	/* player_id initialised in handling of DPLITE_MSGID_CONNECT_HOST_OK. */
 	player_to_peer_id[peer->player_id] = peer_id;
+	player_stats_add(peer);
 	
-	{
-		DPNMSG_CREATE_PLAYER cp;
-		memset(&cp, 0, sizeof(cp));
-		
-		cp.dwSize          = sizeof(cp);
-		cp.dpnidPlayer     = peer->player_id;
-		cp.pvPlayerContext = NULL;
-		
-		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_CREATE_PLAYER, &cp);
-		l.lock();
-		
-		RENEW_PEER_OR_RETURN();
-		
-		peer->player_ctx = cp.pvPlayerContext;
-	}
+	peer->join_groups  = peer_groups;
+	peer->join_pending = true;
 	
-	for(auto g = peer_groups.begin(); g != peer_groups.end(); ++g)
+	join_timing.peers_accepted = clock->now();
+	
+	deferred_joins.push_back(peer_id);
+	
+	if(!join_dispatching)
 	{
-		DPNID group_id = *g;
-		
-		if(destroyed_groups.find(group_id) != destroyed_groups.end())
-		{
-			/* Group is already in the process of being destroyed. */
-			continue;
-		}
-		
-		Group *group = get_group_by_id(group_id);
-		if(group == NULL)
-		{
-			/* Unknown group ID... very rarely normal. */
-			continue;
-		}
-		
-		if(group->player_ids.find(peer->player_id) != group->player_ids.end())
-		{
-			/* Already in group... somehow?! */
-			continue;
-		}
-		
-		group->player_ids.insert(peer->player_id);
-		
-		DPNMSG_ADD_PLAYER_TO_GROUP ap;
-		memset(&ap, 0, sizeof(ap));
-		
-		ap.dwSize          = sizeof(ap);
-		ap.dpnidGroup      = group_id;
-		ap.pvGroupContext  = group->ctx;
-		ap.dpnidPlayer     = peer->player_id;
-		ap.pvPlayerContext = peer->player_ctx;
-		
-		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
-		l.lock();
-		
-		RENEW_PEER_OR_RETURN();
+		join_dispatching = true;
+		join_dispatch_deferred(l);
 	}
-	
-	connect_check(l);
 }
 
-void DirectPlay8Peer::handle_connect_peer_fail(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_connect_peer_fail(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -4963,7 +6351,7 @@ void DirectPlay8Peer::handle_connect_peer_fail(std::unique_lock<std::mutex> &l,
 	connect_fail(l, DPNERR_PLAYERNOTREACHABLE, NULL, 0);
 }
 
-void DirectPlay8Peer::handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_message(std::unique_lock<ProfiledMutex> &l, const PacketDeserialiser &pd)
 {
 	try {
 		DWORD from_player_id = pd.get_dword(0);
@@ -4976,39 +6364,159 @@ void DirectPlay8Peer::handle_message(std::unique_lock<std::mutex> &l, const Pack
 			return;
 		}
 		
-		unsigned char *payload_copy = new unsigned char[payload.second];
-		memcpy(payload_copy, payload.first, payload.second);
-		
-		DPNMSG_RECEIVE r;
-		memset(&r, 0, sizeof(r));
+		unsigned char *payload_copy = recv_pool.get(payload.second);
+		if(payload_copy == NULL)
+		{
+			log_printf("Unable to allocate %u bytes for message from player %u",
+				(unsigned)(payload.second), (unsigned)(from_player_id));
+			return;
+		}
+		
+		if(payload.second > 0)
+		{
+			memcpy(payload_copy, payload.first, payload.second);
+		}
+		
+		deliver_message(l, peer, from_player_id, payload_copy, payload.second, flags);
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		log_printf("Received invalid DPLITE_MSGID_MESSAGE: %s", e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_message_fragment(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DWORD from_player_id = pd.get_dword(0);
+		DWORD msg_id         = pd.get_dword(1);
+		DWORD total_size     = pd.get_dword(2);
+		DWORD offset         = pd.get_dword(3);
+		std::pair<const void*, size_t> fragment = pd.get_data(4);
+		DWORD flags          = pd.get_dword(5);
+		
+		if(peer->state != Peer::PS_CONNECTED || from_player_id != peer->player_id)
+		{
+			log_printf("Received unexpected DPLITE_MSGID_MESSAGE_FRAGMENT from peer %u", peer_id);
+			return;
+		}
+		
+		DWORD slot = flags & (DPNSEND_PRIORITY_HIGH | DPNSEND_PRIORITY_LOW);
+		auto ri = peer->reassembly.find(slot);
+		
+		if(offset == 0)
+		{
+			/* Start of a new message. Anything already in progress at this priority
+			 * was cancelled part way through by the sender and will never complete.
+			*/
+			
+			if(ri != peer->reassembly.end())
+			{
+				peer->reassembly.erase(ri);
+			}
+			
+			/* Anything which fits in one fragment would have been sent as a normal
+			 * DPLITE_MSGID_MESSAGE, and the size came off the wire, so don't trust
+			 * it any further than we have to before allocating a buffer for it.
+			*/
+			if(total_size <= MAX_FRAGMENT_SIZE || total_size > MAX_MESSAGE_SIZE)
+			{
+				log_printf("Received DPLITE_MSGID_MESSAGE_FRAGMENT with invalid total size %u from peer %u",
+					(unsigned)(total_size), peer_id);
+				return;
+			}
+			
+			unsigned char *buffer = recv_pool.get(total_size);
+			if(buffer == NULL)
+			{
+				log_printf("Unable to allocate %u bytes for message from peer %u",
+					(unsigned)(total_size), peer_id);
+				return;
+			}
+			
+			ri = peer->reassembly.insert(std::make_pair(slot,
+				std::unique_ptr<Peer::Reassembly>(new Peer::Reassembly(&recv_pool, buffer, msg_id, total_size)))).first;
+		}
+		else if(ri == peer->reassembly.end()
+			|| ri->second->msg_id != msg_id
+			|| ri->second->total_size != total_size
+			|| ri->second->received != offset)
+		{
+			/* Missed the start of the message, probably because we couldn't allocate
+			 * a buffer for it.
+			*/
+			return;
+		}
+		
+		Peer::Reassembly *ra = ri->second.get();
 		
-		static_assert(sizeof(DPNHANDLE) >= sizeof(unsigned char*),
-			"DPNHANDLE must be large enough to take a pointer");
-		
-		r.dwSize            = sizeof(r);
-		r.dpnidSender       = from_player_id;
-		r.pvPlayerContext   = peer->player_ctx;
-		r.pReceiveData      = payload_copy;
-		r.dwReceiveDataSize = payload.second;
-		r.hBufferHandle     = (DPNHANDLE)(payload_copy);
-		// r.dwReceiveFlags
+		if(fragment.second > (ra->total_size - ra->received))
+		{
+			log_printf("Received over-size DPLITE_MSGID_MESSAGE_FRAGMENT from peer %u", peer_id);
+			
+			peer->reassembly.erase(ri);
+			return;
+		}
 		
-		l.unlock();
-		HRESULT r_result = message_handler(message_handler_ctx, DPN_MSGID_RECEIVE, &r);
-		l.lock();
+		if(fragment.second > 0)
+		{
+			memcpy(ra->buffer + ra->received, fragment.first, fragment.second);
+			ra->received += fragment.second;
+		}
 		
-		if(r_result != DPNSUCCESS_PENDING)
+		if(ra->received == ra->total_size)
 		{
-			delete[] payload_copy;
+			/* Ownership of the buffer passes to deliver_message(). */
+			unsigned char *buffer = ra->buffer;
+			ra->buffer = NULL;
+			
+			peer->reassembly.erase(ri);
+			
+			deliver_message(l, peer, from_player_id, buffer, total_size, flags);
 		}
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
-		log_printf("Received invalid DPLITE_MSGID_MESSAGE: %s", e.what());
+		log_printf("Received invalid DPLITE_MSGID_MESSAGE_FRAGMENT from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+/* Raises a DPN_MSGID_RECEIVE for a message from a peer. The buffer must have come from
+ * recv_pool, ownership of it passes to the application if it returns DPNSUCCESS_PENDING.
+*/
+void DirectPlay8Peer::deliver_message(std::unique_lock<ProfiledMutex> &l, Peer *peer, DPNID from_player_id, unsigned char *buffer, size_t size, DWORD flags)
+{
+	peer->stats->message_received(flags, size);
+	
+	DPNMSG_RECEIVE r;
+	memset(&r, 0, sizeof(r));
+	
+	static_assert(sizeof(DPNHANDLE) >= sizeof(unsigned char*),
+		"DPNHANDLE must be large enough to take a pointer");
+	
+	r.dwSize            = sizeof(r);
+	r.dpnidSender       = from_player_id;
+	r.pvPlayerContext   = peer->player_ctx;
+	r.pReceiveData      = buffer;
+	r.dwReceiveDataSize = size;
+	r.hBufferHandle     = (DPNHANDLE)(buffer);
+	// r.dwReceiveFlags
+	
+	l.unlock();
+	HRESULT r_result = call_message_handler(DPN_MSGID_RECEIVE, &r);
+	l.lock();
+	
+	if(r_result != DPNSUCCESS_PENDING)
+	{
+		recv_pool.put(buffer);
 	}
 }
 
-void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_playerinfo(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5050,7 +6558,7 @@ void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigne
 		ack.append_data(NULL, 0);
 		
 		peer->sq.send(SendQueue::SEND_PRI_HIGH, ack, NULL,
-			[](std::unique_lock<std::mutex> &l, HRESULT s_result) {});
+			[](std::unique_lock<ProfiledMutex> &l, HRESULT s_result) {});
 		
 		DPNMSG_PEER_INFO pi;
 		memset(&pi, 0, sizeof(pi));
@@ -5060,7 +6568,7 @@ void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigne
 		pi.pvPlayerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_PEER_INFO, &pi);
+		call_message_handler(DPN_MSGID_PEER_INFO, &pi);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5070,7 +6578,7 @@ void DirectPlay8Peer::handle_playerinfo(std::unique_lock<std::mutex> &l, unsigne
 	}
 }
 
-void DirectPlay8Peer::handle_ack(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_ack(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5088,7 +6596,7 @@ void DirectPlay8Peer::handle_ack(std::unique_lock<std::mutex> &l, unsigned int p
 			return;
 		}
 		
-		std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> callback = ai->second;
+		std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const void*, size_t)> callback = ai->second;
 		peer->pending_acks.erase(ai);
 		
 		callback(l, result, data.first, data.second);
@@ -5100,7 +6608,7 @@ void DirectPlay8Peer::handle_ack(std::unique_lock<std::mutex> &l, unsigned int p
 	}
 }
 
-void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_appdesc(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5138,13 +6646,15 @@ void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned i
 			(const unsigned char*)(application_data.first),
 			(const unsigned char*)(application_data.first) + application_data.second);
 		
+		host_enum_response.reset();
+		
 		/* DPN_MSGID_APPLICATION_DESC has no accompanying structure.
 		 * The application must call GetApplicationDesc() to obtain the
 		 * new data.
 		*/
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_APPLICATION_DESC, NULL);
+		call_message_handler(DPN_MSGID_APPLICATION_DESC, NULL);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5154,7 +6664,7 @@ void DirectPlay8Peer::handle_appdesc(std::unique_lock<std::mutex> &l, unsigned i
 	}
 }
 
-void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5197,7 +6707,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 			state = STATE_TERMINATED;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_TERMINATE_SESSION, &ts);
+			call_message_handler(DPN_MSGID_TERMINATE_SESSION, &ts);
 			l.lock();
 			
 			dispatch_destroy_player(l, local_player_id, local_player_ctx, DPNDESTROYPLAYERREASON_SESSIONTERMINATED);
@@ -5216,7 +6726,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 					PacketSerialiser destroy_peer(DPLITE_MSGID_DESTROY_PEER);
 					destroy_peer.append_dword(local_player_id);
 					
-					peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer, NULL, [](std::unique_lock<std::mutex> &l, HRESULT result) {});
+					peer->sq.send(SendQueue::SEND_PRI_HIGH, destroy_peer, NULL, [](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 				}
 			}
 			
@@ -5246,7 +6756,7 @@ void DirectPlay8Peer::handle_destroy_peer(std::unique_lock<std::mutex> &l, unsig
 	}
 }
 
-void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_terminate_session(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5283,7 +6793,7 @@ void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l,
 		ts.dwTerminateDataSize = terminate_data.second;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_TERMINATE_SESSION, &ts);
+		call_message_handler(DPN_MSGID_TERMINATE_SESSION, &ts);
 		l.lock();
 		
 		dispatch_destroy_player(l, local_player_id, local_player_ctx, DPNDESTROYPLAYERREASON_SESSIONTERMINATED);
@@ -5299,7 +6809,7 @@ void DirectPlay8Peer::handle_terminate_session(std::unique_lock<std::mutex> &l,
 	}
 }
 
-void DirectPlay8Peer::handle_group_allocate(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_allocate(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5325,7 +6835,7 @@ void DirectPlay8Peer::handle_group_allocate(std::unique_lock<std::mutex> &l, uns
 	}
 }
 
-void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_create(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5373,7 +6883,7 @@ void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsig
 		cg.pvOwnerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_CREATE_GROUP, &cg);
+		call_message_handler(DPN_MSGID_CREATE_GROUP, &cg);
 		l.lock();
 		
 		Group *group = get_group_by_id(group_id);
@@ -5389,7 +6899,7 @@ void DirectPlay8Peer::handle_group_create(std::unique_lock<std::mutex> &l, unsig
 	}
 }
 
-void DirectPlay8Peer::handle_group_destroy(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_destroy(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5426,7 +6936,7 @@ void DirectPlay8Peer::handle_group_destroy(std::unique_lock<std::mutex> &l, unsi
 			dg.dwReason       = DPNDESTROYGROUPREASON_NORMAL;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_DESTROY_GROUP, &dg);
+			call_message_handler(DPN_MSGID_DESTROY_GROUP, &dg);
 			l.lock();
 			
 			groups.erase(group_id);
@@ -5439,7 +6949,7 @@ void DirectPlay8Peer::handle_group_destroy(std::unique_lock<std::mutex> &l, unsi
 	}
 }
 
-void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_join(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5486,7 +6996,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 			cg.pvOwnerContext = peer->player_ctx;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_CREATE_GROUP, &cg);
+			call_message_handler(DPN_MSGID_CREATE_GROUP, &cg);
 			l.lock();
 			
 			Group *group = get_group_by_id(group_id);
@@ -5519,7 +7029,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 			if(peer->state == Peer::PS_CONNECTED)
 			{
 				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_joined, NULL,
-					[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+					[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 			}
 		}
 		
@@ -5542,7 +7052,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 		ap.pvPlayerContext = local_player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
+		call_message_handler(DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5552,7 +7062,7 @@ void DirectPlay8Peer::handle_group_join(std::unique_lock<std::mutex> &l, unsigne
 	}
 }
 
-void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_joined(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5597,7 +7107,7 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 			cg.pvOwnerContext = peer->player_ctx;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_CREATE_GROUP, &cg);
+			call_message_handler(DPN_MSGID_CREATE_GROUP, &cg);
 			l.lock();
 			
 			Group *group = get_group_by_id(group_id);
@@ -5630,7 +7140,7 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 		ap.pvPlayerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
+		call_message_handler(DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5640,7 +7150,7 @@ void DirectPlay8Peer::handle_group_joined(std::unique_lock<std::mutex> &l, unsig
 	}
 }
 
-void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_leave(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5687,7 +7197,7 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 			if(peer->state == Peer::PS_CONNECTED)
 			{
 				peer->sq.send(SendQueue::SEND_PRI_HIGH, group_left, NULL,
-					[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+					[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 			}
 		}
 		
@@ -5710,7 +7220,7 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 		rp.pvPlayerContext = local_player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
+		call_message_handler(DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5720,7 +7230,7 @@ void DirectPlay8Peer::handle_group_leave(std::unique_lock<std::mutex> &l, unsign
 	}
 }
 
-void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+void DirectPlay8Peer::handle_group_left(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
 {
 	Peer *peer = get_peer_by_peer_id(peer_id);
 	assert(peer != NULL);
@@ -5768,7 +7278,7 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
 		rp.pvPlayerContext = peer->player_ctx;
 		
 		l.unlock();
-		message_handler(message_handler_ctx, DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
+		call_message_handler(DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
 		l.lock();
 	}
 	catch(const PacketDeserialiser::Error &e)
@@ -5778,6 +7288,230 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
 	}
 }
 
+void DirectPlay8Peer::handle_host_migrate(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DPNID new_host_id  = pd.get_dword(0);
+		DPNID host_next_id = pd.get_dword(1);
+		
+		if(peer->state != Peer::PS_CONNECTED)
+		{
+			log_printf("Received unexpected DPLITE_MSGID_HOST_MIGRATE from peer %u, in state %u",
+				peer_id, (unsigned)(peer->state));
+			return;
+		}
+		
+		if(!(session_flags & DPNSESSION_MIGRATE_HOST) || new_host_id != peer->player_id)
+		{
+			log_printf("Received unexpected DPLITE_MSGID_HOST_MIGRATE from peer %u",
+				peer_id);
+			return;
+		}
+		
+		if(next_player_id < host_next_id)
+		{
+			next_player_id = host_next_id;
+		}
+		
+		if(host_player_id == new_host_id)
+		{
+			/* We already elected the same host when our connection to the old one
+			 * went away.
+			*/
+			return;
+		}
+		
+		if(state != STATE_CONNECTED)
+		{
+			log_printf("Ignoring DPLITE_MSGID_HOST_MIGRATE from peer %u, in state %u",
+				peer_id, (unsigned)(state));
+			return;
+		}
+		
+		/* The new host noticed the old one going away before we did. Switch over now,
+		 * the connection to the old host will be treated as a normal player leaving
+		 * when it finally drops.
+		*/
+		
+		host_migrated(l, new_host_id);
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		log_printf("Received invalid DPLITE_MSGID_HOST_MIGRATE from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_ping(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DWORD tick_count = pd.get_dword(0);
+		
+		PacketSerialiser pong(DPLITE_MSGID_PONG);
+		pong.append_dword(tick_count);
+		
+		peer->sq.send(SendQueue::SEND_PRI_HIGH, pong, NULL, [](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		log_printf("Received invalid DPLITE_MSGID_PING from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+void DirectPlay8Peer::handle_pong(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd)
+{
+	Peer *peer = get_peer_by_peer_id(peer_id);
+	assert(peer != NULL);
+	
+	try {
+		DWORD tick_count = pd.get_dword(0);
+		
+		if(peer->ping_outstanding && peer->ping_sent_at != 0)
+		{
+			SendQueue::Timestamp rtt = clock->now() - peer->ping_sent_at;
+			
+			peer->stats->rtt_sample((DWORD)(rtt / 1000));
+			peer->cc.rtt_sample(rtt, !peer->rate_limited, peer->ping_sent_at + rtt);
+			
+			peer->rate_limited = false;
+		}
+		else{
+			/* We didn't send a ping, or it hasn't been written out yet. Still good enough
+			 * for the RTT estimate, but not trusted for congestion control.
+			*/
+			peer->stats->rtt_sample(clock->ticks() - tick_count);
+		}
+		
+		peer->ping_outstanding = false;
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		log_printf("Received invalid DPLITE_MSGID_PONG from peer %u: %s",
+			peer_id, e.what());
+	}
+}
+
+/* Raises DPNMSG_CREATE_PLAYER (and DPNMSG_ADD_PLAYER_TO_GROUP) for each peer in
+ * deferred_joins, including any which complete their handshake while we are at it, then
+ * checks if the Connect() operation is complete.
+ *
+ * join_dispatching must be set by the caller, it is cleared once deferred_joins is empty.
+*/
+void DirectPlay8Peer::join_dispatch_deferred(std::unique_lock<ProfiledMutex> &l)
+{
+	SendQueue::Timestamp callbacks_start = clock->now();
+	
+	while(!deferred_joins.empty())
+	{
+		unsigned int peer_id = deferred_joins.front();
+		deferred_joins.pop_front();
+		
+		Peer *peer = get_peer_by_peer_id(peer_id);
+		if(peer == NULL || peer->state != Peer::PS_CONNECTED)
+		{
+			continue;
+		}
+		
+		std::set<DPNID> peer_groups;
+		peer_groups.swap(peer->join_groups);
+		
+		/* From here on the player has been announced, so losing it must raise a
+		 * DPNMSG_DESTROY_PLAYER.
+		*/
+		peer->join_pending = false;
+		
+		DPNMSG_CREATE_PLAYER cp;
+		memset(&cp, 0, sizeof(cp));
+		
+		cp.dwSize          = sizeof(cp);
+		cp.dpnidPlayer     = peer->player_id;
+		cp.pvPlayerContext = NULL;
+		
+		l.unlock();
+		call_message_handler(DPN_MSGID_CREATE_PLAYER, &cp);
+		l.lock();
+		
+		if(state != STATE_CONNECTING_TO_PEERS)
+		{
+			/* Connect failed while we were in the callback. */
+			return;
+		}
+		
+		if((peer = get_peer_by_peer_id(peer_id)) == NULL)
+		{
+			continue;
+		}
+		
+		peer->player_ctx = cp.pvPlayerContext;
+		
+		for(auto g = peer_groups.begin(); g != peer_groups.end(); ++g)
+		{
+			DPNID group_id = *g;
+			
+			if(destroyed_groups.find(group_id) != destroyed_groups.end())
+			{
+				/* Group is already in the process of being destroyed. */
+				continue;
+			}
+			
+			Group *group = get_group_by_id(group_id);
+			if(group == NULL)
+			{
+				/* Unknown group ID... very rarely normal. */
+				continue;
+			}
+			
+			if(group->player_ids.find(peer->player_id) != group->player_ids.end())
+			{
+				/* Already in group... somehow?! */
+				continue;
+			}
+			
+			group->player_ids.insert(peer->player_id);
+			
+			DPNMSG_ADD_PLAYER_TO_GROUP ap;
+			memset(&ap, 0, sizeof(ap));
+			
+			ap.dwSize          = sizeof(ap);
+			ap.dpnidGroup      = group_id;
+			ap.pvGroupContext  = group->ctx;
+			ap.dpnidPlayer     = peer->player_id;
+			ap.pvPlayerContext = peer->player_ctx;
+			
+			l.unlock();
+			call_message_handler(DPN_MSGID_ADD_PLAYER_TO_GROUP, &ap);
+			l.lock();
+			
+			if(state != STATE_CONNECTING_TO_PEERS)
+			{
+				return;
+			}
+			
+			if((peer = get_peer_by_peer_id(peer_id)) == NULL)
+			{
+				break;
+			}
+		}
+		
+		if(peer != NULL)
+		{
+			peer_recv_resume(peer);
+		}
+	}
+	
+	join_timing.callbacks += clock->now() - callbacks_start;
+	join_dispatching = false;
+	
+	connect_check(l);
+}
+
 /* Check if we have finished connecting and should enter STATE_CONNECTED.
  *
  * This is called after processing either of:
@@ -5789,7 +7523,7 @@ void DirectPlay8Peer::handle_group_left(std::unique_lock<std::mutex> &l, unsigne
  * successfully connected to every peer in the session at the point the server
  * accepted us and we should proceed.
 */
-void DirectPlay8Peer::connect_check(std::unique_lock<std::mutex> &l)
+void DirectPlay8Peer::connect_check(std::unique_lock<ProfiledMutex> &l)
 {
 	assert(state == STATE_CONNECTING_TO_HOST || state == STATE_CONNECTING_TO_PEERS);
 	
@@ -5815,6 +7549,22 @@ void DirectPlay8Peer::connect_check(std::unique_lock<std::mutex> &l)
 	
 	state = STATE_CONNECTED;
 	
+	{
+		SendQueue::Timestamp now = clock->now();
+		const JoinTiming &jt = join_timing;
+		
+		/* Peer phases are measured from the host accepting us until the last peer
+		 * completes each step, so they overlap each other and the callbacks.
+		*/
+		log_printf("Joined session in %u us (host connect %u us, host handshake %u us, peer connects %u us, peer handshakes %u us, callbacks %u us)",
+			(unsigned)(now - jt.started),
+			(unsigned)(jt.host_connected - jt.started),
+			(unsigned)(jt.host_accepted - jt.host_connected),
+			(unsigned)(jt.peers_connected != 0 ? jt.peers_connected - jt.host_accepted : 0),
+			(unsigned)(jt.peers_accepted  != 0 ? jt.peers_accepted  - jt.host_accepted : 0),
+			(unsigned)(jt.callbacks));
+	}
+	
 	DPNMSG_CONNECT_COMPLETE cc;
 	memset(&cc, 0, sizeof(cc));
 	
@@ -5831,7 +7581,7 @@ void DirectPlay8Peer::connect_check(std::unique_lock<std::mutex> &l)
 	}
 	
 	l.unlock();
-	message_handler(message_handler_ctx, DPN_MSGID_CONNECT_COMPLETE, &cc);
+	call_message_handler(DPN_MSGID_CONNECT_COMPLETE, &cc);
 	l.lock();
 	
 	/* Signal the pending synchronous Connect() call (if any) to return. */
@@ -5843,7 +7593,7 @@ void DirectPlay8Peer::connect_check(std::unique_lock<std::mutex> &l)
 /* Fail a pending Connect operation and return to STATE_INITIALISED.
  * ...
 */
-void DirectPlay8Peer::connect_fail(std::unique_lock<std::mutex> &l, HRESULT hResultCode, const void *pvApplicationReplyData, DWORD dwApplicationReplyDataSize)
+void DirectPlay8Peer::connect_fail(std::unique_lock<ProfiledMutex> &l, HRESULT hResultCode, const void *pvApplicationReplyData, DWORD dwApplicationReplyDataSize)
 {
 	assert(state == STATE_CONNECTING_TO_HOST || state == STATE_CONNECTING_TO_PEERS);
 	
@@ -5851,6 +7601,9 @@ void DirectPlay8Peer::connect_fail(std::unique_lock<std::mutex> &l, HRESULT hRes
 	
 	state = STATE_CONNECT_FAILED;
 	
+	join_dispatching = false;
+	deferred_joins.clear();
+	
 	close_main_sockets();
 	peer_destroy_all(l, DPNERR_GENERIC, DPNDESTROYPLAYERREASON_CONNECTIONLOST);
 	
@@ -5875,7 +7628,7 @@ void DirectPlay8Peer::connect_fail(std::unique_lock<std::mutex> &l, HRESULT hRes
 	cc.dwApplicationReplyDataSize = dwApplicationReplyDataSize;
 	
 	l.unlock();
-	message_handler(message_handler_ctx, DPN_MSGID_CONNECT_COMPLETE, &cc);
+	call_message_handler(DPN_MSGID_CONNECT_COMPLETE, &cc);
 	l.lock();
 	
 	/* Signal the pending synchronous Connect() call (if any) to return. */
@@ -5885,16 +7638,110 @@ void DirectPlay8Peer::connect_fail(std::unique_lock<std::mutex> &l, HRESULT hRes
 	connect_cv.notify_all();
 }
 
-HRESULT DirectPlay8Peer::dispatch_message(std::unique_lock<std::mutex> &l, DWORD dwMessageType, PVOID pvMessage)
+/* Records the session being started in the capture file (if capturing), so the replay
+ * tool can set up an equivalent session to feed the capture through.
+*/
+void DirectPlay8Peer::capture_session(uint32_t type, const DPN_APPLICATION_DESC *app_desc, uint16_t port)
 {
-	l.unlock();
+	CaptureTransport *capture = dynamic_cast<CaptureTransport*>(transport);
+	if(capture == NULL)
+	{
+		return;
+	}
+	
+	PacketSerialiser session(type);
+	
+	session.append_dword(role);
+	session.append_guid(app_desc->guidApplication);
+	session.append_guid(instance_guid);
+	session.append_dword(app_desc->dwFlags);
+	session.append_dword(app_desc->dwMaxPlayers);
+	session.append_wstring(app_desc->pwszSessionName != NULL ? app_desc->pwszSessionName : L"");
+	session.append_wstring(app_desc->pwszPassword != NULL ? app_desc->pwszPassword : L"");
+	session.append_dword(port);
+	
+	if(type == CAPTURE_SESSION_CONNECT)
+	{
+		session.append_data(connect_req_data.data(), connect_req_data.size());
+	}
+	else{
+		session.append_data(NULL, 0);
+	}
+	
+	capture->record_session(session);
+}
+
+HRESULT DirectPlay8Peer::call_message_handler(DWORD dwMessageType, PVOID pvMessage)
+{
+	uint32_t player = 0, size = 0, handle = 0;
+	
+	switch(dwMessageType)
+	{
+		case DPN_MSGID_RECEIVE:
+		{
+			DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pvMessage);
+			
+			player = r->dpnidSender;
+			size   = r->dwReceiveDataSize;
+			handle = r->hBufferHandle;
+			
+			break;
+		}
+		
+		case DPN_MSGID_SEND_COMPLETE:
+			handle = ((DPNMSG_SEND_COMPLETE*)(pvMessage))->hAsyncOp;
+			break;
+			
+		case DPN_MSGID_ASYNC_OP_COMPLETE:
+			handle = ((DPNMSG_ASYNC_OP_COMPLETE*)(pvMessage))->hAsyncOp;
+			break;
+			
+		case DPN_MSGID_CONNECT_COMPLETE:
+			handle = ((DPNMSG_CONNECT_COMPLETE*)(pvMessage))->hAsyncOp;
+			break;
+			
+		case DPN_MSGID_CREATE_PLAYER:
+			player = ((DPNMSG_CREATE_PLAYER*)(pvMessage))->dpnidPlayer;
+			break;
+			
+		case DPN_MSGID_DESTROY_PLAYER:
+			player = ((DPNMSG_DESTROY_PLAYER*)(pvMessage))->dpnidPlayer;
+			break;
+	}
+	
+	TRACE_POINT(TE_HANDLER_BEGIN, player, dwMessageType, size, handle);
+	
+	unsigned long long start = clock->now();
 	HRESULT result = message_handler(message_handler_ctx, dwMessageType, pvMessage);
+	unsigned long long took = clock->now() - start;
+	
+	TRACE_POINT(TE_HANDLER_END, player, dwMessageType, size, handle);
+	
+	if(handler_profiler.record(dwMessageType, player, took))
+	{
+		log_printf("Message handler took %llu us to process %s (player %u)",
+			took, trace_message_name(TE_HANDLER_BEGIN, dwMessageType), (unsigned)(player));
+	}
+	
+	return result;
+}
+
+HRESULT CALLBACK DirectPlay8Peer::host_enum_message_handler(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	DirectPlay8Peer *self = (DirectPlay8Peer*)(pvUserContext);
+	return self->call_message_handler(dwMessageType, pMessage);
+}
+
+HRESULT DirectPlay8Peer::dispatch_message(std::unique_lock<ProfiledMutex> &l, DWORD dwMessageType, PVOID pvMessage)
+{
+	l.unlock();
+	HRESULT result = call_message_handler(dwMessageType, pvMessage);
 	l.lock();
 	
 	return result;
 }
 
-HRESULT DirectPlay8Peer::dispatch_create_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext)
+HRESULT DirectPlay8Peer::dispatch_create_player(std::unique_lock<ProfiledMutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext)
 {
 	DPNMSG_CREATE_PLAYER cp;
 	memset(&cp, 0, sizeof(cp));
@@ -5910,7 +7757,7 @@ HRESULT DirectPlay8Peer::dispatch_create_player(std::unique_lock<std::mutex> &l,
 	return result;
 }
 
-HRESULT DirectPlay8Peer::dispatch_destroy_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void *pvPlayerContext, DWORD dwReason)
+HRESULT DirectPlay8Peer::dispatch_destroy_player(std::unique_lock<ProfiledMutex> &l, DPNID dpnidPlayer, void *pvPlayerContext, DWORD dwReason)
 {
 	/* HACK: Remove the player ID from any groups it is still in. */
 	for(auto g = groups.begin(); g != groups.end();)
@@ -5932,7 +7779,7 @@ HRESULT DirectPlay8Peer::dispatch_destroy_player(std::unique_lock<std::mutex> &l
 			rp.pvPlayerContext = pvPlayerContext;
 			
 			l.unlock();
-			message_handler(message_handler_ctx, DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
+			call_message_handler(DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, &rp);
 			l.lock();
 			
 			g = groups.begin();
@@ -5953,7 +7800,7 @@ HRESULT DirectPlay8Peer::dispatch_destroy_player(std::unique_lock<std::mutex> &l
 	return dispatch_message(l, DPN_MSGID_DESTROY_PLAYER, &dp);
 }
 
-HRESULT DirectPlay8Peer::dispatch_destroy_group(std::unique_lock<std::mutex> &l, DPNID dpnidGroup, void *pvGroupContext, DWORD dwReason)
+HRESULT DirectPlay8Peer::dispatch_destroy_group(std::unique_lock<ProfiledMutex> &l, DPNID dpnidGroup, void *pvGroupContext, DWORD dwReason)
 {
 	DPNMSG_DESTROY_GROUP dg;
 	
@@ -5965,13 +7812,29 @@ HRESULT DirectPlay8Peer::dispatch_destroy_group(std::unique_lock<std::mutex> &l,
 	return dispatch_message(l, DPN_MSGID_DESTROY_GROUP, &dg);
 }
 
-DirectPlay8Peer::Peer::Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port):
-	state(state), sock(sock), ip(ip), port(port), recv_busy(false), recv_buf_cur(0), events(0), sq(event), send_open(true), next_ack_id(1)
-{}
+DirectPlay8Peer::Peer::Peer(Transport *transport, Clock *clock, enum PeerState state, int sock, uint32_t ip, uint16_t port):
+	transport(transport), state(state), sock(sock), ip(ip), port(port), recv_busy(false), recv_buf_cur(0), recv_buf_preload(0), events(0), sq(event, clock), send_open(true), stats(new ConnectionStats()), next_ack_id(1), join_pending(false), recv_parked(false), relay_tried(false)
+{
+	last_recv = clock->ticks();
+	last_ping = last_recv;
+	
+	ping_outstanding = false;
+	ping_sent_at     = 0;
+	sent_since_ping  = false;
+	rate_limited     = false;
+}
+
+DirectPlay8Peer::Peer::Reassembly::Reassembly(BufferPool *pool, unsigned char *buffer, DWORD msg_id, DWORD total_size):
+	pool(pool), buffer(buffer), msg_id(msg_id), total_size(total_size), received(0) {}
+
+DirectPlay8Peer::Peer::Reassembly::~Reassembly()
+{
+	pool->put(buffer);
+}
 
 bool DirectPlay8Peer::Peer::enable_events(long events)
 {
-	if(WSAEventSelect(sock, event, (this->events | events)) != 0)
+	if(transport->event_select(sock, event, (this->events | events)) != 0)
 	{
 		DWORD err = WSAGetLastError();
 		log_printf("WSAEventSelect() error: ", win_strerror(err).c_str());
@@ -5986,7 +7849,7 @@ bool DirectPlay8Peer::Peer::enable_events(long events)
 
 bool DirectPlay8Peer::Peer::disable_events(long events)
 {
-	if(WSAEventSelect(sock, event, (this->events & ~events)) != 0)
+	if(transport->event_select(sock, event, (this->events & ~events)) != 0)
 	{
 		DWORD err = WSAGetLastError();
 		log_printf("WSAEventSelect() error: ", win_strerror(err).c_str());
@@ -6010,15 +7873,15 @@ DWORD DirectPlay8Peer::Peer::alloc_ack_id()
 	return id;
 }
 
-void DirectPlay8Peer::Peer::register_ack(DWORD id, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
+void DirectPlay8Peer::Peer::register_ack(DWORD id, const std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT)> &callback)
 {
-	register_ack(id, [callback](std::unique_lock<std::mutex> &l, HRESULT result, const void *data, size_t data_size)
+	register_ack(id, [callback](std::unique_lock<ProfiledMutex> &l, HRESULT result, const void *data, size_t data_size)
 	{
 		callback(l, result);
 	});
 }
 
-void DirectPlay8Peer::Peer::register_ack(DWORD id, const std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> &callback)
+void DirectPlay8Peer::Peer::register_ack(DWORD id, const std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const void*, size_t)> &callback)
 {
 	assert(pending_acks.find(id) == pending_acks.end());
 	pending_acks.emplace(id, callback);
@@ -6032,7 +7895,7 @@ void DirectPlay8Peer::Peer::send_ack(DWORD ack_id, HRESULT result, const void *d
 	ack.append_data(data, data_size);
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, ack, NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) {});
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) {});
 }
 
 DirectPlay8Peer::Group::Group(const std::wstring &name, const void *data, size_t data_size, void *ctx):
@@ -22,27 +22,78 @@
 #include <winsock2.h>
 #include <atomic>
 #include <dplay8.h>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <objbase.h>
-#include <queue>
+#include <set>
 #include <stdint.h>
 #include <windows.h>
 
 #include "AsyncHandleAllocator.hpp"
+#include "BufferPool.hpp"
+#include "CaptureTransport.hpp"
+#include "Clock.hpp"
+#include "CongestionController.hpp"
+#include "ConnectionStats.hpp"
 #include "EventObject.hpp"
 #include "HandleHandlingPool.hpp"
+#include "HandlerProfiler.hpp"
 #include "HostEnumerator.hpp"
 #include "network.hpp"
 #include "packet.hpp"
+#include "ProfiledMutex.hpp"
+#include "RelayTransport.hpp"
 #include "SendQueue.hpp"
+#include "SharedListener.hpp"
+#include "TokenBucket.hpp"
+#include "Transport.hpp"
+#include "WorkQueue.hpp"
 
 class DirectPlay8Peer: public IDirectPlay8Peer
 {
+	friend class DirectPlay8Client;
+	friend class DirectPlay8Server;
+	friend class SharedListener;
+	
+	public:
+		/* Which COM interface this instance is backing.
+		 *
+		 * ROLE_PEER instances form a full mesh with every other peer in the session,
+		 * ROLE_SERVER instances host a star topology where each ROLE_CLIENT instance
+		 * is only connected to the server and never learns about the other clients.
+		*/
+		enum Role {
+			ROLE_PEER,
+			ROLE_SERVER,
+			ROLE_CLIENT,
+		};
+		
 	private:
 		std::atomic<unsigned int> * const global_refcount;
 		ULONG local_refcount;
 		
+		const Role role;
+		
+		/* Wraps the SocketTransport when the DPLITE_RELAY environment variable names a
+		 * relay to reach peers through when they can't be connected to directly, owned
+		 * by us.
+		*/
+		RelayTransport * const env_relay;
+		
+		/* Wraps the SocketTransport (or env_relay) when the DPLITE_CAPTURE environment
+		 * variable asks for the wire traffic to be recorded, owned by us.
+		*/
+		CaptureTransport * const env_capture;
+		
+		/* Where our sockets and the time come from. Not owned by us (unless it is
+		 * env_capture or env_relay), normally the process-wide SocketTransport and
+		 * SystemClock.
+		*/
+		Transport * const transport;
+		Clock * const clock;
+		
 		PFNDPNMESSAGEHANDLER message_handler;
 		PVOID message_handler_ctx;
 		
@@ -64,7 +115,7 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		
 		std::map<DPNHANDLE, HostEnumerator> async_host_enums;
 		std::list<HostEnumerator> sync_host_enums;
-		std::condition_variable host_enum_completed;
+		std::condition_variable_any host_enum_completed;
 		
 		GUID instance_guid;
 		GUID application_guid;
@@ -73,6 +124,12 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		std::wstring password;
 		std::vector<unsigned char> application_data;
 		
+		/* DPNSESSION_MIGRATE_HOST, DPNSESSION_NODPNSVR and DPNSESSION_CLIENT_SERVER from the DPN_APPLICATION_DESC
+		 * which the session was created with, sent to peers when they join so whichever
+		 * one takes over the session as host knows how to behave.
+		*/
+		DWORD session_flags;
+		
 		GUID service_provider;
 		
 		/* Local IP and port for all our sockets, except discovery_socket. */
@@ -83,18 +140,113 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		int listener_socket;   /* TCP listener socket. */
 		int discovery_socket;  /* Discovery UDP sockets, RECIEVES broadcasts only. */
 		
+		/* Set when hosting with DPLITE_HOST_SHAREDPORT. listener_socket isn't used and
+		 * udp_socket belongs to the SharedListener, which reads from both and passes us
+		 * anything meant for this session.
+		*/
+		SharedListener *shared_listener;
+		unsigned int shared_listener_id;
+		
 		EventObject udp_socket_event;
 		EventObject other_socket_event;
 		
+		/* Process-wide HandleHandlingPool, shared with all other instances. */
 		HandleHandlingPool *worker_pool;
 		
-		std::queue< std::function<void()> > work_queue;
+		/* Every callback we register with worker_pool holds a copy of pool_ref. Close()
+		 * drops our own copy and waits for the deleter to signal pool_idle, at which point
+		 * no worker can be running (or about to run) any of our callbacks.
+		*/
+		std::shared_ptr<void> pool_ref;
+		EventObject pool_idle;
+		
+		/* work_signalled is set when work_ready has been signalled and no worker has
+		 * started draining work_queue since.
+		*/
+		WorkQueue work_queue;
+		std::atomic<bool> work_signalled;
 		EventObject work_ready;
 		
 		SendQueue udp_sq;
 		
+		/* Periodic timer which drives keepalive_tick(), created by Initialize(). */
+		HANDLE keepalive_timer;
+		
+		/* Values from SetCaps(). A DPLITE_MSGID_PING is sent to a peer if we haven't pinged it
+		 * for dwTimeoutUntilKeepAlive (or RTT_PROBE_INTERVAL, whichever is shorter), and the
+		 * peer is considered dead if nothing at all is received from it for
+		 * dwTimeoutUntilKeepAlive + (dwNumSendRetries * dwMaxSendRetryInterval).
+		*/
+		DWORD keepalive_timeout;
+		DWORD num_send_retries;
+		DWORD max_send_retry_interval;
+		
+		/* Send rate limits and drop thresholds from SetCaps(), see DPLITE_CAPS. */
+		DWORD drop_threshold_rate;
+		DWORD throttle_rate;
+		DWORD max_send_rate;
+		DWORD max_player_send_rate;
+		
+		/* Pace each peer at the rate picked by its CongestionController, see DPLITE_CAPS.
+		 * keepalive_timer runs every CC_PROBE_INTERVAL rather than KEEPALIVE_TICK while set.
+		*/
+		bool congestion_control;
+		
+		/* Socket options from SetCaps() (DPLITE_CAPS) and SetSPCaps(), a buffer size of
+		 * zero means the one from the profile is used.
+		*/
+		DWORD socket_profile;
+		DWORD system_buffer_size;
+		
+		/* Host enumeration settings from SetCaps(), see DPLITE_CAPS. */
+		DWORD enum_flags;
+		DWORD max_enum_response_rate;
+		
+		/* Responses sent to each source address (IPv4, network byte order) in the current
+		 * one second window, for enforcing max_enum_response_rate.
+		 *
+		 * enum_source_lru holds the same addresses ordered by window_start, oldest first,
+		 * so the one to evict when the table is full is always at the front.
+		*/
+		struct EnumSource
+		{
+			DWORD window_start;
+			DWORD responses;
+			
+			std::list<uint32_t>::iterator lru;
+		};
+		
+		std::map<uint32_t, EnumSource> enum_sources;
+		std::list<uint32_t> enum_source_lru;
+		
+		/* DPLITE_MSGID_HOST_ENUM_RESPONSE with the session description filled in, minus the
+		 * per-request fields on the end. Reset whenever the description changes, and rebuilt
+		 * by get_host_enum_response() when next needed or the player count has changed.
+		*/
+		std::unique_ptr<PacketSerialiser> host_enum_response;
+		DWORD host_enum_response_players;
+		
+		/* Paces sends to all peers according to max_send_rate. Peers which can't send
+		 * because either this or their own bucket is empty are added to paced_peers and
+		 * have their events signalled when pace_timer next fires.
+		*/
+		TokenBucket send_pacer;
+		HANDLE pace_timer;
+		SendQueue::Timestamp pace_timer_due;
+		std::set<unsigned int> paced_peers;
+		
+		/* Time spent in the application's message handler, see call_message_handler(). */
+		HandlerProfiler handler_profiler;
+		
+		/* Buffers passed to the application in DPNMSG_RECEIVE, released by ReturnBuffer(). */
+		BufferPool recv_pool;
+		
+		DWORD next_fragmented_msg_id;
+		
 		struct Peer
 		{
+			Transport *transport;
+			
 			enum PeerState {
 				/* Peer has connected to us, we're waiting for the initial message from it. */
 				PS_ACCEPTED,
@@ -148,6 +300,7 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			bool recv_busy;
 			unsigned char recv_buf[MAX_PACKET_SIZE];
 			size_t recv_buf_cur;
+			size_t recv_buf_preload;  /* Bytes at the start of recv_buf read before the peer was created. */
 			
 			EventObject event;
 			long events;
@@ -155,21 +308,92 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 			SendQueue sq;
 			bool send_open;
 			
+			/* Shared with player_stats and any in-flight send callbacks so that it can be
+			 * updated/read without holding the session lock.
+			*/
+			std::shared_ptr<ConnectionStats> stats;
+			
+			/* Paces sends to this peer according to max_player_send_rate, or the rate picked
+			 * by cc if that is lower and congestion_control is set.
+			*/
+			TokenBucket pacer;
+			CongestionController cc;
+			
+			DWORD last_recv; /* clock->ticks() when we last received anything from the peer. */
+			DWORD last_ping; /* clock->ticks() when we last sent a DPLITE_MSGID_PING. */
+			
+			/* ping_outstanding is set from sending a DPLITE_MSGID_PING until the matching
+			 * DPLITE_MSGID_PONG arrives. ping_sent_at is when the ping
+			 * was actually written to the socket, so time spent waiting in our own send
+			 * queue isn't counted as network delay.
+			*/
+			bool ping_outstanding;
+			SendQueue::Timestamp ping_sent_at;
+			
+			bool sent_since_ping; /* Anything has been sent since the last ping. */
+			bool rate_limited;    /* pacer has held back a send since the last RTT sample. */
+			
 			/* Some messages require confirmation of success/failure from the other
 			 * peer. Each of these is assigned a rolling (per peer) ID, the callback
 			 * associated to which is called when we get a DPLITE_MSGID_ACK.
 			 */
 			DWORD next_ack_id;
-			std::map< DWORD, std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> > pending_acks;
+			std::map< DWORD, std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const void*, size_t)> > pending_acks;
 			
-			Peer(enum PeerState state, int sock, uint32_t ip, uint16_t port);
+			/* A fragmented message being received from the peer. The buffer is returned to
+			 * the pool if the Reassembly is destroyed before the message is complete.
+			*/
+			struct Reassembly
+			{
+				BufferPool *pool;
+				unsigned char *buffer;
+				
+				DWORD msg_id;
+				DWORD total_size;
+				DWORD received;
+				
+				Reassembly(BufferPool *pool, unsigned char *buffer, DWORD msg_id, DWORD total_size);
+				~Reassembly();
+				
+				/* No copy c'tor. */
+				Reassembly(const Reassembly &src) = delete;
+			};
+			
+			/* Keyed by the DPNSEND_PRIORITY_* flags of the message. */
+			std::map< DWORD, std::unique_ptr<Reassembly> > reassembly;
+			
+			/* Groups the peer said it was in when it accepted our DPLITE_MSGID_CONNECT_PEER,
+			 * held until it is announced by join_dispatch_deferred().
+			*/
+			std::set<DPNID> join_groups;
+			
+			/* Set while the peer is waiting in deferred_joins. No DPNMSG_DESTROY_PLAYER is
+			 * raised for the peer until join_dispatch_deferred() has raised its
+			 * DPNMSG_CREATE_PLAYER, and nothing more is read from it until the player and
+			 * its group memberships have been announced, so the application can't see the
+			 * player's messages (or departure) before the player itself.
+			*/
+			bool join_pending;
+			
+			/* Set when io_peer_recv() stops reading from the peer because of join_pending,
+			 * leaving recv_busy set until peer_recv_resume().
+			*/
+			bool recv_parked;
+			
+			/* Set once peer_relay() has tried to replace the connection with one through
+			 * the relay, after connecting directly failed or took longer than
+			 * DIRECT_CONNECT_TIMEOUT.
+			*/
+			bool relay_tried;
+			
+			Peer(Transport *transport, Clock *clock, enum PeerState state, int sock, uint32_t ip, uint16_t port);
 			
 			bool enable_events(long events);
 			bool disable_events(long events);
 			
 			DWORD alloc_ack_id();
-			void register_ack(DWORD id, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
-			void register_ack(DWORD id, const std::function<void(std::unique_lock<std::mutex>&, HRESULT, const void*, size_t)> &callback);
+			void register_ack(DWORD id, const std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT)> &callback);
+			void register_ack(DWORD id, const std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const void*, size_t)> &callback);
 			void send_ack(DWORD ack_id, HRESULT result, const void *data = NULL, size_t data_size = 0);
 		};
 		
@@ -185,10 +409,16 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		
 		unsigned int next_peer_id;
 		std::map<unsigned int, Peer*> peers;
-		std::condition_variable peer_destroyed;
+		std::condition_variable_any peer_destroyed;
 		
 		std::map<DPNID, unsigned int> player_to_peer_id;
 		
+		/* Statistics for each connected player, protected by stats_lock rather than the
+		 * session-wide lock so that GetConnectionInfo() never has to wait for it.
+		*/
+		std::map< DPNID, std::shared_ptr<ConnectionStats> > player_stats;
+		std::mutex stats_lock;
+		
 		struct Group
 		{
 			std::wstring name;
@@ -209,10 +439,13 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		 * temporarily release it when executing the application message handler, after
 		 * which they must reclaim it and check for any changes to the state which may
 		 * affect them, such as a peer being destroyed.
+		 *
+		 * Lock sites are named after the public method or event handler which takes the
+		 * lock, see ProfiledMutex.
 		*/
-		std::mutex lock;
+		ProfiledMutex lock;
 		
-		std::condition_variable connect_cv;
+		std::condition_variable_any connect_cv;
 		
 		void *connect_ctx;
 		DPNHANDLE connect_handle;
@@ -221,64 +454,137 @@ class DirectPlay8Peer: public IDirectPlay8Peer
 		HRESULT connect_result;
 		std::vector<unsigned char> connect_reply_data;
 		
+		/* Set while a thread is raising the messages for players joined during Connect().
+		 * Peers which complete their handshake in the meantime are added to deferred_joins
+		 * and announced by that thread, so the application sees the players in a sensible
+		 * order while the remaining handshakes carry on in the background.
+		*/
+		bool join_dispatching;
+		std::list<unsigned int> deferred_joins;
+		
+		/* clock->now() at each phase of the last Connect(), logged once it completes.
+		 * callbacks is the total time spent in the application's message handler.
+		*/
+		struct JoinTiming
+		{
+			SendQueue::Timestamp started;
+			SendQueue::Timestamp host_connected;
+			SendQueue::Timestamp host_accepted;
+			SendQueue::Timestamp peers_connected;
+			SendQueue::Timestamp peers_accepted;
+			SendQueue::Timestamp callbacks;
+		} join_timing;
+		
 		Peer *get_peer_by_peer_id(unsigned int peer_id);
 		Peer *get_peer_by_player_id(DPNID player_id);
+		void player_stats_add(Peer *peer);
+		void player_stats_remove(DPNID player_id);
 		Group *get_group_by_id(DPNID group_id);
 		
 		void handle_udp_socket_event();
-		void io_udp_send(std::unique_lock<std::mutex> &l);
+		void handle_udp_packet(std::unique_lock<ProfiledMutex> &l, const void *data, size_t size, const struct sockaddr_in *from_addr);
+		void io_udp_send(std::unique_lock<ProfiledMutex> &l);
 		void handle_other_socket_event();
 		
+		void add_pool_handle(HANDLE handle, const std::function<void()> &callback);
 		void queue_work(const std::function<void()> &work);
 		void handle_work();
+		void keepalive_tick();
+		void pace_wait(unsigned int peer_id, SendQueue::Timestamp ready_at);
+		DWORD peer_send_rate(Peer *peer);
+		DWORD keepalive_period() const;
+		SocketOptions get_socket_options() const;
+		DWORD reported_buffer_size() const;
+		void apply_session_socket_options();
+		void handle_pace_timer();
+		bool send_backlogged(Peer *peer, DWORD send_flags);
+		void send_fragmented(Peer *peer, SendQueue::SendPriority priority, DWORD msg_id, const std::shared_ptr<const std::vector<unsigned char>> &payload, DWORD flags, DPNHANDLE async_handle, const SendQueue::TimedCallback &callback);
+		std::set<Peer*> send_multi(const std::list<Peer*> &send_to_peers, const PacketSerialiser *message, DPNHANDLE async_handle);
 		
 		void io_peer_triggered(unsigned int peer_id);
-		void io_peer_connected(std::unique_lock<std::mutex> &l, unsigned int peer_id);
-		void io_peer_send(std::unique_lock<std::mutex> &l, unsigned int peer_id);
-		void io_peer_recv(std::unique_lock<std::mutex> &l, unsigned int peer_id);
+		void io_peer_connected(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id);
+		void io_peer_send(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id);
+		void io_peer_recv(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id);
 		
-		void peer_accept(std::unique_lock<std::mutex> &l);
+		void peer_accept(std::unique_lock<ProfiledMutex> &l);
+		void peer_accept_socket(int newfd, const struct sockaddr_in *addr, const void *data = NULL, size_t data_size = 0);
+		void peer_recv_resume(Peer *peer);
 		bool peer_connect(Peer::PeerState initial_state, uint32_t remote_ip, uint16_t remote_port, DPNID player_id = 0);
-		void peer_destroy(std::unique_lock<std::mutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason);
-		void peer_destroy_all(std::unique_lock<std::mutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason);
-		void peer_shutdown(std::unique_lock<std::mutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason);
-		void peer_shutdown_all(std::unique_lock<std::mutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason);
+		bool peer_relay(unsigned int peer_id);
+		void peer_destroy(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason);
+		void peer_destroy_all(std::unique_lock<ProfiledMutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason);
+		void peer_shutdown(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, HRESULT outstanding_op_result, DWORD destroy_player_reason);
+		void peer_shutdown_all(std::unique_lock<ProfiledMutex> &l, HRESULT outstanding_op_result, DWORD destroy_player_reason);
 		
-		void group_destroy_all(std::unique_lock<std::mutex> &l, DWORD dwReason);
+		void group_destroy_all(std::unique_lock<ProfiledMutex> &l, DWORD dwReason);
 		
 		void close_main_sockets();
 		
-		void handle_host_enum_request(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd, const struct sockaddr_in *from_addr);
-		void handle_host_connect_request(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_host_connect_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_host_connect_fail(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_connect_peer(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_connect_peer_ok(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_connect_peer_fail(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_message(std::unique_lock<std::mutex> &l, const PacketDeserialiser &pd);
-		void handle_playerinfo(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_ack(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_appdesc(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_destroy_peer(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_terminate_session(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_allocate(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_create(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_destroy(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_join(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_joined(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_leave(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		void handle_group_left(std::unique_lock<std::mutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
-		
-		void connect_check(std::unique_lock<std::mutex> &l);
-		void connect_fail(std::unique_lock<std::mutex> &l, HRESULT hResultCode, const void *pvApplicationReplyData, DWORD dwApplicationReplyDataSize);
-		
-		HRESULT dispatch_message(std::unique_lock<std::mutex> &l, DWORD dwMessageType, PVOID pvMessage);
-		HRESULT dispatch_create_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext);
-		HRESULT dispatch_destroy_player(std::unique_lock<std::mutex> &l, DPNID dpnidPlayer, void *pvPlayerContext, DWORD dwReason);
-		HRESULT dispatch_destroy_group(std::unique_lock<std::mutex> &l, DPNID dpnidGroup, void *pvGroupContext, DWORD dwReason);
+		/* Called by the SharedListener without its lock held, except for
+		 * shared_udp_writable() which must not take ours.
+		*/
+		void adopt_connection(int sock, const struct sockaddr_in *addr, const void *data, size_t data_size);
+		void shared_udp_recv(const void *data, size_t size, const struct sockaddr_in *from_addr);
+		void shared_udp_writable();
+		
+		DPNID elect_new_host();
+		void become_host(std::unique_lock<ProfiledMutex> &l);
+		void host_migrated(std::unique_lock<ProfiledMutex> &l, DPNID new_host_id);
+		
+		void handle_host_enum_request(std::unique_lock<ProfiledMutex> &l, const PacketDeserialiser &pd, const struct sockaddr_in *from_addr);
+		bool host_enum_allowed(uint32_t ipaddr);
+		const PacketSerialiser &get_host_enum_response();
+		void handle_host_connect_request(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_host_connect_ok(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_host_connect_fail(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_connect_peer(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_connect_peer_ok(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_connect_peer_fail(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_message(std::unique_lock<ProfiledMutex> &l, const PacketDeserialiser &pd);
+		void handle_message_fragment(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void deliver_message(std::unique_lock<ProfiledMutex> &l, Peer *peer, DPNID from_player_id, unsigned char *buffer, size_t size, DWORD flags);
+		void handle_playerinfo(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_ack(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_appdesc(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_destroy_peer(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_terminate_session(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_allocate(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_create(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_destroy(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_join(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_joined(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_leave(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_group_left(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_host_migrate(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_ping(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		void handle_pong(std::unique_lock<ProfiledMutex> &l, unsigned int peer_id, const PacketDeserialiser &pd);
+		
+		void join_dispatch_deferred(std::unique_lock<ProfiledMutex> &l);
+		void connect_check(std::unique_lock<ProfiledMutex> &l);
+		void connect_fail(std::unique_lock<ProfiledMutex> &l, HRESULT hResultCode, const void *pvApplicationReplyData, DWORD dwApplicationReplyDataSize);
+		
+		void capture_session(uint32_t type, const DPN_APPLICATION_DESC *app_desc, uint16_t port);
+		
+		/* Calls the application's message handler, every message raised goes through here
+		 * so it can be traced and timed. The lock must not be held.
+		*/
+		HRESULT call_message_handler(DWORD dwMessageType, PVOID pvMessage);
+		
+		/* Message handler given to HostEnumerator, passes the message on to
+		 * call_message_handler() of the DirectPlay8Peer given as the context.
+		*/
+		static HRESULT CALLBACK host_enum_message_handler(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+		
+		HRESULT dispatch_message(std::unique_lock<ProfiledMutex> &l, DWORD dwMessageType, PVOID pvMessage);
+		HRESULT dispatch_create_player(std::unique_lock<ProfiledMutex> &l, DPNID dpnidPlayer, void **ppvPlayerContext);
+		HRESULT dispatch_destroy_player(std::unique_lock<ProfiledMutex> &l, DPNID dpnidPlayer, void *pvPlayerContext, DWORD dwReason);
+		HRESULT dispatch_destroy_group(std::unique_lock<ProfiledMutex> &l, DPNID dpnidGroup, void *pvGroupContext, DWORD dwReason);
 		
 	public:
-		DirectPlay8Peer(std::atomic<unsigned int> *global_refcount);
+		/* The transport and clock may be replaced for testing, see LoopbackTransport and
+		 * VirtualClock. They must outlive the instance.
+		*/
+		DirectPlay8Peer(std::atomic<unsigned int> *global_refcount, Role role = ROLE_PEER, Transport *transport = NULL, Clock *clock = NULL);
 		virtual ~DirectPlay8Peer();
 		
 		/* IUnknown */
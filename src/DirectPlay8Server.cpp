@@ -0,0 +1,290 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <objbase.h>
+#include <string.h>
+#include <windows.h>
+
+#include "DirectPlay8Peer.hpp"
+#include "DirectPlay8Server.hpp"
+
+DirectPlay8Server::DirectPlay8Server(std::atomic<unsigned int> *global_refcount):
+	global_refcount(global_refcount),
+	local_refcount(0),
+	message_handler(NULL),
+	message_handler_ctx(NULL)
+{
+	peer = new DirectPlay8Peer(global_refcount, DirectPlay8Peer::ROLE_SERVER);
+	AddRef();
+}
+
+DirectPlay8Server::~DirectPlay8Server()
+{
+	peer->Release();
+}
+
+HRESULT DirectPlay8Server::QueryInterface(REFIID riid, void **ppvObject)
+{
+	if(riid == IID_IDirectPlay8Server || riid == IID_IUnknown)
+	{
+		*((IUnknown**)(ppvObject)) = this;
+		AddRef();
+		
+		return S_OK;
+	}
+	else{
+		return E_NOINTERFACE;
+	}
+}
+
+ULONG DirectPlay8Server::AddRef(void)
+{
+	if(global_refcount != NULL)
+	{
+		++(*global_refcount);
+	}
+	
+	return ++local_refcount;
+}
+
+ULONG DirectPlay8Server::Release(void)
+{
+	std::atomic<unsigned int> *global_refcount = this->global_refcount;
+	
+	ULONG rc = --local_refcount;
+	if(rc == 0)
+	{
+		delete this;
+	}
+	
+	if(global_refcount != NULL)
+	{
+		--(*global_refcount);
+	}
+	
+	return rc;
+}
+
+HRESULT DirectPlay8Server::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags)
+{
+	HRESULT result = peer->Initialize(this, &peer_message_handler, dwFlags);
+	
+	if(result == S_OK)
+	{
+		message_handler     = pfn;
+		message_handler_ctx = pvUserContext;
+	}
+	
+	return result;
+}
+
+HRESULT DirectPlay8Server::EnumServiceProviders(CONST GUID* CONST pguidServiceProvider, CONST GUID* CONST pguidApplication, DPN_SERVICE_PROVIDER_INFO* CONST pSPInfoBuffer, PDWORD CONST pcbEnumData, PDWORD CONST pcReturned, CONST DWORD dwFlags)
+{
+	return peer->EnumServiceProviders(pguidServiceProvider, pguidApplication, pSPInfoBuffer, pcbEnumData, pcReturned, dwFlags);
+}
+
+HRESULT DirectPlay8Server::CancelAsyncOperation(CONST DPNHANDLE hAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->CancelAsyncOperation(hAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetSendQueueInfo(CONST DPNID dpnid, DWORD* CONST pdwNumMsgs, DWORD* CONST pdwNumBytes, CONST DWORD dwFlags)
+{
+	return peer->GetSendQueueInfo(dpnid, pdwNumMsgs, pdwNumBytes, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetApplicationDesc(DPN_APPLICATION_DESC* CONST pAppDescBuffer, DWORD* CONST pcbDataSize, CONST DWORD dwFlags)
+{
+	return peer->GetApplicationDesc(pAppDescBuffer, pcbDataSize, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SetServerInfo(CONST DPN_PLAYER_INFO* CONST pdpnPlayerInfo, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->SetPeerInfo(pdpnPlayerInfo, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetClientInfo(CONST DPNID dpnid, DPN_PLAYER_INFO* CONST pdpnPlayerInfo, DWORD* CONST pdwSize, CONST DWORD dwFlags)
+{
+	return peer->GetPeerInfo(dpnid, pdpnPlayerInfo, pdwSize, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetClientAddress(CONST DPNID dpnid, IDirectPlay8Address** CONST pAddress, CONST DWORD dwFlags)
+{
+	return peer->GetPeerAddress(dpnid, pAddress, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetLocalHostAddresses(IDirectPlay8Address** CONST prgpAddress, DWORD* CONST pcAddress, CONST DWORD dwFlags)
+{
+	return peer->GetLocalHostAddresses(prgpAddress, pcAddress, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SetApplicationDesc(CONST DPN_APPLICATION_DESC* CONST pad, CONST DWORD dwFlags)
+{
+	return peer->SetApplicationDesc(pad, dwFlags);
+}
+
+HRESULT DirectPlay8Server::Host(CONST DPN_APPLICATION_DESC* CONST pdnAppDesc, IDirectPlay8Address **CONST prgpDeviceInfo, CONST DWORD cDeviceInfo, CONST DPN_SECURITY_DESC* CONST pdnSecurity, CONST DPN_SECURITY_CREDENTIALS* CONST pdnCredentials, void* CONST pvPlayerContext, CONST DWORD dwFlags)
+{
+	return peer->Host(pdnAppDesc, prgpDeviceInfo, cDeviceInfo, pdnSecurity, pdnCredentials, pvPlayerContext, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SendTo(CONST DPNID dpnid, CONST DPN_BUFFER_DESC* CONST prgBufferDesc, CONST DWORD cBufferDesc, CONST DWORD dwTimeOut, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->SendTo(dpnid, prgBufferDesc, cBufferDesc, dwTimeOut, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::CreateGroup(CONST DPN_GROUP_INFO* CONST pdpnGroupInfo, void* CONST pvGroupContext, void* CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->CreateGroup(pdpnGroupInfo, pvGroupContext, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::DestroyGroup(CONST DPNID idGroup, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->DestroyGroup(idGroup, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::AddPlayerToGroup(CONST DPNID idGroup, CONST DPNID idClient, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->AddPlayerToGroup(idGroup, idClient, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::RemovePlayerFromGroup(CONST DPNID idGroup, CONST DPNID idClient, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->RemovePlayerFromGroup(idGroup, idClient, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST pdpnGroupInfo, PVOID CONST pvAsyncContext, DPNHANDLE* CONST phAsyncHandle, CONST DWORD dwFlags)
+{
+	return peer->SetGroupInfo(dpnid, pdpnGroupInfo, pvAsyncContext, phAsyncHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetGroupInfo(CONST DPNID dpnid, DPN_GROUP_INFO* CONST pdpnGroupInfo, DWORD* CONST pdwSize, CONST DWORD dwFlags)
+{
+	return peer->GetGroupInfo(dpnid, pdpnGroupInfo, pdwSize, dwFlags);
+}
+
+HRESULT DirectPlay8Server::EnumPlayersAndGroups(DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
+{
+	return peer->EnumPlayersAndGroups(prgdpnid, pcdpnid, dwFlags);
+}
+
+HRESULT DirectPlay8Server::EnumGroupMembers(CONST DPNID dpnid, DPNID* CONST prgdpnid, DWORD* CONST pcdpnid, CONST DWORD dwFlags)
+{
+	return peer->EnumGroupMembers(dpnid, prgdpnid, pcdpnid, dwFlags);
+}
+
+HRESULT DirectPlay8Server::Close(CONST DWORD dwFlags)
+{
+	return peer->Close(dwFlags);
+}
+
+HRESULT DirectPlay8Server::DestroyClient(CONST DPNID dpnidClient, CONST void* CONST pvDestroyData, CONST DWORD dwDestroyDataSize, CONST DWORD dwFlags)
+{
+	return peer->DestroyPeer(dpnidClient, pvDestroyData, dwDestroyDataSize, dwFlags);
+}
+
+HRESULT DirectPlay8Server::ReturnBuffer(CONST DPNHANDLE hBufferHandle, CONST DWORD dwFlags)
+{
+	return peer->ReturnBuffer(hBufferHandle, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetPlayerContext(CONST DPNID dpnid, PVOID* CONST ppvPlayerContext, CONST DWORD dwFlags)
+{
+	return peer->GetPlayerContext(dpnid, ppvPlayerContext, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetGroupContext(CONST DPNID dpnid, PVOID* CONST ppvGroupContext, CONST DWORD dwFlags)
+{
+	return peer->GetGroupContext(dpnid, ppvGroupContext, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetCaps(DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
+{
+	return peer->GetCaps(pdpCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SetCaps(CONST DPN_CAPS* CONST pdpCaps, CONST DWORD dwFlags)
+{
+	return peer->SetCaps(pdpCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Server::SetSPCaps(CONST GUID* CONST pguidSP, CONST DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags)
+{
+	return peer->SetSPCaps(pguidSP, pdpspCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetSPCaps(CONST GUID* CONST pguidSP, DPN_SP_CAPS* CONST pdpspCaps, CONST DWORD dwFlags)
+{
+	return peer->GetSPCaps(pguidSP, pdpspCaps, dwFlags);
+}
+
+HRESULT DirectPlay8Server::GetConnectionInfo(CONST DPNID dpnid, DPN_CONNECTION_INFO* CONST pdpConnectionInfo, CONST DWORD dwFlags)
+{
+	return peer->GetConnectionInfo(dpnid, pdpConnectionInfo, dwFlags);
+}
+
+HRESULT DirectPlay8Server::RegisterLobby(CONST DPNHANDLE dpnHandle, struct IDirectPlay8LobbiedApplication* CONST pIDP8LobbiedApplication, CONST DWORD dwFlags)
+{
+	return peer->RegisterLobby(dpnHandle, pIDP8LobbiedApplication, dwFlags);
+}
+
+HRESULT CALLBACK DirectPlay8Server::peer_message_handler(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	DirectPlay8Server *self = (DirectPlay8Server*)(pvUserContext);
+	
+	switch(dwMessageType)
+	{
+		case DPN_MSGID_PEER_INFO:
+		{
+			/* The player info of a client or the server itself has changed. The local
+			 * player ID doesn't change while the session is running, so we can safely
+			 * read it here without holding the peer's lock.
+			*/
+			
+			DPNMSG_PEER_INFO *pi = (DPNMSG_PEER_INFO*)(pMessage);
+			
+			if(pi->dpnidPeer == self->peer->local_player_id)
+			{
+				DPNMSG_SERVER_INFO si;
+				memset(&si, 0, sizeof(si));
+				
+				si.dwSize          = sizeof(si);
+				si.dpnidServer     = pi->dpnidPeer;
+				si.pvPlayerContext = pi->pvPlayerContext;
+				
+				return self->message_handler(self->message_handler_ctx, DPN_MSGID_SERVER_INFO, &si);
+			}
+			else{
+				DPNMSG_CLIENT_INFO ci;
+				memset(&ci, 0, sizeof(ci));
+				
+				ci.dwSize          = sizeof(ci);
+				ci.dpnidClient     = pi->dpnidPeer;
+				ci.pvPlayerContext = pi->pvPlayerContext;
+				
+				return self->message_handler(self->message_handler_ctx, DPN_MSGID_CLIENT_INFO, &ci);
+			}
+		}
+		
+		default:
+			return self->message_handler(self->message_handler_ctx, dwMessageType, pMessage);
+	}
+}
@@ -0,0 +1,289 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <mutex>
+#include <objbase.h>
+#include <string.h>
+#include <windows.h>
+
+#include "DirectPlay8ThreadPool.hpp"
+#include "HandleHandlingPool.hpp"
+#include "Log.hpp"
+
+/* Set while the current thread is inside DoWork(), which may not be called recursively from
+ * within a message handler.
+*/
+static thread_local bool in_do_work = false;
+
+DirectPlay8ThreadPool::DirectPlay8ThreadPool(std::atomic<unsigned int> *global_refcount):
+	global_refcount(global_refcount),
+	local_refcount(0),
+	pool(NULL),
+	initial_threads(0),
+	message_handler(NULL),
+	message_handler_ctx(NULL),
+	thread_hooks_id(0)
+{
+	AddRef();
+}
+
+DirectPlay8ThreadPool::~DirectPlay8ThreadPool()
+{
+	if(pool != NULL)
+	{
+		Close(0);
+	}
+}
+
+HRESULT DirectPlay8ThreadPool::QueryInterface(REFIID riid, void **ppvObject)
+{
+	if(riid == IID_IDirectPlay8ThreadPool || riid == IID_IUnknown)
+	{
+		*((IUnknown**)(ppvObject)) = this;
+		AddRef();
+		
+		return S_OK;
+	}
+	else{
+		return E_NOINTERFACE;
+	}
+}
+
+ULONG DirectPlay8ThreadPool::AddRef(void)
+{
+	if(global_refcount != NULL)
+	{
+		++(*global_refcount);
+	}
+	
+	return ++local_refcount;
+}
+
+ULONG DirectPlay8ThreadPool::Release(void)
+{
+	std::atomic<unsigned int> *global_refcount = this->global_refcount;
+	
+	ULONG rc = --local_refcount;
+	if(rc == 0)
+	{
+		delete this;
+	}
+	
+	if(global_refcount != NULL)
+	{
+		--(*global_refcount);
+	}
+	
+	return rc;
+}
+
+HRESULT DirectPlay8ThreadPool::Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(pfn == NULL)
+	{
+		return DPNERR_INVALIDPARAM;
+	}
+	
+	if(pool != NULL)
+	{
+		return DPNERR_ALREADYINITIALIZED;
+	}
+	
+	message_handler     = pfn;
+	message_handler_ctx = pvUserContext;
+	
+	pool            = HandleHandlingPool::acquire_shared();
+	initial_threads = pool->get_threads_per_pool();
+	
+	thread_hooks_id = pool->add_thread_hooks(
+		[this]() { thread_created(); },
+		[this]() { thread_destroyed(); });
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::Close(CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(pool == NULL)
+	{
+		return DPNERR_UNINITIALIZED;
+	}
+	
+	if(in_do_work)
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	/* Don't leave any sessions which outlive us without anything to process them. */
+	if(pool->get_threads_per_pool() == 0)
+	{
+		pool->set_threads_per_pool(initial_threads);
+	}
+	
+	HandleHandlingPool *pool = this->pool;
+	unsigned int thread_hooks_id = this->thread_hooks_id;
+	
+	this->pool = NULL;
+	
+	/* A worker raising DPN_MSGID_CREATE_THREAD or DPN_MSGID_DESTROY_THREAD may be calling
+	 * back into us, so don't hold the lock while waiting for it to finish.
+	*/
+	l.unlock();
+	
+	pool->remove_thread_hooks(thread_hooks_id);
+	HandleHandlingPool::release_shared();
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::GetThreadCount(CONST DWORD dwProcessorNum, DWORD* CONST pdwNumThreads, CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(pool == NULL)
+	{
+		return DPNERR_UNINITIALIZED;
+	}
+	
+	if(dwProcessorNum != (DWORD)(-1))
+	{
+		log_printf("IDirectPlay8ThreadPool::GetThreadCount() called for processor %u, per-processor thread counts are not supported", (unsigned)(dwProcessorNum));
+		return DPNERR_UNSUPPORTED;
+	}
+	
+	*pdwNumThreads = pool->get_threads_per_pool();
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::SetThreadCount(CONST DWORD dwProcessorNum, CONST DWORD dwNumThreads, CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(pool == NULL)
+	{
+		return DPNERR_UNINITIALIZED;
+	}
+	
+	if(dwProcessorNum != (DWORD)(-1))
+	{
+		log_printf("IDirectPlay8ThreadPool::SetThreadCount() called for processor %u, per-processor thread counts are not supported", (unsigned)(dwProcessorNum));
+		return DPNERR_UNSUPPORTED;
+	}
+	
+	if(in_do_work)
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	try {
+		pool->set_threads_per_pool(dwNumThreads);
+	}
+	catch(...)
+	{
+		return DPNERR_OUTOFMEMORY;
+	}
+	
+	return S_OK;
+}
+
+HRESULT DirectPlay8ThreadPool::DoWork(CONST DWORD dwAllowedTimeSlice, CONST DWORD dwFlags)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(pool == NULL)
+	{
+		return DPNERR_UNINITIALIZED;
+	}
+	
+	if(pool->get_threads_per_pool() != 0)
+	{
+		/* DoWork() is only permitted once the thread count has been set to zero. */
+		return DPNERR_NOTREADY;
+	}
+	
+	if(in_do_work)
+	{
+		return DPNERR_NOTALLOWED;
+	}
+	
+	/* Callbacks may call back into us (e.g. GetThreadCount()), so don't hold the lock while
+	 * processing work. We take our own reference to the shared pool in case another thread
+	 * calls Close() in the meantime.
+	*/
+	HandleHandlingPool *pool = HandleHandlingPool::acquire_shared();
+	l.unlock();
+	
+	in_do_work = true;
+	bool more_work = pool->dispatch_signalled(dwAllowedTimeSlice);
+	in_do_work = false;
+	
+	HandleHandlingPool::release_shared();
+	
+	return more_work ? DPNSUCCESS_PENDING : DPN_OK;
+}
+
+void DirectPlay8ThreadPool::thread_created()
+{
+	DPNMSG_CREATE_THREAD ct;
+	memset(&ct, 0, sizeof(ct));
+	
+	ct.dwSize         = sizeof(ct);
+	ct.dwFlags        = 0;
+	ct.dwProcessorNum = 0;
+	ct.pvUserContext  = NULL;
+	
+	message_handler(message_handler_ctx, DPN_MSGID_CREATE_THREAD, &ct);
+	
+	std::unique_lock<std::mutex> l(thread_contexts_lock);
+	thread_contexts[GetCurrentThreadId()] = ct.pvUserContext;
+}
+
+void DirectPlay8ThreadPool::thread_destroyed()
+{
+	DPNMSG_DESTROY_THREAD dt;
+	memset(&dt, 0, sizeof(dt));
+	
+	dt.dwSize         = sizeof(dt);
+	dt.dwProcessorNum = 0;
+	
+	{
+		std::unique_lock<std::mutex> l(thread_contexts_lock);
+		
+		/* Threads which started before we were initialised never raised
+		 * DPN_MSGID_CREATE_THREAD, so they don't get a DPN_MSGID_DESTROY_THREAD either.
+		*/
+		auto tc = thread_contexts.find(GetCurrentThreadId());
+		if(tc == thread_contexts.end())
+		{
+			return;
+		}
+		
+		dt.pvUserContext = tc->second;
+		thread_contexts.erase(tc);
+	}
+	
+	message_handler(message_handler_ctx, DPN_MSGID_DESTROY_THREAD, &dt);
+}
@@ -0,0 +1,96 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_DIRECTPLAY8THREADPOOL_HPP
+#define DPLITE_DIRECTPLAY8THREADPOOL_HPP
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <map>
+#include <mutex>
+#include <objbase.h>
+#include <windows.h>
+
+#include "HandleHandlingPool.hpp"
+
+/* IDirectPlay8ThreadPool controls the process-wide HandleHandlingPool which all DirectPlay8Peer
+ * (and Client/Server) instances do their work in.
+ *
+ * The thread count is the total number of worker threads in the pool (although each block of
+ * handles always gets at least one) rather than a per-processor count, since we don't bind
+ * threads to processors. Setting it to zero stops all worker threads, and the application must
+ * then call DoWork() regularly to process network events from its own thread. Blocking
+ * operations (DPNCONNECT_SYNC, DPNENUMHOSTS_SYNC, graceful Close(), etc) will not complete in
+ * that mode unless DoWork() is being called from another thread.
+ *
+ * DPN_MSGID_CREATE_THREAD and DPN_MSGID_DESTROY_THREAD are raised from each worker thread which
+ * starts or exits while we are initialised.
+*/
+
+class DirectPlay8ThreadPool: public IDirectPlay8ThreadPool
+{
+	private:
+		std::atomic<unsigned int> * const global_refcount;
+		ULONG local_refcount;
+		
+		std::mutex lock;
+		
+		/* Shared pool, NULL until Initialize() is called. */
+		HandleHandlingPool *pool;
+		
+		/* Thread count at the time we were initialised, restored by Close() if the
+		 * application leaves the pool with no threads.
+		*/
+		size_t initial_threads;
+		
+		PFNDPNMESSAGEHANDLER message_handler;
+		PVOID message_handler_ctx;
+		
+		/* Hooks registered with the pool to raise DPN_MSGID_CREATE_THREAD and
+		 * DPN_MSGID_DESTROY_THREAD, and the pvUserContext the application gave each
+		 * worker thread in the former, keyed by thread ID.
+		 *
+		 * The hooks may run on several workers at once, so thread_contexts has a lock of
+		 * its own.
+		*/
+		unsigned int thread_hooks_id;
+		std::map<DWORD, PVOID> thread_contexts;
+		std::mutex thread_contexts_lock;
+		
+		void thread_created();
+		void thread_destroyed();
+		
+	public:
+		DirectPlay8ThreadPool(std::atomic<unsigned int> *global_refcount);
+		virtual ~DirectPlay8ThreadPool();
+		
+		/* IUnknown */
+		virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvObject) override;
+		virtual ULONG STDMETHODCALLTYPE AddRef(void) override;
+		virtual ULONG STDMETHODCALLTYPE Release(void) override;
+		
+		/* IDirectPlay8ThreadPool */
+		virtual HRESULT STDMETHODCALLTYPE Initialize(PVOID CONST pvUserContext, CONST PFNDPNMESSAGEHANDLER pfn, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE Close(CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE GetThreadCount(CONST DWORD dwProcessorNum, DWORD* CONST pdwNumThreads, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE SetThreadCount(CONST DWORD dwProcessorNum, CONST DWORD dwNumThreads, CONST DWORD dwFlags) override;
+		virtual HRESULT STDMETHODCALLTYPE DoWork(CONST DWORD dwAllowedTimeSlice, CONST DWORD dwFlags) override;
+};
+
+#endif /* !DPLITE_DIRECTPLAY8THREADPOOL_HPP */
@@ -22,11 +22,26 @@
 #include <stdlib.h>
 
 #include "HandleHandlingPool.hpp"
+#include "Log.hpp"
 
-HandleHandlingPool::HandleHandlingPool(size_t threads_per_pool, size_t max_handles_per_pool):
+/* The shared pool waits on as many handles per block as WaitForMultipleObjects() allows, with
+ * one worker thread per CPU core divided between the blocks.
+*/
+#define SHARED_MIN_THREADS_PER_POOL 2
+#define SHARED_MAX_HANDLES_PER_POOL (MAXIMUM_WAIT_OBJECTS - 1)
+
+std::mutex HandleHandlingPool::shared_pool_lock;
+HandleHandlingPool *HandleHandlingPool::shared_pool = NULL;
+unsigned int HandleHandlingPool::shared_pool_refcount = 0;
+
+HandleHandlingPool::HandleHandlingPool(size_t threads_per_pool, size_t max_handles_per_pool, bool divide_threads):
 	threads_per_pool(threads_per_pool),
 	max_handles_per_pool(max_handles_per_pool + 1),
-	stopping(false)
+	divide_threads(divide_threads),
+	stopping(false),
+	wait_lock("HandleHandlingPool::wait_lock"),
+	dispatch_next(0),
+	next_thread_hooks_id(1)
 {
 	if(threads_per_pool < 1)
 	{
@@ -74,7 +89,7 @@ void HandleHandlingPool::add_handle(HANDLE handle, const std::function<void()> &
 	pending_writer = true;
 	SetEvent(spin_workers);
 	
-	std::unique_lock<std::shared_mutex> wal(wait_lock);
+	std::unique_lock<ProfiledSharedMutex> wal(wait_lock.at("add_handle"));
 	
 	ResetEvent(spin_workers);
 	pending_writer = false;
@@ -114,77 +129,15 @@ void HandleHandlingPool::add_handle(HANDLE handle, const std::function<void()> &
 			throw e;
 		}
 		
-		/* Calculate how many threads we need to spawn for there to be threads_per_pool
-		 * workers for this pool.
-		 *
-		 * This may be less than threads_per_pool, if the block we just created previously
-		 * existed, then some handles were removed causing it to go away - threads will exit
-		 * once they detect they have nothing to wait for, but we may also add more handles
-		 * before they catch up.
-		 *
-		 * Workers check if they have anything to do and remove themselves from
-		 * active_workers while holding wait_lock, so there is no race between us counting
-		 * the workers and them going away.
-		*/
-		
-		std::unique_lock<std::mutex> wo_l(workers_lock);
-		
-		size_t threads_to_spawn = threads_per_pool;
-		
-		for(auto w = active_workers.begin(); w != active_workers.end(); w++)
-		{
-			if((*w)->base_index == base_index)
-			{
-				--threads_to_spawn;
-			}
+		try {
+			spawn_workers(base_index);
 		}
-		
-		/* Spawn the new worker threads.
-		 *
-		 * We need to create the worker data on the heap so that:
-		 *
-		 * a) We can pass a reference to it into the worker main so that it may remove
-		 *    itself from active_workers when the time comes.
-		 *
-		 * b) The reference in active_workers itself is const, so that thread may be
-		 *    changed by the thread starting/exiting.
-		 *
-		 * The thread won't attempt to do anything (e.g. exit) until after acquiring
-		 * wait_lock, so it won't attempt to do anything with its thread handle before it
-		 * is done being initialised.
-		*/
-		
-		for(size_t i = 0; i < threads_to_spawn; ++i)
+		catch(const std::exception &e)
 		{
-			Worker *w = new Worker(base_index);
+			handles.pop_back(); callbacks.pop_back();
+			handles.pop_back(); callbacks.pop_back();
 			
-			try {
-				active_workers.insert(w);
-				
-				try {
-					w->thread = std::thread(&HandleHandlingPool::worker_main, this, w);
-				}
-				catch(const std::exception &e)
-				{
-					active_workers.erase(w);
-					throw e;
-				}
-			}
-			catch(const std::exception &e)
-			{
-				delete w;
-				
-				if(i == 0)
-				{
-					/* This is the first worker we tried spawning, fail the
-					 * whole operation.
-					*/
-					handles.pop_back(); callbacks.pop_back();
-					handles.pop_back(); callbacks.pop_back();
-					
-					throw e;
-				}
-			}
+			throw e;
 		}
 	}
 	else{
@@ -210,7 +163,7 @@ void HandleHandlingPool::remove_handle(HANDLE handle)
 	pending_writer = true;
 	SetEvent(spin_workers);
 	
-	std::unique_lock<std::shared_mutex> wal(wait_lock);
+	std::unique_lock<ProfiledSharedMutex> wal(wait_lock.at("remove_handle"));
 	
 	ResetEvent(spin_workers);
 	pending_writer = false;
@@ -240,10 +193,14 @@ void HandleHandlingPool::remove_handle(HANDLE handle)
 	 * boundary. Downside is we may keep one group of idle threads around for no reason.
 	*/
 	
+	bool removed_block = false;
+	
 	if(handles.back() == spin_workers)
 	{
 		handles.pop_back();
 		callbacks.pop_back();
+		
+		removed_block = true;
 	}
 	
 	/* Replace it with the last handle. */
@@ -254,11 +211,137 @@ void HandleHandlingPool::remove_handle(HANDLE handle)
 	callbacks[remove_index] = callbacks.back();
 	callbacks.pop_back();
 	
+	/* The remaining blocks may now be due more of the threads. */
+	if(removed_block && divide_threads)
+	{
+		for(size_t base_index = 0; base_index < handles.size(); base_index += max_handles_per_pool)
+		{
+			try {
+				spawn_workers(base_index);
+			}
+			catch(const std::exception &e)
+			{
+				/* Not fatal, every block still has at least the workers it had. */
+			}
+		}
+	}
+	
 	pending_writer_cv.notify_all();
 }
 
+/* Returns the number of workers which should be waiting on the block of handles starting at
+ * base_index. wait_lock MUST be held by the caller.
+*/
+size_t HandleHandlingPool::block_threads(size_t base_index) const
+{
+	if(!divide_threads || threads_per_pool == 0)
+	{
+		return threads_per_pool;
+	}
+	
+	size_t blocks = (handles.size() + max_handles_per_pool - 1) / max_handles_per_pool;
+	size_t block  = base_index / max_handles_per_pool;
+	
+	if(blocks == 0)
+	{
+		return threads_per_pool;
+	}
+	
+	/* Any threads left over go to the first blocks. */
+	size_t threads = (threads_per_pool / blocks) + (block < (threads_per_pool % blocks) ? 1 : 0);
+	
+	return std::max<size_t>(threads, 1);
+}
+
+/* Spawn any worker threads missing from the block of handles starting at base_index.
+ *
+ * wait_lock MUST be held exclusively by the caller. Throws if no threads could be spawned.
+*/
+void HandleHandlingPool::spawn_workers(size_t base_index)
+{
+	/* Work out which of the worker slots for this block are already occupied.
+	 *
+	 * Some may be, if the block we are spawning for previously existed, then some handles
+	 * were removed causing it to go away - threads will exit once they detect they have
+	 * nothing to wait for, but we may also add more handles before they catch up.
+	 *
+	 * Workers check if they have anything to do and remove themselves from active_workers
+	 * while holding wait_lock, so there is no race between us counting the workers and them
+	 * going away.
+	*/
+	
+	std::unique_lock<std::mutex> wo_l(workers_lock);
+	
+	size_t threads = block_threads(base_index);
+	std::vector<bool> slot_used(threads, false);
+	
+	for(auto w = active_workers.begin(); w != active_workers.end(); w++)
+	{
+		if((*w)->base_index == base_index && (*w)->slot < threads)
+		{
+			slot_used[(*w)->slot] = true;
+		}
+	}
+	
+	/* Spawn the new worker threads.
+	 *
+	 * We need to create the worker data on the heap so that:
+	 *
+	 * a) We can pass a reference to it into the worker main so that it may remove
+	 *    itself from active_workers when the time comes.
+	 *
+	 * b) The reference in active_workers itself is const, so that thread may be
+	 *    changed by the thread starting/exiting.
+	 *
+	 * The thread won't attempt to do anything (e.g. exit) until after acquiring
+	 * wait_lock, so it won't attempt to do anything with its thread handle before it
+	 * is done being initialised.
+	*/
+	
+	bool spawned_any = false;
+	
+	for(size_t slot = 0; slot < threads; ++slot)
+	{
+		if(slot_used[slot])
+		{
+			continue;
+		}
+		
+		Worker *w = new Worker(base_index, slot);
+		
+		try {
+			active_workers.insert(w);
+			
+			try {
+				w->thread = std::thread(&HandleHandlingPool::worker_main, this, w);
+			}
+			catch(const std::exception &e)
+			{
+				active_workers.erase(w);
+				throw e;
+			}
+		}
+		catch(const std::exception &e)
+		{
+			delete w;
+			
+			if(!spawned_any)
+			{
+				/* This is the first worker we tried spawning, fail the whole
+				 * operation.
+				*/
+				throw e;
+			}
+		}
+		
+		spawned_any = true;
+	}
+}
+
 void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 {
+	call_thread_hooks(true);
+	
 	while(1)
 	{
 		if(pending_writer)
@@ -267,11 +350,22 @@ void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 			pending_writer_cv.wait(pwl, [this]() { return !pending_writer; });
 		}
 		
-		std::shared_lock<std::shared_mutex> l(wait_lock);
+		std::shared_lock<ProfiledSharedMutex> l(wait_lock.at("worker_main"));
 		
 		if(handles.size() <= w->base_index)
 		{
 			/* No handles to wait on. Exit. */
+			l.unlock();
+			worker_exit(w);
+			return;
+		}
+		
+		if(w->slot >= block_threads(w->base_index))
+		{
+			/* The thread count was reduced by set_threads_per_pool(), or another block
+			 * was added and is taking some of our threads. Exit.
+			*/
+			l.unlock();
 			worker_exit(w);
 			return;
 		}
@@ -281,10 +375,31 @@ void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 		*/
 		size_t num_handles = std::min((handles.size() - w->base_index), max_handles_per_pool);
 		
-		DWORD wait_res = WaitForMultipleObjects(num_handles, &(handles[w->base_index]), FALSE, INFINITE);
+		DWORD wait_res = WAIT_TIMEOUT;
+		
+		/* WaitForMultipleObjects() always returns the lowest signalled handle, so we first
+		 * poll the handles after the one we serviced last and only wait on the whole block
+		 * if none of those are ready.
+		*/
+		if(w->next_offset > 1 && w->next_offset < num_handles)
+		{
+			size_t num_poll = num_handles - w->next_offset;
+			DWORD poll_res = WaitForMultipleObjects(num_poll, &(handles[w->base_index + w->next_offset]), FALSE, 0);
+			
+			if(poll_res >= WAIT_OBJECT_0 && poll_res < (WAIT_OBJECT_0 + num_poll))
+			{
+				wait_res = poll_res + w->next_offset;
+			}
+		}
+		
+		if(wait_res == WAIT_TIMEOUT)
+		{
+			wait_res = WaitForMultipleObjects(num_handles, &(handles[w->base_index]), FALSE, INFINITE);
+		}
 		
 		if(stopping)
 		{
+			l.unlock();
 			worker_exit(w);
 			return;
 		}
@@ -298,6 +413,8 @@ void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 			size_t wait_index = (w->base_index + wait_res) - WAIT_OBJECT_0;
 			std::function<void()> callback = callbacks[wait_index];
 			
+			w->next_offset = (wait_res - WAIT_OBJECT_0) + 1;
+			
 			l.unlock();
 			
 			callback();
@@ -307,6 +424,7 @@ void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 			/* Some system error while waiting... invalid handle?
 			 * Only thing we can do is go quietly. Or maybe not so quietly... abort?
 			*/
+			l.unlock();
 			worker_exit(w);
 			return;
 		}
@@ -316,10 +434,12 @@ void HandleHandlingPool::worker_main(HandleHandlingPool::Worker *w)
 /* Exit a worker thread.
  *
  * This MUST only be called by the worker thread which is about to exit, which
- * MUST exit as soon as this method returns.
+ * MUST exit as soon as this method returns. wait_lock MUST NOT be held.
 */
 void HandleHandlingPool::worker_exit(HandleHandlingPool::Worker *w)
 {
+	call_thread_hooks(false);
+	
 	std::unique_lock<std::mutex> wo_l(workers_lock);
 	
 	if(join_worker.joinable())
@@ -344,5 +464,236 @@ void HandleHandlingPool::worker_exit(HandleHandlingPool::Worker *w)
 	*/
 }
 
-HandleHandlingPool::Worker::Worker(size_t base_index):
-	base_index(base_index) {}
+/* The hooks being called by this thread, so remove_thread_hooks() doesn't wait for the call
+ * it is being made from.
+*/
+static thread_local const void *running_thread_hooks = NULL;
+
+void HandleHandlingPool::call_thread_hooks(bool start)
+{
+	std::unique_lock<std::mutex> l(thread_hooks_lock);
+	
+	/* Hooks may be added or removed while we are calling them. */
+	std::vector< std::shared_ptr<ThreadHooks> > hooks;
+	
+	for(auto h = thread_hooks.begin(); h != thread_hooks.end(); ++h)
+	{
+		hooks.push_back(h->second);
+	}
+	
+	for(auto h = hooks.begin(); h != hooks.end(); ++h)
+	{
+		ThreadHooks *th = h->get();
+		
+		if(th->removed)
+		{
+			continue;
+		}
+		
+		const std::function<void()> &hook = start ? th->on_start : th->on_exit;
+		
+		if(hook)
+		{
+			++(th->in_flight);
+			l.unlock();
+			
+			running_thread_hooks = th;
+			hook();
+			running_thread_hooks = NULL;
+			
+			l.lock();
+			
+			if(--(th->in_flight) == 0)
+			{
+				thread_hooks_cv.notify_all();
+			}
+		}
+	}
+}
+
+HandleHandlingPool *HandleHandlingPool::acquire_shared()
+{
+	std::unique_lock<std::mutex> l(shared_pool_lock);
+	
+	if(shared_pool == NULL)
+	{
+		size_t threads_per_pool = std::max<size_t>(std::thread::hardware_concurrency(), SHARED_MIN_THREADS_PER_POOL);
+		shared_pool = new HandleHandlingPool(threads_per_pool, SHARED_MAX_HANDLES_PER_POOL, true);
+	}
+	
+	++shared_pool_refcount;
+	
+	return shared_pool;
+}
+
+void HandleHandlingPool::release_shared()
+{
+	std::unique_lock<std::mutex> l(shared_pool_lock);
+	
+	if(--shared_pool_refcount == 0)
+	{
+		/* Profiles of the process-wide locks cover every instance which used the pool. */
+		shared_pool->log_lock_stats();
+		::log_lock_stats();
+		
+		delete shared_pool;
+		shared_pool = NULL;
+	}
+}
+
+unsigned int HandleHandlingPool::add_thread_hooks(const std::function<void()> &on_start, const std::function<void()> &on_exit)
+{
+	std::unique_lock<std::mutex> l(thread_hooks_lock);
+	
+	unsigned int id = next_thread_hooks_id++;
+	
+	std::shared_ptr<ThreadHooks> hooks(new ThreadHooks());
+	hooks->on_start  = on_start;
+	hooks->on_exit   = on_exit;
+	hooks->in_flight = 0;
+	hooks->removed   = false;
+	
+	thread_hooks[id] = hooks;
+	
+	return id;
+}
+
+void HandleHandlingPool::remove_thread_hooks(unsigned int id)
+{
+	std::unique_lock<std::mutex> l(thread_hooks_lock);
+	
+	auto h = thread_hooks.find(id);
+	if(h == thread_hooks.end())
+	{
+		return;
+	}
+	
+	std::shared_ptr<ThreadHooks> hooks = h->second;
+	
+	hooks->removed = true;
+	thread_hooks.erase(h);
+	
+	/* If we are being called from one of the hooks being removed, don't wait for it. */
+	unsigned int self = (running_thread_hooks == hooks.get()) ? 1 : 0;
+	
+	thread_hooks_cv.wait(l, [&hooks, self]() { return hooks->in_flight == self; });
+}
+
+size_t HandleHandlingPool::get_threads_per_pool()
+{
+	std::shared_lock<ProfiledSharedMutex> l(wait_lock.at("get_threads_per_pool"));
+	return threads_per_pool;
+}
+
+void HandleHandlingPool::set_threads_per_pool(size_t threads_per_pool)
+{
+	/* See HandleHandlingPool.hpp for an explanation of this sequence. */
+	
+	std::unique_lock<std::mutex> pwl(pending_writer_lock);
+	
+	pending_writer = true;
+	SetEvent(spin_workers);
+	
+	std::unique_lock<ProfiledSharedMutex> wal(wait_lock.at("set_threads_per_pool"));
+	
+	ResetEvent(spin_workers);
+	pending_writer = false;
+	
+	pwl.unlock();
+	
+	pending_writer_cv.notify_all();
+	
+	/* Any workers with a slot beyond the new limit will exit when they next wake up, we only
+	 * need to spawn workers if the limit was raised.
+	*/
+	
+	this->threads_per_pool = threads_per_pool;
+	
+	for(size_t base_index = 0; base_index < handles.size(); base_index += max_handles_per_pool)
+	{
+		spawn_workers(base_index);
+	}
+}
+
+bool HandleHandlingPool::dispatch_signalled(DWORD max_time)
+{
+	DWORD started_at = GetTickCount();
+	
+	while(1)
+	{
+		if(pending_writer)
+		{
+			std::unique_lock<std::mutex> pwl(pending_writer_lock);
+			pending_writer_cv.wait(pwl, [this]() { return !pending_writer; });
+		}
+		
+		std::shared_lock<ProfiledSharedMutex> l(wait_lock.at("dispatch_signalled"));
+		
+		/* Poll each block for a signalled handle, starting after the last one we
+		 * dispatched and wrapping around to the start of the array, so that the handles at
+		 * the start can't starve the rest.
+		*/
+		
+		size_t found_index = handles.size();
+		
+		size_t index   = dispatch_next;
+		size_t scanned = 0;
+		
+		if(index >= handles.size())
+		{
+			index = 0;
+		}
+		
+		while(found_index == handles.size() && scanned < handles.size())
+		{
+			size_t block_end = std::min((((index / max_handles_per_pool) + 1) * max_handles_per_pool), handles.size());
+			
+			/* Skip over spin_workers at the start of the block. */
+			size_t poll_begin = (index % max_handles_per_pool) == 0 ? (index + 1) : index;
+			
+			if(poll_begin < block_end)
+			{
+				size_t num_poll = block_end - poll_begin;
+				DWORD poll_res = WaitForMultipleObjects(num_poll, &(handles[poll_begin]), FALSE, 0);
+				
+				if(poll_res >= WAIT_OBJECT_0 && poll_res < (WAIT_OBJECT_0 + num_poll))
+				{
+					found_index = poll_begin + (poll_res - WAIT_OBJECT_0);
+				}
+			}
+			
+			scanned += block_end - index;
+			index = block_end < handles.size() ? block_end : 0;
+		}
+		
+		if(found_index == handles.size())
+		{
+			/* Nothing left to do. */
+			return false;
+		}
+		
+		dispatch_next = found_index + 1;
+		
+		std::function<void()> callback = callbacks[found_index];
+		
+		l.unlock();
+		
+		callback();
+		
+		if(max_time != INFINITE && (GetTickCount() - started_at) >= max_time)
+		{
+			return true;
+		}
+	}
+}
+
+HandleHandlingPool::Worker::Worker(size_t base_index, size_t slot):
+	base_index(base_index),
+	slot(slot),
+	next_offset(1) {}
+
+void HandleHandlingPool::log_lock_stats()
+{
+	wait_lock.get_profile().log_summary();
+	wait_lock.get_profile().reset();
+}
@@ -23,6 +23,8 @@
 #include <atomic>
 #include <condition_variable>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <shared_mutex>
@@ -30,6 +32,8 @@
 #include <vector>
 #include <windows.h>
 
+#include "ProfiledMutex.hpp"
+
 /* This class maintains a pool of threads to wait on HANDLEs and invoke callback functors when the
  * HANDLEs become signalled.
  *
@@ -44,6 +48,18 @@
  * is signalled multiple times in quick sucession or is a manual reset event. Ensure your callbacks
  * can handle this and do not block, as this will prevent other HANDLEs managed by the same thread
  * from being invoked.
+ *
+ * Each worker resumes scanning its block after the last HANDLE it serviced, so a HANDLE which is
+ * signalled continuously cannot starve the HANDLEs after it in the same block.
+ *
+ * If divide_threads is set, threads_per_pool is instead the total number of worker threads,
+ * divided as evenly as possible between the blocks. Every block still gets at least one, since
+ * WaitForMultipleObjects() can't wait on more than one block at a time.
+ *
+ * A single process-wide pool, sized from the number of CPU cores, is available through
+ * acquire_shared() and is used by all DirectPlay8Peer and HostEnumerator instances. Its threads
+ * are divided between blocks, so the number of threads doesn't grow with the number of sessions
+ * until there are more blocks than cores.
 */
 
 class HandleHandlingPool
@@ -52,13 +68,24 @@ class HandleHandlingPool
 		struct Worker
 		{
 			const size_t base_index;
+			const size_t slot;
 			std::thread thread;
 			
-			Worker(size_t base_index);
+			/* Offset within the block of the handle after the one most recently
+			 * serviced by this worker.
+			*/
+			size_t next_offset;
+			
+			Worker(size_t base_index, size_t slot);
 		};
 		
-		const size_t threads_per_pool;
+		/* threads_per_pool may be changed by set_threads_per_pool() while holding
+		 * wait_lock exclusively. Workers whose slot is not below it exit when they next
+		 * wake up.
+		*/
+		size_t threads_per_pool;
 		const size_t max_handles_per_pool;
+		const bool divide_threads;
 		
 		/* spin_workers is a MANUAL RESET event object, we set this to signalled whenever
 		 * we need all the worker threads to exit their WaitForMultipleObjects() calls.
@@ -88,9 +115,12 @@ class HandleHandlingPool
 		 *
 		 * One thread may hold it exclusively in order to add or remove a handle, this
 		 * will block any workers from waiting for events.
+		 *
+		 * Shared holds by workers include the time spent waiting for events, so expect
+		 * their hold times in the lock profile to be long.
 		*/
 		
-		std::shared_mutex wait_lock;
+		ProfiledSharedMutex wait_lock;
 		
 		/* pending_writer ensures worker threads cannot starve writers which are trying to
 		 * exclusively take wait_lock.
@@ -156,15 +186,88 @@ class HandleHandlingPool
 		std::mutex              workers_lock;
 		std::condition_variable workers_cv;
 		
+		/* Index in handles to start polling from in the next dispatch_signalled() call. */
+		std::atomic<size_t> dispatch_next;
+		
+		/* Functions registered by add_thread_hooks(), which every worker thread calls
+		 * when it starts and again just before it exits.
+		 *
+		 * The hooks are called without thread_hooks_lock held, so one slow hook doesn't
+		 * hold up other workers starting or exiting. in_flight counts the calls in
+		 * progress, which remove_thread_hooks() waits on before returning.
+		*/
+		struct ThreadHooks
+		{
+			std::function<void()> on_start;
+			std::function<void()> on_exit;
+			
+			unsigned int in_flight;
+			bool removed;
+		};
+		
+		std::map< unsigned int, std::shared_ptr<ThreadHooks> > thread_hooks;
+		unsigned int next_thread_hooks_id;
+		std::mutex thread_hooks_lock;
+		std::condition_variable thread_hooks_cv;
+		
+		size_t block_threads(size_t base_index) const;
+		void spawn_workers(size_t base_index);
 		void worker_main(HandleHandlingPool::Worker *w);
 		void worker_exit(HandleHandlingPool::Worker *w);
+		void call_thread_hooks(bool start);
+		
+		static std::mutex shared_pool_lock;
+		static HandleHandlingPool *shared_pool;
+		static unsigned int shared_pool_refcount;
 		
 	public:
-		HandleHandlingPool(size_t threads_per_pool, size_t max_handles_per_pool);
+		HandleHandlingPool(size_t threads_per_pool, size_t max_handles_per_pool, bool divide_threads = false);
 		~HandleHandlingPool();
 		
 		void add_handle(HANDLE handle, const std::function<void()> &callback);
 		void remove_handle(HANDLE handle);
+		
+		size_t get_threads_per_pool();
+		
+		/* Change the number of worker threads waiting on each block of handles (or in
+		 * total, if divide_threads is set). Zero is permitted, in which case callbacks
+		 * will only be invoked by dispatch_signalled().
+		*/
+		void set_threads_per_pool(size_t threads_per_pool);
+		
+		/* Invoke the callbacks of any signalled handles from the calling thread, until no
+		 * more are signalled or max_time milliseconds (may be INFINITE) have elapsed.
+		 *
+		 * Returns true if we stopped because the time ran out, in which case there may be
+		 * more handles still waiting to be dispatched.
+		*/
+		bool dispatch_signalled(DWORD max_time);
+		
+		/* Register functions to be called from each worker thread as it starts and just
+		 * before it exits, without any of our locks held. Threads which are already
+		 * running when the hooks are added only call on_exit.
+		 *
+		 * Returns an ID to pass to remove_thread_hooks(), which must be called before
+		 * anything the hooks refer to is destroyed. It waits for any calls to the hooks
+		 * which are in progress on other threads to return.
+		*/
+		unsigned int add_thread_hooks(const std::function<void()> &on_start, const std::function<void()> &on_exit);
+		void remove_thread_hooks(unsigned int id);
+		
+		/* Obtain a reference to the process-wide pool, creating it if necessary. Every
+		 * call must be balanced by a call to release_shared(), the pool is destroyed when
+		 * the last reference is released.
+		 *
+		 * release_shared() must not be called from within a callback belonging to the
+		 * shared pool, since destroying the pool waits for its worker threads to exit.
+		*/
+		static HandleHandlingPool *acquire_shared();
+		static void release_shared();
+		
+		/* Write the wait_lock profile to the log and reset it. Called by release_shared()
+		 * when the shared pool is destroyed, or whenever a snapshot is wanted.
+		*/
+		void log_lock_stats();
 };
 
 #endif /* !DPLITE_HANDLEHANDLINGPOOL_HPP */
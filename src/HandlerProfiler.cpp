@@ -0,0 +1,206 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <dplite.h>
+#include <mutex>
+#include <windows.h>
+
+#include "ConnectionStats.hpp"
+#include "HandlerProfiler.hpp"
+#include "Log.hpp"
+#include "Trace.hpp"
+
+static_assert(HandlerProfiler::LATENCY_BUCKETS == ConnectionStats::LATENCY_BUCKETS,
+	"Handler times are bucketed by ConnectionStats::latency_bucket()");
+
+HandlerProfiler::HandlerProfiler():
+	warn_us(0)
+{
+	reset();
+}
+
+int HandlerProfiler::type_index(DWORD message_type)
+{
+	if(message_type > DPN_MSGID_OFFSET && message_type < (DPN_MSGID_OFFSET | NUM_TYPES))
+	{
+		return message_type & ~DPN_MSGID_OFFSET;
+	}
+	else{
+		return 0;
+	}
+}
+
+void HandlerProfiler::set_warn_time(DWORD ms)
+{
+	warn_us = ms * 1000;
+}
+
+DWORD HandlerProfiler::get_warn_time() const
+{
+	return warn_us / 1000;
+}
+
+bool HandlerProfiler::record(DWORD message_type, DPNID player, unsigned long long us)
+{
+	TypeStats &ts = types[type_index(message_type)];
+	
+	++(ts.count);
+	ts.total_us += us;
+	++(ts.histogram[ConnectionStats::latency_bucket(us)]);
+	
+	DWORD us32 = (us < 0xFFFFFFFF ? (DWORD)(us) : 0xFFFFFFFF);
+	
+	if(us32 > ts.max_us.load(std::memory_order_relaxed))
+	{
+		std::unique_lock<std::mutex> l(max_lock);
+		
+		if(us32 > ts.max_us)
+		{
+			ts.max_us     = us32;
+			ts.max_player = player;
+		}
+	}
+	
+	DWORD warn = warn_us.load(std::memory_order_relaxed);
+	
+	if(warn > 0 && us > warn)
+	{
+		++(ts.slow_count);
+		return true;
+	}
+	else{
+		return false;
+	}
+}
+
+bool HandlerProfiler::get_stats(DPLITE_HANDLER_STATS *stats) const
+{
+	int first, last;
+	
+	if(stats->dwMessageType == 0)
+	{
+		first = 0;
+		last  = NUM_TYPES - 1;
+	}
+	else if(type_index(stats->dwMessageType) != 0)
+	{
+		first = last = type_index(stats->dwMessageType);
+	}
+	else{
+		return false;
+	}
+	
+	stats->dwCount        = 0;
+	stats->dwSlowCount    = 0;
+	stats->qwTotalTime    = 0;
+	stats->dwMaxTime      = 0;
+	stats->dpnidMaxPlayer = 0;
+	
+	for(int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		stats->dwHistogram[i] = 0;
+	}
+	
+	for(int t = first; t <= last; ++t)
+	{
+		const TypeStats &ts = types[t];
+		
+		stats->dwCount     += ts.count;
+		stats->dwSlowCount += ts.slow_count;
+		stats->qwTotalTime += ts.total_us;
+		
+		for(int i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			stats->dwHistogram[i] += ts.histogram[i];
+		}
+		
+		if(ts.max_us > stats->dwMaxTime)
+		{
+			stats->dwMaxTime      = ts.max_us;
+			stats->dpnidMaxPlayer = ts.max_player;
+			
+			if(first != last)
+			{
+				stats->dwMessageType = (t != 0 ? (DPN_MSGID_OFFSET | t) : 0);
+			}
+		}
+	}
+	
+	return true;
+}
+
+void HandlerProfiler::reset()
+{
+	std::unique_lock<std::mutex> l(max_lock);
+	
+	for(int t = 0; t < NUM_TYPES; ++t)
+	{
+		TypeStats &ts = types[t];
+		
+		ts.count      = 0;
+		ts.slow_count = 0;
+		ts.total_us   = 0;
+		ts.max_us     = 0;
+		ts.max_player = 0;
+		
+		for(int i = 0; i < LATENCY_BUCKETS; ++i)
+		{
+			ts.histogram[i] = 0;
+		}
+	}
+}
+
+void HandlerProfiler::log_summary() const
+{
+	for(int t = 0; t < NUM_TYPES; ++t)
+	{
+		const TypeStats &ts = types[t];
+		
+		DWORD count = ts.count;
+		if(count == 0)
+		{
+			continue;
+		}
+		
+		/* Upper bound of the bucket containing the 99th percentile. */
+		DWORD seen = 0;
+		int p99_bucket = 0;
+		
+		for(; p99_bucket < (LATENCY_BUCKETS - 1); ++p99_bucket)
+		{
+			seen += ts.histogram[p99_bucket];
+			
+			if(seen >= (count - (count / 100)))
+			{
+				break;
+			}
+		}
+		
+		log_printf("Message handler %s: %u calls, mean %u us, 99%% under %u us, max %u us (player %u), %u slow",
+			(t != 0 ? trace_message_name(TE_HANDLER_BEGIN, DPN_MSGID_OFFSET | t) : "(other)"),
+			(unsigned)(count),
+			(unsigned)(ts.total_us / count),
+			(unsigned)(1U << p99_bucket),
+			(unsigned)(ts.max_us),
+			(unsigned)(ts.max_player),
+			(unsigned)(ts.slow_count));
+	}
+}
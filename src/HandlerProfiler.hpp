@@ -0,0 +1,96 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_HANDLERPROFILER_HPP
+#define DPLITE_HANDLERPROFILER_HPP
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <dplite.h>
+#include <mutex>
+#include <windows.h>
+
+/* Timing of calls to the application's message handler, by message type. Used to fill in
+ * DPLITE_HANDLER_STATS.
+ *
+ * Counters are atomics so calls may be recorded from any number of worker threads without
+ * taking the session-wide lock, the same as ConnectionStats.
+*/
+
+class HandlerProfiler
+{
+	public:
+		static const int LATENCY_BUCKETS = DPLITE_HANDLER_HISTOGRAM_BUCKETS;
+		
+	private:
+		/* One slot for each DPN_MSGID_* value from DPN_MSGID_ADD_PLAYER_TO_GROUP up to
+		 * DPN_MSGID_DESTROY_THREAD, slot 0 counts anything else.
+		*/
+		static const int NUM_TYPES = 0x19;
+		
+		struct TypeStats
+		{
+			std::atomic<DWORD> count;
+			std::atomic<DWORD> slow_count;
+			std::atomic<unsigned long long> total_us;
+			
+			std::atomic<DWORD> max_us;
+			std::atomic<DPNID> max_player;
+			
+			std::atomic<DWORD> histogram[LATENCY_BUCKETS];
+		};
+		
+		TypeStats types[NUM_TYPES];
+		
+		/* Held while updating max_us and max_player, so they agree. Only taken by calls
+		 * which look like they might be a new maximum.
+		*/
+		std::mutex max_lock;
+		
+		std::atomic<DWORD> warn_us;  /* 0 if disabled. */
+		
+		static int type_index(DWORD message_type);
+		
+	public:
+		HandlerProfiler();
+		
+		/* No copy c'tor. */
+		HandlerProfiler(const HandlerProfiler&) = delete;
+		
+		/* Threshold above which calls are counted as slow, in milliseconds. */
+		void set_warn_time(DWORD ms);
+		DWORD get_warn_time() const;
+		
+		/* Record a call to the handler which took us microseconds. player is the player
+		 * the message was for (or from), 0 if none. Returns true if the call was slow.
+		*/
+		bool record(DWORD message_type, DPNID player, unsigned long long us);
+		
+		/* Fills in stats for the type in stats->dwMessageType (0 for all types), returns
+		 * false if the type isn't a DPN_MSGID_* value.
+		*/
+		bool get_stats(DPLITE_HANDLER_STATS *stats) const;
+		
+		void reset();
+		
+		/* Writes a line for each message type that has been handled to the log. */
+		void log_summary() const;
+};
+
+#endif /* !DPLITE_HANDLERPROFILER_HPP */
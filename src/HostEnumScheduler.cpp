@@ -0,0 +1,371 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <windows.h>
+
+#include "HostEnumerator.hpp"
+#include "HostEnumScheduler.hpp"
+#include "Messages.hpp"
+#include "packet.hpp"
+
+std::mutex HostEnumScheduler::shared_lock;
+HostEnumScheduler *HostEnumScheduler::shared_scheduler = NULL;
+unsigned int HostEnumScheduler::shared_refcount = 0;
+
+HostEnumScheduler::HostEnumScheduler():
+	next_enumerator_id(1),
+	wake_pending(false)
+{
+	/* TODO: Bind to interface in pdpaddrDeviceInfo, if provided. */
+	
+	sock = create_udp_socket(0, 0);
+	if(sock == -1)
+	{
+		throw std::runtime_error("Cannot create UDP socket");
+	}
+	
+	sock_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(sock_event == NULL)
+	{
+		closesocket(sock);
+		throw std::runtime_error("Cannot create sock_event object");
+	}
+	
+	if(WSAEventSelect(sock, sock_event, FD_READ))
+	{
+		CloseHandle(sock_event);
+		closesocket(sock);
+		throw std::runtime_error("Cannot WSAEventSelect");
+	}
+	
+	timer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if(timer == NULL)
+	{
+		CloseHandle(sock_event);
+		closesocket(sock);
+		throw std::runtime_error("Cannot create timer object");
+	}
+	
+	pool_idle = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(pool_idle == NULL)
+	{
+		CloseHandle(timer);
+		CloseHandle(sock_event);
+		closesocket(sock);
+		throw std::runtime_error("Cannot create pool_idle object");
+	}
+	
+	pool     = HandleHandlingPool::acquire_shared();
+	pool_ref = std::shared_ptr<void>(nullptr, [this](void*) { SetEvent(pool_idle); });
+	
+	std::shared_ptr<void> ref = pool_ref;
+	
+	pool->add_handle(sock_event, [this, ref]() { handle_sock_event(); });
+	pool->add_handle(timer,      [this, ref]() { handle_timer(); });
+}
+
+HostEnumScheduler::~HostEnumScheduler()
+{
+	pool->remove_handle(timer);
+	pool->remove_handle(sock_event);
+	
+	pool_ref.reset();
+	WaitForSingleObject(pool_idle, INFINITE);
+	
+	HandleHandlingPool::release_shared();
+	
+	CloseHandle(pool_idle);
+	CloseHandle(timer);
+	CloseHandle(sock_event);
+	closesocket(sock);
+}
+
+HostEnumScheduler *HostEnumScheduler::acquire_shared()
+{
+	std::unique_lock<std::mutex> l(shared_lock);
+	
+	if(shared_scheduler == NULL)
+	{
+		shared_scheduler = new HostEnumScheduler();
+	}
+	
+	++shared_refcount;
+	
+	return shared_scheduler;
+}
+
+void HostEnumScheduler::release_shared()
+{
+	std::unique_lock<std::mutex> l(shared_lock);
+	
+	if(--shared_refcount == 0)
+	{
+		delete shared_scheduler;
+		shared_scheduler = NULL;
+	}
+}
+
+unsigned int HostEnumScheduler::add(HostEnumerator *he, const std::shared_ptr<void> &ref)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	unsigned int id = next_enumerator_id++;
+	
+	Enumerator e;
+	e.he  = he;
+	e.ref = ref;
+	
+	enumerators.insert(std::make_pair(id, e));
+	
+	wake_pending = true;
+	arm_timer(0);
+	
+	return id;
+}
+
+void HostEnumScheduler::remove(unsigned int id)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	enumerators.erase(id);
+	
+	for(auto r = requests.begin(); r != requests.end();)
+	{
+		if(r->second == id)
+		{
+			r = requests.erase(r);
+		}
+		else{
+			++r;
+		}
+	}
+}
+
+DWORD HostEnumScheduler::new_request(unsigned int id, DWORD now)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	/* Nudge the tick forward until it is unique. This throws the round trip time reported
+	 * to the application out by a millisecond or two when lots of enumerations are running,
+	 * which is well within the resolution of GetTickCount() anyway.
+	*/
+	
+	DWORD tick = now;
+	while(requests.find(tick) != requests.end())
+	{
+		++tick;
+	}
+	
+	requests.insert(std::make_pair(tick, id));
+	
+	return tick;
+}
+
+void HostEnumScheduler::forget_request(DWORD tick)
+{
+	std::unique_lock<std::mutex> l(lock);
+	requests.erase(tick);
+}
+
+void HostEnumScheduler::send(const void *data, size_t size, const struct sockaddr_in *dest_addr)
+{
+	sendto(sock, (const char*)(data), size, 0, (struct sockaddr*)(dest_addr), sizeof(*dest_addr));
+}
+
+void HostEnumScheduler::wake()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	wake_pending = true;
+	arm_timer(0);
+}
+
+/* Must be called with lock held. */
+void HostEnumScheduler::arm_timer(DWORD timeout_ms)
+{
+	LARGE_INTEGER due;
+	
+	if(timeout_ms == 0)
+	{
+		due.QuadPart = -1;
+	}
+	else{
+		due.QuadPart = -((LONGLONG)(timeout_ms) * 10000); /* Relative, in 100ns units. */
+	}
+	
+	SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE);
+}
+
+void HostEnumScheduler::handle_sock_event()
+{
+	while(true)
+	{
+		/* recv_lock is only held while reading the packet into recv_buf. handle_packet()
+		 * raises DPN_MSGID_ENUM_HOSTS_RESPONSE, so the responses for other enumerations
+		 * mustn't wait behind it, and the application may start or cancel another
+		 * enumeration from within its message handler.
+		*/
+		
+		std::unique_lock<std::mutex> rl(recv_lock);
+		
+		struct sockaddr_in from_addr;
+		int addrlen = sizeof(from_addr);
+		
+		int r = recvfrom(sock, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &addrlen);
+		if(r <= 0)
+		{
+			break;
+		}
+		
+		std::vector<unsigned char> packet(recv_buf, recv_buf + r);
+		
+		rl.unlock();
+		
+		std::unique_ptr<PacketDeserialiser> pd;
+		DWORD request_tick;
+		
+		try {
+			pd.reset(new PacketDeserialiser(packet.data(), packet.size()));
+			
+			if(pd->packet_type() != DPLITE_MSGID_HOST_ENUM_RESPONSE)
+			{
+				/* Unexpected packet type. */
+				continue;
+			}
+			
+			request_tick = pd->get_dword(8);
+		}
+		catch(const PacketDeserialiser::Error &e)
+		{
+			/* Malformed packet received */
+			continue;
+		}
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		auto ri = requests.find(request_tick);
+		if(ri == requests.end())
+		{
+			/* Response to a request which has been forgotten, or whose enumeration has
+			 * finished.
+			*/
+			continue;
+		}
+		
+		auto ei = enumerators.find(ri->second);
+		if(ei == enumerators.end())
+		{
+			continue;
+		}
+		
+		HostEnumerator *he = ei->second.he;
+		std::shared_ptr<void> ref = ei->second.ref;
+		
+		l.unlock();
+		
+		he->handle_packet(*pd, request_tick, &from_addr);
+	}
+}
+
+void HostEnumScheduler::handle_timer()
+{
+	std::unique_lock<std::mutex> tl(tick_lock);
+	std::unique_lock<std::mutex> l(lock);
+	
+	wake_pending = false;
+	
+	std::vector<unsigned int> ids;
+	ids.reserve(enumerators.size());
+	
+	for(auto e = enumerators.begin(); e != enumerators.end(); ++e)
+	{
+		ids.push_back(e->first);
+	}
+	
+	DWORD timeout = INFINITE;
+	
+	/* Enumerations which have finished, and need their completion raising once we have
+	 * released tick_lock.
+	*/
+	std::vector<unsigned int> finished;
+	
+	for(auto id = ids.begin(); id != ids.end(); ++id)
+	{
+		auto ei = enumerators.find(*id);
+		if(ei == enumerators.end())
+		{
+			/* Removed since we started. */
+			continue;
+		}
+		
+		HostEnumerator *he = ei->second.he;
+		std::shared_ptr<void> ref = ei->second.ref;
+		
+		l.unlock();
+		
+		bool he_finished = false;
+		timeout = std::min(he->poll(&he_finished), timeout);
+		
+		if(he_finished)
+		{
+			finished.push_back(*id);
+		}
+		
+		ref.reset();
+		l.lock();
+	}
+	
+	if(wake_pending)
+	{
+		arm_timer(0);
+	}
+	else if(timeout != INFINITE)
+	{
+		arm_timer(timeout);
+	}
+	
+	/* The application may start or wait for another enumeration from the completion, which
+	 * would need handle_timer() to run again.
+	*/
+	
+	tl.unlock();
+	
+	for(auto id = finished.begin(); id != finished.end(); ++id)
+	{
+		auto ei = enumerators.find(*id);
+		if(ei == enumerators.end())
+		{
+			continue;
+		}
+		
+		HostEnumerator *he = ei->second.he;
+		std::shared_ptr<void> ref = ei->second.ref;
+		
+		l.unlock();
+		
+		he->finish();
+		
+		ref.reset();
+		l.lock();
+	}
+}
@@ -0,0 +1,128 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_HOSTENUMSCHEDULER_HPP
+#define DPLITE_HOSTENUMSCHEDULER_HPP
+
+#include <winsock2.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <windows.h>
+
+#include "HandleHandlingPool.hpp"
+#include "network.hpp"
+
+class HostEnumerator;
+
+/* Drives every HostEnumerator in the process from one UDP socket and one timer.
+ *
+ * Each request sent is tagged with the tick count it was sent at, which the host echoes back
+ * in its response. new_request() makes sure no two outstanding requests share a tick, so
+ * responses can be routed back to the HostEnumerator which sent the request.
+ *
+ * None of the scheduler's locks are held while a HostEnumerator is calling the application,
+ * which may start, cancel or wait for other enumerations from its message handler. The
+ * scheduler lock is never held while calling into a HostEnumerator at all. Instead the caller's
+ * pool_ref is copied and held while it is being called, so the HostEnumerator destructor
+ * can wait for calls to finish the same way it waits for any other callbacks. Only one
+ * enumerator's reference is held at a time, so destroying one enumerator never has to wait
+ * on callbacks belonging to another.
+*/
+
+class HostEnumScheduler
+{
+	private:
+		struct Enumerator
+		{
+			HostEnumerator *he;
+			std::shared_ptr<void> ref;
+		};
+		
+		std::mutex lock;
+		
+		std::map<unsigned int, Enumerator> enumerators;
+		unsigned int next_enumerator_id;
+		
+		/* Request tick count => enumerator ID */
+		std::map<DWORD, unsigned int> requests;
+		
+		/* Set by wake(), tells handle_timer() to go around again straight away rather than
+		 * sleeping until the next deadline it found.
+		*/
+		bool wake_pending;
+		
+		int sock;
+		HANDLE sock_event;
+		HANDLE timer;
+		
+		/* recv_lock protects recv_buf, which handle_sock_event() copies each packet out
+		 * of before dispatching it. tick_lock serialises polling the enumerators in
+		 * handle_timer().
+		*/
+		std::mutex recv_lock;
+		unsigned char recv_buf[MAX_PACKET_SIZE];
+		
+		std::mutex tick_lock;
+		
+		HandleHandlingPool *pool;
+		std::shared_ptr<void> pool_ref;
+		HANDLE pool_idle;
+		
+		static std::mutex shared_lock;
+		static HostEnumScheduler *shared_scheduler;
+		static unsigned int shared_refcount;
+		
+		HostEnumScheduler();
+		~HostEnumScheduler();
+		
+		/* No copy c'tor. */
+		HostEnumScheduler(const HostEnumScheduler&) = delete;
+		
+		void arm_timer(DWORD timeout_ms);
+		void handle_sock_event();
+		void handle_timer();
+		
+	public:
+		static HostEnumScheduler *acquire_shared();
+		static void release_shared();
+		
+		/* Registers a HostEnumerator, which will be polled straight away and then whenever
+		 * it next asks to be. ref is held while calling into it.
+		*/
+		unsigned int add(HostEnumerator *he, const std::shared_ptr<void> &ref);
+		
+		/* Unregisters a HostEnumerator and forgets any requests it has outstanding. Calls
+		 * into it which are already in progress may still be running when this returns.
+		*/
+		void remove(unsigned int id);
+		
+		/* Returns the tick count to put in a new request from the given enumerator, which
+		 * will be now unless another request is already using it.
+		*/
+		DWORD new_request(unsigned int id, DWORD now);
+		void forget_request(DWORD tick);
+		
+		void send(const void *data, size_t size, const struct sockaddr_in *dest_addr);
+		
+		/* Polls every HostEnumerator as soon as possible. */
+		void wake();
+};
+
+#endif /* !DPLITE_HOSTENUMSCHEDULER_HPP */
@@ -53,7 +53,12 @@ HostEnumerator::HostEnumerator(
 	complete_cb(complete_cb),
 	user_context(pvUserContext),
 	next_tx_at(0),
-	req_cancel(false)
+	stop_at(0),
+	req_cancel(false),
+	completing(false),
+	result(S_OK),
+	dispatching(0),
+	completed(false)
 {
 	if(pdpaddrDeviceInfo == NULL)
 	{
@@ -157,59 +162,71 @@ HostEnumerator::HostEnumerator(
 	tx_interval = (dwRetryInterval == 0) ? DEFAULT_ENUM_INTERVAL : dwRetryInterval;
 	rx_timeout  = (dwTimeOut       == 0) ? DEFAULT_ENUM_TIMEOUT  : dwTimeOut;
 	
-	/* TODO: Bind to interface in pdpaddrDeviceInfo, if provided. */
-	
-	sock = create_udp_socket(0, 0);
-	if(sock == -1)
+	pool_idle = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(pool_idle == NULL)
 	{
-		throw std::runtime_error("Cannot create UDP socket");
+		throw std::runtime_error("Cannot create pool_idle object");
 	}
 	
-	wake_thread = CreateEvent(NULL, FALSE, FALSE, NULL);
-	if(wake_thread == NULL)
-	{
-		closesocket(sock);
-		throw std::runtime_error("Cannot create wake_thread object");
+	try {
+		scheduler = HostEnumScheduler::acquire_shared();
 	}
-	
-	if(WSAEventSelect(sock, wake_thread, FD_READ))
+	catch(...)
 	{
-		CloseHandle(wake_thread);
-		closesocket(sock);
-		throw std::runtime_error("Cannot WSAEventSelect");
+		CloseHandle(pool_idle);
+		throw;
 	}
 	
-	thread = new std::thread(&HostEnumerator::main, this);
+	pool_ref = std::shared_ptr<void>(nullptr, [this](void*) { SetEvent(pool_idle); });
+	
+	/* Kicks off the first request. */
+	scheduler_id = scheduler->add(this, pool_ref);
 }
 
 HostEnumerator::~HostEnumerator()
 {
 	cancel();
+	wait();
 	
-	if(thread->joinable())
-	{
-		if(thread->get_id() == std::this_thread::get_id())
-		{
-			thread->detach();
-		}
-		else{
-			thread->join();
-		}
-	}
+	/* Once removed, the scheduler won't start calling us again, wait for any calls which
+	 * were already in flight to return.
+	*/
+	scheduler->remove(scheduler_id);
+	
+	pool_ref.reset();
+	WaitForSingleObject(pool_idle, INFINITE);
 	
-	delete thread;
+	HostEnumScheduler::release_shared();
 	
-	CloseHandle(wake_thread);
+	CloseHandle(pool_idle);
 }
 
-void HostEnumerator::main()
+DWORD HostEnumerator::poll(bool *finished)
 {
-	while(!req_cancel)
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(completing)
+	{
+		return INFINITE;
+	}
+	
+	DWORD now = GetTickCount();
+	
+	if(!req_cancel)
 	{
-		DWORD now = GetTickCount();
-		
 		if(tx_remain > 0 && now >= next_tx_at)
 		{
+			Request request;
+			request.tick = scheduler->new_request(scheduler_id, now);
+			
+			requests.push_back(request);
+			
+			if(requests.size() > MAX_TRACKED_ENUM_REQUESTS)
+			{
+				scheduler->forget_request(requests.front().tick);
+				requests.pop_front();
+			}
+			
 			PacketSerialiser ps(DPLITE_MSGID_HOST_ENUM_REQUEST);
 			
 			if(application_guid != GUID_NULL)
@@ -228,12 +245,10 @@ void HostEnumerator::main()
 				ps.append_null();
 			}
 			
-			ps.append_dword(now);
+			ps.append_dword(request.tick);
 			
 			std::pair<const void*, size_t> raw = ps.raw_packet();
-			
-			sendto(sock, (const char*)(raw.first), raw.second, 0,
-				(struct sockaddr*)(&send_addr), sizeof(send_addr));
+			scheduler->send(raw.first, raw.second, &send_addr);
 			
 			next_tx_at = now + tx_interval;
 			--tx_remain;
@@ -244,55 +259,67 @@ void HostEnumerator::main()
 			}
 		}
 		
-		struct sockaddr_in from_addr;
-		int addrlen = sizeof(from_addr);
-		
-		int r = recvfrom(sock, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &addrlen);
-		if(r > 0)
+		if(tx_remain > 0 || stop_at == 0 || now < stop_at)
 		{
-			handle_packet(recv_buf, r, &from_addr);
-		}
-		
-		if(tx_remain == 0 && stop_at > 0 && now >= stop_at)
-		{
-			/* No more requests to transmit and the wait for replies from the last one
-			 * has timed out.
+			/* Still waiting to transmit more requests or for replies to the last one,
+			 * ask to be polled again for whichever comes first.
 			*/
-			break;
+			
+			DWORD timeout = INFINITE;
+			if(tx_remain > 0) { timeout = std::min((next_tx_at - now), timeout); }
+			if(stop_at   > 0) { timeout = std::min((stop_at - now),    timeout); }
+			
+			return timeout;
 		}
 		
-		DWORD timeout = INFINITE;
-		if(tx_remain > 0) { timeout = std::min((next_tx_at - now), timeout); }
-		if(stop_at   > 0) { timeout = std::min((stop_at - now),    timeout); }
-		
-		WaitForSingleObject(wake_thread, timeout);
+		/* No more requests to transmit and the wait for replies from the last one has
+		 * timed out.
+		*/
 	}
 	
-	if(req_cancel)
-	{
-		complete_cb(DPNERR_USERCANCEL);
-	}
-	else{
-		complete_cb(S_OK);
-	}
+	completing = true;
+	result     = req_cancel ? DPNERR_USERCANCEL : S_OK;
+	
+	*finished = true;
+	
+	return INFINITE;
 }
 
-void HostEnumerator::handle_packet(const void *data, size_t size, struct sockaddr_in *from_addr)
+/* Raises the completion once poll() has decided the enumeration is over. Called by the
+ * scheduler without any of its locks held, since complete_cb calls the application.
+*/
+void HostEnumerator::finish()
 {
-	std::unique_ptr<PacketDeserialiser> pd;
+	std::unique_lock<std::mutex> l(lock);
 	
-	try {
-		pd.reset(new PacketDeserialiser(data, size));
-	}
-	catch(const PacketDeserialiser::Error &e)
+	/* Responses which were already being raised go out before the completion. */
+	dispatch_cv.wait(l, [this]() { return dispatching == 0; });
+	
+	l.unlock();
+	
+	complete_cb(result);
+	
+	l.lock();
+	
+	completed = true;
+	completed_cv.notify_all();
+}
+
+void HostEnumerator::handle_packet(const PacketDeserialiser &pd, DWORD request_tick, struct sockaddr_in *from_addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(completing || req_cancel)
 	{
-		/* Malformed packet received */
 		return;
 	}
 	
-	if(pd->packet_type() != DPLITE_MSGID_HOST_ENUM_RESPONSE)
+	auto request = std::find_if(requests.begin(), requests.end(),
+		[request_tick](const Request &r) { return r.tick == request_tick; });
+	
+	if(request == requests.end())
 	{
-		/* Unexpected packet type. */
+		/* Not one of ours (any more). */
 		return;
 	}
 	
@@ -303,35 +330,31 @@ void HostEnumerator::handle_packet(const void *data, size_t size, struct sockadd
 	const void *response_data = NULL;
 	size_t response_data_size = 0;
 	
-	DWORD request_tick_count;
-	
 	try {
 		app_desc.dwSize = sizeof(app_desc);
 		
-		app_desc.dwFlags          = pd->get_dword(0);
-		app_desc.guidInstance     = pd->get_guid(1);
-		app_desc.guidApplication  = pd->get_guid(2);
-		app_desc.dwMaxPlayers     = pd->get_dword(3);
-		app_desc.dwCurrentPlayers = pd->get_dword(4);
+		app_desc.dwFlags          = pd.get_dword(0);
+		app_desc.guidInstance     = pd.get_guid(1);
+		app_desc.guidApplication  = pd.get_guid(2);
+		app_desc.dwMaxPlayers     = pd.get_dword(3);
+		app_desc.dwCurrentPlayers = pd.get_dword(4);
 		
-		app_desc_pwszSessionName = pd->get_wstring(5);
+		app_desc_pwszSessionName = pd.get_wstring(5);
 		app_desc.pwszSessionName = (wchar_t*)(app_desc_pwszSessionName.c_str());
 		
-		if(!pd->is_null(6))
+		if(!pd.is_null(6))
 		{
-			std::pair<const void*, size_t> app_data = pd->get_data(6);
+			std::pair<const void*, size_t> app_data = pd.get_data(6);
 			app_desc.pvApplicationReservedData     = (void*)(app_data.first);
 			app_desc.dwApplicationReservedDataSize = app_data.second;
 		}
 		
-		if(!pd->is_null(7))
+		if(!pd.is_null(7))
 		{
-			std::pair<const void*, size_t> r_data = pd->get_data(7);
+			std::pair<const void*, size_t> r_data = pd.get_data(7);
 			response_data      = r_data.first;
 			response_data_size = r_data.second;
 		}
-		
-		request_tick_count = pd->get_dword(8);
 	}
 	catch(const PacketDeserialiser::Error &e)
 	{
@@ -339,6 +362,19 @@ void HostEnumerator::handle_packet(const void *data, size_t size, struct sockadd
 		return;
 	}
 	
+	if(std::find(request->responded.begin(), request->responded.end(), app_desc.guidInstance) != request->responded.end())
+	{
+		/* Already heard from this session in response to this request. */
+		return;
+	}
+	
+	request->responded.push_back(app_desc.guidInstance);
+	
+	++dispatching;
+	l.unlock();
+	
+	std::unique_lock<std::mutex> dl(dispatch_lock);
+	
 	/* Build a DirectPlay8Address with the host/port where the response came from - thats the main
 	 * port for the host.
 	*/
@@ -363,24 +399,36 @@ void HostEnumerator::handle_packet(const void *data, size_t size, struct sockadd
 	message.pvResponseData          = (void*)(response_data);
 	message.dwResponseDataSize      = response_data_size;
 	message.pvUserContext           = user_context;
-	message.dwRoundTripLatencyMS    = GetTickCount() - request_tick_count;
+	message.dwRoundTripLatencyMS    = GetTickCount() - request_tick;
+	
+	if((LONG)(message.dwRoundTripLatencyMS) < 0)
+	{
+		/* request_tick was nudged ahead of the real send time by the scheduler. */
+		message.dwRoundTripLatencyMS = 0;
+	}
 	
 	message_handler(message_handler_ctx, DPN_MSGID_ENUM_HOSTS_RESPONSE, &message);
 	
 	device_address->Release();
 	sender_address->Release();
+	
+	dl.unlock();
+	l.lock();
+	
+	if(--dispatching == 0)
+	{
+		dispatch_cv.notify_all();
+	}
 }
 
 void HostEnumerator::cancel()
 {
 	req_cancel = true;
-	SetEvent(wake_thread);
+	scheduler->wake();
 }
 
 void HostEnumerator::wait()
 {
-	if(thread->joinable())
-	{
-		thread->join();
-	}
+	std::unique_lock<std::mutex> l(lock);
+	completed_cv.wait(l, [this]() { return completed; });
 }
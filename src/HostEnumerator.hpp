@@ -20,18 +20,29 @@
 #define DPLITE_HOSTENUMERATOR_HPP
 
 #include <winsock2.h>
+#include <atomic>
+#include <condition_variable>
 #include <dplay8.h>
 #include <functional>
-#include <thread>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <windows.h>
 
+#include "HostEnumScheduler.hpp"
 #include "network.hpp"
+#include "packet.hpp"
 
 #define DEFAULT_ENUM_COUNT    5
 #define DEFAULT_ENUM_INTERVAL 1500
 #define DEFAULT_ENUM_TIMEOUT  1500
 
+/* Responses are only accepted for this many of the most recent requests sent by each
+ * HostEnumerator.
+*/
+#define MAX_TRACKED_ENUM_REQUESTS 16
+
 class HostEnumerator
 {
 	private:
@@ -62,17 +73,67 @@ class HostEnumerator
 		DWORD next_tx_at;
 		DWORD stop_at;
 		
-		int sock;
-		HANDLE wake_thread;
-		std::thread *thread;
-		bool req_cancel;
+		std::atomic<bool> req_cancel;
+		
+		/* Rather than each instance having its own socket and timer, all enumerations
+		 * in the process share the ones belonging to the HostEnumScheduler, which calls
+		 * poll() when we are due to send a request or time out and handle_packet() when
+		 * a response to one of our requests arrives.
+		 *
+		 * The scheduler holds a copy of pool_ref while calling us, the destructor drops
+		 * its own copy and waits for pool_idle to be signalled by the deleter before
+		 * tearing anything down.
+		*/
+		HostEnumScheduler *scheduler;
+		unsigned int scheduler_id;
+		std::shared_ptr<void> pool_ref;
+		HANDLE pool_idle;
+		
+		/* Requests we are accepting responses to, oldest first, and the instance GUIDs
+		 * which have already responded to each so duplicates (e.g. a broadcast which
+		 * reached the host on more than one interface) are only reported once.
+		*/
+		struct Request
+		{
+			DWORD tick;
+			std::vector<GUID> responded;
+		};
+		
+		std::list<Request> requests;
+		
+		/* lock protects everything above which changes after construction, and is never
+		 * held while calling the application. dispatch_lock is held while raising each
+		 * DPN_MSGID_ENUM_HOSTS_RESPONSE instead, so responses to one enumeration are
+		 * still raised one at a time without holding up any others.
+		 *
+		 * poll() sets completing once the enumeration is over, after which no more
+		 * responses are raised. finish() then waits for dispatching (the number of
+		 * responses being raised) to drop to zero before calling complete_cb, and sets
+		 * completed once it has returned.
+		*/
+		std::mutex lock;
+		bool completing;
+		HRESULT result;
+		unsigned int dispatching;
+		std::condition_variable dispatch_cv;
+		bool completed;
+		std::condition_variable completed_cv;
+		
+		std::mutex dispatch_lock;
 		
-		unsigned char recv_buf[MAX_PACKET_SIZE];
+		/* Returns the number of milliseconds until we next need polling, or INFINITE. Sets
+		 * *finished if the enumeration is over and finish() needs calling.
+		*/
+		DWORD poll(bool *finished);
+		void finish();
+		void handle_packet(const PacketDeserialiser &pd, DWORD request_tick, struct sockaddr_in *from_addr);
 		
-		void main();
-		void handle_packet(const void *data, size_t size, struct sockaddr_in *from_addr);
+		friend class HostEnumScheduler;
 		
 	public:
+		/* complete_cb is invoked from a worker thread in the shared pool and must NOT
+		 * destroy the HostEnumerator before it returns.
+		*/
 		HostEnumerator(
 			std::atomic<unsigned int> * const global_refcount,
 			
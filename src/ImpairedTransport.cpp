@@ -0,0 +1,578 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <windows.h>
+
+#include "ImpairedTransport.hpp"
+#include "Log.hpp"
+
+ImpairedTransport::Impairment::Impairment():
+	delay_us(0),
+	jitter_us(0),
+	loss(0.0),
+	reorder(0.0),
+	reorder_us(0),
+	retransmit_us(300000),
+	rate(0),
+	queue_limit(64 * 1024) {}
+
+ImpairedTransport::Stats::Stats():
+	datagrams_sent(0),
+	datagrams_lost(0),
+	datagrams_dropped(0),
+	datagrams_reordered(0),
+	stream_bytes_sent(0),
+	stream_retransmits(0) {}
+
+ImpairedTransport::Link::Link():
+	event(NULL),
+	events(0),
+	last_due(0),
+	stream_queued(0),
+	send_blocked(false),
+	send_shut(false) {}
+
+ImpairedTransport::ImpairedTransport(Transport *inner, uint32_t seed, Clock *clock):
+	inner(inner),
+	clock(clock),
+	rng(seed),
+	link_free_at(0),
+	timer_due(0)
+{
+	timer = clock->create_timer();
+	if(timer == NULL)
+	{
+		throw std::runtime_error("Unable to create timer");
+	}
+	
+	delivery_thread = std::thread(&ImpairedTransport::delivery_main, this);
+}
+
+ImpairedTransport::~ImpairedTransport()
+{
+	SetEvent(stop_event);
+	delivery_thread.join();
+	
+	clock->cancel_timer(timer);
+	CloseHandle(timer);
+	
+	/* Anything still held back is lost, but sockets the owner has closed must still be
+	 * closed underneath.
+	*/
+	for(auto li = links.begin(); li != links.end(); ++li)
+	{
+		if(!li->second.stream_queue.empty() && li->second.stream_queue.back().type == StreamChunk::SC_CLOSE)
+		{
+			inner->close(li->first);
+		}
+	}
+}
+
+void ImpairedTransport::set_impairment(const Impairment &impairment)
+{
+	std::unique_lock<std::mutex> l(lock);
+	this->impairment = impairment;
+}
+
+ImpairedTransport::Impairment ImpairedTransport::get_impairment()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return impairment;
+}
+
+ImpairedTransport::Stats ImpairedTransport::get_stats()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return stats;
+}
+
+size_t ImpairedTransport::pending()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	size_t n = datagrams.size();
+	
+	for(auto li = links.begin(); li != links.end(); ++li)
+	{
+		n += li->second.stream_queue.size();
+	}
+	
+	return n;
+}
+
+double ImpairedTransport::random_chance()
+{
+	return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+}
+
+/* Puts bytes onto the rate limited link and returns the time they finish going out. */
+unsigned long long ImpairedTransport::link_departure(size_t bytes, unsigned long long now)
+{
+	if(impairment.rate == 0)
+	{
+		return now;
+	}
+	
+	unsigned long long start = std::max(now, link_free_at);
+	link_free_at = start + ((unsigned long long)(bytes) * 1000000) / impairment.rate;
+	
+	return link_free_at;
+}
+
+/* Returns how long anything put onto the rate limited link now would wait to start going out. */
+unsigned long long ImpairedTransport::queue_delay(unsigned long long now)
+{
+	return link_free_at > now ? link_free_at - now : 0;
+}
+
+void ImpairedTransport::schedule(unsigned long long due)
+{
+	if(timer_due == 0 || due < timer_due)
+	{
+		timer_due = due;
+		clock->set_timer(timer, due);
+	}
+}
+
+void ImpairedTransport::delivery_main()
+{
+	HANDLE handles[] = { stop_event, timer };
+	
+	while(WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		timer_due = 0;
+		deliver(clock->now());
+	}
+}
+
+/* Passes on everything which has come due and re-arms the timer for whatever is next. */
+void ImpairedTransport::deliver(unsigned long long now)
+{
+	while(!datagrams.empty() && datagrams.begin()->first <= now)
+	{
+		Datagram &d = datagrams.begin()->second;
+		
+		if(inner->sendto(d.sock, d.data.data(), d.data.size(), (struct sockaddr*)(&(d.addr)), d.addrlen) < 0)
+		{
+			log_printf("Delayed sendto() failed: %s", win_strerror(WSAGetLastError()).c_str());
+		}
+		
+		datagrams.erase(datagrams.begin());
+	}
+	
+	unsigned long long next_due = datagrams.empty() ? 0 : datagrams.begin()->first;
+	
+	for(auto li = links.begin(); li != links.end();)
+	{
+		Link &link = li->second;
+		
+		if(!link.stream_queue.empty() && link.stream_queue.front().due <= now)
+		{
+			flush_stream(li->first, link, now);
+		}
+		
+		if(!link.stream_queue.empty() && link.stream_queue.front().type == StreamChunk::SC_CLOSE && link.stream_queue.front().due <= now)
+		{
+			inner->close(li->first);
+			li = links.erase(li);
+			
+			continue;
+		}
+		
+		if(!link.stream_queue.empty() && (next_due == 0 || link.stream_queue.front().due < next_due))
+		{
+			next_due = link.stream_queue.front().due;
+		}
+		
+		++li;
+	}
+	
+	if(next_due != 0)
+	{
+		schedule(next_due);
+	}
+}
+
+/* Writes as much due stream data to the wrapped transport as it will take, stopping at a
+ * close so the caller can get rid of the link.
+*/
+void ImpairedTransport::flush_stream(int sock, Link &link, unsigned long long now)
+{
+	while(!link.stream_queue.empty() && link.stream_queue.front().due <= now)
+	{
+		StreamChunk &chunk = link.stream_queue.front();
+		
+		if(chunk.type == StreamChunk::SC_DATA)
+		{
+			int s = inner->send(sock, chunk.data.data() + chunk.off, chunk.data.size() - chunk.off);
+			if(s < 0)
+			{
+				DWORD err = WSAGetLastError();
+				
+				if(err == WSAEWOULDBLOCK)
+				{
+					chunk.due = now + STREAM_RETRY_US;
+					break;
+				}
+				
+				/* The connection is broken, the owner will find out when it next reads from
+				 * it. Nothing else we are holding back can be delivered.
+				*/
+				
+				for(auto ci = link.stream_queue.begin(); ci != link.stream_queue.end();)
+				{
+					if(ci->type == StreamChunk::SC_DATA)
+					{
+						link.stream_queued -= ci->data.size() - ci->off;
+						ci = link.stream_queue.erase(ci);
+					}
+					else{
+						++ci;
+					}
+				}
+				
+				continue;
+			}
+			
+			chunk.off          += s;
+			link.stream_queued -= s;
+			
+			if(chunk.off < chunk.data.size())
+			{
+				chunk.due = now + STREAM_RETRY_US;
+				break;
+			}
+		}
+		else if(chunk.type == StreamChunk::SC_SHUTDOWN)
+		{
+			inner->shutdown_send(sock);
+		}
+		else if(chunk.type == StreamChunk::SC_CLOSE)
+		{
+			break;
+		}
+		
+		link.stream_queue.pop_front();
+	}
+	
+	if(link.send_blocked && (impairment.queue_limit == 0 || link.stream_queued < impairment.queue_limit))
+	{
+		link.send_blocked = false;
+		
+		if(link.event != NULL && (link.events & FD_WRITE))
+		{
+			SetEvent(link.event);
+		}
+	}
+}
+
+int ImpairedTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	return inner->create_udp_socket(ipaddr, port, options);
+}
+
+int ImpairedTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	return inner->create_listener_socket(ipaddr, port, options);
+}
+
+bool ImpairedTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	return inner->create_auto_port_sockets(ipaddr, udp_sock, listener_sock, port, options);
+}
+
+int ImpairedTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	return inner->create_client_socket(local_ipaddr, local_port, options);
+}
+
+int ImpairedTransport::create_discovery_socket()
+{
+	return inner->create_discovery_socket();
+}
+
+void ImpairedTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	inner->apply_socket_options(sock, stream, options);
+}
+
+bool ImpairedTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	return inner->setup_accepted_socket(sock, options);
+}
+
+int ImpairedTransport::event_select(int sock, HANDLE event, long events)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Link &link = links[sock];
+	link.event  = event;
+	link.events = events;
+	
+	return inner->event_select(sock, event, events);
+}
+
+int ImpairedTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	return inner->accept(sock, addr);
+}
+
+int ImpairedTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	return inner->connect(sock, addr);
+}
+
+int ImpairedTransport::get_socket_error(int sock, int *error)
+{
+	return inner->get_socket_error(sock, error);
+}
+
+int ImpairedTransport::send(int sock, const void *data, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Link &link = links[sock];
+	
+	if(link.send_shut)
+	{
+		WSASetLastError(WSAESHUTDOWN);
+		return -1;
+	}
+	
+	if(impairment.queue_limit != 0 && link.stream_queued >= impairment.queue_limit)
+	{
+		link.send_blocked = true;
+		
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	if(impairment.queue_limit != 0 && size > (impairment.queue_limit - link.stream_queued))
+	{
+		size = impairment.queue_limit - link.stream_queued;
+	}
+	
+	unsigned long long now = clock->now();
+	unsigned long long due = link_departure(size, now) + impairment.delay_us;
+	
+	if(impairment.jitter_us != 0)
+	{
+		due += std::uniform_int_distribution<unsigned long long>(0, impairment.jitter_us)(rng);
+	}
+	
+	if(impairment.loss > 0.0 && random_chance() < impairment.loss)
+	{
+		due += impairment.retransmit_us;
+		++(stats.stream_retransmits);
+	}
+	
+	/* Stream data can't overtake what was sent before it. */
+	due = std::max(due, link.last_due);
+	link.last_due = due;
+	
+	if(link.stream_queue.empty() && due <= now)
+	{
+		int s = inner->send(sock, data, size);
+		if(s > 0)
+		{
+			stats.stream_bytes_sent += s;
+		}
+		
+		return s;
+	}
+	
+	StreamChunk chunk;
+	chunk.type = StreamChunk::SC_DATA;
+	chunk.due  = due;
+	chunk.data.assign((const unsigned char*)(data), (const unsigned char*)(data) + size);
+	chunk.off  = 0;
+	
+	link.stream_queue.push_back(chunk);
+	link.stream_queued += size;
+	
+	stats.stream_bytes_sent += size;
+	
+	schedule(due);
+	
+	return size;
+}
+
+int ImpairedTransport::recv(int sock, void *buf, size_t size)
+{
+	return inner->recv(sock, buf, size);
+}
+
+int ImpairedTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	++(stats.datagrams_sent);
+	
+	if(impairment.loss > 0.0 && random_chance() < impairment.loss)
+	{
+		++(stats.datagrams_lost);
+		return size;
+	}
+	
+	unsigned long long now = clock->now();
+	
+	if(impairment.rate != 0 && impairment.queue_limit != 0
+		&& ((queue_delay(now) * impairment.rate) / 1000000) + size > impairment.queue_limit)
+	{
+		++(stats.datagrams_dropped);
+		return size;
+	}
+	
+	unsigned long long due = link_departure(size, now) + impairment.delay_us;
+	
+	if(impairment.jitter_us != 0)
+	{
+		due += std::uniform_int_distribution<unsigned long long>(0, impairment.jitter_us)(rng);
+	}
+	
+	if(impairment.reorder > 0.0 && random_chance() < impairment.reorder)
+	{
+		due += impairment.reorder_us;
+		++(stats.datagrams_reordered);
+	}
+	
+	if(due <= now)
+	{
+		return inner->sendto(sock, data, size, addr, addrlen);
+	}
+	
+	Datagram d;
+	d.sock = sock;
+	d.data.assign((const unsigned char*)(data), (const unsigned char*)(data) + size);
+	
+	memset(&(d.addr), 0, sizeof(d.addr));
+	memcpy(&(d.addr), addr, std::min<size_t>(addrlen, sizeof(d.addr)));
+	d.addrlen = addrlen;
+	
+	datagrams.insert(std::make_pair(due, d));
+	schedule(due);
+	
+	return size;
+}
+
+int ImpairedTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	return inner->recvfrom(sock, buf, size, from_addr);
+}
+
+int ImpairedTransport::shutdown_send(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Link &link = links[sock];
+	
+	if(link.stream_queue.empty())
+	{
+		link.send_shut = true;
+		return inner->shutdown_send(sock);
+	}
+	
+	StreamChunk chunk;
+	chunk.type = StreamChunk::SC_SHUTDOWN;
+	chunk.due  = link.last_due;
+	chunk.off  = 0;
+	
+	link.stream_queue.push_back(chunk);
+	link.send_shut = true;
+	
+	return 0;
+}
+
+void ImpairedTransport::close(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	for(auto di = datagrams.begin(); di != datagrams.end();)
+	{
+		if(di->second.sock == sock)
+		{
+			di = datagrams.erase(di);
+		}
+		else{
+			++di;
+		}
+	}
+	
+	auto li = links.find(sock);
+	
+	if(li != links.end() && !li->second.stream_queue.empty())
+	{
+		/* Let whatever we are holding back drain before closing the underlying socket,
+		 * but stop signalling the owner's event, which may be gone by then.
+		*/
+		
+		Link &link = li->second;
+		
+		inner->event_select(sock, NULL, 0);
+		link.event  = NULL;
+		link.events = 0;
+		
+		StreamChunk chunk;
+		chunk.type = StreamChunk::SC_CLOSE;
+		chunk.due  = link.last_due;
+		chunk.off  = 0;
+		
+		link.stream_queue.push_back(chunk);
+		link.send_shut = true;
+		
+		return;
+	}
+	
+	if(li != links.end())
+	{
+		links.erase(li);
+	}
+	
+	inner->close(sock);
+}
+
+bool ImpairedTransport::get_host_instance(GUID *instance)
+{
+	return inner->get_host_instance(instance);
+}
+
+void ImpairedTransport::session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token)
+{
+	inner->session_joined(instance, player_id, relay_token);
+}
+
+void ImpairedTransport::admit_player(DWORD player_id, GUID *relay_token)
+{
+	inner->admit_player(player_id, relay_token);
+}
+
+void ImpairedTransport::session_left()
+{
+	inner->session_left();
+}
+
+int ImpairedTransport::connect_player(DWORD player_id, const SocketOptions &options)
+{
+	return inner->connect_player(player_id, options);
+}
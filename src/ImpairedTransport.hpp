@@ -0,0 +1,226 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_IMPAIREDTRANSPORT_HPP
+#define DPLITE_IMPAIREDTRANSPORT_HPP
+
+#include <winsock2.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "Clock.hpp"
+#include "EventObject.hpp"
+#include "Transport.hpp"
+
+/* A Transport which passes everything through to another one, but holds back, drops and
+ * reorders what is sent through it to simulate a poor network link.
+ *
+ * Each DirectPlay8Peer is given its own ImpairedTransport wrapping a shared one (usually a
+ * LoopbackTransport), so the impairment applies to everything that peer sends and
+ * different peers can be given different conditions. For a symmetric link, give both ends
+ * the same settings with half the round trip time as the delay.
+ *
+ * Datagrams are delayed, lost and reordered independently. Stream data is never lost or
+ * reordered; a "lost" stream write is instead held back by the retransmission timeout as
+ * TCP would. Both share a rate limited link: data is serialised onto it at the configured
+ * rate and datagrams which would have to queue for more than queue_limit bytes are
+ * dropped, while send() on a stream fails with WSAEWOULDBLOCK once queue_limit bytes are
+ * waiting and signals FD_WRITE when there is room again.
+ *
+ * Random decisions come from a generator seeded at construction, so a single-threaded
+ * sequence of sends is impaired the same way every run.
+ *
+ * Held back data is sent on by a thread which waits on a timer from the given Clock, so a
+ * VirtualClock can be used to release it. With no impairment configured, everything goes
+ * straight through.
+ *
+ * Thread safe.
+*/
+
+class ImpairedTransport: public Transport
+{
+	public:
+		struct Impairment
+		{
+			/* One-way delay added to everything, in microseconds. */
+			unsigned long long delay_us;
+			
+			/* Maximum extra random delay, in microseconds. */
+			unsigned long long jitter_us;
+			
+			/* Probability of a datagram being lost, or of a stream write needing to be
+			 * retransmitted, from 0.0 to 1.0.
+			*/
+			double loss;
+			
+			/* Probability of a datagram being held back by reorder_us, so that ones sent
+			 * after it arrive first.
+			*/
+			double reorder;
+			unsigned long long reorder_us;
+			
+			/* Delay added to a stream write which is "lost", in microseconds. */
+			unsigned long long retransmit_us;
+			
+			/* Link rate in bytes per second, zero for unlimited. */
+			DWORD rate;
+			
+			/* Bytes which may be waiting for the rate limited link, see above. */
+			DWORD queue_limit;
+			
+			Impairment();
+		};
+		
+		struct Stats
+		{
+			unsigned long long datagrams_sent;
+			unsigned long long datagrams_lost;       /* Randomly, see Impairment::loss */
+			unsigned long long datagrams_dropped;    /* Rate limited link was full. */
+			unsigned long long datagrams_reordered;
+			
+			unsigned long long stream_bytes_sent;
+			unsigned long long stream_retransmits;
+			
+			Stats();
+		};
+		
+	private:
+		/* Waiting time before retrying a stream write the wrapped transport didn't take. */
+		static const unsigned long long STREAM_RETRY_US = 1000;
+		
+		struct Datagram
+		{
+			int sock;
+			std::vector<unsigned char> data;
+			struct sockaddr_in addr;
+			int addrlen;
+		};
+		
+		struct StreamChunk
+		{
+			enum Type {
+				SC_DATA,
+				SC_SHUTDOWN,  /* shutdown_send() once everything before it has gone. */
+				SC_CLOSE,     /* close() once everything before it has gone. */
+			};
+			
+			Type type;
+			unsigned long long due;
+			
+			std::vector<unsigned char> data;
+			size_t off;  /* Start of data not yet taken by the wrapped transport. */
+		};
+		
+		struct Link
+		{
+			HANDLE event;
+			long events;
+			
+			unsigned long long last_due;  /* Keeps stream data in order despite jitter. */
+			
+			std::list<StreamChunk> stream_queue;
+			size_t stream_queued;         /* Bytes of data in stream_queue. */
+			
+			bool send_blocked;            /* send() has failed with WSAEWOULDBLOCK. */
+			bool send_shut;               /* shutdown_send() or close() has been called. */
+			
+			Link();
+		};
+		
+		Transport * const inner;
+		Clock * const clock;
+		
+		std::mutex lock;
+		
+		Impairment impairment;
+		Stats stats;
+		
+		std::mt19937 rng;
+		
+		/* Time at which the rate limited link will be idle. */
+		unsigned long long link_free_at;
+		
+		std::map<int, Link> links;
+		std::multimap<unsigned long long, Datagram> datagrams;
+		
+		HANDLE timer;
+		unsigned long long timer_due;  /* Zero when the timer isn't armed. */
+		
+		EventObject stop_event;
+		std::thread delivery_thread;
+		
+		double random_chance();
+		unsigned long long link_departure(size_t bytes, unsigned long long now);
+		unsigned long long queue_delay(unsigned long long now);
+		void schedule(unsigned long long due);
+		
+		void delivery_main();
+		void deliver(unsigned long long now);
+		void flush_stream(int sock, Link &link, unsigned long long now);
+		
+	public:
+		ImpairedTransport(Transport *inner, uint32_t seed = 0, Clock *clock = SystemClock::get());
+		virtual ~ImpairedTransport();
+		
+		/* No copy c'tor. */
+		ImpairedTransport(const ImpairedTransport &src) = delete;
+		
+		/* Applies to anything sent from now on, data which is already held back keeps the
+		 * schedule it was given.
+		*/
+		void set_impairment(const Impairment &impairment);
+		Impairment get_impairment();
+		
+		Stats get_stats();
+		
+		/* Datagrams and stream writes currently being held back. */
+		size_t pending();
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+		virtual bool get_host_instance(GUID *instance) override;
+		virtual void session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token) override;
+		virtual void admit_player(DWORD player_id, GUID *relay_token) override;
+		virtual void session_left() override;
+		virtual int connect_player(DWORD player_id, const SocketOptions &options) override;
+};
+
+#endif /* !DPLITE_IMPAIREDTRANSPORT_HPP */
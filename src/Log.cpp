@@ -17,53 +17,487 @@
 */
 
 #include <winsock2.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
 #include <mutex>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <tuple>
+#include <vector>
 #include <windows.h>
 
 #include "Log.hpp"
+#include "LogFormat.hpp"
+#include "ProfiledMutex.hpp"
 
+/* Messages are copied into a lock-free buffer belonging to the logging thread and written
+ * out to the log file by a background thread, so logging never waits for the disk or for
+ * other threads.
+ *
+ * The log is written in the binary format described in LogFormat.hpp, or as text if
+ * DPLITE_LOG_TEXT is also set. Text is still formatted by the background thread.
+*/
+
+/* Size of each thread's buffer, must be a power of two. Messages are dropped (and counted)
+ * when the buffer is full.
+*/
+#define RING_SIZE (64 * 1024)
+
+/* Largest encoded message, bigger ones are formatted as (truncated) text instead. */
+#define MAX_RECORD_DATA 2048
+
+/* Buffered messages are written out at least this often. */
+#define FLUSH_INTERVAL_MS 100
+
+enum LogState
+{
+	LOG_UNINITIALISED,
+	LOG_DISABLED,
+	LOG_ENABLED,
+};
+
+/* A message in a thread's buffer, followed by length bytes of data. */
+struct PendingRecord
+{
+	uint64_t time;
+	const char *format;  /* LR_MESSAGE only, format strings must outlive the logger. */
+	uint32_t length;
+	uint8_t type;
+};
+
+/* Single producer, single consumer ring buffer. The head and tail only ever increase and
+ * are masked down to an offset when accessing the buffer.
+*/
+struct LogRing
+{
+	unsigned char buf[RING_SIZE];
+	
+	std::atomic<size_t> head;  /* Advanced by the owning thread. */
+	std::atomic<size_t> tail;  /* Advanced by the flusher. */
+	
+	std::atomic<uint32_t> dropped;
+	std::atomic<bool> orphaned;  /* Owning thread has exited. */
+	
+	uint32_t thread;
+	
+	LogRing():
+		head(0), tail(0), dropped(0), orphaned(false), thread(GetCurrentThreadId()) {}
+};
+
+/* Hands the thread's ring over to the flusher to free once the thread exits. */
+struct RingOwner
+{
+	LogRing *ring;
+	
+	RingOwner(): ring(NULL) {}
+	
+	~RingOwner()
+	{
+		if(ring != NULL)
+		{
+			ring->orphaned.store(true, std::memory_order_release);
+		}
+	}
+};
+
+static std::atomic<int> state(LOG_UNINITIALISED);
+static std::atomic<bool> trace_enabled(false);
+
+/* Serialises log_init() and log_fini(). */
 static std::mutex lock;
-static bool initialised = false;
+
+/* Protects the list of rings, held by the flusher while draining them. */
+static ProfiledMutex rings_lock("Log::rings_lock");
+static std::list<LogRing*> rings;
+
+static thread_local RingOwner ring_owner;
+
 static FILE *log_fh = NULL;
-static bool trace_enabled = false;
+static bool text_mode = false;
+
+static uint32_t start_ticks;
+static LARGE_INTEGER start_counter, counter_freq;
+
+/* Format strings already written to the current log, and their IDs. */
+static std::map<const char*, uint32_t> formats;
+
+/* Created on the first log_init() and never closed, since log_printf() may still be about
+ * to signal wake_event from another thread when the log is closed.
+*/
+static HANDLE wake_event = NULL;
+static HANDLE done_event = NULL;
+
+static std::atomic<bool> stopping(false);
+static HANDLE flusher = NULL;
+
+static uint64_t now_us()
+{
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	
+	uint64_t elapsed = counter.QuadPart - start_counter.QuadPart;
+	
+	return ((elapsed / counter_freq.QuadPart) * 1000000)
+		+ (((elapsed % counter_freq.QuadPart) * 1000000) / counter_freq.QuadPart);
+}
+
+static void ring_write(LogRing *ring, size_t pos, const void *data, size_t size)
+{
+	size_t off   = pos & (RING_SIZE - 1);
+	size_t first = std::min<size_t>(size, RING_SIZE - off);
+	
+	memcpy(ring->buf + off, data, first);
+	memcpy(ring->buf, (const unsigned char*)(data) + first, size - first);
+}
+
+static void ring_read(LogRing *ring, size_t pos, void *buf, size_t size)
+{
+	size_t off   = pos & (RING_SIZE - 1);
+	size_t first = std::min<size_t>(size, RING_SIZE - off);
+	
+	memcpy(buf, ring->buf + off, first);
+	memcpy((unsigned char*)(buf) + first, ring->buf, size - first);
+}
+
+static LogRing *get_ring()
+{
+	if(ring_owner.ring == NULL)
+	{
+		LogRing *ring = new LogRing();
+		
+		std::unique_lock<ProfiledMutex> l(rings_lock.at("get_ring"));
+		rings.push_back(ring);
+		
+		ring_owner.ring = ring;
+	}
+	
+	return ring_owner.ring;
+}
+
+/* Formatted output from a drain, sorted by time before being written out. */
+struct DrainedRecords
+{
+	std::vector<unsigned char> definitions;
+	std::vector<unsigned char> data;
+	
+	/* Time, offset and length of each record in data. */
+	std::vector< std::tuple<uint64_t, size_t, size_t> > index;
+	
+	void add(std::vector<unsigned char> *to, const LogRecord &record, const void *payload)
+	{
+		to->insert(to->end(), (const unsigned char*)(&record), (const unsigned char*)(&record + 1));
+		to->insert(to->end(), (const unsigned char*)(payload), (const unsigned char*)(payload) + record.length);
+	}
+	
+	void add_text(uint64_t time, uint32_t thread, const std::string &text)
+	{
+		char prefix[64];
+		snprintf(prefix, sizeof(prefix), "[thread=%u time=%u] ",
+			(unsigned)(thread), (unsigned)(start_ticks + (time / 1000)));
+		
+		size_t offset = data.size();
+		
+		data.insert(data.end(), prefix, prefix + strlen(prefix));
+		data.insert(data.end(), text.begin(), text.end());
+		data.push_back('\n');
+		
+		index.push_back(std::make_tuple(time, offset, data.size() - offset));
+	}
+	
+	void add_record(uint64_t time, uint32_t thread, LogRecordType type, uint32_t format, const void *payload, size_t length)
+	{
+		LogRecord record;
+		memset(&record, 0, sizeof(record));
+		
+		record.time   = time;
+		record.thread = thread;
+		record.format = format;
+		record.length = length;
+		record.type   = type;
+		
+		size_t offset = data.size();
+		add(&data, record, payload);
+		
+		index.push_back(std::make_tuple(time, offset, data.size() - offset));
+	}
+	
+	void add_format(const char *format, uint32_t id)
+	{
+		LogRecord record;
+		memset(&record, 0, sizeof(record));
+		
+		record.format = id;
+		record.length = strlen(format);
+		record.type   = LR_FORMAT;
+		
+		add(&definitions, record, format);
+	}
+};
+
+static void drain_ring(LogRing *ring, DrainedRecords *out)
+{
+	size_t tail = ring->tail.load(std::memory_order_relaxed);
+	size_t head = ring->head.load(std::memory_order_acquire);
+	
+	std::vector<unsigned char> data;
+	
+	while(tail != head)
+	{
+		PendingRecord r;
+		ring_read(ring, tail, &r, sizeof(r));
+		
+		data.resize(r.length);
+		ring_read(ring, tail + sizeof(r), data.data(), r.length);
+		
+		tail += sizeof(r) + r.length;
+		
+		if(r.type == LR_MESSAGE)
+		{
+			if(text_mode)
+			{
+				out->add_text(r.time, ring->thread, log_decode_args(r.format, data.data(), data.size()));
+			}
+			else{
+				auto f = formats.find(r.format);
+				if(f == formats.end())
+				{
+					f = formats.insert(std::make_pair(r.format, (uint32_t)(formats.size() + 1))).first;
+					out->add_format(f->first, f->second);
+				}
+				
+				out->add_record(r.time, ring->thread, LR_MESSAGE, f->second, data.data(), data.size());
+			}
+		}
+		else{
+			if(text_mode)
+			{
+				out->add_text(r.time, ring->thread, std::string(data.begin(), data.end()));
+			}
+			else{
+				out->add_record(r.time, ring->thread, LR_TEXT, 0, data.data(), data.size());
+			}
+		}
+	}
+	
+	ring->tail.store(tail, std::memory_order_release);
+	
+	uint32_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+	if(dropped > 0)
+	{
+		if(text_mode)
+		{
+			out->add_text(now_us(), ring->thread, "(" + std::to_string(dropped) + " messages dropped, log buffer full)");
+		}
+		else{
+			out->add_record(now_us(), ring->thread, LR_DROPPED, 0, &dropped, sizeof(dropped));
+		}
+	}
+}
+
+/* Writes out everything in the thread buffers. Only one thread may drain at a time.
+ *
+ * If may_block is false, nothing is written if another thread holds rings_lock. This is for
+ * when the process is exiting, since the other threads have been killed and whichever one
+ * held the lock will never release it.
+*/
+static void drain(bool may_block = true)
+{
+	DrainedRecords out;
+	
+	{
+		std::unique_lock<ProfiledMutex> l(rings_lock.at("drain"), std::defer_lock);
+		
+		if(may_block)
+		{
+			l.lock();
+		}
+		else if(!l.try_lock())
+		{
+			return;
+		}
+		
+		for(auto r = rings.begin(); r != rings.end();)
+		{
+			/* Checked before draining, so nothing can be written after the last drain. */
+			bool orphaned = (*r)->orphaned.load(std::memory_order_acquire);
+			
+			drain_ring(*r, &out);
+			
+			if(orphaned)
+			{
+				delete *r;
+				r = rings.erase(r);
+			}
+			else{
+				++r;
+			}
+		}
+	}
+	
+	if(out.index.empty())
+	{
+		return;
+	}
+	
+	/* Interleave the threads' messages. */
+	std::stable_sort(out.index.begin(), out.index.end(),
+		[](const std::tuple<uint64_t, size_t, size_t> &a, const std::tuple<uint64_t, size_t, size_t> &b)
+		{
+			return std::get<0>(a) < std::get<0>(b);
+		});
+	
+	fwrite(out.definitions.data(), 1, out.definitions.size(), log_fh);
+	
+	for(auto i = out.index.begin(); i != out.index.end(); ++i)
+	{
+		fwrite(out.data.data() + std::get<1>(*i), 1, std::get<2>(*i), log_fh);
+	}
+	
+	fflush(log_fh);
+}
+
+/* The flusher holds a reference to the module containing it (passed as the thread
+ * parameter) while it runs, so the DLL can't be unloaded out from under it while logging is
+ * enabled. It drops the reference as it exits, after log_fini() has stopped waiting for it.
+*/
+static DWORD WINAPI flusher_main(LPVOID module)
+{
+	while(!stopping.load())
+	{
+		WaitForSingleObject(wake_event, FLUSH_INTERVAL_MS);
+		drain();
+	}
+	
+	drain();
+	
+	SetEvent(done_event);
+	
+	if(module != NULL)
+	{
+		FreeLibraryAndExitThread((HMODULE)(module), 0);
+	}
+	
+	return 0;
+}
 
 static void _log_init()
 {
-	if(initialised)
+	if(state.load() != LOG_UNINITIALISED)
 	{
 		return;
 	}
 	
+	const char *t = getenv("DPLITE_TRACE");
+	trace_enabled.store(t && atoi(t) != 0);
+	
 	const char *log_name = getenv("DPLITE_LOG");
-	if(log_name != NULL)
+	if(log_name == NULL)
+	{
+		state.store(LOG_DISABLED);
+		return;
+	}
+	
+	const char *text = getenv("DPLITE_LOG_TEXT");
+	text_mode = (text && atoi(text) != 0);
+	
+	log_fh = fopen(log_name, (text_mode ? "a" : "ab"));
+	if(log_fh == NULL)
+	{
+		state.store(LOG_DISABLED);
+		return;
+	}
+	
+	setvbuf(log_fh, NULL, _IOFBF, RING_SIZE);
+	
+	start_ticks = GetTickCount();
+	
+	QueryPerformanceFrequency(&counter_freq);
+	QueryPerformanceCounter(&start_counter);
+	
+	formats.clear();
+	
+	if(!text_mode)
+	{
+		LogFileHeader header;
+		memset(&header, 0, sizeof(header));
+		
+		memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+		header.version     = LOG_VERSION;
+		header.start_ticks = start_ticks;
+		
+		fwrite(&header, sizeof(header), 1, log_fh);
+		fflush(log_fh);
+	}
+	
+	if(wake_event == NULL)
+	{
+		wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		done_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	
+	ResetEvent(done_event);
+	
+	HMODULE module = NULL;
+	GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCTSTR)(&flusher_main), &module);
+	
+	stopping.store(false);
+	
+	flusher = CreateThread(NULL, 0, &flusher_main, module, 0, NULL);
+	if(flusher == NULL)
 	{
-		log_fh = fopen(log_name, "a");
-		if(log_fh != NULL)
+		if(module != NULL)
 		{
-			setbuf(log_fh, NULL);
+			FreeLibrary(module);
 		}
+		
+		fclose(log_fh);
+		log_fh = NULL;
+		
+		state.store(LOG_DISABLED);
+		return;
 	}
 	
-	const char *t = getenv("DPLITE_TRACE");
-	trace_enabled = (t && atoi(t) != 0);
-	
-	initialised = true;
+	state.store(LOG_ENABLED, std::memory_order_release);
 }
 
 static void _log_fini()
 {
-	initialised = false;
-	
-	trace_enabled = false;
-	
-	if(log_fh != NULL)
+	if(state.load() == LOG_ENABLED)
 	{
+		stopping.store(true);
+		SetEvent(wake_event);
+		
+		if(WaitForSingleObject(flusher, 0) == WAIT_TIMEOUT)
+		{
+			/* Wait for the flusher to finish rather than for it to exit, since threads
+			 * can't exit while the loader lock is held when we are called from DllMain().
+			 * It holds a reference to the module, so won't be unloaded until it has.
+			*/
+			WaitForSingleObject(done_event, INFINITE);
+		}
+		else{
+			/* The flusher has already been killed, the process is exiting. Any other
+			 * thread which was logging has been killed too, possibly while holding
+			 * rings_lock.
+			*/
+			drain(false);
+		}
+		
+		CloseHandle(flusher);
+		flusher = NULL;
+		
 		fclose(log_fh);
 		log_fh = NULL;
 	}
+	
+	trace_enabled.store(false);
+	state.store(LOG_UNINITIALISED);
 }
 
 void log_init()
@@ -78,30 +512,92 @@ void log_fini()
 	_log_fini();
 }
 
+void log_lock_stats()
+{
+	rings_lock.get_profile().log_summary();
+	rings_lock.get_profile().reset();
+}
+
 bool log_trace_enabled()
 {
-	std::unique_lock<std::mutex> l(lock);
-	_log_init();
+	if(state.load(std::memory_order_relaxed) == LOG_UNINITIALISED)
+	{
+		log_init();
+	}
 	
-	return trace_enabled;
+	return trace_enabled.load(std::memory_order_relaxed);
 }
 
 void log_printf(const char *fmt, ...)
 {
-	std::unique_lock<std::mutex> l(lock);
-	_log_init();
+	int s = state.load(std::memory_order_relaxed);
 	
-	if(log_fh != NULL)
+	if(s == LOG_DISABLED)
+	{
+		return;
+	}
+	else if(s == LOG_UNINITIALISED)
 	{
-		fprintf(log_fh, "[thread=%u time=%u] ",
-			(unsigned)(GetCurrentThreadId()), (unsigned)(GetTickCount()));
+		log_init();
 		
-		va_list argv;
-		va_start(argv, fmt);
-		vfprintf(log_fh, fmt, argv);
+		if(state.load(std::memory_order_relaxed) != LOG_ENABLED)
+		{
+			return;
+		}
+	}
+	
+	std::atomic_thread_fence(std::memory_order_acquire);
+	
+	PendingRecord r;
+	unsigned char data[MAX_RECORD_DATA];
+	size_t length;
+	
+	r.time   = now_us();
+	r.format = fmt;
+	r.type   = LR_MESSAGE;
+	
+	va_list argv;
+	va_start(argv, fmt);
+	
+	if(!log_encode_args(fmt, argv, data, sizeof(data), &length))
+	{
 		va_end(argv);
+		va_start(argv, fmt);
+		
+		int n = vsnprintf((char*)(data), sizeof(data), fmt, argv);
 		
-		fprintf(log_fh, "\n");
+		r.format = NULL;
+		r.type   = LR_TEXT;
+		length   = (n < 0 ? 0 : std::min<size_t>(n, sizeof(data) - 1));
+	}
+	
+	va_end(argv);
+	
+	r.length = length;
+	
+	LogRing *ring = get_ring();
+	
+	size_t need = sizeof(r) + length;
+	size_t head = ring->head.load(std::memory_order_relaxed);
+	size_t tail = ring->tail.load(std::memory_order_acquire);
+	
+	if((RING_SIZE - (head - tail)) < need)
+	{
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		SetEvent(wake_event);
+		
+		return;
+	}
+	
+	ring_write(ring, head, &r, sizeof(r));
+	ring_write(ring, head + sizeof(r), data, length);
+	
+	ring->head.store(head + need, std::memory_order_release);
+	
+	/* Don't wait for the timer if the buffer is filling up. */
+	if((head + need - tail) >= (RING_SIZE / 2) && (head - tail) < (RING_SIZE / 2))
+	{
+		SetEvent(wake_event);
 	}
 }
 
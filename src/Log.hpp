@@ -22,9 +22,20 @@
 #include <string>
 
 void log_init();
+
+/* Writes out anything still buffered and closes the log. Logging again reopens it. */
 void log_fini();
+
+/* Writes the lock profile of the logger's own lock to the log and resets it. */
+void log_lock_stats();
+
 bool log_trace_enabled();
 
+/* Logs a message if the DPLITE_LOG environment variable is set.
+ *
+ * The arguments are copied and formatted later, so fmt must be a string literal (or
+ * otherwise outlive the logger). Costs a single atomic load when logging is disabled.
+*/
 void log_printf(const char *fmt, ...);
 
 std::string win_strerror(DWORD errnum);
@@ -0,0 +1,659 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <wchar.h>
+
+#include "LogFormat.hpp"
+
+/* Values are read and written with memcpy() since nothing in the buffers is aligned. */
+
+enum LengthModifier
+{
+	LM_NONE,
+	LM_HH,
+	LM_H,
+	LM_L,
+	LM_LL,
+	LM_I32,
+	LM_I64,
+	LM_SIZE,       /* z or I */
+	LM_INTMAX,     /* j */
+	LM_PTRDIFF,    /* t */
+	LM_LONGDOUBLE, /* L */
+	LM_WIDE,       /* w */
+};
+
+/* A parsed conversion specification. */
+struct ConversionSpec
+{
+	const char *end;  /* One past the conversion character. */
+	
+	std::string flags;
+	
+	bool star_width;
+	std::string width;
+	
+	bool has_precision;
+	bool star_precision;
+	std::string precision;
+	
+	LengthModifier length;
+	char conversion;
+	
+	bool wide() const
+	{
+		return conversion == 'S' || conversion == 'C'
+			|| ((conversion == 's' || conversion == 'c') && (length == LM_L || length == LM_WIDE));
+	}
+};
+
+/* Parses the conversion specification starting at the '%' pointed to by p. */
+static bool parse_spec(const char *p, ConversionSpec *spec)
+{
+	++p;
+	
+	spec->flags.clear();
+	spec->width.clear();
+	spec->precision.clear();
+	
+	spec->star_width     = false;
+	spec->has_precision  = false;
+	spec->star_precision = false;
+	spec->length         = LM_NONE;
+	
+	while(*p != '\0' && strchr("-+ #0", *p) != NULL)
+	{
+		spec->flags += *(p++);
+	}
+	
+	if(*p == '*')
+	{
+		spec->star_width = true;
+		++p;
+	}
+	else{
+		while(*p >= '0' && *p <= '9')
+		{
+			spec->width += *(p++);
+		}
+	}
+	
+	if(*p == '.')
+	{
+		spec->has_precision = true;
+		++p;
+		
+		if(*p == '*')
+		{
+			spec->star_precision = true;
+			++p;
+		}
+		else{
+			while(*p >= '0' && *p <= '9')
+			{
+				spec->precision += *(p++);
+			}
+		}
+	}
+	
+	if(strncmp(p, "hh", 2) == 0)       { spec->length = LM_HH;         p += 2; }
+	else if(*p == 'h')                 { spec->length = LM_H;          p += 1; }
+	else if(strncmp(p, "ll", 2) == 0)  { spec->length = LM_LL;         p += 2; }
+	else if(*p == 'l')                 { spec->length = LM_L;          p += 1; }
+	else if(strncmp(p, "I64", 3) == 0) { spec->length = LM_I64;        p += 3; }
+	else if(strncmp(p, "I32", 3) == 0) { spec->length = LM_I32;        p += 3; }
+	else if(*p == 'I' || *p == 'z')    { spec->length = LM_SIZE;       p += 1; }
+	else if(*p == 'j')                 { spec->length = LM_INTMAX;     p += 1; }
+	else if(*p == 't')                 { spec->length = LM_PTRDIFF;    p += 1; }
+	else if(*p == 'L')                 { spec->length = LM_LONGDOUBLE; p += 1; }
+	else if(*p == 'w')                 { spec->length = LM_WIDE;       p += 1; }
+	
+	if(*p == '\0' || strchr("diouxXcCsSpfFeEgGaA%", *p) == NULL)
+	{
+		return false;
+	}
+	
+	spec->conversion = *(p++);
+	spec->end        = p;
+	
+	return true;
+}
+
+struct ArgWriter
+{
+	unsigned char *p;
+	size_t left;
+	bool ok;
+	
+	ArgWriter(unsigned char *buf, size_t size):
+		p(buf), left(size), ok(true) {}
+	
+	void bytes(const void *data, size_t size)
+	{
+		if(!ok || size > left)
+		{
+			ok = false;
+			return;
+		}
+		
+		memcpy(p, data, size);
+		
+		p    += size;
+		left -= size;
+	}
+	
+	void u64(uint64_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+	
+	void u32(uint32_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+};
+
+struct ArgReader
+{
+	const unsigned char *p;
+	size_t left;
+	bool ok;
+	
+	ArgReader(const unsigned char *data, size_t length):
+		p(data), left(length), ok(true) {}
+	
+	bool bytes(void *buf, size_t size)
+	{
+		if(!ok || size > left)
+		{
+			ok = false;
+			return false;
+		}
+		
+		memcpy(buf, p, size);
+		
+		p    += size;
+		left -= size;
+		
+		return true;
+	}
+	
+	bool u64(uint64_t *value)
+	{
+		return bytes(value, sizeof(*value));
+	}
+	
+	bool u32(uint32_t *value)
+	{
+		return bytes(value, sizeof(*value));
+	}
+};
+
+/* Reads a signed integer argument of the given size and sign extends it. */
+static uint64_t va_arg_signed(va_list *argv, LengthModifier length)
+{
+	switch(length)
+	{
+		case LM_L:       return (int64_t)(va_arg(*argv, long));
+		case LM_LL:      return (int64_t)(va_arg(*argv, long long));
+		case LM_I64:     return (int64_t)(va_arg(*argv, long long));
+		case LM_SIZE:    return (int64_t)(va_arg(*argv, ptrdiff_t));
+		case LM_INTMAX:  return (int64_t)(va_arg(*argv, long long));
+		case LM_PTRDIFF: return (int64_t)(va_arg(*argv, ptrdiff_t));
+		case LM_HH:      return (int64_t)((signed char)(va_arg(*argv, int)));
+		case LM_H:       return (int64_t)((short)(va_arg(*argv, int)));
+		default:         return (int64_t)(va_arg(*argv, int));
+	}
+}
+
+static uint64_t va_arg_unsigned(va_list *argv, LengthModifier length)
+{
+	switch(length)
+	{
+		case LM_L:       return va_arg(*argv, unsigned long);
+		case LM_LL:      return va_arg(*argv, unsigned long long);
+		case LM_I64:     return va_arg(*argv, unsigned long long);
+		case LM_SIZE:    return va_arg(*argv, size_t);
+		case LM_INTMAX:  return va_arg(*argv, unsigned long long);
+		case LM_PTRDIFF: return va_arg(*argv, size_t);
+		case LM_HH:      return (unsigned char)(va_arg(*argv, unsigned int));
+		case LM_H:       return (unsigned short)(va_arg(*argv, unsigned int));
+		default:         return va_arg(*argv, unsigned int);
+	}
+}
+
+/* Appends a wide string as UTF-16, limited to max characters. */
+static void write_wstring(ArgWriter &w, const wchar_t *s, size_t max)
+{
+	std::vector<uint16_t> units;
+	
+	for(size_t i = 0; i < max && s[i] != L'\0'; ++i)
+	{
+		uint32_t c = s[i];
+		
+		if(c > 0xFFFF)
+		{
+			/* Only happens where wchar_t is UTF-32. */
+			c -= 0x10000;
+			
+			units.push_back(0xD800 | (c >> 10));
+			units.push_back(0xDC00 | (c & 0x3FF));
+		}
+		else{
+			units.push_back(c);
+		}
+	}
+	
+	w.u32(units.size());
+	
+	if(!units.empty())
+	{
+		w.bytes(units.data(), units.size() * sizeof(uint16_t));
+	}
+}
+
+bool log_encode_args(const char *fmt, va_list argv, unsigned char *buf, size_t size, size_t *used)
+{
+	ArgWriter w(buf, size);
+	
+	va_list args;
+	va_copy(args, argv);
+	
+	for(const char *p = fmt; *p != '\0' && w.ok;)
+	{
+		if(*p != '%')
+		{
+			++p;
+			continue;
+		}
+		
+		ConversionSpec spec;
+		if(!parse_spec(p, &spec))
+		{
+			va_end(args);
+			return false;
+		}
+		
+		p = spec.end;
+		
+		if(spec.conversion == '%')
+		{
+			continue;
+		}
+		
+		if(spec.star_width)
+		{
+			w.u64((int64_t)(va_arg(args, int)));
+		}
+		
+		int precision = -1;
+		
+		if(spec.star_precision)
+		{
+			precision = va_arg(args, int);
+			w.u64((int64_t)(precision));
+		}
+		else if(spec.has_precision)
+		{
+			precision = atoi(spec.precision.c_str());
+		}
+		
+		size_t max_chars = (precision >= 0 ? (size_t)(precision) : (size_t)(-1));
+		
+		switch(spec.conversion)
+		{
+			case 'd':
+			case 'i':
+				w.u64(va_arg_signed(&args, spec.length));
+				break;
+				
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				w.u64(va_arg_unsigned(&args, spec.length));
+				break;
+				
+			case 'c':
+			case 'C':
+				/* wint_t and char are both promoted to int. */
+				w.u64((uint32_t)(va_arg(args, int)));
+				break;
+				
+			case 'p':
+				w.u64((uintptr_t)(va_arg(args, void*)));
+				break;
+				
+			case 's':
+			case 'S':
+				if(spec.wide())
+				{
+					const wchar_t *s = va_arg(args, const wchar_t*);
+					write_wstring(w, (s != NULL ? s : L"(null)"), max_chars);
+				}
+				else{
+					const char *s = va_arg(args, const char*);
+					if(s == NULL)
+					{
+						s = "(null)";
+					}
+					
+					size_t len = 0;
+					while(len < max_chars && s[len] != '\0')
+					{
+						++len;
+					}
+					
+					w.u32(len);
+					w.bytes(s, len);
+				}
+				
+				break;
+				
+			default:
+			{
+				/* Floating point. */
+				double value = (spec.length == LM_LONGDOUBLE)
+					? (double)(va_arg(args, long double))
+					: va_arg(args, double);
+				
+				w.bytes(&value, sizeof(value));
+				
+				break;
+			}
+		}
+	}
+	
+	va_end(args);
+	
+	if(!w.ok)
+	{
+		return false;
+	}
+	
+	*used = size - w.left;
+	return true;
+}
+
+static void append_utf8(std::string &out, uint32_t c)
+{
+	if(c < 0x80)
+	{
+		out += (char)(c);
+	}
+	else if(c < 0x800)
+	{
+		out += (char)(0xC0 | (c >> 6));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else if(c < 0x10000)
+	{
+		out += (char)(0xE0 | (c >> 12));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+	else{
+		out += (char)(0xF0 | (c >> 18));
+		out += (char)(0x80 | ((c >> 12) & 0x3F));
+		out += (char)(0x80 | ((c >> 6) & 0x3F));
+		out += (char)(0x80 | (c & 0x3F));
+	}
+}
+
+static bool read_string(ArgReader &r, bool wide, std::string *s)
+{
+	uint32_t len;
+	if(!r.u32(&len))
+	{
+		return false;
+	}
+	
+	s->clear();
+	
+	if(!wide)
+	{
+		if(len > r.left)
+		{
+			r.ok = false;
+			return false;
+		}
+		
+		s->assign((const char*)(r.p), len);
+		
+		r.p    += len;
+		r.left -= len;
+		
+		return true;
+	}
+	
+	for(uint32_t i = 0; i < len; ++i)
+	{
+		uint16_t unit;
+		if(!r.bytes(&unit, sizeof(unit)))
+		{
+			return false;
+		}
+		
+		uint32_t c = unit;
+		
+		if(unit >= 0xD800 && unit < 0xDC00 && (i + 1) < len)
+		{
+			uint16_t low;
+			if(!r.bytes(&low, sizeof(low)))
+			{
+				return false;
+			}
+			
+			++i;
+			c = 0x10000 + (((uint32_t)(unit) - 0xD800) << 10) + ((uint32_t)(low) - 0xDC00);
+		}
+		
+		append_utf8(*s, c);
+	}
+	
+	return true;
+}
+
+static std::string format_one(const std::string &spec, ...)
+{
+	va_list argv, argv2;
+	
+	va_start(argv, spec);
+	va_copy(argv2, argv);
+	
+	int len = vsnprintf(NULL, 0, spec.c_str(), argv);
+	
+	std::string out;
+	
+	if(len > 0)
+	{
+		std::vector<char> buf(len + 1);
+		vsnprintf(buf.data(), buf.size(), spec.c_str(), argv2);
+		
+		out.assign(buf.data(), len);
+	}
+	
+	va_end(argv2);
+	va_end(argv);
+	
+	return out;
+}
+
+std::string log_decode_args(const char *fmt, const unsigned char *data, size_t length)
+{
+	std::string out;
+	ArgReader r(data, length);
+	
+	for(const char *p = fmt; *p != '\0';)
+	{
+		if(*p != '%')
+		{
+			out += *(p++);
+			continue;
+		}
+		
+		ConversionSpec spec;
+		if(!parse_spec(p, &spec))
+		{
+			out += *(p++);
+			continue;
+		}
+		
+		p = spec.end;
+		
+		if(spec.conversion == '%')
+		{
+			out += '%';
+			continue;
+		}
+		
+		/* Rebuild the specification for the host's printf(), with any '*' values
+		 * filled in and the length modifier replaced to match how the argument was
+		 * stored.
+		*/
+		
+		std::string width, precision;
+		uint64_t value;
+		
+		if(spec.star_width)
+		{
+			if(!r.u64(&value))
+			{
+				break;
+			}
+			
+			width = std::to_string((int64_t)(value));
+		}
+		else{
+			width = spec.width;
+		}
+		
+		if(spec.star_precision)
+		{
+			if(!r.u64(&value))
+			{
+				break;
+			}
+			
+			if((int64_t)(value) >= 0)
+			{
+				precision = "." + std::to_string((int64_t)(value));
+			}
+		}
+		else if(spec.has_precision)
+		{
+			precision = "." + spec.precision;
+		}
+		
+		std::string host_spec = "%" + spec.flags + width + precision;
+		
+		switch(spec.conversion)
+		{
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				if(r.u64(&value))
+				{
+					out += format_one(host_spec + "ll" + spec.conversion, value);
+				}
+				
+				break;
+				
+			case 'c':
+			case 'C':
+				if(r.u64(&value))
+				{
+					std::string c;
+					
+					if(spec.wide())
+					{
+						append_utf8(c, (uint32_t)(value));
+					}
+					else{
+						c += (char)(value);
+					}
+					
+					out += format_one(host_spec + "s", c.c_str());
+				}
+				
+				break;
+				
+			case 'p':
+				if(r.u64(&value))
+				{
+					/* Same as the Windows C runtime, which doesn't prefix it. */
+					out += format_one((value > 0xFFFFFFFFULL ? "%016llX" : "%08llX"), (unsigned long long)(value));
+				}
+				
+				break;
+				
+			case 's':
+			case 'S':
+			{
+				std::string s;
+				
+				if(read_string(r, spec.wide(), &s))
+				{
+					if(spec.wide())
+					{
+						/* Already cut down to the precision in characters. */
+						host_spec = "%" + spec.flags + width;
+					}
+					
+					out += format_one(host_spec + "s", s.c_str());
+				}
+				
+				break;
+			}
+			
+			default:
+			{
+				double d;
+				
+				if(r.bytes(&d, sizeof(d)))
+				{
+					out += format_one(host_spec + spec.conversion, d);
+				}
+				
+				break;
+			}
+		}
+		
+		if(!r.ok)
+		{
+			break;
+		}
+	}
+	
+	if(!r.ok)
+	{
+		out += "<?>";
+	}
+	
+	return out;
+}
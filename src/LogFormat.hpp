@@ -0,0 +1,91 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_LOGFORMAT_HPP
+#define DPLITE_LOGFORMAT_HPP
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/* Binary log file format written by log_printf() when DPLITE_LOG is set.
+ *
+ * Messages aren't formatted when they are logged. The arguments are copied into the log
+ * along with an ID for the format string, and the format string itself is written out
+ * the first time it is used. dplite-logdecode turns the log back into text.
+ *
+ * The file starts with a LogFileHeader. A LogRecord and its data follow for each entry.
+ * Another LogFileHeader follows if the file was appended to by a later process, and the
+ * format IDs start again from there.
+ *
+ * Like RelayPacket, this doesn't need windows.h, so the decoder can be built anywhere.
+*/
+
+#define LOG_MAGIC   "DPLLOG\r\n"
+#define LOG_VERSION 1
+
+struct LogFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t start_ticks;  /* GetTickCount() when the log was opened. */
+};
+
+enum LogRecordType
+{
+	/* Defines a format string, data is the string without a terminator. */
+	LR_FORMAT = 1,
+	
+	/* A message, data is the arguments as encoded by log_encode_args(). */
+	LR_MESSAGE = 2,
+	
+	/* A message which was formatted when logged, data is the text. */
+	LR_TEXT = 3,
+	
+	/* Messages lost because the thread's buffer was full, data is a uint32_t count. */
+	LR_DROPPED = 4,
+};
+
+struct LogRecord
+{
+	uint64_t time;    /* Microseconds since the log was opened. */
+	uint32_t thread;
+	uint32_t format;  /* ID of the format string, LR_FORMAT and LR_MESSAGE only. */
+	uint32_t length;  /* Length of data following the record. */
+	uint8_t  type;
+	uint8_t  reserved[3];
+};
+
+/* Copies the arguments for a printf() style format string into buf.
+ *
+ * Integers, characters and pointers are stored as 64-bit values, floating point values as
+ * doubles and strings as a uint32_t length followed by the characters. Wide strings (%S
+ * and %ls) are stored as UTF-16 code units.
+ *
+ * Returns false if the arguments don't fit or the format uses something which isn't
+ * supported (%n), in which case the caller should format the message itself.
+*/
+bool log_encode_args(const char *fmt, va_list argv, unsigned char *buf, size_t size, size_t *used);
+
+/* Formats a message from a format string and arguments encoded by log_encode_args().
+ * Malformed data is substituted with "<?>" rather than read out of bounds.
+*/
+std::string log_decode_args(const char *fmt, const unsigned char *data, size_t length);
+
+#endif /* !DPLITE_LOGFORMAT_HPP */
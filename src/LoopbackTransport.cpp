@@ -0,0 +1,667 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <assert.h>
+#include <string.h>
+#include <windows.h>
+
+#include "LoopbackTransport.hpp"
+#include "network.hpp"
+
+LoopbackTransport::Socket::Socket(SocketType type, uint32_t ip, uint16_t port):
+	type(type), ip(ip), port(port), shared(false), event(NULL), events(0), write_pending(false),
+	remote(-1), connect_error(0), connect_pending(false), send_blocked(false), send_shut(false),
+	recv_buf_off(0), recv_eof(false), recv_reset(false)
+{
+	memset(&remote_addr, 0, sizeof(remote_addr));
+}
+
+LoopbackTransport::LoopbackTransport():
+	next_sock(1), next_port(FIRST_AUTO_PORT) {}
+
+LoopbackTransport::~LoopbackTransport() {}
+
+size_t LoopbackTransport::open_sockets()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return sockets.size();
+}
+
+LoopbackTransport::Socket *LoopbackTransport::get_socket(int sock)
+{
+	auto s = sockets.find(sock);
+	if(s == sockets.end())
+	{
+		WSASetLastError(WSAENOTSOCK);
+		return NULL;
+	}
+	
+	return &(s->second);
+}
+
+int LoopbackTransport::new_socket(SocketType type, uint32_t ip, uint16_t port, bool shared)
+{
+	int sock = next_sock++;
+	
+	Socket &s = sockets.insert(std::make_pair(sock, Socket(type, ip, port))).first->second;
+	s.shared = shared;
+	
+	/* Real UDP sockets are writable straight away. */
+	s.write_pending = (type == ST_UDP);
+	
+	return sock;
+}
+
+bool LoopbackTransport::address_in_use(SocketType type, uint32_t ip, uint16_t port)
+{
+	for(auto si = sockets.begin(); si != sockets.end(); ++si)
+	{
+		const Socket &s = si->second;
+		
+		if(s.type == type && s.port == port && !s.shared
+			&& (s.ip == htonl(INADDR_ANY) || ip == htonl(INADDR_ANY) || s.ip == ip))
+		{
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+uint16_t LoopbackTransport::alloc_port()
+{
+	uint16_t port = next_port++;
+	
+	if(next_port == 0)
+	{
+		next_port = FIRST_AUTO_PORT;
+	}
+	
+	return port;
+}
+
+bool LoopbackTransport::address_matches(const Socket &s, uint32_t ip, uint16_t port)
+{
+	return s.port == port
+		&& (s.ip == htonl(INADDR_ANY) || ip == htonl(INADDR_BROADCAST) || s.ip == ip);
+}
+
+struct sockaddr_in LoopbackTransport::local_addr(const Socket &s)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = (s.ip == htonl(INADDR_ANY) ? htonl(INADDR_LOOPBACK) : s.ip);
+	addr.sin_port        = htons(s.port);
+	
+	return addr;
+}
+
+/* Breaks the connection between a stream socket and its remote end, which will see EOF or a
+ * reset once it has read everything already sent to it.
+*/
+void LoopbackTransport::disconnect(Socket &s)
+{
+	if(s.remote == -1)
+	{
+		return;
+	}
+	
+	Socket *remote = get_socket(s.remote);
+	assert(remote != NULL);
+	
+	remote->remote     = -1;
+	remote->recv_eof   = true;
+	remote->recv_reset = !s.send_shut;
+	
+	update_events(*remote);
+	
+	s.remote = -1;
+}
+
+/* Signals the socket's event if any of the selected network events are waiting. */
+void LoopbackTransport::update_events(Socket &s)
+{
+	if(s.event == NULL)
+	{
+		return;
+	}
+	
+	bool signal = false;
+	
+	if((s.events & FD_READ) && (!s.datagrams.empty() || s.recv_buf.size() > s.recv_buf_off))
+	{
+		signal = true;
+	}
+	
+	if((s.events & FD_ACCEPT) && !s.backlog.empty())
+	{
+		signal = true;
+	}
+	
+	if((s.events & FD_CLOSE) && s.recv_eof)
+	{
+		signal = true;
+	}
+	
+	/* FD_CONNECT and FD_WRITE are only signalled once per occurrence. */
+	
+	if((s.events & FD_CONNECT) && s.connect_pending)
+	{
+		s.connect_pending = false;
+		signal = true;
+	}
+	
+	if((s.events & FD_WRITE) && s.write_pending)
+	{
+		s.write_pending = false;
+		signal = true;
+	}
+	
+	if(signal)
+	{
+		SetEvent(s.event);
+	}
+}
+
+int LoopbackTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(port == 0)
+	{
+		do {
+			port = alloc_port();
+		} while(address_in_use(ST_UDP, ipaddr, port));
+	}
+	else if(address_in_use(ST_UDP, ipaddr, port))
+	{
+		WSASetLastError(WSAEADDRINUSE);
+		return -1;
+	}
+	
+	return new_socket(ST_UDP, ipaddr, port);
+}
+
+int LoopbackTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(port == 0)
+	{
+		do {
+			port = alloc_port();
+		} while(address_in_use(ST_LISTENER, ipaddr, port));
+	}
+	else if(address_in_use(ST_LISTENER, ipaddr, port))
+	{
+		WSASetLastError(WSAEADDRINUSE);
+		return -1;
+	}
+	
+	return new_socket(ST_LISTENER, ipaddr, port);
+}
+
+bool LoopbackTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	uint16_t p;
+	
+	do {
+		p = alloc_port();
+	} while(address_in_use(ST_UDP, ipaddr, p) || address_in_use(ST_LISTENER, ipaddr, p));
+	
+	*udp_sock      = new_socket(ST_UDP, ipaddr, p);
+	*listener_sock = new_socket(ST_LISTENER, ipaddr, p);
+	*port          = p;
+	
+	return true;
+}
+
+int LoopbackTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	/* Client sockets share their port with the listener, like SO_REUSEADDR. */
+	
+	if(local_port == 0)
+	{
+		local_port = alloc_port();
+	}
+	
+	return new_socket(ST_STREAM, local_ipaddr, local_port);
+}
+
+int LoopbackTransport::create_discovery_socket()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return new_socket(ST_UDP, htonl(INADDR_ANY), DISCOVERY_PORT, true);
+}
+
+void LoopbackTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	/* Nothing to tune. */
+}
+
+bool LoopbackTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	return true;
+}
+
+int LoopbackTransport::event_select(int sock, HANDLE event, long events)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	s->event  = (events != 0 ? event : NULL);
+	s->events = events;
+	
+	update_events(*s);
+	
+	return 0;
+}
+
+int LoopbackTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_LISTENER)
+	{
+		WSASetLastError(WSAEINVAL);
+		return -1;
+	}
+	
+	if(s->backlog.empty())
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	int newfd = s->backlog.front();
+	s->backlog.pop_front();
+	
+	update_events(*s);
+	
+	Socket *ns = get_socket(newfd);
+	assert(ns != NULL);
+	
+	*addr = ns->remote_addr;
+	
+	return newfd;
+}
+
+int LoopbackTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_STREAM || s->remote != -1 || s->connect_pending)
+	{
+		WSASetLastError(WSAEINVAL);
+		return -1;
+	}
+	
+	Socket *listener = NULL;
+	
+	for(auto si = sockets.begin(); si != sockets.end(); ++si)
+	{
+		if(si->second.type == ST_LISTENER && address_matches(si->second, addr->sin_addr.s_addr, ntohs(addr->sin_port)))
+		{
+			listener = &(si->second);
+			break;
+		}
+	}
+	
+	s->connect_pending = true;
+	
+	if(listener == NULL || listener->backlog.size() >= LISTEN_QUEUE_SIZE)
+	{
+		s->connect_error = WSAECONNREFUSED;
+	}
+	else{
+		/* Connections are established before they are accept()ed, like real TCP. */
+		
+		int newfd = new_socket(ST_STREAM, listener->ip, listener->port);
+		Socket *ns = get_socket(newfd);
+		
+		ns->remote        = sock;
+		ns->remote_addr   = local_addr(*s);
+		ns->write_pending = true;
+		
+		s->remote        = newfd;
+		s->remote_addr   = *addr;
+		s->write_pending = true;
+		
+		listener->backlog.push_back(newfd);
+		update_events(*listener);
+	}
+	
+	update_events(*s);
+	
+	WSASetLastError(WSAEWOULDBLOCK);
+	return -1;
+}
+
+int LoopbackTransport::get_socket_error(int sock, int *error)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	*error = s->connect_error;
+	s->connect_error = 0;
+	
+	return 0;
+}
+
+int LoopbackTransport::send(int sock, const void *data, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_STREAM)
+	{
+		WSASetLastError(WSAENOTCONN);
+		return -1;
+	}
+	
+	if(s->send_shut)
+	{
+		WSASetLastError(WSAESHUTDOWN);
+		return -1;
+	}
+	
+	if(s->remote == -1)
+	{
+		WSASetLastError(s->recv_eof ? WSAECONNRESET : WSAENOTCONN);
+		return -1;
+	}
+	
+	Socket *remote = get_socket(s->remote);
+	assert(remote != NULL);
+	
+	size_t queued = remote->recv_buf.size() - remote->recv_buf_off;
+	size_t space  = queued < STREAM_BUFFER_SIZE ? STREAM_BUFFER_SIZE - queued : 0;
+	
+	if(space == 0)
+	{
+		s->send_blocked = true;
+		
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	if(size > space)
+	{
+		size = space;
+	}
+	
+	remote->recv_buf.insert(remote->recv_buf.end(), (const unsigned char*)(data), (const unsigned char*)(data) + size);
+	update_events(*remote);
+	
+	return size;
+}
+
+int LoopbackTransport::recv(int sock, void *buf, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_STREAM)
+	{
+		WSASetLastError(WSAENOTCONN);
+		return -1;
+	}
+	
+	size_t avail = s->recv_buf.size() - s->recv_buf_off;
+	
+	if(avail == 0)
+	{
+		if(s->recv_reset)
+		{
+			WSASetLastError(WSAECONNRESET);
+			return -1;
+		}
+		else if(s->recv_eof)
+		{
+			WSASetLastError(0);
+			return 0;
+		}
+		else{
+			WSASetLastError(WSAEWOULDBLOCK);
+			return -1;
+		}
+	}
+	
+	if(size > avail)
+	{
+		size = avail;
+	}
+	
+	memcpy(buf, s->recv_buf.data() + s->recv_buf_off, size);
+	s->recv_buf_off += size;
+	
+	if(s->recv_buf_off == s->recv_buf.size())
+	{
+		s->recv_buf.clear();
+		s->recv_buf_off = 0;
+	}
+	else if(s->recv_buf_off >= STREAM_BUFFER_SIZE)
+	{
+		s->recv_buf.erase(s->recv_buf.begin(), s->recv_buf.begin() + s->recv_buf_off);
+		s->recv_buf_off = 0;
+	}
+	
+	if(s->remote != -1)
+	{
+		Socket *remote = get_socket(s->remote);
+		assert(remote != NULL);
+		
+		if(remote->send_blocked)
+		{
+			remote->send_blocked  = false;
+			remote->write_pending = true;
+			
+			update_events(*remote);
+		}
+	}
+	
+	update_events(*s);
+	
+	WSASetLastError(0);
+	return size;
+}
+
+int LoopbackTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_UDP || addr->sa_family != AF_INET || addrlen < (int)(sizeof(struct sockaddr_in)))
+	{
+		WSASetLastError(WSAEINVAL);
+		return -1;
+	}
+	
+	const struct sockaddr_in *dest = (const struct sockaddr_in*)(addr);
+	
+	for(auto si = sockets.begin(); si != sockets.end(); ++si)
+	{
+		Socket &ds = si->second;
+		
+		if(ds.type != ST_UDP || !address_matches(ds, dest->sin_addr.s_addr, ntohs(dest->sin_port)))
+		{
+			continue;
+		}
+		
+		if(ds.datagrams.size() >= MAX_QUEUED_DATAGRAMS)
+		{
+			/* Receive buffer full, silently dropped like a real datagram. */
+			continue;
+		}
+		
+		ds.datagrams.push_back(Datagram());
+		
+		Datagram &dg = ds.datagrams.back();
+		dg.data.assign((const unsigned char*)(data), (const unsigned char*)(data) + size);
+		dg.from = local_addr(*s);
+		
+		update_events(ds);
+	}
+	
+	return size;
+}
+
+int LoopbackTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_UDP)
+	{
+		WSASetLastError(WSAEINVAL);
+		return -1;
+	}
+	
+	if(s->datagrams.empty())
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	Datagram dg = std::move(s->datagrams.front());
+	s->datagrams.pop_front();
+	
+	update_events(*s);
+	
+	*from_addr = dg.from;
+	
+	if(dg.data.size() > size)
+	{
+		memcpy(buf, dg.data.data(), size);
+		
+		WSASetLastError(WSAEMSGSIZE);
+		return -1;
+	}
+	
+	memcpy(buf, dg.data.data(), dg.data.size());
+	
+	WSASetLastError(0);
+	return dg.data.size();
+}
+
+int LoopbackTransport::shutdown_send(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->type != ST_STREAM || s->remote == -1)
+	{
+		WSASetLastError(WSAENOTCONN);
+		return -1;
+	}
+	
+	s->send_shut = true;
+	
+	Socket *remote = get_socket(s->remote);
+	assert(remote != NULL);
+	
+	remote->recv_eof = true;
+	update_events(*remote);
+	
+	return 0;
+}
+
+void LoopbackTransport::close(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return;
+	}
+	
+	if(s->type == ST_STREAM)
+	{
+		disconnect(*s);
+	}
+	else if(s->type == ST_LISTENER)
+	{
+		/* Connections nobody accepted are reset. */
+		
+		for(auto bi = s->backlog.begin(); bi != s->backlog.end(); ++bi)
+		{
+			Socket *bs = get_socket(*bi);
+			assert(bs != NULL);
+			
+			disconnect(*bs);
+			sockets.erase(*bi);
+		}
+	}
+	
+	sockets.erase(sock);
+}
@@ -0,0 +1,161 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_LOOPBACKTRANSPORT_HPP
+#define DPLITE_LOOPBACKTRANSPORT_HPP
+
+#include <winsock2.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+#include <windows.h>
+
+#include "Transport.hpp"
+
+/* An in-memory network for tests and benchmarks.
+ *
+ * Every DirectPlay8Peer given the same LoopbackTransport can talk to the others as if they
+ * were on one host, connections complete immediately and data is delivered to the other
+ * end as soon as it is sent. No real sockets are created.
+ *
+ * Sockets bound to INADDR_ANY accept anything sent to their port and appear to come from
+ * 127.0.0.1, sockets bound to a specific address only accept traffic sent to it.
+ *
+ * Events follow WSAEventSelect(): a selected event is signalled whenever its condition
+ * becomes true, and again after a read, accept() or event_select() call which leaves it
+ * true. A hard close() is seen as WSAECONNRESET by the other end after it has read any
+ * remaining data, unless shutdown_send() was called first.
+ *
+ * Thread safe.
+*/
+
+class LoopbackTransport: public Transport
+{
+	public:
+		/* Bytes which may be waiting to be read on each side of a connection before
+		 * send() starts failing with WSAEWOULDBLOCK.
+		*/
+		static const size_t STREAM_BUFFER_SIZE = 256 * 1024;
+		
+		/* Datagrams which may be waiting to be read on a UDP socket before any more are
+		 * dropped.
+		*/
+		static const size_t MAX_QUEUED_DATAGRAMS = 256;
+		
+		/* First port handed out when binding to port zero. */
+		static const uint16_t FIRST_AUTO_PORT = 49152;
+		
+	private:
+		enum SocketType {
+			ST_UDP,
+			ST_LISTENER,
+			ST_STREAM,
+		};
+		
+		struct Datagram
+		{
+			std::vector<unsigned char> data;
+			struct sockaddr_in from;
+		};
+		
+		struct Socket
+		{
+			SocketType type;
+			
+			uint32_t ip;    /* Bound IPv4 address, network byte order. */
+			uint16_t port;  /* Bound port, host byte order. */
+			bool shared;    /* Other shared sockets may be bound to the same address (discovery). */
+			
+			HANDLE event;
+			long events;
+			
+			bool write_pending;  /* FD_WRITE to be signalled. */
+			
+			/* ST_UDP */
+			std::list<Datagram> datagrams;
+			
+			/* ST_LISTENER, connections waiting to be accept()ed. */
+			std::list<int> backlog;
+			
+			/* ST_STREAM */
+			int remote;                       /* Other end of the connection, -1 if none. */
+			struct sockaddr_in remote_addr;
+			int connect_error;                /* SO_ERROR */
+			bool connect_pending;             /* FD_CONNECT to be signalled. */
+			bool send_blocked;                /* send() has failed with WSAEWOULDBLOCK. */
+			bool send_shut;                   /* shutdown_send() has been called. */
+			
+			std::vector<unsigned char> recv_buf;
+			size_t recv_buf_off;              /* Start of unread data in recv_buf. */
+			
+			bool recv_eof;                    /* Remote end shut down or went away. */
+			bool recv_reset;                  /* Remote end went away without shutting down. */
+			
+			Socket(SocketType type, uint32_t ip, uint16_t port);
+		};
+		
+		std::mutex lock;
+		
+		int next_sock;
+		uint16_t next_port;
+		
+		std::map<int, Socket> sockets;
+		
+		Socket *get_socket(int sock);
+		int new_socket(SocketType type, uint32_t ip, uint16_t port, bool shared = false);
+		bool address_in_use(SocketType type, uint32_t ip, uint16_t port);
+		uint16_t alloc_port();
+		bool address_matches(const Socket &s, uint32_t ip, uint16_t port);
+		struct sockaddr_in local_addr(const Socket &s);
+		void disconnect(Socket &s);
+		void update_events(Socket &s);
+		
+	public:
+		LoopbackTransport();
+		virtual ~LoopbackTransport();
+		
+		/* No copy c'tor. */
+		LoopbackTransport(const LoopbackTransport &src) = delete;
+		
+		/* Number of sockets which haven't been closed, for checking nothing was leaked. */
+		size_t open_sockets();
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+};
+
+#endif /* !DPLITE_LOOPBACKTRANSPORT_HPP */
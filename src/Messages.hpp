@@ -54,8 +54,12 @@
  * DATA | NULL    - Request data
  * WSTRING - Player name (empty = none)
  * DATA    - Player data (empty = none)
+ * DWORD   - Interface (DPLITE_CONNECT_AS_PEER or DPLITE_CONNECT_AS_CLIENT)
 */
 
+#define DPLITE_CONNECT_AS_PEER   0
+#define DPLITE_CONNECT_AS_CLIENT 1
+
 #define DPLITE_MSGID_CONNECT_HOST_OK 4
 
 /* Successful response to DPLITE_MSGID_CONNECT_HOST from host.
@@ -63,7 +67,7 @@
  * GUID        - Instance GUID
  * DWORD       - Player ID of current host
  * DWORD       - Player ID assigned to receiving client
- * DWORD       - Number of other peers (total - 2)
+ * DWORD       - Number of other peers (total - 2, always zero in client/server sessions)
  *
  * For each peer:
  *   DWORD - Player ID
@@ -81,6 +85,10 @@
  *
  * For each group:
  *   DWORD - Group ID
+ *
+ * DWORD   - Session flags (DPNSESSION_MIGRATE_HOST, DPNSESSION_NODPNSVR, DPNSESSION_CLIENT_SERVER)
+ * DWORD   - Next player/group ID the host would allocate
+ * GUID    - Token for joining the session on the host's relay (GUID_NULL if none)
 */
 
 #define DPLITE_MSGID_CONNECT_HOST_FAIL 5
@@ -288,4 +296,154 @@
  * DWORD   - Group ID
 */
 
+#define DPLITE_MSGID_HOST_MIGRATE 22
+
+/* DPLITE_MSGID_HOST_MIGRATE
+ * The host has gone away and the peer sending this message has taken over as
+ * the host of a DPNSESSION_MIGRATE_HOST session.
+ *
+ * Every peer elects the new host independently when it loses its connection
+ * to the old one (lowest remaining player ID wins), so normally the receiver
+ * will have already reached the same conclusion. This message exists so that
+ * peers which haven't noticed the old host going away yet switch over without
+ * waiting for their own connection to it to fail.
+ *
+ * DWORD - Player ID of the new host (always the sending peer)
+ * DWORD - Next player/group ID the new host will allocate
+*/
+
+#define DPLITE_MSGID_PING 23
+
+/* DPLITE_MSGID_PING
+ * Sent periodically to each connected peer to measure the round trip time and keep the
+ * connection alive. The receiver must respond with a DPLITE_MSGID_PONG.
+ *
+ * DWORD - Sender's tick count, to be returned in the DPLITE_MSGID_PONG
+*/
+
+#define DPLITE_MSGID_PONG 24
+
+/* DPLITE_MSGID_PONG
+ * Response to a DPLITE_MSGID_PING.
+ *
+ * DWORD - Tick count from the DPLITE_MSGID_PING
+*/
+
+#define DPLITE_MSGID_MESSAGE_FRAGMENT 25
+
+/* DPLITE_MSGID_MESSAGE_FRAGMENT
+ * Part of a message sent via SendTo() which was too big to go in a single
+ * DPLITE_MSGID_MESSAGE. Fragments are sent in order and the message is delivered once
+ * the last one arrives. Fragments of messages sent at different priorities may be
+ * interleaved, but only one message of each priority is in flight at a time.
+ *
+ * DWORD - Player ID of sender
+ * DWORD - Message ID, unique to the sender, for a time.
+ * DWORD - Total message size
+ * DWORD - Offset of this fragment within the message
+ * DATA  - Fragment payload
+ * DWORD - Flags (as DPLITE_MSGID_MESSAGE, plus DPNSEND_PRIORITY_HIGH or DPNSEND_PRIORITY_LOW)
+*/
+
+/* The following messages are exchanged with a relay server (see relay/) over a TCP
+ * connection, rather than directly between peers. A relay hosts any number of sessions,
+ * each of which exists while at least one peer is joined to it.
+*/
+
+#define DPLITE_MSGID_RELAY_JOIN 26
+
+/* DPLITE_MSGID_RELAY_JOIN
+ * First message sent to a relay on a new connection, attaches it to a session. The relay
+ * responds with DPLITE_MSGID_RELAY_JOIN_OK or DPLITE_MSGID_RELAY_JOIN_FAIL.
+ *
+ * GUID  - Instance GUID of the session
+ * DWORD - Player ID of the joining peer, unique within the session
+ * GUID  - Token from DPLITE_MSGID_RELAY_ADMIT, or GUID_NULL when hosting the session
+ *
+ * The host creates the session by joining it with a null token, which fails if the session
+ * already exists. Anyone else must have been admitted by a peer already in the session (the
+ * host, normally) and present the token it was given. The relay holds the join until the
+ * matching DPLITE_MSGID_RELAY_ADMIT arrives, refusing it if that doesn't happen within a
+ * few seconds.
+*/
+
+#define DPLITE_MSGID_RELAY_JOIN_OK 27
+
+/* DPLITE_MSGID_RELAY_JOIN_OK
+ * The connection is now attached to the session.
+ *
+ * DWORD - Number of other peers in the session
+ *
+ * For each peer:
+ *   DWORD - Player ID
+*/
+
+#define DPLITE_MSGID_RELAY_JOIN_FAIL 28
+
+/* DPLITE_MSGID_RELAY_JOIN_FAIL
+ * The relay will close the connection after sending this.
+ *
+ * DWORD - Error code (DPNERR_ALREADYCONNECTED if the player ID is in use,
+ *         DPNERR_INVALIDPASSWORD if the player wasn't admitted with the token, etc)
+*/
+
+#define DPLITE_MSGID_RELAY_SEND 29
+
+/* DPLITE_MSGID_RELAY_SEND
+ * Asks the relay to pass a packet on to one, some or all of the other peers in the session.
+ * Sending to more than one only costs the sender one copy of the packet, the relay makes
+ * the rest.
+ *
+ * DWORD - Player ID of the destination, or 0 for more than one
+ * DATA  - Packet (any other complete DPLITE_MSGID_* message)
+ *
+ * If the destination is 0, the packet goes to every other peer in the session, unless it is
+ * followed by a list of the players to send it to:
+ *
+ * For each player:
+ *   DWORD - Player ID
+ *
+ * RelayTransport uses these to carry the stream between two players which couldn't
+ * connect directly, so DATA is the next chunk of the stream to the destination rather than
+ * a whole message. An empty DATA marks the end of the stream. A message sent to several
+ * players with RelayTransport::send_multi() is always complete, so it lands between messages
+ * in each of their streams.
+*/
+
+#define DPLITE_MSGID_RELAY_RECV 30
+
+/* DPLITE_MSGID_RELAY_RECV
+ * A packet which another peer sent with DPLITE_MSGID_RELAY_SEND.
+ *
+ * DWORD - Player ID of the sender
+ * DATA  - Packet
+*/
+
+#define DPLITE_MSGID_RELAY_PEER_JOINED 31
+
+/* DPLITE_MSGID_RELAY_PEER_JOINED
+ * Another peer has joined the session.
+ *
+ * DWORD - Player ID
+*/
+
+#define DPLITE_MSGID_RELAY_PEER_LEFT 32
+
+/* DPLITE_MSGID_RELAY_PEER_LEFT
+ * Another peer has left the session, or been disconnected by the relay.
+ *
+ * DWORD - Player ID
+*/
+
+#define DPLITE_MSGID_RELAY_ADMIT 33
+
+/* DPLITE_MSGID_RELAY_ADMIT
+ * Allows a player to join the session with DPLITE_MSGID_RELAY_JOIN. Sent by a peer already
+ * in the session, normally the host once it has accepted the player's connection and given
+ * them the token in DPLITE_MSGID_CONNECT_HOST_OK. Each token may only be used once.
+ *
+ * DWORD - Player ID
+ * GUID  - Token the player will join with
+*/
+
 #endif /* !DPLITE_MESSAGES_HPP */
@@ -0,0 +1,419 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+#include "Log.hpp"
+#include "ProfiledMutex.hpp"
+
+std::atomic<int> lock_profile_state(LOCK_PROFILE_UNINITIALISED);
+
+/* Where this thread last said it was locking each mutex from, see ProfiledMutex::at().
+ * Entries are reused round-robin, a thread rarely has more than a couple of profiled locks
+ * on the go at once.
+*/
+struct ThreadLockSite
+{
+	const void *mutex;
+	const char *site;
+	
+	/* When this thread took the mutex shared, 0 if it doesn't hold it. */
+	unsigned long long shared_since;
+};
+
+static const size_t THREAD_LOCK_SITES = 8;
+
+static thread_local ThreadLockSite thread_sites[THREAD_LOCK_SITES];
+static thread_local size_t thread_sites_next = 0;
+
+static ThreadLockSite *thread_site(const void *mutex, bool create)
+{
+	for(size_t i = 0; i < THREAD_LOCK_SITES; ++i)
+	{
+		if(thread_sites[i].mutex == mutex)
+		{
+			return &(thread_sites[i]);
+		}
+	}
+	
+	if(!create)
+	{
+		return NULL;
+	}
+	
+	ThreadLockSite *ts = &(thread_sites[thread_sites_next]);
+	thread_sites_next = (thread_sites_next + 1) % THREAD_LOCK_SITES;
+	
+	ts->mutex        = mutex;
+	ts->site         = NULL;
+	ts->shared_since = 0;
+	
+	return ts;
+}
+
+static const char *thread_site_name(const void *mutex)
+{
+	ThreadLockSite *ts = thread_site(mutex, false);
+	return (ts != NULL ? ts->site : NULL);
+}
+
+static LONGLONG counter_freq()
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	
+	return freq.QuadPart;
+}
+
+/* Microseconds since an arbitrary point, never 0. */
+static unsigned long long now_us()
+{
+	static const LONGLONG freq = counter_freq();
+	
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+	
+	return ((unsigned long long)(count.QuadPart / freq) * 1000000)
+		+ (((unsigned long long)(count.QuadPart % freq) * 1000000) / freq)
+		+ 1;
+}
+
+static int latency_bucket(unsigned long long us)
+{
+	int bucket = 0;
+	
+	while(us > 0 && bucket < (LockProfile::LATENCY_BUCKETS - 1))
+	{
+		us >>= 1;
+		++bucket;
+	}
+	
+	return bucket;
+}
+
+static DWORD clamp_us(unsigned long long us)
+{
+	return (us < 0xFFFFFFFF ? (DWORD)(us) : 0xFFFFFFFF);
+}
+
+bool lock_profile_init()
+{
+	const char *e = getenv("DPLITE_LOCK_PROFILE");
+	
+	int expect = LOCK_PROFILE_UNINITIALISED;
+	lock_profile_state.compare_exchange_strong(expect, ((e != NULL && atoi(e) != 0) ? LOCK_PROFILE_ENABLED : LOCK_PROFILE_DISABLED));
+	
+	return lock_profile_state.load() == LOCK_PROFILE_ENABLED;
+}
+
+void lock_profile_set_enabled(bool enabled)
+{
+	lock_profile_state.store(enabled ? LOCK_PROFILE_ENABLED : LOCK_PROFILE_DISABLED);
+}
+
+LockProfile::LockProfile(const char *name):
+	name(name)
+{
+	sites.reserve(MAX_SITES);
+}
+
+LockProfile::Site *LockProfile::find_site(const char *site)
+{
+	if(site == NULL)
+	{
+		site = "(unknown)";
+	}
+	
+	for(auto s = sites.begin(); s != sites.end(); ++s)
+	{
+		if(s->name == site || strcmp(s->name, site) == 0)
+		{
+			return &(*s);
+		}
+	}
+	
+	if(sites.size() == MAX_SITES)
+	{
+		/* Full, the last slot was renamed when it was filled. */
+		return &(sites.back());
+	}
+	
+	Site s;
+	memset(&s, 0, sizeof(s));
+	
+	s.name = (sites.size() == (MAX_SITES - 1) ? "(other)" : site);
+	
+	sites.push_back(s);
+	return &(sites.back());
+}
+
+void LockProfile::record_wait(const char *site, bool contended, unsigned long long wait_us)
+{
+	std::unique_lock<std::mutex> l(stats_lock);
+	
+	Site *s = find_site(site);
+	
+	++(s->acquisitions);
+	
+	if(contended)
+	{
+		++(s->contended);
+	}
+	
+	s->total_wait_us += wait_us;
+	++(s->wait_histogram[latency_bucket(wait_us)]);
+	
+	if(clamp_us(wait_us) > s->max_wait_us)
+	{
+		s->max_wait_us = clamp_us(wait_us);
+	}
+}
+
+void LockProfile::record_hold(const char *site, unsigned long long hold_us)
+{
+	std::unique_lock<std::mutex> l(stats_lock);
+	
+	Site *s = find_site(site);
+	
+	s->total_hold_us += hold_us;
+	++(s->hold_histogram[latency_bucket(hold_us)]);
+	
+	if(clamp_us(hold_us) > s->max_hold_us)
+	{
+		s->max_hold_us = clamp_us(hold_us);
+	}
+}
+
+std::vector<LockProfile::Site> LockProfile::get_sites() const
+{
+	std::unique_lock<std::mutex> l(stats_lock);
+	return sites;
+}
+
+void LockProfile::reset()
+{
+	std::unique_lock<std::mutex> l(stats_lock);
+	sites.clear();
+}
+
+static std::string format_histogram(const DWORD (&histogram)[LockProfile::LATENCY_BUCKETS])
+{
+	std::string s;
+	
+	for(int i = 0; i < LockProfile::LATENCY_BUCKETS; ++i)
+	{
+		if(histogram[i] == 0)
+		{
+			continue;
+		}
+		
+		char buf[64];
+		
+		if(i < (LockProfile::LATENCY_BUCKETS - 1))
+		{
+			snprintf(buf, sizeof(buf), " <%lluus:%u", (1ULL << i), (unsigned)(histogram[i]));
+		}
+		else{
+			snprintf(buf, sizeof(buf), " >=%lluus:%u", (1ULL << (i - 1)), (unsigned)(histogram[i]));
+		}
+		
+		s += buf;
+	}
+	
+	return s;
+}
+
+void LockProfile::log_summary() const
+{
+	std::vector<Site> sites = get_sites();
+	
+	for(auto s = sites.begin(); s != sites.end(); ++s)
+	{
+		if(s->acquisitions == 0)
+		{
+			continue;
+		}
+		
+		log_printf("Lock %s from %s: %u acquisitions, %u contended, wait mean %u us max %u us, hold mean %u us max %u us",
+			name, s->name,
+			(unsigned)(s->acquisitions), (unsigned)(s->contended),
+			(unsigned)(s->total_wait_us / s->acquisitions), (unsigned)(s->max_wait_us),
+			(unsigned)(s->total_hold_us / s->acquisitions), (unsigned)(s->max_hold_us));
+		
+		log_printf("Lock %s from %s: wait%s", name, s->name, format_histogram(s->wait_histogram).c_str());
+		log_printf("Lock %s from %s: hold%s", name, s->name, format_histogram(s->hold_histogram).c_str());
+	}
+}
+
+ProfiledMutex::ProfiledMutex(const char *name):
+	profile(name), held_profiled(false), held_site(NULL), held_since(0) {}
+
+ProfiledMutex &ProfiledMutex::at(const char *site)
+{
+	if(lock_profile_active())
+	{
+		thread_site(this, true)->site = site;
+	}
+	
+	return *this;
+}
+
+void ProfiledMutex::lock_profiled()
+{
+	const char *site = thread_site_name(this);
+	
+	bool contended = !m.try_lock();
+	unsigned long long wait_us = 0;
+	
+	if(contended)
+	{
+		unsigned long long start = now_us();
+		m.lock();
+		wait_us = now_us() - start;
+	}
+	
+	profile.record_wait(site, contended, wait_us);
+	
+	held_profiled = true;
+	held_site     = site;
+	held_since    = now_us();
+}
+
+bool ProfiledMutex::try_lock()
+{
+	if(!m.try_lock())
+	{
+		return false;
+	}
+	
+	if(lock_profile_active())
+	{
+		held_site = thread_site_name(this);
+		profile.record_wait(held_site, false, 0);
+		
+		held_profiled = true;
+		held_since    = now_us();
+	}
+	
+	return true;
+}
+
+void ProfiledMutex::unlock_profiled()
+{
+	profile.record_hold(held_site, now_us() - held_since);
+	
+	held_profiled = false;
+	m.unlock();
+}
+
+LockProfile &ProfiledMutex::get_profile()
+{
+	return profile;
+}
+
+ProfiledSharedMutex::ProfiledSharedMutex(const char *name):
+	profile(name), held_profiled(false), held_site(NULL), held_since(0), shared_profiled(0) {}
+
+ProfiledSharedMutex &ProfiledSharedMutex::at(const char *site)
+{
+	if(lock_profile_active())
+	{
+		thread_site(this, true)->site = site;
+	}
+	
+	return *this;
+}
+
+void ProfiledSharedMutex::lock_profiled()
+{
+	const char *site = thread_site_name(this);
+	
+	bool contended = !m.try_lock();
+	unsigned long long wait_us = 0;
+	
+	if(contended)
+	{
+		unsigned long long start = now_us();
+		m.lock();
+		wait_us = now_us() - start;
+	}
+	
+	profile.record_wait(site, contended, wait_us);
+	
+	held_profiled = true;
+	held_site     = site;
+	held_since    = now_us();
+}
+
+void ProfiledSharedMutex::unlock_profiled()
+{
+	profile.record_hold(held_site, now_us() - held_since);
+	
+	held_profiled = false;
+	m.unlock();
+}
+
+void ProfiledSharedMutex::lock_shared_profiled()
+{
+	ThreadLockSite *ts = thread_site(this, true);
+	
+	bool contended = !m.try_lock_shared();
+	unsigned long long wait_us = 0;
+	
+	if(contended)
+	{
+		unsigned long long start = now_us();
+		m.lock_shared();
+		wait_us = now_us() - start;
+	}
+	
+	profile.record_wait(ts->site, contended, wait_us);
+	
+	ts->shared_since = now_us();
+	++shared_profiled;
+}
+
+void ProfiledSharedMutex::unlock_shared_profiled()
+{
+	ThreadLockSite *ts = thread_site(this, false);
+	
+	/* Another thread's shared lock may be the profiled one. */
+	if(ts != NULL && ts->shared_since != 0)
+	{
+		profile.record_hold(ts->site, now_us() - ts->shared_since);
+		
+		ts->shared_since = 0;
+		--shared_profiled;
+	}
+	
+	m.unlock_shared();
+}
+
+LockProfile &ProfiledSharedMutex::get_profile()
+{
+	return profile;
+}
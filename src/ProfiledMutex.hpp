@@ -0,0 +1,261 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_PROFILEDMUTEX_HPP
+#define DPLITE_PROFILEDMUTEX_HPP
+
+#include <winsock2.h>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <windows.h>
+
+/* Lock contention profiling.
+ *
+ * ProfiledMutex and ProfiledSharedMutex are drop-in replacements for std::mutex and
+ * std::shared_mutex which, while profiling is enabled, count how often the lock is taken
+ * and how long each acquisition waited for and held it, broken down by call site.
+ *
+ * The call site is named by locking through at(), for example:
+ *
+ *   std::unique_lock<ProfiledMutex> l(lock.at("SendTo"));
+ *
+ * The name sticks to the calling thread until the next at() on the same mutex, so the lock
+ * being released and retaken further down (around a callback, or by a condition variable)
+ * is counted against the function which took it in the first place. Names must be string
+ * literals (or otherwise outlive the mutex).
+ *
+ * Profiling is enabled by setting the DPLITE_LOCK_PROFILE environment variable to a
+ * non-zero value, or at runtime with lock_profile_set_enabled(). While disabled, taking and
+ * releasing a lock costs one extra relaxed atomic load each.
+*/
+
+enum {
+	LOCK_PROFILE_UNINITIALISED = 0,
+	LOCK_PROFILE_DISABLED,
+	LOCK_PROFILE_ENABLED,
+};
+
+extern std::atomic<int> lock_profile_state;
+
+/* Reads DPLITE_LOCK_PROFILE, returns true if profiling is enabled. */
+bool lock_profile_init();
+
+inline bool lock_profile_active()
+{
+	int s = lock_profile_state.load(std::memory_order_relaxed);
+	
+	if(s == LOCK_PROFILE_ENABLED)
+	{
+		return true;
+	}
+	else if(s == LOCK_PROFILE_UNINITIALISED)
+	{
+		return lock_profile_init();
+	}
+	else{
+		return false;
+	}
+}
+
+void lock_profile_set_enabled(bool enabled);
+
+/* Statistics for one lock, by call site. Thread safe. */
+class LockProfile
+{
+	public:
+		/* Histograms are bucketed by powers of two, like ConnectionStats. Bucket 0 counts
+		 * samples under 1us, bucket N counts samples of [2^(N-1), 2^N) us and the last
+		 * bucket counts anything longer.
+		*/
+		static const int LATENCY_BUCKETS = 24;
+		
+		/* Sites beyond this many are lumped together. */
+		static const size_t MAX_SITES = 32;
+		
+		struct Site
+		{
+			const char *name;
+			
+			DWORD acquisitions;
+			DWORD contended;     /* Acquisitions which had to wait. */
+			
+			unsigned long long total_wait_us;
+			unsigned long long total_hold_us;
+			DWORD max_wait_us;
+			DWORD max_hold_us;
+			
+			DWORD wait_histogram[LATENCY_BUCKETS];
+			DWORD hold_histogram[LATENCY_BUCKETS];
+		};
+		
+	private:
+		const char * const name;
+		
+		mutable std::mutex stats_lock;
+		std::vector<Site> sites;
+		
+		Site *find_site(const char *site);
+		
+	public:
+		LockProfile(const char *name);
+		
+		/* No copy c'tor. */
+		LockProfile(const LockProfile&) = delete;
+		
+		void record_wait(const char *site, bool contended, unsigned long long wait_us);
+		void record_hold(const char *site, unsigned long long hold_us);
+		
+		std::vector<Site> get_sites() const;
+		void reset();
+		
+		/* Writes the statistics for each site to the log, if the lock has been taken
+		 * while profiling.
+		*/
+		void log_summary() const;
+};
+
+class ProfiledMutex
+{
+	private:
+		std::mutex m;
+		LockProfile profile;
+		
+		/* Protected by m. */
+		bool held_profiled;
+		const char *held_site;
+		unsigned long long held_since;
+		
+		void lock_profiled();
+		void unlock_profiled();
+		
+	public:
+		ProfiledMutex(const char *name);
+		
+		/* No copy c'tor. */
+		ProfiledMutex(const ProfiledMutex&) = delete;
+		
+		/* Sets the call site for locks taken by this thread, returns *this. */
+		ProfiledMutex &at(const char *site);
+		
+		void lock()
+		{
+			if(lock_profile_active())
+			{
+				lock_profiled();
+			}
+			else{
+				m.lock();
+			}
+		}
+		
+		bool try_lock();
+		
+		void unlock()
+		{
+			if(held_profiled)
+			{
+				unlock_profiled();
+			}
+			else{
+				m.unlock();
+			}
+		}
+		
+		LockProfile &get_profile();
+};
+
+/* As ProfiledMutex, but also profiles shared acquisitions. Shared and exclusive
+ * acquisitions are counted together against their sites.
+*/
+class ProfiledSharedMutex
+{
+	private:
+		std::shared_mutex m;
+		LockProfile profile;
+		
+		/* Protected by m (held exclusively). */
+		bool held_profiled;
+		const char *held_site;
+		unsigned long long held_since;
+		
+		/* Shared acquisitions made while profiling which haven't been released yet. */
+		std::atomic<unsigned int> shared_profiled;
+		
+		void lock_profiled();
+		void unlock_profiled();
+		void lock_shared_profiled();
+		void unlock_shared_profiled();
+		
+	public:
+		ProfiledSharedMutex(const char *name);
+		
+		/* No copy c'tor. */
+		ProfiledSharedMutex(const ProfiledSharedMutex&) = delete;
+		
+		ProfiledSharedMutex &at(const char *site);
+		
+		void lock()
+		{
+			if(lock_profile_active())
+			{
+				lock_profiled();
+			}
+			else{
+				m.lock();
+			}
+		}
+		
+		void unlock()
+		{
+			if(held_profiled)
+			{
+				unlock_profiled();
+			}
+			else{
+				m.unlock();
+			}
+		}
+		
+		void lock_shared()
+		{
+			if(lock_profile_active())
+			{
+				lock_shared_profiled();
+			}
+			else{
+				m.lock_shared();
+			}
+		}
+		
+		void unlock_shared()
+		{
+			if(shared_profiled.load(std::memory_order_relaxed) > 0)
+			{
+				unlock_shared_profiled();
+			}
+			else{
+				m.unlock_shared();
+			}
+		}
+		
+		LockProfile &get_profile();
+};
+
+#endif /* !DPLITE_PROFILEDMUTEX_HPP */
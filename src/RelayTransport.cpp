@@ -0,0 +1,1091 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <iterator>
+#include <objbase.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <windows.h>
+#include <ws2tcpip.h>
+
+#include "Log.hpp"
+#include "Messages.hpp"
+#include "RelayTransport.hpp"
+
+/* Largest message the relay will pass on to us: a MAX_PACKET_SIZE packet plus the fields
+ * of the DPLITE_MSGID_RELAY_RECV wrapped around it.
+*/
+#define MAX_RELAY_MESSAGE_SIZE (MAX_PACKET_SIZE + 64)
+
+/* Bytes read from the relay connection per recv() call. */
+#define LINK_RECV_SIZE (64 * 1024)
+
+RelayTransport::VSocket::VSocket(DWORD player_id):
+	player_id(player_id),
+	event(NULL),
+	events(0),
+	connecting(false),
+	error(0),
+	opened(false),
+	recv_eof(false),
+	reset(false),
+	send_shut(false),
+	send_blocked(false) {}
+
+RelayTransport::RelayTransport(Transport *inner, uint32_t relay_ip, uint16_t relay_port):
+	inner(inner),
+	relay_ip(relay_ip),
+	relay_port(relay_port),
+	link_state(LS_IDLE),
+	link(-1),
+	instance(GUID_NULL),
+	player_id(0),
+	token(GUID_NULL),
+	leaving(false),
+	link_send_queued(0),
+	link_send_offset(0),
+	next_vsock(VSOCK_BASE),
+	listener(-1),
+	listener_event(NULL),
+	listener_events(0)
+{
+	link_thread = std::thread(&RelayTransport::link_main, this);
+}
+
+RelayTransport::~RelayTransport()
+{
+	SetEvent(stop_event);
+	link_thread.join();
+	
+	if(link != -1)
+	{
+		inner->close(link);
+	}
+}
+
+RelayTransport *RelayTransport::from_env(Transport *inner)
+{
+	const char *relay = getenv("DPLITE_RELAY");
+	if(relay == NULL || *relay == '\0')
+	{
+		return NULL;
+	}
+	
+	std::string ip = relay;
+	int port = 0;
+	
+	size_t colon = ip.rfind(':');
+	if(colon != std::string::npos)
+	{
+		port = atoi(ip.c_str() + colon + 1);
+		ip.erase(colon);
+	}
+	
+	struct in_addr relay_addr;
+	
+	if(port <= 0 || port > 65535 || inet_pton(AF_INET, ip.c_str(), &relay_addr) != 1)
+	{
+		log_printf(
+			"DPLITE_RELAY environment variable must be an IP address and port (\"1.2.3.4:5678\"), not using relay: %s",
+			relay);
+		return NULL;
+	}
+	
+	log_printf("Using relay at %s for unreachable peers", relay);
+	
+	return new RelayTransport(inner, relay_addr.s_addr, port);
+}
+
+void RelayTransport::signal(const VSocket &vs)
+{
+	if(vs.event != NULL && vs.events != 0)
+	{
+		SetEvent(vs.event);
+	}
+}
+
+RelayTransport::VSocket *RelayTransport::get_vsocket(int sock)
+{
+	auto vi = vsockets.find(sock);
+	return vi != vsockets.end() ? &(vi->second) : NULL;
+}
+
+void RelayTransport::link_main()
+{
+	HANDLE handles[] = { stop_event, link_event };
+	
+	while(WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		link_io();
+	}
+}
+
+void RelayTransport::link_io()
+{
+	if(link == -1)
+	{
+		return;
+	}
+	
+	if(link_state == LS_CONNECTING)
+	{
+		int error;
+		if(inner->get_socket_error(link, &error) != 0)
+		{
+			error = WSAGetLastError();
+		}
+		
+		if(error != 0)
+		{
+			log_printf("Unable to connect to relay: %s", win_strerror(error).c_str());
+			
+			link_drop(WSAENETUNREACH);
+			return;
+		}
+		
+		log_printf("Connected to relay, joining session as player %u", (unsigned)(player_id));
+		
+		PacketSerialiser join(DPLITE_MSGID_RELAY_JOIN);
+		join.append_guid(instance);
+		join.append_dword(player_id);
+		join.append_guid(token);
+		
+		/* Nothing has been written yet, so it can go ahead of any DPLITE_MSGID_RELAY_ADMIT
+		 * queued while we were connecting.
+		*/
+		link_queue(join);
+		std::rotate(link_send_queue.begin(), std::prev(link_send_queue.end()), link_send_queue.end());
+		
+		link_state = LS_JOINING;
+	}
+	
+	link_flush();
+	
+	while(link != -1)
+	{
+		size_t old_size = link_recv_buf.size();
+		link_recv_buf.resize(old_size + LINK_RECV_SIZE);
+		
+		int r = inner->recv(link, link_recv_buf.data() + old_size, LINK_RECV_SIZE);
+		DWORD err = WSAGetLastError();
+		
+		link_recv_buf.resize(old_size + (r > 0 ? r : 0));
+		
+		if(r < 0 && err == WSAEWOULDBLOCK)
+		{
+			break;
+		}
+		else if(r == 0)
+		{
+			log_printf("Relay closed the connection");
+			
+			link_drop(WSAECONNRESET);
+			return;
+		}
+		else if(r < 0)
+		{
+			log_printf("Read error from relay: %s", win_strerror(err).c_str());
+			
+			link_drop(WSAECONNRESET);
+			return;
+		}
+		
+		size_t off = 0;
+		
+		while(link != -1 && (link_recv_buf.size() - off) >= sizeof(TLVChunk))
+		{
+			TLVChunk header;
+			memcpy(&header, link_recv_buf.data() + off, sizeof(header));
+			
+			size_t full_packet_size = sizeof(TLVChunk) + header.value_length;
+			
+			if(full_packet_size > MAX_RELAY_MESSAGE_SIZE)
+			{
+				log_printf("Received over-size packet from relay, dropping connection");
+				
+				link_drop(WSAECONNRESET);
+				return;
+			}
+			
+			if((link_recv_buf.size() - off) < full_packet_size)
+			{
+				break;
+			}
+			
+			try {
+				PacketDeserialiser pd(link_recv_buf.data() + off, full_packet_size);
+				handle_packet(pd);
+			}
+			catch(const PacketDeserialiser::Error &e)
+			{
+				log_printf("Received malformed packet (%s) from relay, dropping connection", e.what());
+				
+				link_drop(WSAECONNRESET);
+				return;
+			}
+			
+			off += full_packet_size;
+		}
+		
+		if(link != -1)
+		{
+			link_recv_buf.erase(link_recv_buf.begin(), link_recv_buf.begin() + off);
+		}
+	}
+}
+
+/* Writes as much of link_send_queue to the relay as it will take, then wakes up anything
+ * which was blocked waiting for it to drain.
+*/
+void RelayTransport::link_flush()
+{
+	while(link != -1 && (link_state == LS_JOINING || link_state == LS_JOINED) && !link_send_queue.empty())
+	{
+		std::vector<unsigned char> &packet = link_send_queue.front();
+		
+		int s = inner->send(link, packet.data() + link_send_offset, packet.size() - link_send_offset);
+		if(s < 0)
+		{
+			DWORD err = WSAGetLastError();
+			
+			if(err == WSAEWOULDBLOCK)
+			{
+				break;
+			}
+			
+			log_printf("Write error to relay: %s", win_strerror(err).c_str());
+			
+			link_drop(WSAECONNRESET);
+			return;
+		}
+		
+		link_send_offset += s;
+		link_send_queued -= s;
+		
+		if(link_send_offset == packet.size())
+		{
+			link_send_queue.pop_front();
+			link_send_offset = 0;
+		}
+	}
+	
+	if(link_send_queued < SEND_LIMIT)
+	{
+		for(auto vi = vsockets.begin(); vi != vsockets.end(); ++vi)
+		{
+			VSocket &vs = vi->second;
+			
+			if(vs.send_blocked && !vs.connecting)
+			{
+				vs.send_blocked = false;
+				signal(vs);
+			}
+		}
+	}
+	
+	leave_if_done();
+}
+
+void RelayTransport::link_queue(const PacketSerialiser &packet)
+{
+	std::pair<const void*, size_t> raw = packet.raw_packet();
+	
+	link_send_queue.push_back(std::vector<unsigned char>(
+		(const unsigned char*)(raw.first),
+		(const unsigned char*)(raw.first) + raw.second));
+	
+	link_send_queued += raw.second;
+}
+
+void RelayTransport::link_close()
+{
+	if(link != -1)
+	{
+		inner->close(link);
+		link = -1;
+	}
+	
+	link_send_queue.clear();
+	link_send_queued = 0;
+	link_send_offset = 0;
+	
+	link_recv_buf.clear();
+	
+	members.clear();
+	draining.clear();
+}
+
+/* Closes the connection to the relay and fails every connection through it with error. */
+void RelayTransport::link_drop(int error)
+{
+	link_close();
+	link_state = LS_FAILED;
+	
+	player_vsocks.clear();
+	
+	for(auto vi = vsockets.begin(); vi != vsockets.end(); ++vi)
+	{
+		VSocket &vs = vi->second;
+		
+		if(vs.connecting)
+		{
+			vs.connecting = false;
+			vs.error      = error;
+		}
+		else{
+			vs.reset = true;
+		}
+		
+		signal(vs);
+	}
+	
+	leave_if_done();
+}
+
+/* Finishes session_left() once every virtual socket has been closed and anything they
+ * sent has gone to the relay.
+*/
+void RelayTransport::leave_if_done()
+{
+	if(leaving && vsockets.empty() && link_send_queue.empty())
+	{
+		link_close();
+		
+		link_state = LS_IDLE;
+		leaving    = false;
+	}
+}
+
+/* Completes a connect_player() once we know whether the player is joined to the relay. */
+void RelayTransport::connect_resolve(VSocket &vs)
+{
+	vs.connecting = false;
+	
+	if(members.find(vs.player_id) != members.end())
+	{
+		vs.error = 0;
+	}
+	else{
+		log_printf("Player %u isn't joined to the relay", (unsigned)(vs.player_id));
+		
+		vs.error = WSAECONNREFUSED;
+		player_vsocks.erase(vs.player_id);
+	}
+	
+	signal(vs);
+}
+
+void RelayTransport::handle_packet(const PacketDeserialiser &pd)
+{
+	switch(pd.packet_type())
+	{
+		case DPLITE_MSGID_RELAY_JOIN_OK:
+		{
+			if(link_state != LS_JOINING)
+			{
+				log_printf("Received unexpected DPLITE_MSGID_RELAY_JOIN_OK from relay");
+				break;
+			}
+			
+			DWORD n_players = pd.get_dword(0);
+			
+			for(DWORD i = 0; i < n_players; ++i)
+			{
+				members.insert(pd.get_dword(1 + i));
+			}
+			
+			log_printf("Joined relay session with %u other players", (unsigned)(n_players));
+			
+			link_state = LS_JOINED;
+			
+			for(auto vi = vsockets.begin(); vi != vsockets.end(); ++vi)
+			{
+				if(vi->second.connecting)
+				{
+					connect_resolve(vi->second);
+				}
+			}
+			
+			break;
+		}
+		
+		case DPLITE_MSGID_RELAY_JOIN_FAIL:
+		{
+			log_printf("Relay refused to join session (error 0x%08x)", (unsigned)(pd.get_dword(0)));
+			
+			link_drop(WSAECONNREFUSED);
+			break;
+		}
+		
+		case DPLITE_MSGID_RELAY_RECV:
+		{
+			std::pair<const void*, size_t> data = pd.get_data(1);
+			handle_relay_recv(pd.get_dword(0), data.first, data.second);
+			
+			break;
+		}
+		
+		case DPLITE_MSGID_RELAY_PEER_JOINED:
+		{
+			members.insert(pd.get_dword(0));
+			break;
+		}
+		
+		case DPLITE_MSGID_RELAY_PEER_LEFT:
+		{
+			player_left(pd.get_dword(0));
+			break;
+		}
+		
+		default:
+		{
+			log_printf("Unexpected message type %u received from relay", (unsigned)(pd.packet_type()));
+			break;
+		}
+	}
+}
+
+void RelayTransport::handle_relay_recv(DWORD from, const void *data, size_t size)
+{
+	auto pv = player_vsocks.find(from);
+	if(pv == player_vsocks.end())
+	{
+		if(draining.find(from) != draining.end())
+		{
+			/* Still arriving from a connection we have closed. */
+			
+			if(size == 0)
+			{
+				draining.erase(from);
+			}
+			
+			return;
+		}
+		
+		if(size == 0 || leaving || listener == -1)
+		{
+			return;
+		}
+		
+		/* First data from a player we have no connection with, it is connecting to us. */
+		
+		int sock = next_vsock++;
+		
+		VSocket &vs = vsockets.insert(std::make_pair(sock, VSocket(from))).first->second;
+		vs.opened = true;
+		
+		pv = player_vsocks.insert(std::make_pair(from, sock)).first;
+		
+		accept_queue.push_back(sock);
+		
+		if(listener_event != NULL && (listener_events & FD_ACCEPT))
+		{
+			SetEvent(listener_event);
+		}
+		
+		log_printf("Accepted relayed connection from player %u", (unsigned)(from));
+	}
+	
+	VSocket &vs = vsockets.find(pv->second)->second;
+	
+	if(vs.connecting || vs.recv_eof || vs.reset)
+	{
+		return;
+	}
+	
+	if(size == 0)
+	{
+		vs.recv_eof = true;
+	}
+	else{
+		vs.recv_buf.insert(vs.recv_buf.end(), (const unsigned char*)(data), (const unsigned char*)(data) + size);
+		vs.opened = true;
+	}
+	
+	signal(vs);
+}
+
+void RelayTransport::player_left(DWORD player_id)
+{
+	members.erase(player_id);
+	draining.erase(player_id);
+	
+	auto pv = player_vsocks.find(player_id);
+	if(pv == player_vsocks.end())
+	{
+		return;
+	}
+	
+	VSocket &vs = vsockets.find(pv->second)->second;
+	player_vsocks.erase(pv);
+	
+	if(!vs.connecting)
+	{
+		vs.reset = true;
+		signal(vs);
+	}
+}
+
+void RelayTransport::send_chunk(DWORD player_id, const void *data, size_t size)
+{
+	PacketSerialiser relay_send(DPLITE_MSGID_RELAY_SEND);
+	relay_send.append_dword(player_id);
+	relay_send.append_data(data, size);
+	
+	link_queue(relay_send);
+}
+
+/* Whether data can be written to vs straight away. */
+bool RelayTransport::multi_vsocket(const VSocket *vs) const
+{
+	return vs != NULL
+		&& link_state == LS_JOINED
+		&& !vs->connecting
+		&& vs->error == 0
+		&& !vs->reset
+		&& !vs->send_shut;
+}
+
+int RelayTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	return inner->create_udp_socket(ipaddr, port, options);
+}
+
+int RelayTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	int sock = inner->create_listener_socket(ipaddr, port, options);
+	if(sock != -1)
+	{
+		listener        = sock;
+		listener_event  = NULL;
+		listener_events = 0;
+	}
+	
+	return sock;
+}
+
+bool RelayTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(!inner->create_auto_port_sockets(ipaddr, udp_sock, listener_sock, port, options))
+	{
+		return false;
+	}
+	
+	listener        = *listener_sock;
+	listener_event  = NULL;
+	listener_events = 0;
+	
+	return true;
+}
+
+int RelayTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	return inner->create_client_socket(local_ipaddr, local_port, options);
+}
+
+int RelayTransport::create_discovery_socket()
+{
+	return inner->create_discovery_socket();
+}
+
+void RelayTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(get_vsocket(sock) == NULL)
+	{
+		inner->apply_socket_options(sock, stream, options);
+	}
+}
+
+bool RelayTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(get_vsocket(sock) != NULL)
+	{
+		return true;
+	}
+	
+	return inner->setup_accepted_socket(sock, options);
+}
+
+int RelayTransport::event_select(int sock, HANDLE event, long events)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs != NULL)
+	{
+		vs->event  = event;
+		vs->events = events;
+		
+		/* We don't keep track of which events are due like Winsock does, so just wake the
+		 * owner up to look, unless a connect is still pending and it would take the
+		 * wakeup as the result.
+		*/
+		if(!vs->connecting)
+		{
+			signal(*vs);
+		}
+		
+		return 0;
+	}
+	
+	if(sock == listener)
+	{
+		listener_event  = event;
+		listener_events = events;
+		
+		if(!accept_queue.empty() && (events & FD_ACCEPT))
+		{
+			SetEvent(event);
+		}
+	}
+	
+	return inner->event_select(sock, event, events);
+}
+
+int RelayTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(sock == listener && !accept_queue.empty())
+	{
+		int newfd = accept_queue.front();
+		accept_queue.pop_front();
+		
+		/* Relayed connections have no address of their own. */
+		memset(addr, 0, sizeof(*addr));
+		addr->sin_family      = AF_INET;
+		addr->sin_addr.s_addr = relay_ip;
+		addr->sin_port        = htons(relay_port);
+		
+		if(!accept_queue.empty() && listener_event != NULL)
+		{
+			SetEvent(listener_event);
+		}
+		
+		return newfd;
+	}
+	
+	return inner->accept(sock, addr);
+}
+
+int RelayTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(get_vsocket(sock) != NULL)
+	{
+		WSASetLastError(WSAEISCONN);
+		return -1;
+	}
+	
+	return inner->connect(sock, addr);
+}
+
+int RelayTransport::get_socket_error(int sock, int *error)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs != NULL)
+	{
+		*error = vs->error;
+		return 0;
+	}
+	
+	return inner->get_socket_error(sock, error);
+}
+
+int RelayTransport::send(int sock, const void *data, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs == NULL)
+	{
+		return inner->send(sock, data, size);
+	}
+	
+	if(vs->error != 0)
+	{
+		WSASetLastError(vs->error);
+		return -1;
+	}
+	
+	if(vs->reset)
+	{
+		WSASetLastError(WSAECONNRESET);
+		return -1;
+	}
+	
+	if(vs->send_shut)
+	{
+		WSASetLastError(WSAESHUTDOWN);
+		return -1;
+	}
+	
+	if(vs->connecting || link_send_queued >= SEND_LIMIT)
+	{
+		vs->send_blocked = true;
+		
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	if(size == 0)
+	{
+		/* Would look like the end of the stream. */
+		return 0;
+	}
+	
+	if(size > MAX_CHUNK)
+	{
+		size = MAX_CHUNK;
+	}
+	
+	send_chunk(vs->player_id, data, size);
+	vs->opened = true;
+	
+	link_flush();
+	
+	return size;
+}
+
+int RelayTransport::recv(int sock, void *buf, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs == NULL)
+	{
+		return inner->recv(sock, buf, size);
+	}
+	
+	if(!vs->recv_buf.empty())
+	{
+		size = std::min(size, vs->recv_buf.size());
+		
+		std::copy(vs->recv_buf.begin(), vs->recv_buf.begin() + size, (unsigned char*)(buf));
+		vs->recv_buf.erase(vs->recv_buf.begin(), vs->recv_buf.begin() + size);
+		
+		if(!vs->recv_buf.empty() || vs->recv_eof)
+		{
+			signal(*vs);
+		}
+		
+		return size;
+	}
+	
+	if(vs->error != 0)
+	{
+		WSASetLastError(vs->error);
+		return -1;
+	}
+	
+	if(vs->reset)
+	{
+		WSASetLastError(WSAECONNRESET);
+		return -1;
+	}
+	
+	if(vs->recv_eof)
+	{
+		return 0;
+	}
+	
+	WSASetLastError(WSAEWOULDBLOCK);
+	return -1;
+}
+
+int RelayTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	return inner->sendto(sock, data, size, addr, addrlen);
+}
+
+int RelayTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	return inner->recvfrom(sock, buf, size, from_addr);
+}
+
+int RelayTransport::shutdown_send(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs == NULL)
+	{
+		return inner->shutdown_send(sock);
+	}
+	
+	if(!vs->send_shut && vs->opened && !vs->reset && link_state == LS_JOINED)
+	{
+		send_chunk(vs->player_id, NULL, 0);
+		link_flush();
+	}
+	
+	vs->send_shut = true;
+	
+	return 0;
+}
+
+void RelayTransport::close(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	VSocket *vs = get_vsocket(sock);
+	if(vs == NULL)
+	{
+		if(sock == listener)
+		{
+			listener        = -1;
+			listener_event  = NULL;
+			listener_events = 0;
+			
+			while(!accept_queue.empty())
+			{
+				vsock_close(accept_queue.front());
+			}
+		}
+		
+		inner->close(sock);
+		return;
+	}
+	
+	vsock_close(sock);
+}
+
+void RelayTransport::vsock_close(int sock)
+{
+	auto vi = vsockets.find(sock);
+	VSocket &vs = vi->second;
+	
+	/* The other end only knows about the connection once something has gone over it. */
+	if(vs.opened && !vs.reset && link_state == LS_JOINED)
+	{
+		if(!vs.send_shut)
+		{
+			send_chunk(vs.player_id, NULL, 0);
+		}
+		
+		if(!vs.recv_eof)
+		{
+			draining.insert(vs.player_id);
+		}
+	}
+	
+	auto pv = player_vsocks.find(vs.player_id);
+	if(pv != player_vsocks.end() && pv->second == sock)
+	{
+		player_vsocks.erase(pv);
+	}
+	
+	accept_queue.erase(std::remove(accept_queue.begin(), accept_queue.end(), sock), accept_queue.end());
+	vsockets.erase(vi);
+	
+	link_flush();
+}
+
+bool RelayTransport::get_host_instance(GUID *instance)
+{
+	return inner->get_host_instance(instance);
+}
+
+void RelayTransport::session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(link_state != LS_IDLE)
+	{
+		/* Anything left over from an earlier session can't carry on without it. */
+		link_drop(WSAECONNRESET);
+	}
+	
+	this->instance  = instance;
+	this->player_id = player_id;
+	this->token     = relay_token;
+	
+	leaving = false;
+	
+	SocketOptions options;
+	options.nodelay = true;
+	
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = relay_ip;
+	addr.sin_port        = htons(relay_port);
+	
+	link = inner->create_client_socket(htonl(INADDR_ANY), 0, options);
+	
+	if(link == -1
+		|| inner->event_select(link, link_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE) != 0
+		|| inner->connect(link, &addr) != -1 || WSAGetLastError() != WSAEWOULDBLOCK)
+	{
+		log_printf("Unable to connect to relay: %s", win_strerror(WSAGetLastError()).c_str());
+		
+		link_drop(WSAENETUNREACH);
+		return;
+	}
+	
+	link_state = LS_CONNECTING;
+}
+
+void RelayTransport::admit_player(DWORD player_id, GUID *relay_token)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(link_state == LS_IDLE || link_state == LS_FAILED || leaving
+		|| CoCreateGuid(relay_token) != S_OK)
+	{
+		*relay_token = GUID_NULL;
+		return;
+	}
+	
+	PacketSerialiser admit(DPLITE_MSGID_RELAY_ADMIT);
+	admit.append_dword(player_id);
+	admit.append_guid(*relay_token);
+	
+	link_queue(admit);
+	link_flush();
+}
+
+void RelayTransport::session_left()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(link_state != LS_IDLE)
+	{
+		leaving = true;
+		leave_if_done();
+	}
+}
+
+int RelayTransport::connect_player(DWORD player_id, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(link_state == LS_IDLE || leaving)
+	{
+		WSASetLastError(WSAEOPNOTSUPP);
+		return -1;
+	}
+	
+	if(link_state == LS_FAILED)
+	{
+		WSASetLastError(WSAENETUNREACH);
+		return -1;
+	}
+	
+	if(player_vsocks.find(player_id) != player_vsocks.end())
+	{
+		WSASetLastError(WSAEISCONN);
+		return -1;
+	}
+	
+	int sock = next_vsock++;
+	
+	VSocket &vs = vsockets.insert(std::make_pair(sock, VSocket(player_id))).first->second;
+	player_vsocks.insert(std::make_pair(player_id, sock));
+	
+	log_printf("Connecting to player %u via relay", (unsigned)(player_id));
+	
+	if(link_state == LS_JOINED)
+	{
+		connect_resolve(vs);
+	}
+	else{
+		vs.connecting = true;
+	}
+	
+	return sock;
+}
+
+bool RelayTransport::can_send_multi(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	return multi_vsocket(get_vsocket(sock));
+}
+
+bool RelayTransport::send_multi(const int *socks, size_t n_socks, const void *data, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(size == 0 || (size + (n_socks * (sizeof(TLVChunk) + sizeof(DWORD)))) > MAX_PACKET_SIZE)
+	{
+		/* Empty would look like the end of the stream, and the relay won't take anything
+		 * much bigger than a whole packet, including the list of players.
+		*/
+		WSASetLastError(WSAEMSGSIZE);
+		return false;
+	}
+	
+	if(link_send_queued >= SEND_LIMIT)
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return false;
+	}
+	
+	std::set<DWORD> players;
+	
+	for(size_t i = 0; i < n_socks; ++i)
+	{
+		VSocket *vs = get_vsocket(socks[i]);
+		
+		if(!multi_vsocket(vs) || !players.insert(vs->player_id).second)
+		{
+			WSASetLastError(WSAENOTCONN);
+			return false;
+		}
+	}
+	
+	/* Always list the players rather than sending to everybody, since the relay may
+	 * know of players which have joined it since we last heard.
+	*/
+	
+	PacketSerialiser relay_send(DPLITE_MSGID_RELAY_SEND);
+	relay_send.append_dword(0);
+	relay_send.append_data(data, size);
+	
+	for(auto p = players.begin(); p != players.end(); ++p)
+	{
+		relay_send.append_dword(*p);
+	}
+	
+	link_queue(relay_send);
+	
+	for(size_t i = 0; i < n_socks; ++i)
+	{
+		get_vsocket(socks[i])->opened = true;
+	}
+	
+	link_flush();
+	
+	return true;
+}
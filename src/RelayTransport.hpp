@@ -0,0 +1,215 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_RELAYTRANSPORT_HPP
+#define DPLITE_RELAYTRANSPORT_HPP
+
+#include <winsock2.h>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "EventObject.hpp"
+#include "packet.hpp"
+#include "Transport.hpp"
+
+/* A Transport which passes everything through to another one, but can also carry
+ * connections to other players in the session over a relay server (see relay/) for when
+ * they can't be reached directly.
+ *
+ * Once told about the session with session_joined(), a single TCP connection is made to
+ * the relay and joined to the session using our player ID and the token the host got for
+ * us from its own admit_player(). connect_player() then returns a virtual socket which
+ * behaves like a TCP connection to the player, and the first data relayed to us from a
+ * player we have no connection with is presented as a new connection on the listener
+ * socket.
+ *
+ * Stream data is forwarded in DPLITE_MSGID_RELAY_SEND messages of up to MAX_CHUNK bytes,
+ * an empty one marks the end of the stream as shutdown_send() would. A connection is reset
+ * if the player leaves the relay or our own connection to it is lost.
+ *
+ * send_multi() uploads a message going to several relayed players in a single
+ * DPLITE_MSGID_RELAY_SEND, which the relay copies into each of their streams.
+ *
+ * Virtual sockets are numbered from VSOCK_BASE upwards so they can't be mistaken for
+ * sockets from the wrapped transport. The connection to the relay is serviced by a thread
+ * of its own, since the owner only waits on the events of its own sockets.
+ *
+ * Thread safe.
+*/
+
+class RelayTransport: public Transport
+{
+	private:
+		static const int VSOCK_BASE = 0x40000000;
+		
+		/* Largest chunk of stream data sent in one DPLITE_MSGID_RELAY_SEND. */
+		static const size_t MAX_CHUNK = 64 * 1024;
+		
+		/* send() fails with WSAEWOULDBLOCK while this many bytes are waiting to be written
+		 * to the relay.
+		*/
+		static const size_t SEND_LIMIT = 256 * 1024;
+		
+		enum LinkState {
+			LS_IDLE,        /* Not in a session. */
+			LS_CONNECTING,  /* Waiting for the TCP connection to the relay. */
+			LS_JOINING,     /* Waiting for DPLITE_MSGID_RELAY_JOIN_OK. */
+			LS_JOINED,
+			LS_FAILED,      /* Connection to the relay lost or refused. */
+		};
+		
+		struct VSocket
+		{
+			DWORD player_id;
+			
+			HANDLE event;
+			long events;
+			
+			bool connecting;    /* connect_player() waiting for the relay. */
+			int error;          /* SO_ERROR once connecting is cleared. */
+			
+			bool opened;        /* Data has gone over the connection, so the player knows of it. */
+			
+			std::deque<unsigned char> recv_buf;
+			bool recv_eof;      /* Player has shut down its end. */
+			bool reset;         /* Player left the relay, or we did. */
+			
+			bool send_shut;     /* shutdown_send() or close() has been called. */
+			bool send_blocked;  /* send() has failed with WSAEWOULDBLOCK. */
+			
+			VSocket(DWORD player_id);
+		};
+		
+		Transport * const inner;
+		const uint32_t relay_ip;    /* Network byte order. */
+		const uint16_t relay_port;  /* Host byte order. */
+		
+		std::mutex lock;
+		
+		LinkState link_state;
+		int link;
+		EventObject link_event;
+		
+		GUID instance;
+		DWORD player_id;
+		GUID token;  /* Passed to session_joined(), GUID_NULL when hosting. */
+		
+		/* session_left() has been called, the link is closed once the last virtual socket
+		 * is.
+		*/
+		bool leaving;
+		
+		/* Other players joined to the relay. */
+		std::set<DWORD> members;
+		
+		std::deque< std::vector<unsigned char> > link_send_queue;
+		size_t link_send_queued;  /* Bytes in link_send_queue. */
+		size_t link_send_offset;  /* Bytes of link_send_queue.front() already sent. */
+		
+		std::vector<unsigned char> link_recv_buf;
+		
+		int next_vsock;
+		std::map<int, VSocket> vsockets;
+		std::map<DWORD, int> player_vsocks;
+		
+		/* Players whose connection we closed before they shut down their end, anything
+		 * more from them is discarded until their end of stream arrives.
+		*/
+		std::set<DWORD> draining;
+		
+		/* Accepted connections waiting to be returned by accept() on the listener. */
+		int listener;
+		HANDLE listener_event;
+		long listener_events;
+		std::deque<int> accept_queue;
+		
+		EventObject stop_event;
+		std::thread link_thread;
+		
+		static void signal(const VSocket &vs);
+		
+		VSocket *get_vsocket(int sock);
+		
+		void link_main();
+		void link_io();
+		void link_flush();
+		void link_queue(const PacketSerialiser &packet);
+		void link_close();
+		void link_drop(int error);
+		void leave_if_done();
+		
+		void connect_resolve(VSocket &vs);
+		void vsock_close(int sock);
+		
+		void handle_packet(const PacketDeserialiser &pd);
+		void handle_relay_recv(DWORD from, const void *data, size_t size);
+		void player_left(DWORD player_id);
+		
+		void send_chunk(DWORD player_id, const void *data, size_t size);
+		bool multi_vsocket(const VSocket *vs) const;
+		
+	public:
+		/* relay_ip is in network byte order, relay_port in host byte order. */
+		RelayTransport(Transport *inner, uint32_t relay_ip, uint16_t relay_port);
+		virtual ~RelayTransport();
+		
+		/* No copy c'tor. */
+		RelayTransport(const RelayTransport &src) = delete;
+		
+		/* Returns a new RelayTransport wrapping inner if the DPLITE_RELAY environment
+		 * variable is set to the "host:port" of a relay, otherwise NULL.
+		*/
+		static RelayTransport *from_env(Transport *inner);
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+		
+		virtual bool get_host_instance(GUID *instance) override;
+		virtual void session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token) override;
+		virtual void admit_player(DWORD player_id, GUID *relay_token) override;
+		virtual void session_left() override;
+		virtual int connect_player(DWORD player_id, const SocketOptions &options) override;
+		
+		virtual bool can_send_multi(int sock) override;
+		virtual bool send_multi(const int *socks, size_t n_socks, const void *data, size_t size) override;
+};
+
+#endif /* !DPLITE_RELAYTRANSPORT_HPP */
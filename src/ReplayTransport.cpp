@@ -0,0 +1,686 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#include "ReplayTransport.hpp"
+
+ReplayTransport::Socket::Socket():
+	opened(false),
+	closed(false),
+	event(NULL),
+	events(0),
+	write_pending(false),
+	connect_error(0),
+	connect_done(false),
+	connect_signalled(false),
+	recv_off(0),
+	end_read(false) {}
+
+ReplayTransport::ReplayTransport(const std::string &path):
+	have_session(false),
+	outstanding(0),
+	next_unrecorded_sock(FIRST_UNRECORDED_SOCK),
+	n_inbound(0),
+	inbound_bytes(0)
+{
+	load(path);
+	
+	for(auto r = records.begin(); r != records.end(); ++r)
+	{
+		if(r->sock == 0)
+		{
+			/* Belongs to a socket we never saw created. */
+			continue;
+		}
+		
+		switch(r->header.type)
+		{
+			case CR_RECV:
+			case CR_RECVFROM:
+				inbound_bytes += r->data.size();
+				/* Fall through */
+				
+			case CR_ACCEPT:
+			case CR_CONNECT_RESULT:
+			case CR_RECV_EOF:
+			case CR_RECV_ERROR:
+				unreleased.push_back(&(*r));
+				++n_inbound;
+				break;
+				
+			case CR_UDP_SOCKET:
+			case CR_LISTENER_SOCKET:
+			case CR_CLIENT_SOCKET:
+			case CR_DISCOVERY_SOCKET:
+				creations[r->header.type].push_back(&(*r));
+				break;
+				
+			default:
+				break;
+		}
+	}
+}
+
+ReplayTransport::~ReplayTransport() {}
+
+void ReplayTransport::load(const std::string &path)
+{
+	FILE *fh = fopen(path.c_str(), "rb");
+	if(fh == NULL)
+	{
+		throw std::runtime_error("Unable to open capture file");
+	}
+	
+	CaptureFileHeader header;
+	
+	if(fread(&header, sizeof(header), 1, fh) != 1
+		|| memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fclose(fh);
+		throw std::runtime_error("Not a capture file");
+	}
+	
+	if(header.version != CAPTURE_VERSION)
+	{
+		fclose(fh);
+		throw std::runtime_error("Unsupported capture file version");
+	}
+	
+	/* Socket numbers from the capture to our unique ones, for the sockets open at the
+	 * current point in the capture.
+	*/
+	std::map<uint32_t, int> live;
+	int next_sock = 1;
+	
+	unsigned long long session_time = 0;
+	
+	CaptureRecord h;
+	
+	while(fread(&h, sizeof(h), 1, fh) == 1)
+	{
+		Record r;
+		r.header   = h;
+		r.sock     = 0;
+		r.accepted = 0;
+		
+		r.data.resize(h.length);
+		
+		if(h.length > 0 && fread(r.data.data(), h.length, 1, fh) != 1)
+		{
+			/* Truncated, the process probably died while capturing. */
+			break;
+		}
+		
+		if(h.type == CR_SESSION)
+		{
+			if(have_session)
+			{
+				/* Start of the next session. */
+				break;
+			}
+			
+			try {
+				PacketDeserialiser pd(r.data.data(), r.data.size());
+				
+				session.host         = (pd.packet_type() == CAPTURE_SESSION_HOST);
+				session.role         = pd.get_dword(0);
+				session.application  = pd.get_guid(1);
+				session.instance     = pd.get_guid(2);
+				session.flags        = pd.get_dword(3);
+				session.max_players  = pd.get_dword(4);
+				session.session_name = pd.get_wstring(5);
+				session.password     = pd.get_wstring(6);
+				session.port         = pd.get_dword(7);
+				
+				std::pair<const void*, size_t> connect_data = pd.get_data(8);
+				session.connect_data.assign(
+					(const unsigned char*)(connect_data.first),
+					(const unsigned char*)(connect_data.first) + connect_data.second);
+			}
+			catch(const PacketDeserialiser::Error &e)
+			{
+				fclose(fh);
+				throw std::runtime_error("Malformed session record in capture file");
+			}
+			
+			have_session = true;
+			session_time = h.time;
+			
+			continue;
+		}
+		
+		if(!have_session)
+		{
+			continue;
+		}
+		
+		r.time = (h.time > session_time ? h.time - session_time : 0);
+		
+		switch(h.type)
+		{
+			case CR_UDP_SOCKET:
+			case CR_LISTENER_SOCKET:
+			case CR_CLIENT_SOCKET:
+			case CR_DISCOVERY_SOCKET:
+				r.sock = next_sock++;
+				live[h.sock] = r.sock;
+				break;
+				
+			case CR_ACCEPT:
+			{
+				uint32_t listener = 0;
+				if(r.data.size() >= sizeof(listener))
+				{
+					memcpy(&listener, r.data.data(), sizeof(listener));
+				}
+				
+				auto l = live.find(listener);
+				r.sock     = (l != live.end() ? l->second : 0);
+				r.accepted = next_sock++;
+				
+				live[h.sock] = r.accepted;
+				
+				break;
+			}
+			
+			default:
+			{
+				auto l = live.find(h.sock);
+				r.sock = (l != live.end() ? l->second : 0);
+				
+				if(h.type == CR_CLOSE)
+				{
+					live.erase(h.sock);
+				}
+				
+				break;
+			}
+		}
+		
+		records.push_back(r);
+	}
+	
+	fclose(fh);
+}
+
+bool ReplayTransport::get_session(Session *session)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(have_session)
+	{
+		*session = this->session;
+	}
+	
+	return have_session;
+}
+
+size_t ReplayTransport::inbound_records()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return n_inbound;
+}
+
+unsigned long long ReplayTransport::total_inbound_bytes()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return inbound_bytes;
+}
+
+bool ReplayTransport::next_release(unsigned long long *time)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(unreleased.empty())
+	{
+		return false;
+	}
+	
+	*time = unreleased.front()->time;
+	return true;
+}
+
+void ReplayTransport::release(unsigned long long until)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	while(!unreleased.empty() && unreleased.front()->time <= until)
+	{
+		release_record(unreleased.front());
+		unreleased.pop_front();
+	}
+}
+
+void ReplayTransport::release_all()
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	while(!unreleased.empty())
+	{
+		release_record(unreleased.front());
+		unreleased.pop_front();
+	}
+}
+
+size_t ReplayTransport::unread()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return outstanding;
+}
+
+bool ReplayTransport::finished()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return unreleased.empty() && outstanding == 0;
+}
+
+int ReplayTransport::create_socket(CaptureRecordType type)
+{
+	std::list<const Record*> &c = creations[type];
+	int sock;
+	
+	if(!c.empty())
+	{
+		sock = c.front()->sock;
+		c.pop_front();
+	}
+	else{
+		sock = next_unrecorded_sock++;
+	}
+	
+	Socket &s = sockets[sock];
+	s.opened = true;
+	
+	/* Outgoing connections become writable once they are established, which may have
+	 * been released already.
+	*/
+	if(type != CR_CLIENT_SOCKET)
+	{
+		s.write_pending = true;
+	}
+	
+	return sock;
+}
+
+ReplayTransport::Socket *ReplayTransport::get_socket(int sock)
+{
+	auto s = sockets.find(sock);
+	if(s == sockets.end() || !s->second.opened || s->second.closed)
+	{
+		WSASetLastError(WSAENOTSOCK);
+		return NULL;
+	}
+	
+	return &(s->second);
+}
+
+void ReplayTransport::release_record(const Record *record)
+{
+	Socket &s = sockets[record->sock];
+	
+	if(s.closed)
+	{
+		return;
+	}
+	
+	if(record->header.type == CR_CONNECT_RESULT)
+	{
+		uint32_t error = 0;
+		if(record->data.size() >= sizeof(error))
+		{
+			memcpy(&error, record->data.data(), sizeof(error));
+		}
+		
+		s.connect_error = error;
+		s.connect_done  = true;
+		s.write_pending = (error == 0);
+	}
+	else{
+		s.inbound.push_back(record);
+		++outstanding;
+	}
+	
+	update_events(s);
+}
+
+void ReplayTransport::consumed(Socket &s)
+{
+	--outstanding;
+	update_events(s);
+}
+
+void ReplayTransport::update_events(Socket &s)
+{
+	if(!s.opened || s.closed || s.event == NULL)
+	{
+		return;
+	}
+	
+	bool signal = false;
+	
+	if(s.write_pending && (s.events & FD_WRITE))
+	{
+		signal = true;
+		s.write_pending = false;
+	}
+	
+	if(s.connect_done && !s.connect_signalled && (s.events & FD_CONNECT))
+	{
+		signal = true;
+		s.connect_signalled = true;
+	}
+	
+	if(!s.inbound.empty())
+	{
+		switch(s.inbound.front()->header.type)
+		{
+			case CR_ACCEPT:
+				signal = signal || (s.events & FD_ACCEPT);
+				break;
+				
+			case CR_RECV:
+			case CR_RECVFROM:
+				signal = signal || (s.events & FD_READ);
+				break;
+				
+			case CR_RECV_EOF:
+			case CR_RECV_ERROR:
+				signal = signal || (s.events & (FD_READ | FD_CLOSE));
+				break;
+		}
+	}
+	
+	if(signal)
+	{
+		SetEvent(s.event);
+	}
+}
+
+int ReplayTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return create_socket(CR_UDP_SOCKET);
+}
+
+int ReplayTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return create_socket(CR_LISTENER_SOCKET);
+}
+
+bool ReplayTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	std::list<const Record*> &c = creations[CR_LISTENER_SOCKET];
+	*port = (!c.empty() ? c.front()->header.port : session.port);
+	
+	*udp_sock      = create_socket(CR_UDP_SOCKET);
+	*listener_sock = create_socket(CR_LISTENER_SOCKET);
+	
+	return true;
+}
+
+int ReplayTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return create_socket(CR_CLIENT_SOCKET);
+}
+
+int ReplayTransport::create_discovery_socket()
+{
+	std::unique_lock<std::mutex> l(lock);
+	return create_socket(CR_DISCOVERY_SOCKET);
+}
+
+void ReplayTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options) {}
+
+bool ReplayTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	return true;
+}
+
+int ReplayTransport::event_select(int sock, HANDLE event, long events)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	s->event  = (events != 0 ? event : NULL);
+	s->events = events;
+	
+	update_events(*s);
+	
+	return 0;
+}
+
+int ReplayTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->inbound.empty() || s->inbound.front()->header.type != CR_ACCEPT)
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	const Record *record = s->inbound.front();
+	s->inbound.pop_front();
+	
+	Socket &newfd = sockets[record->accepted];
+	newfd.opened        = true;
+	newfd.write_pending = true;
+	
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family      = AF_INET;
+	addr->sin_addr.s_addr = record->header.ip;
+	addr->sin_port        = htons(record->header.port);
+	
+	consumed(*s);
+	
+	return record->accepted;
+}
+
+int ReplayTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(get_socket(sock) == NULL)
+	{
+		return -1;
+	}
+	
+	WSASetLastError(WSAEWOULDBLOCK);
+	return -1;
+}
+
+int ReplayTransport::get_socket_error(int sock, int *error)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	*error = (s->connect_done ? s->connect_error : WSAEWOULDBLOCK);
+	return 0;
+}
+
+int ReplayTransport::send(int sock, const void *data, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return get_socket(sock) != NULL ? size : -1;
+}
+
+int ReplayTransport::recv(int sock, void *buf, size_t size)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->inbound.empty())
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	const Record *record = s->inbound.front();
+	
+	if(record->header.type == CR_RECV_EOF || record->header.type == CR_RECV_ERROR)
+	{
+		if(!s->end_read)
+		{
+			s->end_read = true;
+			consumed(*s);
+		}
+		
+		if(record->header.type == CR_RECV_EOF)
+		{
+			return 0;
+		}
+		
+		uint32_t error = WSAECONNRESET;
+		if(record->data.size() >= sizeof(error))
+		{
+			memcpy(&error, record->data.data(), sizeof(error));
+		}
+		
+		WSASetLastError(error);
+		return -1;
+	}
+	
+	size_t n = record->data.size() - s->recv_off;
+	if(n > size)
+	{
+		n = size;
+	}
+	
+	memcpy(buf, record->data.data() + s->recv_off, n);
+	s->recv_off += n;
+	
+	if(s->recv_off == record->data.size())
+	{
+		s->inbound.pop_front();
+		s->recv_off = 0;
+		
+		consumed(*s);
+	}
+	
+	return n;
+}
+
+int ReplayTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return get_socket(sock) != NULL ? size : -1;
+}
+
+int ReplayTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return -1;
+	}
+	
+	if(s->inbound.empty() || s->inbound.front()->header.type != CR_RECVFROM)
+	{
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	
+	const Record *record = s->inbound.front();
+	s->inbound.pop_front();
+	
+	memset(from_addr, 0, sizeof(*from_addr));
+	from_addr->sin_family      = AF_INET;
+	from_addr->sin_addr.s_addr = record->header.ip;
+	from_addr->sin_port        = htons(record->header.port);
+	
+	size_t n = record->data.size() < size ? record->data.size() : size;
+	memcpy(buf, record->data.data(), n);
+	
+	consumed(*s);
+	
+	if(n < record->data.size())
+	{
+		WSASetLastError(WSAEMSGSIZE);
+		return -1;
+	}
+	
+	return n;
+}
+
+int ReplayTransport::shutdown_send(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	return get_socket(sock) != NULL ? 0 : -1;
+}
+
+void ReplayTransport::close(int sock)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	Socket *s = get_socket(sock);
+	if(s == NULL)
+	{
+		return;
+	}
+	
+	/* Anything the peer didn't get around to reading will never be read now. */
+	outstanding -= s->inbound.size() - (s->end_read ? 1 : 0);
+	
+	s->inbound.clear();
+	s->closed = true;
+	s->event  = NULL;
+}
+
+bool ReplayTransport::get_host_instance(GUID *instance)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	if(have_session)
+	{
+		*instance = session.instance;
+	}
+	
+	return have_session;
+}
@@ -0,0 +1,188 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_REPLAYTRANSPORT_HPP
+#define DPLITE_REPLAYTRANSPORT_HPP
+
+#include <winsock2.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+#include "CaptureTransport.hpp"
+#include "Transport.hpp"
+
+/* A Transport which plays back what a DirectPlay8Peer received in a capture written by
+ * CaptureTransport, so that a fresh DirectPlay8Peer calling Host() or Connect() the same
+ * way goes through the same receive path with the same data.
+ *
+ * Sockets are matched up by the order they were created in. Everything sent is
+ * discarded. Received data, accepted connections and connection results are held back
+ * until released by the caller, either as their recorded time comes up or all at once.
+ * A socket gets the data recorded for it even if released before the peer creates it, so
+ * releasing everything at once still delivers each socket's data in the recorded order.
+ *
+ * Only the first session in the capture is replayed.
+ *
+ * Thread safe.
+*/
+
+class ReplayTransport: public Transport
+{
+	public:
+		/* What the session was started with, see CAPTURE_SESSION_HOST. */
+		struct Session
+		{
+			bool host;
+			DWORD role;
+			GUID application;
+			GUID instance;
+			DWORD flags;
+			DWORD max_players;
+			std::wstring session_name;
+			std::wstring password;
+			uint16_t port;
+			std::vector<unsigned char> connect_data;
+		};
+		
+	private:
+		struct Record
+		{
+			CaptureRecord header;
+			std::vector<unsigned char> data;
+			
+			/* Socket the record belongs to, numbered uniquely across the whole capture
+			 * since socket numbers get reused once closed. For CR_ACCEPT, this is the
+			 * listener and accepted is the new socket.
+			*/
+			int sock;
+			int accepted;
+			
+			unsigned long long time;  /* Since the session started. */
+		};
+		
+		struct Socket
+		{
+			bool opened;  /* Handed out to the peer. */
+			bool closed;  /* Closed by the peer. */
+			
+			HANDLE event;
+			long events;
+			
+			bool write_pending;
+			
+			int connect_error;
+			bool connect_done;
+			bool connect_signalled;
+			
+			/* Released CR_ACCEPT, CR_RECV, CR_RECV_EOF, CR_RECV_ERROR and CR_RECVFROM
+			 * records. End of stream records are left in place once read.
+			*/
+			std::list<const Record*> inbound;
+			size_t recv_off;
+			bool end_read;
+			
+			Socket();
+		};
+		
+		/* Socket numbers handed out when the peer creates more sockets than were recorded. */
+		static const int FIRST_UNRECORDED_SOCK = 0x10000000;
+		
+		std::mutex lock;
+		
+		bool have_session;
+		Session session;
+		
+		std::vector<Record> records;
+		
+		/* Recorded sockets of each CR_*_SOCKET type, in creation order. */
+		std::map<uint8_t, std::list<const Record*> > creations;
+		
+		std::list<const Record*> unreleased;
+		size_t outstanding;  /* Released records not yet read by the peer. */
+		
+		std::map<int, Socket> sockets;
+		int next_unrecorded_sock;
+		
+		size_t n_inbound;
+		unsigned long long inbound_bytes;
+		
+		void load(const std::string &path);
+		int create_socket(CaptureRecordType type);
+		Socket *get_socket(int sock);
+		void release_record(const Record *record);
+		void consumed(Socket &s);
+		void update_events(Socket &s);
+		
+	public:
+		/* Throws std::runtime_error if the capture can't be read. */
+		ReplayTransport(const std::string &path);
+		virtual ~ReplayTransport();
+		
+		/* No copy c'tor. */
+		ReplayTransport(const ReplayTransport &src) = delete;
+		
+		/* Returns false if the capture doesn't include the start of a session. */
+		bool get_session(Session *session);
+		
+		/* Number and total size of the received records in the session. */
+		size_t inbound_records();
+		unsigned long long total_inbound_bytes();
+		
+		/* Time of the next record to be released, in microseconds since the session
+		 * started. Returns false if everything has been released.
+		*/
+		bool next_release(unsigned long long *time);
+		
+		/* Releases everything recorded up to the given time since the session started. */
+		void release(unsigned long long until);
+		void release_all();
+		
+		/* Number of released records which the peer hasn't read yet. */
+		size_t unread();
+		
+		/* True once everything has been released and read. */
+		bool finished();
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+		virtual bool get_host_instance(GUID *instance) override;
+};
+
+#endif /* !DPLITE_REPLAYTRANSPORT_HPP */
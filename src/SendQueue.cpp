@@ -21,17 +21,49 @@
 #include <windows.h>
 
 #include "SendQueue.hpp"
+#include "Trace.hpp"
+
+static LONGLONG counter_freq()
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	
+	return freq.QuadPart;
+}
+
+SendQueue::Timestamp SendQueue::now()
+{
+	static const LONGLONG freq = counter_freq();
+	
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+	
+	/* Split to avoid overflowing the multiplication with a large counter value. */
+	return ((Timestamp)(count.QuadPart / freq) * 1000000)
+		+ (((Timestamp)(count.QuadPart % freq) * 1000000) / freq);
+}
 
 void SendQueue::send(SendPriority priority, const PacketSerialiser &ps,
 	const struct sockaddr_in *dest_addr,
-	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
+	const Callback &callback)
 {
 	send(priority, ps, dest_addr, 0, callback);
 }
 
 void SendQueue::send(SendPriority priority, const PacketSerialiser &ps,
 	const struct sockaddr_in *dest_addr, DPNHANDLE async_handle,
-	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback)
+	const Callback &callback)
+{
+	send_timed(priority, ps, dest_addr, async_handle,
+		[callback](std::unique_lock<ProfiledMutex> &l, HRESULT result, const SendOp &op)
+		{
+			callback(l, result);
+		});
+}
+
+void SendQueue::send_timed(SendPriority priority, const PacketSerialiser &ps,
+	const struct sockaddr_in *dest_addr, DPNHANDLE async_handle,
+	const TimedCallback &callback)
 {
 	std::pair<const void*, size_t> data = ps.raw_packet();
 	
@@ -39,23 +71,64 @@ void SendQueue::send(SendPriority priority, const PacketSerialiser &ps,
 		data.first, data.second,
 		(const struct sockaddr*)(dest_addr), (dest_addr != NULL ? sizeof(*dest_addr) : 0),
 		async_handle,
-		callback);
+		callback,
+		clock);
+	
+	enqueue(priority, op, false);
+}
+
+void SendQueue::send_streamed(SendPriority priority, const PacketSerialiser &ps,
+	DPNHANDLE async_handle, const Continuation &next,
+	const TimedCallback &callback)
+{
+	std::pair<const void*, size_t> data = ps.raw_packet();
+	
+	SendOp *op = new SendOp(
+		data.first, data.second,
+		NULL, 0,
+		async_handle,
+		callback,
+		clock);
+	
+	op->next = next;
+	
+	enqueue(priority, op, false);
+}
+
+void SendQueue::enqueue(SendPriority priority, SendOp *op, bool front)
+{
+	std::pair<const void*, size_t> data = op->get_data();
+	
+	op->priority  = priority;
+	queued_bytes += data.second;
+	
+	TRACE_POINT(TE_SEND_ENQUEUE, trace_peer, ((const TLVChunk*)(data.first))->type, data.second, op->async_handle);
+	
+	std::list<SendOp*> *queue = NULL;
 	
 	switch(priority)
 	{
 		case SEND_PRI_LOW:
-			low_queue.push_back(op);
+			queue = &low_queue;
 			break;
 			
 		case SEND_PRI_MEDIUM:
-			medium_queue.push_back(op);
+			queue = &medium_queue;
 			break;
 			
 		case SEND_PRI_HIGH:
-			high_queue.push_back(op);
+			queue = &high_queue;
 			break;
 	}
 	
+	if(front)
+	{
+		queue->push_front(op);
+	}
+	else{
+		queue->push_back(op);
+	}
+	
 	SetEvent(signal_on_queue);
 }
 
@@ -82,6 +155,11 @@ SendQueue::SendOp *SendQueue::get_pending()
 		low_queue.pop_front();
 	}
 	
+	if(current != NULL)
+	{
+		queued_bytes -= current->get_data().second;
+	}
+	
 	return current;
 }
 
@@ -91,6 +169,24 @@ void SendQueue::pop_pending(SendQueue::SendOp *op)
 	current = NULL;
 }
 
+bool SendQueue::continue_pending(SendQueue::SendOp *op)
+{
+	assert(op == current);
+	assert(op->sent_data == op->data.size());
+	
+	if(!op->next || !op->next(op->data))
+	{
+		return false;
+	}
+	
+	op->sent_data = 0;
+	
+	current = NULL;
+	enqueue(op->priority, op, true);
+	
+	return true;
+}
+
 /* NOTE: The remove_queued() family of methods will ONLY return SendOps which
  * have a nonzero async_handle. This is for cancelling application-created SendOps
  * without also aborting internal ones.
@@ -109,6 +205,8 @@ SendQueue::SendOp *SendQueue::remove_queued()
 			if(op->async_handle != 0)
 			{
 				queues[i]->erase(it);
+				queued_bytes -= op->get_data().second;
+				
 				return op;
 			}
 		}
@@ -130,6 +228,8 @@ SendQueue::SendOp *SendQueue::remove_queued_by_handle(DPNHANDLE async_handle)
 			if(op->async_handle != 0 && op->async_handle == async_handle)
 			{
 				queues[i]->erase(it);
+				queued_bytes -= op->get_data().second;
+				
 				return op;
 			}
 		}
@@ -164,6 +264,8 @@ SendQueue::SendOp *SendQueue::remove_queued_by_priority(SendPriority priority)
 		if(op->async_handle != 0)
 		{
 			queue->erase(it);
+			queued_bytes -= op->get_data().second;
+			
 			return op;
 		}
 	}
@@ -176,15 +278,31 @@ bool SendQueue::handle_is_pending(DPNHANDLE async_handle)
 	return (current != NULL && current->async_handle == async_handle);
 }
 
+size_t SendQueue::get_queued_bytes() const
+{
+	return queued_bytes;
+}
+
+void SendQueue::set_trace_peer(unsigned int peer_id)
+{
+	trace_peer = peer_id;
+}
+
 SendQueue::SendOp::SendOp(const void *data, size_t data_size,
 	const struct sockaddr *dest_addr, size_t dest_addr_size,
 	DPNHANDLE async_handle,
-	const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback):
+	const TimedCallback &callback,
+	Clock *clock):
 	
 	data((const unsigned char*)(data), (const unsigned char*)(data) + data_size),
 	sent_data(0),
-	async_handle(async_handle),
-	callback(callback)
+	priority(SEND_PRI_MEDIUM),
+	callback(callback),
+	clock(clock),
+	queued_at(clock->now()),
+	first_sent_at(0),
+	completed_at(0),
+	async_handle(async_handle)
 {
 	assert((size_t)(dest_addr_size) <= sizeof(this->dest_addr));
 	
@@ -204,6 +322,11 @@ std::pair<const struct sockaddr*, size_t> SendQueue::SendOp::get_dest_addr() con
 
 void SendQueue::SendOp::inc_sent_data(size_t sent)
 {
+	if(first_sent_at == 0 && sent > 0)
+	{
+		first_sent_at = clock->now();
+	}
+	
 	sent_data += sent;
 	assert(sent_data <= data.size());
 }
@@ -213,7 +336,30 @@ std::pair<const void*, size_t> SendQueue::SendOp::get_pending_data() const
 	return std::make_pair<const void*, size_t>(data.data() + sent_data, data.size() - sent_data);
 }
 
-void SendQueue::SendOp::invoke_callback(std::unique_lock<std::mutex> &l, HRESULT result) const
+SendQueue::Timestamp SendQueue::SendOp::get_queued_at() const
 {
-	callback(l, result);
+	return queued_at;
+}
+
+SendQueue::Timestamp SendQueue::SendOp::get_first_sent_at() const
+{
+	return first_sent_at;
+}
+
+SendQueue::Timestamp SendQueue::SendOp::get_completed_at() const
+{
+	return completed_at;
+}
+
+void SendQueue::SendOp::invoke_callback(std::unique_lock<ProfiledMutex> &l, HRESULT result)
+{
+	completed_at = clock->now();
+	
+	if(first_sent_at == 0 && result == S_OK)
+	{
+		/* Datagrams go out in one go without calling inc_sent_data(). */
+		first_sent_at = completed_at;
+	}
+	
+	callback(l, result, *this);
 }
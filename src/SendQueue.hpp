@@ -31,7 +31,9 @@
 #include <vector>
 #include <windows.h>
 
+#include "Clock.hpp"
 #include "packet.hpp"
+#include "ProfiledMutex.hpp"
 
 class SendQueue
 {
@@ -42,16 +44,47 @@ class SendQueue
 			SEND_PRI_HIGH = 4,
 		};
 		
+		/* Microseconds since an arbitrary point, from the performance counter. SendOp
+		 * times come from the queue's Clock instead, which is normally the same thing.
+		*/
+		typedef unsigned long long Timestamp;
+		static Timestamp now();
+		
+		class SendOp;
+		
+		typedef std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT)> Callback;
+		
+		/* Like Callback, but also given the SendOp so the callback can look at when
+		 * the operation was queued, started and completed.
+		*/
+		typedef std::function<void(std::unique_lock<ProfiledMutex>&, HRESULT, const SendOp&)> TimedCallback;
+		
+		/* Produces the next packet of a streamed SendOp into data, returns false once
+		 * there is nothing more to send.
+		*/
+		typedef std::function<bool(std::vector<unsigned char> &data)> Continuation;
+		
 		class SendOp
 		{
+			friend class SendQueue;
+			
 			private:
 				std::vector<unsigned char> data;
 				size_t sent_data;
 				
+				SendPriority priority;
+				Continuation next;
+				
 				struct sockaddr_storage dest_addr;
 				size_t dest_addr_size;
 				
-				std::function<void(std::unique_lock<std::mutex>&, HRESULT)> callback;
+				TimedCallback callback;
+				
+				Clock *clock;
+				
+				Timestamp queued_at;     /* When the SendOp was created. */
+				Timestamp first_sent_at; /* When the first byte was sent, 0 if not yet. */
+				Timestamp completed_at;  /* When the callback was invoked, 0 if not yet. */
 				
 			public:
 				const DPNHANDLE async_handle;
@@ -60,7 +93,8 @@ class SendQueue
 					const void *data, size_t data_size,
 					const struct sockaddr *dest_addr, size_t dest_addr_size,
 					DPNHANDLE async_handle,
-					const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+					const TimedCallback &callback,
+					Clock *clock = SystemClock::get());
 				
 				std::pair<const void*, size_t> get_data() const;
 				std::pair<const struct sockaddr*, size_t> get_dest_addr() const;
@@ -68,7 +102,11 @@ class SendQueue
 				void inc_sent_data(size_t sent);
 				std::pair<const void*, size_t> get_pending_data() const;
 				
-				void invoke_callback(std::unique_lock<std::mutex> &l, HRESULT result) const;
+				Timestamp get_queued_at() const;
+				Timestamp get_first_sent_at() const;
+				Timestamp get_completed_at() const;
+				
+				void invoke_callback(std::unique_lock<ProfiledMutex> &l, HRESULT result);
 		};
 		
 	private:
@@ -78,24 +116,52 @@ class SendQueue
 		
 		SendOp *current;
 		
+		void enqueue(SendPriority priority, SendOp *op, bool front);
+		
+		/* Total size of all SendOps in the queues, not including current. */
+		size_t queued_bytes;
+		
 		HANDLE signal_on_queue;
+		Clock *clock;
+		
+		/* Peer ID recorded in trace points, 0 for queues not belonging to a peer. */
+		unsigned int trace_peer;
 		
 	public:
-		SendQueue(HANDLE signal_on_queue): current(NULL), signal_on_queue(signal_on_queue) {}
+		SendQueue(HANDLE signal_on_queue, Clock *clock = SystemClock::get()): current(NULL), queued_bytes(0), signal_on_queue(signal_on_queue), clock(clock), trace_peer(0) {}
 		
 		/* No copy c'tor. */
 		SendQueue(const SendQueue &src) = delete;
 		
-		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
-		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const std::function<void(std::unique_lock<std::mutex>&, HRESULT)> &callback);
+		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, const Callback &callback);
+		void send(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const Callback &callback);
+		void send_timed(SendPriority priority, const PacketSerialiser &ps, const struct sockaddr_in *dest_addr, DPNHANDLE async_handle, const TimedCallback &callback);
+		
+		/* Queues an operation made up of several packets. ps is sent first, then next is
+		 * called for each following packet once the previous one has been sent, so only
+		 * one is held in the queue at a time. The callback is invoked once, after the last
+		 * packet has been sent or if the operation is aborted.
+		*/
+		void send_streamed(SendPriority priority, const PacketSerialiser &ps, DPNHANDLE async_handle, const Continuation &next, const TimedCallback &callback);
 		
 		SendOp *get_pending();
 		void pop_pending(SendOp *op);
 		
+		/* Called once all of the current SendOp's data has been sent. If it is streamed
+		 * and has another packet to send, the SendOp is put back at the front of its queue
+		 * (so higher priority messages can go first) and true is returned. Otherwise the
+		 * SendOp is left for pop_pending().
+		*/
+		bool continue_pending(SendOp *op);
+		
 		SendOp *remove_queued();
 		SendOp *remove_queued_by_handle(DPNHANDLE async_handle);
 		SendOp *remove_queued_by_priority(SendPriority priority);
 		bool handle_is_pending(DPNHANDLE async_handle);
+		
+		size_t get_queued_bytes() const;
+		
+		void set_trace_peer(unsigned int peer_id);
 };
 
 #endif /* !DPLITE_SENDQUEUE_HPP */
@@ -0,0 +1,490 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <stdexcept>
+#include <vector>
+#include <windows.h>
+
+#include "DirectPlay8Peer.hpp"
+#include "Log.hpp"
+#include "Messages.hpp"
+#include "packet.hpp"
+#include "SharedListener.hpp"
+
+std::mutex SharedListener::shared_lock;
+std::map<std::pair<uint32_t, uint16_t>, SharedListener*> SharedListener::shared_listeners;
+
+SharedListener::SharedListener(uint32_t ipaddr, uint16_t port, int udp_socket, int listener_socket):
+	next_session_id(1),
+	ipaddr(ipaddr),
+	port(port),
+	udp_socket(udp_socket),
+	listener_socket(listener_socket),
+	refcount(0)
+{
+	udp_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(udp_event == NULL)
+	{
+		throw std::runtime_error("Cannot create udp_event object");
+	}
+	
+	listener_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(listener_event == NULL)
+	{
+		CloseHandle(udp_event);
+		throw std::runtime_error("Cannot create listener_event object");
+	}
+	
+	if(WSAEventSelect(udp_socket, udp_event, FD_READ | FD_WRITE) != 0
+		|| WSAEventSelect(listener_socket, listener_event, FD_ACCEPT) != 0)
+	{
+		CloseHandle(listener_event);
+		CloseHandle(udp_event);
+		throw std::runtime_error("Cannot WSAEventSelect");
+	}
+	
+	pending_timer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if(pending_timer == NULL)
+	{
+		CloseHandle(listener_event);
+		CloseHandle(udp_event);
+		throw std::runtime_error("Cannot create pending_timer object");
+	}
+	
+	pool_idle = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if(pool_idle == NULL)
+	{
+		CloseHandle(pending_timer);
+		CloseHandle(listener_event);
+		CloseHandle(udp_event);
+		throw std::runtime_error("Cannot create pool_idle object");
+	}
+	
+	pool     = HandleHandlingPool::acquire_shared();
+	pool_ref = std::shared_ptr<void>(nullptr, [this](void*) { SetEvent(pool_idle); });
+	
+	std::shared_ptr<void> ref = pool_ref;
+	
+	pool->add_handle(udp_event,      [this, ref]() { handle_udp_event(); });
+	pool->add_handle(listener_event, [this, ref]() { handle_listener_event(); });
+	pool->add_handle(pending_timer,  [this, ref]() { handle_pending_timer(); });
+}
+
+SharedListener::~SharedListener()
+{
+	pool->remove_handle(pending_timer);
+	pool->remove_handle(listener_event);
+	pool->remove_handle(udp_event);
+	
+	pool_ref.reset();
+	WaitForSingleObject(pool_idle, INFINITE);
+	
+	HandleHandlingPool::release_shared();
+	
+	for(auto p = pending.begin(); p != pending.end(); ++p)
+	{
+		closesocket((*p)->sock);
+		delete *p;
+	}
+	
+	CloseHandle(pool_idle);
+	CloseHandle(pending_timer);
+	CloseHandle(listener_event);
+	CloseHandle(udp_event);
+	closesocket(listener_socket);
+	closesocket(udp_socket);
+}
+
+SharedListener *SharedListener::acquire(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	std::unique_lock<std::mutex> l(shared_lock);
+	
+	auto key = std::make_pair(ipaddr, port);
+	
+	auto sli = shared_listeners.find(key);
+	if(sli != shared_listeners.end())
+	{
+		++(sli->second->refcount);
+		return sli->second;
+	}
+	
+	/* The socket options of the first session are used for the shared sockets, every
+	 * session applies its own to the connections it adopts.
+	*/
+	
+	int udp_socket = create_udp_socket(ipaddr, port, options);
+	if(udp_socket == -1)
+	{
+		return NULL;
+	}
+	
+	int listener_socket = create_listener_socket(ipaddr, port, options);
+	if(listener_socket == -1)
+	{
+		closesocket(udp_socket);
+		return NULL;
+	}
+	
+	SharedListener *sl;
+	
+	try {
+		sl = new SharedListener(ipaddr, port, udp_socket, listener_socket);
+	}
+	catch(const std::runtime_error &e)
+	{
+		log_printf("Cannot create shared listener: %s", e.what());
+		
+		closesocket(listener_socket);
+		closesocket(udp_socket);
+		
+		return NULL;
+	}
+	
+	sl->refcount = 1;
+	shared_listeners.insert(std::make_pair(key, sl));
+	
+	return sl;
+}
+
+void SharedListener::release(SharedListener *sl)
+{
+	std::unique_lock<std::mutex> l(shared_lock);
+	
+	if(--(sl->refcount) > 0)
+	{
+		return;
+	}
+	
+	shared_listeners.erase(std::make_pair(sl->ipaddr, sl->port));
+	
+	/* The destructor waits for our handlers to finish, which may be calling into sessions,
+	 * so don't block anybody else acquiring a listener in the meantime.
+	*/
+	l.unlock();
+	
+	delete sl;
+}
+
+int SharedListener::get_udp_socket() const
+{
+	return udp_socket;
+}
+
+unsigned int SharedListener::add(DirectPlay8Peer *session, const std::shared_ptr<void> &ref, const GUID &instance_guid, const GUID &application_guid)
+{
+	std::unique_lock<std::mutex> l(lock);
+	
+	unsigned int id = next_session_id++;
+	
+	Session s;
+	s.session          = session;
+	s.ref              = ref;
+	s.instance_guid    = instance_guid;
+	s.application_guid = application_guid;
+	
+	sessions.insert(std::make_pair(id, s));
+	
+	return id;
+}
+
+void SharedListener::remove(unsigned int id)
+{
+	std::unique_lock<std::mutex> l(lock);
+	sessions.erase(id);
+}
+
+void SharedListener::handle_udp_event()
+{
+	std::unique_lock<std::mutex> rl(recv_lock);
+	
+	WSANETWORKEVENTS events;
+	if(WSAEnumNetworkEvents(udp_socket, NULL, &events) != 0)
+	{
+		events.lNetworkEvents = FD_READ | FD_WRITE;
+	}
+	
+	if(events.lNetworkEvents & FD_WRITE)
+	{
+		/* Space has become available in the send buffer, let any sessions which were
+		 * waiting for it carry on sending.
+		*/
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		for(auto s = sessions.begin(); s != sessions.end(); ++s)
+		{
+			s->second.session->shared_udp_writable();
+		}
+	}
+	
+	while(true)
+	{
+		struct sockaddr_in from_addr;
+		int addrlen = sizeof(from_addr);
+		
+		int r = recvfrom(udp_socket, (char*)(recv_buf), sizeof(recv_buf), 0, (struct sockaddr*)(&from_addr), &addrlen);
+		if(r <= 0)
+		{
+			break;
+		}
+		
+		std::unique_lock<std::mutex> l(lock);
+		
+		std::vector<Session> targets;
+		targets.reserve(sessions.size());
+		
+		for(auto s = sessions.begin(); s != sessions.end(); ++s)
+		{
+			targets.push_back(s->second);
+		}
+		
+		l.unlock();
+		
+		for(auto t = targets.begin(); t != targets.end(); ++t)
+		{
+			t->session->shared_udp_recv(recv_buf, r, &from_addr);
+		}
+	}
+}
+
+void SharedListener::handle_listener_event()
+{
+	std::unique_lock<std::mutex> al(accept_lock);
+	
+	while(true)
+	{
+		struct sockaddr_in addr;
+		int addrlen = sizeof(addr);
+		
+		int newfd = accept(listener_socket, (struct sockaddr*)(&addr), &addrlen);
+		if(newfd == -1)
+		{
+			DWORD err = WSAGetLastError();
+			
+			if(err != WSAEWOULDBLOCK)
+			{
+				log_printf("Incoming connection failed: %s", win_strerror(err).c_str());
+			}
+			
+			break;
+		}
+		
+		/* The new socket inherits FD_ACCEPT on listener_event from the listener, we want
+		 * to know when it has data instead.
+		*/
+		if(WSAEventSelect(newfd, listener_event, FD_READ | FD_CLOSE) != 0)
+		{
+			DWORD err = WSAGetLastError();
+			log_printf("WSAEventSelect() error: %s", win_strerror(err).c_str());
+			
+			closesocket(newfd);
+			continue;
+		}
+		
+		PendingConnection *pc = new PendingConnection;
+		pc->sock         = newfd;
+		pc->addr         = addr;
+		pc->accepted_at  = GetTickCount();
+		pc->recv_buf.resize(sizeof(TLVChunk));
+		pc->recv_buf_cur = 0;
+		
+		pending.push_back(pc);
+		
+		if(pending.size() > MAX_PENDING)
+		{
+			log_printf("Too many connections waiting for DPLITE_MSGID_CONNECT_HOST, dropping oldest");
+			
+			pending_close(pending.front());
+			pending.pop_front();
+		}
+	}
+	
+	DWORD now = GetTickCount();
+	
+	for(auto p = pending.begin(); p != pending.end();)
+	{
+		PendingConnection *pc = *p;
+		
+		if(!pending_recv(pc))
+		{
+			pending_close(pc);
+			p = pending.erase(p);
+		}
+		else if(pc->recv_buf_cur == pc->recv_buf.size() && pc->recv_buf.size() > sizeof(TLVChunk))
+		{
+			/* First message complete. */
+			
+			p = pending.erase(p);
+			pending_route(pc);
+		}
+		else if((now - pc->accepted_at) >= PENDING_TIMEOUT_MS)
+		{
+			pending_close(pc);
+			p = pending.erase(p);
+		}
+		else{
+			++p;
+		}
+	}
+	
+	arm_pending_timer();
+}
+
+void SharedListener::handle_pending_timer()
+{
+	std::unique_lock<std::mutex> al(accept_lock);
+	
+	DWORD now = GetTickCount();
+	
+	while(!pending.empty() && (now - pending.front()->accepted_at) >= PENDING_TIMEOUT_MS)
+	{
+		pending_close(pending.front());
+		pending.pop_front();
+	}
+	
+	arm_pending_timer();
+}
+
+/* Arms pending_timer to go off when the oldest pending connection times out. Must be called
+ * with accept_lock held.
+*/
+void SharedListener::arm_pending_timer()
+{
+	if(pending.empty())
+	{
+		CancelWaitableTimer(pending_timer);
+		return;
+	}
+	
+	DWORD age = GetTickCount() - pending.front()->accepted_at;
+	DWORD remaining = (age < PENDING_TIMEOUT_MS) ? (PENDING_TIMEOUT_MS - age) : 0;
+	
+	LARGE_INTEGER due;
+	due.QuadPart = -((LONGLONG)(remaining) * 10000) - 1; /* Relative, in 100ns units. */
+	
+	SetWaitableTimer(pending_timer, &due, 0, NULL, NULL, FALSE);
+}
+
+/* Reads whatever is available of the first message on a pending connection. Returns false if
+ * the connection has been closed or sent something invalid.
+*/
+bool SharedListener::pending_recv(PendingConnection *pc)
+{
+	while(pc->recv_buf_cur < pc->recv_buf.size())
+	{
+		int r = recv(pc->sock, (char*)(pc->recv_buf.data() + pc->recv_buf_cur), (pc->recv_buf.size() - pc->recv_buf_cur), 0);
+		if(r == 0)
+		{
+			return false;
+		}
+		else if(r < 0)
+		{
+			return WSAGetLastError() == WSAEWOULDBLOCK;
+		}
+		
+		pc->recv_buf_cur += r;
+		
+		if(pc->recv_buf_cur == sizeof(TLVChunk) && pc->recv_buf.size() == sizeof(TLVChunk))
+		{
+			/* Header complete, now we know how big the message is. */
+			
+			TLVChunk *header = (TLVChunk*)(pc->recv_buf.data());
+			size_t full_packet_size = sizeof(TLVChunk) + header->value_length;
+			
+			if(header->type != DPLITE_MSGID_CONNECT_HOST || full_packet_size > MAX_PACKET_SIZE || full_packet_size == sizeof(TLVChunk))
+			{
+				return false;
+			}
+			
+			pc->recv_buf.resize(full_packet_size);
+		}
+	}
+	
+	return true;
+}
+
+/* Hands a pending connection over to the session it is trying to join, or rejects it if
+ * there is no such session. Takes ownership of pc.
+*/
+void SharedListener::pending_route(PendingConnection *pc)
+{
+	GUID instance_guid;
+	GUID application_guid;
+	
+	try {
+		PacketDeserialiser pd(pc->recv_buf.data(), pc->recv_buf.size());
+		
+		instance_guid    = pd.is_null(0) ? GUID_NULL : pd.get_guid(0);
+		application_guid = pd.get_guid(1);
+	}
+	catch(const PacketDeserialiser::Error &e)
+	{
+		/* Malformed packet received */
+		pending_close(pc);
+		return;
+	}
+	
+	std::unique_lock<std::mutex> l(lock);
+	
+	Session *target = NULL;
+	HRESULT error   = (instance_guid != GUID_NULL ? DPNERR_INVALIDINSTANCE : DPNERR_INVALIDAPPLICATION);
+	
+	for(auto s = sessions.begin(); s != sessions.end() && target == NULL; ++s)
+	{
+		if(instance_guid != GUID_NULL
+			? s->second.instance_guid == instance_guid
+			: s->second.application_guid == application_guid)
+		{
+			target = &(s->second);
+		}
+	}
+	
+	if(target == NULL)
+	{
+		l.unlock();
+		
+		PacketSerialiser connect_host_fail(DPLITE_MSGID_CONNECT_HOST_FAIL);
+		connect_host_fail.append_dword(error);
+		connect_host_fail.append_null();
+		
+		std::pair<const void*, size_t> raw = connect_host_fail.raw_packet();
+		send(pc->sock, (const char*)(raw.first), raw.second, 0);
+		
+		pending_close(pc);
+		return;
+	}
+	
+	DirectPlay8Peer *session = target->session;
+	std::shared_ptr<void> ref = target->ref;
+	
+	l.unlock();
+	
+	/* The session takes over the socket, so it must stop raising our event first. */
+	WSAEventSelect(pc->sock, NULL, 0);
+	
+	session->adopt_connection(pc->sock, &(pc->addr), pc->recv_buf.data(), pc->recv_buf.size());
+	
+	delete pc;
+}
+
+void SharedListener::pending_close(PendingConnection *pc)
+{
+	closesocket(pc->sock);
+	delete pc;
+}
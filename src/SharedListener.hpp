@@ -0,0 +1,159 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_SHAREDLISTENER_HPP
+#define DPLITE_SHAREDLISTENER_HPP
+
+#include <winsock2.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include <windows.h>
+
+#include "HandleHandlingPool.hpp"
+#include "network.hpp"
+
+class DirectPlay8Peer;
+
+/* TCP listener and UDP socket shared by every session in the process which is hosted on the
+ * same address and port with DPLITE_HOST_SHAREDPORT.
+ *
+ * New connections are held here until their DPLITE_MSGID_CONNECT_HOST message has arrived,
+ * then handed to the session named by its instance GUID (or the first session of the named
+ * application, if the client didn't specify an instance) along with everything read from
+ * the connection so far. Host enumeration requests received on the UDP socket are passed to
+ * every session, each of which decides whether to answer and sends its response from the
+ * shared socket.
+ *
+ * As with HostEnumScheduler, the lock is never held while calling into a session. The
+ * session's pool_ref is copied and held instead, so Close() waits for the call to finish.
+*/
+
+class SharedListener
+{
+	private:
+		/* Connections which haven't sent a complete message are dropped after this long, or
+		 * when there are too many of them (oldest first). pending_timer is armed to go off
+		 * when the oldest one is due to time out, so they are dropped even if nothing else
+		 * happens on the listener.
+		*/
+		static const DWORD PENDING_TIMEOUT_MS = 10000;
+		static const size_t MAX_PENDING = 256;
+		
+		struct Session
+		{
+			DirectPlay8Peer *session;
+			std::shared_ptr<void> ref;
+			
+			GUID instance_guid;
+			GUID application_guid;
+		};
+		
+		struct PendingConnection
+		{
+			int sock;
+			struct sockaddr_in addr;
+			DWORD accepted_at;
+			
+			/* Only the first message is read from the connection, anything after it is
+			 * left in the socket for the session to read.
+			*/
+			std::vector<unsigned char> recv_buf;
+			size_t recv_buf_cur;
+		};
+		
+		std::mutex lock;
+		
+		std::map<unsigned int, Session> sessions;
+		unsigned int next_session_id;
+		
+		const uint32_t ipaddr;
+		const uint16_t port;
+		
+		int udp_socket;
+		int listener_socket;
+		
+		HANDLE udp_event;
+		HANDLE listener_event;
+		HANDLE pending_timer;
+		
+		/* recv_lock serialises handle_udp_event() and protects recv_buf, accept_lock
+		 * serialises handle_listener_event() and handle_pending_timer() and protects
+		 * pending, which is kept in the order the connections were accepted.
+		*/
+		std::mutex recv_lock;
+		unsigned char recv_buf[MAX_PACKET_SIZE];
+		
+		std::mutex accept_lock;
+		std::list<PendingConnection*> pending;
+		
+		HandleHandlingPool *pool;
+		std::shared_ptr<void> pool_ref;
+		HANDLE pool_idle;
+		
+		/* Protected by shared_lock. */
+		unsigned int refcount;
+		
+		static std::mutex shared_lock;
+		static std::map<std::pair<uint32_t, uint16_t>, SharedListener*> shared_listeners;
+		
+		SharedListener(uint32_t ipaddr, uint16_t port, int udp_socket, int listener_socket);
+		~SharedListener();
+		
+		/* No copy c'tor. */
+		SharedListener(const SharedListener&) = delete;
+		
+		void handle_udp_event();
+		void handle_listener_event();
+		void handle_pending_timer();
+		
+		void arm_pending_timer();
+		bool pending_recv(PendingConnection *pc);
+		void pending_route(PendingConnection *pc);
+		void pending_close(PendingConnection *pc);
+		
+	public:
+		/* Returns the SharedListener for the given address, creating its sockets if this
+		 * is the first session to use it. Returns NULL if the sockets can't be created.
+		*/
+		static SharedListener *acquire(uint32_t ipaddr, uint16_t port, const SocketOptions &options);
+		
+		/* Drops a reference obtained by acquire(). Must not be called with the lock of any
+		 * session which might still be registered held, since closing the sockets waits for
+		 * calls into sessions to finish.
+		*/
+		static void release(SharedListener *sl);
+		
+		int get_udp_socket() const;
+		
+		/* Registers a session to receive connections and enumeration requests. ref is held
+		 * while calling into it.
+		*/
+		unsigned int add(DirectPlay8Peer *session, const std::shared_ptr<void> &ref, const GUID &instance_guid, const GUID &application_guid);
+		
+		/* Unregisters a session. Calls into it which are already in progress may still be
+		 * running when this returns.
+		*/
+		void remove(unsigned int id);
+};
+
+#endif /* !DPLITE_SHAREDLISTENER_HPP */
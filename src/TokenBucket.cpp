@@ -0,0 +1,126 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "TokenBucket.hpp"
+
+TokenBucket::TokenBucket():
+	rate(0), burst(0), tokens(0), last_refill(0) {}
+
+void TokenBucket::refill(unsigned long long now)
+{
+	if(now <= last_refill)
+	{
+		return;
+	}
+	
+	unsigned long long elapsed = now - last_refill;
+	
+	/* Cap elapsed so the multiplication below can't overflow after a long idle period, the
+	 * bucket would be full by then anyway.
+	*/
+	if(elapsed > 1000000ULL * 3600)
+	{
+		elapsed = 1000000ULL * 3600;
+	}
+	
+	tokens += (long long)((elapsed * rate) / 1000000);
+	
+	if(tokens > (long long)(burst))
+	{
+		tokens = burst;
+	}
+	
+	/* Only advance by the time the added tokens were worth, so fractional tokens aren't
+	 * lost when this is called very often.
+	*/
+	if(tokens == (long long)(burst))
+	{
+		last_refill = now;
+	}
+	else{
+		last_refill += (((elapsed * rate) / 1000000) * 1000000) / rate;
+	}
+}
+
+DWORD TokenBucket::get_rate() const
+{
+	return rate;
+}
+
+void TokenBucket::set_rate(DWORD rate, DWORD burst)
+{
+	if(burst == 0)
+	{
+		burst = (DWORD)(((unsigned long long)(rate) * DEFAULT_BURST_MS) / 1000);
+	}
+	
+	if(burst < MIN_BURST)
+	{
+		burst = MIN_BURST;
+	}
+	
+	bool was_unlimited = (this->rate == 0);
+	
+	this->rate  = rate;
+	this->burst = burst;
+	
+	if(was_unlimited)
+	{
+		tokens      = burst;
+		last_refill = 0;
+	}
+	else if(tokens > (long long)(burst))
+	{
+		tokens = burst;
+	}
+}
+
+unsigned long long TokenBucket::ready_at(size_t bytes, unsigned long long now)
+{
+	if(rate == 0)
+	{
+		return now;
+	}
+	
+	refill(now);
+	
+	long long need = (bytes < burst ? (long long)(bytes) : (long long)(burst));
+	
+	if(tokens >= need)
+	{
+		return now;
+	}
+	
+	/* Round up so we don't wake up just before there are enough tokens. */
+	unsigned long long shortfall = (unsigned long long)(need - tokens);
+	return now + ((shortfall * 1000000) + rate - 1) / rate;
+}
+
+void TokenBucket::consume(size_t bytes, unsigned long long now)
+{
+	if(rate == 0)
+	{
+		return;
+	}
+	
+	refill(now);
+	tokens -= (long long)(bytes);
+}
@@ -0,0 +1,76 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_TOKENBUCKET_HPP
+#define DPLITE_TOKENBUCKET_HPP
+
+#include <winsock2.h>
+#include <windows.h>
+
+/* Token bucket rate limiter.
+ *
+ * Tokens (bytes) accumulate at the configured rate up to the burst size. Times are in
+ * microseconds (as returned by SendQueue::now()) and are passed in by the caller so the
+ * bucket doesn't care where they come from.
+ *
+ * A message larger than the burst size may be sent once the bucket is full, leaving it in
+ * debt until enough tokens have accumulated to pay for it.
+ *
+ * Not thread safe, the owner must serialise access.
+*/
+
+class TokenBucket
+{
+	private:
+		/* Burst size used when none is specified, in milliseconds' worth of tokens. */
+		static const DWORD DEFAULT_BURST_MS = 100;
+		
+		/* Burst size is never smaller than this, so a full-sized Ethernet frame can get out
+		 * even at very low rates.
+		*/
+		static const DWORD MIN_BURST = 1500;
+		
+		DWORD rate;   /* Bytes per second, 0 for unlimited. */
+		DWORD burst;  /* Maximum tokens. */
+		
+		long long tokens;
+		unsigned long long last_refill;
+		
+		void refill(unsigned long long now);
+		
+	public:
+		TokenBucket();
+		
+		DWORD get_rate() const;
+		
+		/* Change the rate, and the burst size (0 to pick one from the rate). A bucket which
+		 * was previously unlimited starts full, otherwise any tokens (or debt) carry over so
+		 * frequent rate changes don't hand out free bursts.
+		*/
+		void set_rate(DWORD rate, DWORD burst = 0);
+		
+		/* Returns the time at which there will be enough tokens to send bytes, now if
+		 * there are enough already.
+		*/
+		unsigned long long ready_at(size_t bytes, unsigned long long now);
+		
+		/* Remove tokens for bytes which have been sent, this may leave the bucket in debt. */
+		void consume(size_t bytes, unsigned long long now);
+};
+
+#endif /* !DPLITE_TOKENBUCKET_HPP */
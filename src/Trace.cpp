@@ -0,0 +1,439 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <atomic>
+#include <dplay8.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+#include "Log.hpp"
+#include "Messages.hpp"
+#include "Trace.hpp"
+
+std::atomic<int> trace_state(TRACE_UNINITIALISED);
+
+namespace
+{
+	struct TraceBuffer
+	{
+		TraceRecord records[TRACE_BUFFER_RECORDS];
+		
+		/* Index of the next record to be written, only ever modified by the owning
+		 * thread. claimed is advanced before a record is written and next after, so
+		 * a reader can tell which slots may have been overwritten while it was copying.
+		 * Records at or above cleared_at are valid.
+		*/
+		std::atomic<uint64_t> next;
+		std::atomic<uint64_t> claimed;
+		std::atomic<uint64_t> cleared_at;
+		
+		/* Owned by a running thread, protected by buffers_lock. */
+		bool in_use;
+		
+		/* Value of next when trace_save() last wrote the buffers out, protected by
+		 * buffers_lock.
+		*/
+		uint64_t saved_at;
+		
+		TraceBuffer(): next(0), claimed(0), cleared_at(0), in_use(true), saved_at(0) {}
+	};
+	
+	/* Releases the thread's buffer when it exits, so it can be picked up by the next
+	 * thread rather than allocating a new one. The records in it stay around until they
+	 * get overwritten.
+	*/
+	struct BufferOwner
+	{
+		TraceBuffer *buffer;
+		uint32_t thread;
+		
+		BufferOwner(): buffer(NULL), thread(0) {}
+		~BufferOwner();
+	};
+}
+
+static std::mutex buffers_lock;
+static std::list<TraceBuffer*> buffers;
+
+/* Serialises trace_save() so only one thread writes the trace file at a time. */
+static std::mutex save_lock;
+
+static thread_local BufferOwner owner;
+
+BufferOwner::~BufferOwner()
+{
+	if(buffer != NULL)
+	{
+		std::unique_lock<std::mutex> l(buffers_lock);
+		buffer->in_use = false;
+	}
+}
+
+static TraceBuffer *thread_buffer()
+{
+	if(owner.buffer == NULL)
+	{
+		std::unique_lock<std::mutex> l(buffers_lock);
+		
+		for(auto b = buffers.begin(); b != buffers.end(); ++b)
+		{
+			if(!(*b)->in_use)
+			{
+				(*b)->in_use = true;
+				owner.buffer = *b;
+				break;
+			}
+		}
+		
+		if(owner.buffer == NULL)
+		{
+			owner.buffer = new TraceBuffer();
+			buffers.push_back(owner.buffer);
+		}
+		
+		owner.thread = GetCurrentThreadId();
+	}
+	
+	return owner.buffer;
+}
+
+bool trace_init()
+{
+	int expect = TRACE_UNINITIALISED;
+	trace_state.compare_exchange_strong(expect, (log_trace_enabled() ? TRACE_ENABLED : TRACE_DISABLED));
+	
+	return trace_state.load() == TRACE_ENABLED;
+}
+
+void trace_set_enabled(bool enabled)
+{
+	trace_state.store(enabled ? TRACE_ENABLED : TRACE_DISABLED);
+}
+
+void trace_record(TraceEvent event, uint32_t peer, uint32_t type, uint32_t size, uint32_t handle)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	
+	TraceBuffer *b = thread_buffer();
+	uint64_t n = b->next.load(std::memory_order_relaxed);
+	
+	b->claimed.store(n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	
+	TraceRecord *r = &(b->records[n % TRACE_BUFFER_RECORDS]);
+	
+	r->time     = now.QuadPart;
+	r->thread   = owner.thread;
+	r->peer     = peer;
+	r->type     = type;
+	r->size     = size;
+	r->handle   = handle;
+	r->event    = event;
+	r->reserved = 0;
+	
+	b->next.store(n + 1, std::memory_order_release);
+}
+
+std::vector<TraceRecord> trace_snapshot()
+{
+	std::vector<TraceRecord> records;
+	
+	std::unique_lock<std::mutex> l(buffers_lock);
+	
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		uint64_t end   = (*b)->next.load(std::memory_order_acquire);
+		uint64_t begin = std::max((*b)->cleared_at.load(), (end > TRACE_BUFFER_RECORDS ? end - TRACE_BUFFER_RECORDS : 0));
+		
+		size_t base = records.size();
+		
+		for(uint64_t i = begin; i < end; ++i)
+		{
+			records.push_back((*b)->records[i % TRACE_BUFFER_RECORDS]);
+		}
+		
+		/* The owning thread may have carried on recording while we were copying, in
+		 * which case the oldest records we copied could have been overwritten
+		 * underneath us.
+		*/
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t claimed = (*b)->claimed.load(std::memory_order_relaxed);
+		
+		if(claimed > (begin + TRACE_BUFFER_RECORDS))
+		{
+			uint64_t torn = std::min<uint64_t>(claimed - (begin + TRACE_BUFFER_RECORDS), end - begin);
+			records.erase(records.begin() + base, records.begin() + base + torn);
+		}
+	}
+	
+	l.unlock();
+	
+	std::stable_sort(records.begin(), records.end(),
+		[](const TraceRecord &a, const TraceRecord &b)
+		{
+			return a.time < b.time;
+		});
+	
+	return records;
+}
+
+void trace_clear()
+{
+	std::unique_lock<std::mutex> l(buffers_lock);
+	
+	for(auto b = buffers.begin(); b != buffers.end(); ++b)
+	{
+		(*b)->cleared_at.store((*b)->next.load());
+	}
+}
+
+static const char *event_name(uint16_t event)
+{
+	switch(event)
+	{
+		case TE_SEND_ENQUEUE:  return "enqueue";
+		case TE_WIRE_WRITE:    return "write";
+		case TE_RECV_DECODE:   return "decode";
+		case TE_HANDLER_BEGIN: return "handler";
+		case TE_HANDLER_END:   return "handler";
+		default:               return "unknown";
+	}
+}
+
+static void append_event(std::string &json, const char *ph, const TraceRecord &r, double ts, double dur, DWORD pid)
+{
+	char buf[512];
+	
+	char dur_s[32] = "";
+	if(dur >= 0.0)
+	{
+		snprintf(dur_s, sizeof(dur_s), ",\"dur\":%.3f", dur);
+	}
+	
+	bool is_handler = (r.event == TE_HANDLER_BEGIN || r.event == TE_HANDLER_END);
+	
+	char name[128];
+	if(is_handler)
+	{
+		snprintf(name, sizeof(name), "%s", trace_message_name((TraceEvent)(r.event), r.type));
+	}
+	else{
+		snprintf(name, sizeof(name), "%s %s", event_name(r.event), trace_message_name((TraceEvent)(r.event), r.type));
+	}
+	
+	snprintf(buf, sizeof(buf),
+		"%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\"%s,\"ts\":%.3f%s,\"pid\":%u,\"tid\":%u,"
+		"\"args\":{\"peer\":%u,\"type\":\"0x%08X\",\"size\":%u,\"handle\":\"0x%08X\"}}",
+		(json.back() == '[' ? "\n" : ",\n"),
+		name, (is_handler ? "handler" : "packet"), ph, (strcmp(ph, "i") == 0 ? ",\"s\":\"t\"" : ""),
+		ts, dur_s, (unsigned)(pid), (unsigned)(r.thread),
+		(unsigned)(r.peer), (unsigned)(r.type), (unsigned)(r.size), (unsigned)(r.handle));
+	
+	json += buf;
+}
+
+std::string trace_to_chrome_json(const std::vector<TraceRecord> &records)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	
+	DWORD pid = GetCurrentProcessId();
+	
+	uint64_t base = records.empty() ? 0 : records.front().time;
+	auto usecs = [&](uint64_t t) { return (double)(t - base) * 1000000.0 / (double)(freq.QuadPart); };
+	
+	std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	
+	/* Handler calls which haven't returned yet, per thread. Handlers can be nested if
+	 * one calls back into DirectPlay and causes another message to be raised.
+	*/
+	std::map< uint32_t, std::vector<TraceRecord> > open_handlers;
+	
+	for(auto r = records.begin(); r != records.end(); ++r)
+	{
+		if(r->event == TE_HANDLER_BEGIN)
+		{
+			open_handlers[r->thread].push_back(*r);
+		}
+		else if(r->event == TE_HANDLER_END)
+		{
+			std::vector<TraceRecord> &open = open_handlers[r->thread];
+			
+			/* An end without a begin means the begin has been overwritten. */
+			if(!open.empty() && open.back().type == r->type)
+			{
+				append_event(json, "X", open.back(), usecs(open.back().time), usecs(r->time) - usecs(open.back().time), pid);
+				open.pop_back();
+			}
+		}
+		else{
+			append_event(json, "i", *r, usecs(r->time), -1.0, pid);
+		}
+	}
+	
+	/* Still inside the handler when the snapshot was taken. */
+	for(auto t = open_handlers.begin(); t != open_handlers.end(); ++t)
+	{
+		for(auto r = t->second.begin(); r != t->second.end(); ++r)
+		{
+			append_event(json, "B", *r, usecs(r->time), -1.0, pid);
+		}
+	}
+	
+	json += "\n]}\n";
+	
+	return json;
+}
+
+bool trace_export_chrome(const char *path)
+{
+	std::string json = trace_to_chrome_json(trace_snapshot());
+	
+	FILE *fh = fopen(path, "wb");
+	if(fh == NULL)
+	{
+		log_printf("Unable to open trace file %s", path);
+		return false;
+	}
+	
+	bool ok = fwrite(json.data(), 1, json.size(), fh) == json.size();
+	
+	if(fclose(fh) != 0)
+	{
+		ok = false;
+	}
+	
+	if(!ok)
+	{
+		log_printf("Unable to write trace file %s", path);
+	}
+	
+	return ok;
+}
+
+void trace_save()
+{
+	std::unique_lock<std::mutex> sl(save_lock);
+	
+	bool recorded = false;
+	
+	{
+		std::unique_lock<std::mutex> l(buffers_lock);
+		
+		for(auto b = buffers.begin(); b != buffers.end(); ++b)
+		{
+			uint64_t next = (*b)->next.load();
+			
+			if(next > (*b)->cleared_at.load() && next > (*b)->saved_at)
+			{
+				recorded = true;
+			}
+			
+			(*b)->saved_at = next;
+		}
+	}
+	
+	if(recorded)
+	{
+		const char *path = getenv("DPLITE_TRACE_FILE");
+		trace_export_chrome(path != NULL ? path : "dplite-trace.json");
+	}
+}
+
+const char *trace_message_name(TraceEvent event, uint32_t type)
+{
+	if(event == TE_HANDLER_BEGIN || event == TE_HANDLER_END)
+	{
+		switch(type)
+		{
+			case DPN_MSGID_ADD_PLAYER_TO_GROUP:       return "ADD_PLAYER_TO_GROUP";
+			case DPN_MSGID_APPLICATION_DESC:          return "APPLICATION_DESC";
+			case DPN_MSGID_ASYNC_OP_COMPLETE:         return "ASYNC_OP_COMPLETE";
+			case DPN_MSGID_CLIENT_INFO:               return "CLIENT_INFO";
+			case DPN_MSGID_CONNECT_COMPLETE:          return "CONNECT_COMPLETE";
+			case DPN_MSGID_CREATE_GROUP:              return "CREATE_GROUP";
+			case DPN_MSGID_CREATE_PLAYER:             return "CREATE_PLAYER";
+			case DPN_MSGID_DESTROY_GROUP:             return "DESTROY_GROUP";
+			case DPN_MSGID_DESTROY_PLAYER:            return "DESTROY_PLAYER";
+			case DPN_MSGID_ENUM_HOSTS_QUERY:          return "ENUM_HOSTS_QUERY";
+			case DPN_MSGID_ENUM_HOSTS_RESPONSE:       return "ENUM_HOSTS_RESPONSE";
+			case DPN_MSGID_GROUP_INFO:                return "GROUP_INFO";
+			case DPN_MSGID_HOST_MIGRATE:              return "HOST_MIGRATE";
+			case DPN_MSGID_INDICATE_CONNECT:          return "INDICATE_CONNECT";
+			case DPN_MSGID_INDICATED_CONNECT_ABORTED: return "INDICATED_CONNECT_ABORTED";
+			case DPN_MSGID_PEER_INFO:                 return "PEER_INFO";
+			case DPN_MSGID_RECEIVE:                   return "RECEIVE";
+			case DPN_MSGID_REMOVE_PLAYER_FROM_GROUP:  return "REMOVE_PLAYER_FROM_GROUP";
+			case DPN_MSGID_RETURN_BUFFER:             return "RETURN_BUFFER";
+			case DPN_MSGID_SEND_COMPLETE:             return "SEND_COMPLETE";
+			case DPN_MSGID_SERVER_INFO:               return "SERVER_INFO";
+			case DPN_MSGID_TERMINATE_SESSION:         return "TERMINATE_SESSION";
+			case DPN_MSGID_CREATE_THREAD:             return "CREATE_THREAD";
+			case DPN_MSGID_DESTROY_THREAD:            return "DESTROY_THREAD";
+			default:                                  return "UNKNOWN";
+		}
+	}
+	
+	switch(type)
+	{
+		case DPLITE_MSGID_HOST_ENUM_REQUEST:   return "HOST_ENUM_REQUEST";
+		case DPLITE_MSGID_HOST_ENUM_RESPONSE:  return "HOST_ENUM_RESPONSE";
+		case DPLITE_MSGID_CONNECT_HOST:        return "CONNECT_HOST";
+		case DPLITE_MSGID_CONNECT_HOST_OK:     return "CONNECT_HOST_OK";
+		case DPLITE_MSGID_CONNECT_HOST_FAIL:   return "CONNECT_HOST_FAIL";
+		case DPLITE_MSGID_MESSAGE:             return "MESSAGE";
+		case DPLITE_MSGID_PLAYERINFO:          return "PLAYERINFO";
+		case DPLITE_MSGID_ACK:                 return "ACK";
+		case DPLITE_MSGID_APPDESC:             return "APPDESC";
+		case DPLITE_MSGID_CONNECT_PEER:        return "CONNECT_PEER";
+		case DPLITE_MSGID_CONNECT_PEER_OK:     return "CONNECT_PEER_OK";
+		case DPLITE_MSGID_CONNECT_PEER_FAIL:   return "CONNECT_PEER_FAIL";
+		case DPLITE_MSGID_DESTROY_PEER:        return "DESTROY_PEER";
+		case DPLITE_MSGID_TERMINATE_SESSION:   return "TERMINATE_SESSION";
+		case DPLITE_MSGID_GROUP_ALLOCATE:      return "GROUP_ALLOCATE";
+		case DPLITE_MSGID_GROUP_CREATE:        return "GROUP_CREATE";
+		case DPLITE_MSGID_GROUP_DESTROY:       return "GROUP_DESTROY";
+		case DPLITE_MSGID_GROUP_JOIN:          return "GROUP_JOIN";
+		case DPLITE_MSGID_GROUP_JOINED:        return "GROUP_JOINED";
+		case DPLITE_MSGID_GROUP_LEAVE:         return "GROUP_LEAVE";
+		case DPLITE_MSGID_GROUP_LEFT:          return "GROUP_LEFT";
+		case DPLITE_MSGID_HOST_MIGRATE:        return "HOST_MIGRATE";
+		case DPLITE_MSGID_PING:                return "PING";
+		case DPLITE_MSGID_PONG:                return "PONG";
+		case DPLITE_MSGID_MESSAGE_FRAGMENT:    return "MESSAGE_FRAGMENT";
+		case DPLITE_MSGID_RELAY_JOIN:          return "RELAY_JOIN";
+		case DPLITE_MSGID_RELAY_JOIN_OK:       return "RELAY_JOIN_OK";
+		case DPLITE_MSGID_RELAY_JOIN_FAIL:     return "RELAY_JOIN_FAIL";
+		case DPLITE_MSGID_RELAY_SEND:          return "RELAY_SEND";
+		case DPLITE_MSGID_RELAY_RECV:          return "RELAY_RECV";
+		case DPLITE_MSGID_RELAY_PEER_JOINED:   return "RELAY_PEER_JOINED";
+		case DPLITE_MSGID_RELAY_PEER_LEFT:     return "RELAY_PEER_LEFT";
+		default:                               return "UNKNOWN";
+	}
+}
@@ -0,0 +1,141 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_TRACE_HPP
+#define DPLITE_TRACE_HPP
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* Per-message trace points.
+ *
+ * When the DPLITE_TRACE environment variable is set to a non-zero value, each message
+ * passing through a peer leaves a fixed-size record at the point where it is queued for
+ * sending, written to the wire, decoded after being received and where the application's
+ * message handler is called and returns. Records go into a per-thread ring buffer which
+ * keeps the most recent TRACE_BUFFER_RECORDS records from each thread, no locks are
+ * taken on the recording path.
+ *
+ * The buffers are written out as Chrome trace JSON (load in chrome://tracing or Perfetto)
+ * to the file named by DPLITE_TRACE_FILE (default dplite-trace.json) when the DLL is
+ * unloaded, or whenever trace_export_chrome() is called.
+ *
+ * Defining DPLITE_NO_TRACE when building removes the trace points entirely. Otherwise a
+ * trace point costs one relaxed atomic load while tracing is disabled.
+*/
+
+enum TraceEvent
+{
+	TE_SEND_ENQUEUE = 1,  /* Packet added to a SendQueue. */
+	TE_WIRE_WRITE,        /* Packet (or part of one) written to a peer's socket. */
+	TE_RECV_DECODE,       /* Packet received from a peer and deserialised. */
+	TE_HANDLER_BEGIN,     /* Application message handler called. */
+	TE_HANDLER_END,       /* Application message handler returned. */
+};
+
+/* peer is the internal peer (connection) ID for the packet events and the player DPNID,
+ * where there is one, for the handler events. type is a DPLITE_MSGID_* value for packet
+ * events and a DPN_MSGID_* value for handler events. handle is the async operation or
+ * buffer handle associated with the message, if any.
+*/
+struct TraceRecord
+{
+	uint64_t time;     /* Performance counter ticks. */
+	uint32_t thread;
+	uint32_t peer;
+	uint32_t type;
+	uint32_t size;
+	uint32_t handle;
+	uint16_t event;    /* TraceEvent */
+	uint16_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord must be 32 bytes");
+
+static const size_t TRACE_BUFFER_RECORDS = 16384;
+
+enum {
+	TRACE_UNINITIALISED = 0,
+	TRACE_DISABLED,
+	TRACE_ENABLED,
+};
+
+extern std::atomic<int> trace_state;
+
+/* Reads DPLITE_TRACE, returns true if tracing is enabled. */
+bool trace_init();
+
+inline bool trace_active()
+{
+	int s = trace_state.load(std::memory_order_relaxed);
+	
+	if(s == TRACE_ENABLED)
+	{
+		return true;
+	}
+	else if(s == TRACE_UNINITIALISED)
+	{
+		return trace_init();
+	}
+	else{
+		return false;
+	}
+}
+
+/* Enables or disables recording at runtime, overriding DPLITE_TRACE. */
+void trace_set_enabled(bool enabled);
+
+void trace_record(TraceEvent event, uint32_t peer, uint32_t type, uint32_t size, uint32_t handle);
+
+/* Returns all records currently held in the thread buffers, ordered by time. */
+std::vector<TraceRecord> trace_snapshot();
+
+/* Discards all records currently held in the thread buffers. */
+void trace_clear();
+
+/* Formats records as a Chrome trace JSON document. Matching handler begin/end records on
+ * the same thread become complete ("X") events, everything else is an instant event.
+*/
+std::string trace_to_chrome_json(const std::vector<TraceRecord> &records);
+
+/* Writes the current contents of the thread buffers to path as Chrome trace JSON. */
+bool trace_export_chrome(const char *path);
+
+/* Exports to DPLITE_TRACE_FILE if anything has been recorded since the last call. Called
+ * as each instance is closed rather than when the DLL is unloaded, since the export does
+ * file I/O which mustn't happen under the loader lock.
+*/
+void trace_save();
+
+const char *trace_message_name(TraceEvent event, uint32_t type);
+
+#ifdef DPLITE_NO_TRACE
+#define TRACE_POINT(event, peer, type, size, handle) do {} while(0)
+#else
+#define TRACE_POINT(event, peer, type, size, handle) \
+	do { \
+		if(trace_active()) \
+		{ \
+			trace_record((event), (peer), (type), (size), (handle)); \
+		} \
+	} while(0)
+#endif
+
+#endif /* !DPLITE_TRACE_HPP */
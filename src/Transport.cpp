@@ -0,0 +1,162 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <windows.h>
+
+#include "Log.hpp"
+#include "network.hpp"
+#include "Transport.hpp"
+
+SocketTransport *SocketTransport::get()
+{
+	static SocketTransport transport;
+	return &transport;
+}
+
+int SocketTransport::create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	return ::create_udp_socket(ipaddr, port, options);
+}
+
+int SocketTransport::create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
+{
+	return ::create_listener_socket(ipaddr, port, options);
+}
+
+bool SocketTransport::create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	return ::create_auto_port_sockets(ipaddr, udp_sock, listener_sock, port, options);
+}
+
+int SocketTransport::create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
+{
+	return ::create_client_socket(local_ipaddr, local_port, options);
+}
+
+int SocketTransport::create_discovery_socket()
+{
+	return ::create_discovery_socket();
+}
+
+void SocketTransport::apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	::apply_socket_options(sock, stream, options);
+}
+
+bool SocketTransport::setup_accepted_socket(int sock, const SocketOptions &options)
+{
+	struct linger li;
+	li.l_onoff = 0;
+	li.l_linger = 0;
+	
+	if(setsockopt(sock, SOL_SOCKET, SO_LINGER, (char*)(&li), sizeof(li)) != 0)
+	{
+		DWORD err = WSAGetLastError();
+		log_printf("Failed to set SO_LINGER parameters on accepted connection: %s", win_strerror(err).c_str());
+		
+		/* Not fatal, since this probably won't matter in production. */
+	}
+	
+	u_long non_blocking = 1;
+	if(ioctlsocket(sock, FIONBIO, &non_blocking) != 0)
+	{
+		DWORD err = WSAGetLastError();
+		log_printf("Failed to set accepted connection to non-blocking mode: %s", win_strerror(err).c_str());
+		log_printf("Closing connection");
+		
+		closesocket(sock);
+		return false;
+	}
+	
+	/* Set SO_LINGER so that closesocket() does a hard close, immediately removing the socket
+	 * address from the connection table.
+	 *
+	 * If this isn't done, then we are able to immediately bind() new sockets to the same
+	 * local address (as we may when the port isn't specified), but then outgoing connections
+	 * made from it will fail with WSAEADDRINUSE until the background close completes.
+	*/
+	
+	struct linger no_linger;
+	no_linger.l_onoff  = 1;
+	no_linger.l_linger = 0;
+	
+	if(setsockopt(sock, SOL_SOCKET, SO_LINGER, (char*)(&no_linger), sizeof(no_linger)) != 0)
+	{
+		DWORD err = WSAGetLastError();
+		log_printf("Failed to set SO_LINGER on accepted connection: %s", win_strerror(err).c_str());
+	}
+	
+	/* Windows should've copied these from the listener, but make sure. */
+	::apply_socket_options(sock, true, options);
+	
+	return true;
+}
+
+int SocketTransport::event_select(int sock, HANDLE event, long events)
+{
+	return WSAEventSelect(sock, event, events);
+}
+
+int SocketTransport::accept(int sock, struct sockaddr_in *addr)
+{
+	int addrlen = sizeof(*addr);
+	return ::accept(sock, (struct sockaddr*)(addr), &addrlen);
+}
+
+int SocketTransport::connect(int sock, const struct sockaddr_in *addr)
+{
+	return ::connect(sock, (const struct sockaddr*)(addr), sizeof(*addr));
+}
+
+int SocketTransport::get_socket_error(int sock, int *error)
+{
+	int esize = sizeof(*error);
+	return getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)(error), &esize);
+}
+
+int SocketTransport::send(int sock, const void *data, size_t size)
+{
+	return ::send(sock, (const char*)(data), size, 0);
+}
+
+int SocketTransport::recv(int sock, void *buf, size_t size)
+{
+	return ::recv(sock, (char*)(buf), size, 0);
+}
+
+int SocketTransport::sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen)
+{
+	return ::sendto(sock, (const char*)(data), size, 0, addr, addrlen);
+}
+
+int SocketTransport::recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr)
+{
+	int fa_len = sizeof(*from_addr);
+	return ::recvfrom(sock, (char*)(buf), size, 0, (struct sockaddr*)(from_addr), &fa_len);
+}
+
+int SocketTransport::shutdown_send(int sock)
+{
+	return shutdown(sock, SD_SEND);
+}
+
+void SocketTransport::close(int sock)
+{
+	closesocket(sock);
+}
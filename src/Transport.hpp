@@ -0,0 +1,150 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_TRANSPORT_HPP
+#define DPLITE_TRANSPORT_HPP
+
+#include <winsock2.h>
+#include <stdint.h>
+#include <windows.h>
+
+#include "network.hpp"
+
+/* The socket operations used by DirectPlay8Peer.
+ *
+ * Calls follow the Winsock functions they stand in for: sockets are ints, failures return
+ * -1 (or false) with the error left in WSAGetLastError(), and readiness is reported by
+ * setting the event passed to event_select() the same way WSAEventSelect() does.
+ *
+ * SocketTransport passes everything straight through to Winsock, LoopbackTransport
+ * implements the same behaviour in memory for tests and benchmarks.
+*/
+
+class Transport
+{
+	public:
+		virtual ~Transport() {}
+		
+		/* See network.hpp */
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) = 0;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) = 0;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) = 0;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) = 0;
+		virtual int create_discovery_socket() = 0;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) = 0;
+		
+		/* Prepares a socket returned by accept() for use. The socket is closed if this
+		 * fails.
+		*/
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) = 0;
+		
+		virtual int event_select(int sock, HANDLE event, long events) = 0;
+		virtual int accept(int sock, struct sockaddr_in *addr) = 0;
+		virtual int connect(int sock, const struct sockaddr_in *addr) = 0;
+		
+		/* Stores the SO_ERROR value of sock in *error. */
+		virtual int get_socket_error(int sock, int *error) = 0;
+		
+		virtual int send(int sock, const void *data, size_t size) = 0;
+		virtual int recv(int sock, void *buf, size_t size) = 0;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) = 0;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) = 0;
+		virtual int shutdown_send(int sock) = 0;
+		virtual void close(int sock) = 0;
+		
+		/* Instance GUID to use when hosting a session, for transports which stand in for
+		 * a recorded one. Returns false if a new GUID should be generated.
+		*/
+		virtual bool get_host_instance(GUID *instance) { return false; }
+		
+		/* Called once a peer has hosted or joined a session and knows its player ID, and
+		 * when it leaves again. Transports which can route connections by player (such as
+		 * RelayTransport) use these to register with their relay.
+		 *
+		 * relay_token is the one the host got from admit_player() for us, or GUID_NULL
+		 * when hosting.
+		*/
+		virtual void session_joined(const GUID &instance, DWORD player_id, const GUID &relay_token) {}
+		virtual void session_left() {}
+		
+		/* Called by the host when it accepts a new player, to let them register with the
+		 * same relay as player_id (and nobody else). Stores the token to pass to their
+		 * session_joined() in *relay_token, or GUID_NULL if there is nothing to join.
+		*/
+		virtual void admit_player(DWORD player_id, GUID *relay_token)
+		{
+			*relay_token = GUID_NULL;
+		}
+		
+		/* Begins a connection to another player in the current session by some route other
+		 * than its address, for when connecting directly has failed. Returns a socket which
+		 * completes like one passed to connect(), or -1 with WSAEOPNOTSUPP if there is no
+		 * other route.
+		*/
+		virtual int connect_player(DWORD player_id, const SocketOptions &options)
+		{
+			WSASetLastError(WSAEOPNOTSUPP);
+			return -1;
+		}
+		
+		/* Writes the same data to several stream sockets in one go, for transports which
+		 * can do that more cheaply than a send() on each (RelayTransport uploads it to the
+		 * relay once). Either all of it goes to every socket, or nothing is sent and false
+		 * is returned, in which case the caller should send() to each as normal.
+		 *
+		 * Only sockets for which can_send_multi() returns true may be passed. The caller
+		 * must only do this where each stream is at a message boundary.
+		*/
+		virtual bool can_send_multi(int sock) { return false; }
+		
+		virtual bool send_multi(const int *socks, size_t n_socks, const void *data, size_t size)
+		{
+			WSASetLastError(WSAEOPNOTSUPP);
+			return false;
+		}
+};
+
+/* Real sockets. */
+class SocketTransport: public Transport
+{
+	public:
+		/* Process-wide instance, used when no other transport is given. */
+		static SocketTransport *get();
+		
+		virtual int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options) override;
+		virtual bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options) override;
+		virtual int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options) override;
+		virtual int create_discovery_socket() override;
+		virtual void apply_socket_options(int sock, bool stream, const SocketOptions &options) override;
+		virtual bool setup_accepted_socket(int sock, const SocketOptions &options) override;
+		
+		virtual int event_select(int sock, HANDLE event, long events) override;
+		virtual int accept(int sock, struct sockaddr_in *addr) override;
+		virtual int connect(int sock, const struct sockaddr_in *addr) override;
+		virtual int get_socket_error(int sock, int *error) override;
+		
+		virtual int send(int sock, const void *data, size_t size) override;
+		virtual int recv(int sock, void *buf, size_t size) override;
+		virtual int sendto(int sock, const void *data, size_t size, const struct sockaddr *addr, int addrlen) override;
+		virtual int recvfrom(int sock, void *buf, size_t size, struct sockaddr_in *from_addr) override;
+		virtual int shutdown_send(int sock) override;
+		virtual void close(int sock) override;
+};
+
+#endif /* !DPLITE_TRANSPORT_HPP */
@@ -0,0 +1,182 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdexcept>
+#include <stdint.h>
+
+#include "WorkQueue.hpp"
+
+static size_t round_up_pow2(size_t n)
+{
+	size_t p = 2;
+	while(p < n)
+	{
+		p <<= 1;
+	}
+	
+	return p;
+}
+
+WorkQueue::WorkQueue(size_t capacity):
+	mask(round_up_pow2(capacity) - 1),
+	push_pos(0),
+	pop_pos(0),
+	overflow_size(0)
+{
+	cells = new Cell[mask + 1];
+	
+	for(size_t i = 0; i <= mask; ++i)
+	{
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+WorkQueue::~WorkQueue()
+{
+	delete[] cells;
+}
+
+void WorkQueue::push(const std::function<void()> &work)
+{
+	/* Once anything has overflowed, everything goes to the overflow queue until it has been
+	 * drained, else newer items in the ring could overtake the older ones in there.
+	*/
+	if(overflow_size.load(std::memory_order_acquire) == 0 && ring_push(work))
+	{
+		return;
+	}
+	
+	std::unique_lock<std::mutex> l(overflow_lock);
+	
+	overflow.push(work);
+	overflow_size.fetch_add(1, std::memory_order_release);
+}
+
+bool WorkQueue::pop(std::function<void()> &work)
+{
+	if(ring_pop(work))
+	{
+		return true;
+	}
+	
+	if(overflow_size.load(std::memory_order_acquire) == 0)
+	{
+		return false;
+	}
+	
+	std::unique_lock<std::mutex> l(overflow_lock);
+	
+	/* Anything pushed into the ring before the overflow started must be popped first. */
+	if(ring_pop(work))
+	{
+		return true;
+	}
+	
+	if(overflow.empty())
+	{
+		return false;
+	}
+	
+	work = std::move(overflow.front());
+	overflow.pop();
+	
+	overflow_size.fetch_sub(1, std::memory_order_release);
+	
+	return true;
+}
+
+bool WorkQueue::ring_push(const std::function<void()> &work)
+{
+	size_t pos = push_pos.load(std::memory_order_relaxed);
+	Cell *cell;
+	
+	while(1)
+	{
+		cell = &(cells[pos & mask]);
+		
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq) - (intptr_t)(pos);
+		
+		if(diff == 0)
+		{
+			/* Cell is free, try to claim it. */
+			if(push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if(diff < 0)
+		{
+			/* Cell still holds an item from the previous lap, the ring is full. */
+			return false;
+		}
+		else{
+			/* Another producer claimed this cell, try again from the new position. */
+			pos = push_pos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	cell->work = work;
+	cell->sequence.store(pos + 1, std::memory_order_release);
+	
+	return true;
+}
+
+bool WorkQueue::ring_pop(std::function<void()> &work)
+{
+	size_t pos = pop_pos.load(std::memory_order_relaxed);
+	Cell *cell;
+	
+	while(1)
+	{
+		cell = &(cells[pos & mask]);
+		
+		size_t seq = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)(seq) - (intptr_t)(pos + 1);
+		
+		if(diff == 0)
+		{
+			/* Cell has been filled, try to claim it. */
+			if(pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if(diff < 0)
+		{
+			/* Cell hasn't been filled yet, the ring is empty. */
+			return false;
+		}
+		else{
+			/* Another consumer claimed this cell, try again from the new position. */
+			pos = pop_pos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	work = std::move(cell->work);
+	cell->work = nullptr;
+	
+	/* Release the cell for the producers on the next lap. */
+	cell->sequence.store(pos + mask + 1, std::memory_order_release);
+	
+	return true;
+}
@@ -0,0 +1,78 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_WORKQUEUE_HPP
+#define DPLITE_WORKQUEUE_HPP
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stddef.h>
+
+/* Multi-producer, multi-consumer queue of work functors.
+ *
+ * Items are stored in a fixed size ring buffer which producers and consumers claim slots in
+ * using atomic sequence numbers rather than a lock (Dmitry Vyukov's bounded MPMC queue). If the
+ * ring is ever full, push() falls back to a mutex protected overflow queue so that it never
+ * fails, and keeps using it until the consumers have drained it, so items from a single producer
+ * are still popped in the order they were pushed.
+ *
+ * Note that with multiple consumers, items may still be EXECUTED out of order.
+*/
+
+class WorkQueue
+{
+	private:
+		/* No copy c'tor. */
+		WorkQueue(const WorkQueue&) = delete;
+		
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			std::function<void()> work;
+		};
+		
+		Cell *cells;
+		const size_t mask;
+		
+		/* Keep the producer and consumer positions on their own cache lines so they don't
+		 * bounce between cores which are only pushing or only popping.
+		*/
+		alignas(64) std::atomic<size_t> push_pos;
+		alignas(64) std::atomic<size_t> pop_pos;
+		
+		alignas(64) std::mutex overflow_lock;
+		std::queue< std::function<void()> > overflow;
+		std::atomic<size_t> overflow_size;
+		
+		bool ring_push(const std::function<void()> &work);
+		bool ring_pop(std::function<void()> &work);
+		
+	public:
+		/* capacity is rounded up to the next power of two. */
+		WorkQueue(size_t capacity);
+		~WorkQueue();
+		
+		void push(const std::function<void()> &work);
+		
+		/* Pop the oldest item into work, returns false if the queue was empty. */
+		bool pop(std::function<void()> &work);
+};
+
+#endif /* !DPLITE_WORKQUEUE_HPP */
@@ -23,8 +23,12 @@
 #include <windows.h>
 
 #include "DirectPlay8Address.hpp"
+#include "DirectPlay8Client.hpp"
 #include "DirectPlay8Peer.hpp"
+#include "DirectPlay8Server.hpp"
+#include "DirectPlay8ThreadPool.hpp"
 #include "Factory.hpp"
+#include "Log.hpp"
 
 /* Sum of refcounts of all created COM objects. */
 static std::atomic<unsigned int> global_refcount;
@@ -35,6 +39,11 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 	{
 		global_refcount = 0;
 	}
+	else if(fdwReason == DLL_PROCESS_DETACH)
+	{
+		/* Write out anything still sitting in the log buffers. */
+		log_fini();
+	}
 	
 	return TRUE;
 }
@@ -61,6 +70,21 @@ HRESULT CALLBACK DllGetClassObject(REFCLSID rclsid, REFIID riid, LPVOID *ppv)
 		*((IUnknown**)(ppv)) = new Factory<DirectPlay8Peer, IID_IDirectPlay8Peer>(&global_refcount);
 		return S_OK;
 	}
+	else if(rclsid == CLSID_DirectPlay8Server)
+	{
+		*((IUnknown**)(ppv)) = new Factory<DirectPlay8Server, IID_IDirectPlay8Server>(&global_refcount);
+		return S_OK;
+	}
+	else if(rclsid == CLSID_DirectPlay8Client)
+	{
+		*((IUnknown**)(ppv)) = new Factory<DirectPlay8Client, IID_IDirectPlay8Client>(&global_refcount);
+		return S_OK;
+	}
+	else if(rclsid == CLSID_DirectPlay8ThreadPool)
+	{
+		*((IUnknown**)(ppv)) = new Factory<DirectPlay8ThreadPool, IID_IDirectPlay8ThreadPool>(&global_refcount);
+		return S_OK;
+	}
 	else{
 		return CLASS_E_CLASSNOTAVAILABLE;
 	}
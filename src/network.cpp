@@ -17,6 +17,7 @@
 */
 
 #include <winsock2.h>
+#include <dplite.h>
 #include <iphlpapi.h>
 #include <windows.h>
 #include <ws2tcpip.h>
@@ -27,7 +28,91 @@
 #include "network.hpp"
 #include "log.hpp"
 
-int create_udp_socket(uint32_t ipaddr, uint16_t port)
+SocketOptions::SocketOptions():
+	nodelay(false),
+	send_buffer(0),
+	recv_buffer(0),
+	tos(-1) {}
+
+SocketOptions SocketOptions::from_profile(DWORD profile, DWORD buffer_size)
+{
+	SocketOptions options;
+	
+	switch(profile)
+	{
+		case DPLITE_SOCKET_PROFILE_LOW_LATENCY:
+			options.nodelay     = true;
+			options.send_buffer = 64 * 1024;
+			options.recv_buffer = 256 * 1024;
+			options.tos         = 0xB8;  /* DSCP EF (Expedited Forwarding) */
+			break;
+			
+		case DPLITE_SOCKET_PROFILE_HIGH_THROUGHPUT:
+			options.send_buffer = 4 * 1024 * 1024;
+			options.recv_buffer = 4 * 1024 * 1024;
+			options.tos         = 0x08;  /* IPTOS_THROUGHPUT */
+			break;
+			
+		case DPLITE_SOCKET_PROFILE_LAN:
+			options.nodelay     = true;
+			options.send_buffer = 1024 * 1024;
+			options.recv_buffer = 1024 * 1024;
+			break;
+			
+		default:
+			break;
+	}
+	
+	if(buffer_size != 0)
+	{
+		options.send_buffer = buffer_size;
+		options.recv_buffer = buffer_size;
+	}
+	
+	return options;
+}
+
+void apply_socket_options(int sock, bool stream, const SocketOptions &options)
+{
+	if(stream)
+	{
+		BOOL nodelay = options.nodelay ? TRUE : FALSE;
+		if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)(&nodelay), sizeof(BOOL)) == -1)
+		{
+			log_printf("Unable to set TCP_NODELAY on socket: %s", win_strerror(WSAGetLastError()).c_str());
+		}
+	}
+	
+	if(options.send_buffer > 0)
+	{
+		if(setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)(&(options.send_buffer)), sizeof(int)) == -1)
+		{
+			log_printf("Unable to set SO_SNDBUF on socket: %s", win_strerror(WSAGetLastError()).c_str());
+		}
+	}
+	
+	if(options.recv_buffer > 0)
+	{
+		if(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)(&(options.recv_buffer)), sizeof(int)) == -1)
+		{
+			log_printf("Unable to set SO_RCVBUF on socket: %s", win_strerror(WSAGetLastError()).c_str());
+		}
+	}
+	
+	if(options.tos >= 0)
+	{
+		/* Windows ignores IP_TOS unless the administrator has enabled it, so this is
+		 * only a hint.
+		*/
+		DWORD tos = options.tos;
+		if(setsockopt(sock, IPPROTO_IP, IP_TOS, (char*)(&tos), sizeof(DWORD)) == -1)
+		{
+			log_printf("Unable to set IP_TOS on socket: %s", win_strerror(WSAGetLastError()).c_str());
+		}
+	}
+}
+
+int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
 {
 	int sock = socket(AF_INET, SOCK_DGRAM, 0);
 	if(sock == -1)
@@ -49,6 +134,8 @@ int create_udp_socket(uint32_t ipaddr, uint16_t port)
 		return -1;
 	}
 	
+	apply_socket_options(sock, false, options);
+	
 	struct sockaddr_in addr;
 	addr.sin_family      = AF_INET;
 	addr.sin_addr.s_addr = ipaddr;
@@ -56,14 +143,20 @@ int create_udp_socket(uint32_t ipaddr, uint16_t port)
 	
 	if(bind(sock, (struct sockaddr*)(&addr), sizeof(addr)) == -1)
 	{
+		/* Preserve the bind() error so create_auto_port_sockets() can tell whether the
+		 * port was taken.
+		*/
+		int err = WSAGetLastError();
 		closesocket(sock);
+		WSASetLastError(err);
+		
 		return -1;
 	}
 	
 	return sock;
 }
 
-int create_listener_socket(uint32_t ipaddr, uint16_t port)
+int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	if(sock == -1)
@@ -85,6 +178,9 @@ int create_listener_socket(uint32_t ipaddr, uint16_t port)
 		return -1;
 	}
 	
+	/* Accepted sockets inherit these from the listener. */
+	apply_socket_options(sock, true, options);
+	
 	struct sockaddr_in addr;
 	addr.sin_family      = AF_INET;
 	addr.sin_addr.s_addr = ipaddr;
@@ -105,7 +201,62 @@ int create_listener_socket(uint32_t ipaddr, uint16_t port)
 	return sock;
 }
 
-int create_client_socket(uint32_t local_ipaddr, uint16_t local_port)
+bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options)
+{
+	/* Let the kernel pick a free port for the listener, then bind the UDP socket to the
+	 * same port. The TCP and UDP port spaces are separate, so the UDP bind only fails if
+	 * something else happens to have that UDP port, in which case we just try again with
+	 * a new listener. Any other failure is returned immediately rather than being retried
+	 * for every port in the range.
+	*/
+	
+	for(int attempt = 0; attempt < AUTO_PORT_ATTEMPTS; ++attempt)
+	{
+		int l_sock = create_listener_socket(ipaddr, 0, options);
+		if(l_sock == -1)
+		{
+			return false;
+		}
+		
+		struct sockaddr_in l_addr;
+		int l_addrlen = sizeof(l_addr);
+		
+		if(getsockname(l_sock, (struct sockaddr*)(&l_addr), &l_addrlen) != 0)
+		{
+			closesocket(l_sock);
+			return false;
+		}
+		
+		uint16_t l_port = ntohs(l_addr.sin_port);
+		
+		int u_sock = create_udp_socket(ipaddr, l_port, options);
+		if(u_sock == -1)
+		{
+			int err = WSAGetLastError();
+			closesocket(l_sock);
+			
+			if(err == WSAEADDRINUSE || err == WSAEACCES)
+			{
+				log_printf("UDP port %u is in use, picking another port", (unsigned)(l_port));
+				continue;
+			}
+			else{
+				return false;
+			}
+		}
+		
+		*udp_sock      = u_sock;
+		*listener_sock = l_sock;
+		*port          = l_port;
+		
+		return true;
+	}
+	
+	log_printf("Unable to find a free port after %d attempts", AUTO_PORT_ATTEMPTS);
+	return false;
+}
+
+int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options)
 {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 	if(sock == -1)
@@ -145,6 +296,8 @@ int create_client_socket(uint32_t local_ipaddr, uint16_t local_port)
 		return -1;
 	}
 	
+	apply_socket_options(sock, true, options);
+	
 	struct sockaddr_in l_addr;
 	l_addr.sin_family      = AF_INET;
 	l_addr.sin_addr.s_addr = local_ipaddr;
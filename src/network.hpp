@@ -29,15 +29,49 @@
 #define LISTEN_QUEUE_SIZE 16
 #define MAX_PACKET_SIZE   (256 * 1024)
 
+/* Number of kernel-assigned ports create_auto_port_sockets() will try before giving up. */
+#define AUTO_PORT_ATTEMPTS 32
+
+/* Application messages larger than this are split into fragments of up to this size. */
+#define MAX_FRAGMENT_SIZE (64 * 1024)
+
+/* Largest application message we will send or reassemble. */
+#define MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+
+/* Options applied to sockets by the create_*_socket() functions. */
+struct SocketOptions
+{
+	bool nodelay;     /* Disable Nagle's algorithm (TCP only). */
+	int send_buffer;  /* SO_SNDBUF, 0 to leave at the system default. */
+	int recv_buffer;  /* SO_RCVBUF, 0 to leave at the system default. */
+	int tos;          /* IP_TOS, -1 to leave at the system default. */
+	
+	SocketOptions();
+	
+	/* Returns the options for a DPLITE_SOCKET_PROFILE_* value, with the buffer sizes
+	 * replaced by buffer_size if it is non-zero.
+	*/
+	static SocketOptions from_profile(DWORD profile, DWORD buffer_size = 0);
+};
+
 struct SystemNetworkInterface {
 	std::wstring friendly_name;
 	
 	std::list<struct sockaddr_storage> unicast_addrs;
 };
 
-int create_udp_socket(uint32_t ipaddr, uint16_t port);
-int create_listener_socket(uint32_t ipaddr, uint16_t port);
-int create_client_socket(uint32_t local_ipaddr, uint16_t local_port);
+/* Applies options to an existing socket. Failures are logged but otherwise ignored since
+ * none of the options are required for the socket to work.
+*/
+void apply_socket_options(int sock, bool stream, const SocketOptions &options);
+
+int create_udp_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options = SocketOptions());
+int create_listener_socket(uint32_t ipaddr, uint16_t port, const SocketOptions &options = SocketOptions());
+
+/* Creates a UDP socket and listener socket bound to the same kernel-assigned port. */
+bool create_auto_port_sockets(uint32_t ipaddr, int *udp_sock, int *listener_sock, uint16_t *port, const SocketOptions &options = SocketOptions());
+
+int create_client_socket(uint32_t local_ipaddr, uint16_t local_port, const SocketOptions &options = SocketOptions());
 int create_discovery_socket();
 std::list<SystemNetworkInterface> get_network_interfaces();
 
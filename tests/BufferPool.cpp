@@ -0,0 +1,89 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <string.h>
+#include <windows.h>
+
+#include "../src/BufferPool.hpp"
+
+TEST(BufferPool, SmallBuffersNotPooled)
+{
+	BufferPool pool(1024, 1024 * 1024);
+	
+	unsigned char *b = pool.get(100);
+	ASSERT_NE(b, (unsigned char*)(NULL));
+	
+	memset(b, 0xAA, 100);
+	
+	pool.put(b);
+	EXPECT_EQ(pool.get_retained(), 0U);
+}
+
+TEST(BufferPool, LargeBuffersReused)
+{
+	BufferPool pool(1024, 1024 * 1024);
+	
+	unsigned char *b1 = pool.get(3000);
+	ASSERT_NE(b1, (unsigned char*)(NULL));
+	
+	/* Rounded up to 4096. */
+	memset(b1, 0xAA, 4096);
+	
+	pool.put(b1);
+	EXPECT_EQ(pool.get_retained(), 4096U);
+	
+	/* Anything which rounds to the same size gets the same buffer back. */
+	unsigned char *b2 = pool.get(4000);
+	EXPECT_EQ(b2, b1);
+	EXPECT_EQ(pool.get_retained(), 0U);
+	
+	/* But not a bigger one. */
+	pool.put(b2);
+	
+	unsigned char *b3 = pool.get(5000);
+	EXPECT_NE(b3, b1);
+	EXPECT_EQ(pool.get_retained(), 4096U);
+	
+	pool.put(b3);
+	EXPECT_EQ(pool.get_retained(), 4096U + 8192U);
+}
+
+TEST(BufferPool, RetainLimit)
+{
+	BufferPool pool(1024, 10000);
+	
+	unsigned char *b1 = pool.get(4096);
+	unsigned char *b2 = pool.get(4096);
+	unsigned char *b3 = pool.get(4096);
+	
+	pool.put(b1);
+	pool.put(b2);
+	pool.put(b3);
+	
+	/* Only two fit within the limit, the third is freed. */
+	EXPECT_EQ(pool.get_retained(), 8192U);
+}
+
+TEST(BufferPool, AllocationFailure)
+{
+	BufferPool pool(1024, 1024 * 1024);
+	
+	EXPECT_EQ(pool.get((size_t)(-1)), (unsigned char*)(NULL));
+}
@@ -0,0 +1,279 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+#include "../src/CaptureTransport.hpp"
+#include "../src/Clock.hpp"
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/DirectPlay8ThreadPool.hpp"
+#include "../src/EventObject.hpp"
+#include "../src/LoopbackTransport.hpp"
+#include "../src/packet.hpp"
+#include "../src/ReplayTransport.hpp"
+#include "TestHelpers.hpp"
+
+#define PORT 42897
+
+static const GUID APP_GUID = { 0x5f02c6a1, 0x7d3e, 0x4b19, { 0xa4, 0x80, 0x1e, 0x6c, 0x93, 0xd7, 0x2b, 0x55 } };
+
+/* Capture file which is deleted when the test is done with it. */
+struct TempCapture
+{
+	char path[MAX_PATH];
+	
+	TempCapture()
+	{
+		char dir[MAX_PATH];
+		
+		if(GetTempPathA(sizeof(dir), dir) == 0 || GetTempFileNameA(dir, "dpl", 0, path) == 0)
+		{
+			throw std::runtime_error("Unable to create temporary file");
+		}
+	}
+	
+	~TempCapture()
+	{
+		DeleteFileA(path);
+	}
+};
+
+TEST(CaptureTransport, ReplayStream)
+{
+	TempCapture tc;
+	LoopbackTransport net;
+	
+	{
+		CaptureTransport capture(&net, tc.path);
+		
+		PacketSerialiser session(CAPTURE_SESSION_CONNECT);
+		session.append_dword(DirectPlay8Peer::ROLE_PEER);
+		session.append_guid(APP_GUID);
+		session.append_guid(GUID_NULL);
+		session.append_dword(0);
+		session.append_dword(0);
+		session.append_wstring(L"");
+		session.append_wstring(L"");
+		session.append_dword(PORT);
+		session.append_data(NULL, 0);
+		
+		capture.record_session(session);
+		
+		int listener = net.create_listener_socket(inet_addr("127.0.0.1"), PORT, SocketOptions());
+		ASSERT_NE(listener, -1);
+		
+		int client = capture.create_client_socket(htonl(INADDR_ANY), 0, SocketOptions());
+		ASSERT_NE(client, -1);
+		
+		struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+		capture.connect(client, &addr);
+		
+		int error;
+		ASSERT_EQ(capture.get_socket_error(client, &error), 0);
+		ASSERT_EQ(error, 0);
+		
+		struct sockaddr_in client_addr;
+		int server = net.accept(listener, &client_addr);
+		ASSERT_NE(server, -1);
+		
+		EXPECT_EQ(net.send(server, "HelloWorld", 10), 10);
+		net.close(server);
+		
+		char buf[16];
+		EXPECT_EQ(capture.recv(client, buf, 8), 8);
+		EXPECT_EQ(capture.recv(client, buf, sizeof(buf)), 2);
+		
+		EXPECT_EQ(capture.recv(client, buf, sizeof(buf)), -1);
+		EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+		
+		capture.close(client);
+		net.close(listener);
+	}
+	
+	ReplayTransport replay(tc.path);
+	
+	ReplayTransport::Session session;
+	ASSERT_TRUE(replay.get_session(&session));
+	EXPECT_FALSE(session.host);
+	EXPECT_EQ(session.port, PORT);
+	
+	/* Connect result, two reads and the reset. */
+	EXPECT_EQ(replay.inbound_records(), 4U);
+	EXPECT_EQ(replay.total_inbound_bytes(), 10U);
+	
+	int client = replay.create_client_socket(htonl(INADDR_ANY), 0, SocketOptions());
+	ASSERT_NE(client, -1);
+	
+	EventObject event;
+	ASSERT_EQ(replay.event_select(client, event, FD_CONNECT | FD_READ | FD_CLOSE), 0);
+	
+	struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+	EXPECT_EQ(replay.connect(client, &addr), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	char buf[16];
+	EXPECT_EQ(replay.recv(client, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_FALSE(WaitForSingleObject(event, 0) == WAIT_OBJECT_0);
+	
+	unsigned long long next;
+	ASSERT_TRUE(replay.next_release(&next));
+	
+	replay.release_all();
+	EXPECT_FALSE(replay.next_release(&next));
+	EXPECT_EQ(replay.unread(), 3U);
+	
+	EXPECT_TRUE(WaitForSingleObject(event, 0) == WAIT_OBJECT_0);
+	
+	int error;
+	ASSERT_EQ(replay.get_socket_error(client, &error), 0);
+	EXPECT_EQ(error, 0);
+	
+	/* Reads don't have to line up with the ones in the capture. */
+	EXPECT_EQ(replay.recv(client, buf, 5), 5);
+	EXPECT_EQ(std::string(buf, 5), "Hello");
+	EXPECT_EQ(replay.recv(client, buf, sizeof(buf)), 3);
+	EXPECT_EQ(std::string(buf, 3), "Wor");
+	EXPECT_EQ(replay.recv(client, buf, sizeof(buf)), 2);
+	EXPECT_EQ(std::string(buf, 2), "ld");
+	
+	EXPECT_FALSE(replay.finished());
+	
+	EXPECT_EQ(replay.recv(client, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+	
+	EXPECT_TRUE(replay.finished());
+	
+	replay.close(client);
+}
+
+TEST(CaptureTransport, ReplaySession)
+{
+	TempCapture tc;
+	
+	LoopbackTransport net;
+	VirtualClock clock;
+	
+	/* Run everything from the test thread, as in the LoopbackSession tests. */
+	
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	
+	DWORD initial_threads;
+	ASSERT_EQ(tp->Initialize(NULL, &PeerMessages::callback, 0), S_OK);
+	ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	
+	PeerMessages host_pm, client_pm;
+	
+	{
+		CaptureTransport capture(&net, tc.path, &clock);
+		
+		DirectPlay8Peer *host   = new_peer(&host_pm, &net, &clock);
+		DirectPlay8Peer *client = new_peer(&client_pm, &capture, &clock);
+		
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize          = sizeof(app_desc);
+		app_desc.guidApplication = APP_GUID;
+		app_desc.pwszSessionName = (wchar_t*)(L"Capture Session");
+		
+		DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+		DWORD port = PORT;
+		
+		addr->SetSP(&CLSID_DP8SP_TCPIP);
+		addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+		
+		IDirectPlay8Address *addrs[] = { addr };
+		ASSERT_EQ(host->Host(&app_desc, addrs, 1, NULL, NULL, NULL, 0), S_OK);
+		
+		addr->Release();
+		
+		ASSERT_EQ(connect_session(client, APP_GUID, PORT, "Join", 4), DPNSUCCESS_PENDING);
+		tp->DoWork(INFINITE, 0);
+		
+		ASSERT_EQ(client_pm.connects, 1);
+		ASSERT_EQ(client_pm.connect_result, S_OK);
+		
+		const char *messages[] = { "One", "Two", "Three" };
+		
+		for(int i = 0; i < 3; ++i)
+		{
+			DPN_BUFFER_DESC bd = { (DWORD)(strlen(messages[i])), (BYTE*)(messages[i]) };
+			
+			DPNHANDLE handle;
+			ASSERT_EQ(host->SendTo(DPNID_ALL_PLAYERS_GROUP, &bd, 1, 0, NULL, &handle, DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE), DPNSUCCESS_PENDING);
+		}
+		
+		tp->DoWork(INFINITE, 0);
+		
+		ASSERT_EQ(client_pm.received.size(), 3U);
+		
+		/* Close() can't wait for anything without worker threads. */
+		tp->SetThreadCount(-1, initial_threads, 0);
+		
+		client->Release();
+		host->Release();
+		
+		tp->SetThreadCount(-1, 0, 0);
+	}
+	
+	ReplayTransport replay(tc.path);
+	
+	ReplayTransport::Session session;
+	ASSERT_TRUE(replay.get_session(&session));
+	
+	EXPECT_FALSE(session.host);
+	EXPECT_EQ(session.role, (DWORD)(DirectPlay8Peer::ROLE_PEER));
+	EXPECT_TRUE(session.application == APP_GUID);
+	EXPECT_EQ(session.port, PORT);
+	EXPECT_EQ(std::string(session.connect_data.begin(), session.connect_data.end()), "Join");
+	
+	EXPECT_GT(replay.inbound_records(), 0U);
+	
+	/* Feed the whole capture through a fresh peer, it should see exactly what the
+	 * captured one did.
+	*/
+	
+	replay.release_all();
+	
+	PeerMessages replay_pm;
+	DirectPlay8Peer *peer = new_peer(&replay_pm, &replay, &clock);
+	
+	ASSERT_EQ(connect_session(peer, APP_GUID, session.port, "Join", 4), DPNSUCCESS_PENDING);
+	tp->DoWork(INFINITE, 0);
+	
+	EXPECT_EQ(replay_pm.connects, 1);
+	EXPECT_EQ(replay_pm.connect_result, S_OK);
+	EXPECT_EQ(replay_pm.received, client_pm.received);
+	
+	EXPECT_TRUE(replay.finished());
+	
+	tp->SetThreadCount(-1, initial_threads, 0);
+	
+	peer->Release();
+	tp->Release();
+}
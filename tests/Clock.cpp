@@ -0,0 +1,140 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <windows.h>
+
+#include "../src/Clock.hpp"
+
+static const unsigned long long T0 = 1000000;
+
+static bool signalled(HANDLE event)
+{
+	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+}
+
+TEST(VirtualClock, Time)
+{
+	VirtualClock clock;
+	
+	EXPECT_EQ(clock.now(), T0);
+	EXPECT_EQ(clock.ticks(), (DWORD)(T0 / 1000));
+	
+	clock.advance(1500);
+	
+	EXPECT_EQ(clock.now(), T0 + 1500);
+	EXPECT_EQ(clock.ticks(), (DWORD)(T0 / 1000) + 1);
+}
+
+TEST(VirtualClock, OneShotTimer)
+{
+	VirtualClock clock;
+	
+	HANDLE timer = clock.create_timer();
+	ASSERT_NE(timer, (HANDLE)(NULL));
+	
+	clock.set_timer(timer, T0 + 100);
+	
+	clock.advance(99);
+	EXPECT_FALSE(signalled(timer));
+	
+	clock.advance(1);
+	EXPECT_TRUE(signalled(timer));
+	
+	clock.advance(1000);
+	EXPECT_FALSE(signalled(timer));
+	
+	/* Arming in the past fires straight away. */
+	clock.set_timer(timer, T0);
+	EXPECT_TRUE(signalled(timer));
+	
+	clock.cancel_timer(timer);
+	CloseHandle(timer);
+}
+
+TEST(VirtualClock, PeriodicTimer)
+{
+	VirtualClock clock;
+	
+	HANDLE timer = clock.create_timer();
+	ASSERT_NE(timer, (HANDLE)(NULL));
+	
+	clock.set_timer(timer, T0 + 1000, 10);
+	
+	clock.advance(1000);
+	EXPECT_TRUE(signalled(timer));
+	
+	clock.advance(9999);
+	EXPECT_FALSE(signalled(timer));
+	
+	clock.advance(1);
+	EXPECT_TRUE(signalled(timer));
+	
+	/* Skipping several periods only fires once, and the schedule carries on from there. */
+	
+	clock.advance(35000);
+	EXPECT_TRUE(signalled(timer));
+	EXPECT_FALSE(signalled(timer));
+	
+	clock.advance(4999);
+	EXPECT_FALSE(signalled(timer));
+	
+	clock.advance(1);
+	EXPECT_TRUE(signalled(timer));
+	
+	clock.cancel_timer(timer);
+	
+	clock.advance(100000);
+	EXPECT_FALSE(signalled(timer));
+	
+	CloseHandle(timer);
+}
+
+TEST(VirtualClock, AdvanceToNextTimer)
+{
+	VirtualClock clock;
+	
+	EXPECT_FALSE(clock.advance_to_next_timer());
+	
+	HANDLE t1 = clock.create_timer();
+	HANDLE t2 = clock.create_timer();
+	
+	clock.set_timer(t1, T0 + 500);
+	clock.set_timer(t2, T0 + 200);
+	
+	EXPECT_TRUE(clock.advance_to_next_timer());
+	EXPECT_EQ(clock.now(), T0 + 200);
+	EXPECT_FALSE(signalled(t1));
+	EXPECT_TRUE(signalled(t2));
+	
+	/* Re-arming replaces the old schedule. */
+	clock.set_timer(t1, T0 + 800);
+	
+	EXPECT_TRUE(clock.advance_to_next_timer());
+	EXPECT_EQ(clock.now(), T0 + 800);
+	EXPECT_TRUE(signalled(t1));
+	
+	EXPECT_FALSE(clock.advance_to_next_timer());
+	EXPECT_EQ(clock.now(), T0 + 800);
+	
+	clock.cancel_timer(t2);
+	clock.cancel_timer(t1);
+	CloseHandle(t2);
+	CloseHandle(t1);
+}
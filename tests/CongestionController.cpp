@@ -0,0 +1,115 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <windows.h>
+
+#include "../src/CongestionController.hpp"
+
+static const unsigned long long T0 = 1000000000ULL;
+
+TEST(CongestionController, InitialRate)
+{
+	CongestionController cc;
+	
+	EXPECT_EQ(cc.get_rate(), (DWORD)(CongestionController::INITIAL_RATE));
+	EXPECT_EQ(cc.get_queueing_delay(), 0U);
+}
+
+TEST(CongestionController, GrowsWhenNotQueueing)
+{
+	CongestionController cc;
+	
+	DWORD start = cc.get_rate();
+	
+	/* Application limited, no point growing the rate. */
+	for(int i = 0; i < 10; ++i)
+	{
+		cc.rtt_sample(20000, true, T0 + (i * 100000));
+	}
+	
+	EXPECT_EQ(cc.get_rate(), start);
+	
+	/* Sender is using all it has and there's no queueing, open up. */
+	for(int i = 10; i < 20; ++i)
+	{
+		cc.rtt_sample(20000, false, T0 + (i * 100000));
+	}
+	
+	EXPECT_GT(cc.get_rate(), start);
+	EXPECT_EQ(cc.get_queueing_delay(), 0U);
+}
+
+TEST(CongestionController, BacksOffWhenQueueing)
+{
+	CongestionController cc;
+	
+	cc.rtt_sample(20000, false, T0);
+	DWORD start = cc.get_rate();
+	
+	/* RTT climbs well past base + TARGET_DELAY, backing off even if app limited. */
+	for(int i = 1; i < 20; ++i)
+	{
+		cc.rtt_sample(20000 + (CongestionController::TARGET_DELAY * 3), true, T0 + (i * 100000));
+	}
+	
+	EXPECT_LT(cc.get_rate(), start / 2);
+	EXPECT_EQ(cc.get_queueing_delay(), CongestionController::TARGET_DELAY * 3);
+	
+	/* Converges on the target, no further adjustment once we are there. */
+	for(int i = 20; i < 30; ++i)
+	{
+		cc.rtt_sample(20000 + CongestionController::TARGET_DELAY, false, T0 + (i * 100000));
+	}
+	
+	DWORD settled = cc.get_rate();
+	
+	cc.rtt_sample(20000 + CongestionController::TARGET_DELAY, false, T0 + 3000000);
+	EXPECT_EQ(cc.get_rate(), settled);
+}
+
+TEST(CongestionController, BaseDelayExpires)
+{
+	CongestionController cc;
+	
+	cc.rtt_sample(10000, true, T0);
+	cc.rtt_sample(50000, true, T0 + 1000000);
+	
+	EXPECT_EQ(cc.get_queueing_delay(), 0U);
+	
+	/* Route changed to a longer one, the old minimum is forgotten after BASE_HISTORY minutes
+	 * and the new RTT stops looking like queueing.
+	*/
+	for(int i = 0; i < 12; ++i)
+	{
+		for(int j = 0; j < 4; ++j)
+		{
+			cc.rtt_sample(50000, true, T0 + (61000000ULL * (i + 1)) + j);
+		}
+	}
+	
+	EXPECT_EQ(cc.get_queueing_delay(), 0U);
+	
+	for(int j = 0; j < 4; ++j)
+	{
+		cc.rtt_sample(80000, true, T0 + (61000000ULL * 13) + j);
+	}
+	
+	EXPECT_EQ(cc.get_queueing_delay(), 30000U);
+}
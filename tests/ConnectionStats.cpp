@@ -0,0 +1,116 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <dplay8.h>
+#include <gtest/gtest.h>
+#include <windows.h>
+
+#include "../src/ConnectionStats.hpp"
+
+TEST(ConnectionStats, Counters)
+{
+	ConnectionStats stats;
+	
+	stats.message_sent(DPNSEND_GUARANTEED,    100, S_OK);
+	stats.message_sent(DPNSEND_PRIORITY_HIGH,  10, S_OK);
+	stats.message_sent(DPNSEND_PRIORITY_LOW,   20, S_OK);
+	stats.message_sent(DPNSEND_PRIORITY_LOW,   30, DPNERR_TIMEDOUT);
+	stats.message_sent(0,                      40, DPNERR_USERCANCEL);
+	
+	stats.message_received(DPNSEND_GUARANTEED, 5);
+	stats.message_received(0,                  6);
+	stats.message_received(0,                  7);
+	
+	DPN_CONNECTION_INFO ci;
+	memset(&ci, 0, sizeof(ci));
+	
+	stats.fill_connection_info(&ci);
+	
+	EXPECT_EQ(ci.dwBytesSentGuaranteed,               100);
+	EXPECT_EQ(ci.dwPacketsSentGuaranteed,             1);
+	EXPECT_EQ(ci.dwBytesSentNonGuaranteed,            30);
+	EXPECT_EQ(ci.dwPacketsSentNonGuaranteed,          2);
+	EXPECT_EQ(ci.dwBytesDropped,                      40);
+	EXPECT_EQ(ci.dwPacketsDropped,                    1);
+	EXPECT_EQ(ci.dwMessagesTransmittedHighPriority,   1);
+	EXPECT_EQ(ci.dwMessagesTransmittedNormalPriority, 1);
+	EXPECT_EQ(ci.dwMessagesTransmittedLowPriority,    1);
+	EXPECT_EQ(ci.dwMessagesTimedOutLowPriority,       1);
+	EXPECT_EQ(ci.dwBytesReceivedGuaranteed,           5);
+	EXPECT_EQ(ci.dwPacketsReceivedGuaranteed,         1);
+	EXPECT_EQ(ci.dwBytesReceivedNonGuaranteed,        13);
+	EXPECT_EQ(ci.dwPacketsReceivedNonGuaranteed,      2);
+	EXPECT_EQ(ci.dwMessagesReceived,                  3);
+}
+
+TEST(ConnectionStats, SmoothedRTT)
+{
+	ConnectionStats stats;
+	
+	EXPECT_EQ(stats.get_rtt(), 0);
+	
+	/* First sample is taken as-is. */
+	stats.rtt_sample(80);
+	EXPECT_EQ(stats.get_rtt(), 80);
+	
+	/* Later samples only move it by 1/8th of the difference. */
+	stats.rtt_sample(160);
+	EXPECT_EQ(stats.get_rtt(), 90);
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		stats.rtt_sample(20);
+	}
+	
+	EXPECT_EQ(stats.get_rtt(), 20);
+}
+
+TEST(ConnectionStats, LatencyHistograms)
+{
+	ConnectionStats stats;
+	
+	stats.send_latency(0,    3);
+	stats.send_latency(1,    3);
+	stats.send_latency(1000, 3);
+	stats.send_latency(0xFFFFFFFFFFULL, 3);
+	
+	DWORD queue[ConnectionStats::LATENCY_BUCKETS];
+	DWORD wire[ConnectionStats::LATENCY_BUCKETS];
+	
+	stats.get_queue_latency(queue);
+	stats.get_wire_latency(wire);
+	
+	for(int i = 0; i < ConnectionStats::LATENCY_BUCKETS; ++i)
+	{
+		switch(i)
+		{
+			case 0:  EXPECT_EQ(queue[i], 1) << "bucket " << i; break; /* 0us */
+			case 1:  EXPECT_EQ(queue[i], 1) << "bucket " << i; break; /* 1us */
+			case 10: EXPECT_EQ(queue[i], 1) << "bucket " << i; break; /* 512-1023us */
+			
+			case ConnectionStats::LATENCY_BUCKETS - 1:
+				EXPECT_EQ(queue[i], 1) << "bucket " << i;
+				break;
+				
+			default: EXPECT_EQ(queue[i], 0) << "bucket " << i; break;
+		}
+		
+		EXPECT_EQ(wire[i], (i == 2 ? 4 : 0)) << "bucket " << i;
+	}
+}
@@ -0,0 +1,330 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <functional>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Client.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/DirectPlay8Server.hpp"
+
+#define PORT 42896
+
+static const GUID APP_GUID = { 0x4e1cd3b3, 0x2a4c, 0x4b52, { 0x8f, 0x1e, 0x6a, 0x0d, 0x93, 0x27, 0x5c, 0x71 } };
+
+/* Records the type of every message raised by an instance, along with the
+ * sender and payload of any DPN_MSGID_RECEIVE messages.
+*/
+struct MessageLog
+{
+	std::mutex lock;
+	std::vector<DWORD> types;
+	std::vector<DPNID> receive_from;
+	std::vector< std::vector<unsigned char> > receive_data;
+	
+	std::function<HRESULT(DWORD,PVOID)> hook;
+	
+	static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+	{
+		MessageLog *log = (MessageLog*)(pvUserContext);
+		std::unique_lock<std::mutex> l(log->lock);
+		
+		log->types.push_back(dwMessageType);
+		
+		if(dwMessageType == DPN_MSGID_RECEIVE)
+		{
+			DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+			
+			log->receive_from.push_back(r->dpnidSender);
+			log->receive_data.push_back(std::vector<unsigned char>(r->pReceiveData, r->pReceiveData + r->dwReceiveDataSize));
+		}
+		
+		if(log->hook)
+		{
+			return log->hook(dwMessageType, pMessage);
+		}
+		
+		return DPN_OK;
+	}
+	
+	size_t count(DWORD type)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		return std::count(types.begin(), types.end(), type);
+	}
+};
+
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+	
+	if(addr->SetSP(&CLSID_DP8SP_TCPIP) != S_OK
+		|| (hostname != NULL && addr->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING) != S_OK)
+		|| addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD) != S_OK)
+	{
+		addr->Release();
+		throw std::runtime_error("Address setup failed");
+	}
+	
+	return addr;
+}
+
+static HRESULT host_server(IDirectPlay8Server *server, DWORD flags)
+{
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = flags;
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"Server Session");
+	
+	DirectPlay8Address *addr = make_address(NULL, PORT);
+	IDirectPlay8Address *addrs[] = { addr };
+	
+	HRESULT result = server->Host(&app_desc, addrs, 1, NULL, NULL, NULL, 0);
+	
+	addr->Release();
+	
+	return result;
+}
+
+static HRESULT connect_client(IDirectPlay8Client *client)
+{
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID;
+	
+	DirectPlay8Address *addr = make_address(L"127.0.0.1", PORT);
+	
+	HRESULT result = client->Connect(&app_desc, addr, NULL, NULL, NULL, NULL, 0, NULL, NULL, DPNCONNECT_SYNC);
+	
+	addr->Release();
+	
+	return result;
+}
+
+TEST(DirectPlay8ClientServer, HostRequiresClientServerFlag)
+{
+	MessageLog server_log;
+	
+	DirectPlay8Server *server = new DirectPlay8Server(NULL);
+	ASSERT_EQ(server->Initialize(&server_log, &MessageLog::callback, 0), S_OK);
+	
+	EXPECT_EQ(host_server(server, 0), DPNERR_INVALIDPARAM);
+	
+	server->Release();
+	
+	MessageLog peer_log;
+	
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(peer->Initialize(&peer_log, &MessageLog::callback, 0), S_OK);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = DPNSESSION_CLIENT_SERVER;
+	app_desc.guidApplication = APP_GUID;
+	
+	DirectPlay8Address *addr = make_address(NULL, PORT);
+	IDirectPlay8Address *addrs[] = { addr };
+	
+	EXPECT_EQ(peer->Host(&app_desc, addrs, 1, NULL, NULL, NULL, 0), DPNERR_INVALIDPARAM);
+	
+	addr->Release();
+	peer->Release();
+}
+
+TEST(DirectPlay8ClientServer, ClientsOnlyConnectToServer)
+{
+	MessageLog server_log, c1_log, c2_log;
+	
+	DirectPlay8Server *server = new DirectPlay8Server(NULL);
+	ASSERT_EQ(server->Initialize(&server_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(host_server(server, DPNSESSION_CLIENT_SERVER), S_OK);
+	
+	DirectPlay8Client *c1 = new DirectPlay8Client(NULL);
+	ASSERT_EQ(c1->Initialize(&c1_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(connect_client(c1), S_OK);
+	
+	DirectPlay8Client *c2 = new DirectPlay8Client(NULL);
+	ASSERT_EQ(c2->Initialize(&c2_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(connect_client(c2), S_OK);
+	
+	Sleep(250);
+	
+	/* The server sees itself and both clients... */
+	
+	DPNID players[8];
+	DWORD num_players = 8;
+	
+	ASSERT_EQ(server->EnumPlayersAndGroups(players, &num_players, DPNENUM_PLAYERS), S_OK);
+	EXPECT_EQ(num_players, 3);
+	
+	EXPECT_EQ(server_log.count(DPN_MSGID_INDICATE_CONNECT), 2);
+	EXPECT_EQ(server_log.count(DPN_MSGID_CREATE_PLAYER),    3);
+	
+	/* ...but the clients are never told about any players. */
+	
+	EXPECT_EQ(c1_log.count(DPN_MSGID_CONNECT_COMPLETE), 1);
+	EXPECT_EQ(c1_log.count(DPN_MSGID_CREATE_PLAYER),    0);
+	EXPECT_EQ(c2_log.count(DPN_MSGID_CREATE_PLAYER),    0);
+	
+	DPN_APPLICATION_DESC *app_desc = (DPN_APPLICATION_DESC*)(malloc(1024));
+	DWORD app_desc_size = 1024;
+	app_desc->dwSize = sizeof(DPN_APPLICATION_DESC);
+	
+	ASSERT_EQ(c2->GetApplicationDesc(app_desc, &app_desc_size, 0), S_OK);
+	EXPECT_TRUE(app_desc->dwFlags & DPNSESSION_CLIENT_SERVER);
+	
+	free(app_desc);
+	
+	/* Client sends go to the server. */
+	
+	unsigned char payload[] = { 0x01, 0x02, 0x03 };
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ sizeof(payload), payload },
+	};
+	
+	DPNHANDLE send_handle;
+	ASSERT_EQ(c1->Send(bd, 1, 0, NULL, &send_handle, DPNSEND_SYNC), S_OK);
+	
+	Sleep(250);
+	
+	{
+		std::unique_lock<std::mutex> l(server_log.lock);
+		
+		ASSERT_EQ(server_log.receive_data.size(), 1);
+		EXPECT_EQ(server_log.receive_data[0], std::vector<unsigned char>(payload, payload + sizeof(payload)));
+	}
+	
+	/* A broadcast from the server reaches both clients. */
+	
+	ASSERT_EQ(server->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, &send_handle, (DPNSEND_SYNC | DPNSEND_NOLOOPBACK)), S_OK);
+	
+	Sleep(250);
+	
+	EXPECT_EQ(c1_log.count(DPN_MSGID_RECEIVE), 1);
+	EXPECT_EQ(c2_log.count(DPN_MSGID_RECEIVE), 1);
+	
+	c2->Release();
+	c1->Release();
+	server->Release();
+}
+
+TEST(DirectPlay8ClientServer, ServerGroups)
+{
+	MessageLog server_log, c1_log;
+	
+	DirectPlay8Server *server = new DirectPlay8Server(NULL);
+	ASSERT_EQ(server->Initialize(&server_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(host_server(server, DPNSESSION_CLIENT_SERVER), S_OK);
+	
+	DirectPlay8Client *c1 = new DirectPlay8Client(NULL);
+	ASSERT_EQ(c1->Initialize(&c1_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(connect_client(c1), S_OK);
+	
+	Sleep(250);
+	
+	DPNID players[8];
+	DWORD num_players = 8;
+	
+	ASSERT_EQ(server->EnumPlayersAndGroups(players, &num_players, DPNENUM_PLAYERS), S_OK);
+	ASSERT_EQ(num_players, 2);
+	
+	DPN_GROUP_INFO group_info;
+	memset(&group_info, 0, sizeof(group_info));
+	
+	group_info.dwSize = sizeof(group_info);
+	group_info.dwInfoFlags = DPNINFO_NAME;
+	group_info.pwszName = (wchar_t*)(L"Group");
+	
+	DPNID group_id = 0;
+	server_log.hook = [&group_id](DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_CREATE_GROUP)
+		{
+			group_id = ((DPNMSG_CREATE_GROUP*)(pMessage))->dpnidGroup;
+		}
+		
+		return DPN_OK;
+	};
+	
+	DPNHANDLE handle;
+	ASSERT_EQ(server->CreateGroup(&group_info, NULL, NULL, &handle, DPNCREATEGROUP_SYNC), S_OK);
+	
+	for(DWORD i = 0; i < num_players; ++i)
+	{
+		EXPECT_EQ(server->AddPlayerToGroup(group_id, players[i], NULL, &handle, DPNADDPLAYERTOGROUP_SYNC), S_OK);
+	}
+	
+	Sleep(250);
+	
+	DPNID members[8];
+	DWORD num_members = 8;
+	
+	ASSERT_EQ(server->EnumGroupMembers(group_id, members, &num_members, 0), S_OK);
+	EXPECT_EQ(num_members, 2);
+	
+	EXPECT_EQ(server_log.count(DPN_MSGID_ADD_PLAYER_TO_GROUP), 2);
+	EXPECT_EQ(c1_log.count(DPN_MSGID_CREATE_GROUP),            0);
+	EXPECT_EQ(c1_log.count(DPN_MSGID_ADD_PLAYER_TO_GROUP),     0);
+	
+	c1->Release();
+	server->Release();
+}
+
+TEST(DirectPlay8ClientServer, PeerCannotJoinServer)
+{
+	MessageLog server_log, peer_log;
+	
+	DirectPlay8Server *server = new DirectPlay8Server(NULL);
+	ASSERT_EQ(server->Initialize(&server_log, &MessageLog::callback, 0), S_OK);
+	ASSERT_EQ(host_server(server, DPNSESSION_CLIENT_SERVER), S_OK);
+	
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(peer->Initialize(&peer_log, &MessageLog::callback, 0), S_OK);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID;
+	
+	DirectPlay8Address *addr = make_address(L"127.0.0.1", PORT);
+	
+	EXPECT_EQ(peer->Connect(&app_desc, addr, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL, DPNCONNECT_SYNC), DPNERR_INVALIDINTERFACE);
+	
+	addr->Release();
+	
+	EXPECT_EQ(server_log.count(DPN_MSGID_INDICATE_CONNECT), 0);
+	
+	peer->Release();
+	server->Release();
+}
@@ -18,6 +18,7 @@
 
 #include <winsock2.h>
 #include <array>
+#include <dplite.h>
 #include <functional>
 #include <gtest/gtest.h>
 #include <list>
@@ -641,6 +642,210 @@ TEST(DirectPlay8Peer, EnumHostsAsync)
 	}
 }
 
+TEST(DirectPlay8Peer, EnumHostsSyncFromResponse)
+{
+	SessionHost a1s1(APP_GUID_1, L"Application 1 Session 1");
+	
+	IDP8PeerInstance client;
+	
+	IDP8AddressInstance device_address;
+	device_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	std::atomic<bool> started_inner(false);
+	std::atomic<int> inner_responses(0);
+	HRESULT inner_result = DPNERR_GENERIC;
+	bool got_async_op_complete = false;
+	
+	std::function<HRESULT(DWORD,PVOID)> callback =
+		[&client, &device_address, &started_inner, &inner_responses, &inner_result, &got_async_op_complete]
+		(DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_ENUM_HOSTS_RESPONSE)
+		{
+			DPNMSG_ENUM_HOSTS_RESPONSE *ehr = (DPNMSG_ENUM_HOSTS_RESPONSE*)(pMessage);
+			
+			if(ehr->pvUserContext == (void*)(0xBEEF))
+			{
+				++inner_responses;
+			}
+			else if(!started_inner.exchange(true))
+			{
+				/* The inner enumeration needs responses and its completion raised while
+				 * we are still inside the handler for the outer one.
+				*/
+				inner_result = client->EnumHosts(
+					NULL,              /* pApplicationDesc */
+					NULL,              /* pdpaddrHost */
+					device_address,    /* pdpaddrDeviceInfo */
+					NULL,              /* pvUserEnumData */
+					0,                 /* dwUserEnumDataSize */
+					1,                 /* dwEnumCount */
+					100,               /* dwRetryInterval */
+					500,               /* dwTimeOut*/
+					(void*)(0xBEEF),   /* pvUserContext */
+					NULL,              /* pAsyncHandle */
+					DPNENUMHOSTS_SYNC  /* dwFlags */
+				);
+			}
+		}
+		else if(dwMessageType == DPN_MSGID_ASYNC_OP_COMPLETE)
+		{
+			got_async_op_complete = true;
+		}
+		
+		return DPN_OK;
+	};
+	
+	ASSERT_EQ(client->Initialize(&callback, &callback_shim, 0), S_OK);
+	
+	DPNHANDLE async_handle;
+	
+	ASSERT_EQ(client->EnumHosts(
+		NULL,              /* pApplicationDesc */
+		NULL,              /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		1,                 /* dwEnumCount */
+		100,               /* dwRetryInterval */
+		500,               /* dwTimeOut*/
+		(void*)(0xABCD),   /* pvUserContext */
+		&async_handle,     /* pAsyncHandle */
+		0                  /* dwFlags */
+	), DPNSUCCESS_PENDING);
+	
+	Sleep(2000);
+	
+	EXPECT_TRUE(started_inner);
+	EXPECT_EQ(inner_result, S_OK);
+	EXPECT_EQ(inner_responses, 1);
+	EXPECT_TRUE(got_async_op_complete);
+}
+
+TEST(DirectPlay8Peer, EnumHostsAsyncConcurrent)
+{
+	SessionHost a1s1(APP_GUID_1, L"Application 1 Session 1");
+	SessionHost a1s2(APP_GUID_1, L"Application 1 Session 2");
+	SessionHost a2s1(APP_GUID_2, L"Application 2 Session 1");
+	
+	std::mutex sessions_lock;
+	std::map<GUID, FoundSession, CompareGUID> app1_sessions, app2_sessions;
+	
+	std::atomic<int> completed(0);
+	
+	std::function<HRESULT(DWORD,PVOID)> callback =
+		[&sessions_lock, &app1_sessions, &app2_sessions, &completed]
+		(DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_ENUM_HOSTS_RESPONSE)
+		{
+			DPNMSG_ENUM_HOSTS_RESPONSE *ehr = (DPNMSG_ENUM_HOSTS_RESPONSE*)(pMessage);
+			
+			std::unique_lock<std::mutex> l(sessions_lock);
+			
+			std::map<GUID, FoundSession, CompareGUID> *sessions;
+			
+			if(ehr->pvUserContext == (void*)(0x1))
+			{
+				EXPECT_EQ(ehr->pApplicationDescription->guidApplication, APP_GUID_1);
+				sessions = &app1_sessions;
+			}
+			else if(ehr->pvUserContext == (void*)(0x2))
+			{
+				EXPECT_EQ(ehr->pApplicationDescription->guidApplication, APP_GUID_2);
+				sessions = &app2_sessions;
+			}
+			else{
+				ADD_FAILURE() << "Unexpected pvUserContext " << ehr->pvUserContext;
+				return DPN_OK;
+			}
+			
+			sessions->emplace(
+				ehr->pApplicationDescription->guidInstance,
+				FoundSession(
+					ehr->pApplicationDescription->guidApplication,
+					ehr->pApplicationDescription->pwszSessionName));
+		}
+		else if(dwMessageType == DPN_MSGID_ASYNC_OP_COMPLETE)
+		{
+			DPNMSG_ASYNC_OP_COMPLETE *oc = (DPNMSG_ASYNC_OP_COMPLETE*)(pMessage);
+			EXPECT_EQ(oc->hResultCode, S_OK);
+			
+			++completed;
+		}
+		
+		return DPN_OK;
+	};
+	
+	IDP8PeerInstance client;
+	
+	ASSERT_EQ(client->Initialize(&callback, &callback_shim, 0), S_OK);
+	
+	IDP8AddressInstance device_address;
+	device_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	DPN_APPLICATION_DESC app1_desc;
+	memset(&app1_desc, 0, sizeof(app1_desc));
+	
+	app1_desc.dwSize          = sizeof(app1_desc);
+	app1_desc.guidApplication = APP_GUID_1;
+	
+	DPN_APPLICATION_DESC app2_desc;
+	memset(&app2_desc, 0, sizeof(app2_desc));
+	
+	app2_desc.dwSize          = sizeof(app2_desc);
+	app2_desc.guidApplication = APP_GUID_2;
+	
+	DPNHANDLE app1_handle, app2_handle;
+	
+	ASSERT_EQ(client->EnumHosts(
+		&app1_desc,        /* pApplicationDesc */
+		NULL,              /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		3,                 /* dwEnumCount */
+		500,               /* dwRetryInterval */
+		500,               /* dwTimeOut*/
+		(void*)(0x1),      /* pvUserContext */
+		&app1_handle,      /* pAsyncHandle */
+		0                  /* dwFlags */
+	), DPNSUCCESS_PENDING);
+	
+	ASSERT_EQ(client->EnumHosts(
+		&app2_desc,        /* pApplicationDesc */
+		NULL,              /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		3,                 /* dwEnumCount */
+		500,               /* dwRetryInterval */
+		500,               /* dwTimeOut*/
+		(void*)(0x2),      /* pvUserContext */
+		&app2_handle,      /* pAsyncHandle */
+		0                  /* dwFlags */
+	), DPNSUCCESS_PENDING);
+	
+	Sleep(3000);
+	
+	EXPECT_EQ(completed, 2);
+	
+	std::unique_lock<std::mutex> l(sessions_lock);
+	
+	FoundSession expect_app1_sessions[] = {
+		FoundSession(APP_GUID_1, L"Application 1 Session 1"),
+		FoundSession(APP_GUID_1, L"Application 1 Session 2"),
+	};
+	
+	EXPECT_SESSIONS(app1_sessions, expect_app1_sessions, expect_app1_sessions + 2);
+	
+	FoundSession expect_app2_sessions[] = {
+		FoundSession(APP_GUID_2, L"Application 2 Session 1"),
+	};
+	
+	EXPECT_SESSIONS(app2_sessions, expect_app2_sessions, expect_app2_sessions + 1);
+}
+
 TEST(DirectPlay8Peer, EnumHostsAsyncCancelByHandle)
 {
 	bool got_async_op_complete = false;
@@ -1321,125 +1526,280 @@ TEST(DirectPlay8Peer, EnumHostsSpecifyPort)
 	EXPECT_SESSIONS(sessions, expect_sessions, expect_sessions + 1);
 }
 
-TEST(DirectPlay8Peer, ConnectSync)
+TEST(DirectPlay8Peer, EnumHostsNoQuery)
 {
-	std::atomic<bool> testing(true);
-	
-	std::atomic<int> host_seq(0), p1_seq(0);
-	DPNID host_player_id = -1, p1_player_id = -1;
-	
-	SessionHost host(APP_GUID_1, L"Session 1", PORT,
-		[&testing, &host_seq, &host_player_id, &p1_player_id]
+	SessionHost a1s1(APP_GUID_1, L"Application 1 Session 1", PORT,
+		[]
 		(DWORD dwMessageType, PVOID pMessage)
 		{
-			if(!testing)
-			{
-				return DPN_OK;
-			}
-			
-			int seq = ++host_seq;
-			
-			switch(seq)
+			if(dwMessageType == DPN_MSGID_ENUM_HOSTS_QUERY)
 			{
-				case 1:
-					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
-					
-					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
-					{
-						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-						host_player_id = cp->dpnidPlayer;
-						
-						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
-						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xB00));
-						
-						cp->pvPlayerContext = (void*)(0xB00B00);
-					}
-					
-					break;
-					
-				case 2:
-					EXPECT_EQ(dwMessageType, DPN_MSGID_INDICATE_CONNECT);
-					
-					if(dwMessageType == DPN_MSGID_INDICATE_CONNECT)
-					{
-						DPNMSG_INDICATE_CONNECT *ic = (DPNMSG_INDICATE_CONNECT*)(pMessage);
-						
-						EXPECT_EQ(ic->dwSize, sizeof(DPNMSG_INDICATE_CONNECT));
-						
-						EXPECT_EQ(ic->pvUserConnectData,     (void*)(NULL));
-						EXPECT_EQ(ic->dwUserConnectDataSize, 0);
-						
-						EXPECT_EQ(ic->pvReplyData,     (void*)(NULL));
-						EXPECT_EQ(ic->dwReplyDataSize, 0);
-						
-						EXPECT_EQ(ic->pvReplyContext,  (void*)(NULL));
-						EXPECT_EQ(ic->pvPlayerContext, (void*)(NULL));
-						
-						/* TODO: Check pAddressPlayer, pAddressDevice */
-						
-						ic->pvPlayerContext = (void*)(0xB441);
-					}
-					
-					break;
-					
-				case 3:
-					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
-					
-					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
-					{
-						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-						p1_player_id = cp->dpnidPlayer;
-						
-						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
-						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xB441));
-						
-						cp->pvPlayerContext = (void*)(0xFEED);
-					}
-					
-					break;
-				
-				default:
-					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
-					break;
+				ADD_FAILURE() << "Unexpected DPN_MSGID_ENUM_HOSTS_QUERY";
 			}
 			
 			return DPN_OK;
 		});
 	
-	/* Give the host instance a moment to settle. */
-	Sleep(1000);
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
 	
-	DPNID p1_cp_dpnidPlayer = -1, p1_cc_dpnidLocal = -1;
+	caps.dwSize = sizeof(caps);
 	
-	std::function<HRESULT(DWORD,PVOID)> p1_cb =
-		[&testing, &p1_seq, &host_player_id, &p1_player_id, &p1_cp_dpnidPlayer, &p1_cc_dpnidLocal]
+	ASSERT_EQ(a1s1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwEnumFlags, 0);
+	EXPECT_EQ(caps.dwMaxEnumResponseRate, 50);
+	
+	caps.dwEnumFlags = DPLITE_ENUM_NOQUERY;
+	
+	ASSERT_EQ(a1s1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	std::map<GUID, FoundSession, CompareGUID> sessions;
+	DWORD current_players = 0;
+	
+	std::function<HRESULT(DWORD,PVOID)> client_cb =
+		[&sessions, &current_players]
 		(DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_ENUM_HOSTS_RESPONSE)
 		{
-			if(!testing)
-			{
-				return DPN_OK;
-			}
+			DPNMSG_ENUM_HOSTS_RESPONSE *ehr = (DPNMSG_ENUM_HOSTS_RESPONSE*)(pMessage);
 			
-			int seq = ++p1_seq;
+			EXPECT_EQ(ehr->pvResponseData, nullptr);
+			EXPECT_EQ(ehr->dwResponseDataSize, 0);
 			
-			switch(seq)
-			{
-				case 1:
-					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
-					
-					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
-					{
-						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
-						p1_cp_dpnidPlayer = cp->dpnidPlayer;
-						
-						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
-						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xBCDE));
-						
-						cp->pvPlayerContext = (void*)(0xCDEF);
-					}
-					
-					break;
-					
+			current_players = ehr->pApplicationDescription->dwCurrentPlayers;
+			
+			sessions.emplace(
+				ehr->pApplicationDescription->guidInstance,
+				FoundSession(
+					ehr->pApplicationDescription->guidApplication,
+					ehr->pApplicationDescription->pwszSessionName));
+		}
+		
+		return DPN_OK;
+	};
+	
+	IDP8PeerInstance client;
+	
+	ASSERT_EQ(client->Initialize(&client_cb, &callback_shim, 0), S_OK);
+	
+	IDP8AddressInstance host_address(L"127.0.0.1", PORT);
+	
+	IDP8AddressInstance device_address;
+	device_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	ASSERT_EQ(client->EnumHosts(
+		NULL,              /* pApplicationDesc */
+		host_address,      /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		3,                 /* dwEnumCount */
+		500,               /* dwRetryInterval */
+		500,               /* dwTimeOut*/
+		NULL,              /* pvUserContext */
+		NULL,              /* pAsyncHandle */
+		DPNENUMHOSTS_SYNC  /* dwFlags */
+	), S_OK);
+	
+	FoundSession expect_sessions[] = {
+		FoundSession(APP_GUID_1, L"Application 1 Session 1"),
+	};
+	
+	EXPECT_SESSIONS(sessions, expect_sessions, expect_sessions + 1);
+	EXPECT_EQ(current_players, 1);
+}
+
+TEST(DirectPlay8Peer, EnumHostsRateLimit)
+{
+	std::atomic<int> queries(0);
+	
+	SessionHost a1s1(APP_GUID_1, L"Application 1 Session 1", PORT,
+		[&queries]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_ENUM_HOSTS_QUERY)
+			{
+				++queries;
+			}
+			
+			return DPN_OK;
+		});
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(a1s1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	caps.dwMaxEnumResponseRate = 2;
+	
+	ASSERT_EQ(a1s1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	std::atomic<int> responses(0);
+	
+	std::function<HRESULT(DWORD,PVOID)> client_cb =
+		[&responses]
+		(DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_ENUM_HOSTS_RESPONSE)
+		{
+			++responses;
+		}
+		
+		return DPN_OK;
+	};
+	
+	IDP8PeerInstance client;
+	
+	ASSERT_EQ(client->Initialize(&client_cb, &callback_shim, 0), S_OK);
+	
+	IDP8AddressInstance host_address(L"127.0.0.1", PORT);
+	
+	IDP8AddressInstance device_address;
+	device_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	/* 6 probes within half a second, only the first 2 should get through. */
+	
+	ASSERT_EQ(client->EnumHosts(
+		NULL,              /* pApplicationDesc */
+		host_address,      /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		6,                 /* dwEnumCount */
+		50,                /* dwRetryInterval */
+		250,               /* dwTimeOut*/
+		NULL,              /* pvUserContext */
+		NULL,              /* pAsyncHandle */
+		DPNENUMHOSTS_SYNC  /* dwFlags */
+	), S_OK);
+	
+	EXPECT_EQ(queries, 2);
+	EXPECT_EQ(responses, 2);
+}
+
+TEST(DirectPlay8Peer, ConnectSync)
+{
+	std::atomic<bool> testing(true);
+	
+	std::atomic<int> host_seq(0), p1_seq(0);
+	DPNID host_player_id = -1, p1_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_seq, &host_player_id, &p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++host_seq;
+			
+			switch(seq)
+			{
+				case 1:
+					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
+					
+					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+					{
+						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+						host_player_id = cp->dpnidPlayer;
+						
+						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
+						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xB00));
+						
+						cp->pvPlayerContext = (void*)(0xB00B00);
+					}
+					
+					break;
+					
+				case 2:
+					EXPECT_EQ(dwMessageType, DPN_MSGID_INDICATE_CONNECT);
+					
+					if(dwMessageType == DPN_MSGID_INDICATE_CONNECT)
+					{
+						DPNMSG_INDICATE_CONNECT *ic = (DPNMSG_INDICATE_CONNECT*)(pMessage);
+						
+						EXPECT_EQ(ic->dwSize, sizeof(DPNMSG_INDICATE_CONNECT));
+						
+						EXPECT_EQ(ic->pvUserConnectData,     (void*)(NULL));
+						EXPECT_EQ(ic->dwUserConnectDataSize, 0);
+						
+						EXPECT_EQ(ic->pvReplyData,     (void*)(NULL));
+						EXPECT_EQ(ic->dwReplyDataSize, 0);
+						
+						EXPECT_EQ(ic->pvReplyContext,  (void*)(NULL));
+						EXPECT_EQ(ic->pvPlayerContext, (void*)(NULL));
+						
+						/* TODO: Check pAddressPlayer, pAddressDevice */
+						
+						ic->pvPlayerContext = (void*)(0xB441);
+					}
+					
+					break;
+					
+				case 3:
+					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
+					
+					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+					{
+						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+						p1_player_id = cp->dpnidPlayer;
+						
+						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
+						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xB441));
+						
+						cp->pvPlayerContext = (void*)(0xFEED);
+					}
+					
+					break;
+				
+				default:
+					ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+					break;
+			}
+			
+			return DPN_OK;
+		});
+	
+	/* Give the host instance a moment to settle. */
+	Sleep(1000);
+	
+	DPNID p1_cp_dpnidPlayer = -1, p1_cc_dpnidLocal = -1;
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&testing, &p1_seq, &host_player_id, &p1_player_id, &p1_cp_dpnidPlayer, &p1_cc_dpnidLocal]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(!testing)
+			{
+				return DPN_OK;
+			}
+			
+			int seq = ++p1_seq;
+			
+			switch(seq)
+			{
+				case 1:
+					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
+					
+					if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+					{
+						DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+						p1_cp_dpnidPlayer = cp->dpnidPlayer;
+						
+						EXPECT_EQ(cp->dwSize,          sizeof(DPNMSG_CREATE_PLAYER));
+						EXPECT_EQ(cp->pvPlayerContext, (void*)(0xBCDE));
+						
+						cp->pvPlayerContext = (void*)(0xCDEF);
+					}
+					
+					break;
+					
 				case 2:
 					EXPECT_EQ(dwMessageType, DPN_MSGID_CREATE_PLAYER);
 					
@@ -2742,42 +3102,310 @@ TEST(DirectPlay8Peer, ConnectTwoPeersToHost)
 	EXPECT_EQ(p2_cp2_dpnidPlayer, p1_player_id);
 }
 
-TEST(DirectPlay8Peer, HostPeerSoftClose)
+TEST(DirectPlay8Peer, ConnectToMeshSlowCallbacks)
 {
-	DPN_APPLICATION_DESC app_desc;
-	memset(&app_desc, 0, sizeof(app_desc));
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		});
 	
-	app_desc.dwSize          = sizeof(app_desc);
-	app_desc.guidApplication = APP_GUID_1;
-	app_desc.pwszSessionName = L"Session 1";
+	std::function<HRESULT(DWORD,PVOID)> null_cb =
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		};
 	
-	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
 	
-	TestPeer host("host");
-	ASSERT_EQ(host->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, 0), S_OK);
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
 	
-	IDP8AddressInstance connect_addr(CLSID_DP8SP_TCPIP, L"127.0.0.1", PORT);
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
 	
-	TestPeer peer1("peer1");
-	ASSERT_EQ(peer1->Connect(
-		&app_desc,        /* pdnAppDesc */
-		connect_addr,     /* pHostAddr */
-		NULL,             /* pDeviceInfo */
-		NULL,             /* pdnSecurity */
-		NULL,             /* pdnCredentials */
-		NULL,             /* pvUserConnectData */
-		0,                /* dwUserConnectDataSize */
-		0,                /* pvPlayerContext */
-		NULL,             /* pvAsyncContext */
-		NULL,             /* phAsyncHandle */
-		DPNCONNECT_SYNC   /* dwFlags */
-	), S_OK);
+	auto connect = [&connect_to_app, &connect_to_addr](IDP8PeerInstance &p)
+	{
+		return p->Connect(
+			&connect_to_app,  /* pdnAppDesc */
+			connect_to_addr,  /* pHostAddr */
+			NULL,             /* pDeviceInfo */
+			NULL,             /* pdnSecurity */
+			NULL,             /* pdnCredentials */
+			NULL,             /* pvUserConnectData */
+			0,                /* dwUserConnectDataSize */
+			NULL,             /* pvPlayerContext */
+			NULL,             /* pvAsyncContext */
+			NULL,             /* phAsyncHandle */
+			DPNCONNECT_SYNC   /* dwFlags */
+		);
+	};
 	
-	TestPeer peer2("peer2");
-	ASSERT_EQ(peer2->Connect(
-		&app_desc,        /* pdnAppDesc */
-		connect_addr,     /* pHostAddr */
-		NULL,             /* pDeviceInfo */
+	IDP8PeerInstance p1, p2, p3;
+	
+	ASSERT_EQ(p1->Initialize(&null_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p1), S_OK);
+	
+	ASSERT_EQ(p2->Initialize(&null_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p2), S_OK);
+	
+	ASSERT_EQ(p3->Initialize(&null_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p3), S_OK);
+	
+	/* The handshakes with the other peers complete while the joining peer is still
+	 * busy in its first callbacks, they must still all be announced before the connect
+	 * completes, with the local player first.
+	*/
+	
+	std::mutex seq_lock;
+	std::vector<DWORD> seq;
+	std::vector<DPNID> created;
+	DPNID local_id = -1;
+	
+	std::function<HRESULT(DWORD,PVOID)> p4_cb =
+		[&seq_lock, &seq, &created, &local_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				Sleep(100);
+				
+				std::unique_lock<std::mutex> l(seq_lock);
+				created.push_back(((DPNMSG_CREATE_PLAYER*)(pMessage))->dpnidPlayer);
+			}
+			else if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				std::unique_lock<std::mutex> l(seq_lock);
+				local_id = ((DPNMSG_CONNECT_COMPLETE*)(pMessage))->dpnidLocal;
+			}
+			
+			std::unique_lock<std::mutex> l(seq_lock);
+			seq.push_back(dwMessageType);
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p4;
+	
+	ASSERT_EQ(p4->Initialize(&p4_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p4), S_OK);
+	
+	std::unique_lock<std::mutex> l(seq_lock);
+	
+	ASSERT_EQ(seq.size(), 6U);
+	
+	for(int i = 0; i < 5; ++i)
+	{
+		EXPECT_EQ(seq[i], DPN_MSGID_CREATE_PLAYER);
+	}
+	
+	EXPECT_EQ(seq[5], DPN_MSGID_CONNECT_COMPLETE);
+	
+	ASSERT_EQ(created.size(), 5U);
+	EXPECT_EQ(created[0], local_id);
+	
+	std::set<DPNID> unique_created(created.begin(), created.end());
+	EXPECT_EQ(unique_created.size(), 5U);
+}
+
+TEST(DirectPlay8Peer, ConnectToMeshMessagesDuringJoin)
+{
+	/* Every other player sends a message to the joining peer as soon as it learns of it,
+	 * these must not be delivered until the joining peer has raised DPNMSG_CREATE_PLAYER
+	 * for the sender, even when the sender's handshake completes while the joining peer
+	 * is still busy in its first callbacks.
+	*/
+	
+	std::atomic<bool> joining(false);
+	
+	IDP8PeerInstance p1, p2;
+	IDP8PeerInstance *host_p = NULL;
+	
+	DPNID host_player_id = -1;
+	
+	auto send_hello = [](IDP8PeerInstance &p, DPNID to)
+	{
+		static const unsigned char DATA[] = { 0x00, 0x01, 0x02, 0x03 };
+		
+		DPN_BUFFER_DESC bd[] = {
+			{ sizeof(DATA), (BYTE*)(DATA) },
+		};
+		
+		DPNHANDLE send_handle;
+		
+		EXPECT_EQ(p->SendTo(
+			to,
+			bd,
+			1,
+			0,
+			NULL,
+			&send_handle,
+			(DPNSEND_GUARANTEED | DPNSEND_NOCOMPLETE)
+		), DPNSUCCESS_PENDING);
+	};
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&joining, &host_p, &host_player_id, &send_hello]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				
+				if(host_player_id == -1)
+				{
+					host_player_id = cp->dpnidPlayer;
+				}
+				else if(joining)
+				{
+					send_hello(*host_p, cp->dpnidPlayer);
+				}
+			}
+			
+			return DPN_OK;
+		});
+	
+	host_p = &(host.dp8p);
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&joining, &p1, &send_hello]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && joining)
+			{
+				send_hello(p1, ((DPNMSG_CREATE_PLAYER*)(pMessage))->dpnidPlayer);
+			}
+			
+			return DPN_OK;
+		};
+	
+	std::function<HRESULT(DWORD,PVOID)> p2_cb =
+		[&joining, &p2, &send_hello]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && joining)
+			{
+				send_hello(p2, ((DPNMSG_CREATE_PLAYER*)(pMessage))->dpnidPlayer);
+			}
+			
+			return DPN_OK;
+		};
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	auto connect = [&connect_to_app, &connect_to_addr](IDP8PeerInstance &p)
+	{
+		return p->Connect(
+			&connect_to_app,  /* pdnAppDesc */
+			connect_to_addr,  /* pHostAddr */
+			NULL,             /* pDeviceInfo */
+			NULL,             /* pdnSecurity */
+			NULL,             /* pdnCredentials */
+			NULL,             /* pvUserConnectData */
+			0,                /* dwUserConnectDataSize */
+			NULL,             /* pvPlayerContext */
+			NULL,             /* pvAsyncContext */
+			NULL,             /* phAsyncHandle */
+			DPNCONNECT_SYNC   /* dwFlags */
+		);
+	};
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p1), S_OK);
+	
+	ASSERT_EQ(p2->Initialize(&p2_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p2), S_OK);
+	
+	std::mutex p3_lock;
+	std::set<DPNID> p3_created;
+	std::set<DPNID> p3_received;
+	
+	std::function<HRESULT(DWORD,PVOID)> p3_cb =
+		[&p3_lock, &p3_created, &p3_received]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER)
+			{
+				Sleep(100);
+				
+				std::unique_lock<std::mutex> l(p3_lock);
+				p3_created.insert(((DPNMSG_CREATE_PLAYER*)(pMessage))->dpnidPlayer);
+			}
+			else if(dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				DPNID sender = ((DPNMSG_RECEIVE*)(pMessage))->dpnidSender;
+				
+				std::unique_lock<std::mutex> l(p3_lock);
+				
+				EXPECT_TRUE(p3_created.find(sender) != p3_created.end())
+					<< "DPN_MSGID_RECEIVE from player " << sender << " before DPN_MSGID_CREATE_PLAYER";
+				
+				p3_received.insert(sender);
+			}
+			
+			return DPN_OK;
+		};
+	
+	joining = true;
+	
+	IDP8PeerInstance p3;
+	
+	ASSERT_EQ(p3->Initialize(&p3_cb, &callback_shim, 0), S_OK);
+	ASSERT_EQ(connect(p3), S_OK);
+	
+	/* Let the messages get through. */
+	Sleep(500);
+	
+	std::unique_lock<std::mutex> l(p3_lock);
+	
+	EXPECT_EQ(p3_created.size(),  4U);
+	EXPECT_EQ(p3_received.size(), 3U);
+}
+
+TEST(DirectPlay8Peer, HostPeerSoftClose)
+{
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID_1;
+	app_desc.pwszSessionName = L"Session 1";
+	
+	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	
+	TestPeer host("host");
+	ASSERT_EQ(host->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, 0), S_OK);
+	
+	IDP8AddressInstance connect_addr(CLSID_DP8SP_TCPIP, L"127.0.0.1", PORT);
+	
+	TestPeer peer1("peer1");
+	ASSERT_EQ(peer1->Connect(
+		&app_desc,        /* pdnAppDesc */
+		connect_addr,     /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		0,                /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	TestPeer peer2("peer2");
+	ASSERT_EQ(peer2->Connect(
+		&app_desc,        /* pdnAppDesc */
+		connect_addr,     /* pHostAddr */
+		NULL,             /* pDeviceInfo */
 		NULL,             /* pdnSecurity */
 		NULL,             /* pdnCredentials */
 		NULL,             /* pvUserConnectData */
@@ -3228,12 +3856,13 @@ TEST(DirectPlay8Peer, HostPeerHardClose)
 	EXPECT_TRUE(p2_ts);
 }
 
-TEST(DirectPlay8Peer, NonHostPeerSoftClose)
+TEST(DirectPlay8Peer, HostMigration)
 {
 	DPN_APPLICATION_DESC app_desc;
 	memset(&app_desc, 0, sizeof(app_desc));
 	
 	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = DPNSESSION_MIGRATE_HOST;
 	app_desc.guidApplication = APP_GUID_1;
 	app_desc.pwszSessionName = L"Session 1";
 	
@@ -3276,116 +3905,268 @@ TEST(DirectPlay8Peer, NonHostPeerSoftClose)
 	
 	Sleep(100);
 	
-	host.expect_begin();
-	host.expect_push([&peer2](DWORD dwMessageType, PVOID pMessage)
+	/* peer1 joined first, so it has the lowest remaining player ID and should be
+	 * elected as the new host by both of the remaining peers.
+	*/
+	
+	DPNID p1_new_host = -1;
+	bool p1_dp = false;
+	
+	peer1.expect_begin();
+	peer1.expect_push([&host, &p1_new_host, &p1_dp](DWORD dwMessageType, PVOID pMessage)
 	{
-		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
-		
 		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
 		{
 			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
 			
 			EXPECT_EQ(dp->dwSize,          sizeof(DPNMSG_DESTROY_PLAYER));
-			EXPECT_EQ(dp->dpnidPlayer,     peer2.first_cc_dpnidLocal);
+			EXPECT_EQ(dp->dpnidPlayer,     host.first_cp_dpnidPlayer);
 			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
-			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_CONNECTIONLOST);
+			
+			p1_dp = true;
 		}
-		
-		return DPN_OK;
-	});
-	
-	peer1.expect_begin();
-	peer1.expect_push([&peer2](DWORD dwMessageType, PVOID pMessage)
-	{
-		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
-		
-		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		else if(dwMessageType == DPN_MSGID_HOST_MIGRATE)
 		{
-			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			DPNMSG_HOST_MIGRATE *hm = (DPNMSG_HOST_MIGRATE*)(pMessage);
 			
-			EXPECT_EQ(dp->dwSize,          sizeof(DPNMSG_DESTROY_PLAYER));
-			EXPECT_EQ(dp->dpnidPlayer,     peer2.first_cc_dpnidLocal);
-			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
-			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+			EXPECT_EQ(hm->dwSize,          sizeof(DPNMSG_HOST_MIGRATE));
+			EXPECT_EQ(hm->pvPlayerContext, (void*)~(uintptr_t)(hm->dpnidNewHost));
+			
+			p1_new_host = hm->dpnidNewHost;
+		}
+		else{
+			ADD_FAILURE() << "Unexpected message type: " << dwMessageType;
 		}
 		
 		return DPN_OK;
-	});
+	}, 2);
 	
-	DPNID p2_dp1_dpnidPlayer;
-	DPNID p2_dp2_dpnidPlayer;
+	DPNID p2_new_host = -1;
+	bool p2_dp = false;
 	
 	peer2.expect_begin();
-	peer2.expect_push([&host, &peer1, &peer2, &p2_dp1_dpnidPlayer](DWORD dwMessageType, PVOID pMessage)
+	peer2.expect_push([&host, &p2_new_host, &p2_dp](DWORD dwMessageType, PVOID pMessage)
 	{
-		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
-		
 		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
 		{
 			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
 			
-			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
-			
-			EXPECT_TRUE((dp->dpnidPlayer == host.first_cp_dpnidPlayer || dp->dpnidPlayer == peer1.first_cc_dpnidLocal))
-				<< "(dpnidPlayer = " << dp->dpnidPlayer
-				<< ", host = " << host.first_cp_dpnidPlayer
-				<< ", peer1 = " << peer1.first_cc_dpnidLocal
-				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
-			
+			EXPECT_EQ(dp->dwSize,          sizeof(DPNMSG_DESTROY_PLAYER));
+			EXPECT_EQ(dp->dpnidPlayer,     host.first_cp_dpnidPlayer);
 			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
-			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
 			
-			p2_dp1_dpnidPlayer = dp->dpnidPlayer;
+			p2_dp = true;
 		}
-		
-		return DPN_OK;
-	});
-	peer2.expect_push([&host, &peer1, &peer2, &p2_dp2_dpnidPlayer](DWORD dwMessageType, PVOID pMessage)
-	{
-		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
-		
-		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		else if(dwMessageType == DPN_MSGID_HOST_MIGRATE)
 		{
-			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
-			
-			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
-			
-			EXPECT_TRUE((dp->dpnidPlayer == host.first_cp_dpnidPlayer || dp->dpnidPlayer == peer1.first_cc_dpnidLocal))
-				<< "(dpnidPlayer = " << dp->dpnidPlayer
-				<< ", host = " << host.first_cp_dpnidPlayer
-				<< ", peer1 = " << peer1.first_cc_dpnidLocal
-				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
+			DPNMSG_HOST_MIGRATE *hm = (DPNMSG_HOST_MIGRATE*)(pMessage);
 			
-			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
-			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+			EXPECT_EQ(hm->dwSize,          sizeof(DPNMSG_HOST_MIGRATE));
+			EXPECT_EQ(hm->pvPlayerContext, (void*)~(uintptr_t)(hm->dpnidNewHost));
 			
-			p2_dp2_dpnidPlayer = dp->dpnidPlayer;
+			p2_new_host = hm->dpnidNewHost;
 		}
-		
-		return DPN_OK;
-	});
-	peer2.expect_push([&host, &peer1, &peer2](DWORD dwMessageType, PVOID pMessage)
-	{
-		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
-		
-		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
-		{
-			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
-			
-			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
-			
-			EXPECT_TRUE((dp->dpnidPlayer == peer2.first_cc_dpnidLocal))
-				<< "(dpnidPlayer = " << dp->dpnidPlayer
-				<< ", host = " << host.first_cp_dpnidPlayer
-				<< ", peer1 = " << peer1.first_cc_dpnidLocal
-				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
-			
-			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
-			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+		else{
+			ADD_FAILURE() << "Unexpected message type: " << dwMessageType;
 		}
 		
 		return DPN_OK;
-	});
+	}, 2);
+	
+	host->Close(DPNCLOSE_IMMEDIATE);
+	
+	Sleep(100);
+	
+	peer2.expect_end();
+	peer1.expect_end();
+	
+	EXPECT_TRUE(p1_dp);
+	EXPECT_EQ(p1_new_host, peer1.first_cc_dpnidLocal);
+	
+	EXPECT_TRUE(p2_dp);
+	EXPECT_EQ(p2_new_host, peer1.first_cc_dpnidLocal);
+	
+	/* peer1 should now be acting as the host of the session. */
+	
+	DWORD appdesc_size = 0;
+	ASSERT_EQ(peer1->GetApplicationDesc(NULL, &appdesc_size, 0), DPNERR_BUFFERTOOSMALL);
+	
+	std::vector<unsigned char> appdesc_buf(appdesc_size);
+	DPN_APPLICATION_DESC *appdesc = (DPN_APPLICATION_DESC*)(appdesc_buf.data());
+	
+	appdesc->dwSize = sizeof(DPN_APPLICATION_DESC);
+	
+	ASSERT_EQ(peer1->GetApplicationDesc(appdesc, &appdesc_size, 0), S_OK);
+	
+	EXPECT_EQ((appdesc->dwFlags & DPNSESSION_MIGRATE_HOST), DPNSESSION_MIGRATE_HOST);
+	EXPECT_EQ(appdesc->dwCurrentPlayers, 2);
+	
+	DPN_APPLICATION_DESC new_desc = *appdesc;
+	new_desc.pwszSessionName = L"Session 2";
+	
+	EXPECT_EQ(peer1->SetApplicationDesc(&new_desc, 0), S_OK);
+	EXPECT_EQ(peer2->SetApplicationDesc(&new_desc, 0), DPNERR_NOTHOST);
+}
+
+TEST(DirectPlay8Peer, NonHostPeerSoftClose)
+{
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID_1;
+	app_desc.pwszSessionName = L"Session 1";
+	
+	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	
+	TestPeer host("host");
+	ASSERT_EQ(host->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, 0), S_OK);
+	
+	IDP8AddressInstance connect_addr(CLSID_DP8SP_TCPIP, L"127.0.0.1", PORT);
+	
+	TestPeer peer1("peer1");
+	ASSERT_EQ(peer1->Connect(
+		&app_desc,        /* pdnAppDesc */
+		connect_addr,     /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		0,                /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	TestPeer peer2("peer2");
+	ASSERT_EQ(peer2->Connect(
+		&app_desc,        /* pdnAppDesc */
+		connect_addr,     /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		0,                /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	Sleep(100);
+	
+	host.expect_begin();
+	host.expect_push([&peer2](DWORD dwMessageType, PVOID pMessage)
+	{
+		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
+		
+		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		{
+			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			
+			EXPECT_EQ(dp->dwSize,          sizeof(DPNMSG_DESTROY_PLAYER));
+			EXPECT_EQ(dp->dpnidPlayer,     peer2.first_cc_dpnidLocal);
+			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+		}
+		
+		return DPN_OK;
+	});
+	
+	peer1.expect_begin();
+	peer1.expect_push([&peer2](DWORD dwMessageType, PVOID pMessage)
+	{
+		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
+		
+		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		{
+			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			
+			EXPECT_EQ(dp->dwSize,          sizeof(DPNMSG_DESTROY_PLAYER));
+			EXPECT_EQ(dp->dpnidPlayer,     peer2.first_cc_dpnidLocal);
+			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+		}
+		
+		return DPN_OK;
+	});
+	
+	DPNID p2_dp1_dpnidPlayer;
+	DPNID p2_dp2_dpnidPlayer;
+	
+	peer2.expect_begin();
+	peer2.expect_push([&host, &peer1, &peer2, &p2_dp1_dpnidPlayer](DWORD dwMessageType, PVOID pMessage)
+	{
+		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
+		
+		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		{
+			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			
+			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
+			
+			EXPECT_TRUE((dp->dpnidPlayer == host.first_cp_dpnidPlayer || dp->dpnidPlayer == peer1.first_cc_dpnidLocal))
+				<< "(dpnidPlayer = " << dp->dpnidPlayer
+				<< ", host = " << host.first_cp_dpnidPlayer
+				<< ", peer1 = " << peer1.first_cc_dpnidLocal
+				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
+			
+			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+			
+			p2_dp1_dpnidPlayer = dp->dpnidPlayer;
+		}
+		
+		return DPN_OK;
+	});
+	peer2.expect_push([&host, &peer1, &peer2, &p2_dp2_dpnidPlayer](DWORD dwMessageType, PVOID pMessage)
+	{
+		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
+		
+		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		{
+			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			
+			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
+			
+			EXPECT_TRUE((dp->dpnidPlayer == host.first_cp_dpnidPlayer || dp->dpnidPlayer == peer1.first_cc_dpnidLocal))
+				<< "(dpnidPlayer = " << dp->dpnidPlayer
+				<< ", host = " << host.first_cp_dpnidPlayer
+				<< ", peer1 = " << peer1.first_cc_dpnidLocal
+				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
+			
+			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+			
+			p2_dp2_dpnidPlayer = dp->dpnidPlayer;
+		}
+		
+		return DPN_OK;
+	});
+	peer2.expect_push([&host, &peer1, &peer2](DWORD dwMessageType, PVOID pMessage)
+	{
+		EXPECT_EQ(dwMessageType, DPN_MSGID_DESTROY_PLAYER);
+		
+		if(dwMessageType == DPN_MSGID_DESTROY_PLAYER)
+		{
+			DPNMSG_DESTROY_PLAYER *dp = (DPNMSG_DESTROY_PLAYER*)(pMessage);
+			
+			EXPECT_EQ(dp->dwSize, sizeof(DPNMSG_DESTROY_PLAYER));
+			
+			EXPECT_TRUE((dp->dpnidPlayer == peer2.first_cc_dpnidLocal))
+				<< "(dpnidPlayer = " << dp->dpnidPlayer
+				<< ", host = " << host.first_cp_dpnidPlayer
+				<< ", peer1 = " << peer1.first_cc_dpnidLocal
+				<< ", peer2 = " << peer2.first_cc_dpnidLocal << ")";
+			
+			EXPECT_EQ(dp->pvPlayerContext, (void*)~(uintptr_t)(dp->dpnidPlayer));
+			EXPECT_EQ(dp->dwReason,        DPNDESTROYPLAYERREASON_NORMAL);
+		}
+		
+		return DPN_OK;
+	});
 	
 	peer2->Close(0);
 	
@@ -6268,6 +7049,1018 @@ TEST(DirectPlay8Peer, SyncSendToHostToNone)
 	testing = false;
 }
 
+TEST(DirectPlay8Peer, GetConnectionInfo)
+{
+	DPNID host_player_id = -1, p1_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&host_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&p1_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+			{
+				DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+				p1_player_id = cc->dpnidLocal;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	DPN_BUFFER_DESC bd1[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	DPN_BUFFER_DESC bd2[] = {
+		{ 5, (BYTE*)("Hello") },
+	};
+	
+	ASSERT_EQ(p1->SendTo(host_player_id, bd1, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED), DPN_OK);
+	ASSERT_EQ(p1->SendTo(host_player_id, bd2, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_PRIORITY_HIGH), DPN_OK);
+	
+	/* Let the messages get through. */
+	Sleep(250);
+	
+	DPN_CONNECTION_INFO ci;
+	
+	memset(&ci, 0, sizeof(ci));
+	ci.dwSize = sizeof(ci) - 1;
+	
+	EXPECT_EQ(p1->GetConnectionInfo(host_player_id, &ci, 0), DPNERR_INVALIDPARAM);
+	
+	memset(&ci, 0, sizeof(ci));
+	ci.dwSize = sizeof(ci);
+	
+	EXPECT_EQ(p1->GetConnectionInfo(p1_player_id, &ci, 0), DPNERR_INVALIDPLAYER);
+	
+	memset(&ci, 0, sizeof(ci));
+	ci.dwSize = sizeof(ci);
+	
+	ASSERT_EQ(p1->GetConnectionInfo(host_player_id, &ci, 0), S_OK);
+	
+	EXPECT_EQ(ci.dwBytesSentGuaranteed,               12);
+	EXPECT_EQ(ci.dwPacketsSentGuaranteed,             1);
+	EXPECT_EQ(ci.dwBytesSentNonGuaranteed,            5);
+	EXPECT_EQ(ci.dwPacketsSentNonGuaranteed,          1);
+	EXPECT_EQ(ci.dwMessagesTransmittedHighPriority,   1);
+	EXPECT_EQ(ci.dwMessagesTransmittedNormalPriority, 1);
+	EXPECT_EQ(ci.dwMessagesTransmittedLowPriority,    0);
+	EXPECT_EQ(ci.dwMessagesReceived,                  0);
+	
+	memset(&ci, 0, sizeof(ci));
+	ci.dwSize = sizeof(ci);
+	
+	ASSERT_EQ(host->GetConnectionInfo(p1_player_id, &ci, 0), S_OK);
+	
+	EXPECT_EQ(ci.dwBytesReceivedGuaranteed,      12);
+	EXPECT_EQ(ci.dwPacketsReceivedGuaranteed,    1);
+	EXPECT_EQ(ci.dwBytesReceivedNonGuaranteed,   5);
+	EXPECT_EQ(ci.dwPacketsReceivedNonGuaranteed, 1);
+	EXPECT_EQ(ci.dwMessagesReceived,             2);
+	EXPECT_EQ(ci.dwPacketsSentGuaranteed,        0);
+	EXPECT_EQ(ci.dwPacketsSentNonGuaranteed,     0);
+	
+	DPLITE_CONNECTION_LATENCY cl;
+	
+	memset(&cl, 0, sizeof(cl));
+	cl.dwSize = sizeof(cl);
+	
+	ASSERT_EQ(p1->GetConnectionInfo(host_player_id, (DPN_CONNECTION_INFO*)(&cl), 0), S_OK);
+	
+	DWORD queued = 0, written = 0;
+	for(int i = 0; i < DPLITE_LATENCY_HISTOGRAM_BUCKETS; ++i)
+	{
+		queued  += cl.dwQueueHistogram[i];
+		written += cl.dwWireHistogram[i];
+	}
+	
+	EXPECT_EQ(queued,  2);
+	EXPECT_EQ(written, 2);
+	
+	memset(&cl, 0, sizeof(cl));
+	cl.dwSize = sizeof(cl);
+	
+	ASSERT_EQ(host->GetConnectionInfo(p1_player_id, (DPN_CONNECTION_INFO*)(&cl), 0), S_OK);
+	
+	queued = 0, written = 0;
+	for(int i = 0; i < DPLITE_LATENCY_HISTOGRAM_BUCKETS; ++i)
+	{
+		queued  += cl.dwQueueHistogram[i];
+		written += cl.dwWireHistogram[i];
+	}
+	
+	EXPECT_EQ(queued,  0);
+	EXPECT_EQ(written, 0);
+}
+
+TEST(DirectPlay8Peer, SetCapsKeepAlive)
+{
+	IDP8PeerInstance instance;
+	
+	ASSERT_EQ(instance->Initialize(NULL, &callback_shim, 0), S_OK);
+	
+	DPN_CAPS_EX caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(instance->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwTimeoutUntilKeepAlive, 25000);
+	EXPECT_EQ(caps.dwNumSendRetries,        10);
+	EXPECT_EQ(caps.dwMaxSendRetryInterval,  5000);
+	
+	caps.dwTimeoutUntilKeepAlive = 0;
+	
+	EXPECT_EQ(instance->SetCaps((DPN_CAPS*)(&caps), 0), DPNERR_INVALIDPARAM);
+	
+	caps.dwTimeoutUntilKeepAlive = 1000;
+	caps.dwNumSendRetries        = 2;
+	caps.dwMaxSendRetryInterval  = 250;
+	
+	ASSERT_EQ(instance->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(instance->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwTimeoutUntilKeepAlive, 1000);
+	EXPECT_EQ(caps.dwNumSendRetries,        2);
+	EXPECT_EQ(caps.dwMaxSendRetryInterval,  250);
+}
+
+TEST(DirectPlay8Peer, SetCapsSocketProfile)
+{
+	TestPeer host("host");
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwSocketProfile, DPLITE_SOCKET_PROFILE_DEFAULT);
+	
+	caps.dwSocketProfile = DPLITE_SOCKET_PROFILE_LAN + 1;
+	
+	EXPECT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), DPNERR_INVALIDPARAM);
+	
+	caps.dwSocketProfile = DPLITE_SOCKET_PROFILE_LOW_LATENCY;
+	
+	ASSERT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	DPN_SP_CAPS sp_caps;
+	memset(&sp_caps, 0, sizeof(sp_caps));
+	
+	sp_caps.dwSize = sizeof(sp_caps);
+	
+	ASSERT_EQ(host->GetSPCaps(&CLSID_DP8SP_TCPIP, &sp_caps, 0), S_OK);
+	
+	/* Send buffer size from the profile. */
+	EXPECT_EQ(sp_caps.dwSystemBufferSize, 64 * 1024);
+	
+	/* Passing it back shouldn't override the profile. */
+	ASSERT_EQ(host->SetSPCaps(&CLSID_DP8SP_TCPIP, &sp_caps, 0), S_OK);
+	
+	caps.dwSocketProfile = DPLITE_SOCKET_PROFILE_DEFAULT;
+	
+	ASSERT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	ASSERT_EQ(host->GetSPCaps(&CLSID_DP8SP_TCPIP, &sp_caps, 0), S_OK);
+	
+	EXPECT_EQ(sp_caps.dwSystemBufferSize, 8192);
+	
+	caps.dwSocketProfile = DPLITE_SOCKET_PROFILE_LOW_LATENCY;
+	
+	ASSERT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	sp_caps.dwSystemBufferSize = 128 * 1024;
+	
+	ASSERT_EQ(host->SetSPCaps(&CLSID_DP8SP_TCPIP, &sp_caps, 0), S_OK);
+	
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwSocketProfile, DPLITE_SOCKET_PROFILE_LOW_LATENCY);
+	
+	memset(&sp_caps, 0, sizeof(sp_caps));
+	sp_caps.dwSize = sizeof(sp_caps);
+	
+	ASSERT_EQ(host->GetSPCaps(&CLSID_DP8SP_TCPIP, &sp_caps, 0), S_OK);
+	
+	EXPECT_EQ(sp_caps.dwSystemBufferSize, 128 * 1024);
+	
+	/* Sessions should still work with the options applied. */
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID_1;
+	app_desc.pwszSessionName = L"Session 1";
+	
+	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	
+	ASSERT_EQ(host->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, 0), S_OK);
+	
+	IDP8AddressInstance connect_addr(CLSID_DP8SP_TCPIP, L"127.0.0.1", PORT);
+	
+	TestPeer peer1("peer1");
+	ASSERT_EQ(peer1->Connect(
+		&app_desc,        /* pdnAppDesc */
+		connect_addr,     /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		0,                /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+}
+
+TEST(DirectPlay8Peer, HandlerStats)
+{
+	std::atomic<bool> testing(false);
+	DPNID host_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			if(testing && dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				/* A slow application. */
+				Sleep(50);
+			}
+			
+			return DPN_OK;
+		});
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwHandlerWarnTime, 0);
+	
+	caps.dwHandlerWarnTime = 20;
+	
+	ASSERT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	TestPeer peer1("peer1");
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(peer1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	testing = true;
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	ASSERT_EQ(peer1->SendTo(host_player_id, bd, 1, 0, NULL, NULL, DPNSEND_SYNC), S_OK);
+	
+	/* Let the message get through and the handler finish. */
+	Sleep(250);
+	
+	testing = false;
+	
+	DPLITE_HANDLER_STATS stats;
+	memset(&stats, 0, sizeof(stats));
+	
+	stats.dwSize        = sizeof(stats);
+	stats.dwMessageType = DPN_MSGID_RECEIVE;
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&stats), 0), S_OK);
+	
+	EXPECT_EQ(stats.dwMessageType,  DPN_MSGID_RECEIVE);
+	EXPECT_EQ(stats.dwCount,        1);
+	EXPECT_EQ(stats.dwSlowCount,    1);
+	EXPECT_GE(stats.dwMaxTime,      40000);
+	EXPECT_EQ(stats.qwTotalTime,    stats.dwMaxTime);
+	EXPECT_EQ(stats.dpnidMaxPlayer, peer1.first_cc_dpnidLocal);
+	
+	/* Totals for all message types, the receive was the slowest. */
+	
+	memset(&stats, 0, sizeof(stats));
+	stats.dwSize = sizeof(stats);
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&stats), DPLITE_HANDLER_STATS_RESET), S_OK);
+	
+	EXPECT_EQ(stats.dwMessageType, DPN_MSGID_RECEIVE);
+	EXPECT_GT(stats.dwCount,       1);  /* CREATE_PLAYER etc */
+	EXPECT_EQ(stats.dwSlowCount,   1);
+	
+	memset(&stats, 0, sizeof(stats));
+	stats.dwSize = sizeof(stats);
+	
+	ASSERT_EQ(host->GetCaps((DPN_CAPS*)(&stats), 0), S_OK);
+	
+	EXPECT_EQ(stats.dwCount,   0);
+	EXPECT_EQ(stats.dwMaxTime, 0);
+	
+	stats.dwMessageType = 0x1234;
+	
+	EXPECT_EQ(host->GetCaps((DPN_CAPS*)(&stats), 0), DPNERR_INVALIDPARAM);
+}
+
+TEST(DirectPlay8Peer, HandlerStatsEnumHostsResponse)
+{
+	SessionHost a1s1(APP_GUID_1, L"Application 1 Session 1");
+	
+	std::function<HRESULT(DWORD,PVOID)> client_cb =
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+	{
+		if(dwMessageType == DPN_MSGID_ENUM_HOSTS_RESPONSE)
+		{
+			Sleep(50);
+		}
+		
+		return DPN_OK;
+	};
+	
+	IDP8PeerInstance client;
+	
+	ASSERT_EQ(client->Initialize(&client_cb, &callback_shim, 0), S_OK);
+	
+	IDP8AddressInstance device_address;
+	device_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	ASSERT_EQ(client->EnumHosts(
+		NULL,              /* pApplicationDesc */
+		NULL,              /* pdpaddrHost */
+		device_address,    /* pdpaddrDeviceInfo */
+		NULL,              /* pvUserEnumData */
+		0,                 /* dwUserEnumDataSize */
+		1,                 /* dwEnumCount */
+		500,               /* dwRetryInterval */
+		500,               /* dwTimeOut*/
+		NULL,              /* pvUserContext */
+		NULL,              /* pAsyncHandle */
+		DPNENUMHOSTS_SYNC  /* dwFlags */
+	), S_OK);
+	
+	DPLITE_HANDLER_STATS stats;
+	memset(&stats, 0, sizeof(stats));
+	
+	stats.dwSize        = sizeof(stats);
+	stats.dwMessageType = DPN_MSGID_ENUM_HOSTS_RESPONSE;
+	
+	ASSERT_EQ(client->GetCaps((DPN_CAPS*)(&stats), 0), S_OK);
+	
+	EXPECT_GE(stats.dwCount,   1);
+	EXPECT_GE(stats.dwMaxTime, 40000);
+}
+
+TEST(DirectPlay8Peer, HostSharedPort)
+{
+	auto get_appdesc = [](TestPeer &peer, GUID *instance_guid, std::wstring *session_name)
+	{
+		DWORD appdesc_size = 0;
+		ASSERT_EQ(peer->GetApplicationDesc(NULL, &appdesc_size, 0), DPNERR_BUFFERTOOSMALL);
+		
+		std::vector<unsigned char> appdesc_buf(appdesc_size);
+		DPN_APPLICATION_DESC *appdesc = (DPN_APPLICATION_DESC*)(appdesc_buf.data());
+		
+		appdesc->dwSize = sizeof(DPN_APPLICATION_DESC);
+		
+		ASSERT_EQ(peer->GetApplicationDesc(appdesc, &appdesc_size, 0), S_OK);
+		
+		*instance_guid = appdesc->guidInstance;
+		*session_name  = appdesc->pwszSessionName;
+	};
+	
+	auto connect = [](TestPeer &peer, const GUID &instance_guid)
+	{
+		DPN_APPLICATION_DESC connect_to_app;
+		memset(&connect_to_app, 0, sizeof(connect_to_app));
+		
+		connect_to_app.dwSize          = sizeof(connect_to_app);
+		connect_to_app.guidInstance    = instance_guid;
+		connect_to_app.guidApplication = APP_GUID_1;
+		
+		IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+		
+		return peer->Connect(
+			&connect_to_app,  /* pdnAppDesc */
+			connect_to_addr,  /* pHostAddr */
+			NULL,             /* pDeviceInfo */
+			NULL,             /* pdnSecurity */
+			NULL,             /* pdnCredentials */
+			NULL,             /* pvUserConnectData */
+			0,                /* dwUserConnectDataSize */
+			NULL,             /* pvPlayerContext */
+			NULL,             /* pvAsyncContext */
+			NULL,             /* phAsyncHandle */
+			DPNCONNECT_SYNC   /* dwFlags */
+		);
+	};
+	
+	TestPeer host1("host1");
+	TestPeer host2("host2");
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = DPNSESSION_NODPNSVR;
+	app_desc.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	
+	/* A port must be given to share it. */
+	
+	IDP8AddressInstance no_port_addr;
+	no_port_addr->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	app_desc.pwszSessionName = L"Session 1";
+	EXPECT_EQ(host1->Host(&app_desc, &(no_port_addr.instance), 1, NULL, NULL, 0, DPLITE_HOST_SHAREDPORT), DPNERR_INVALIDPARAM);
+	
+	ASSERT_EQ(host1->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, DPLITE_HOST_SHAREDPORT), S_OK);
+	
+	app_desc.pwszSessionName = L"Session 2";
+	ASSERT_EQ(host2->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, DPLITE_HOST_SHAREDPORT), S_OK);
+	
+	GUID instance1, instance2;
+	std::wstring name;
+	
+	get_appdesc(host1, &instance1, &name);
+	get_appdesc(host2, &instance2, &name);
+	
+	ASSERT_NE(instance1, instance2);
+	
+	/* Each connection should be passed to the session named in it. */
+	
+	TestPeer peer1("peer1");
+	ASSERT_EQ(connect(peer1, instance2), S_OK);
+	
+	GUID peer1_instance;
+	get_appdesc(peer1, &peer1_instance, &name);
+	
+	EXPECT_EQ(peer1_instance, instance2);
+	EXPECT_EQ(name, std::wstring(L"Session 2"));
+	
+	TestPeer peer2("peer2");
+	ASSERT_EQ(connect(peer2, instance1), S_OK);
+	
+	GUID peer2_instance;
+	get_appdesc(peer2, &peer2_instance, &name);
+	
+	EXPECT_EQ(peer2_instance, instance1);
+	EXPECT_EQ(name, std::wstring(L"Session 1"));
+	
+	/* An instance which isn't hosted here should be rejected. */
+	
+	TestPeer peer3("peer3");
+	EXPECT_EQ(connect(peer3, APP_GUID_2), DPNERR_INVALIDINSTANCE);
+	
+	/* Closing one session shouldn't affect the other, and a connection which doesn't name
+	 * an instance should go to the remaining session of the application.
+	*/
+	
+	peer2->Close(0);
+	host1->Close(0);
+	
+	TestPeer peer4("peer4");
+	ASSERT_EQ(connect(peer4, GUID_NULL), S_OK);
+	
+	GUID peer4_instance;
+	get_appdesc(peer4, &peer4_instance, &name);
+	
+	EXPECT_EQ(peer4_instance, instance2);
+	EXPECT_EQ(name, std::wstring(L"Session 2"));
+}
+
+TEST(DirectPlay8Peer, HostSharedPortIdleConnectionTimeout)
+{
+	TestPeer host("host");
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = DPNSESSION_NODPNSVR;
+	app_desc.guidApplication = APP_GUID_1;
+	app_desc.pwszSessionName = L"Session 1";
+	
+	IDP8AddressInstance host_addr(CLSID_DP8SP_TCPIP, PORT);
+	
+	ASSERT_EQ(host->Host(&app_desc, &(host_addr.instance), 1, NULL, NULL, 0, DPLITE_HOST_SHAREDPORT), S_OK);
+	
+	/* A connection which never sends anything should be dropped once it times out, even
+	 * though nothing else happens on the listener.
+	*/
+	
+	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	ASSERT_NE(sock, -1);
+	
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port        = htons(PORT);
+	
+	ASSERT_EQ(::connect(sock, (struct sockaddr*)(&addr), sizeof(addr)), 0);
+	
+	DWORD recv_timeout = 15000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)(&recv_timeout), sizeof(recv_timeout));
+	
+	DWORD start = GetTickCount();
+	
+	char c;
+	int r = recv(sock, &c, 1, 0);
+	
+	DWORD elapsed = GetTickCount() - start;
+	
+	EXPECT_LE(r, 0);
+	EXPECT_GE(elapsed, 9000U);
+	EXPECT_LT(elapsed, 14000U);
+	
+	closesocket(sock);
+}
+
+TEST(DirectPlay8Peer, KeepAliveIdleConnection)
+{
+	std::atomic<bool> testing(false);
+	
+	std::atomic<int> host_seq(0), p1_seq(0);
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&testing, &host_seq]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(testing)
+			{
+				int seq = ++host_seq;
+				ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&testing, &p1_seq]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(testing)
+			{
+				int seq = ++p1_seq;
+				ADD_FAILURE() << "Unexpected message of type " << dwMessageType <<", sequence " << seq;
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	/* Short keepalive timeout on both ends, so an idle connection will be dropped within a
+	 * couple of seconds unless pings are flowing in both directions.
+	*/
+	
+	DPN_CAPS_EX caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize                  = sizeof(caps);
+	caps.dwTimeoutUntilKeepAlive = 250;
+	caps.dwNumSendRetries        = 1;
+	caps.dwMaxSendRetryInterval  = 250;
+	
+	ASSERT_EQ(host->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	ASSERT_EQ(p1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	testing = true;
+	
+	/* Sit idle for a good few keepalive periods. */
+	Sleep(5000);
+	
+	EXPECT_EQ(host_seq, 0);
+	EXPECT_EQ(p1_seq, 0);
+	
+	testing = false;
+}
+
+TEST(DirectPlay8Peer, ThrottleSendRate)
+{
+	DPNID host_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&host_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(p1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	EXPECT_EQ(caps.dwMaxSendRate,       0);
+	EXPECT_EQ(caps.dwMaxPlayerSendRate, 0);
+	
+	caps.dwMaxPlayerSendRate = 20000;
+	
+	ASSERT_EQ(p1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	/* 10 * 2000 bytes at 20000 bytes/sec should take about a second, less whatever
+	 * fits in the initial burst.
+	*/
+	
+	std::vector<unsigned char> payload(2000, 0xAA);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ (DWORD)(payload.size()), payload.data() },
+	};
+	
+	DWORD start = GetTickCount();
+	
+	for(int i = 0; i < 10; ++i)
+	{
+		ASSERT_EQ(p1->SendTo(host_player_id, bd, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED), S_OK);
+	}
+	
+	DWORD elapsed = GetTickCount() - start;
+	
+	EXPECT_GE(elapsed, 700U);
+	EXPECT_LE(elapsed, 3000U);
+}
+
+TEST(DirectPlay8Peer, ThrottleDropsNonGuaranteed)
+{
+	DPNID host_player_id = -1;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&host_player_id]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::mutex results_lock;
+	std::map<HRESULT, int> results;
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[&results_lock, &results]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_SEND_COMPLETE)
+			{
+				DPNMSG_SEND_COMPLETE *sc = (DPNMSG_SEND_COMPLETE*)(pMessage);
+				
+				std::unique_lock<std::mutex> l(results_lock);
+				++(results[sc->hResultCode]);
+			}
+			
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* 10000 bytes/sec, low priority messages are dropped once more than 700 bytes are
+	 * queued up.
+	*/
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(p1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	caps.dwDropThresholdRate = 7;
+	caps.dwMaxPlayerSendRate = 10000;
+	
+	ASSERT_EQ(p1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	/* Give everything a moment to settle. */
+	Sleep(250);
+	
+	std::vector<unsigned char> payload(1000, 0xAA);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ (DWORD)(payload.size()), payload.data() },
+	};
+	
+	for(int i = 0; i < 20; ++i)
+	{
+		DPNHANDLE send_handle;
+		ASSERT_EQ(p1->SendTo(host_player_id, bd, 1, 0, NULL, &send_handle, DPNSEND_PRIORITY_LOW), DPNSUCCESS_PENDING);
+	}
+	
+	/* Wait for whatever was queued to trickle out. */
+	Sleep(3000);
+	
+	std::unique_lock<std::mutex> l(results_lock);
+	
+	EXPECT_GE(results[S_OK], 2);
+	EXPECT_GE(results[DPNERR_TIMEDOUT], 10);
+	EXPECT_EQ((results[S_OK] + results[DPNERR_TIMEDOUT]), 20);
+}
+
+TEST(DirectPlay8Peer, SendToLargeMessage)
+{
+	DPNID host_player_id = -1;
+	
+	std::mutex received_lock;
+	std::list< std::vector<unsigned char> > received;
+	
+	SessionHost host(APP_GUID_1, L"Session 1", PORT,
+		[&host_player_id, &received_lock, &received]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			if(dwMessageType == DPN_MSGID_CREATE_PLAYER && host_player_id == -1)
+			{
+				DPNMSG_CREATE_PLAYER *cp = (DPNMSG_CREATE_PLAYER*)(pMessage);
+				host_player_id = cp->dpnidPlayer;
+			}
+			else if(dwMessageType == DPN_MSGID_RECEIVE)
+			{
+				DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+				
+				std::unique_lock<std::mutex> l(received_lock);
+				
+				received.push_back(std::vector<unsigned char>(
+					(unsigned char*)(r->pReceiveData),
+					(unsigned char*)(r->pReceiveData) + r->dwReceiveDataSize));
+			}
+			
+			return DPN_OK;
+		});
+	
+	std::function<HRESULT(DWORD,PVOID)> p1_cb =
+		[]
+		(DWORD dwMessageType, PVOID pMessage)
+		{
+			return DPN_OK;
+		};
+	
+	IDP8PeerInstance p1;
+	
+	ASSERT_EQ(p1->Initialize(&p1_cb, &callback_shim, 0), S_OK);
+	
+	DPN_APPLICATION_DESC connect_to_app;
+	memset(&connect_to_app, 0, sizeof(connect_to_app));
+	
+	connect_to_app.dwSize = sizeof(connect_to_app);
+	connect_to_app.guidApplication = APP_GUID_1;
+	
+	IDP8AddressInstance connect_to_addr(L"127.0.0.1", PORT);
+	
+	ASSERT_EQ(p1->Connect(
+		&connect_to_app,  /* pdnAppDesc */
+		connect_to_addr,  /* pHostAddr */
+		NULL,             /* pDeviceInfo */
+		NULL,             /* pdnSecurity */
+		NULL,             /* pdnCredentials */
+		NULL,             /* pvUserConnectData */
+		0,                /* dwUserConnectDataSize */
+		NULL,             /* pvPlayerContext */
+		NULL,             /* pvAsyncContext */
+		NULL,             /* phAsyncHandle */
+		DPNCONNECT_SYNC   /* dwFlags */
+	), S_OK);
+	
+	/* Well over MAX_PACKET_SIZE, and not a multiple of the fragment size. */
+	std::vector<unsigned char> big(3 * 1024 * 1024 + 1234);
+	for(size_t i = 0; i < big.size(); ++i)
+	{
+		big[i] = (unsigned char)((i * 7) + (i >> 16));
+	}
+	
+	std::vector<unsigned char> small(100, 0x55);
+	
+	DPN_BUFFER_DESC big_bd[] = {
+		{ (DWORD)(big.size()), big.data() },
+	};
+	
+	DPN_BUFFER_DESC small_bd[] = {
+		{ (DWORD)(small.size()), small.data() },
+	};
+	
+	ASSERT_EQ(p1->SendTo(host_player_id, big_bd, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED), S_OK);
+	
+	/* A high priority message sent while a big one is queued at normal priority. */
+	DPNHANDLE send_handle;
+	ASSERT_EQ(p1->SendTo(host_player_id, big_bd,   1, 0, NULL, &send_handle, DPNSEND_GUARANTEED), DPNSUCCESS_PENDING);
+	ASSERT_EQ(p1->SendTo(host_player_id, small_bd, 1, 0, NULL, &send_handle, DPNSEND_GUARANTEED | DPNSEND_PRIORITY_HIGH), DPNSUCCESS_PENDING);
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		{
+			std::unique_lock<std::mutex> l(received_lock);
+			if(received.size() >= 3)
+			{
+				break;
+			}
+		}
+		
+		Sleep(50);
+	}
+	
+	std::unique_lock<std::mutex> l(received_lock);
+	
+	ASSERT_EQ(received.size(), 3U);
+	
+	EXPECT_TRUE(received.front() == big);
+	received.pop_front();
+	
+	/* Either order is fine for the second two, but neither may be mangled. */
+	EXPECT_TRUE((received.front() == big && received.back() == small)
+		|| (received.front() == small && received.back() == big));
+}
+
+TEST(DirectPlay8Peer, SendToTooLarge)
+{
+	SessionHost host(APP_GUID_1, L"Session 1", PORT);
+	
+	/* Just over MAX_MESSAGE_SIZE, built from one buffer repeated. */
+	std::vector<unsigned char> chunk(1024 * 1024, 0x55);
+	std::vector<DPN_BUFFER_DESC> bd(65, DPN_BUFFER_DESC{ (DWORD)(chunk.size()), chunk.data() });
+	
+	EXPECT_EQ(host->SendTo(DPNID_ALL_PLAYERS_GROUP, bd.data(), 64, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_NOLOOPBACK), S_OK);
+	EXPECT_EQ(host->SendTo(DPNID_ALL_PLAYERS_GROUP, bd.data(), 65, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_NOLOOPBACK), DPNERR_SENDTOOLARGE);
+}
+
 TEST(DirectPlay8Peer, SetPeerInfoSyncBeforeHost)
 {
 	std::atomic<bool> testing(false);
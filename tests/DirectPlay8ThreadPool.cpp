@@ -0,0 +1,328 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <windows.h>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/DirectPlay8ThreadPool.hpp"
+
+#define PORT 42897
+
+static const GUID APP_GUID = { 0x7b2f6a10, 0x93c4, 0x4d8e, { 0xa1, 0x5b, 0x2c, 0x60, 0xe4, 0x1f, 0x88, 0x3d } };
+
+static HRESULT CALLBACK ignore_message(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	return DPN_OK;
+}
+
+/* Counts connections completed by a peer and notes if any message was raised from a thread
+ * other than the one which created it.
+*/
+struct ThreadCheck
+{
+	DWORD thread_id;
+	std::atomic<bool> wrong_thread;
+	std::atomic<int> connects;
+	
+	ThreadCheck():
+		thread_id(GetCurrentThreadId()), wrong_thread(false), connects(0) {}
+	
+	static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+	{
+		ThreadCheck *tc = (ThreadCheck*)(pvUserContext);
+		
+		if(GetCurrentThreadId() != tc->thread_id)
+		{
+			tc->wrong_thread = true;
+		}
+		
+		if(dwMessageType == DPN_MSGID_CONNECT_COMPLETE)
+		{
+			++(tc->connects);
+		}
+		
+		return DPN_OK;
+	}
+};
+
+/* Counts the DPN_MSGID_CREATE_THREAD and DPN_MSGID_DESTROY_THREAD messages raised by a thread
+ * pool and checks each thread gets back the context it set when it was created.
+*/
+struct ThreadMessages
+{
+	std::atomic<int> created;
+	std::atomic<int> destroyed;
+	std::atomic<bool> wrong_context;
+	
+	ThreadMessages():
+		created(0), destroyed(0), wrong_context(false) {}
+	
+	static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+	{
+		ThreadMessages *tm = (ThreadMessages*)(pvUserContext);
+		
+		if(dwMessageType == DPN_MSGID_CREATE_THREAD)
+		{
+			DPNMSG_CREATE_THREAD *ct = (DPNMSG_CREATE_THREAD*)(pMessage);
+			ct->pvUserContext = (PVOID)(uintptr_t)(GetCurrentThreadId());
+			
+			++(tm->created);
+		}
+		else if(dwMessageType == DPN_MSGID_DESTROY_THREAD)
+		{
+			DPNMSG_DESTROY_THREAD *dt = (DPNMSG_DESTROY_THREAD*)(pMessage);
+			
+			if(dt->pvUserContext != (PVOID)(uintptr_t)(GetCurrentThreadId()))
+			{
+				tm->wrong_context = true;
+			}
+			
+			++(tm->destroyed);
+		}
+		
+		return DPN_OK;
+	}
+	
+	/* Workers start and stop asynchronously. */
+	bool wait_for(int created, int destroyed)
+	{
+		for(int i = 0; i < 500 && (this->created != created || this->destroyed != destroyed); ++i)
+		{
+			Sleep(10);
+		}
+		
+		return this->created == created && this->destroyed == destroyed;
+	}
+};
+
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+	
+	if(addr->SetSP(&CLSID_DP8SP_TCPIP) != S_OK
+		|| (hostname != NULL && addr->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING) != S_OK)
+		|| addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD) != S_OK)
+	{
+		addr->Release();
+		throw std::runtime_error("Address setup failed");
+	}
+	
+	return addr;
+}
+
+TEST(DirectPlay8ThreadPool, ThreadCount)
+{
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	
+	DWORD threads;
+	EXPECT_EQ(tp->GetThreadCount(-1, &threads, 0), DPNERR_UNINITIALIZED);
+	
+	ASSERT_EQ(tp->Initialize(NULL, &ignore_message, 0), S_OK);
+	EXPECT_EQ(tp->Initialize(NULL, &ignore_message, 0), DPNERR_ALREADYINITIALIZED);
+	
+	DWORD initial_threads;
+	ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+	EXPECT_GT(initial_threads, 0U);
+	
+	/* DoWork() is only permitted with no threads. */
+	EXPECT_EQ(tp->DoWork(0, 0), DPNERR_NOTREADY);
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	
+	ASSERT_EQ(tp->GetThreadCount(-1, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 0U);
+	
+	EXPECT_EQ(tp->DoWork(0, 0), DPN_OK);
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 2, 0), S_OK);
+	
+	ASSERT_EQ(tp->GetThreadCount(-1, &threads, 0), S_OK);
+	EXPECT_EQ(threads, 2U);
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, initial_threads, 0), S_OK);
+	
+	EXPECT_EQ(tp->Close(0), S_OK);
+	EXPECT_EQ(tp->Close(0), DPNERR_UNINITIALIZED);
+	
+	tp->Release();
+}
+
+TEST(DirectPlay8ThreadPool, ThreadMessages)
+{
+	ThreadMessages tm;
+	
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	ASSERT_EQ(tp->Initialize(&tm, &ThreadMessages::callback, 0), S_OK);
+	
+	DWORD initial_threads;
+	ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+	
+	/* Workers are only started once there are handles to wait on. */
+	
+	EXPECT_TRUE(tm.wait_for(0, 0));
+	
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(host->Initialize(NULL, &ignore_message, 0), S_OK);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"Thread Pool Session");
+	
+	DirectPlay8Address *host_addr = make_address(NULL, PORT);
+	IDirectPlay8Address *host_addrs[] = { host_addr };
+	
+	ASSERT_EQ(host->Host(&app_desc, host_addrs, 1, NULL, NULL, NULL, 0), S_OK);
+	
+	host_addr->Release();
+	
+	EXPECT_TRUE(tm.wait_for(initial_threads, 0));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(initial_threads, initial_threads));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 1, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(initial_threads + 1, initial_threads));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, initial_threads, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(initial_threads * 2, initial_threads));
+	
+	EXPECT_FALSE(tm.wrong_context);
+	
+	host->Release();
+	tp->Release();
+}
+
+TEST(DirectPlay8ThreadPool, ThreadMessagesExistingWorkers)
+{
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(host->Initialize(NULL, &ignore_message, 0), S_OK);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"Thread Pool Session");
+	
+	DirectPlay8Address *host_addr = make_address(NULL, PORT);
+	IDirectPlay8Address *host_addrs[] = { host_addr };
+	
+	ASSERT_EQ(host->Host(&app_desc, host_addrs, 1, NULL, NULL, NULL, 0), S_OK);
+	
+	host_addr->Release();
+	
+	/* The shared pool already has workers running when the thread pool is initialised. */
+	
+	ThreadMessages tm;
+	
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	ASSERT_EQ(tp->Initialize(&tm, &ThreadMessages::callback, 0), S_OK);
+	
+	DWORD initial_threads;
+	ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+	
+	/* They never raised DPN_MSGID_CREATE_THREAD, so they don't raise DESTROY_THREAD. */
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(0, 0));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, initial_threads, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(initial_threads, 0));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	EXPECT_TRUE(tm.wait_for(initial_threads, initial_threads));
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, initial_threads, 0), S_OK);
+	
+	EXPECT_FALSE(tm.wrong_context);
+	
+	host->Release();
+	tp->Release();
+}
+
+TEST(DirectPlay8ThreadPool, DoWorkDrivesSession)
+{
+	DirectPlay8ThreadPool *tp = new DirectPlay8ThreadPool(NULL);
+	ASSERT_EQ(tp->Initialize(NULL, &ignore_message, 0), S_OK);
+	
+	DWORD initial_threads;
+	ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+	
+	ThreadCheck host_tc, client_tc;
+	
+	DirectPlay8Peer *host = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(host->Initialize(&host_tc, &ThreadCheck::callback, 0), S_OK);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"Thread Pool Session");
+	
+	DirectPlay8Address *host_addr = make_address(NULL, PORT);
+	IDirectPlay8Address *host_addrs[] = { host_addr };
+	
+	ASSERT_EQ(host->Host(&app_desc, host_addrs, 1, NULL, NULL, NULL, 0), S_OK);
+	
+	host_addr->Release();
+	
+	DirectPlay8Peer *client = new DirectPlay8Peer(NULL);
+	ASSERT_EQ(client->Initialize(&client_tc, &ThreadCheck::callback, 0), S_OK);
+	
+	DirectPlay8Address *connect_addr = make_address(L"127.0.0.1", PORT);
+	
+	DPNHANDLE connect_handle;
+	ASSERT_EQ(client->Connect(&app_desc, connect_addr, NULL, NULL, NULL, NULL, 0, NULL, NULL, &connect_handle, 0), DPNSUCCESS_PENDING);
+	
+	connect_addr->Release();
+	
+	/* Nothing happens unless we call DoWork(). */
+	
+	Sleep(250);
+	EXPECT_EQ(client_tc.connects, 0);
+	
+	for(DWORD start = GetTickCount(); client_tc.connects == 0 && (GetTickCount() - start) < 5000;)
+	{
+		tp->DoWork(INFINITE, 0);
+		Sleep(1);
+	}
+	
+	EXPECT_EQ(client_tc.connects, 1);
+	
+	/* Every message must have been raised from within DoWork() on this thread. */
+	EXPECT_FALSE(host_tc.wrong_thread);
+	EXPECT_FALSE(client_tc.wrong_thread);
+	
+	ASSERT_EQ(tp->SetThreadCount(-1, initial_threads, 0), S_OK);
+	
+	client->Release();
+	host->Release();
+	
+	tp->Release();
+}
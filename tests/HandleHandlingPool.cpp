@@ -197,3 +197,171 @@ TEST(HandleHandlingPool, Stress)
 		EXPECT_EQ(counters[i], 10000);
 	}
 }
+
+TEST(HandleHandlingPool, Fairness)
+{
+	HandleHandlingPool pool(1, 32);
+	
+	/* e1 is a manual reset event which is never reset, so it is always signalled and would
+	 * win every wait if the worker always favoured the lowest handle.
+	*/
+	
+	EventObject e1(TRUE, TRUE);
+	std::atomic<int> e1_counter(0);
+	
+	EventObject e2(FALSE, FALSE);
+	std::atomic<int> e2_counter(0);
+	
+	pool.add_handle(e1, [&e1_counter]() { ++e1_counter; });
+	pool.add_handle(e2, [&e2, &e2_counter]() { if(++e2_counter < 100) { SetEvent(e2); } });
+	
+	SetEvent(e2);
+	
+	Sleep(100);
+	
+	ResetEvent(e1);
+	
+	Sleep(100);
+	
+	EXPECT_GT(e1_counter, 0);
+	EXPECT_EQ(e2_counter, 100);
+}
+
+TEST(HandleHandlingPool, SharedPool)
+{
+	HandleHandlingPool *p1 = HandleHandlingPool::acquire_shared();
+	HandleHandlingPool *p2 = HandleHandlingPool::acquire_shared();
+	
+	EXPECT_EQ(p1, p2);
+	
+	EventObject e1(FALSE, FALSE);
+	std::atomic<int> e1_counter(0);
+	
+	p1->add_handle(e1, [&e1_counter]() { ++e1_counter; });
+	
+	HandleHandlingPool::release_shared();
+	
+	/* The pool should still be running while the first reference is held. */
+	
+	SetEvent(e1);
+	
+	Sleep(100);
+	
+	EXPECT_EQ(e1_counter, 1);
+	
+	p1->remove_handle(e1);
+	HandleHandlingPool::release_shared();
+}
+
+TEST(HandleHandlingPool, ThreadHooksRunConcurrently)
+{
+	HandleHandlingPool pool(2, 32);
+	
+	std::atomic<int> running(0), max_running(0), started(0), finished(0);
+	
+	unsigned int hooks = pool.add_thread_hooks(
+		[&]()
+		{
+			int r = ++running;
+			
+			int m = max_running;
+			while(r > m && !max_running.compare_exchange_weak(m, r)) {}
+			
+			++started;
+			Sleep(200);
+			
+			--running;
+			++finished;
+		},
+		[]() {});
+	
+	EventObject e1(FALSE, FALSE);
+	pool.add_handle(e1, []() {});
+	
+	/* Wait for both workers to be inside the hook, one slow hook shouldn't hold up the
+	 * other thread starting.
+	*/
+	for(int i = 0; i < 100 && started < 2; ++i)
+	{
+		Sleep(10);
+	}
+	
+	EXPECT_EQ(started, 2);
+	EXPECT_EQ(max_running, 2);
+	
+	/* Removing the hooks waits for the calls in progress to return. */
+	pool.remove_thread_hooks(hooks);
+	
+	EXPECT_EQ(finished, 2);
+	EXPECT_EQ(running, 0);
+	
+	pool.remove_handle(e1);
+}
+
+TEST(HandleHandlingPool, DivideThreads)
+{
+	HandleHandlingPool pool(4, 2, true);
+	
+	std::atomic<int> live(0);
+	
+	unsigned int hooks = pool.add_thread_hooks(
+		[&live]() { ++live; },
+		[&live]() { --live; });
+	
+	/* Workers start and stop asynchronously. */
+	auto wait_for_live = [&live](int expect)
+	{
+		for(int i = 0; i < 100 && live != expect; ++i)
+		{
+			Sleep(10);
+		}
+		
+		return live == expect;
+	};
+	
+	std::vector<EventObject> events(9);
+	
+	pool.add_handle(events[0], []() {});
+	EXPECT_TRUE(wait_for_live(4));
+	
+	/* Three blocks of two handles, split 2/1/1. */
+	for(int i = 1; i < 5; ++i)
+	{
+		pool.add_handle(events[i], []() {});
+	}
+	
+	EXPECT_TRUE(wait_for_live(4));
+	
+	/* Five blocks, more than the threads, so each gets one. */
+	for(int i = 5; i < 9; ++i)
+	{
+		pool.add_handle(events[i], []() {});
+	}
+	
+	EXPECT_TRUE(wait_for_live(5));
+	
+	/* Handles still get dispatched by the remaining threads. */
+	std::atomic<int> counter(0);
+	
+	pool.remove_handle(events[0]);
+	pool.add_handle(events[0], [&counter]() { ++counter; });
+	
+	SetEvent(events[0]);
+	Sleep(100);
+	
+	EXPECT_EQ(counter, 1);
+	
+	/* Threads move back to the remaining blocks as the others go away. */
+	for(int i = 8; i > 0; --i)
+	{
+		pool.remove_handle(events[i]);
+	}
+	
+	EXPECT_TRUE(wait_for_live(4));
+	
+	pool.set_threads_per_pool(2);
+	EXPECT_TRUE(wait_for_live(2));
+	
+	pool.remove_handle(events[0]);
+	pool.remove_thread_hooks(hooks);
+}
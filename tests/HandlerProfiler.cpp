@@ -0,0 +1,165 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <dplay8.h>
+#include <dplite.h>
+#include <gtest/gtest.h>
+#include <windows.h>
+
+#include "../src/HandlerProfiler.hpp"
+
+static DPLITE_HANDLER_STATS get_stats(const HandlerProfiler &profiler, DWORD message_type)
+{
+	DPLITE_HANDLER_STATS stats;
+	memset(&stats, 0xFF, sizeof(stats));
+	
+	stats.dwSize        = sizeof(stats);
+	stats.dwMessageType = message_type;
+	
+	EXPECT_TRUE(profiler.get_stats(&stats));
+	
+	return stats;
+}
+
+TEST(HandlerProfiler, Counters)
+{
+	HandlerProfiler profiler;
+	
+	profiler.record(DPN_MSGID_RECEIVE,       1, 10);
+	profiler.record(DPN_MSGID_RECEIVE,       2, 300);
+	profiler.record(DPN_MSGID_RECEIVE,       3, 20);
+	profiler.record(DPN_MSGID_SEND_COMPLETE, 0, 5);
+	
+	DPLITE_HANDLER_STATS r = get_stats(profiler, DPN_MSGID_RECEIVE);
+	
+	EXPECT_EQ(r.dwMessageType,  DPN_MSGID_RECEIVE);
+	EXPECT_EQ(r.dwCount,        3);
+	EXPECT_EQ(r.dwSlowCount,    0);
+	EXPECT_EQ(r.qwTotalTime,    330);
+	EXPECT_EQ(r.dwMaxTime,      300);
+	EXPECT_EQ(r.dpnidMaxPlayer, 2);
+	
+	DPLITE_HANDLER_STATS sc = get_stats(profiler, DPN_MSGID_SEND_COMPLETE);
+	
+	EXPECT_EQ(sc.dwCount,        1);
+	EXPECT_EQ(sc.qwTotalTime,    5);
+	EXPECT_EQ(sc.dwMaxTime,      5);
+	EXPECT_EQ(sc.dpnidMaxPlayer, 0);
+	
+	DPLITE_HANDLER_STATS cp = get_stats(profiler, DPN_MSGID_CREATE_PLAYER);
+	
+	EXPECT_EQ(cp.dwCount,     0);
+	EXPECT_EQ(cp.qwTotalTime, 0);
+	EXPECT_EQ(cp.dwMaxTime,   0);
+}
+
+TEST(HandlerProfiler, Histogram)
+{
+	HandlerProfiler profiler;
+	
+	profiler.record(DPN_MSGID_RECEIVE, 0, 0);
+	profiler.record(DPN_MSGID_RECEIVE, 0, 1);
+	profiler.record(DPN_MSGID_RECEIVE, 0, 3);
+	profiler.record(DPN_MSGID_RECEIVE, 0, 1000);
+	profiler.record(DPN_MSGID_RECEIVE, 0, 1ULL << 40);
+	
+	DPLITE_HANDLER_STATS r = get_stats(profiler, DPN_MSGID_RECEIVE);
+	
+	EXPECT_EQ(r.dwHistogram[0],  1);  /* <1us */
+	EXPECT_EQ(r.dwHistogram[1],  1);  /* [1, 2) */
+	EXPECT_EQ(r.dwHistogram[2],  1);  /* [2, 4) */
+	EXPECT_EQ(r.dwHistogram[10], 1);  /* [512, 1024) */
+	EXPECT_EQ(r.dwHistogram[HandlerProfiler::LATENCY_BUCKETS - 1], 1);
+	
+	/* Clamped rather than wrapped. */
+	EXPECT_EQ(r.dwMaxTime, 0xFFFFFFFF);
+}
+
+TEST(HandlerProfiler, WarnTime)
+{
+	HandlerProfiler profiler;
+	
+	EXPECT_EQ(profiler.get_warn_time(), 0);
+	
+	/* Nothing is slow while disabled. */
+	EXPECT_FALSE(profiler.record(DPN_MSGID_RECEIVE, 0, 1000000));
+	
+	profiler.set_warn_time(5);
+	EXPECT_EQ(profiler.get_warn_time(), 5);
+	
+	EXPECT_FALSE(profiler.record(DPN_MSGID_RECEIVE, 0, 5000));
+	EXPECT_TRUE(profiler.record(DPN_MSGID_RECEIVE, 0, 5001));
+	EXPECT_TRUE(profiler.record(DPN_MSGID_CREATE_PLAYER, 0, 20000));
+	
+	EXPECT_EQ(get_stats(profiler, DPN_MSGID_RECEIVE).dwSlowCount, 1);
+	EXPECT_EQ(get_stats(profiler, DPN_MSGID_CREATE_PLAYER).dwSlowCount, 1);
+}
+
+TEST(HandlerProfiler, AllTypes)
+{
+	HandlerProfiler profiler;
+	
+	profiler.record(DPN_MSGID_RECEIVE,       1, 10);
+	profiler.record(DPN_MSGID_CREATE_PLAYER, 7, 400);
+	profiler.record(DPN_MSGID_SEND_COMPLETE, 0, 40);
+	
+	/* Not a DPN_MSGID_* value, only counted in the totals. */
+	profiler.record(0x1234, 0, 50);
+	
+	DPLITE_HANDLER_STATS all = get_stats(profiler, 0);
+	
+	EXPECT_EQ(all.dwMessageType,  DPN_MSGID_CREATE_PLAYER);
+	EXPECT_EQ(all.dwCount,        4);
+	EXPECT_EQ(all.qwTotalTime,    500);
+	EXPECT_EQ(all.dwMaxTime,      400);
+	EXPECT_EQ(all.dpnidMaxPlayer, 7);
+	
+	DPLITE_HANDLER_STATS stats;
+	stats.dwSize        = sizeof(stats);
+	stats.dwMessageType = 0x1234;
+	
+	EXPECT_FALSE(profiler.get_stats(&stats));
+}
+
+TEST(HandlerProfiler, Reset)
+{
+	HandlerProfiler profiler;
+	
+	profiler.set_warn_time(1);
+	profiler.record(DPN_MSGID_RECEIVE, 1, 5000);
+	
+	profiler.reset();
+	
+	DPLITE_HANDLER_STATS r = get_stats(profiler, DPN_MSGID_RECEIVE);
+	
+	EXPECT_EQ(r.dwCount,        0);
+	EXPECT_EQ(r.dwSlowCount,    0);
+	EXPECT_EQ(r.qwTotalTime,    0);
+	EXPECT_EQ(r.dwMaxTime,      0);
+	EXPECT_EQ(r.dpnidMaxPlayer, 0);
+	EXPECT_EQ(r.dwHistogram[13], 0);
+	
+	/* The threshold isn't a statistic. */
+	EXPECT_EQ(profiler.get_warn_time(), 1);
+	
+	/* A smaller maximum than before the reset is picked up. */
+	profiler.record(DPN_MSGID_RECEIVE, 2, 100);
+	EXPECT_EQ(get_stats(profiler, DPN_MSGID_RECEIVE).dwMaxTime, 100);
+	EXPECT_EQ(get_stats(profiler, DPN_MSGID_RECEIVE).dpnidMaxPlayer, 2);
+}
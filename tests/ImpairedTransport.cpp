@@ -0,0 +1,372 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Clock.hpp"
+#include "../src/EventObject.hpp"
+#include "../src/ImpairedTransport.hpp"
+#include "../src/LoopbackTransport.hpp"
+#include "TestHelpers.hpp"
+
+#define PORT 42899
+
+/* Held back data is passed on by another thread, give it a moment to catch up after the
+ * clock is advanced.
+*/
+static bool wait_for_pending(ImpairedTransport &t, size_t pending)
+{
+	for(int i = 0; i < 500 && t.pending() != pending; ++i)
+	{
+		Sleep(10);
+	}
+	
+	return t.pending() == pending;
+}
+
+/* A pair of UDP sockets, sending from the impaired side to the plain side. */
+struct DatagramPair
+{
+	LoopbackTransport net;
+	VirtualClock clock;
+	ImpairedTransport impaired;
+	
+	int from, to;
+	struct sockaddr_in to_addr;
+	
+	DatagramPair(uint32_t seed = 0):
+		impaired(&net, seed, &clock)
+	{
+		from = impaired.create_udp_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+		to   = net.create_udp_socket(htonl(INADDR_ANY), PORT + 1, SocketOptions());
+		
+		to_addr = make_sockaddr("127.0.0.1", PORT + 1);
+	}
+	
+	~DatagramPair()
+	{
+		net.close(to);
+		impaired.close(from);
+	}
+	
+	void send(uint32_t n, size_t size = sizeof(uint32_t))
+	{
+		std::vector<unsigned char> buf(size);
+		memcpy(buf.data(), &n, sizeof(n));
+		
+		impaired.sendto(from, buf.data(), buf.size(), (struct sockaddr*)(&to_addr), sizeof(to_addr));
+	}
+	
+	std::vector<uint32_t> recv_all()
+	{
+		std::vector<uint32_t> got;
+		
+		unsigned char buf[2048];
+		struct sockaddr_in from_addr;
+		
+		while(net.recvfrom(to, buf, sizeof(buf), &from_addr) >= (int)(sizeof(uint32_t)))
+		{
+			uint32_t n;
+			memcpy(&n, buf, sizeof(n));
+			
+			got.push_back(n);
+		}
+		
+		return got;
+	}
+};
+
+/* A connection from an impaired client socket to a plain server socket. */
+struct StreamPair
+{
+	LoopbackTransport net;
+	VirtualClock clock;
+	ImpairedTransport impaired;
+	
+	int client, server;
+	
+	StreamPair():
+		impaired(&net, 0, &clock)
+	{
+		int listener = net.create_listener_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+		client = impaired.create_client_socket(htonl(INADDR_ANY), 0, SocketOptions());
+		
+		struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+		impaired.connect(client, &addr);
+		
+		server = net.accept(listener, &addr);
+		net.close(listener);
+	}
+	
+	~StreamPair()
+	{
+		net.close(server);
+		
+		if(client != -1)
+		{
+			impaired.close(client);
+		}
+	}
+};
+
+TEST(ImpairedTransport, PassThrough)
+{
+	DatagramPair dp;
+	
+	dp.send(1);
+	dp.send(2);
+	
+	EXPECT_EQ(dp.impaired.pending(), 0U);
+	EXPECT_EQ(dp.recv_all(), std::vector<uint32_t>({ 1, 2 }));
+	
+	StreamPair sp;
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, "Hello", 5), 5);
+	EXPECT_EQ(sp.impaired.pending(), 0U);
+	
+	char buf[16];
+	EXPECT_EQ(sp.net.recv(sp.server, buf, sizeof(buf)), 5);
+}
+
+TEST(ImpairedTransport, DatagramDelay)
+{
+	DatagramPair dp;
+	
+	ImpairedTransport::Impairment imp;
+	imp.delay_us = 50000;
+	dp.impaired.set_impairment(imp);
+	
+	dp.send(1);
+	
+	EXPECT_EQ(dp.impaired.pending(), 1U);
+	EXPECT_TRUE(dp.recv_all().empty());
+	
+	dp.clock.advance(49999);
+	
+	EXPECT_EQ(dp.impaired.pending(), 1U);
+	EXPECT_TRUE(dp.recv_all().empty());
+	
+	dp.clock.advance(1);
+	
+	ASSERT_TRUE(wait_for_pending(dp.impaired, 0));
+	EXPECT_EQ(dp.recv_all(), std::vector<uint32_t>({ 1 }));
+}
+
+TEST(ImpairedTransport, DatagramLossIsRepeatable)
+{
+	ImpairedTransport::Impairment imp;
+	imp.loss = 0.3;
+	
+	DatagramPair dp1(1234), dp2(1234);
+	
+	/* Only send as many as the receiving socket can queue. */
+	const size_t count = LoopbackTransport::MAX_QUEUED_DATAGRAMS;
+	
+	dp1.impaired.set_impairment(imp);
+	dp2.impaired.set_impairment(imp);
+	
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		dp1.send(i);
+		dp2.send(i);
+	}
+	
+	std::vector<uint32_t> got1 = dp1.recv_all();
+	std::vector<uint32_t> got2 = dp2.recv_all();
+	
+	EXPECT_EQ(got1, got2);
+	
+	EXPECT_GT(got1.size(), (count * 5) / 10);
+	EXPECT_LT(got1.size(), (count * 9) / 10);
+	
+	ImpairedTransport::Stats stats = dp1.impaired.get_stats();
+	
+	EXPECT_EQ(stats.datagrams_sent, count);
+	EXPECT_EQ(stats.datagrams_lost, count - got1.size());
+}
+
+TEST(ImpairedTransport, DatagramReorder)
+{
+	DatagramPair dp;
+	
+	ImpairedTransport::Impairment imp;
+	imp.reorder    = 0.5;
+	imp.reorder_us = 10000;
+	dp.impaired.set_impairment(imp);
+	
+	for(uint32_t i = 0; i < 100; ++i)
+	{
+		dp.send(i);
+	}
+	
+	ImpairedTransport::Stats stats = dp.impaired.get_stats();
+	
+	EXPECT_GT(stats.datagrams_reordered, 0U);
+	EXPECT_EQ(dp.impaired.pending(), stats.datagrams_reordered);
+	
+	dp.clock.advance(10000);
+	ASSERT_TRUE(wait_for_pending(dp.impaired, 0));
+	
+	std::vector<uint32_t> got = dp.recv_all();
+	ASSERT_EQ(got.size(), 100U);
+	
+	/* Held back datagrams still keep their order relative to each other. */
+	
+	std::vector<uint32_t> held(got.end() - stats.datagrams_reordered, got.end());
+	
+	EXPECT_FALSE(std::is_sorted(got.begin(), got.end()));
+	EXPECT_TRUE(std::is_sorted(held.begin(), held.end()));
+	
+	std::sort(got.begin(), got.end());
+	
+	for(uint32_t i = 0; i < 100; ++i)
+	{
+		EXPECT_EQ(got[i], i);
+	}
+}
+
+TEST(ImpairedTransport, DatagramRateLimit)
+{
+	DatagramPair dp;
+	
+	ImpairedTransport::Impairment imp;
+	imp.rate        = 10000;
+	imp.queue_limit = 5000;
+	dp.impaired.set_impairment(imp);
+	
+	/* Each 1000 byte datagram takes 100ms to go out, the first five fit in the queue. */
+	for(uint32_t i = 0; i < 10; ++i)
+	{
+		dp.send(i, 1000);
+	}
+	
+	ImpairedTransport::Stats stats = dp.impaired.get_stats();
+	
+	EXPECT_EQ(stats.datagrams_sent, 10U);
+	EXPECT_EQ(stats.datagrams_dropped, 5U);
+	
+	EXPECT_EQ(dp.impaired.pending(), 5U);
+	
+	for(size_t i = 1; i <= 5; ++i)
+	{
+		dp.clock.advance(100000);
+		
+		ASSERT_TRUE(wait_for_pending(dp.impaired, 5 - i));
+		EXPECT_EQ(dp.recv_all(), std::vector<uint32_t>({ (uint32_t)(i - 1) }));
+	}
+}
+
+TEST(ImpairedTransport, StreamStaysInOrder)
+{
+	StreamPair sp;
+	
+	ImpairedTransport::Impairment imp;
+	imp.delay_us      = 20000;
+	imp.jitter_us     = 20000;
+	imp.loss          = 0.2;
+	imp.retransmit_us = 100000;
+	sp.impaired.set_impairment(imp);
+	
+	for(uint32_t i = 0; i < 200; ++i)
+	{
+		EXPECT_EQ(sp.impaired.send(sp.client, &i, sizeof(i)), (int)(sizeof(i)));
+	}
+	
+	EXPECT_GT(sp.impaired.get_stats().stream_retransmits, 0U);
+	
+	sp.clock.advance(1000000);
+	ASSERT_TRUE(wait_for_pending(sp.impaired, 0));
+	
+	uint32_t got[200];
+	ASSERT_EQ(sp.net.recv(sp.server, got, sizeof(got)), (int)(sizeof(got)));
+	
+	for(uint32_t i = 0; i < 200; ++i)
+	{
+		EXPECT_EQ(got[i], i);
+	}
+}
+
+TEST(ImpairedTransport, StreamBackpressure)
+{
+	StreamPair sp;
+	EventObject event;
+	
+	ImpairedTransport::Impairment imp;
+	imp.delay_us    = 10000;
+	imp.queue_limit = 1000;
+	sp.impaired.set_impairment(imp);
+	
+	ASSERT_EQ(sp.impaired.event_select(sp.client, event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	signalled(event);  /* FD_WRITE from connecting. */
+	
+	unsigned char data[1500];
+	memset(data, 0xAA, sizeof(data));
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, data, sizeof(data)), 1000);
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, data, sizeof(data)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_FALSE(signalled(event));
+	
+	sp.clock.advance(10000);
+	ASSERT_TRUE(wait_for_pending(sp.impaired, 0));
+	
+	EXPECT_TRUE(signalled(event));
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, data, sizeof(data)), 1000);
+}
+
+TEST(ImpairedTransport, StreamCloseWaitsForData)
+{
+	StreamPair sp;
+	
+	ImpairedTransport::Impairment imp;
+	imp.delay_us = 10000;
+	sp.impaired.set_impairment(imp);
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, "Bye", 3), 3);
+	EXPECT_EQ(sp.impaired.shutdown_send(sp.client), 0);
+	
+	EXPECT_EQ(sp.impaired.send(sp.client, "Bye", 3), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAESHUTDOWN);
+	
+	sp.impaired.close(sp.client);
+	
+	char buf[16];
+	
+	EXPECT_EQ(sp.net.recv(sp.server, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	sp.clock.advance(10000);
+	ASSERT_TRUE(wait_for_pending(sp.impaired, 0));
+	
+	EXPECT_EQ(sp.net.recv(sp.server, buf, sizeof(buf)), 3);
+	EXPECT_EQ(sp.net.recv(sp.server, buf, sizeof(buf)), 0);
+	
+	/* Only the server end is left. */
+	EXPECT_EQ(sp.net.open_sockets(), 1U);
+	
+	sp.client = -1;
+}
@@ -0,0 +1,162 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <gtest/gtest.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/LogFormat.hpp"
+
+/* Encodes the arguments and decodes them again. */
+static std::string round_trip(const char *fmt, ...)
+{
+	unsigned char buf[1024];
+	size_t used;
+	
+	va_list argv;
+	va_start(argv, fmt);
+	bool ok = log_encode_args(fmt, argv, buf, sizeof(buf), &used);
+	va_end(argv);
+	
+	if(!ok)
+	{
+		return "<encode failed>";
+	}
+	
+	return log_decode_args(fmt, buf, used);
+}
+
+static bool encode(size_t size, size_t *used, const char *fmt, ...)
+{
+	std::vector<unsigned char> buf(size);
+	
+	va_list argv;
+	va_start(argv, fmt);
+	bool ok = log_encode_args(fmt, argv, buf.data(), buf.size(), used);
+	va_end(argv);
+	
+	return ok;
+}
+
+TEST(LogFormat, Literal)
+{
+	EXPECT_EQ(round_trip("Hello, world"), "Hello, world");
+	EXPECT_EQ(round_trip("100%% done"), "100% done");
+	EXPECT_EQ(round_trip(""), "");
+}
+
+TEST(LogFormat, Integers)
+{
+	EXPECT_EQ(round_trip("%d %i %u", -42, 7, 4000000000U), "-42 7 4000000000");
+	EXPECT_EQ(round_trip("%x %X %08x %o", 0xbeefU, 0xbeefU, 0x1fU, 8U), "beef BEEF 0000001f 10");
+	EXPECT_EQ(round_trip("%ld %lu", -5L, 6UL), "-5 6");
+	EXPECT_EQ(round_trip("%lld %llu", -1234567890123LL, 18446744073709551615ULL), "-1234567890123 18446744073709551615");
+	EXPECT_EQ(round_trip("%zu", (size_t)(123)), "123");
+	EXPECT_EQ(round_trip("%hd %hhu", (short)(-3), (unsigned char)(255)), "-3 255");
+	EXPECT_EQ(round_trip("[%5d] [%-5d] [%+d]", 12, 12, 12), "[   12] [12   ] [+12]");
+}
+
+TEST(LogFormat, StarWidthAndPrecision)
+{
+	EXPECT_EQ(round_trip("[%*d]", 6, 42), "[    42]");
+	EXPECT_EQ(round_trip("[%*d]", -6, 42), "[42    ]");
+	EXPECT_EQ(round_trip("[%.*f]", 2, 3.14159), "[3.14]");
+	EXPECT_EQ(round_trip("[%.*s]", 3, "abcdef"), "[abc]");
+}
+
+TEST(LogFormat, FloatingPoint)
+{
+	EXPECT_EQ(round_trip("%f %.1f %g", 1.5, 2.25, 0.0001), "1.500000 2.2 0.0001");
+	EXPECT_EQ(round_trip("%e", 12345.0), "1.234500e+04");
+}
+
+TEST(LogFormat, Strings)
+{
+	EXPECT_EQ(round_trip("'%s'", "text"), "'text'");
+	EXPECT_EQ(round_trip("'%s'", (const char*)(NULL)), "'(null)'");
+	EXPECT_EQ(round_trip("'%-6s' '%6s'", "ab", "cd"), "'ab    ' '    cd'");
+	EXPECT_EQ(round_trip("'%.2s'", "abcdef"), "'ab'");
+	EXPECT_EQ(round_trip("%c%c", 'o', 'k'), "ok");
+}
+
+TEST(LogFormat, WideStrings)
+{
+	EXPECT_EQ(round_trip("'%ls'", L"wide"), "'wide'");
+	EXPECT_EQ(round_trip("'%ls'", L"café"), "'caf\xc3\xa9'");
+	EXPECT_EQ(round_trip("'%.3ls'", L"abcdef"), "'abc'");
+	EXPECT_EQ(round_trip("'%6ls'", L"ab"), "'    ab'");
+	EXPECT_EQ(round_trip("'%ls'", (const wchar_t*)(NULL)), "'(null)'");
+}
+
+TEST(LogFormat, Pointer)
+{
+	EXPECT_EQ(round_trip("%p", (void*)(0x1234)), "00001234");
+}
+
+TEST(LogFormat, Mixed)
+{
+	EXPECT_EQ(round_trip("Sent %u bytes to %s:%u (%.1f%%)", 512U, "10.0.0.1", 2302U, 99.5),
+		"Sent 512 bytes to 10.0.0.1:2302 (99.5%)");
+}
+
+TEST(LogFormat, EncodedSize)
+{
+	size_t used;
+	
+	ASSERT_TRUE(encode(64, &used, "no arguments"));
+	EXPECT_EQ(used, 0U);
+	
+	ASSERT_TRUE(encode(64, &used, "%d %u", 1, 2U));
+	EXPECT_EQ(used, 16U);
+	
+	ASSERT_TRUE(encode(64, &used, "%s", "abc"));
+	EXPECT_EQ(used, 7U);
+}
+
+TEST(LogFormat, DoesntFit)
+{
+	size_t used;
+	
+	EXPECT_FALSE(encode(15, &used, "%d %u", 1, 2U));
+	EXPECT_FALSE(encode(8, &used, "%s", "too long for the buffer"));
+}
+
+TEST(LogFormat, Unsupported)
+{
+	size_t used;
+	int n;
+	
+	EXPECT_FALSE(encode(64, &used, "abc%n", &n));
+	EXPECT_FALSE(encode(64, &used, "trailing %"));
+}
+
+TEST(LogFormat, TruncatedData)
+{
+	unsigned char buf[64];
+	memset(buf, 0, sizeof(buf));
+	
+	/* Room for the first integer but not the second. */
+	EXPECT_EQ(log_decode_args("%d %d", buf, 8), "0 <?>");
+	
+	/* Not even the string length. */
+	EXPECT_EQ(log_decode_args("%s", buf, 2), "<?>");
+}
@@ -0,0 +1,794 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <dplite.h>
+#include <gtest/gtest.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Clock.hpp"
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/DirectPlay8ThreadPool.hpp"
+#include "../src/EventObject.hpp"
+#include "../src/LoopbackTransport.hpp"
+#include "TestHelpers.hpp"
+
+#define PORT 42898
+
+static const GUID APP_GUID = { 0x3c1d7e52, 0x0a9b, 0x4f6e, { 0x8d, 0x27, 0x61, 0xb4, 0x05, 0xfa, 0x3e, 0x90 } };
+
+/* Opens a connection from a client socket bound to client_port to a listener on PORT and
+ * accepts it.
+*/
+static void make_connection(LoopbackTransport &net, int *client, int *server, uint16_t client_port = 0)
+{
+	int listener = net.create_listener_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	ASSERT_NE(listener, -1);
+	
+	*client = net.create_client_socket(htonl(INADDR_ANY), client_port, SocketOptions());
+	ASSERT_NE(*client, -1);
+	
+	struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+	
+	ASSERT_EQ(net.connect(*client, &addr), -1);
+	ASSERT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	*server = net.accept(listener, &addr);
+	ASSERT_NE(*server, -1);
+	
+	net.close(listener);
+}
+
+TEST(LoopbackTransport, StreamConnect)
+{
+	LoopbackTransport net;
+	EventObject l_event, c_event, s_event;
+	
+	int listener = net.create_listener_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	ASSERT_NE(listener, -1);
+	ASSERT_EQ(net.event_select(listener, l_event, FD_ACCEPT), 0);
+	
+	int client = net.create_client_socket(htonl(INADDR_ANY), 1234, SocketOptions());
+	ASSERT_NE(client, -1);
+	ASSERT_EQ(net.event_select(client, c_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	EXPECT_FALSE(signalled(l_event));
+	EXPECT_FALSE(signalled(c_event));
+	
+	struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+	
+	EXPECT_EQ(net.connect(client, &addr), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_TRUE(signalled(l_event));
+	EXPECT_TRUE(signalled(c_event));
+	
+	int error = -1;
+	EXPECT_EQ(net.get_socket_error(client, &error), 0);
+	EXPECT_EQ(error, 0);
+	
+	struct sockaddr_in from;
+	int server = net.accept(listener, &from);
+	ASSERT_NE(server, -1);
+	
+	EXPECT_EQ(from.sin_addr.s_addr, inet_addr("127.0.0.1"));
+	EXPECT_EQ(ntohs(from.sin_port), 1234);
+	
+	EXPECT_EQ(net.accept(listener, &from), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	ASSERT_EQ(net.event_select(server, s_event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	EXPECT_TRUE(signalled(s_event));  /* FD_WRITE */
+	EXPECT_FALSE(signalled(s_event));
+	
+	EXPECT_EQ(net.send(client, "Hello", 5), 5);
+	EXPECT_TRUE(signalled(s_event));
+	
+	char buf[16];
+	EXPECT_EQ(net.recv(server, buf, 3), 3);
+	EXPECT_EQ(std::string(buf, 3), "Hel");
+	
+	/* Still readable. */
+	EXPECT_TRUE(signalled(s_event));
+	
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), 2);
+	EXPECT_EQ(std::string(buf, 2), "lo");
+	
+	EXPECT_FALSE(signalled(s_event));
+	
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	net.close(server);
+	net.close(client);
+	net.close(listener);
+	
+	EXPECT_EQ(net.open_sockets(), 0U);
+}
+
+TEST(LoopbackTransport, StreamConnectRefused)
+{
+	LoopbackTransport net;
+	EventObject c_event;
+	
+	int client = net.create_client_socket(htonl(INADDR_ANY), 0, SocketOptions());
+	ASSERT_NE(client, -1);
+	ASSERT_EQ(net.event_select(client, c_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+	
+	EXPECT_EQ(net.connect(client, &addr), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_TRUE(signalled(c_event));
+	
+	int error = 0;
+	EXPECT_EQ(net.get_socket_error(client, &error), 0);
+	EXPECT_EQ(error, WSAECONNREFUSED);
+	
+	net.close(client);
+}
+
+TEST(LoopbackTransport, StreamSendBlocksUntilRead)
+{
+	LoopbackTransport net;
+	EventObject c_event;
+	
+	int client, server;
+	make_connection(net, &client, &server);
+	
+	ASSERT_EQ(net.event_select(client, c_event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	EXPECT_TRUE(signalled(c_event));  /* FD_WRITE from connecting. */
+	
+	std::vector<unsigned char> data(LoopbackTransport::STREAM_BUFFER_SIZE + 100, 0xAA);
+	
+	EXPECT_EQ(net.send(client, data.data(), data.size()), (int)(LoopbackTransport::STREAM_BUFFER_SIZE));
+	
+	EXPECT_EQ(net.send(client, data.data(), data.size()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_FALSE(signalled(c_event));
+	
+	unsigned char buf[1024];
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), (int)(sizeof(buf)));
+	
+	/* FD_WRITE once there is space again. */
+	EXPECT_TRUE(signalled(c_event));
+	
+	EXPECT_EQ(net.send(client, data.data(), data.size()), (int)(sizeof(buf)));
+	
+	net.close(server);
+	net.close(client);
+}
+
+TEST(LoopbackTransport, StreamShutdownSend)
+{
+	LoopbackTransport net;
+	
+	int client, server;
+	make_connection(net, &client, &server);
+	
+	EXPECT_EQ(net.send(client, "Bye", 3), 3);
+	EXPECT_EQ(net.shutdown_send(client), 0);
+	
+	EXPECT_EQ(net.send(client, "Bye", 3), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAESHUTDOWN);
+	
+	/* Data sent before the shutdown is still delivered, then EOF. */
+	
+	char buf[16];
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), 3);
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), 0);
+	
+	/* The other direction still works. */
+	
+	EXPECT_EQ(net.send(server, "Ok", 2), 2);
+	EXPECT_EQ(net.recv(client, buf, sizeof(buf)), 2);
+	
+	net.close(client);
+	
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), 0);
+	
+	net.close(server);
+}
+
+TEST(LoopbackTransport, StreamClose)
+{
+	LoopbackTransport net;
+	EventObject s_event;
+	
+	int client, server;
+	make_connection(net, &client, &server);
+	
+	ASSERT_EQ(net.event_select(server, s_event, FD_READ | FD_CLOSE), 0);
+	
+	EXPECT_EQ(net.send(client, "Bye", 3), 3);
+	net.close(client);
+	
+	EXPECT_TRUE(signalled(s_event));
+	
+	/* A hard close still lets us read what was already sent, then resets. */
+	
+	char buf[16];
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), 3);
+	
+	EXPECT_EQ(net.recv(server, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+	
+	EXPECT_EQ(net.send(server, "Hello", 5), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+	
+	net.close(server);
+	
+	EXPECT_EQ(net.open_sockets(), 0U);
+}
+
+TEST(LoopbackTransport, StreamListenerCloseResetsBacklog)
+{
+	LoopbackTransport net;
+	
+	int listener = net.create_listener_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	ASSERT_NE(listener, -1);
+	
+	int client = net.create_client_socket(htonl(INADDR_ANY), 0, SocketOptions());
+	ASSERT_NE(client, -1);
+	
+	struct sockaddr_in addr = make_sockaddr("127.0.0.1", PORT);
+	net.connect(client, &addr);
+	
+	net.close(listener);
+	
+	char buf[16];
+	EXPECT_EQ(net.recv(client, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+	
+	net.close(client);
+	
+	EXPECT_EQ(net.open_sockets(), 0U);
+}
+
+TEST(LoopbackTransport, Datagrams)
+{
+	LoopbackTransport net;
+	EventObject a_event, b_event;
+	
+	int a = net.create_udp_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	ASSERT_NE(a, -1);
+	
+	int b = net.create_udp_socket(inet_addr("127.0.0.1"), PORT + 1, SocketOptions());
+	ASSERT_NE(b, -1);
+	
+	ASSERT_EQ(net.event_select(a, a_event, FD_READ | FD_WRITE), 0);
+	ASSERT_EQ(net.event_select(b, b_event, FD_READ), 0);
+	
+	EXPECT_TRUE(signalled(a_event));  /* FD_WRITE */
+	EXPECT_FALSE(signalled(b_event));
+	
+	struct sockaddr_in to_b = make_sockaddr("127.0.0.1", PORT + 1);
+	
+	EXPECT_EQ(net.sendto(a, "One", 3, (struct sockaddr*)(&to_b), sizeof(to_b)), 3);
+	EXPECT_EQ(net.sendto(a, "Two!", 4, (struct sockaddr*)(&to_b), sizeof(to_b)), 4);
+	
+	/* Nothing is bound here, the datagram just disappears. */
+	struct sockaddr_in to_nowhere = make_sockaddr("127.0.0.2", PORT + 1);
+	EXPECT_EQ(net.sendto(a, "Lost", 4, (struct sockaddr*)(&to_nowhere), sizeof(to_nowhere)), 4);
+	
+	EXPECT_TRUE(signalled(b_event));
+	
+	char buf[16];
+	struct sockaddr_in from;
+	
+	EXPECT_EQ(net.recvfrom(b, buf, sizeof(buf), &from), 3);
+	EXPECT_EQ(std::string(buf, 3), "One");
+	EXPECT_EQ(from.sin_addr.s_addr, inet_addr("127.0.0.1"));
+	EXPECT_EQ(ntohs(from.sin_port), PORT);
+	
+	EXPECT_TRUE(signalled(b_event));
+	
+	/* Datagrams which don't fit are truncated. */
+	EXPECT_EQ(net.recvfrom(b, buf, 2, &from), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEMSGSIZE);
+	
+	EXPECT_EQ(net.recvfrom(b, buf, sizeof(buf), &from), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	EXPECT_FALSE(signalled(b_event));
+	EXPECT_FALSE(signalled(a_event));
+	
+	net.close(a);
+	net.close(b);
+}
+
+TEST(LoopbackTransport, AddressInUse)
+{
+	LoopbackTransport net;
+	
+	int a = net.create_udp_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	ASSERT_NE(a, -1);
+	
+	EXPECT_EQ(net.create_udp_socket(inet_addr("127.0.0.1"), PORT, SocketOptions()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEADDRINUSE);
+	
+	/* Different protocol. */
+	int l = net.create_listener_socket(htonl(INADDR_ANY), PORT, SocketOptions());
+	EXPECT_NE(l, -1);
+	
+	int udp, listener;
+	uint16_t port;
+	
+	ASSERT_TRUE(net.create_auto_port_sockets(htonl(INADDR_ANY), &udp, &listener, &port, SocketOptions()));
+	EXPECT_NE(port, PORT);
+	
+	EXPECT_EQ(net.create_udp_socket(htonl(INADDR_ANY), port, SocketOptions()), -1);
+	EXPECT_EQ(net.create_listener_socket(htonl(INADDR_ANY), port, SocketOptions()), -1);
+	
+	net.close(listener);
+	net.close(udp);
+	net.close(l);
+	net.close(a);
+	
+	EXPECT_EQ(net.open_sockets(), 0U);
+}
+
+TEST(LoopbackTransport, DiscoveryBroadcast)
+{
+	LoopbackTransport net;
+	
+	int d1 = net.create_discovery_socket();
+	ASSERT_NE(d1, -1);
+	
+	int d2 = net.create_discovery_socket();
+	ASSERT_NE(d2, -1);
+	
+	int sender = net.create_udp_socket(htonl(INADDR_ANY), 0, SocketOptions());
+	ASSERT_NE(sender, -1);
+	
+	struct sockaddr_in to = make_sockaddr("255.255.255.255", DISCOVERY_PORT);
+	EXPECT_EQ(net.sendto(sender, "Hi", 2, (struct sockaddr*)(&to), sizeof(to)), 2);
+	
+	char buf[16];
+	struct sockaddr_in from;
+	
+	EXPECT_EQ(net.recvfrom(d1, buf, sizeof(buf), &from), 2);
+	EXPECT_EQ(net.recvfrom(d2, buf, sizeof(buf), &from), 2);
+	
+	net.close(sender);
+	net.close(d2);
+	net.close(d1);
+}
+
+/* Runs sessions over a LoopbackTransport with a VirtualClock and the shared thread pool
+ * stopped, so everything happens on the test thread from within run() and nothing depends
+ * on real time passing.
+*/
+class LoopbackSession: public ::testing::Test
+{
+	protected:
+		LoopbackTransport net;
+		VirtualClock clock;
+		
+		DirectPlay8ThreadPool *tp;
+		DWORD initial_threads;
+		
+		std::vector<DirectPlay8Peer*> instances;
+		
+		virtual void SetUp() override
+		{
+			tp = new DirectPlay8ThreadPool(NULL);
+			
+			ASSERT_EQ(tp->Initialize(NULL, &PeerMessages::callback, 0), S_OK);
+			ASSERT_EQ(tp->GetThreadCount(-1, &initial_threads, 0), S_OK);
+			ASSERT_EQ(tp->SetThreadCount(-1, 0, 0), S_OK);
+		}
+		
+		virtual void TearDown() override
+		{
+			/* Close() can't wait for anything without worker threads. */
+			tp->SetThreadCount(-1, initial_threads, 0);
+			
+			for(auto i = instances.begin(); i != instances.end(); ++i)
+			{
+				(*i)->Release();
+			}
+			
+			EXPECT_EQ(net.open_sockets(), 0U);
+			
+			tp->Release();
+		}
+		
+		DirectPlay8Peer *new_peer(PeerMessages *pm)
+		{
+			DirectPlay8Peer *peer = ::new_peer(pm, &net, &clock);
+			instances.push_back(peer);
+			
+			return peer;
+		}
+		
+		/* Runs every callback which is ready, and any which become ready as a result. */
+		void run()
+		{
+			tp->DoWork(INFINITE, 0);
+		}
+		
+		/* Moves the clock forward in small steps, running everything in between. */
+		void advance(DWORD ms, DWORD step_ms = 10)
+		{
+			for(DWORD t = 0; t < ms; t += step_ms)
+			{
+				clock.advance((unsigned long long)(step_ms) * 1000);
+				run();
+			}
+		}
+		
+		void host_session(DirectPlay8Peer *host)
+		{
+			DPN_APPLICATION_DESC app_desc;
+			memset(&app_desc, 0, sizeof(app_desc));
+			
+			app_desc.dwSize          = sizeof(app_desc);
+			app_desc.guidApplication = APP_GUID;
+			app_desc.pwszSessionName = (wchar_t*)(L"Loopback Session");
+			
+			DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+			DWORD port = PORT;
+			
+			addr->SetSP(&CLSID_DP8SP_TCPIP);
+			addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+			
+			IDirectPlay8Address *addrs[] = { addr };
+			HRESULT res = host->Host(&app_desc, addrs, 1, NULL, NULL, NULL, 0);
+			
+			addr->Release();
+			
+			ASSERT_EQ(res, S_OK);
+		}
+		
+		void connect_session(DirectPlay8Peer *peer)
+		{
+			ASSERT_EQ(::connect_session(peer, APP_GUID, PORT), DPNSUCCESS_PENDING);
+		}
+		
+		void set_short_keepalive(DirectPlay8Peer *peer)
+		{
+			DPN_CAPS_EX caps;
+			memset(&caps, 0, sizeof(caps));
+			
+			caps.dwSize                  = sizeof(caps);
+			caps.dwTimeoutUntilKeepAlive = 250;
+			caps.dwNumSendRetries        = 1;
+			caps.dwMaxSendRetryInterval  = 250;
+			
+			ASSERT_EQ(peer->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+		}
+};
+
+TEST_F(LoopbackSession, ConnectAndSend)
+{
+	PeerMessages host_pm, p1_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	
+	host_session(host);
+	connect_session(p1);
+	
+	/* The whole handshake happens in here. */
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	DPNHANDLE handle;
+	ASSERT_EQ(p1->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, &handle, DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE), DPNSUCCESS_PENDING);
+	
+	EXPECT_TRUE(host_pm.received.empty());
+	
+	run();
+	
+	ASSERT_EQ(host_pm.received.size(), 1U);
+	EXPECT_EQ(host_pm.received[0], "Hello, world");
+	
+	EXPECT_TRUE(p1_pm.received.empty());
+}
+
+TEST_F(LoopbackSession, KeepAliveIdleConnection)
+{
+	PeerMessages host_pm, p1_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	
+	set_short_keepalive(host);
+	set_short_keepalive(p1);
+	
+	host_session(host);
+	connect_session(p1);
+	
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	/* Pings keep the idle connection open through many keepalive periods. */
+	advance(10000);
+	
+	EXPECT_EQ(host_pm.players_destroyed, 0);
+	EXPECT_EQ(p1_pm.terminated, 0);
+}
+
+TEST_F(LoopbackSession, KeepAliveTimeout)
+{
+	PeerMessages host_pm, p1_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	
+	set_short_keepalive(host);
+	set_short_keepalive(p1);
+	
+	host_session(host);
+	connect_session(p1);
+	
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	/* Jumping straight past the keepalive timeout, as if both processes had been stalled,
+	 * leaves neither end a chance to ping the other first. Whichever end notices first
+	 * drops the connection and the other sees it close.
+	*/
+	clock.advance(5000 * 1000);
+	run();
+	
+	EXPECT_EQ(host_pm.players_destroyed, 1);
+	EXPECT_EQ(p1_pm.terminated, 1);
+}
+
+TEST_F(LoopbackSession, CongestionControlOptIn)
+{
+	PeerMessages host_pm, p1_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(p1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	EXPECT_EQ(caps.dwCongestionControl, 0U);
+	
+	host_session(host);
+	connect_session(p1);
+	
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	/* 2MiB is more than the congestion controller's initial rate allows in one burst. */
+	
+	std::vector<unsigned char> data(256 * 1024, 0xAA);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ (DWORD)(data.size()), data.data() },
+	};
+	
+	auto send_all = [&]()
+	{
+		for(int i = 0; i < 8; ++i)
+		{
+			DPNHANDLE handle;
+			ASSERT_EQ(p1->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, &handle, DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE), DPNSUCCESS_PENDING);
+		}
+	};
+	
+	/* Nothing holds sends back by default, so no time needs to pass. */
+	
+	send_all();
+	run();
+	
+	EXPECT_EQ(host_pm.received.size(), 8U);
+	
+	caps.dwCongestionControl = 1;
+	ASSERT_EQ(p1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	memset(&caps, 0, sizeof(caps));
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(p1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	EXPECT_EQ(caps.dwCongestionControl, 1U);
+	
+	send_all();
+	run();
+	
+	EXPECT_LT(host_pm.received.size(), 16U);
+	
+	advance(1000);
+	
+	EXPECT_EQ(host_pm.received.size(), 16U);
+}
+
+TEST_F(LoopbackSession, GroupMembership)
+{
+	PeerMessages host_pm, p1_pm, p2_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	DirectPlay8Peer *p2   = new_peer(&p2_pm);
+	
+	host_session(host);
+	
+	connect_session(p1);
+	run();
+	
+	connect_session(p2);
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	ASSERT_EQ(p2_pm.connects, 1);
+	ASSERT_EQ(p2_pm.connect_result, S_OK);
+	
+	DPN_GROUP_INFO group_info;
+	memset(&group_info, 0, sizeof(group_info));
+	
+	group_info.dwSize      = sizeof(group_info);
+	group_info.dwInfoFlags = DPNINFO_NAME;
+	group_info.pwszName    = (wchar_t*)(L"Loopback Group");
+	
+	DPNHANDLE handle;
+	ASSERT_EQ(host->CreateGroup(&group_info, NULL, NULL, &handle, 0), DPNSUCCESS_PENDING);
+	
+	run();
+	
+	ASSERT_EQ(host_pm.groups_created.size(), 1U);
+	DPNID group = host_pm.groups_created[0];
+	
+	EXPECT_EQ(p1_pm.groups_created, std::vector<DPNID>({ group }));
+	EXPECT_EQ(p2_pm.groups_created, std::vector<DPNID>({ group }));
+	
+	ASSERT_EQ(host->AddPlayerToGroup(group, p1_pm.local_player, NULL, &handle, 0), DPNSUCCESS_PENDING);
+	
+	run();
+	
+	std::vector< std::pair<DPNID, DPNID> > p1_membership = { std::make_pair(group, p1_pm.local_player) };
+	
+	EXPECT_EQ(host_pm.group_adds, p1_membership);
+	EXPECT_EQ(p1_pm.group_adds, p1_membership);
+	EXPECT_EQ(p2_pm.group_adds, p1_membership);
+	
+	/* Only members get messages sent to the group. */
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, group") },
+	};
+	
+	ASSERT_EQ(p2->SendTo(group, bd, 1, 0, NULL, &handle, DPNSEND_GUARANTEED | DPNSEND_NOCOMPLETE), DPNSUCCESS_PENDING);
+	
+	run();
+	
+	EXPECT_TRUE(host_pm.received.empty());
+	EXPECT_EQ(p1_pm.received, std::vector<std::string>({ "Hello, group" }));
+	EXPECT_TRUE(p2_pm.received.empty());
+	
+	ASSERT_EQ(host->RemovePlayerFromGroup(group, p1_pm.local_player, NULL, &handle, 0), DPNSUCCESS_PENDING);
+	
+	run();
+	
+	EXPECT_EQ(host_pm.group_removes, p1_membership);
+	EXPECT_EQ(p1_pm.group_removes, p1_membership);
+	EXPECT_EQ(p2_pm.group_removes, p1_membership);
+	
+	ASSERT_EQ(host->DestroyGroup(group, NULL, &handle, 0), DPNSUCCESS_PENDING);
+	
+	run();
+	
+	EXPECT_EQ(host_pm.groups_destroyed, std::vector<DPNID>({ group }));
+	EXPECT_EQ(p1_pm.groups_destroyed, std::vector<DPNID>({ group }));
+	EXPECT_EQ(p2_pm.groups_destroyed, std::vector<DPNID>({ group }));
+}
+
+TEST_F(LoopbackSession, PrioritySendOrder)
+{
+	PeerMessages host_pm, p1_pm;
+	
+	DirectPlay8Peer *host = new_peer(&host_pm);
+	DirectPlay8Peer *p1   = new_peer(&p1_pm);
+	
+	host_session(host);
+	connect_session(p1);
+	
+	run();
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	auto send = [p1](const std::string &message, DWORD flags)
+	{
+		DPN_BUFFER_DESC bd[] = {
+			{ (DWORD)(message.size()), (BYTE*)(message.data()) },
+		};
+		
+		DPNHANDLE handle;
+		ASSERT_EQ(p1->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, &handle, (flags | DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE)), DPNSUCCESS_PENDING);
+	};
+	
+	/* Nothing goes out until the thread pool runs, so everything queued before then is
+	 * sent in priority order, and in the order it was queued within each priority.
+	*/
+	
+	send("low 1",    DPNSEND_PRIORITY_LOW);
+	send("normal 1", 0);
+	send("high 1",   DPNSEND_PRIORITY_HIGH);
+	send("low 2",    DPNSEND_PRIORITY_LOW);
+	send("high 2",   DPNSEND_PRIORITY_HIGH);
+	send("normal 2", 0);
+	
+	run();
+	
+	EXPECT_EQ(host_pm.received, std::vector<std::string>({ "high 1", "high 2", "normal 1", "normal 2", "low 1", "low 2" }));
+	
+	host_pm.received.clear();
+	
+	/* With sends paced, a high priority message queued later overtakes the low priority
+	 * ones still waiting for their turn.
+	*/
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	ASSERT_EQ(p1->GetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	caps.dwMaxPlayerSendRate = 2000;
+	
+	ASSERT_EQ(p1->SetCaps((DPN_CAPS*)(&caps), 0), S_OK);
+	
+	for(int i = 0; i < 4; ++i)
+	{
+		send(std::string(1000, (char)('a' + i)), DPNSEND_PRIORITY_LOW);
+	}
+	
+	run();
+	
+	ASSERT_EQ(host_pm.received.size(), 1U);
+	
+	send(std::string(1000, 'H'), DPNSEND_PRIORITY_HIGH);
+	
+	advance(5000);
+	
+	std::string order;
+	for(auto r = host_pm.received.begin(); r != host_pm.received.end(); ++r)
+	{
+		order += (*r)[0];
+	}
+	
+	EXPECT_EQ(order, "aHbcd");
+}
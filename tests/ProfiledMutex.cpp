@@ -0,0 +1,258 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <shared_mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../src/ProfiledMutex.hpp"
+
+static const LockProfile::Site *find_site(const std::vector<LockProfile::Site> &sites, const char *name)
+{
+	for(auto s = sites.begin(); s != sites.end(); ++s)
+	{
+		if(strcmp(s->name, name) == 0)
+		{
+			return &(*s);
+		}
+	}
+	
+	return NULL;
+}
+
+static DWORD histogram_total(const DWORD (&histogram)[LockProfile::LATENCY_BUCKETS])
+{
+	DWORD total = 0;
+	
+	for(int i = 0; i < LockProfile::LATENCY_BUCKETS; ++i)
+	{
+		total += histogram[i];
+	}
+	
+	return total;
+}
+
+TEST(ProfiledMutex, Disabled)
+{
+	lock_profile_set_enabled(false);
+	
+	ProfiledMutex m("m");
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+	}
+	
+	EXPECT_TRUE(m.get_profile().get_sites().empty());
+}
+
+TEST(ProfiledMutex, Sites)
+{
+	lock_profile_set_enabled(true);
+	
+	ProfiledMutex m("m");
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+	}
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+	}
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("b"));
+	}
+	
+	lock_profile_set_enabled(false);
+	
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	ASSERT_EQ(sites.size(), 2U);
+	
+	const LockProfile::Site *a = find_site(sites, "a");
+	ASSERT_NE(a, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(a->acquisitions, 2U);
+	EXPECT_EQ(a->contended,    0U);
+	EXPECT_EQ(a->max_wait_us,  0U);
+	
+	EXPECT_EQ(histogram_total(a->wait_histogram), 2U);
+	EXPECT_EQ(histogram_total(a->hold_histogram), 2U);
+	EXPECT_EQ(a->wait_histogram[0],               2U);
+	
+	const LockProfile::Site *b = find_site(sites, "b");
+	ASSERT_NE(b, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(b->acquisitions, 1U);
+	
+	m.get_profile().reset();
+	EXPECT_TRUE(m.get_profile().get_sites().empty());
+}
+
+TEST(ProfiledMutex, Relock)
+{
+	lock_profile_set_enabled(true);
+	
+	ProfiledMutex m("m");
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+		
+		/* Retaking the lock after releasing it (such as around a callback) should be
+		 * counted against the original site.
+		*/
+		l.unlock();
+		l.lock();
+	}
+	
+	lock_profile_set_enabled(false);
+	
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	ASSERT_EQ(sites.size(), 1U);
+	
+	EXPECT_STREQ(sites[0].name, "a");
+	EXPECT_EQ(sites[0].acquisitions, 2U);
+}
+
+TEST(ProfiledMutex, HoldTime)
+{
+	lock_profile_set_enabled(true);
+	
+	ProfiledMutex m("m");
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+		Sleep(50);
+	}
+	
+	lock_profile_set_enabled(false);
+	
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	ASSERT_EQ(sites.size(), 1U);
+	
+	EXPECT_GE(sites[0].max_hold_us,   40000U);
+	EXPECT_LT(sites[0].max_hold_us,   1000000U);
+	EXPECT_GE(sites[0].total_hold_us, 40000U);
+	EXPECT_EQ(sites[0].contended,     0U);
+}
+
+TEST(ProfiledMutex, Contended)
+{
+	lock_profile_set_enabled(true);
+	
+	ProfiledMutex m("m");
+	
+	std::unique_lock<ProfiledMutex> l(m.at("holder"));
+	
+	std::thread t([&m]()
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("waiter"));
+	});
+	
+	Sleep(50);
+	l.unlock();
+	
+	t.join();
+	
+	lock_profile_set_enabled(false);
+	
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	
+	const LockProfile::Site *waiter = find_site(sites, "waiter");
+	ASSERT_NE(waiter, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(waiter->acquisitions, 1U);
+	EXPECT_EQ(waiter->contended,    1U);
+	EXPECT_GE(waiter->max_wait_us,  30000U);
+	
+	const LockProfile::Site *holder = find_site(sites, "holder");
+	ASSERT_NE(holder, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(holder->contended,   0U);
+	EXPECT_GE(holder->max_hold_us, 40000U);
+}
+
+TEST(ProfiledMutex, ToggledWhileHeld)
+{
+	ProfiledMutex m("m");
+	
+	lock_profile_set_enabled(false);
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("a"));
+		lock_profile_set_enabled(true);
+	}
+	
+	/* Taken before profiling was enabled, so not counted. */
+	EXPECT_TRUE(m.get_profile().get_sites().empty());
+	
+	{
+		std::unique_lock<ProfiledMutex> l(m.at("b"));
+		lock_profile_set_enabled(false);
+	}
+	
+	/* Taken while profiling, so the release is still counted. */
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	ASSERT_EQ(sites.size(), 1U);
+	
+	EXPECT_STREQ(sites[0].name, "b");
+	EXPECT_EQ(sites[0].acquisitions,                    1U);
+	EXPECT_EQ(histogram_total(sites[0].hold_histogram), 1U);
+}
+
+TEST(ProfiledSharedMutex, SharedAndExclusive)
+{
+	lock_profile_set_enabled(true);
+	
+	ProfiledSharedMutex m("m");
+	
+	std::shared_lock<ProfiledSharedMutex> rl(m.at("reader"));
+	
+	std::thread t([&m]()
+	{
+		std::unique_lock<ProfiledSharedMutex> wl(m.at("writer"));
+	});
+	
+	Sleep(50);
+	rl.unlock();
+	
+	t.join();
+	
+	lock_profile_set_enabled(false);
+	
+	std::vector<LockProfile::Site> sites = m.get_profile().get_sites();
+	ASSERT_EQ(sites.size(), 2U);
+	
+	const LockProfile::Site *reader = find_site(sites, "reader");
+	ASSERT_NE(reader, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(reader->acquisitions, 1U);
+	EXPECT_EQ(reader->contended,    0U);
+	EXPECT_GE(reader->max_hold_us,  40000U);
+	
+	const LockProfile::Site *writer = find_site(sites, "writer");
+	ASSERT_NE(writer, (const LockProfile::Site*)(NULL));
+	
+	EXPECT_EQ(writer->acquisitions, 1U);
+	EXPECT_EQ(writer->contended,    1U);
+	EXPECT_GE(writer->max_wait_us,  30000U);
+}
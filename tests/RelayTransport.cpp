@@ -0,0 +1,571 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../relay/RelayServer.hpp"
+#include "../relay/RelaySocket.hpp"
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/EventObject.hpp"
+#include "../src/RelayTransport.hpp"
+#include "TestHelpers.hpp"
+
+#define PORT 42901
+
+static const GUID APP_GUID = { 0x7a0e5d3c, 0x94b1, 0x4c2f, { 0xa6, 0x1d, 0x3e, 0x08, 0xc7, 0x55, 0x2b, 0x9f } };
+static const GUID SESSION_GUID = { 0x1f6c2a90, 0x5d3e, 0x4b87, { 0x9c, 0x40, 0x72, 0xe1, 0x0b, 0xd6, 0x8a, 0x13 } };
+
+/* Virtual sockets complete on the relay link thread, so wait for them rather than
+ * expecting results straight away.
+*/
+static int recv_wait(Transport *t, int sock, HANDLE event, char *buf, size_t size)
+{
+	for(int i = 0; i < 100; ++i)
+	{
+		int r = t->recv(sock, buf, size);
+		if(r != -1 || WSAGetLastError() != WSAEWOULDBLOCK)
+		{
+			return r;
+		}
+		
+		WaitForSingleObject(event, 20);
+	}
+	
+	WSASetLastError(WSAEWOULDBLOCK);
+	return -1;
+}
+
+/* Refuses stream connections to any port not in the allowed set, as if every other peer
+ * was behind a NAT. The refusal completes asynchronously like a real one would.
+*/
+class NATTransport: public SocketTransport
+{
+	private:
+		std::set<uint16_t> allowed_ports;
+		
+		std::mutex lock;
+		std::map<int, HANDLE> events;
+		std::set<int> refused;
+		
+	public:
+		NATTransport(const std::set<uint16_t> &allowed_ports):
+			allowed_ports(allowed_ports) {}
+		
+		virtual int event_select(int sock, HANDLE event, long events) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			this->events[sock] = event;
+			l.unlock();
+			
+			return SocketTransport::event_select(sock, event, events);
+		}
+		
+		virtual int connect(int sock, const struct sockaddr_in *addr) override
+		{
+			if(allowed_ports.find(ntohs(addr->sin_port)) != allowed_ports.end())
+			{
+				return SocketTransport::connect(sock, addr);
+			}
+			
+			std::unique_lock<std::mutex> l(lock);
+			
+			refused.insert(sock);
+			SetEvent(events[sock]);
+			
+			WSASetLastError(WSAEWOULDBLOCK);
+			return -1;
+		}
+		
+		virtual int get_socket_error(int sock, int *error) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			
+			if(refused.find(sock) != refused.end())
+			{
+				*error = WSAECONNREFUSED;
+				return 0;
+			}
+			
+			l.unlock();
+			
+			return SocketTransport::get_socket_error(sock, error);
+		}
+		
+		virtual void close(int sock) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			
+			refused.erase(sock);
+			events.erase(sock);
+			
+			l.unlock();
+			
+			SocketTransport::close(sock);
+		}
+};
+
+class RelaySession: public ::testing::Test
+{
+	protected:
+		RelayServer *relay;
+		std::thread relay_thread;
+		
+		std::vector<Transport*> transports;
+		std::vector<DirectPlay8Peer*> instances;
+		
+		virtual void SetUp() override
+		{
+			ASSERT_TRUE(relay_sockets_init());
+			
+			relay = new RelayServer(htonl(INADDR_LOOPBACK), 0);
+			relay_thread = std::thread([this]() { relay->run(); });
+		}
+		
+		virtual void TearDown() override
+		{
+			for(auto i = instances.begin(); i != instances.end(); ++i)
+			{
+				(*i)->Release();
+			}
+			
+			for(auto i = transports.rbegin(); i != transports.rend(); ++i)
+			{
+				delete *i;
+			}
+			
+			relay->stop();
+			relay_thread.join();
+			delete relay;
+			
+			WSACleanup();
+		}
+		
+		RelayTransport *new_transport(Transport *inner = SocketTransport::get())
+		{
+			RelayTransport *t = new RelayTransport(inner, htonl(INADDR_LOOPBACK), relay->get_port());
+			transports.push_back(t);
+			
+			return t;
+		}
+		
+		DirectPlay8Peer *new_peer(PeerMessages *pm, Transport *transport)
+		{
+			DirectPlay8Peer *peer = ::new_peer(pm, transport, NULL);
+			instances.push_back(peer);
+			
+			return peer;
+		}
+		
+		void host_session(DirectPlay8Peer *host)
+		{
+			DPN_APPLICATION_DESC app_desc;
+			memset(&app_desc, 0, sizeof(app_desc));
+			
+			app_desc.dwSize          = sizeof(app_desc);
+			app_desc.guidApplication = APP_GUID;
+			app_desc.pwszSessionName = (wchar_t*)(L"Relay Session");
+			
+			DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+			DWORD port = PORT;
+			
+			addr->SetSP(&CLSID_DP8SP_TCPIP);
+			addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+			
+			IDirectPlay8Address *addrs[] = { addr };
+			HRESULT res = host->Host(&app_desc, addrs, 1, NULL, NULL, NULL, 0);
+			
+			addr->Release();
+			
+			ASSERT_EQ(res, S_OK);
+		}
+		
+		/* Connects a player from t1 to a listener on t2 and accepts it. */
+		void connect_player(RelayTransport *t1, RelayTransport *t2, DWORD player_id, HANDLE c_event, HANDLE l_event, int listener, int *client, int *server)
+		{
+			*client = t1->connect_player(player_id, SocketOptions());
+			ASSERT_NE(*client, -1);
+			ASSERT_EQ(t1->event_select(*client, c_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE), 0);
+			
+			ASSERT_EQ(WaitForSingleObject(c_event, 2000), WAIT_OBJECT_0);
+			
+			int error = -1;
+			ASSERT_EQ(t1->get_socket_error(*client, &error), 0);
+			ASSERT_EQ(error, 0);
+			
+			/* Nothing is announced to the far end until there is data. */
+			ASSERT_EQ(t1->send(*client, "Hello", 5), 5);
+			
+			ASSERT_EQ(WaitForSingleObject(l_event, 2000), WAIT_OBJECT_0);
+			
+			struct sockaddr_in from;
+			*server = t2->accept(listener, &from);
+			ASSERT_NE(*server, -1);
+			ASSERT_TRUE(t2->setup_accepted_socket(*server, SocketOptions()));
+		}
+};
+
+TEST_F(RelaySession, NoSession)
+{
+	RelayTransport *t = new_transport();
+	
+	EXPECT_EQ(t->connect_player(2, SocketOptions()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEOPNOTSUPP);
+}
+
+TEST_F(RelaySession, ConnectPlayer)
+{
+	RelayTransport *t1 = new_transport();
+	RelayTransport *t2 = new_transport();
+	
+	EventObject l_event, c_event, s_event;
+	
+	int listener = t2->create_listener_socket(htonl(INADDR_LOOPBACK), PORT, SocketOptions());
+	ASSERT_NE(listener, -1);
+	ASSERT_EQ(t2->event_select(listener, l_event, FD_ACCEPT), 0);
+	
+	t2->session_joined(SESSION_GUID, 2, GUID_NULL);
+	Sleep(100);
+	
+	GUID token;
+	t2->admit_player(1, &token);
+	t1->session_joined(SESSION_GUID, 1, token);
+	
+	int client, server;
+	connect_player(t1, t2, 2, c_event, l_event, listener, &client, &server);
+	ASSERT_EQ(t2->event_select(server, s_event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	char buf[16];
+	ASSERT_EQ(recv_wait(t2, server, s_event, buf, sizeof(buf)), 5);
+	EXPECT_EQ(std::string(buf, 5), "Hello");
+	
+	ASSERT_EQ(t2->send(server, "World", 5), 5);
+	ASSERT_EQ(recv_wait(t1, client, c_event, buf, sizeof(buf)), 5);
+	EXPECT_EQ(std::string(buf, 5), "World");
+	
+	/* Shutting down sending is seen as EOF at the far end. */
+	
+	ASSERT_EQ(t1->shutdown_send(client), 0);
+	
+	EXPECT_EQ(t1->send(client, "x", 1), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAESHUTDOWN);
+	
+	EXPECT_EQ(recv_wait(t2, server, s_event, buf, sizeof(buf)), 0);
+	
+	t2->close(server);
+	
+	EXPECT_EQ(recv_wait(t1, client, c_event, buf, sizeof(buf)), 0);
+	
+	t1->close(client);
+	t2->close(listener);
+	
+	t1->session_left();
+	t2->session_left();
+}
+
+TEST_F(RelaySession, ConnectPlayerNotJoined)
+{
+	RelayTransport *t1 = new_transport();
+	EventObject c_event;
+	
+	t1->session_joined(SESSION_GUID, 1, GUID_NULL);
+	
+	int client = t1->connect_player(3, SocketOptions());
+	ASSERT_NE(client, -1);
+	ASSERT_EQ(t1->event_select(client, c_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	ASSERT_EQ(WaitForSingleObject(c_event, 2000), WAIT_OBJECT_0);
+	
+	int error = 0;
+	EXPECT_EQ(t1->get_socket_error(client, &error), 0);
+	EXPECT_EQ(error, WSAECONNREFUSED);
+	
+	t1->close(client);
+	t1->session_left();
+}
+
+TEST_F(RelaySession, JoinRefused)
+{
+	RelayTransport *host = new_transport();
+	
+	RelayTransport *t1 = new_transport();  /* Hosts a session which already exists. */
+	RelayTransport *t2 = new_transport();  /* Admitted as the host's own player ID. */
+	RelayTransport *t3 = new_transport();  /* Never admitted. */
+	
+	host->session_joined(SESSION_GUID, 1, GUID_NULL);
+	Sleep(100);
+	
+	GUID token;
+	host->admit_player(1, &token);
+	ASSERT_NE(token, GUID_NULL);
+	
+	t1->session_joined(SESSION_GUID, 2, GUID_NULL);
+	t2->session_joined(SESSION_GUID, 1, token);
+	t3->session_joined(SESSION_GUID, 3, APP_GUID);
+	
+	Sleep(500);
+	
+	EXPECT_EQ(t1->connect_player(1, SocketOptions()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAENETUNREACH);
+	
+	EXPECT_EQ(t2->connect_player(1, SocketOptions()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAENETUNREACH);
+	
+	/* Held by the relay in case the admission is still on its way, until it gives up. */
+	
+	EventObject c_event;
+	
+	int client = t3->connect_player(1, SocketOptions());
+	ASSERT_NE(client, -1);
+	ASSERT_EQ(t3->event_select(client, c_event, FD_CONNECT | FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	ASSERT_EQ(WaitForSingleObject(c_event, 10000), WAIT_OBJECT_0);
+	
+	int error = 0;
+	EXPECT_EQ(t3->get_socket_error(client, &error), 0);
+	EXPECT_EQ(error, WSAECONNREFUSED);
+	
+	t3->close(client);
+	
+	EXPECT_EQ(t3->connect_player(1, SocketOptions()), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAENETUNREACH);
+	
+	host->session_left();
+	t1->session_left();
+	t2->session_left();
+	t3->session_left();
+}
+
+TEST_F(RelaySession, PlayerLeftResetsConnection)
+{
+	RelayTransport *t1 = new_transport();
+	RelayTransport *t2 = new_transport();
+	
+	EventObject l_event, c_event;
+	
+	int listener = t2->create_listener_socket(htonl(INADDR_LOOPBACK), PORT, SocketOptions());
+	ASSERT_NE(listener, -1);
+	ASSERT_EQ(t2->event_select(listener, l_event, FD_ACCEPT), 0);
+	
+	t2->session_joined(SESSION_GUID, 2, GUID_NULL);
+	Sleep(100);
+	
+	GUID token;
+	t2->admit_player(1, &token);
+	t1->session_joined(SESSION_GUID, 1, token);
+	
+	int client, server;
+	connect_player(t1, t2, 2, c_event, l_event, listener, &client, &server);
+	
+	/* The far end drops off the relay without closing the connection. */
+	transports.erase(std::find(transports.begin(), transports.end(), t2));
+	delete t2;
+	
+	char buf[16];
+	EXPECT_EQ(recv_wait(t1, client, c_event, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAECONNRESET);
+	
+	t1->close(client);
+	t1->session_left();
+}
+
+TEST_F(RelaySession, PeerFallsBackToRelay)
+{
+	PeerMessages host_pm, p1_pm, p2_pm;
+	
+	/* The host is reachable directly, p2 can't reach p1 except through the relay. */
+	
+	NATTransport *nat = new NATTransport({ PORT, relay->get_port() });
+	transports.push_back(nat);
+	
+	DirectPlay8Peer *host = new_peer(&host_pm, new_transport());
+	DirectPlay8Peer *p1   = new_peer(&p1_pm, new_transport());
+	DirectPlay8Peer *p2   = new_peer(&p2_pm, new_transport(nat));
+	
+	host_session(host);
+	
+	ASSERT_EQ(connect_session(p1, APP_GUID, PORT), DPNSUCCESS_PENDING);
+	Sleep(500);
+	
+	ASSERT_EQ(p1_pm.connects, 1);
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	
+	ASSERT_EQ(connect_session(p2, APP_GUID, PORT), DPNSUCCESS_PENDING);
+	Sleep(1000);
+	
+	ASSERT_EQ(p2_pm.connects, 1);
+	ASSERT_EQ(p2_pm.connect_result, S_OK);
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	DPNHANDLE handle;
+	ASSERT_EQ(p2->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, &handle, DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE), DPNSUCCESS_PENDING);
+	
+	Sleep(500);
+	
+	ASSERT_EQ(host_pm.received.size(), 1U);
+	EXPECT_EQ(host_pm.received[0], "Hello, world");
+	
+	ASSERT_EQ(p1_pm.received.size(), 1U);
+	EXPECT_EQ(p1_pm.received[0], "Hello, world");
+	
+	EXPECT_GT(relay->get_stats().packets_in, 0U);
+}
+
+TEST_F(RelaySession, SendMulti)
+{
+	RelayTransport *t1 = new_transport();
+	RelayTransport *t2 = new_transport();
+	RelayTransport *t3 = new_transport();
+	
+	EventObject l2_event, l3_event, c2_event, c3_event, s2_event, s3_event;
+	
+	int listener2 = t2->create_listener_socket(htonl(INADDR_LOOPBACK), PORT, SocketOptions());
+	ASSERT_NE(listener2, -1);
+	ASSERT_EQ(t2->event_select(listener2, l2_event, FD_ACCEPT), 0);
+	
+	int listener3 = t3->create_listener_socket(htonl(INADDR_LOOPBACK), PORT + 1, SocketOptions());
+	ASSERT_NE(listener3, -1);
+	ASSERT_EQ(t3->event_select(listener3, l3_event, FD_ACCEPT), 0);
+	
+	t2->session_joined(SESSION_GUID, 2, GUID_NULL);
+	Sleep(100);
+	
+	GUID token1, token3;
+	t2->admit_player(1, &token1);
+	t2->admit_player(3, &token3);
+	
+	t3->session_joined(SESSION_GUID, 3, token3);
+	Sleep(100);
+	t1->session_joined(SESSION_GUID, 1, token1);
+	
+	int client2, server2, client3, server3;
+	connect_player(t1, t2, 2, c2_event, l2_event, listener2, &client2, &server2);
+	connect_player(t1, t3, 3, c3_event, l3_event, listener3, &client3, &server3);
+	ASSERT_EQ(t2->event_select(server2, s2_event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	ASSERT_EQ(t3->event_select(server3, s3_event, FD_READ | FD_WRITE | FD_CLOSE), 0);
+	
+	char buf[16];
+	ASSERT_EQ(recv_wait(t2, server2, s2_event, buf, sizeof(buf)), 5);
+	ASSERT_EQ(recv_wait(t3, server3, s3_event, buf, sizeof(buf)), 5);
+	
+	EXPECT_TRUE(t1->can_send_multi(client2));
+	EXPECT_FALSE(t2->can_send_multi(listener2));
+	
+	uint64_t packets_in = relay->get_stats().packets_in;
+	
+	int socks[] = { client2, client3 };
+	ASSERT_TRUE(t1->send_multi(socks, 2, "World", 5));
+	
+	/* Lands in each stream after what was already sent. */
+	
+	ASSERT_EQ(recv_wait(t2, server2, s2_event, buf, sizeof(buf)), 5);
+	EXPECT_EQ(std::string(buf, 5), "World");
+	
+	ASSERT_EQ(recv_wait(t3, server3, s3_event, buf, sizeof(buf)), 5);
+	EXPECT_EQ(std::string(buf, 5), "World");
+	
+	EXPECT_EQ(relay->get_stats().packets_in, packets_in + 1);
+	
+	/* Nothing is sent if any of the sockets can't take it. */
+	
+	ASSERT_EQ(t1->shutdown_send(client3), 0);
+	EXPECT_FALSE(t1->send_multi(socks, 2, "Again", 5));
+	
+	EXPECT_EQ(recv_wait(t2, server2, s2_event, buf, sizeof(buf)), -1);
+	EXPECT_EQ(WSAGetLastError(), WSAEWOULDBLOCK);
+	
+	t1->close(client2);
+	t1->close(client3);
+	t2->close(server2);
+	t3->close(server3);
+	t2->close(listener2);
+	t3->close(listener3);
+	
+	t1->session_left();
+	t2->session_left();
+	t3->session_left();
+}
+
+TEST_F(RelaySession, PeerSendToAllUploadsOnce)
+{
+	PeerMessages host_pm, p1_pm, p2_pm, p3_pm;
+	
+	/* Only the host is reachable directly, the other peers can only reach each other
+	 * through the relay.
+	*/
+	
+	NATTransport *nat = new NATTransport({ PORT, relay->get_port() });
+	transports.push_back(nat);
+	
+	DirectPlay8Peer *host = new_peer(&host_pm, new_transport());
+	DirectPlay8Peer *p1   = new_peer(&p1_pm, new_transport(nat));
+	DirectPlay8Peer *p2   = new_peer(&p2_pm, new_transport(nat));
+	DirectPlay8Peer *p3   = new_peer(&p3_pm, new_transport(nat));
+	
+	host_session(host);
+	
+	ASSERT_EQ(connect_session(p1, APP_GUID, PORT), DPNSUCCESS_PENDING);
+	Sleep(500);
+	ASSERT_EQ(connect_session(p2, APP_GUID, PORT), DPNSUCCESS_PENDING);
+	Sleep(1000);
+	ASSERT_EQ(connect_session(p3, APP_GUID, PORT), DPNSUCCESS_PENDING);
+	Sleep(1000);
+	
+	ASSERT_EQ(p1_pm.connect_result, S_OK);
+	ASSERT_EQ(p2_pm.connect_result, S_OK);
+	ASSERT_EQ(p3_pm.connect_result, S_OK);
+	
+	uint64_t packets_in = relay->get_stats().packets_in;
+	
+	DPN_BUFFER_DESC bd[] = {
+		{ 12, (BYTE*)("Hello, world") },
+	};
+	
+	const int MESSAGES = 10;
+	
+	for(int i = 0; i < MESSAGES; ++i)
+	{
+		ASSERT_EQ(p1->SendTo(DPNID_ALL_PLAYERS_GROUP, bd, 1, 0, NULL, NULL, DPNSEND_SYNC | DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK), S_OK);
+	}
+	
+	Sleep(500);
+	
+	EXPECT_EQ(host_pm.received.size(), (size_t)(MESSAGES));
+	EXPECT_EQ(p2_pm.received.size(), (size_t)(MESSAGES));
+	EXPECT_EQ(p3_pm.received.size(), (size_t)(MESSAGES));
+	
+	/* One upload for p2 and p3 together rather than one each, allowing for the odd ping
+	 * going through the relay at the same time.
+	*/
+	uint64_t uploads = relay->get_stats().packets_in - packets_in;
+	EXPECT_GE(uploads, (uint64_t)(MESSAGES));
+	EXPECT_LT(uploads, (uint64_t)(MESSAGES + (MESSAGES / 2)));
+}
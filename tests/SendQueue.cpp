@@ -51,7 +51,7 @@ TEST_F(SendQueueTest, SendSingleLow)
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(0), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after calling send() */
 	EXPECT_TRUE(event_signalled());
@@ -77,17 +77,17 @@ TEST_F(SendQueueTest, SendMultiLow)
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after each batch of calls to send() */
 	EXPECT_TRUE(event_signalled());
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(0), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after each batch of calls to send() */
 	EXPECT_TRUE(event_signalled());
@@ -139,10 +139,10 @@ TEST_F(SendQueueTest, SendMultiMedium)
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after each batch of calls to send() */
 	EXPECT_TRUE(event_signalled());
@@ -182,10 +182,10 @@ TEST_F(SendQueueTest, SendMultiHigh)
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after each batch of calls to send() */
 	EXPECT_TRUE(event_signalled());
@@ -225,22 +225,22 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 	EXPECT_FALSE(event_signalled());
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(4), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(5), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(6), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	/* Event should signal once after each batch of calls to send() */
 	EXPECT_TRUE(event_signalled());
@@ -326,13 +326,13 @@ TEST_F(SendQueueTest, SendMultiPriorities)
 TEST_F(SendQueueTest, RemoveQueued)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL, 2,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL, 3,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	{
 		SendQueue::SendOp *sqop = sq.remove_queued();
@@ -369,13 +369,13 @@ TEST_F(SendQueueTest, RemoveQueued)
 TEST_F(SendQueueTest, RemoveQueuedPending)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL, 2,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL, 3,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	{
 		SendQueue::SendOp *sqop = sq.get_pending();
@@ -414,13 +414,13 @@ TEST_F(SendQueueTest, RemoveQueuedPending)
 TEST_F(SendQueueTest, RemoveQueuedNoHandle)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	EXPECT_EQ(sq.remove_queued(), (SendQueue::SendOp*)(NULL));
 }
@@ -428,13 +428,13 @@ TEST_F(SendQueueTest, RemoveQueuedNoHandle)
 TEST_F(SendQueueTest, RemoveQueuedByHandle)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL, 2,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL, 3,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	{
 		SendQueue::SendOp *sqop = sq.remove_queued_by_handle(1);
@@ -473,13 +473,13 @@ TEST_F(SendQueueTest, RemoveQueuedByHandle)
 TEST_F(SendQueueTest, RemoveQueuedByPriority)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL, 1,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL, 2,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(3), NULL, 3,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	{
 		SendQueue::SendOp *sqop = sq.remove_queued_by_priority(SendQueue::SEND_PRI_LOW);
@@ -518,15 +518,186 @@ TEST_F(SendQueueTest, RemoveQueuedByPriority)
 TEST_F(SendQueueTest, RemoveQueuedByPriorityNoHandle)
 {
 	sq.send(SendQueue::SEND_PRI_LOW, PacketSerialiser(1), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(2), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(3), NULL,
-		[](std::unique_lock<std::mutex> &l, HRESULT result) { return 0; });
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
 	
 	EXPECT_EQ(sq.remove_queued_by_priority(SendQueue::SEND_PRI_LOW),    (SendQueue::SendOp*)(NULL));
 	EXPECT_EQ(sq.remove_queued_by_priority(SendQueue::SEND_PRI_MEDIUM), (SendQueue::SendOp*)(NULL));
 	EXPECT_EQ(sq.remove_queued_by_priority(SendQueue::SEND_PRI_HIGH),   (SendQueue::SendOp*)(NULL));
 }
+
+TEST_F(SendQueueTest, Timestamps)
+{
+	SendQueue::Timestamp before = SendQueue::now();
+	
+	bool called = false;
+	SendQueue::Timestamp cb_queued = 0, cb_first_sent = 0, cb_completed = 0;
+	
+	sq.send_timed(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(1), NULL, 1,
+		[&](std::unique_lock<ProfiledMutex> &l, HRESULT result, const SendQueue::SendOp &op)
+		{
+			called = true;
+			
+			cb_queued     = op.get_queued_at();
+			cb_first_sent = op.get_first_sent_at();
+			cb_completed  = op.get_completed_at();
+		});
+	
+	SendQueue::SendOp *sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	
+	EXPECT_GE(sqop->get_queued_at(), before);
+	EXPECT_EQ(sqop->get_first_sent_at(), 0U);
+	EXPECT_EQ(sqop->get_completed_at(),  0U);
+	
+	Sleep(20);
+	
+	sqop->inc_sent_data(1);
+	
+	EXPECT_GE(sqop->get_first_sent_at(), sqop->get_queued_at() + 10000);
+	
+	SendQueue::Timestamp first_sent = sqop->get_first_sent_at();
+	
+	Sleep(20);
+	
+	/* Only the first send should be recorded. */
+	sqop->inc_sent_data(1);
+	EXPECT_EQ(sqop->get_first_sent_at(), first_sent);
+	
+	sq.pop_pending(sqop);
+	
+	ProfiledMutex lock("lock");
+	std::unique_lock<ProfiledMutex> l(lock);
+	
+	sqop->invoke_callback(l, S_OK);
+	
+	EXPECT_TRUE(called);
+	
+	EXPECT_EQ(cb_queued,     sqop->get_queued_at());
+	EXPECT_EQ(cb_first_sent, first_sent);
+	EXPECT_GE(cb_completed,  first_sent + 10000);
+	
+	delete sqop;
+}
+
+TEST_F(SendQueueTest, QueuedBytes)
+{
+	EXPECT_EQ(sq.get_queued_bytes(), 0U);
+	
+	PacketSerialiser p1(1);
+	p1.append_dword(0);
+	
+	PacketSerialiser p2(2);
+	
+	size_t p1_size = p1.raw_packet().second;
+	size_t p2_size = p2.raw_packet().second;
+	
+	sq.send(SendQueue::SEND_PRI_LOW, p1, NULL, 1,
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
+	
+	sq.send(SendQueue::SEND_PRI_HIGH, p2, NULL, 2,
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
+	
+	EXPECT_EQ(sq.get_queued_bytes(), p1_size + p2_size);
+	
+	/* The current SendOp isn't counted. */
+	SendQueue::SendOp *sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop), 2);
+	
+	EXPECT_EQ(sq.get_queued_bytes(), p1_size);
+	
+	sq.pop_pending(sqop);
+	delete sqop;
+	
+	sqop = sq.remove_queued_by_handle(1);
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	delete sqop;
+	
+	EXPECT_EQ(sq.get_queued_bytes(), 0U);
+}
+
+TEST_F(SendQueueTest, SendStreamed)
+{
+	uint32_t next_type = 11;
+	
+	sq.send_streamed(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(10), 1,
+		[&next_type](std::vector<unsigned char> &data)
+		{
+			if(next_type > 12)
+			{
+				return false;
+			}
+			
+			PacketSerialiser p(next_type++);
+			
+			std::pair<const void*, size_t> raw = p.raw_packet();
+			data.assign((const unsigned char*)(raw.first), (const unsigned char*)(raw.first) + raw.second);
+			
+			return true;
+		},
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result, const SendQueue::SendOp &op) {});
+	
+	sq.send(SendQueue::SEND_PRI_MEDIUM, PacketSerialiser(20), NULL,
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
+	
+	EXPECT_TRUE(event_signalled());
+	
+	SendQueue::SendOp *sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop), 10U);
+	
+	sqop->inc_sent_data(sqop->get_pending_data().second);
+	
+	/* Higher priority messages queued while the stream is in progress go before the
+	 * next packet, lower or equal ones go after the whole stream.
+	*/
+	sq.send(SendQueue::SEND_PRI_HIGH, PacketSerialiser(30), NULL,
+		[](std::unique_lock<ProfiledMutex> &l, HRESULT result) { return 0; });
+	
+	EXPECT_TRUE(sq.continue_pending(sqop));
+	EXPECT_TRUE(event_signalled());
+	
+	{
+		SendQueue::SendOp *hop = sq.get_pending();
+		ASSERT_NE(hop, (SendQueue::SendOp*)(NULL));
+		EXPECT_EQ(sqop_ptype(hop), 30U);
+		
+		hop->inc_sent_data(hop->get_pending_data().second);
+		EXPECT_FALSE(sq.continue_pending(hop));
+		
+		sq.pop_pending(hop);
+		delete hop;
+	}
+	
+	EXPECT_EQ(sq.get_pending(), sqop);
+	EXPECT_EQ(sqop_ptype(sqop), 11U);
+	EXPECT_EQ(sqop->get_pending_data().second, sqop->get_data().second);
+	
+	sqop->inc_sent_data(sqop->get_pending_data().second);
+	EXPECT_TRUE(sq.continue_pending(sqop));
+	
+	EXPECT_EQ(sq.get_pending(), sqop);
+	EXPECT_EQ(sqop_ptype(sqop), 12U);
+	
+	sqop->inc_sent_data(sqop->get_pending_data().second);
+	EXPECT_FALSE(sq.continue_pending(sqop));
+	
+	sq.pop_pending(sqop);
+	delete sqop;
+	
+	sqop = sq.get_pending();
+	ASSERT_NE(sqop, (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sqop_ptype(sqop), 20U);
+	
+	sq.pop_pending(sqop);
+	delete sqop;
+	
+	EXPECT_EQ(sq.get_pending(), (SendQueue::SendOp*)(NULL));
+	EXPECT_EQ(sq.get_queued_bytes(), 0U);
+}
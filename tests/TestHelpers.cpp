@@ -0,0 +1,165 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <stdexcept>
+#include <string.h>
+#include <windows.h>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "TestHelpers.hpp"
+
+bool signalled(HANDLE event)
+{
+	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+}
+
+struct sockaddr_in make_sockaddr(const char *ip, uint16_t port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(ip);
+	addr.sin_port        = htons(port);
+	
+	return addr;
+}
+
+PeerMessages::PeerMessages():
+	connects(0), connect_result(S_OK), local_player(0), players_destroyed(0), terminated(0) {}
+
+HRESULT CALLBACK PeerMessages::callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	PeerMessages *pm = (PeerMessages*)(pvUserContext);
+	
+	switch(dwMessageType)
+	{
+		case DPN_MSGID_CONNECT_COMPLETE:
+		{
+			DPNMSG_CONNECT_COMPLETE *cc = (DPNMSG_CONNECT_COMPLETE*)(pMessage);
+			
+			++(pm->connects);
+			pm->connect_result = cc->hResultCode;
+			pm->local_player   = cc->dpnidLocal;
+			
+			break;
+		}
+		
+		case DPN_MSGID_RECEIVE:
+		{
+			DPNMSG_RECEIVE *r = (DPNMSG_RECEIVE*)(pMessage);
+			pm->received.push_back(std::string((const char*)(r->pReceiveData), r->dwReceiveDataSize));
+			
+			break;
+		}
+		
+		case DPN_MSGID_DESTROY_PLAYER:
+		{
+			++(pm->players_destroyed);
+			break;
+		}
+		
+		case DPN_MSGID_CREATE_GROUP:
+		{
+			DPNMSG_CREATE_GROUP *cg = (DPNMSG_CREATE_GROUP*)(pMessage);
+			pm->groups_created.push_back(cg->dpnidGroup);
+			
+			break;
+		}
+		
+		case DPN_MSGID_DESTROY_GROUP:
+		{
+			DPNMSG_DESTROY_GROUP *dg = (DPNMSG_DESTROY_GROUP*)(pMessage);
+			pm->groups_destroyed.push_back(dg->dpnidGroup);
+			
+			break;
+		}
+		
+		case DPN_MSGID_ADD_PLAYER_TO_GROUP:
+		{
+			DPNMSG_ADD_PLAYER_TO_GROUP *ap = (DPNMSG_ADD_PLAYER_TO_GROUP*)(pMessage);
+			pm->group_adds.push_back(std::make_pair(ap->dpnidGroup, ap->dpnidPlayer));
+			
+			break;
+		}
+		
+		case DPN_MSGID_REMOVE_PLAYER_FROM_GROUP:
+		{
+			DPNMSG_REMOVE_PLAYER_FROM_GROUP *rp = (DPNMSG_REMOVE_PLAYER_FROM_GROUP*)(pMessage);
+			pm->group_removes.push_back(std::make_pair(rp->dpnidGroup, rp->dpnidPlayer));
+			
+			break;
+		}
+		
+		case DPN_MSGID_TERMINATE_SESSION:
+			++(pm->terminated);
+			break;
+			
+		default:
+			break;
+	}
+	
+	return DPN_OK;
+}
+
+DirectPlay8Peer *new_peer(PeerMessages *pm, Transport *transport, Clock *clock)
+{
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL, DirectPlay8Peer::ROLE_PEER, transport, clock);
+	
+	if(peer->Initialize(pm, &PeerMessages::callback, 0) != S_OK)
+	{
+		peer->Release();
+		throw std::runtime_error("DirectPlay8Peer::Initialize failed");
+	}
+	
+	return peer;
+}
+
+HRESULT connect_session(DirectPlay8Peer *peer, const GUID &application_guid, DWORD port, const void *connect_data, DWORD connect_data_size)
+{
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.guidApplication = application_guid;
+	
+	DirectPlay8Address *addr = new DirectPlay8Address(NULL);
+	
+	addr->SetSP(&CLSID_DP8SP_TCPIP);
+	addr->AddComponent(DPNA_KEY_HOSTNAME, L"127.0.0.1", sizeof(L"127.0.0.1"), DPNA_DATATYPE_STRING);
+	addr->AddComponent(DPNA_KEY_PORT, &port, sizeof(DWORD), DPNA_DATATYPE_DWORD);
+	
+	DPNHANDLE handle;
+	HRESULT res = peer->Connect(
+		&app_desc,          /* pdnAppDesc */
+		addr,               /* pHostAddr */
+		NULL,               /* pDeviceInfo */
+		NULL,               /* pdnSecurity */
+		NULL,               /* pdnCredentials */
+		connect_data,       /* pvUserConnectData */
+		connect_data_size,  /* dwUserConnectDataSize */
+		NULL,               /* pvPlayerContext */
+		NULL,               /* pvAsyncContext */
+		&handle,            /* phAsyncHandle */
+		0);                 /* dwFlags */
+	
+	addr->Release();
+	
+	return res;
+}
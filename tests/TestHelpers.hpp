@@ -0,0 +1,72 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef DPLITE_TESTS_TESTHELPERS_HPP
+#define DPLITE_TESTS_TESTHELPERS_HPP
+
+#include <winsock2.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Clock.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/Transport.hpp"
+
+/* Helpers shared by the tests which drive DirectPlay8Peer instances over a Transport. */
+
+bool signalled(HANDLE event);
+struct sockaddr_in make_sockaddr(const char *ip, uint16_t port);
+
+/* Records the messages raised by a DirectPlay8Peer. */
+struct PeerMessages
+{
+	int connects;
+	HRESULT connect_result;
+	DPNID local_player;
+	
+	std::vector<std::string> received;
+	
+	int players_destroyed;
+	int terminated;
+	
+	/* Group IDs from DPN_MSGID_CREATE_GROUP and DPN_MSGID_DESTROY_GROUP, and (group, player)
+	 * pairs from DPN_MSGID_ADD_PLAYER_TO_GROUP and DPN_MSGID_REMOVE_PLAYER_FROM_GROUP, in the
+	 * order they were raised.
+	*/
+	std::vector<DPNID> groups_created;
+	std::vector<DPNID> groups_destroyed;
+	std::vector< std::pair<DPNID, DPNID> > group_adds;
+	std::vector< std::pair<DPNID, DPNID> > group_removes;
+	
+	PeerMessages();
+	
+	static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+};
+
+/* Creates a DirectPlay8Peer using the given Transport and Clock and initialises it with a
+ * PeerMessages as its message handler. Throws std::runtime_error on failure.
+*/
+DirectPlay8Peer *new_peer(PeerMessages *pm, Transport *transport, Clock *clock);
+
+/* Begins an asynchronous connection from peer to a session on 127.0.0.1:port. */
+HRESULT connect_session(DirectPlay8Peer *peer, const GUID &application_guid, DWORD port, const void *connect_data = NULL, DWORD connect_data_size = 0);
+
+#endif /* !DPLITE_TESTS_TESTHELPERS_HPP */
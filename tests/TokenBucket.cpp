@@ -0,0 +1,122 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <gtest/gtest.h>
+#include <windows.h>
+
+#include "../src/TokenBucket.hpp"
+
+static const unsigned long long T0 = 1000000000ULL;
+
+TEST(TokenBucket, Unlimited)
+{
+	TokenBucket tb;
+	
+	EXPECT_EQ(tb.get_rate(), 0U);
+	
+	EXPECT_EQ(tb.ready_at(1000000, T0), T0);
+	tb.consume(1000000, T0);
+	EXPECT_EQ(tb.ready_at(1000000, T0), T0);
+}
+
+TEST(TokenBucket, Burst)
+{
+	TokenBucket tb;
+	tb.set_rate(20000, 2000);
+	
+	/* Starts full. */
+	EXPECT_EQ(tb.ready_at(2000, T0), T0);
+	tb.consume(2000, T0);
+	
+	/* Empty, 2000 bytes at 20000/sec takes 100ms to come back. */
+	EXPECT_EQ(tb.ready_at(2000, T0), T0 + 100000);
+	EXPECT_EQ(tb.ready_at(1000, T0), T0 + 50000);
+	
+	EXPECT_EQ(tb.ready_at(1000, T0 + 50000), T0 + 50000);
+	
+	/* Never fills beyond the burst size. */
+	EXPECT_EQ(tb.ready_at(2000, T0 + 10000000), T0 + 10000000);
+	tb.consume(2000, T0 + 10000000);
+	EXPECT_EQ(tb.ready_at(1, T0 + 10000000), T0 + 10000050);
+}
+
+TEST(TokenBucket, Debt)
+{
+	TokenBucket tb;
+	tb.set_rate(10000, 1500);
+	
+	/* Messages bigger than the burst size can go once the bucket is full... */
+	EXPECT_EQ(tb.ready_at(5000, T0), T0);
+	tb.consume(5000, T0);
+	
+	/* ...but leave it in debt until they've been paid for. */
+	EXPECT_EQ(tb.ready_at(100, T0), T0 + 360000);
+	EXPECT_EQ(tb.ready_at(5000, T0), T0 + 500000);
+}
+
+TEST(TokenBucket, SustainedRate)
+{
+	TokenBucket tb;
+	tb.set_rate(50000, 1500);
+	
+	tb.consume(1500, T0);
+	
+	/* Send 100 byte messages as fast as the bucket allows for a second. */
+	
+	unsigned long long sent = 0;
+	
+	for(unsigned long long now = T0; now < T0 + 1000000; now += 7)
+	{
+		if(tb.ready_at(100, now) == now)
+		{
+			tb.consume(100, now);
+			sent += 100;
+		}
+	}
+	
+	EXPECT_GE(sent, 49900U);
+	EXPECT_LE(sent, 50000U);
+}
+
+TEST(TokenBucket, MinimumBurst)
+{
+	TokenBucket tb;
+	tb.set_rate(100);
+	
+	/* Rate is tiny, but a full frame can still get out. */
+	EXPECT_EQ(tb.ready_at(1500, T0), T0);
+}
+
+TEST(TokenBucket, RateChangeKeepsTokens)
+{
+	TokenBucket tb;
+	tb.set_rate(10000, 2000);
+	
+	tb.consume(2000, T0);
+	
+	/* Changing the rate doesn't refill the bucket... */
+	tb.set_rate(20000, 2000);
+	EXPECT_EQ(tb.ready_at(1000, T0), T0 + 50000);
+	
+	/* ...but does clamp it to a smaller burst size. */
+	EXPECT_EQ(tb.ready_at(2000, T0 + 10000000), T0 + 10000000);
+	tb.set_rate(20000, 1500);
+	tb.consume(1500, T0 + 10000000);
+	EXPECT_EQ(tb.ready_at(1, T0 + 10000000), T0 + 10000050);
+}
@@ -0,0 +1,189 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <dplay8.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../src/Messages.hpp"
+#include "../src/Trace.hpp"
+
+class TraceTest: public ::testing::Test
+{
+	protected:
+		TraceTest()
+		{
+			trace_set_enabled(true);
+			trace_clear();
+		}
+		
+		virtual ~TraceTest()
+		{
+			trace_set_enabled(false);
+			trace_clear();
+		}
+};
+
+static size_t count(const std::string &haystack, const std::string &needle)
+{
+	size_t n = 0;
+	
+	for(size_t p = haystack.find(needle); p != std::string::npos; p = haystack.find(needle, p + 1))
+	{
+		++n;
+	}
+	
+	return n;
+}
+
+TEST_F(TraceTest, Record)
+{
+	TRACE_POINT(TE_SEND_ENQUEUE, 1, DPLITE_MSGID_MESSAGE, 100, 0x1234);
+	TRACE_POINT(TE_WIRE_WRITE,   1, DPLITE_MSGID_MESSAGE, 100, 0x1234);
+	
+	std::vector<TraceRecord> records = trace_snapshot();
+	ASSERT_EQ(records.size(), 2U);
+	
+	EXPECT_EQ(records[0].event,  TE_SEND_ENQUEUE);
+	EXPECT_EQ(records[0].peer,   1U);
+	EXPECT_EQ(records[0].type,   (uint32_t)(DPLITE_MSGID_MESSAGE));
+	EXPECT_EQ(records[0].size,   100U);
+	EXPECT_EQ(records[0].handle, 0x1234U);
+	EXPECT_EQ(records[0].thread, (uint32_t)(GetCurrentThreadId()));
+	
+	EXPECT_EQ(records[1].event,  TE_WIRE_WRITE);
+	EXPECT_LE(records[0].time, records[1].time);
+}
+
+TEST_F(TraceTest, Disabled)
+{
+	trace_set_enabled(false);
+	
+	TRACE_POINT(TE_SEND_ENQUEUE, 1, DPLITE_MSGID_MESSAGE, 100, 0);
+	
+	EXPECT_TRUE(trace_snapshot().empty());
+}
+
+TEST_F(TraceTest, Clear)
+{
+	TRACE_POINT(TE_SEND_ENQUEUE, 1, DPLITE_MSGID_MESSAGE, 100, 0);
+	trace_clear();
+	TRACE_POINT(TE_RECV_DECODE, 1, DPLITE_MSGID_ACK, 16, 0);
+	
+	std::vector<TraceRecord> records = trace_snapshot();
+	ASSERT_EQ(records.size(), 1U);
+	EXPECT_EQ(records[0].event, TE_RECV_DECODE);
+}
+
+TEST_F(TraceTest, Overwrite)
+{
+	/* Only the most recent TRACE_BUFFER_RECORDS are kept. */
+	
+	for(uint32_t i = 0; i < (TRACE_BUFFER_RECORDS + 100); ++i)
+	{
+		TRACE_POINT(TE_RECV_DECODE, 1, DPLITE_MSGID_MESSAGE, i, 0);
+	}
+	
+	std::vector<TraceRecord> records = trace_snapshot();
+	ASSERT_EQ(records.size(), TRACE_BUFFER_RECORDS);
+	
+	EXPECT_EQ(records.front().size, 100U);
+	EXPECT_EQ(records.back().size,  (uint32_t)(TRACE_BUFFER_RECORDS + 99));
+}
+
+TEST_F(TraceTest, Threads)
+{
+	/* Records from threads which have since exited are kept and merged in time order. */
+	
+	std::vector<std::thread> threads;
+	
+	for(uint32_t t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([t]()
+		{
+			for(uint32_t i = 0; i < 1000; ++i)
+			{
+				TRACE_POINT(TE_SEND_ENQUEUE, t, DPLITE_MSGID_MESSAGE, i, 0);
+			}
+		});
+	}
+	
+	for(auto t = threads.begin(); t != threads.end(); ++t)
+	{
+		t->join();
+	}
+	
+	std::vector<TraceRecord> records = trace_snapshot();
+	ASSERT_EQ(records.size(), 4000U);
+	
+	uint32_t next[4] = { 0, 0, 0, 0 };
+	
+	for(size_t i = 0; i < records.size(); ++i)
+	{
+		if(i > 0)
+		{
+			EXPECT_LE(records[i - 1].time, records[i].time);
+		}
+		
+		ASSERT_LT(records[i].peer, 4U);
+		EXPECT_EQ(records[i].size, next[records[i].peer]++);
+	}
+}
+
+TEST_F(TraceTest, ChromeJSON)
+{
+	TRACE_POINT(TE_RECV_DECODE,   1, DPLITE_MSGID_MESSAGE, 64, 0);
+	TRACE_POINT(TE_HANDLER_BEGIN, 2, DPN_MSGID_RECEIVE,    48, 0x10);
+	TRACE_POINT(TE_HANDLER_BEGIN, 2, DPN_MSGID_SEND_COMPLETE, 0, 0x20);
+	TRACE_POINT(TE_HANDLER_END,   2, DPN_MSGID_SEND_COMPLETE, 0, 0x20);
+	TRACE_POINT(TE_HANDLER_END,   2, DPN_MSGID_RECEIVE,    48, 0x10);
+	TRACE_POINT(TE_HANDLER_BEGIN, 0, DPN_MSGID_CREATE_PLAYER, 0, 0);
+	
+	std::string json = trace_to_chrome_json(trace_snapshot());
+	
+	EXPECT_EQ(json.find("{\"displayTimeUnit\":\"ms\",\"traceEvents\":["), 0U);
+	
+	EXPECT_EQ(count(json, "\"name\":\"decode MESSAGE\""), 1U);
+	EXPECT_EQ(count(json, "\"ph\":\"i\",\"s\":\"t\""), 1U);
+	
+	/* Nested handlers each become a complete event. */
+	EXPECT_EQ(count(json, "\"name\":\"RECEIVE\",\"cat\":\"handler\",\"ph\":\"X\""), 1U);
+	EXPECT_EQ(count(json, "\"name\":\"SEND_COMPLETE\",\"cat\":\"handler\",\"ph\":\"X\""), 1U);
+	EXPECT_EQ(count(json, "\"size\":48,\"handle\":\"0x00000010\""), 1U);
+	
+	/* Handler which hasn't returned yet. */
+	EXPECT_EQ(count(json, "\"name\":\"CREATE_PLAYER\",\"cat\":\"handler\",\"ph\":\"B\""), 1U);
+	
+	EXPECT_EQ(count(json, "\"dur\":"), 2U);
+	EXPECT_NE(json.find("\n]}\n"), std::string::npos);
+}
+
+TEST_F(TraceTest, ChromeJSONOrphanEnd)
+{
+	/* The begin record was overwritten or cleared, so the end can't be matched. */
+	
+	TRACE_POINT(TE_HANDLER_END, 2, DPN_MSGID_RECEIVE, 48, 0x10);
+	
+	std::string json = trace_to_chrome_json(trace_snapshot());
+	EXPECT_EQ(json.find("\"name\""), std::string::npos);
+}
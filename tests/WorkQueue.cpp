@@ -0,0 +1,150 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../src/WorkQueue.hpp"
+
+TEST(WorkQueue, Empty)
+{
+	WorkQueue wq(16);
+	
+	std::function<void()> work;
+	EXPECT_FALSE(wq.pop(work));
+}
+
+TEST(WorkQueue, FIFO)
+{
+	WorkQueue wq(16);
+	
+	std::vector<int> order;
+	
+	for(int i = 0; i < 10; ++i)
+	{
+		wq.push([i, &order]() { order.push_back(i); });
+	}
+	
+	std::function<void()> work;
+	while(wq.pop(work))
+	{
+		work();
+	}
+	
+	ASSERT_EQ(order.size(), 10U);
+	
+	for(int i = 0; i < 10; ++i)
+	{
+		EXPECT_EQ(order[i], i);
+	}
+}
+
+TEST(WorkQueue, Overflow)
+{
+	/* Push far more than the ring can hold, items must still come out in order. */
+	
+	WorkQueue wq(8);
+	
+	std::vector<int> order;
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		wq.push([i, &order]() { order.push_back(i); });
+		
+		if((i % 30) == 29)
+		{
+			/* Pop a few while some are in the overflow queue. */
+			std::function<void()> work;
+			
+			for(int j = 0; j < 5 && wq.pop(work); ++j)
+			{
+				work();
+			}
+		}
+	}
+	
+	std::function<void()> work;
+	while(wq.pop(work))
+	{
+		work();
+	}
+	
+	ASSERT_EQ(order.size(), 100U);
+	
+	for(int i = 0; i < 100; ++i)
+	{
+		EXPECT_EQ(order[i], i);
+	}
+}
+
+TEST(WorkQueue, MultiProducerMultiConsumer)
+{
+	const int PRODUCERS = 4, CONSUMERS = 4, ITEMS_PER_PRODUCER = 100000;
+	
+	WorkQueue wq(64);
+	
+	std::vector< std::atomic<int> > counters(PRODUCERS);
+	std::atomic<int> remain(PRODUCERS * ITEMS_PER_PRODUCER);
+	
+	std::vector<std::thread> threads;
+	
+	for(int p = 0; p < PRODUCERS; ++p)
+	{
+		threads.emplace_back([p, &wq, &counters]()
+		{
+			for(int i = 0; i < ITEMS_PER_PRODUCER; ++i)
+			{
+				wq.push([p, &counters]() { ++counters[p]; });
+			}
+		});
+	}
+	
+	for(int c = 0; c < CONSUMERS; ++c)
+	{
+		threads.emplace_back([&wq, &remain]()
+		{
+			std::function<void()> work;
+			
+			while(remain > 0)
+			{
+				if(wq.pop(work))
+				{
+					work();
+					--remain;
+				}
+			}
+		});
+	}
+	
+	for(auto t = threads.begin(); t != threads.end(); ++t)
+	{
+		t->join();
+	}
+	
+	for(int p = 0; p < PRODUCERS; ++p)
+	{
+		EXPECT_EQ(counters[p], ITEMS_PER_PRODUCER);
+	}
+	
+	std::function<void()> work;
+	EXPECT_FALSE(wq.pop(work));
+}
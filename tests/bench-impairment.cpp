@@ -0,0 +1,323 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for DirectPlay8Peer over impaired network links.
+ *
+ * For each scenario, connects two peers over a LoopbackTransport with each end's traffic
+ * passed through an ImpairedTransport, then sends MESSAGES messages from one to the other
+ * at a steady rate, first guaranteed and then non-guaranteed. Prints the one-way latency
+ * distribution of the messages which arrived and the throughput achieved.
+ *
+ * Session traffic is carried over TCP, so "lost" data is held back for the retransmission
+ * timeout rather than dropped, and non-guaranteed messages are only dropped if the send
+ * queue backs up.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <dplay8.h>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+#include <mmsystem.h>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/ImpairedTransport.hpp"
+#include "../src/LoopbackTransport.hpp"
+#include "../src/SendQueue.hpp"
+
+#define MESSAGES         1000
+#define MESSAGE_SIZE     256
+#define SEND_INTERVAL_US 2000
+#define PORT             42900
+
+/* Give up waiting for more messages after this long without one arriving. */
+#define IDLE_TIMEOUT_MS 3000
+
+static const GUID APP_GUID = { 0x9e4b1f07, 0x63d2, 0x4a8c, { 0x91, 0x5e, 0x2b, 0x7f, 0xc0, 0x48, 0xd6, 0x13 } };
+
+static const struct {
+	const char *name;
+	unsigned long long delay_us;   /* One way */
+	unsigned long long jitter_us;
+	double loss;
+	double reorder;
+	DWORD rate;
+} SCENARIOS[] = {
+	{ "Loopback",  0,     0,     0.0,   0.0,   0 },
+	{ "LAN",       500,   200,   0.0,   0.0,   0 },
+	{ "Broadband", 25000, 2000,  0.005, 0.0,   0 },
+	{ "Typical",   50000, 5000,  0.02,  0.005, 0 },
+	{ "Congested", 75000, 20000, 0.05,  0.01,  64 * 1024 },
+};
+
+static const struct {
+	DWORD flags;
+	const char *name;
+} SEND_MODES[] = {
+	{ DPNSEND_GUARANTEED, "Guaranteed" },
+	{ 0,                  "Non-guaranteed" },
+};
+
+struct Receiver
+{
+	std::mutex lock;
+	
+	std::vector<unsigned long long> latencies;
+	unsigned long long last_recv;
+	size_t bytes;
+	
+	Receiver():
+		last_recv(0), bytes(0) {}
+};
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+static DirectPlay8Peer *make_peer(Receiver *receiver, Transport *transport);
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port);
+
+int main()
+{
+	WSADATA wd;
+	WSAStartup(MAKEWORD(2, 2), &wd);
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	/* The default timer resolution would swamp the delays on the faster links. */
+	timeBeginPeriod(1);
+	
+	printf("%d x %d byte messages, one every %d us\n\n", MESSAGES, MESSAGE_SIZE, SEND_INTERVAL_US);
+	printf("Scenario  | Send           | Delivered | Median (ms) | 90th (ms) | 99th (ms) | Max (ms) | KB/s\n");
+	printf("----------+----------------+-----------+-------------+-----------+-----------+----------+--------\n");
+	
+	for(size_t s = 0; s < (sizeof(SCENARIOS) / sizeof(*SCENARIOS)); ++s)
+	{
+		for(size_t m = 0; m < (sizeof(SEND_MODES) / sizeof(*SEND_MODES)); ++m)
+		{
+			DWORD port = PORT + (s * 2) + m;
+			
+			ImpairedTransport::Impairment imp;
+			imp.delay_us   = SCENARIOS[s].delay_us;
+			imp.jitter_us  = SCENARIOS[s].jitter_us;
+			imp.loss       = SCENARIOS[s].loss;
+			imp.reorder    = SCENARIOS[s].reorder;
+			imp.reorder_us = SCENARIOS[s].jitter_us * 2;
+			imp.rate       = SCENARIOS[s].rate;
+			
+			LoopbackTransport net;
+			
+			ImpairedTransport host_link(&net, 1);
+			ImpairedTransport client_link(&net, 2);
+			
+			host_link.set_impairment(imp);
+			client_link.set_impairment(imp);
+			
+			Receiver host, client;
+			
+			DirectPlay8Peer *host_peer   = make_peer(&host, &host_link);
+			DirectPlay8Peer *client_peer = make_peer(&client, &client_link);
+			
+			DPN_APPLICATION_DESC app_desc;
+			memset(&app_desc, 0, sizeof(app_desc));
+			
+			app_desc.dwSize = sizeof(app_desc);
+			app_desc.dwFlags = DPNSESSION_NODPNSVR;
+			app_desc.guidApplication = APP_GUID;
+			app_desc.pwszSessionName = (wchar_t*)(L"Impairment benchmark");
+			
+			DirectPlay8Address *host_address = make_address(NULL, port);
+			IDirectPlay8Address *host_addresses[] = { host_address };
+			
+			res = host_peer->Host(&app_desc, host_addresses, 1, NULL, NULL, NULL, 0);
+			if(res != S_OK)
+			{
+				fprintf(stderr, "DirectPlay8Peer::Host failed with HRESULT %08x\n", (unsigned)(res));
+				return 1;
+			}
+			
+			host_address->Release();
+			
+			DirectPlay8Address *connect_address = make_address(L"127.0.0.1", port);
+			
+			res = client_peer->Connect(
+				&app_desc,         /* pdnAppDesc */
+				connect_address,   /* pHostAddr */
+				NULL,              /* pDeviceInfo */
+				NULL,              /* pdnSecurity */
+				NULL,              /* pdnCredentials */
+				NULL,              /* pvUserConnectData */
+				0,                 /* dwUserConnectDataSize */
+				NULL,              /* pvPlayerContext */
+				NULL,              /* pvAsyncContext */
+				NULL,              /* phAsyncHandle */
+				DPNCONNECT_SYNC);  /* dwFlags */
+			
+			if(res != S_OK)
+			{
+				fprintf(stderr, "DirectPlay8Peer::Connect failed with HRESULT %08x\n", (unsigned)(res));
+				return 1;
+			}
+			
+			connect_address->Release();
+			
+			unsigned char payload[MESSAGE_SIZE];
+			memset(payload, 0, sizeof(payload));
+			
+			DPN_BUFFER_DESC bd = { sizeof(payload), payload };
+			
+			unsigned long long first_send = SendQueue::now();
+			unsigned long long next_send  = first_send;
+			
+			for(int i = 0; i < MESSAGES; ++i)
+			{
+				while(SendQueue::now() < next_send) {}
+				next_send += SEND_INTERVAL_US;
+				
+				unsigned long long sent_at = SendQueue::now();
+				memcpy(payload, &sent_at, sizeof(sent_at));
+				
+				DPNHANDLE send_handle;
+				res = client_peer->SendTo(DPNID_ALL_PLAYERS_GROUP, &bd, 1, 0, NULL, &send_handle, SEND_MODES[m].flags | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE);
+				
+				if(res != DPNSUCCESS_PENDING && res != S_OK)
+				{
+					fprintf(stderr, "DirectPlay8Peer::SendTo failed with HRESULT %08x\n", (unsigned)(res));
+					return 1;
+				}
+			}
+			unsigned long long last_send = SendQueue::now();
+			
+			
+			/* Wait for the stragglers, or until nothing has turned up for a while. */
+			for(;;)
+			{
+				Sleep(10);
+				
+				std::unique_lock<std::mutex> l(host.lock);
+				
+				if(host.latencies.size() >= MESSAGES
+					|| (SendQueue::now() - std::max(host.last_recv, last_send)) >= (IDLE_TIMEOUT_MS * 1000ULL))
+				{
+					break;
+				}
+			}
+			
+			client_peer->Close(DPNCLOSE_IMMEDIATE);
+			host_peer->Close(DPNCLOSE_IMMEDIATE);
+			
+			std::vector<unsigned long long> latencies = host.latencies;
+			unsigned long long elapsed = host.last_recv - first_send;
+			size_t bytes = host.bytes;
+			
+			client_peer->Release();
+			host_peer->Release();
+			
+			if(latencies.empty())
+			{
+				printf("%-9s | %-14s | %9u |           - |         - |         - |        - |      -\n",
+					SCENARIOS[s].name, SEND_MODES[m].name, 0U);
+				
+				continue;
+			}
+			
+			std::sort(latencies.begin(), latencies.end());
+			
+			printf("%-9s | %-14s | %9u | %11.3f | %9.3f | %9.3f | %8.3f | %6.1f\n",
+				SCENARIOS[s].name,
+				SEND_MODES[m].name,
+				(unsigned)(latencies.size()),
+				(double)(latencies[latencies.size() / 2]) / 1000.0,
+				(double)(latencies[(latencies.size() * 90) / 100]) / 1000.0,
+				(double)(latencies[(latencies.size() * 99) / 100]) / 1000.0,
+				(double)(latencies.back()) / 1000.0,
+				((double)(bytes) / 1024.0) / ((double)(elapsed) / 1000000.0));
+		}
+	}
+	
+	timeEndPeriod(1);
+	
+	CoUninitialize();
+	WSACleanup();
+	
+	return 0;
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	Receiver *receiver = (Receiver*)(pvUserContext);
+	
+	if(dwMessageType == DPN_MSGID_RECEIVE)
+	{
+		DPNMSG_RECEIVE *dr = (DPNMSG_RECEIVE*)(pMessage);
+		
+		if(dr->dwReceiveDataSize >= sizeof(unsigned long long))
+		{
+			unsigned long long sent_at;
+			memcpy(&sent_at, dr->pReceiveData, sizeof(sent_at));
+			
+			unsigned long long now = SendQueue::now();
+			
+			std::unique_lock<std::mutex> l(receiver->lock);
+			
+			receiver->latencies.push_back(now - sent_at);
+			receiver->last_recv = now;
+			receiver->bytes    += dr->dwReceiveDataSize;
+		}
+	}
+	
+	return DPN_OK;
+}
+
+static DirectPlay8Peer *make_peer(Receiver *receiver, Transport *transport)
+{
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL, DirectPlay8Peer::ROLE_PEER, transport);
+	
+	HRESULT res = peer->Initialize(receiver, &callback, 0);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "DirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	return peer;
+}
+
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	DirectPlay8Address *address = new DirectPlay8Address(NULL);
+	
+	address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	if(hostname != NULL)
+	{
+		address->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+	}
+	
+	address->AddComponent(DPNA_KEY_PORT, &port, sizeof(port), DPNA_DATATYPE_DWORD);
+	
+	return address;
+}
@@ -0,0 +1,211 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for joining a peer-to-peer session.
+ *
+ * Hosts a session on loopback and joins PLAYERS - 1 peers to it one at a time, printing how
+ * long each Connect() call took to complete. The Nth player has to connect to and complete
+ * a handshake with all N - 1 players already in the session, so the later joins show how
+ * well those are overlapped.
+ *
+ * An optional argument gives a delay (in milliseconds) for the application to spend in each
+ * DPN_MSGID_CREATE_PLAYER callback, to see how slow applications affect join times.
+ *
+ * Per-phase timings for each join are written to the DirectPlay Lite log.
+*/
+
+#include <winsock2.h>
+#include <dplay8.h>
+#include <objbase.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+
+#define PLAYERS 32
+#define PORT    42896
+
+static const GUID APP_GUID = { 0x3dcd9e43, 0x5c8b, 0x4b4a, { 0x97, 0x0e, 0x21, 0x6b, 0x0f, 0x43, 0x5e, 0xa1 } };
+
+static int64_t pc_freq;
+static int64_t now_us();
+
+static DWORD callback_delay_ms = 0;
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+static IDirectPlay8Address *make_address(const wchar_t *hostname, DWORD port);
+
+int main(int argc, char **argv)
+{
+	{
+		LARGE_INTEGER li;
+		QueryPerformanceFrequency(&li);
+		pc_freq = li.QuadPart;
+	}
+	
+	if(argc > 1)
+	{
+		callback_delay_ms = atoi(argv[1]);
+	}
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	std::vector<IDirectPlay8Peer*> instances;
+	
+	for(int i = 0; i < PLAYERS; ++i)
+	{
+		IDirectPlay8Peer *instance;
+		
+		res = CoCreateInstance(CLSID_DirectPlay8Peer, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Peer, (void**)(&instance));
+		if(res != S_OK)
+		{
+			fprintf(stderr, "Failed to construct DirectPlay8Peer instance (HRESULT %08x)\n", (unsigned)(res));
+			return 1;
+		}
+		
+		res = instance->Initialize(NULL, &callback, 0);
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		instances.push_back(instance);
+	}
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize = sizeof(app_desc);
+	app_desc.dwFlags = DPNSESSION_NODPNSVR;
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"IDirectPlay8Peer join benchmark");
+	
+	{
+		IDirectPlay8Address *host_address = make_address(NULL, PORT);
+		
+		res = instances[0]->Host(&app_desc, &host_address, 1, NULL, NULL, NULL, 0);
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Host failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		host_address->Release();
+	}
+	
+	printf("Joining %d players, %u ms spent in each DPN_MSGID_CREATE_PLAYER\n\n", PLAYERS, (unsigned)(callback_delay_ms));
+	printf("Player | Time to connected (ms)\n");
+	printf("-------+-----------------------\n");
+	
+	IDirectPlay8Address *connect_address = make_address(L"127.0.0.1", PORT);
+	
+	int64_t total_us = 0;
+	
+	for(int i = 1; i < PLAYERS; ++i)
+	{
+		int64_t start = now_us();
+		
+		res = instances[i]->Connect(
+			&app_desc,         /* pdnAppDesc */
+			connect_address,   /* pHostAddr */
+			NULL,              /* pDeviceInfo */
+			NULL,              /* pdnSecurity */
+			NULL,              /* pdnCredentials */
+			NULL,              /* pvUserConnectData */
+			0,                 /* dwUserConnectDataSize */
+			NULL,              /* pvPlayerContext */
+			NULL,              /* pvAsyncContext */
+			NULL,              /* phAsyncHandle */
+			DPNCONNECT_SYNC);  /* dwFlags */
+		
+		int64_t elapsed = now_us() - start;
+		
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Connect failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		total_us += elapsed;
+		
+		printf("%6d | %22.2f\n", i + 1, (double)(elapsed) / 1000.0);
+	}
+	
+	printf("\nMean time to connected: %.2f ms\n", ((double)(total_us) / (PLAYERS - 1)) / 1000.0);
+	
+	connect_address->Release();
+	
+	for(int i = PLAYERS - 1; i >= 0; --i)
+	{
+		instances[i]->Close(DPNCLOSE_IMMEDIATE);
+		instances[i]->Release();
+	}
+	
+	CoUninitialize();
+	
+	return 0;
+}
+
+static int64_t now_us()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	
+	return ((li.QuadPart / pc_freq) * 1000000) + (((li.QuadPart % pc_freq) * 1000000) / pc_freq);
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	if(dwMessageType == DPN_MSGID_CREATE_PLAYER && callback_delay_ms > 0)
+	{
+		Sleep(callback_delay_ms);
+	}
+	
+	return DPN_OK;
+}
+
+static IDirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	IDirectPlay8Address *address;
+	
+	HRESULT res = CoCreateInstance(CLSID_DirectPlay8Address, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Address, (void**)(&address));
+	if(res != S_OK)
+	{
+		fprintf(stderr, "Failed to construct DirectPlay8Address instance (HRESULT %08x)\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	if(hostname != NULL)
+	{
+		address->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+	}
+	
+	address->AddComponent(DPNA_KEY_PORT, &port, sizeof(port), DPNA_DATATYPE_DWORD);
+	
+	return address;
+}
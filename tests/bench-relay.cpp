@@ -0,0 +1,454 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for DirectPlay8Peer sessions carried over the relay server.
+ *
+ * Runs a RelayServer on loopback and, for each of PEER_COUNTS, hosts a session and joins
+ * that many peers to it. Every peer other than the host refuses direct connections from
+ * the others as if it was behind a NAT, so they can only reach each other through the
+ * relay, while the host is reached directly. Then measures:
+ *
+ * Latency - the peers take it in turns to SendTo() a small message to everybody at a gentle
+ * pace, and each receiver records how long it took to arrive. Everything is in one process
+ * so the send and receive timestamps come from the same clock.
+ *
+ * Throughput - every peer other than the host sends messages to everybody with DPNSEND_SYNC
+ * as fast as they complete for THROUGHPUT_DURATION_MS, then we count how many were
+ * delivered, and how many DPLITE_MSGID_RELAY_SEND messages the relay received for each
+ * one sent. Without send_multi() that would be one for each relayed recipient.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <atomic>
+#include <dplay8.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+#include <mmsystem.h>
+
+#include "../relay/RelayServer.hpp"
+#include "../relay/RelaySocket.hpp"
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/RelayTransport.hpp"
+#include "../src/SendQueue.hpp"
+
+static const int PEER_COUNTS[] = { 4, 8, 16 };
+
+#define LATENCY_MESSAGES        200  /* Total messages sent to everybody in the latency phase. */
+#define LATENCY_INTERVAL_US     2000
+#define LATENCY_PAYLOAD_SIZE    64
+#define THROUGHPUT_DURATION_MS  2000
+#define THROUGHPUT_PAYLOAD_SIZE 256
+#define PORT                    42905
+
+#define PAYLOAD_LATENCY    1
+#define PAYLOAD_THROUGHPUT 2
+
+static const GUID APP_GUID = { 0x5b27c4e1, 0x0d9a, 0x4f63, { 0x8e, 0x12, 0x6c, 0xa3, 0x47, 0xf0, 0x95, 0x2d } };
+
+struct Payload
+{
+	uint32_t kind;
+	unsigned long long sent_at;  /* SendQueue::now() */
+};
+
+struct Receiver
+{
+	std::mutex lock;
+	
+	std::vector<unsigned long long> latencies;
+	uint64_t throughput_messages;
+	uint64_t throughput_bytes;
+	
+	Receiver():
+		throughput_messages(0), throughput_bytes(0) {}
+};
+
+/* Refuses stream connections to any port not in the allowed set, as if every other peer
+ * was behind a NAT. The refusal completes asynchronously like a real one would.
+*/
+class NATTransport: public SocketTransport
+{
+	private:
+		std::set<uint16_t> allowed_ports;
+		
+		std::mutex lock;
+		std::map<int, HANDLE> events;
+		std::set<int> refused;
+		
+	public:
+		NATTransport(const std::set<uint16_t> &allowed_ports):
+			allowed_ports(allowed_ports) {}
+		
+		virtual int event_select(int sock, HANDLE event, long events) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			this->events[sock] = event;
+			l.unlock();
+			
+			return SocketTransport::event_select(sock, event, events);
+		}
+		
+		virtual int connect(int sock, const struct sockaddr_in *addr) override
+		{
+			if(allowed_ports.find(ntohs(addr->sin_port)) != allowed_ports.end())
+			{
+				return SocketTransport::connect(sock, addr);
+			}
+			
+			std::unique_lock<std::mutex> l(lock);
+			
+			refused.insert(sock);
+			SetEvent(events[sock]);
+			
+			WSASetLastError(WSAEWOULDBLOCK);
+			return -1;
+		}
+		
+		virtual int get_socket_error(int sock, int *error) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			
+			if(refused.find(sock) != refused.end())
+			{
+				*error = WSAECONNREFUSED;
+				return 0;
+			}
+			
+			l.unlock();
+			
+			return SocketTransport::get_socket_error(sock, error);
+		}
+		
+		virtual void close(int sock) override
+		{
+			std::unique_lock<std::mutex> l(lock);
+			
+			refused.erase(sock);
+			events.erase(sock);
+			
+			l.unlock();
+			
+			SocketTransport::close(sock);
+		}
+};
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+static DirectPlay8Peer *make_peer(Receiver *receiver, Transport *transport);
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port);
+static HRESULT send_to_all(DirectPlay8Peer *peer, uint32_t kind, size_t payload_size, DWORD flags);
+
+int main()
+{
+	if(!relay_sockets_init())
+	{
+		fprintf(stderr, "Cannot initialise sockets\n");
+		return 1;
+	}
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	/* The default timer resolution would swamp the send interval. */
+	timeBeginPeriod(1);
+	
+	RelayServer server(htonl(INADDR_LOOPBACK), 0);
+	std::thread server_thread([&server]() { server.run(); });
+	
+	printf("Peers | Median us  99th us   Max us |  Delivered/s     MB/s | Relay uploads per message\n");
+	printf("------+-----------------------------+-----------------------+--------------------------\n");
+	
+	for(size_t pc = 0; pc < (sizeof(PEER_COUNTS) / sizeof(*PEER_COUNTS)); ++pc)
+	{
+		int n_peers = PEER_COUNTS[pc];
+		DWORD port  = PORT + pc;
+		
+		NATTransport nat({ (uint16_t)(port), server.get_port() });
+		
+		std::vector<RelayTransport*> transports;
+		std::vector<Receiver*> receivers;
+		std::vector<DirectPlay8Peer*> peers;
+		
+		for(int i = 0; i < n_peers; ++i)
+		{
+			/* The host is reachable directly, everyone else only through the relay. */
+			Transport *inner = (i == 0 ? (Transport*)(SocketTransport::get()) : (Transport*)(&nat));
+			
+			transports.push_back(new RelayTransport(inner, htonl(INADDR_LOOPBACK), server.get_port()));
+			receivers.push_back(new Receiver());
+			peers.push_back(make_peer(receivers.back(), transports.back()));
+		}
+		
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize = sizeof(app_desc);
+		app_desc.dwFlags = DPNSESSION_NODPNSVR;
+		app_desc.guidApplication = APP_GUID;
+		app_desc.pwszSessionName = (wchar_t*)(L"Relay benchmark");
+		
+		DirectPlay8Address *host_address = make_address(NULL, port);
+		IDirectPlay8Address *host_addresses[] = { host_address };
+		
+		res = peers[0]->Host(&app_desc, host_addresses, 1, NULL, NULL, NULL, 0);
+		if(res != S_OK)
+		{
+			fprintf(stderr, "DirectPlay8Peer::Host failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		host_address->Release();
+		
+		DirectPlay8Address *connect_address = make_address(L"127.0.0.1", port);
+		
+		for(int i = 1; i < n_peers; ++i)
+		{
+			res = peers[i]->Connect(
+				&app_desc,         /* pdnAppDesc */
+				connect_address,   /* pHostAddr */
+				NULL,              /* pDeviceInfo */
+				NULL,              /* pdnSecurity */
+				NULL,              /* pdnCredentials */
+				NULL,              /* pvUserConnectData */
+				0,                 /* dwUserConnectDataSize */
+				NULL,              /* pvPlayerContext */
+				NULL,              /* pvAsyncContext */
+				NULL,              /* phAsyncHandle */
+				DPNCONNECT_SYNC);  /* dwFlags */
+			
+			if(res != S_OK)
+			{
+				fprintf(stderr, "DirectPlay8Peer::Connect failed with HRESULT %08x\n", (unsigned)(res));
+				return 1;
+			}
+		}
+		
+		connect_address->Release();
+		
+		/* Latency */
+		
+		for(int i = 0; i < LATENCY_MESSAGES; ++i)
+		{
+			/* Skip the host, which doesn't go through the relay at all. */
+			DirectPlay8Peer *sender = peers[1 + (i % (n_peers - 1))];
+			
+			res = send_to_all(sender, PAYLOAD_LATENCY, LATENCY_PAYLOAD_SIZE, DPNSEND_NOCOMPLETE);
+			if(res != DPNSUCCESS_PENDING && res != S_OK)
+			{
+				fprintf(stderr, "DirectPlay8Peer::SendTo failed with HRESULT %08x\n", (unsigned)(res));
+				return 1;
+			}
+			
+			Sleep(LATENCY_INTERVAL_US / 1000);
+		}
+		
+		Sleep(500);
+		
+		/* Throughput */
+		
+		uint64_t packets_in = server.get_stats().packets_in;
+		
+		std::atomic<bool> sending(true);
+		std::atomic<uint64_t> sent(0);
+		std::vector<std::thread> send_threads;
+		
+		for(int i = 1; i < n_peers; ++i)
+		{
+			DirectPlay8Peer *sender = peers[i];
+			
+			send_threads.emplace_back([sender, &sending, &sent]()
+			{
+				while(sending)
+				{
+					if(send_to_all(sender, PAYLOAD_THROUGHPUT, THROUGHPUT_PAYLOAD_SIZE, DPNSEND_SYNC) == S_OK)
+					{
+						++sent;
+					}
+				}
+			});
+		}
+		
+		Sleep(THROUGHPUT_DURATION_MS);
+		sending = false;
+		
+		for(auto t = send_threads.begin(); t != send_threads.end(); ++t)
+		{
+			t->join();
+		}
+		
+		/* DPNSEND_SYNC sends complete once they are written out, so let them arrive. */
+		Sleep(500);
+		
+		uint64_t uploads = server.get_stats().packets_in - packets_in;
+		
+		for(auto p = peers.begin(); p != peers.end(); ++p)
+		{
+			(*p)->Close(DPNCLOSE_IMMEDIATE);
+			(*p)->Release();
+		}
+		
+		for(auto t = transports.begin(); t != transports.end(); ++t)
+		{
+			delete *t;
+		}
+		
+		std::vector<unsigned long long> latencies;
+		uint64_t throughput_messages = 0;
+		uint64_t throughput_bytes    = 0;
+		
+		for(auto r = receivers.begin(); r != receivers.end(); ++r)
+		{
+			latencies.insert(latencies.end(), (*r)->latencies.begin(), (*r)->latencies.end());
+			throughput_messages += (*r)->throughput_messages;
+			throughput_bytes    += (*r)->throughput_bytes;
+			
+			delete *r;
+		}
+		
+		std::sort(latencies.begin(), latencies.end());
+		
+		if(latencies.empty() || sent == 0)
+		{
+			fprintf(stderr, "No messages delivered with %d peers\n", n_peers);
+			return 1;
+		}
+		
+		double seconds = THROUGHPUT_DURATION_MS / 1000.0;
+		
+		printf("%5d | %9llu%9llu%9llu | %12.0f%9.2f | %.2f (%d without send_multi)\n",
+			n_peers,
+			latencies[latencies.size() / 2],
+			latencies[(latencies.size() * 99) / 100],
+			latencies.back(),
+			(double)(throughput_messages) / seconds,
+			((double)(throughput_bytes) / seconds) / (1024.0 * 1024.0),
+			(double)(uploads) / (double)(sent),
+			n_peers - 2);
+	}
+	
+	RelayServer::Stats stats = server.get_stats();
+	
+	printf("\nRelay forwarded %llu of %llu packets sent (%llu bytes in, %llu bytes out)\n",
+		(unsigned long long)(stats.packets_out),
+		(unsigned long long)(stats.packets_in),
+		(unsigned long long)(stats.bytes_in),
+		(unsigned long long)(stats.bytes_out));
+	
+	server.stop();
+	server_thread.join();
+	
+	timeEndPeriod(1);
+	
+	CoUninitialize();
+	WSACleanup();
+	
+	return 0;
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	Receiver *receiver = (Receiver*)(pvUserContext);
+	
+	if(dwMessageType == DPN_MSGID_RECEIVE)
+	{
+		DPNMSG_RECEIVE *dr = (DPNMSG_RECEIVE*)(pMessage);
+		
+		if(dr->dwReceiveDataSize >= sizeof(Payload))
+		{
+			Payload p;
+			memcpy(&p, dr->pReceiveData, sizeof(p));
+			
+			unsigned long long now = SendQueue::now();
+			
+			std::unique_lock<std::mutex> l(receiver->lock);
+			
+			if(p.kind == PAYLOAD_LATENCY)
+			{
+				receiver->latencies.push_back(now - p.sent_at);
+			}
+			else if(p.kind == PAYLOAD_THROUGHPUT)
+			{
+				++(receiver->throughput_messages);
+				receiver->throughput_bytes += dr->dwReceiveDataSize;
+			}
+		}
+	}
+	
+	return DPN_OK;
+}
+
+static DirectPlay8Peer *make_peer(Receiver *receiver, Transport *transport)
+{
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL, DirectPlay8Peer::ROLE_PEER, transport);
+	
+	HRESULT res = peer->Initialize(receiver, &callback, 0);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "DirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	return peer;
+}
+
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	DirectPlay8Address *address = new DirectPlay8Address(NULL);
+	
+	address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	if(hostname != NULL)
+	{
+		address->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+	}
+	
+	address->AddComponent(DPNA_KEY_PORT, &port, sizeof(port), DPNA_DATATYPE_DWORD);
+	
+	return address;
+}
+
+/* SendTo() DPNID_ALL_PLAYERS_GROUP with a Payload, padded out to payload_size. */
+static HRESULT send_to_all(DirectPlay8Peer *peer, uint32_t kind, size_t payload_size, DWORD flags)
+{
+	std::vector<unsigned char> payload(std::max(payload_size, sizeof(Payload)));
+	
+	Payload p;
+	p.kind    = kind;
+	p.sent_at = SendQueue::now();
+	
+	memcpy(payload.data(), &p, sizeof(p));
+	
+	DPN_BUFFER_DESC bd = { (DWORD)(payload.size()), payload.data() };
+	DPNHANDLE handle;
+	
+	return peer->SendTo(DPNID_ALL_PLAYERS_GROUP, &bd, 1, 0, NULL, &handle,
+		(flags | DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK));
+}
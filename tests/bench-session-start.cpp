@@ -0,0 +1,164 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for starting sessions without a port specified.
+ *
+ * Hosts SESSIONS sessions in one process, each one left running while the next is started
+ * so every Host() call has to find a port which isn't already in use by the earlier ones,
+ * then prints the distribution of how long the Host() calls took.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <dplay8.h>
+#include <objbase.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+
+#define SESSIONS 200
+
+static const GUID APP_GUID = { 0x7f1c2a4e, 0x0b6d, 0x4e37, { 0x8a, 0x52, 0xc4, 0x19, 0x6e, 0x2d, 0x93, 0x0b } };
+
+static int64_t pc_freq;
+static int64_t now_us();
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+
+int main()
+{
+	{
+		LARGE_INTEGER li;
+		QueryPerformanceFrequency(&li);
+		pc_freq = li.QuadPart;
+	}
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	IDirectPlay8Address *host_address;
+	
+	res = CoCreateInstance(CLSID_DirectPlay8Address, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Address, (void**)(&host_address));
+	if(res != S_OK)
+	{
+		fprintf(stderr, "Failed to construct DirectPlay8Address instance (HRESULT %08x)\n", (unsigned)(res));
+		return 1;
+	}
+	
+	host_address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize = sizeof(app_desc);
+	app_desc.dwFlags = DPNSESSION_NODPNSVR;
+	app_desc.guidApplication = APP_GUID;
+	app_desc.pwszSessionName = (wchar_t*)(L"IDirectPlay8Peer startup benchmark");
+	
+	std::vector<IDirectPlay8Peer*> instances;
+	std::vector<int64_t> host_times;
+	
+	int64_t total_start = now_us();
+	
+	for(int i = 0; i < SESSIONS; ++i)
+	{
+		IDirectPlay8Peer *instance;
+		
+		res = CoCreateInstance(CLSID_DirectPlay8Peer, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Peer, (void**)(&instance));
+		if(res != S_OK)
+		{
+			fprintf(stderr, "Failed to construct DirectPlay8Peer instance (HRESULT %08x)\n", (unsigned)(res));
+			return 1;
+		}
+		
+		instances.push_back(instance);
+		
+		res = instance->Initialize(NULL, &callback, 0);
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		int64_t start = now_us();
+		
+		res = instance->Host(&app_desc, &host_address, 1, NULL, NULL, NULL, 0);
+		
+		int64_t elapsed = now_us() - start;
+		
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Host failed with HRESULT %08x on session %d\n", (unsigned)(res), i + 1);
+			return 1;
+		}
+		
+		host_times.push_back(elapsed);
+	}
+	
+	int64_t total_elapsed = now_us() - total_start;
+	
+	std::sort(host_times.begin(), host_times.end());
+	
+	int64_t host_total = 0;
+	for(auto t = host_times.begin(); t != host_times.end(); ++t)
+	{
+		host_total += *t;
+	}
+	
+	printf("Started %d sessions in %.2f ms\n\n", SESSIONS, (double)(total_elapsed) / 1000.0);
+	
+	printf("Host() time (ms)\n");
+	printf("----------------\n");
+	printf("Mean:   %8.3f\n", ((double)(host_total) / SESSIONS) / 1000.0);
+	printf("Min:    %8.3f\n", (double)(host_times.front()) / 1000.0);
+	printf("Median: %8.3f\n", (double)(host_times[SESSIONS / 2]) / 1000.0);
+	printf("99th:   %8.3f\n", (double)(host_times[(SESSIONS * 99) / 100]) / 1000.0);
+	printf("Max:    %8.3f\n", (double)(host_times.back()) / 1000.0);
+	
+	host_address->Release();
+	
+	for(auto i = instances.rbegin(); i != instances.rend(); ++i)
+	{
+		(*i)->Close(DPNCLOSE_IMMEDIATE);
+		(*i)->Release();
+	}
+	
+	CoUninitialize();
+	
+	return 0;
+}
+
+static int64_t now_us()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	
+	return ((li.QuadPart / pc_freq) * 1000000) + (((li.QuadPart % pc_freq) * 1000000) / pc_freq);
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	return DPN_OK;
+}
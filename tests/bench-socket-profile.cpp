@@ -0,0 +1,313 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for the DPLITE_SOCKET_PROFILE_* socket option sets.
+ *
+ * For each profile, hosts a session on loopback with one other peer and streams MESSAGES
+ * small guaranteed messages to it at a steady rate, which it echoes straight back. Prints
+ * the distribution of round trip times seen by the host for each profile.
+ *
+ * Streaming rather than strictly alternating messages leaves unacknowledged data in flight
+ * most of the time, which is when Nagle's algorithm holds back small writes.
+*/
+
+#include <winsock2.h>
+#include <algorithm>
+#include <dplay8.h>
+#include <dplite.h>
+#include <mutex>
+#include <objbase.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+
+#define MESSAGES         1000
+#define MESSAGE_SIZE     64
+#define SEND_INTERVAL_US 500
+#define PORT             42897
+
+static const GUID APP_GUID = { 0x5a0e8d31, 0x27c4, 0x4f19, { 0xb6, 0x7d, 0x0c, 0x83, 0x4a, 0x91, 0xe2, 0x5f } };
+
+static const struct {
+	DWORD profile;
+	const char *name;
+} PROFILES[] = {
+	{ DPLITE_SOCKET_PROFILE_DEFAULT,         "Default" },
+	{ DPLITE_SOCKET_PROFILE_LOW_LATENCY,     "Low latency" },
+	{ DPLITE_SOCKET_PROFILE_HIGH_THROUGHPUT, "High throughput" },
+	{ DPLITE_SOCKET_PROFILE_LAN,             "LAN" },
+};
+
+struct Session
+{
+	IDirectPlay8Peer *instance;
+	bool echo;
+	
+	std::mutex lock;
+	std::vector<int64_t> rtts;
+};
+
+static int64_t pc_freq;
+static int64_t now_us();
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+static IDirectPlay8Peer *make_peer(Session *session, DWORD profile);
+static IDirectPlay8Address *make_address(const wchar_t *hostname, DWORD port);
+
+int main()
+{
+	{
+		LARGE_INTEGER li;
+		QueryPerformanceFrequency(&li);
+		pc_freq = li.QuadPart;
+	}
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	printf("%d x %d byte guaranteed messages, one every %d us\n\n", MESSAGES, MESSAGE_SIZE, SEND_INTERVAL_US);
+	printf("Profile         | Mean (ms) | Median (ms) | 99th (ms) | Max (ms)\n");
+	printf("----------------+-----------+-------------+-----------+---------\n");
+	
+	for(size_t p = 0; p < (sizeof(PROFILES) / sizeof(*PROFILES)); ++p)
+	{
+		DWORD port = PORT + p;
+		
+		Session host, client;
+		host.echo   = false;
+		client.echo = true;
+		
+		host.instance   = make_peer(&host,   PROFILES[p].profile);
+		client.instance = make_peer(&client, PROFILES[p].profile);
+		
+		DPN_APPLICATION_DESC app_desc;
+		memset(&app_desc, 0, sizeof(app_desc));
+		
+		app_desc.dwSize = sizeof(app_desc);
+		app_desc.dwFlags = DPNSESSION_NODPNSVR;
+		app_desc.guidApplication = APP_GUID;
+		app_desc.pwszSessionName = (wchar_t*)(L"Socket profile benchmark");
+		
+		IDirectPlay8Address *host_address = make_address(NULL, port);
+		
+		res = host.instance->Host(&app_desc, &host_address, 1, NULL, NULL, NULL, 0);
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Host failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		host_address->Release();
+		
+		IDirectPlay8Address *connect_address = make_address(L"127.0.0.1", port);
+		
+		res = client.instance->Connect(
+			&app_desc,         /* pdnAppDesc */
+			connect_address,   /* pHostAddr */
+			NULL,              /* pDeviceInfo */
+			NULL,              /* pdnSecurity */
+			NULL,              /* pdnCredentials */
+			NULL,              /* pvUserConnectData */
+			0,                 /* dwUserConnectDataSize */
+			NULL,              /* pvPlayerContext */
+			NULL,              /* pvAsyncContext */
+			NULL,              /* phAsyncHandle */
+			DPNCONNECT_SYNC);  /* dwFlags */
+		
+		if(res != S_OK)
+		{
+			fprintf(stderr, "IDirectPlay8Peer::Connect failed with HRESULT %08x\n", (unsigned)(res));
+			return 1;
+		}
+		
+		connect_address->Release();
+		
+		unsigned char payload[MESSAGE_SIZE];
+		memset(payload, 0, sizeof(payload));
+		
+		DPN_BUFFER_DESC bd = { sizeof(payload), payload };
+		
+		int64_t next_send = now_us();
+		
+		for(int i = 0; i < MESSAGES; ++i)
+		{
+			while(now_us() < next_send) {}
+			next_send += SEND_INTERVAL_US;
+			
+			int64_t sent_at = now_us();
+			memcpy(payload, &sent_at, sizeof(sent_at));
+			
+			DPNHANDLE send_handle;
+			res = host.instance->SendTo(DPNID_ALL_PLAYERS_GROUP, &bd, 1, 0, NULL, &send_handle, DPNSEND_GUARANTEED | DPNSEND_NOLOOPBACK | DPNSEND_NOCOMPLETE);
+			
+			if(res != DPNSUCCESS_PENDING && res != S_OK)
+			{
+				fprintf(stderr, "IDirectPlay8Peer::SendTo failed with HRESULT %08x\n", (unsigned)(res));
+				return 1;
+			}
+		}
+		
+		/* Wait up to 10 seconds for the stragglers. */
+		for(int i = 0; i < 1000; ++i)
+		{
+			std::unique_lock<std::mutex> l(host.lock);
+			if(host.rtts.size() >= MESSAGES)
+			{
+				break;
+			}
+			
+			l.unlock();
+			Sleep(10);
+		}
+		
+		client.instance->Close(DPNCLOSE_IMMEDIATE);
+		host.instance->Close(DPNCLOSE_IMMEDIATE);
+		
+		std::vector<int64_t> rtts = host.rtts;
+		
+		client.instance->Release();
+		host.instance->Release();
+		
+		if(rtts.size() < MESSAGES)
+		{
+			fprintf(stderr, "Only %u of %d messages came back\n", (unsigned)(rtts.size()), MESSAGES);
+			return 1;
+		}
+		
+		std::sort(rtts.begin(), rtts.end());
+		
+		int64_t total = 0;
+		for(auto r = rtts.begin(); r != rtts.end(); ++r)
+		{
+			total += *r;
+		}
+		
+		printf("%-15s | %9.3f | %11.3f | %9.3f | %8.3f\n",
+			PROFILES[p].name,
+			((double)(total) / rtts.size()) / 1000.0,
+			(double)(rtts[rtts.size() / 2]) / 1000.0,
+			(double)(rtts[(rtts.size() * 99) / 100]) / 1000.0,
+			(double)(rtts.back()) / 1000.0);
+	}
+	
+	CoUninitialize();
+	
+	return 0;
+}
+
+static int64_t now_us()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	
+	return ((li.QuadPart / pc_freq) * 1000000) + (((li.QuadPart % pc_freq) * 1000000) / pc_freq);
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	Session *session = (Session*)(pvUserContext);
+	
+	if(dwMessageType == DPN_MSGID_RECEIVE)
+	{
+		DPNMSG_RECEIVE *dr = (DPNMSG_RECEIVE*)(pMessage);
+		
+		if(session->echo)
+		{
+			DPN_BUFFER_DESC bd = { dr->dwReceiveDataSize, dr->pReceiveData };
+			DPNHANDLE send_handle;
+			
+			session->instance->SendTo(dr->dpnidSender, &bd, 1, 0, NULL, &send_handle, DPNSEND_GUARANTEED | DPNSEND_NOCOMPLETE);
+		}
+		else if(dr->dwReceiveDataSize >= sizeof(int64_t))
+		{
+			int64_t sent_at;
+			memcpy(&sent_at, dr->pReceiveData, sizeof(sent_at));
+			
+			std::unique_lock<std::mutex> l(session->lock);
+			session->rtts.push_back(now_us() - sent_at);
+		}
+	}
+	
+	return DPN_OK;
+}
+
+static IDirectPlay8Peer *make_peer(Session *session, DWORD profile)
+{
+	IDirectPlay8Peer *instance;
+	
+	HRESULT res = CoCreateInstance(CLSID_DirectPlay8Peer, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Peer, (void**)(&instance));
+	if(res != S_OK)
+	{
+		fprintf(stderr, "Failed to construct DirectPlay8Peer instance (HRESULT %08x)\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	res = instance->Initialize(session, &callback, 0);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "IDirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	DPLITE_CAPS caps;
+	memset(&caps, 0, sizeof(caps));
+	
+	caps.dwSize = sizeof(caps);
+	
+	instance->GetCaps((DPN_CAPS*)(&caps), 0);
+	caps.dwSocketProfile = profile;
+	
+	res = instance->SetCaps((DPN_CAPS*)(&caps), 0);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "IDirectPlay8Peer::SetCaps failed with HRESULT %08x\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	return instance;
+}
+
+static IDirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	IDirectPlay8Address *address;
+	
+	HRESULT res = CoCreateInstance(CLSID_DirectPlay8Address, NULL, CLSCTX_INPROC_SERVER, IID_IDirectPlay8Address, (void**)(&address));
+	if(res != S_OK)
+	{
+		fprintf(stderr, "Failed to construct DirectPlay8Address instance (HRESULT %08x)\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	if(hostname != NULL)
+	{
+		address->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+	}
+	
+	address->AddComponent(DPNA_KEY_PORT, &port, sizeof(port), DPNA_DATATYPE_DWORD);
+	
+	return address;
+}
@@ -0,0 +1,204 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Benchmark for the DirectPlay8Peer work queue.
+ *
+ * Pushes ITEMS trivial work items from PRODUCERS threads and measures how many items per second
+ * are run by a HandleHandlingPool with 1..8 worker threads, using both the old scheme (std::queue
+ * under a mutex, one item per work_ready wakeup) and WorkQueue (lock-free, drained in batches).
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+#include <windows.h>
+
+#include "../src/EventObject.hpp"
+#include "../src/HandleHandlingPool.hpp"
+#include "../src/WorkQueue.hpp"
+
+#define ITEMS       1000000
+#define PRODUCERS   2
+#define MAX_WORKERS 8
+
+/* Must match DirectPlay8Peer.cpp */
+#define WORK_QUEUE_SIZE 1024
+#define WORK_BATCH_SIZE 32
+
+static int64_t pc_freq;
+static int64_t now_us();
+
+/* The scheme used by DirectPlay8Peer before WorkQueue was introduced. */
+struct LockedScheme
+{
+	std::mutex lock;
+	std::queue< std::function<void()> > work_queue;
+	EventObject work_ready;
+	
+	void queue_work(const std::function<void()> &work)
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		work_queue.push(work);
+		SetEvent(work_ready);
+	}
+	
+	void handle_work()
+	{
+		std::unique_lock<std::mutex> l(lock);
+		
+		if(!work_queue.empty())
+		{
+			std::function<void()> work = work_queue.front();
+			work_queue.pop();
+			
+			if(!work_queue.empty())
+			{
+				SetEvent(work_ready);
+			}
+			
+			l.unlock();
+			
+			work();
+		}
+	}
+};
+
+/* The scheme used by DirectPlay8Peer now. */
+struct LockFreeScheme
+{
+	WorkQueue work_queue;
+	std::atomic<bool> work_signalled;
+	EventObject work_ready;
+	
+	LockFreeScheme():
+		work_queue(WORK_QUEUE_SIZE), work_signalled(false) {}
+	
+	void queue_work(const std::function<void()> &work)
+	{
+		work_queue.push(work);
+		
+		if(!work_signalled.exchange(true))
+		{
+			SetEvent(work_ready);
+		}
+	}
+	
+	void handle_work()
+	{
+		work_signalled = false;
+		
+		std::function<void()> work;
+		
+		for(int i = 0; i < WORK_BATCH_SIZE; ++i)
+		{
+			if(!work_queue.pop(work))
+			{
+				return;
+			}
+			
+			work();
+		}
+		
+		if(!work_signalled.exchange(true))
+		{
+			SetEvent(work_ready);
+		}
+	}
+};
+
+template<typename T> static double run(size_t workers)
+{
+	T scheme;
+	
+	std::atomic<int> done(0);
+	EventObject all_done(TRUE, FALSE);
+	
+	HandleHandlingPool pool(workers, 1);
+	pool.add_handle(scheme.work_ready, [&scheme]() { scheme.handle_work(); });
+	
+	std::function<void()> item = [&done, &all_done]()
+	{
+		if(++done == ITEMS)
+		{
+			SetEvent(all_done);
+		}
+	};
+	
+	int64_t start = now_us();
+	
+	std::vector<std::thread> producers;
+	for(int p = 0; p < PRODUCERS; ++p)
+	{
+		producers.emplace_back([&scheme, &item]()
+		{
+			for(int i = 0; i < (ITEMS / PRODUCERS); ++i)
+			{
+				scheme.queue_work(item);
+			}
+		});
+	}
+	
+	for(auto p = producers.begin(); p != producers.end(); ++p)
+	{
+		p->join();
+	}
+	
+	WaitForSingleObject(all_done, INFINITE);
+	
+	int64_t elapsed = now_us() - start;
+	
+	return (double)(ITEMS) / ((double)(elapsed) / 1000000.0);
+}
+
+int main(int argc, char **argv)
+{
+	{
+		LARGE_INTEGER li;
+		QueryPerformanceFrequency(&li);
+		pc_freq = li.QuadPart;
+	}
+	
+	printf("%d items from %d producers\n\n", ITEMS, PRODUCERS);
+	printf("Workers | std::queue + mutex (items/s) | WorkQueue (items/s)\n");
+	printf("--------+------------------------------+--------------------\n");
+	
+	for(size_t workers = 1; workers <= MAX_WORKERS; ++workers)
+	{
+		double locked    = run<LockedScheme>(workers);
+		double lock_free = run<LockFreeScheme>(workers);
+		
+		printf("%7u | %28.0f | %19.0f\n", (unsigned)(workers), locked, lock_free);
+	}
+	
+	return 0;
+}
+
+static int64_t now_us()
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	
+	return ((li.QuadPart / pc_freq) * 1000000) + (((li.QuadPart % pc_freq) * 1000000) / pc_freq);
+}
@@ -0,0 +1,321 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Replays a wire capture through DirectPlay8Peer.
+ *
+ * Captures are recorded by setting the DPLITE_CAPTURE environment variable to a file name
+ * before the application creates its DirectPlay8Peer (see CaptureTransport). This tool
+ * sets up a session like the one which was captured and feeds the recorded inbound
+ * traffic back through the receive path, then reports how long the peer took to process
+ * it and how much CPU time was spent doing so.
+ *
+ * By default the traffic is released at the times it was recorded at, --max-speed feeds it
+ * all in at once to measure how quickly the receive path can chew through it.
+ *
+ * Only the first session in a capture is replayed.
+*/
+
+#include <winsock2.h>
+#include <atomic>
+#include <dplay8.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <windows.h>
+#include <mmsystem.h>
+
+#include "../src/DirectPlay8Address.hpp"
+#include "../src/DirectPlay8Peer.hpp"
+#include "../src/ReplayTransport.hpp"
+#include "../src/SendQueue.hpp"
+
+/* Give up if the peer stops consuming the capture for this long. */
+#define IDLE_TIMEOUT_MS 5000
+
+static std::atomic<unsigned long long> messages_received;
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage);
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port);
+static unsigned long long cpu_time_us();
+static bool replay(const char *path, bool max_speed);
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-m|--max-speed] [-n <iterations>] <capture file>\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	bool max_speed = false;
+	int iterations = 1;
+	const char *path = NULL;
+	
+	for(int i = 1; i < argc; ++i)
+	{
+		if(strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--max-speed") == 0)
+		{
+			max_speed = true;
+		}
+		else if(strcmp(argv[i], "-n") == 0 && (i + 1) < argc)
+		{
+			iterations = atoi(argv[++i]);
+		}
+		else if(path == NULL && argv[i][0] != '-')
+		{
+			path = argv[i];
+		}
+		else{
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	
+	if(path == NULL || iterations < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	WSADATA wd;
+	WSAStartup(MAKEWORD(2, 2), &wd);
+	
+	HRESULT res = CoInitialize(NULL);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "CoInitialize failed with HRESULT %08x\n", (unsigned)(res));
+		return 1;
+	}
+	
+	/* The default timer resolution would smear out the recorded timing. */
+	timeBeginPeriod(1);
+	
+	printf("Replaying %s %s\n\n", path, (max_speed ? "at maximum speed" : "at recorded speed"));
+	printf("Run | Records | Bytes      | Messages | Wall (ms) | CPU (ms) | MB/s\n");
+	printf("----+---------+------------+----------+-----------+----------+--------\n");
+	
+	bool ok = true;
+	
+	for(int i = 0; i < iterations && ok; ++i)
+	{
+		printf("%3d | ", i + 1);
+		fflush(stdout);
+		
+		ok = replay(path, max_speed);
+	}
+	
+	timeEndPeriod(1);
+	
+	CoUninitialize();
+	WSACleanup();
+	
+	return ok ? 0 : 1;
+}
+
+static bool replay(const char *path, bool max_speed)
+{
+	ReplayTransport *replay;
+	
+	try {
+		replay = new ReplayTransport(path);
+	}
+	catch(const std::runtime_error &e)
+	{
+		fprintf(stderr, "%s: %s\n", path, e.what());
+		return false;
+	}
+	
+	ReplayTransport::Session session;
+	if(!replay->get_session(&session))
+	{
+		fprintf(stderr, "%s: No session recorded\n", path);
+		
+		delete replay;
+		return false;
+	}
+	
+	DirectPlay8Peer *peer = new DirectPlay8Peer(NULL, (DirectPlay8Peer::Role)(session.role), replay);
+	
+	HRESULT res = peer->Initialize(NULL, &callback, 0);
+	if(res != S_OK)
+	{
+		fprintf(stderr, "DirectPlay8Peer::Initialize failed with HRESULT %08x\n", (unsigned)(res));
+		exit(1);
+	}
+	
+	DPN_APPLICATION_DESC app_desc;
+	memset(&app_desc, 0, sizeof(app_desc));
+	
+	app_desc.dwSize          = sizeof(app_desc);
+	app_desc.dwFlags         = session.flags;
+	app_desc.guidApplication = session.application;
+	app_desc.guidInstance    = session.instance;
+	app_desc.dwMaxPlayers    = session.max_players;
+	app_desc.pwszSessionName = (wchar_t*)(session.session_name.c_str());
+	app_desc.pwszPassword    = (wchar_t*)(session.password.c_str());
+	
+	messages_received = 0;
+	
+	if(max_speed)
+	{
+		replay->release_all();
+	}
+	
+	unsigned long long start_wall = SendQueue::now();
+	unsigned long long start_cpu  = cpu_time_us();
+	
+	if(session.host)
+	{
+		DirectPlay8Address *host_address = make_address(NULL, session.port);
+		IDirectPlay8Address *host_addresses[] = { host_address };
+		
+		res = peer->Host(&app_desc, host_addresses, 1, NULL, NULL, NULL, 0);
+		
+		host_address->Release();
+		
+		if(res != S_OK)
+		{
+			fprintf(stderr, "DirectPlay8Peer::Host failed with HRESULT %08x\n", (unsigned)(res));
+			exit(1);
+		}
+	}
+	else{
+		DirectPlay8Address *connect_address = make_address(L"127.0.0.1", session.port);
+		
+		DPNHANDLE connect_handle;
+		res = peer->Connect(
+			&app_desc,                                        /* pdnAppDesc */
+			connect_address,                                  /* pHostAddr */
+			NULL,                                             /* pDeviceInfo */
+			NULL,                                             /* pdnSecurity */
+			NULL,                                             /* pdnCredentials */
+			session.connect_data.data(),                      /* pvUserConnectData */
+			session.connect_data.size(),                      /* dwUserConnectDataSize */
+			NULL,                                             /* pvPlayerContext */
+			NULL,                                             /* pvAsyncContext */
+			&connect_handle,                                  /* phAsyncHandle */
+			0);                                               /* dwFlags */
+		
+		connect_address->Release();
+		
+		if(res != DPNSUCCESS_PENDING)
+		{
+			fprintf(stderr, "DirectPlay8Peer::Connect failed with HRESULT %08x\n", (unsigned)(res));
+			exit(1);
+		}
+	}
+	
+	/* Feed the capture in and wait for the peer to finish reading it, or to stop making
+	 * progress if it has wandered off from what happened in the capture.
+	*/
+	
+	size_t last_unread = 0;
+	unsigned long long last_progress = SendQueue::now();
+	
+	while(!replay->finished())
+	{
+		if(!max_speed)
+		{
+			replay->release(SendQueue::now() - start_wall);
+		}
+		
+		size_t unread = replay->unread();
+		unsigned long long next;
+		
+		if(unread != last_unread || (!max_speed && replay->next_release(&next)))
+		{
+			last_unread   = unread;
+			last_progress = SendQueue::now();
+		}
+		else if((SendQueue::now() - last_progress) >= (IDLE_TIMEOUT_MS * 1000ULL))
+		{
+			break;
+		}
+		
+		Sleep(1);
+	}
+	
+	unsigned long long wall_us = SendQueue::now() - start_wall;
+	unsigned long long cpu_us  = cpu_time_us() - start_cpu;
+	
+	bool finished = replay->finished();
+	size_t unread = replay->unread();
+	
+	peer->Close(DPNCLOSE_IMMEDIATE);
+	peer->Release();
+	
+	size_t records = replay->inbound_records();
+	unsigned long long bytes = replay->total_inbound_bytes();
+	
+	delete replay;
+	
+	printf("%7u | %10llu | %8llu | %9.1f | %8.1f | %6.1f\n",
+		(unsigned)(records),
+		bytes,
+		(unsigned long long)(messages_received),
+		(double)(wall_us) / 1000.0,
+		(double)(cpu_us) / 1000.0,
+		((double)(bytes) / (1024.0 * 1024.0)) / ((double)(wall_us) / 1000000.0));
+	
+	if(!finished)
+	{
+		fprintf(stderr, "Replay diverged from the capture, %u records were never read\n", (unsigned)(unread));
+		return false;
+	}
+	
+	return true;
+}
+
+static HRESULT CALLBACK callback(PVOID pvUserContext, DWORD dwMessageType, PVOID pMessage)
+{
+	if(dwMessageType == DPN_MSGID_RECEIVE)
+	{
+		++messages_received;
+	}
+	
+	return DPN_OK;
+}
+
+static DirectPlay8Address *make_address(const wchar_t *hostname, DWORD port)
+{
+	DirectPlay8Address *address = new DirectPlay8Address(NULL);
+	
+	address->SetSP(&CLSID_DP8SP_TCPIP);
+	
+	if(hostname != NULL)
+	{
+		address->AddComponent(DPNA_KEY_HOSTNAME, hostname, ((wcslen(hostname) + 1) * sizeof(wchar_t)), DPNA_DATATYPE_STRING);
+	}
+	
+	address->AddComponent(DPNA_KEY_PORT, &port, sizeof(port), DPNA_DATATYPE_DWORD);
+	
+	return address;
+}
+
+/* User and kernel time used by the process so far, in microseconds. */
+static unsigned long long cpu_time_us()
+{
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	
+	unsigned long long k = ((unsigned long long)(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+	unsigned long long u = ((unsigned long long)(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+	
+	return (k + u) / 10;
+}
@@ -0,0 +1,191 @@
+/* DirectPlay Lite
+ * Copyright (C) 2018 Daniel Collins <solemnwarning@solemnwarning.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Converts a binary log written with DPLITE_LOG set back into text, in the same format
+ * as logs written with DPLITE_LOG_TEXT set.
+ *
+ * Usage: dplite-logdecode <log file> [<output file>]
+ *
+ * Doesn't need windows.h, so it can also be built anywhere else with a C++11 compiler:
+ *
+ *   g++ -std=c++11 -O2 -o dplite-logdecode tools/dplite-logdecode.cpp src/LogFormat.cpp
+*/
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/LogFormat.hpp"
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s <log file> [<output file>]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	if(argc < 2 || argc > 3)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	
+	FILE *in = fopen(argv[1], "rb");
+	if(in == NULL)
+	{
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return 1;
+	}
+	
+	FILE *out = stdout;
+	
+	if(argc == 3)
+	{
+		out = fopen(argv[2], "w");
+		if(out == NULL)
+		{
+			fprintf(stderr, "Unable to open %s\n", argv[2]);
+			
+			fclose(in);
+			return 1;
+		}
+	}
+	
+	std::map<uint32_t, std::string> formats;
+	uint32_t start_ticks = 0;
+	bool have_header = false;
+	
+	std::vector<unsigned char> data;
+	int ret = 0;
+	
+	for(;;)
+	{
+		/* A LogRecord, or a LogFileHeader where another process started appending to
+		 * the log. Records never start with the magic value.
+		*/
+		
+		LogRecord record;
+		if(fread(&record, 1, sizeof(record), in) < sizeof(record))
+		{
+			break;
+		}
+		
+		if(memcmp(&record, LOG_MAGIC, 8) == 0)
+		{
+			LogFileHeader header;
+			
+			/* The header is smaller than a record, back up over the overrun. */
+			if(fseek(in, (long)(sizeof(header)) - (long)(sizeof(record)), SEEK_CUR) != 0)
+			{
+				fprintf(stderr, "Seek error in %s\n", argv[1]);
+				ret = 1;
+				break;
+			}
+			
+			memcpy(&header, &record, sizeof(header));
+			
+			if(header.version != LOG_VERSION)
+			{
+				fprintf(stderr, "Unsupported log version %u in %s\n", (unsigned)(header.version), argv[1]);
+				ret = 1;
+				break;
+			}
+			
+			start_ticks = header.start_ticks;
+			have_header = true;
+			
+			formats.clear();
+			
+			continue;
+		}
+		
+		if(!have_header)
+		{
+			fprintf(stderr, "%s is not a DirectPlay Lite log\n", argv[1]);
+			ret = 1;
+			break;
+		}
+		
+		data.resize(record.length);
+		
+		if(record.length > 0 && fread(data.data(), 1, record.length, in) < record.length)
+		{
+			/* Truncated, probably still being written. */
+			break;
+		}
+		
+		std::string text;
+		
+		switch(record.type)
+		{
+			case LR_FORMAT:
+				formats[record.format] = std::string(data.begin(), data.end());
+				continue;
+				
+			case LR_MESSAGE:
+			{
+				auto f = formats.find(record.format);
+				if(f != formats.end())
+				{
+					text = log_decode_args(f->second.c_str(), data.data(), data.size());
+				}
+				else{
+					text = "(message with unknown format " + std::to_string(record.format) + ")";
+				}
+				
+				break;
+			}
+			
+			case LR_TEXT:
+				text = std::string(data.begin(), data.end());
+				break;
+				
+			case LR_DROPPED:
+			{
+				uint32_t dropped = 0;
+				if(data.size() >= sizeof(dropped))
+				{
+					memcpy(&dropped, data.data(), sizeof(dropped));
+				}
+				
+				text = "(" + std::to_string(dropped) + " messages dropped, log buffer full)";
+				
+				break;
+			}
+			
+			default:
+				/* Unknown record type, skip it. */
+				continue;
+		}
+		
+		fprintf(out, "[thread=%u time=%u] %s\n",
+			(unsigned)(record.thread), (unsigned)(start_ticks + (record.time / 1000)), text.c_str());
+	}
+	
+	if(out != stdout)
+	{
+		fclose(out);
+	}
+	
+	fclose(in);
+	
+	return ret;
+}